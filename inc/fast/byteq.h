@@ -0,0 +1,373 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * byteq.h - Lock-Free, bounded byte queues of variable length
+ *           messages (SPSC and MPSC).
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Introduction
+ * ============
+ *   A ring of bytes carrying messages of any length in place: a
+ *   producer reserves N contiguous bytes, writes the message into
+ *   the ring and commits it; the consumer reads it from the ring
+ *   and releases it. No allocation or copy per message.
+ *
+ *   Every message has an 8 byte header (its length) and is padded
+ *   to a multiple of 8 bytes. A message never wraps around the end
+ *   of the ring: if it doesn't fit in the bytes left before the end,
+ *   those are covered by a padding record (that the consumer skips)
+ *   and the message starts at the beginning of the ring.
+ *
+ *   Reserve/commit and read/release are split so that they can be
+ *   batched: the position of a reserve (read) is private to the
+ *   producer (consumer) until a commit (release) publishes all the
+ *   messages reserved (read) since the last one - one store-release
+ *   for a batch of messages.
+ *
+ *   Use:
+ *       byteq q;
+ *       byteq_init(&q, 1 << 20);
+ *
+ *     Single producer:
+ *       o p = byteq_reserve(&q, n)
+ *            Reserve 'n' bytes; NULL if the queue is full or 'n'
+ *            is more than BYTEQ_MAXMSG(&q).
+ *       o byteq_commit(&q)
+ *            Publish all the messages reserved so far.
+ *
+ *     Multiple producers:
+ *       o p = byteq_mp_reserve(&q, n, &r)
+ *       o byteq_mp_reserve_v(&q, n[], p[], k, &r)
+ *            Reserve one message, or 'k' messages in one go.
+ *       o byteq_mp_commit(&q, &r)
+ *            Publish the messages of reservation 'r'.
+ *
+ *     Single consumer:
+ *       o p = byteq_read(&q, &n)
+ *            Next message and its length; NULL if empty.
+ *       o byteq_release(&q)
+ *            Give back the space of all the messages read so far.
+ *            Pointers from byteq_read() are invalid after this.
+ *
+ *   A queue is used with either the single or the multi-producer
+ *   calls, not both.
+ *
+ *   The MPSC producers claim space with a CAS on the reserve
+ *   position and commit in the order they reserved: a commit waits
+ *   for the commits of the reservations before it (as in DPDK's
+ *   rte_ring). The consumer sees only committed messages, so it
+ *   never reads a header that isn't written yet; the price is that
+ *   a producer descheduled between reserve and commit holds up the
+ *   commits behind it (they spin BYTEQ_SPIN times, then yield).
+ *
+ *  The positions are 64-bit byte counts that never wrap; the ring
+ *  offset is the position modulo the (power of 2) size.
+ */
+
+#ifndef __FAST_BYTEQ_2716394_H__
+#define __FAST_BYTEQ_2716394_H__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "utils/utils.h"
+
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE      64
+#endif
+
+#ifndef __CACHELINE_ALIGNED
+#define __CACHELINE_ALIGNED __attribute__((aligned(CACHELINE_SIZE)))
+#endif
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __byteq_pause()     __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define __byteq_pause()     __asm__ __volatile__("yield")
+#else
+#define __byteq_pause()     do { } while (0)
+#endif
+
+
+/*
+ * Spins of an MPSC commit waiting for the commits before it, before
+ * it yields the CPU.
+ */
+#ifndef BYTEQ_SPIN
+#define BYTEQ_SPIN          1024
+#endif
+
+#define BYTEQ_HDR           8
+#define BYTEQ_PAD           (1U << 31)      /* padding record */
+
+#define __byteq_align(n)    (((n) + 7) & ~((uint64_t)7))
+
+/* Largest message in queue 'q' */
+#define BYTEQ_MAXMSG(q)     ((q)->size / 2 - BYTEQ_HDR)
+
+
+struct byteq
+{
+    /* Producers */
+    atomic_uint_fast64_t wr   __CACHELINE_ALIGNED; /* committed */
+    atomic_uint_fast64_t head;      /* MPSC: reserved */
+    uint64_t             wpos;      /* SPSC: reserved */
+    uint64_t             rcache;    /* SPSC: last rd seen */
+
+    /* Consumer */
+    atomic_uint_fast64_t rd   __CACHELINE_ALIGNED; /* released */
+    uint64_t             rpos;      /* read */
+    uint64_t             wcache;    /* last wr seen */
+
+    uint64_t             size __CACHELINE_ALIGNED;
+    uint64_t             mask;
+    uint8_t *            buf;
+};
+typedef struct byteq byteq;
+
+
+/*
+ * An MPSC reservation.
+ */
+struct byteq_resv
+{
+    uint64_t start;
+    uint64_t end;
+};
+typedef struct byteq_resv byteq_resv;
+
+
+/*
+ * Initialize 'q' for 'size' bytes (rounded up to a power of 2).
+ * Returns 0, -EINVAL if size is less than 64, -ENOMEM.
+ */
+static inline int
+byteq_init(byteq * q, size_t size)
+{
+    void *p;
+
+    if (size < 64) return -EINVAL;
+
+    size = next_pow2(size);
+    if (posix_memalign(&p, CACHELINE_SIZE, size) != 0) return -ENOMEM;
+
+    atomic_init(&q->wr,   0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->rd,   0);
+    q->wpos   = q->rcache = 0;
+    q->rpos   = q->wcache = 0;
+    q->size   = size;
+    q->mask   = size - 1;
+    q->buf    = p;
+    return 0;
+}
+
+
+static inline void
+byteq_fini(byteq * q)
+{
+    DEL(q->buf);
+    q->size = 0;
+}
+
+
+/*
+ * Position after the 'k' messages of lengths 'n' laid out from
+ * 'pos'; 0 if one is too big.
+ */
+static inline uint64_t
+__byteq_layout(byteq * q, uint64_t pos, const size_t * n, int k)
+{
+    int i;
+
+    for (i = 0; i < k; i++) {
+        uint64_t need = BYTEQ_HDR + __byteq_align(n[i]),
+                 off  = pos & q->mask;
+
+        if (n[i] > BYTEQ_MAXMSG(q)) return 0;
+        if (off + need > q->size) pos += q->size - off;
+        pos += need;
+    }
+    return pos;
+}
+
+
+/*
+ * Write the headers of the messages laid out from 'pos' and return
+ * a pointer to the message at 'pos'.
+ */
+static inline void *
+__byteq_put(byteq * q, uint64_t * p_pos, size_t n)
+{
+    uint64_t need = BYTEQ_HDR + __byteq_align(n),
+             pos  = *p_pos,
+             off  = pos & q->mask;
+    uint32_t *h;
+
+    if (off + need > q->size) {
+        h  = (uint32_t *)(q->buf + off);
+        *h = BYTEQ_PAD;
+        pos += q->size - off;
+        off  = 0;
+    }
+
+    h  = (uint32_t *)(q->buf + off);
+    *h = (uint32_t)n;
+    *p_pos = pos + need;
+    return q->buf + off + BYTEQ_HDR;
+}
+
+
+
+/*
+ * Single producer
+ */
+
+static inline void *
+byteq_reserve(byteq * q, size_t n)
+{
+    uint64_t end = __byteq_layout(q, q->wpos, &n, 1);
+
+    if (!end) return 0;
+    if ((end - q->rcache) > q->size) {
+        q->rcache = atomic_load_explicit(&q->rd, memory_order_acquire);
+        if ((end - q->rcache) > q->size) return 0;
+    }
+
+    return __byteq_put(q, &q->wpos, n);
+}
+
+
+static inline void
+byteq_commit(byteq * q)
+{
+    atomic_store_explicit(&q->wr, q->wpos, memory_order_release);
+}
+
+
+
+/*
+ * Multiple producers
+ */
+
+/*
+ * Reserve 'k' messages of lengths 'n' in one go; pointers to them
+ * are put in 'p'. Returns 0 on success, -ENOSPC if the queue is
+ * full, -E2BIG if a message is more than BYTEQ_MAXMSG().
+ */
+static inline int
+byteq_mp_reserve_v(byteq * q, const size_t * n, void ** p, int k, byteq_resv * r)
+{
+    uint64_t start = atomic_load_explicit(&q->head, memory_order_relaxed),
+             end;
+    int i;
+
+    do {
+        if (!(end = __byteq_layout(q, start, n, k))) return -E2BIG;
+        if ((end - atomic_load_explicit(&q->rd, memory_order_acquire)) > q->size)
+            return -ENOSPC;
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &start, end,
+                    memory_order_relaxed, memory_order_relaxed));
+
+    r->start = start;
+    r->end   = end;
+    for (i = 0; i < k; i++) p[i] = __byteq_put(q, &start, n[i]);
+    return 0;
+}
+
+
+static inline void *
+byteq_mp_reserve(byteq * q, size_t n, byteq_resv * r)
+{
+    void *p;
+
+    return byteq_mp_reserve_v(q, &n, &p, 1, r) == 0 ? p : 0;
+}
+
+
+static inline void
+byteq_mp_commit(byteq * q, const byteq_resv * r)
+{
+    unsigned int n = 0;
+
+    // Acquire: our release then carries the earlier commits too
+    while (atomic_load_explicit(&q->wr, memory_order_acquire) != r->start) {
+        // The producer we wait for may not be running
+        if (++n < BYTEQ_SPIN) __byteq_pause();
+        else                  sched_yield();
+    }
+
+    atomic_store_explicit(&q->wr, r->end, memory_order_release);
+}
+
+
+
+/*
+ * Single consumer
+ */
+
+static inline void *
+byteq_read(byteq * q, size_t * p_n)
+{
+    for (;;) {
+        uint64_t off;
+        uint32_t h;
+
+        if (q->rpos == q->wcache) {
+            q->wcache = atomic_load_explicit(&q->wr, memory_order_acquire);
+            if (q->rpos == q->wcache) return 0;
+        }
+
+        off = q->rpos & q->mask;
+        h   = *(uint32_t *)(q->buf + off);
+        if (h == BYTEQ_PAD) {
+            q->rpos += q->size - off;
+            continue;
+        }
+
+        q->rpos += BYTEQ_HDR + __byteq_align(h);
+        *p_n = h;
+        return q->buf + off + BYTEQ_HDR;
+    }
+}
+
+
+static inline void
+byteq_release(byteq * q)
+{
+    atomic_store_explicit(&q->rd, q->rpos, memory_order_release);
+}
+
+
+/* Bytes committed and not yet released (a guess, if concurrent) */
+static inline uint64_t
+byteq_used(byteq * q)
+{
+    return atomic_load_explicit(&q->wr, memory_order_acquire) -
+           atomic_load_explicit(&q->rd, memory_order_acquire);
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! __FAST_BYTEQ_2716394_H__ */
+
+/* EOF */
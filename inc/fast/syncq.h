@@ -29,6 +29,7 @@ extern "C" {
 #include <semaphore.h>
 #include <pthread.h>
 #include "fast/queue.h"
+#include "utils/metrics.h"
 
 
 
@@ -41,6 +42,9 @@ struct __syncobj
     pthread_mutex_t lock;
     sem_t notempty;
     sem_t notfull;
+
+    /* Optional instrumentation; see SYNCQ_METRICS() */
+    metrics_queue * m;
 };
 typedef struct __syncobj __syncobj;
 
@@ -64,6 +68,7 @@ __syncobj_init(__syncobj* s, size_t n)
 {
     int r;
 
+    s->m = 0;
     if ((r = pthread_mutex_init(&s->lock, 0)) != 0)  return -errno;
     if ((r = sem_init(&s->notempty, 0, 0)) != 0)     return -errno;
     if ((r = sem_init(&s->notfull,  0, n)) != 0)     return -errno;
@@ -72,6 +77,18 @@ __syncobj_init(__syncobj* s, size_t n)
 }
 
 
+// Internal function: wait on 'sem', counting the times we block
+static inline void
+__syncq_wait(sem_t* sem, metrics_counter* blocked)
+{
+    if (blocked) {
+        if (sem_trywait(sem) == 0) return;
+        metrics_counter_inc(blocked);
+    }
+    sem_wait(sem);
+}
+
+
 /**
  * Initialize a SyncQ 'q0'.
  */
@@ -101,11 +118,12 @@ __syncobj_init(__syncobj* s, size_t n)
 #define SYNCQ_ENQ(q0, obj)      do { \
                                     typeof(q0)  q = q0; \
                                     __syncobj*  s = &q->s; \
-                                    sem_wait(&s->notfull); \
+                                    __syncq_wait(&s->notfull, s->m ? s->m->enq_blocked : 0); \
                                     pthread_mutex_lock(&s->lock); \
                                     FQ_ENQ(&q->q, obj); \
                                     pthread_mutex_unlock(&s->lock); \
                                     sem_post(&s->notempty); \
+                                    if (s->m) metrics_counter_inc(s->m->enq); \
                                 } while (0)
 
 
@@ -116,13 +134,24 @@ __syncobj_init(__syncobj* s, size_t n)
 #define SYNCQ_DEQ(q0, obj)      do { \
                                     typeof(q0)  q = q0; \
                                     __syncobj*  s = &q->s; \
-                                    sem_wait(&s->notempty); \
+                                    __syncq_wait(&s->notempty, s->m ? s->m->deq_blocked : 0); \
                                     pthread_mutex_lock(&s->lock); \
                                     FQ_DEQ(&q->q, obj);    \
                                     pthread_mutex_unlock(&s->lock); \
                                     sem_post(&s->notfull); \
+                                    if (s->m) metrics_counter_inc(s->m->deq); \
                                 } while (0)
-                                
+
+
+/**
+ * Count enqueues, dequeues and blocked waits of queue 'q0' in 'mq'
+ * (a metrics_queue* set up with metrics_queue_init()); NULL turns
+ * the counting off.
+ */
+#define SYNCQ_METRICS(q0, mq)   do { \
+                                    (q0)->s.m = (mq); \
+                                } while (0)
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,190 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * aioq.h - Asynchronous file I/O queue.
+ *
+ * Reads, writes and fsyncs are prepared into a submission queue
+ * and handed to the kernel in batches; completions are reaped in
+ * batches and a callback is run for each.
+ *
+ * On Linux the queue is an io_uring: one syscall submits a whole
+ * batch, registered files and buffers avoid per-I/O fd lookups and
+ * page pinning, and O_DIRECT I/O is truly asynchronous. Elsewhere
+ * (or on kernels without io_uring) a pool of threads does the I/O
+ * with pread(2)/pwrite(2).
+ *
+ * Either way, completion callbacks run on the thread that calls
+ * aioq_reap(). aioq_fd() returns an fd that becomes readable when
+ * completions are pending, so an epoll/kqueue event loop can call
+ * aioq_reap() when it fires; a callback that needs more CPU can
+ * hand the request to a job_manager.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___AIOQ_H_4407716_1475261129__
+#define ___AIOQ_H_4407716_1475261129__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/*
+ * Operations
+ */
+#define AIOQ_READ       1
+#define AIOQ_WRITE      2
+#define AIOQ_FSYNC      3
+
+/*
+ * Request flags
+ */
+#define AIOQ_FIXED_FILE 0x01    /* 'fd' is an index into registered files */
+#define AIOQ_FIXED_BUF  0x02    /* 'buf' lies in registered buffer 'buf_index' */
+
+/*
+ * Flags for aioq_init()
+ */
+#define AIOQ_THREADS    0x01    /* always use the thread pool */
+
+
+/*
+ * One I/O request. It is owned by the queue from aioq_prep() until
+ * its callback returns; the callback may re-use or free it.
+ */
+struct aioq_req;
+typedef struct aioq_req aioq_req;
+
+typedef void (*aioq_cb)(void * ctx, aioq_req * r);
+
+struct aioq_req
+{
+    int         op;         /* AIOQ_READ, AIOQ_WRITE or AIOQ_FSYNC */
+    int         fd;
+    unsigned    flags;      /* AIOQ_FIXED_xxx */
+    int         buf_index;  /* with AIOQ_FIXED_BUF */
+
+    void *      buf;
+    size_t      len;
+    uint64_t    off;
+
+    aioq_cb     cb;
+    void *      ctx;
+
+    /* bytes transferred or -errno; valid in the callback */
+    ssize_t     res;
+
+    /* Private to the queue */
+    struct iovec iov;
+    aioq_req *  next;
+};
+
+
+/*
+ * Opaque queue
+ */
+struct aioq;
+typedef struct aioq aioq;
+
+
+/*
+ * Make a new queue that can have 'depth' requests in flight. The
+ * thread pool fallback uses 'nthreads' threads (0 => 2 per CPU).
+ *
+ * Returns 0 and sets '*pq' on success, -errno on failure.
+ */
+extern int aioq_init(aioq ** pq, unsigned depth, unsigned flags, int nthreads);
+
+
+/*
+ * Wait for all requests in flight, then destroy the queue.
+ * Callbacks of requests still in flight are run; requests that
+ * could not be submitted complete with -ECANCELED.
+ */
+extern void aioq_destroy(aioq * q);
+
+
+/*
+ * Name of the backend in use: "io_uring" or "threads".
+ */
+extern const char * aioq_backend(aioq * q);
+
+
+/*
+ * Register 'n' files; requests with AIOQ_FIXED_FILE use an index
+ * into 'fds' as their 'fd'. Can be called once per queue.
+ */
+extern int aioq_register_files(aioq * q, const int * fds, unsigned n);
+
+
+/*
+ * Register 'n' buffers; requests with AIOQ_FIXED_BUF must lie
+ * within buffer 'buf_index'. Can be called once per queue.
+ */
+extern int aioq_register_buffers(aioq * q, const struct iovec * iov, unsigned n);
+
+
+/*
+ * Queue a request without submitting it.
+ *
+ * Returns 0 on success or -EAGAIN if 'depth' requests are already
+ * queued or in flight; reap some and try again.
+ */
+extern int aioq_prep(aioq * q, aioq_req * r);
+
+
+/*
+ * Submit all the requests queued by aioq_prep() in one go.
+ *
+ * Returns the number submitted or -errno.
+ */
+extern int aioq_submit(aioq * q);
+
+
+/*
+ * Run the callbacks of completed requests; wait until at least
+ * 'min' have completed (0 => don't wait).
+ *
+ * Returns the number of callbacks run or -errno.
+ */
+extern int aioq_reap(aioq * q, unsigned min);
+
+
+/*
+ * Number of requests queued or in flight.
+ */
+extern unsigned aioq_pending(aioq * q);
+
+
+/*
+ * An fd that is readable when completions are waiting to be
+ * reaped; for use with poll(2)/epoll(7).
+ */
+extern int aioq_fd(aioq * q);
+
+
+/*
+ * Allocate 'n' bytes suitably aligned for O_DIRECT I/O; free with
+ * free(3).
+ */
+extern void * aioq_buf_alloc(size_t n);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___AIOQ_H_4407716_1475261129__ */
+
+/* EOF */
@@ -0,0 +1,149 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * blkwriter.h - Parallel bulk block writer.
+ *
+ * Writes a large range of a file or block device from several
+ * threads. Each thread owns a contiguous slice of the range and a
+ * small pool of aligned buffers; a caller supplied fill function
+ * produces the data for each block on the writing thread and the
+ * thread keeps 'depth' blocks in flight - through io_uring where
+ * available, else with one pwritev(2) per 'depth' blocks.
+ *
+ * Open the target with O_DIRECT to bypass the page cache: there is
+ * no writeback to stall on and no dirty page build up. All buffers
+ * and offsets are aligned for it; a tail of the range that isn't a
+ * multiple of the alignment is written last without O_DIRECT, via
+ * the file opened again through /proc/self/fd (the flags of 'fd'
+ * are left alone).
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___BLKWRITER_H_2093311_1475613470__
+#define ___BLKWRITER_H_2093311_1475613470__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/*
+ * fsync policy
+ */
+#define BLKW_FSYNC_END      0   /* one fsync after all threads finish */
+#define BLKW_FSYNC_NONE     1   /* leave it to the caller */
+#define BLKW_FSYNC_EVERY    2   /* each thread fdatasync's every 'sync_bytes' */
+
+/*
+ * Flags
+ */
+#define BLKW_PWRITEV        0x01    /* don't use io_uring */
+
+
+/*
+ * Alignment of buffers, offsets and sizes for O_DIRECT
+ */
+#define BLKW_ALIGN          4096
+
+
+struct blkwriter_opt
+{
+    int         nthreads;   /* 0 => one per CPU */
+    unsigned    depth;      /* blocks in flight per thread; 0 => 4 */
+    size_t      blksize;    /* bytes per write; 0 => 1MB. Multiple of BLKW_ALIGN */
+    int         fsync;      /* BLKW_FSYNC_xxx */
+    uint64_t    sync_bytes; /* with BLKW_FSYNC_EVERY */
+    unsigned    flags;      /* BLKW_xxx */
+};
+typedef struct blkwriter_opt blkwriter_opt;
+
+
+struct blkwriter_stats
+{
+    uint64_t    total;      /* bytes to write */
+    uint64_t    done;       /* bytes written so far */
+    uint64_t    writes;     /* write calls or io_uring writes */
+    uint64_t    fsyncs;
+    uint64_t    usecs;      /* since start */
+    int         running;    /* threads still running */
+};
+typedef struct blkwriter_stats blkwriter_stats;
+
+
+/*
+ * Fill 'n' bytes at 'buf' with the data for file offset 'off'.
+ * Called concurrently from all the writer threads ('thread' is
+ * 0 .. nthreads-1). Return 0 or -errno to stop the writers.
+ */
+typedef int (*blkwriter_fill)(void * ctx, int thread, uint8_t * buf,
+                              size_t n, uint64_t off);
+
+
+struct blkwriter;
+typedef struct blkwriter blkwriter;
+
+
+/*
+ * Start writing 'size' bytes at offset 'off' of 'fd'. 'off' must
+ * be a multiple of BLKW_ALIGN if 'fd' was opened with O_DIRECT.
+ * 'opt' may be NULL for the defaults.
+ *
+ * Returns 0 and sets '*pw' on success, -errno on failure.
+ */
+extern int blkwriter_start(blkwriter ** pw, int fd, uint64_t off, uint64_t size,
+                           const blkwriter_opt * opt, blkwriter_fill fill, void * ctx);
+
+
+/*
+ * Wait for the writers to finish, write the unaligned tail and
+ * fsync as per the policy.
+ *
+ * Returns 0 or the first error seen (-errno).
+ */
+extern int blkwriter_wait(blkwriter * w);
+
+
+/*
+ * Free a writer; waits for it first if necessary.
+ */
+extern void blkwriter_destroy(blkwriter * w);
+
+
+/*
+ * Totals so far; safe to call while the writers run.
+ */
+extern void blkwriter_get_stats(blkwriter * w, blkwriter_stats * st);
+
+
+/*
+ * Bytes written so far and bytes assigned to 'thread'.
+ */
+extern void blkwriter_progress(blkwriter * w, int thread, uint64_t * done, uint64_t * total);
+
+
+extern int blkwriter_nthreads(blkwriter * w);
+
+
+/*
+ * "io_uring" or "pwritev"
+ */
+extern const char * blkwriter_backend(blkwriter * w);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___BLKWRITER_H_2093311_1475613470__ */
+
+/* EOF */
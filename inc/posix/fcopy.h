@@ -0,0 +1,128 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fcopy.h - Copy files and file ranges in the kernel.
+ *
+ * Copies use the fastest path the kernel and file systems offer
+ * and fall back one step at a time:
+ *
+ *   1. copy_file_range(2): in-kernel copy; server side copy on NFS
+ *      and a reflink on btrfs/XFS.
+ *   2. FICLONE/FICLONERANGE: reflink on file systems that share
+ *      extents.
+ *   3. sendfile(2), then splice(2) through a pipe (the latter also
+ *      when the destination is a pipe or socket).
+ *   4. read(2)/write(2) through a large buffer.
+ *
+ * None but the last move the data through user space.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___FCOPY_H_1840323_1475871155__
+#define ___FCOPY_H_1840323_1475871155__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/*
+ * Copy methods; in the order they are tried.
+ */
+#define FCOPY_CFR           1   /* copy_file_range(2) */
+#define FCOPY_CLONE         2   /* FICLONE/FICLONERANGE */
+#define FCOPY_SENDFILE      3
+#define FCOPY_SPLICE        4
+#define FCOPY_RW            5   /* read(2)/write(2) */
+
+/*
+ * Flags: skip a method
+ */
+#define FCOPY_NO_CFR        0x01
+#define FCOPY_NO_CLONE      0x02
+#define FCOPY_NO_SENDFILE   0x04
+#define FCOPY_NO_SPLICE     0x08
+#define FCOPY_RW_ONLY       0x0f
+
+/*
+ * fcopy_file() only: fsync the destination before returning
+ */
+#define FCOPY_FSYNC         0x100
+
+
+/*
+ * Copy until end of the source
+ */
+#define FCOPY_EOF           (~(uint64_t)0)
+
+
+/*
+ * Progress callback; called after every chunk with the bytes done so
+ * far. 'total' is FCOPY_EOF if unknown. Return < 0 to abort the copy
+ * with that error.
+ */
+typedef int (*fcopy_progress)(void * ctx, uint64_t done, uint64_t total);
+
+
+/*
+ * Copy options and results. A zeroed struct is a sensible default.
+ */
+struct fcopy
+{
+    unsigned        flags;      /* FCOPY_NO_xxx, FCOPY_FSYNC */
+    size_t          chunk;      /* bytes per syscall / progress call; 0 => 16MB */
+    fcopy_progress  progress;   /* may be NULL */
+    void *          ctx;
+
+    /* Filled in by the copy */
+    uint64_t        copied;
+    int             method;     /* FCOPY_xxx that did the last chunk */
+};
+typedef struct fcopy fcopy;
+
+
+/*
+ * Copy 'len' bytes (or up to EOF with FCOPY_EOF) from offset 'soff'
+ * of 'sfd' to offset 'doff' of 'dfd'. Neither file offset is
+ * changed, except when 'dfd' is a pipe or socket ('doff' is ignored
+ * then). 'c' may be NULL.
+ *
+ * Returns 0 on success and -errno on failure; c->copied has the
+ * bytes copied either way. A short source is not an error.
+ */
+extern int fcopy_range(fcopy * c, int dfd, uint64_t doff, int sfd, uint64_t soff, uint64_t len);
+
+
+/*
+ * Copy file 'src' to 'dst', creating or truncating 'dst' with the
+ * mode of 'src'. 'c' may be NULL.
+ *
+ * Returns 0 on success and -errno on failure; -EINVAL if 'dst' is
+ * 'src' (or a link to it), which is left alone.
+ */
+extern int fcopy_file(fcopy * c, const char * dst, const char * src);
+
+
+/*
+ * Name of a FCOPY_xxx method.
+ */
+extern const char * fcopy_method_name(int method);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___FCOPY_H_1840323_1475871155__ */
+
+/* EOF */
@@ -11,6 +11,15 @@
  * The implementation uses the classic producer-consumer pattern.
  * Each "job" is identified by an opaque pointer to some datum.
  *
+ * The queue has JOB_NPRIO priority levels. Threads take jobs from
+ * the levels by weighted round robin: while a level has jobs, it
+ * gets at least its weight's share of every round (the sum of the
+ * weights) - so a flood of jobs at a high level delays, but doesn't
+ * starve, the lower ones, and the other way around a flood of bulk
+ * jobs costs a high priority job at most a few bulk jobs of wait.
+ * Within a level, jobs with a deadline are run earliest deadline
+ * first, ahead of the jobs without one (which run in FIFO order).
+ *
  * On Linux, if required, the job manager knows enough to create as
  * many threads as there are available CPUs (_SC_NPROCESSORS_ONLN).
  *
@@ -34,23 +43,78 @@
 
 /* This file is local for Darwin */
 #include <semaphore.h>
-#include "fast/syncq.h"
+#include <stdint.h>
+#include "utils/metrics.h"
 
 #ifdef __cplusplus
-extern "C"
+extern "C" {
 #endif
 
 
 
 /*
- * Queue size
+ * Queue size (of each priority level)
  */
 #define JOB_MAX     1024
 
+
+/*
+ * Priority levels; 0 is the highest. job_manager_submit_job()
+ * submits at JOB_PRIO_NORMAL.
+ */
+#define JOB_NPRIO           4
+
+#define JOB_PRIO_URGENT     0
+#define JOB_PRIO_HIGH       1
+#define JOB_PRIO_NORMAL     2
+#define JOB_PRIO_BULK       3
+
+/*
+ * Default round robin weights of the levels (highest first)
+ */
+#define JOB_WEIGHTS         { 16, 8, 4, 1 }
+
+
+/*
+ * Counters of one priority level
+ */
+struct job_stats
+{
+    uint64_t submitted;
+    uint64_t dispatched;
+    uint64_t depth;         // jobs waiting now
+    uint64_t max_depth;
+    uint64_t wait_us;       // total queue wait of the dispatched jobs
+    uint64_t max_wait_us;
+    uint64_t late;          // dispatched after their deadline
+};
+typedef struct job_stats job_stats;
+
+
 /*
- * Queue of jobs
+ * A queued job; the queue of a level is a heap on (deadline, seq).
+ * Jobs without a deadline have deadline UINT64_MAX.
  */
-SYNCQ_TYPEDEF(jobq, void*, JOB_MAX);
+struct job_entry
+{
+    uint64_t deadline;
+    uint64_t seq;
+    uint64_t t_enq;
+    void*    job;
+};
+
+
+struct job_level
+{
+    struct job_entry* heap;
+    int               n;
+
+    unsigned int      weight;
+    unsigned int      credit;   // left in this round
+
+    pthread_cond_t    notfull;
+    job_stats         st;
+};
 
 
 /*
@@ -58,7 +122,13 @@ SYNCQ_TYPEDEF(jobq, void*, JOB_MAX);
  */
 struct job_manager
 {
-    jobq    q;
+    pthread_mutex_t  lock;
+    pthread_cond_t   notempty;
+
+    struct job_level lvl[JOB_NPRIO];
+    int              njobs;     // in all levels
+    int              nstop;     // end of work markers
+    uint64_t         seq;
 
     /*
      * Semaphore to capture thread completion.
@@ -71,6 +141,11 @@ struct job_manager
      */
     struct job_context* threads;
     int    nthreads;
+
+    /*
+     * Optional instrumentation; see job_manager_metrics()
+     */
+    struct job_metrics* metrics;
 };
 typedef struct job_manager job_manager;
 
@@ -84,6 +159,10 @@ typedef int (*jobfunc_t)(void* ctx, void* job, int threadnr);
  *
  * The job function is called for each job that is dequeued. It
  * needs to be thread-aware, and thread-safe.
+ *
+ * Returns the number of threads or -errno. On failure some threads
+ * may be running: job_manager_wait() and job_manager_destroy()
+ * still have to be called.
  */
 extern  int job_manager_init(job_manager*, int nthreads, jobfunc_t j, void* ctx);
 
@@ -97,11 +176,47 @@ extern void job_manager_destroy(job_manager*);
 
 
 /*
- * Submit a job.
+ * Submit a job at JOB_PRIO_NORMAL without a deadline.
  */
 extern void job_manager_submit_job(job_manager*, void* j);
 
 
+/*
+ * Submit a job at priority 'prio' (JOB_PRIO_xxx), to be run within
+ * 'deadline' microseconds from now; 0 (or one too far out to add
+ * to the clock) for no deadline. Blocks while the level is full.
+ *
+ * Returns 0 or -EINVAL if 'prio' is out of range.
+ */
+extern int job_manager_submit(job_manager*, void* j, int prio, uint64_t deadline);
+
+
+/*
+ * Set the round robin weights of the levels (JOB_NPRIO of them,
+ * highest first; a weight of 0 counts as 1).
+ */
+extern void job_manager_set_weights(job_manager*, const unsigned int* w);
+
+
+/*
+ * Copy the counters of each level to 'st' (JOB_NPRIO of them).
+ */
+extern void job_manager_stats(job_manager*, job_stats* st);
+
+
+
+/*
+ * Record job_manager metrics in 'r' under labels 'labels' (may be
+ * NULL): counters job_completed, job_errors; gauge job_busy
+ * (threads running a job); histogram job_run_us; the job queue
+ * counters jobq_enq, jobq_deq, jobq_enq_blocked, jobq_deq_blocked;
+ * and for each level (with "prio=N" added to the labels) gauge
+ * jobq_depth and histogram jobq_wait_us.
+ *
+ * Call before submitting jobs. Returns 0 or -ENOMEM.
+ */
+extern int job_manager_metrics(job_manager*, metrics_registry* r, const char* labels);
+
 
 /*
  * Wait for all jobs to complete. This just waits for the threads to
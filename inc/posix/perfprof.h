@@ -0,0 +1,226 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * perfprof.h - Hardware counter profiling of code regions.
+ *
+ * Each thread gets a perf_event group - instructions, cycles, last
+ * level cache misses and branch misses - counting its user space
+ * work. A region is a named piece of code; bracketing it with
+ * perfprof_begin() and perfprof_end() adds the counter deltas, the
+ * TSC ticks and a call count to that thread's totals for the
+ * region. Reports aggregate regions over all threads or show them
+ * per thread.
+ *
+ * Where the kernel allows it (x86, perf_event_mmap_page
+ * cap_user_rdpmc) counters are read with the rdpmc instruction
+ * from user space - tens of cycles instead of a read(2) syscall.
+ *
+ * Without perf_event_open(2) (not Linux, no PMU in a VM,
+ * perf_event_paranoid too strict, seccomp) nothing fails: regions
+ * still count calls and TSC ticks and perfprof_avail() says which
+ * counters are missing.
+ *
+ * Hot paths use the macros, which compile to nothing unless
+ * PERFPROF is defined:
+ *
+ *      PERFPROF_BEGIN(s, "ht_find");
+ *      r = ht_find(h, k, &v);
+ *      PERFPROF_END(s);
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___PERFPROF_H_2209174_1476310842__
+#define ___PERFPROF_H_2209174_1476310842__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "utils/utils.h"
+
+
+/*
+ * Counters
+ */
+#define PERFPROF_INSTRUCTIONS   0
+#define PERFPROF_CYCLES         1
+#define PERFPROF_LLC_MISSES     2
+#define PERFPROF_BRANCH_MISSES  3
+#define PERFPROF_NCTR           4
+
+#define PERFPROF_MAX_REGIONS    128
+
+
+/*
+ * Counter values of the calling thread
+ */
+struct perfprof_sample
+{
+    uint64_t v[PERFPROF_NCTR];
+    uint64_t tsc;
+};
+typedef struct perfprof_sample perfprof_sample;
+
+
+/*
+ * An open region
+ */
+struct perfprof_scope
+{
+    int             region;
+    perfprof_sample s0;
+};
+typedef struct perfprof_scope perfprof_scope;
+
+
+/*
+ * Totals of a region (for one thread or all of them)
+ */
+struct perfprof_stats
+{
+    const char * region;
+    const char * thread;        /* NULL when aggregated */
+    unsigned     avail;         /* counters that were read */
+    uint64_t     calls;
+    uint64_t     tsc;
+    uint64_t     v[PERFPROF_NCTR];
+};
+typedef struct perfprof_stats perfprof_stats;
+
+
+/*
+ * Open the counters of the calling thread and name it in reports
+ * (name may be NULL). Threads that don't call this are set up on
+ * their first read and named by their thread id.
+ *
+ * Returns the mask (1 << PERFPROF_xxx) of counters available on
+ * this thread; 0 if none.
+ */
+extern unsigned perfprof_thread_init(const char * name);
+
+/*
+ * Close the counters of the calling thread; its totals stay in the
+ * reports. Done automatically when a thread exits.
+ */
+extern void perfprof_thread_fini(void);
+
+/*
+ * Counters available on the calling thread
+ */
+extern unsigned perfprof_avail(void);
+
+/*
+ * True if the calling thread reads its counters with rdpmc
+ */
+extern int perfprof_rdpmc(void);
+
+/*
+ * Current counter values of the calling thread; counters that are
+ * not available read as 0.
+ */
+extern void perfprof_read(perfprof_sample * s);
+
+
+/*
+ * Id of region 'name', made if needed; -ENOSPC if there are
+ * already PERFPROF_MAX_REGIONS.
+ */
+extern int perfprof_region(const char * name);
+
+static inline void
+perfprof_begin(perfprof_scope * s, int region)
+{
+    s->region = region;
+    perfprof_read(&s->s0);
+}
+
+/*
+ * Add the deltas since perfprof_begin() to the calling thread's
+ * totals for the region.
+ */
+extern void perfprof_end(perfprof_scope * s);
+
+
+/*
+ * Call 'fn' for every region that has been entered: totals over all
+ * threads, or (per_thread) one call per thread and region. Stops
+ * early and returns the first non-zero value 'fn' returns.
+ */
+typedef int (*perfprof_walker)(void * ctx, const perfprof_stats * st);
+extern int perfprof_walk(int per_thread, perfprof_walker fn, void * ctx);
+
+/*
+ * Print a table of calls, ns, instructions, cycles, IPC and misses
+ * per call for each region.
+ */
+extern void perfprof_report(FILE * fp, int per_thread);
+
+/*
+ * ns per TSC tick (measured once)
+ */
+extern double perfprof_ns_per_tick(void);
+
+/*
+ * Zero the totals of every thread.
+ */
+extern void perfprof_reset(void);
+
+
+#ifdef PERFPROF
+
+#define PERFPROF_BEGIN(s, name)                                 \
+    static int s##_id_ = -1;                                    \
+    perfprof_scope s;                                           \
+    if (s##_id_ < 0) s##_id_ = perfprof_region(name);           \
+    perfprof_begin(&s, s##_id_)
+
+#define PERFPROF_END(s)     perfprof_end(&s)
+
+#else
+
+#define PERFPROF_BEGIN(s, name)     do { } while (0)
+#define PERFPROF_END(s)             do { } while (0)
+
+#endif /* PERFPROF */
+
+
+#ifdef __cplusplus
+}
+
+namespace putils {
+
+/*
+ * Region for the lifetime of the object:
+ *
+ *      static int id = perfprof_region("insert");
+ *      putils::perf_scope p(id);
+ */
+class perf_scope
+{
+public:
+    explicit perf_scope(int region) { perfprof_begin(&m_s, region); }
+    ~perf_scope()                   { perfprof_end(&m_s); }
+
+private:
+    perf_scope(const perf_scope&);
+    perf_scope& operator=(const perf_scope&);
+
+    perfprof_scope m_s;
+};
+
+} // namespace putils
+
+#endif /* __cplusplus */
+
+#endif /* ! ___PERFPROF_H_2209174_1476310842__ */
+
+/* EOF */
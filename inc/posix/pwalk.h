@@ -0,0 +1,125 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * pwalk.h - Parallel directory tree walker.
+ *
+ * fts(3) and ftw(3) walk a tree on one thread, one readdir() and
+ * stat() at a time; on large trees the walk is bound by metadata
+ * latency. pwalk() scans directories on N threads instead. Each
+ * thread keeps a deque of directories still to be scanned and idle
+ * threads steal work from the others.
+ *
+ * On Linux the directory entries are read with getdents64(2) into
+ * large buffers and entries are stat'ed relative to the directory
+ * fd with statx(2), asking only for the fields the caller wants.
+ * Elsewhere it falls back to readdir(3) and fstatat(2).
+ *
+ * The walk is physical: symlinks are reported but never followed;
+ * only a symlink given as the root itself is.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___PWALK_H_5302417_1453411207__
+#define ___PWALK_H_5302417_1453411207__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+/*
+ * Stat fields the caller is interested in. Entries are not stat'ed
+ * at all unless one of these is set (or the file system doesn't
+ * return the entry type).
+ */
+#define PWALK_TYPE      0x0001  /* st_mode file type only */
+#define PWALK_SIZE      0x0002  /* st_size, st_blocks */
+#define PWALK_MODE      0x0004  /* st_mode, st_uid, st_gid, st_nlink */
+#define PWALK_TIME      0x0008  /* st_atime, st_mtime, st_ctime */
+#define PWALK_INO       0x0010  /* st_ino, st_dev */
+#define PWALK_STAT      0x001f  /* all of the above */
+
+/*
+ * Walk options
+ */
+#define PWALK_ORDERED   0x0100  /* deliver entries in sorted pre-order */
+#define PWALK_XDEV      0x0200  /* don't cross devices */
+
+
+/*
+ * Return value from the callback to not descend into a directory.
+ */
+#define PWALK_SKIP      1
+
+
+/*
+ * One walked entry; valid only for the duration of the callback.
+ */
+struct pwalk_ent
+{
+    const char * path;  /* path relative to the root given */
+    const char * name;  /* last component of path */
+
+    /*
+     * fd of the parent directory for use with the *at() calls; -1
+     * in ordered mode (the directory has long been closed).
+     */
+    int   dirfd;
+
+    int   depth;        /* 0 for the root */
+    int   type;         /* DT_xxx */
+    int   err;          /* errno if stat failed or dir unreadable */
+
+    /* Only the fields asked for via PWALK_xxx are valid */
+    struct stat st;
+};
+typedef struct pwalk_ent pwalk_ent;
+
+
+/*
+ * Callback for each entry.
+ *
+ * In unordered mode it is called concurrently from all the worker
+ * threads ('thread' identifies the caller) and must be thread safe.
+ * In ordered mode it is called from the thread that called pwalk()
+ * in the same order as a sorted, single threaded pre-order walk;
+ * workers scan ahead and buffer entries until they are delivered
+ * (up to a limit, after which they wait for the callback). Once
+ * the callback skips a directory, no more of it is read.
+ *
+ * Return 0 to continue, PWALK_SKIP to not descend into this
+ * directory and < 0 to abort the walk.
+ */
+typedef int (*pwalk_fn)(void * ctx, const pwalk_ent * e, int thread);
+
+
+/*
+ * Walk the tree rooted at 'root' with 'nthreads' threads (0 => one
+ * per CPU) and call 'fn' for every entry including the root.
+ *
+ * Returns:
+ *      0 on success
+ *      -errno on failure to start the walk
+ *      the first negative value returned by 'fn'
+ */
+extern int pwalk(const char * root, int nthreads, unsigned int flags,
+                 pwalk_fn fn, void * ctx);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___PWALK_H_5302417_1453411207__ */
+
+/* EOF */
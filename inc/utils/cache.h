@@ -0,0 +1,147 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/cache.h - Bounded memory, concurrent S3-FIFO cache.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * A key-value cache of at most 'capacity' bytes (keys, values and
+ * per entry overhead, as allocated).
+ *
+ * Eviction is S3-FIFO [1]: new entries go to a small FIFO (10% of
+ * the bytes); entries that were hit again by the time they reach
+ * its tail move to the main FIFO, the rest are evicted and their
+ * key hash remembered in a ghost FIFO. A new entry whose key is in
+ * the ghost FIFO goes straight to the main FIFO. The main FIFO is
+ * a CLOCK: an entry at the tail that was hit goes back to the head
+ * with its count decremented.
+ *
+ * A hit only bumps a 2-bit counter in the entry - nothing is moved
+ * - so lookups run concurrently under a shared lock. The cache is
+ * split into shards by key hash, each with its own rwlock, fast-ht
+ * index, FIFOs, timer wheel and allocator; puts and deletes take
+ * the shard lock exclusively.
+ *
+ * Entries are allocated from per shard size class pools (mempool)
+ * of 64 to 4096 bytes (larger ones from malloc) and charged at the
+ * size of their class.
+ *
+ * Entries can have a TTL; each shard has a hashed timer wheel [2]
+ * of its entries by expiry time. An expired entry is never
+ * returned; it is freed when a put finds the wheel has moved past
+ * it, by cache_expire() or when it is evicted.
+ *
+ * Values are copied out under the lock - a value never outlives
+ * its entry in the hands of the caller.
+ *
+ * References:
+ * ===========
+ * [1] FIFO queues are all you need for cache eviction, Yang et al.,
+ *     SOSP 2023
+ *
+ * [2] Hashed and Hierarchical Timing Wheels, Varghese & Lauck
+ */
+
+#ifndef ___UTILS_CACHE_H_1150832_1477081052__
+#define ___UTILS_CACHE_H_1150832_1477081052__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "utils/utils.h"
+
+
+struct cache;
+typedef struct cache cache;
+
+
+struct cache_opt
+{
+    size_t   capacity;      // bytes
+    uint32_t nshards;       // 0: 4 x CPUs; rounded up to a power of 2
+    uint32_t tick;          // ms per timer wheel slot; 0: 100ms
+
+    // Current time in ms; NULL: CLOCK_MONOTONIC
+    uint64_t (*clock)(void);
+};
+typedef struct cache_opt cache_opt;
+
+
+struct cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t puts;
+    uint64_t evictions;
+    uint64_t expired;       // freed after their TTL
+
+    uint64_t items;
+    uint64_t bytes;         // charged to the capacity
+    uint64_t capacity;
+};
+typedef struct cache_stats cache_stats;
+
+
+/*
+ * Make a new cache with options 'o'.
+ *
+ * Returns 0 on success, -EINVAL if the capacity is too small for
+ * the shards, -ENOMEM.
+ */
+extern int cache_new(cache ** p_c, const cache_opt * o);
+
+extern void cache_delete(cache * c);
+
+/*
+ * Add or replace the value of 'key'. The entry expires after
+ * 'ttl' ms, or never if 'ttl' is 0.
+ *
+ * Returns 0 on success, -E2BIG if the entry is larger than 1/8th
+ * of a shard, -ENOMEM.
+ */
+extern int cache_put(cache * c, const void * key, size_t klen,
+                     const void * val, size_t vlen, uint32_t ttl);
+
+/*
+ * Copy at most 'bufsz' bytes of the value of 'key' to 'buf'.
+ *
+ * Returns the length of the value (which may be more than
+ * 'bufsz'), or -ENOENT if 'key' isn't in the cache.
+ */
+extern ssize_t cache_get(cache * c, const void * key, size_t klen,
+                         void * buf, size_t bufsz);
+
+/*
+ * Remove 'key'; returns 0 or -ENOENT.
+ */
+extern int cache_del(cache * c, const void * key, size_t klen);
+
+/*
+ * Free all the expired entries now.
+ */
+extern void cache_expire(cache * c);
+
+/*
+ * Sum of the counters of all shards.
+ */
+extern void cache_stats_get(cache * c, cache_stats * st);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_CACHE_H_1150832_1477081052__ */
+
+/* EOF */
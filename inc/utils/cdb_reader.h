@@ -0,0 +1,205 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_reader.h - CDB Reader Interface
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2 
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___CDB_READER_H_8420881_1470077389__
+#define ___CDB_READER_H_8420881_1470077389__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifndef __BYTE_ORDER__
+#error "Don't know the byte order!"
+#endif /* !__BYTE_ORDER__ */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __little_endian
+#else
+#undef __little_endian
+#endif /* __BYTE_ORDER__ */
+
+
+/*
+ * The first level directory index.
+ */
+struct idx {
+    uint32_t off;
+    uint32_t len;
+};
+typedef struct idx idx;
+
+
+/*
+ * First level index of a CDB64.
+ */
+struct idx64 {
+    uint64_t off;
+    uint64_t len;
+};
+typedef struct idx64 idx64;
+
+
+/*
+ * Abstrction of a DJB CDB/
+ *
+ * This struct is optimized for little-endian systems; we don't need
+ * to store the entire table.
+ *
+ * The same struct is used for the CDB64 variant: 64-bit offsets
+ * and 64-bit hashes for DBs larger than 4GB. The format is detected
+ * when the DB is opened.
+ */
+struct CDB {
+    uint8_t *mmap;
+    uint64_t size;
+
+#ifdef __little_endian
+    idx     *index;   // we just point to the structure
+#else
+    idx     index[256];
+#endif /* LITTLE_ENDIAN */
+
+    idx64   *index64; // CDB64 only; decoded copy of the index
+
+    int      fd;
+    unsigned flags;   // CDB_xxx flags given to cdb_open()
+    int      wide;    // 1 if this is a CDB64
+};
+typedef struct CDB CDB;
+
+
+
+/*
+ * Size of the first level index at the start of the file.
+ */
+#define CDB_INDEX_SIZE      (256 * sizeof(idx))
+
+/*
+ * A CDB64 starts with an 8 byte magic followed by the index. The
+ * first word of a CDB is the offset of the first table and can
+ * never be zero; the magic starts with 4 zero bytes so the two
+ * formats can't be confused.
+ */
+#define CDB64_MAGIC         "\0\0\0\0CD64"
+#define CDB64_MAGIC_SIZE    8
+#define CDB64_INDEX_SIZE    (CDB64_MAGIC_SIZE + (256 * sizeof(idx64)))
+
+
+/*
+ * Flags for cdb_open()
+ *
+ * CDB_RANDOM:  madvise(2) the mapping for random access; this turns
+ *              off kernel readahead that is wasted on hash lookups.
+ *
+ * CDB_COLD:    the DB is mostly not in memory (e.g., larger than
+ *              RAM). cdb_find_batch() also issues MADV_WILLNEED for
+ *              the slot and record pages of a batch so the reads
+ *              are overlapped instead of faulted in one at a time.
+ */
+#define CDB_RANDOM          (1 << 0)
+#define CDB_COLD            (1 << 1)
+
+
+extern uint64_t fasthash64(const void*, size_t, uint64_t);
+
+#define CDB_HASH_SEED       0x2de9ce7b97d9569f
+
+/*
+ * Hash of a key; shared by the reader and the writer. The low byte
+ * picks the table; the rest picks the starting slot.
+ */
+static inline uint32_t
+cdb_hash(const void* k, size_t klen)
+{
+    uint64_t h = fasthash64(k, klen, CDB_HASH_SEED);
+    return (uint32_t)(h - (h >> 32));
+}
+
+
+/*
+ * Hash of a key in a CDB64. All 64 bits are stored in the slots,
+ * which makes false slot matches vanishingly rare.
+ */
+static inline uint64_t
+cdb64_hash(const void* k, size_t klen)
+{
+    return fasthash64(k, klen, CDB_HASH_SEED);
+}
+
+
+/*
+ * Initialize the 'db' for read operations from file 'fname'. Both
+ * CDB and CDB64 files are accepted.
+ *
+ * Return:
+ *  0      on success
+ *  -errno on failre.
+ */
+extern int cdb_open(CDB* db, const char* fname, unsigned flags);
+
+
+/*
+ * Same as cdb_open(db, fname, CDB_RANDOM).
+ */
+extern int cdb_read_init(CDB* db, const char* fname);
+
+
+
+/**
+ * Find key 'key' in the DB. If found, set 'p_ret' to the
+ * corresponding value.
+ *
+ * Returns:
+ *      >= 0     key is found; # of bytes of value
+ *      -ENOENT  key is not found
+ */
+extern ssize_t cdb_find(CDB* db, void** p_ret, const void* key, size_t klen);
+
+
+/*
+ * Find 'n' keys in one go: keys[i] of length klens[i]. For each
+ * key, vals[i] is set to the value and vlens[i] to the value length
+ * or -ENOENT.
+ *
+ * The keys are hashed in groups and the slot and record pages of
+ * a group are prefetched before any of them are compared; this
+ * overlaps the cache (and with CDB_COLD, page) misses that
+ * cdb_find() takes one after another.
+ *
+ * Returns the number of keys found.
+ */
+extern size_t cdb_find_batch(CDB* db, size_t n, const void* const* keys,
+                             const size_t* klens, void** vals, ssize_t* vlens);
+
+
+/*
+ * Unmap and close a DB opened with cdb_read_init().
+ */
+extern void cdb_close(CDB* db);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___CDB_READER_H_8420881_1470077389__ */
+
+/* EOF */
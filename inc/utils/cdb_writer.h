@@ -0,0 +1,148 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_writer.h - CDB Writer Interface
+ *
+ * Builds constant databases (CDB or CDB64) readable by
+ * cdb_read_init() and cdb_find(). Records are streamed to a temp
+ * file next to the final one; only an 8 byte (hash, offset) slot
+ * per record (16 bytes for a CDB64) is kept in memory.
+ * cdb_write_finish() sorts the slots by table, writes all 256 hash
+ * tables and the index and atomically renames the temp file into
+ * place.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___CDB_WRITER_H_3318742_1470171912__
+#define ___CDB_WRITER_H_3318742_1470171912__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "utils/cdb_reader.h"
+
+
+/*
+ * In-memory hash slot for one record.
+ */
+struct cdb_slot {
+    uint32_t hash;
+    uint32_t off;
+};
+typedef struct cdb_slot cdb_slot;
+
+
+/*
+ * In-memory hash slot for one record of a CDB64.
+ */
+struct cdb_slot64 {
+    uint64_t hash;
+    uint64_t off;
+};
+typedef struct cdb_slot64 cdb_slot64;
+
+
+/*
+ * State of a DB being built.
+ */
+struct cdb_writer {
+    int       fd;
+    char     *fname;        // final name
+    char     *tmpname;      // temp file in the same dir
+
+    uint64_t  off;          // end of data written so far
+
+    uint8_t  *buf;          // write buffer
+    size_t    buflen;       // bytes buffered
+
+    union {
+        cdb_slot   *s32;
+        cdb_slot64 *s64;
+        void       *ptr;
+    } slots;
+    size_t    nslots;
+    size_t    slotsz;       // allocated slots
+
+    uint32_t  counts[256];  // records per table
+
+    int       wide;         // 1 if building a CDB64
+};
+typedef struct cdb_writer cdb_writer;
+
+
+/*
+ * Start a new DB that will be renamed to 'fname' when finished.
+ *
+ * Return:
+ *  0      on success
+ *  -errno on failure.
+ */
+extern int cdb_write_init(cdb_writer* w, const char* fname);
+
+
+/*
+ * Start a new CDB64 that will be renamed to 'fname' when finished.
+ * Use this for DBs that may grow beyond 4GB. Everything else is
+ * identical to cdb_write_init().
+ */
+extern int cdb64_write_init(cdb_writer* w, const char* fname);
+
+
+/*
+ * Append a key/value pair. Duplicate keys are stored as is;
+ * cdb_find() returns the first one added.
+ *
+ * Return:
+ *  0       on success
+ *  -EFBIG  if the DB would exceed 4GB (CDB only), or the
+ *          key or value is 4GB or larger
+ *  -errno  on write failures
+ */
+extern int cdb_write(cdb_writer* w, const void* key, size_t klen,
+                     const void* val, size_t vlen);
+
+
+/*
+ * Write the hash tables and index, sync and rename the DB into
+ * place. The tables are built on 'nthreads' threads partitioned by
+ * the low hash byte: 0 uses one thread per CPU, 1 builds them on
+ * the calling thread (as does a failure to start the threads).
+ *
+ * 'w' is released in all cases; on failure the temp file is
+ * removed and the previous DB (if any) is left untouched.
+ *
+ * Return:
+ *  0      on success
+ *  -errno on failure.
+ */
+extern int cdb_write_finish(cdb_writer* w, int nthreads);
+
+
+/*
+ * Discard a DB being built and release 'w'.
+ */
+extern void cdb_write_abort(cdb_writer* w);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___CDB_WRITER_H_3318742_1470171912__ */
+
+/* EOF */
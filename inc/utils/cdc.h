@@ -0,0 +1,185 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/cdc.h - Content defined chunking (FastCDC).
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Splits a byte stream into chunks at positions chosen by the
+ * content, so that an insert or delete only changes the chunks
+ * around it; the rest of the stream chunks (and dedups) as before.
+ *
+ * This is FastCDC [1]: a gear rolling hash (one shift, one add and
+ * one table lookup per byte) over a 64 byte window; a chunk ends
+ * where the top bits of the hash are zero. The first 'min' bytes of
+ * a chunk are skipped, and the chunk size is normalized: up to
+ * 'avg' bytes the test uses two more bits (a cut is 4x less
+ * likely), after it two less bits (4x more likely), and a chunk is
+ * cut at 'max' bytes regardless. Most chunks are then close to
+ * 'avg' bytes.
+ *
+ * Each chunk can be hashed with BLAKE2b-256 (libsodium) in the same
+ * pass, while it is still in cache (CDC_HASH).
+ *
+ * Three ways in:
+ *
+ *   o cdc_cut(): length of the first chunk of a buffer.
+ *
+ *   o cdc_update()/cdc_final(): streaming - feed buffers of any
+ *     size, a callback gets each chunk as it completes. The chunks
+ *     don't depend on how the stream was split into buffers.
+ *
+ *   o cdc_buf()/cdc_file(): a whole buffer (e.g. a mapping from
+ *     mmap_file) or file, on many threads: every thread chunks its
+ *     own slice of the buffer starting at an arbitrary offset; the
+ *     slices are then stitched together by re-chunking from the last
+ *     true cut point of the previous slice until it meets a cut point
+ *     of the next one. Chunking is deterministic from a cut point,
+ *     so from there on the next slice's chunks are the true ones.
+ *     This resynchronizes within a chunk or two; the result is
+ *     exactly that of one thread.
+ *
+ * References:
+ * ===========
+ * [1] FastCDC: a Fast and Efficient Content-Defined Chunking
+ *     Approach for Data Deduplication, Xia et al., USENIX ATC 2016
+ */
+
+#ifndef ___UTILS_CDC_H_2871604_1476996143__
+#define ___UTILS_CDC_H_2871604_1476996143__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "utils/utils.h"
+
+
+/*
+ * Flags
+ */
+#define CDC_HASH        (1 << 0)    /* BLAKE2b-256 of every chunk */
+
+#define CDC_HASHLEN     32
+
+/*
+ * Chunk size limits
+ */
+#define CDC_MIN_SIZE    64
+#define CDC_MAX_SIZE    (1U << 30)
+
+
+struct cdc_chunk
+{
+    uint64_t off;               // offset in the stream
+    uint32_t len;
+    uint8_t  hash[CDC_HASHLEN]; // if CDC_HASH
+};
+typedef struct cdc_chunk cdc_chunk;
+
+
+struct cdc
+{
+    uint32_t min;
+    uint32_t avg;
+    uint32_t max;
+    uint32_t flags;
+
+    uint64_t mask_s;            // cut mask below avg
+    uint64_t mask_l;            // cut mask above avg
+
+    uint64_t gear[256];
+
+    // Streaming state
+    uint64_t off;               // offset of the current chunk
+    uint64_t fp;                // gear hash
+    uint32_t len;               // bytes of the current chunk so far
+    void *   hs;                // hash state of the current chunk
+};
+typedef struct cdc cdc;
+
+
+/*
+ * Called for every chunk; a non-zero return stops the chunking and
+ * is returned to the caller.
+ */
+typedef int cdc_fp(void * ctx, const cdc_chunk * ch);
+
+
+/*
+ * Initialize chunker 'c' for chunks of 'min' to 'max' bytes that
+ * average 'avg' bytes (rounded down to a power of 2). If 'avg' is
+ * 0, chunks average 8k and min and max are avg/4 and 8*avg.
+ *
+ * Returns 0 on success, -EINVAL unless CDC_MIN_SIZE <= min < avg
+ * < max <= CDC_MAX_SIZE, -ENOMEM.
+ */
+extern int cdc_init(cdc * c, uint32_t min, uint32_t avg, uint32_t max, uint32_t flags);
+
+extern void cdc_fini(cdc * c);
+
+/*
+ * Forget the stream in progress; start a new one at offset 0.
+ */
+extern void cdc_reset(cdc * c);
+
+/*
+ * Length of the first chunk of the 'n' bytes at 'buf'. If there is
+ * no cut point in the first 'max' bytes, the result is max; if 'n'
+ * is less, it is 'n' - the chunk might continue past the buffer.
+ * Doesn't use or change the streaming state.
+ */
+extern size_t cdc_cut(const cdc * c, const void * buf, size_t n);
+
+/*
+ * Feed the next 'n' bytes of the stream; 'fp' is called with every
+ * chunk that ends in them.
+ *
+ * Returns 0, or the non-zero return of 'fp' (after which the stream
+ * must be reset).
+ */
+extern int cdc_update(cdc * c, const void * buf, size_t n, cdc_fp * fp, void * ctx);
+
+/*
+ * End of the stream: 'fp' gets the last (short) chunk if any, and
+ * the chunker is reset.
+ */
+extern int cdc_final(cdc * c, cdc_fp * fp, void * ctx);
+
+/*
+ * Chunk the 'n' bytes at 'buf' on 'nthreads' threads (all CPUs if
+ * <= 0). The chunks are returned in '*p_ch' (free with DEL) and
+ * their number in '*p_n'. Doesn't use or change the streaming
+ * state; a chunker can be shared by concurrent calls.
+ *
+ * Returns 0 on success, -ENOMEM or -errno from pthread_create.
+ */
+extern int cdc_buf(const cdc * c, const void * buf, size_t n, int nthreads,
+                   cdc_chunk ** p_ch, size_t * p_n);
+
+/*
+ * cdc_buf() of the contents of file 'fn', mapped into memory.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+extern int cdc_file(const cdc * c, const char * fn, int nthreads,
+                    cdc_chunk ** p_ch, size_t * p_n);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_CDC_H_2871604_1476996143__ */
+
+/* EOF */
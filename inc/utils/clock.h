@@ -0,0 +1,192 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/clock.h - Calibrated TSC clock and a coarse clock.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Cheap timestamps for hot paths, in ns on the CLOCK_MONOTONIC
+ * timeline:
+ *
+ *   o clk_ns() reads the TSC and scales it with a 32-bit fixed point
+ *     multiply and shift: ns = ns0 + ((tsc - tsc0) * mult) >> shift.
+ *     The scale is calibrated against CLOCK_MONOTONIC when the clock
+ *     is first used. It is only used if the TSC is invariant (CPUID
+ *     says so and, on Linux, the kernel uses it as its clocksource);
+ *     otherwise clk_ns() is clock_gettime(CLOCK_MONOTONIC).
+ *
+ *   o clk_coarse_ns() reads a value that a background ticker updates
+ *     every 'res' us (clk_coarse_start()); without the ticker it is
+ *     CLOCK_MONOTONIC_COARSE where there is one.
+ *
+ *   While it runs, the ticker also keeps the TSC scale honest: once
+ *   a second it measures the TSC rate over the whole time since
+ *   calibration and slews (at most 500 ppm) so that clk_ns() meets
+ *   CLOCK_MONOTONIC again, without ever going backwards.
+ *
+ *   A reader reads the scale under a sequence counter; updates are
+ *   rare.
+ *
+ *   Neither clock goes backwards when its source changes: not when
+ *   clk_init() recalibrates or drops the TSC, and not when the
+ *   ticker stops. Each new source starts no earlier than the last
+ *   value the old one could have handed out.
+ *
+ *   timenow() (utils.h) stays what it was: wall clock us.
+ */
+
+#ifndef ___UTILS_CLOCK_H_2049371_1477870011__
+#define ___UTILS_CLOCK_H_2049371_1477870011__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <time.h>
+#include "utils/utils.h"
+
+
+/*
+ * Sources of clk_ns()
+ */
+#define CLK_TSC         1
+#define CLK_MONOTONIC   2
+
+/*
+ * clk_init() flags
+ */
+#define CLK_NOTSC       (1 << 0)    /* don't use the TSC */
+
+
+/*
+ * Pick and calibrate the source of clk_ns(); called by the first
+ * clk_ns() if not before. Calibrating sleeps ~20 ms under a lock, so
+ * code that reads the clock on a hot path or under its own locks
+ * should call this (or clk_ns()) once up front. It can be called
+ * again (e.g. with CLK_NOTSC) at any time. A recalibrated clock
+ * starts at the last reading of the old one, which may leave it a
+ * little ahead of CLOCK_MONOTONIC until the ticker slews it back.
+ *
+ * Returns CLK_TSC or CLK_MONOTONIC.
+ */
+extern int clk_init(unsigned int flags);
+
+
+/*
+ * Start (stop) the coarse clock ticker with a resolution of 'res'
+ * us (0: 1000). Starts are counted; the last stop ends the ticker.
+ * The resolution is that of the first start.
+ *
+ * Returns 0 or -errno.
+ */
+extern int  clk_coarse_start(unsigned int res);
+extern void clk_coarse_stop(void);
+
+
+
+/* Internals of the inline readers */
+struct __clk_scale
+{
+    uint32_t seq;       // odd while being updated
+    uint32_t mult;
+    uint32_t shift;
+    int      src;       // 0 until clk_init()
+    uint64_t tsc0;
+    uint64_t ns0;
+    uint64_t floor;     // CLOCK_MONOTONIC[_COARSE] reads no lower
+} __attribute__((aligned(64)));
+
+extern struct __clk_scale __clk;
+extern uint64_t           __clk_coarse;     // 0 if no ticker
+extern uint64_t           __clk_init_ns(void);
+extern uint64_t           __clk_coarse_slow(void);
+
+
+static inline uint64_t
+clk_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* (d * mult) >> shift without a 128 bit product */
+static inline uint64_t
+__clk_mulshift(uint64_t d, uint32_t mult, uint32_t shift)
+{
+    return (((d >> 32) * mult) << (32 - shift)) + (((d & 0xffffffff) * mult) >> shift);
+}
+
+
+/*
+ * Monotonic ns.
+ */
+static inline uint64_t
+clk_ns(void)
+{
+    if (likely(__atomic_load_n(&__clk.src, __ATOMIC_RELAXED) == CLK_TSC)) {
+        uint32_t s, mult, shift;
+        uint64_t t0, n0, t;
+
+        do {
+            s     = __atomic_load_n(&__clk.seq, __ATOMIC_ACQUIRE);
+            mult  = __atomic_load_n(&__clk.mult, __ATOMIC_RELAXED);
+            shift = __atomic_load_n(&__clk.shift, __ATOMIC_RELAXED);
+            t0    = __atomic_load_n(&__clk.tsc0, __ATOMIC_RELAXED);
+            n0    = __atomic_load_n(&__clk.ns0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((s & 1) || s != __atomic_load_n(&__clk.seq, __ATOMIC_RELAXED));
+
+        // Another CPU's TSC may be a little behind the anchor
+        t = sys_cpu_timestamp();
+        return t >= t0 ? n0 + __clk_mulshift(t - t0, mult, shift)
+                       : n0 - __clk_mulshift(t0 - t, mult, shift);
+    }
+
+    if (unlikely(__clk.src == 0)) return __clk_init_ns();
+
+    uint64_t m = clk_mono_ns(),
+             f = __atomic_load_n(&__clk.floor, __ATOMIC_RELAXED);
+
+    return m > f ? m : f;
+}
+
+
+static inline uint64_t
+clk_us(void)
+{
+    return clk_ns() / 1000;
+}
+
+
+/*
+ * Monotonic ns, as of the last tick.
+ */
+static inline uint64_t
+clk_coarse_ns(void)
+{
+    uint64_t v = __atomic_load_n(&__clk_coarse, __ATOMIC_RELAXED);
+
+    return likely(v) ? v : __clk_coarse_slow();
+}
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_CLOCK_H_2049371_1477870011__ */
+
+/* EOF */
@@ -0,0 +1,197 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/cmsketch.h - Count-Min and Count-Sketch frequency sketches.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notation:
+ * =========
+ *   N  = sum of all the weights added
+ *   e  = error; estimates are off by at most e*N (Count-Min) or
+ *        e*||f||_2 (Count-Sketch) ...
+ *   d  = ... except with probability 'd' (input parameters)
+ *
+ *   w  = counters per row
+ *   k  = number of rows
+ *
+ *   Count-Min    [1]: w = e/eps,     k = ln(1/d)
+ *   Count-Sketch [2]: w = 3/eps^2,   k = ln(1/d), rounded up to odd
+ *
+ * Variants:
+ * =========
+ *   o CMS_COUNT_MIN: each row adds the weight to one counter; the
+ *     estimate is the minimum over the rows. Never underestimates.
+ *
+ *   o CMS_CONSERVATIVE: Count-Min with conservative update [3]: a
+ *     counter is only raised as far as the new estimate. Much
+ *     smaller errors on skewed data; sketches can still be merged
+ *     (the sum remains an overestimate) but not decremented.
+ *
+ *   o CMS_COUNT_SKETCH: each row adds +/- the weight; the estimate
+ *     is the median over the rows. Unbiased, and better than
+ *     Count-Min for low frequency items of a heavy tailed stream.
+ *
+ * Notes:
+ * ======
+ *   o Like the bloom filters, the sketch takes a 64-bit hash of the
+ *     item; use one of the 64-bit functions in hashfunc.h.
+ *
+ *   o The counters are cache-blocked, like a blocked bloom filter:
+ *     the hash picks one 64 byte line of 16 counters and every row
+ *     has its own slots in that line. An update or an estimate is
+ *     one cache miss instead of 'k'. The price is that the rows of
+ *     one item are not independent - items colliding in one row
+ *     share the line in the others - so the error tail is somewhat
+ *     heavier than the bound above; ask for a slightly smaller e if
+ *     the bound must hold. At most 16 rows.
+ *
+ *   o Counters are 32 bits.
+ *
+ *   o With CMS_ATOMIC updates are atomic and a sketch can be shared
+ *     by threads without locks. Count-Min and Count-Sketch use an
+ *     atomic add (and produce exactly the counters a serial run
+ *     would); the conservative update raises counters with CAS
+ *     and retries if another thread got there first.
+ *
+ * References:
+ * ===========
+ * [1] An Improved Data Stream Summary: The Count-Min Sketch and its
+ *     Applications, Cormode & Muthukrishnan
+ *     http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf
+ *
+ * [2] Finding Frequent Items in Data Streams, Charikar, Chen &
+ *     Farach-Colton
+ *
+ * [3] New Directions in Traffic Measurement and Accounting, Estan &
+ *     Varghese (conservative update)
+ */
+
+#ifndef ___UTILS_CMSKETCH_H_7150293_1476833981__
+#define ___UTILS_CMSKETCH_H_7150293_1476833981__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include "utils/utils.h"
+
+
+/*
+ * Sketch types
+ */
+#define CMS_COUNT_MIN       0
+#define CMS_CONSERVATIVE    1
+#define CMS_COUNT_SKETCH    2
+
+/*
+ * Flags
+ */
+#define CMS_ATOMIC          (1 << 0)    /* updates from many threads */
+
+#define CMS_LINE            16          /* counters per cache line */
+#define CMS_MAX_ROWS        CMS_LINE
+
+
+struct cms
+{
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     rows;
+    uint8_t     slots;      // slots of a row in each line
+    uint32_t    nlines;
+    uint32_t    width;      // counters per row: nlines * slots
+
+    uint32_t *  c;          // nlines * CMS_LINE counters
+
+    double      eps;
+    double      delta;
+    uint64_t    total;      // N
+};
+typedef struct cms cms;
+
+
+/*
+ * Initialize sketch 'c' of 'type' for error 'eps' with probability
+ * 'delta'.
+ *
+ * Returns 0 on success, -EINVAL for a bad type or parameters (or
+ * more than CMS_MAX_ROWS rows), -ENOMEM.
+ */
+extern int cms_init(cms * c, int type, double eps, double delta, uint32_t flags);
+
+extern void cms_fini(cms * c);
+
+/*
+ * Make a new sketch; NULL on bad parameters or no memory.
+ */
+extern cms * cms_new(int type, double eps, double delta, uint32_t flags);
+
+extern void cms_delete(cms * c);
+
+/*
+ * Zero all counters.
+ */
+extern void cms_reset(cms * c);
+
+/*
+ * Add 'w' occurrences of the item hashing to 'hash'.
+ */
+extern void cms_add(cms * c, uint64_t hash, uint32_t w);
+
+/*
+ * Estimated number of occurrences of the item hashing to 'hash'.
+ */
+extern uint64_t cms_estimate(cms * c, uint64_t hash);
+
+/*
+ * cms_add() followed by cms_estimate() of the same item; cheaper
+ * than the two calls.
+ */
+extern uint64_t cms_add_estimate(cms * c, uint64_t hash, uint32_t w);
+
+/*
+ * Add the counters of 'src' to 'dst'. Both must be of the same type
+ * and geometry.
+ *
+ * Returns 0 on success, -EINVAL otherwise.
+ */
+extern int cms_merge(cms * dst, const cms * src);
+
+/*
+ * Sum of all the weights added; eps * this is the Count-Min error
+ * bound.
+ */
+static inline uint64_t
+cms_total(const cms * c)
+{
+    return (c->flags & CMS_ATOMIC) ? __atomic_load_n(&c->total, __ATOMIC_RELAXED)
+                                   : c->total;
+}
+
+/*
+ * Memory used by the counters
+ */
+static inline size_t
+cms_size(const cms * c)
+{
+    return (size_t)c->nlines * CMS_LINE * sizeof c->c[0];
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_CMSKETCH_H_7150293_1476833981__ */
+
+/* EOF */
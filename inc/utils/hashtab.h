@@ -237,7 +237,7 @@ extern int hash_table_remove(hash_table_t, const void * key, void** p_ret);
 /*
  * Conditionally remove one or more items from the hash table. The
  * supplied predicate 'pred' is called for every hash table item. An
- * item in the hash table is removed if the predicate returns
+ * item in the hash table is removed if the predicate returns true.
  *
  * 'cookie' is an opaque caller supplied parameter passed to the
  * predicate.
@@ -272,6 +272,113 @@ extern void hash_table_apply(hash_table_t,
 
 
 
+/*
+ *      --- Partitioned, parallel and incremental traversal ---
+ *
+ * hash_table_apply() and hash_table_remove_if() hold the table lock
+ * for the whole walk. The functions below split the buckets into
+ * partitions:
+ *
+ *  o hash_table_apply_par() and hash_table_remove_if_par() walk the
+ *    partitions on 'nthreads' job_manager threads (POSIX only). The
+ *    table lock is still held throughout; the walk just ends
+ *    sooner. 'apply', 'pred', the destructor and the memory manager
+ *    are called from several threads at once.
+ *
+ *  o A cursor sweeps the table (or one partition of it) a few
+ *    buckets per call, and each call takes the table lock only for
+ *    those buckets; writers get in between calls. The table may
+ *    grow between calls: items present for the whole sweep are
+ *    visited exactly once, items inserted or removed meanwhile at
+ *    most once.
+ *
+ * As with hash_table_apply(), 'apply' and 'pred' must not insert or
+ * remove items.
+ */
+
+
+/*
+ * A sweep of the buckets [pos, end) of a table that had 'size'
+ * buckets when the sweep began. After a split, bucket 'i' of the old
+ * table is buckets 'i', 'i + size', ... of the new one.
+ */
+struct hash_table_cursor
+{
+    size_t size;
+    size_t pos;
+    size_t end;
+};
+typedef struct hash_table_cursor hash_table_cursor;
+
+#define hash_table_cursor_done(c)   ((c)->pos >= (c)->end)
+
+
+
+/*
+ * Point cursor 'c' at partition 'part' of 'nparts' (nparts == 0
+ * for the whole table).
+ *
+ * Returns:
+ *   On success: 0
+ *   On failure: -EINVAL
+ */
+extern int hash_table_cursor_init(hash_table_t, hash_table_cursor * c,
+                                  size_t part, size_t nparts);
+
+
+
+/*
+ * Visit the next 'k' (or so; 0 for all that are left) buckets of
+ * cursor 'c', calling 'apply' for each item. Stop when
+ * hash_table_cursor_done(c).
+ *
+ * Returns:
+ *   On success: >= 0
+ *      Number of items visited
+ *   On failure: < 0
+ *      -EINVAL     if 'c' or 'apply' is NULL
+ */
+extern int hash_table_sweep_apply(hash_table_t, hash_table_cursor * c, size_t k,
+        void (*apply)(void * cookie, const void *), void * cookie);
+
+
+
+/*
+ * Visit the next 'k' (or so) buckets of cursor 'c' and remove the
+ * items for which 'pred' returns true.
+ *
+ * Returns:
+ *   On success: >= 0
+ *      Number of items removed
+ *   On failure: < 0
+ *      -EINVAL     if 'c' or 'pred' is NULL
+ */
+extern int hash_table_sweep_remove_if(hash_table_t, hash_table_cursor * c, size_t k,
+             int (*pred) (void * cookie, const void * p),
+             void * cookie);
+
+
+
+/*
+ * hash_table_apply() and hash_table_remove_if() on 'nthreads'
+ * threads (0: one per CPU). If the threads or their memory are
+ * unavailable, the sweep runs serially on the caller's thread.
+ *
+ * Returns:
+ *   On success: >= 0
+ *      0 for apply, number of items deleted for remove_if
+ *   On failure: < 0
+ *      -EINVAL     if the function is NULL
+ */
+extern int hash_table_apply_par(hash_table_t, int nthreads,
+        void (*apply)(void * cookie, const void *), void * cookie);
+
+extern int hash_table_remove_if_par(hash_table_t, int nthreads,
+             int (*pred) (void * cookie, const void * p),
+             void * cookie);
+
+
+
 /*
  * Return the statistics for the hash table.
  */
@@ -338,6 +445,23 @@ extern int hash_table_bucket_iter_new(hash_table_iter_t* p_ret,
 
 
 
+/*
+ * Initialize and return an iterator over partition 'part' of
+ * 'nparts' of the hash-table buckets (a contiguous range of them;
+ * the partitions together cover the table). Meant for walking a
+ * table on several threads, one partition each.
+ *
+ * Returns:
+ *   On success: 0 and sets p_ret to the newly created iterator
+ *   On failure:
+ *      -EINVAL if table or p_ret is NULL or part >= nparts
+ *      -ENOMEM if unable to allocate any memory.
+ */
+extern int hash_table_part_iter_new(hash_table_iter_t* p_ret, hash_table_t,
+                                    size_t part, size_t nparts);
+
+
+
 /*
  * The inverse of the hash_table_iter_new() functions.
  */
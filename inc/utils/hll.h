@@ -0,0 +1,261 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/hll.h - HyperLogLog cardinality estimator.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notation:
+ * =========
+ *   p  = precision; the sketch has m = 2^p registers and a standard
+ *        error of about 1.04/sqrt(m) (0.81% for p = 14).
+ *   p' = 25; precision of the sparse representation.
+ *
+ * Notes:
+ * ======
+ *   o Like the bloom filters, the sketch takes a 64-bit hash of the
+ *     item and not the item itself. Use one of the 64-bit functions
+ *     in hashfunc.h (fasthash64, city_hash, ..), siphash.h or
+ *     xxhash.h. Sketches can only be merged if they were fed by the
+ *     same hash function (and seed).
+ *
+ *   o A new sketch is sparse (as in HLL++ [2]): it keeps a sorted
+ *     list of (index, rank) pairs at precision p'. This is exact
+ *     for small sets - and small. Once the list needs more memory
+ *     than the dense registers, the sketch turns dense.
+ *
+ *   o Dense registers are 6 bits each, packed 4 to 3 bytes
+ *     (little endian); m = 2^14 registers take 12 kB.
+ *
+ *   o The estimate uses the improved raw estimator of Ertl [3]; it
+ *     is unbiased over the whole range without the empirical bias
+ *     tables of HLL++.
+ *
+ *   o Merging two dense sketches unpacks the registers into bytes,
+ *     takes the max 16 at a time with SSE and packs them again.
+ *
+ *   o Sketches can be marshalled to a buffer or a file; the file
+ *     can be mapped back in and used in-situ (HLL_MMAP). See
+ *     hll.c for the format. Like bloom_marshal.c, the data is
+ *     protected by a SHA256 checksum that is verified on unmarshal.
+ *
+ *   o A sketch is not thread safe. Keep one per thread and merge
+ *     them.
+ *
+ * References:
+ * ===========
+ * [1] HyperLogLog: the analysis of a near-optimal cardinality
+ *     estimation algorithm
+ *     http://algo.inria.fr/flajolet/Publications/FlFuGaMe07.pdf
+ *
+ * [2] HyperLogLog in Practice: Algorithmic Engineering of a State
+ *     of The Art Cardinality Estimation Algorithm
+ *     https://research.google.com/pubs/pub40671.html
+ *
+ * [3] New cardinality estimation algorithms for HyperLogLog
+ *     sketches, Otmar Ertl
+ *     https://arxiv.org/abs/1702.01284
+ */
+
+#ifndef ___UTILS_HLL_H_4417023_1476741206__
+#define ___UTILS_HLL_H_4417023_1476741206__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "utils/utils.h"
+
+
+#define HLL_MIN_P       4
+#define HLL_MAX_P       18
+#define HLL_SPARSE_P    25
+
+/*
+ * Unsorted sparse entries buffered before they are merged into the
+ * sorted list.
+ */
+#define HLL_TMPSZ       64
+
+/*
+ * Flags
+ */
+#define HLL_MMAP        (1 << 0)    /* registers are in a file mapping */
+
+
+struct hll
+{
+    uint8_t    p;
+    uint8_t    flags;
+    uint32_t   m;
+    uint32_t   nbytes;      // size of the packed dense registers
+
+    // Dense registers; NULL while the sketch is sparse
+    uint8_t *  regs;
+
+    // Sparse entries: (index' << 6 | rank'), sorted and unique by
+    // index'.
+    uint32_t * sparse;
+    uint32_t   nsparse;
+    uint32_t   sparse_cap;
+    uint32_t   ntmp;
+    uint32_t   tmp[HLL_TMPSZ];
+
+    // File mapping of an unmarshalled sketch (HLL_MMAP)
+    void *     map;
+    size_t     maplen;
+};
+typedef struct hll hll;
+
+
+/*
+ * Initialize sketch 'h' with 2^p registers.
+ *
+ * Returns 0 on success, -EINVAL if p is out of range.
+ */
+extern int hll_init(hll * h, int p);
+
+/*
+ * Free the storage of 'h'; does not free 'h'.
+ */
+extern void hll_fini(hll * h);
+
+/*
+ * Make a new sketch with 2^p registers; NULL if p is out of range
+ * or if there is no memory.
+ */
+extern hll * hll_new(int p);
+
+extern void hll_delete(hll * h);
+
+/*
+ * Forget everything added so far; the sketch becomes sparse again.
+ */
+extern void hll_reset(hll * h);
+
+
+/*
+ * Internal: add to a sparse sketch.
+ */
+extern void __hll_add_sparse(hll * h, uint64_t hash);
+
+/*
+ * Add an item by its 64-bit hash.
+ */
+static inline void
+hll_add(hll * h, uint64_t hash)
+{
+    if (h->regs) {
+        uint32_t j  = (uint32_t)(hash >> (64 - h->p));
+        uint64_t w  = hash << h->p;
+        uint32_t r  = w ? (uint32_t)__builtin_clzll(w) + 1 : 65u - h->p;
+        uint8_t *g  = h->regs + 3 * (j >> 2);
+        uint32_t sh = 6 * (j & 3);
+        uint32_t x  = g[0] | (g[1] << 8) | ((uint32_t)g[2] << 16);
+
+        if (r > ((x >> sh) & 63)) {
+            x = (x & ~(63u << sh)) | (r << sh);
+            g[0] = x;
+            g[1] = x >> 8;
+            g[2] = x >> 16;
+        }
+    } else {
+        __hll_add_sparse(h, hash);
+    }
+}
+
+/*
+ * Estimated number of distinct items added.
+ */
+extern uint64_t hll_count(hll * h);
+
+/*
+ * Merge 'src' into 'dst'; afterwards 'dst' estimates the
+ * cardinality of the union. Both must have the same precision.
+ *
+ * Returns 0 on success, -EINVAL on mismatched precision.
+ */
+extern int hll_merge(hll * dst, hll * src);
+
+/*
+ * Convert 'h' to dense registers (no-op if already dense). Useful
+ * when the sketch is known to grow large.
+ */
+extern void hll_todense(hll * h);
+
+static inline int
+hll_is_dense(const hll * h)
+{
+    return !!h->regs;
+}
+
+/*
+ * Return true if 'a' and 'b' have the same precision and register
+ * values (regardless of representation).
+ */
+extern int hll_eq(hll * a, hll * b);
+
+
+/*
+ * Marshal/Unmarshal interface
+ */
+
+/*
+ * Number of bytes hll_marshal_buf() needs for 'h'.
+ */
+extern size_t hll_marshal_size(hll * h);
+
+/*
+ * Marshal 'h' into 'buf'.
+ *
+ * Returns the number of bytes written, -ENOSPC if 'buf' is smaller
+ * than hll_marshal_size().
+ */
+extern ssize_t hll_marshal_buf(hll * h, void * buf, size_t bufsz);
+
+/*
+ * Unmarshal a sketch from 'buf' into 'h'; 'h' is initialized by
+ * this function and owns a copy of the data.
+ *
+ * Returns:
+ *   o 0 on success
+ *   o -EILSEQ: bad header, bad data or checksum failure
+ *   o -ENOMEM: no memory
+ */
+extern int hll_unmarshal_buf(hll * h, const void * buf, size_t bufsz);
+
+/*
+ * Marshal 'h' into 'fname'. The file is written to a temporary and
+ * renamed over 'fname'.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+extern int hll_marshal(hll * h, const char * fname);
+
+/*
+ * Unmarshal a sketch from 'fname' into a new sketch '*p_h'. If
+ * flags has HLL_MMAP, dense registers are used in-situ from a
+ * private (copy on write) mapping of the file.
+ *
+ * Returns 0 on success; -EILSEQ, -ENOMEM or -errno on failure.
+ */
+extern int hll_unmarshal(hll ** p_h, const char * fname, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_HLL_H_4417023_1476741206__ */
+
+/* EOF */
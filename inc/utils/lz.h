@@ -0,0 +1,205 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/lz.h - Fast LZ77 block and frame codec.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * A byte oriented LZ77 codec for in-memory data (cache values,
+ * blocks): hundreds of MB/s to compress and GB/s to decompress per
+ * core, at a lower ratio than zlib.
+ *
+ * Blocks use the LZ4 block format [1]: a sequence is a token (4
+ * bits of literal length, 4 bits of match length), the literals, a
+ * 16-bit offset (so a 64KB window) and a match of at least 4 bytes;
+ * longer lengths continue in bytes of 255. The last 5 bytes are
+ * always literals.
+ *
+ *   o Level 1 (LZ_FAST) looks up one candidate per position in a
+ *     hash table of 4 byte sequences and skips ahead faster the
+ *     longer it finds nothing - incompressible data goes by quickly.
+ *
+ *   o Levels 2 .. LZ_MAXLEVEL (LZ_HC) follow a hash chain of all the
+ *     earlier positions (2^(level - 1) of them) for the longest
+ *     match, and defer a match by one byte if that finds a longer
+ *     one: slower to compress, same speed to decompress.
+ *
+ *   The decoder copies literals and matches 16 (or 8) bytes at a
+ *   time when the buffers have room, and checks every length and
+ *   offset against the buffers - corrupt input is an error, never
+ *   an overrun.
+ *
+ * Dictionaries: a lz_dict (up to the last 64KB of some sample data)
+ * is a window of history that every block compressed with it can
+ * refer to - small values that share structure compress much better.
+ * The decoder needs the same dictionary.
+ *
+ * Frames: lz_stream compresses a stream of any length into a self
+ * describing frame of blocks:
+ *
+ *     magic[4] version[1] flags[1] log2(blocksize)[1] hdr-csum[1]
+ *     { size[4] data[size] [XXH32(data)[4]] } ...
+ *     0[4] [XXH32(content)[4]]
+ *
+ * All integers are little endian. The top bit of a block size marks
+ * a block that is stored as is (it didn't compress). The header
+ * checksum is the second byte of XXH32 of the header. With
+ * LZ_LINKED, each block may refer to the 64KB before it (better
+ * ratio for small blocks; the blocks can only be decoded in order).
+ *
+ * References:
+ * ===========
+ * [1] LZ4 block format, Y. Collet,
+ *     https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+#ifndef ___UTILS_LZ_H_1802243_1477784105__
+#define ___UTILS_LZ_H_1802243_1477784105__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * Compression levels
+ */
+#define LZ_FAST         1
+#define LZ_HC           6
+#define LZ_MAXLEVEL     9
+
+/*
+ * Largest block and the worst case compressed size of 'n' bytes.
+ */
+#define LZ_MAXBLOCK     0x7e000000U
+#define LZ_BOUND(n)     ((n) + (n) / 255 + 16)
+
+/*
+ * Compress 'n' bytes of 'src' into 'dst' at 'level' (0 is
+ * LZ_FAST).
+ *
+ * Returns the compressed size, -ENOSPC if it doesn't fit in
+ * 'dstsz' bytes (LZ_BOUND(n) always fits), -E2BIG if 'n' is more
+ * than LZ_MAXBLOCK, -ENOMEM.
+ */
+extern ssize_t lz_compress(void * dst, size_t dstsz, const void * src,
+                           size_t n, int level);
+
+/*
+ * Decompress block 'src' of 'n' bytes into 'dst'.
+ *
+ * Returns the decompressed size, -ENOSPC if it is more than 'dstsz'
+ * or -EINVAL if the block is corrupt.
+ */
+extern ssize_t lz_decompress(void * dst, size_t dstsz, const void * src,
+                             size_t n);
+
+
+
+/*
+ * Dictionaries
+ */
+struct lz_dict;
+typedef struct lz_dict lz_dict;
+
+/*
+ * Make a dictionary from the last 64KB of 'n' bytes at 'd' (the
+ * data is copied). Returns 0 or -ENOMEM.
+ */
+extern int  lz_dict_new(lz_dict ** p_d, const void * d, size_t n);
+extern void lz_dict_delete(lz_dict * d);
+
+extern ssize_t lz_compress_dict(void * dst, size_t dstsz, const void * src,
+                                size_t n, const lz_dict * d, int level);
+
+extern ssize_t lz_decompress_dict(void * dst, size_t dstsz, const void * src,
+                                  size_t n, const lz_dict * d);
+
+
+
+/*
+ * Frames
+ */
+
+/* Flags */
+#define LZ_BLOCK_CSUM   (1 << 0)    /* XXH32 of each block */
+#define LZ_CONTENT_CSUM (1 << 1)    /* XXH32 of the whole content */
+#define LZ_LINKED       (1 << 2)    /* blocks refer to earlier ones */
+
+struct lz_opt
+{
+    int      level;         // 0: LZ_FAST
+    uint32_t blocksize;     // 64KB .. 4MB, a power of 2; 0: 256KB
+    uint32_t flags;         // LZ_xxx
+};
+typedef struct lz_opt lz_opt;
+
+
+/*
+ * Output of a stream: write 'n' bytes at 'buf'; return 0 or
+ * -errno (which the stream call then returns).
+ */
+typedef int (*lz_writer)(void * ctx, const void * buf, size_t n);
+
+struct lz_stream;
+typedef struct lz_stream lz_stream;
+
+/*
+ * Make a stream that compresses (decompresses) what it is given to
+ * a frame (from a frame) and writes it with 'w'. Options 'o' may
+ * be NULL for the defaults (LZ_FAST, 256KB, LZ_CONTENT_CSUM).
+ *
+ * Returns 0, -EINVAL for bad options, -ENOMEM.
+ */
+extern int lz_stream_compress_new(lz_stream ** p_s, const lz_opt * o,
+                                  lz_writer w, void * ctx);
+extern int lz_stream_decompress_new(lz_stream ** p_s, lz_writer w, void * ctx);
+
+extern void lz_stream_delete(lz_stream * s);
+
+/*
+ * Add 'n' bytes; full blocks are written out as they fill up.
+ * Returns 0 or the writer's error.
+ */
+extern int lz_stream_compress(lz_stream * s, const void * buf, size_t n);
+
+/*
+ * Write the last block and the end of the frame.
+ */
+extern int lz_stream_compress_end(lz_stream * s);
+
+/*
+ * Add 'n' bytes of the frame (split anywhere); the data of each
+ * block is written out when the block is complete.
+ *
+ * Returns 0, the writer's error, -EINVAL if the frame is corrupt,
+ * -EBADMSG if a checksum doesn't match, -EPROTO for an unknown
+ * version.
+ */
+extern int lz_stream_decompress(lz_stream * s, const void * buf, size_t n);
+
+/*
+ * Returns 0 if a whole frame was seen, -EINVAL otherwise.
+ */
+extern int lz_stream_decompress_end(lz_stream * s);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_LZ_H_1802243_1477784105__ */
+
+/* EOF */
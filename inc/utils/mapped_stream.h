@@ -0,0 +1,122 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * mapped_stream.h - Sequential reader of very large files through
+ *                   a sliding mmap window.
+ *
+ * Mapping a whole multi-GB file costs address space and leaves the
+ * page cache to fill up with pages that are never read again.
+ * mapped_stream maps a window of the file at a time. The caller
+ * parses as many whole records as fit and advances by the bytes it
+ * consumed; the next window starts there, so a record straddling
+ * the window boundary shows up whole in the next window.
+ *
+ * While the caller works on one window, a helper thread reads the
+ * next one into the page cache. Windows that have been consumed
+ * are dropped from the page cache so that RSS and cache footprint
+ * stay bounded by a few windows regardless of the file size.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef __UTILS_MAPPED_STREAM_H_1471302318__
+#define __UTILS_MAPPED_STREAM_H_1471302318__ 1
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "utils/mmap.h"
+
+namespace putils {
+
+
+class mapped_stream
+{
+public:
+
+// These are flags for the CTOR.
+#define MSTREAM_PREFETCH    1   // read the next window on a helper thread
+#define MSTREAM_DROP        2   // drop consumed data from the page cache
+
+#define MSTREAM_DEFAULT_WINDOW  (64 * 1024 * 1024)
+
+
+    // Open 'filename' and map its first window. 'window' is
+    // rounded up to a multiple of the page size; 0 picks
+    // MSTREAM_DEFAULT_WINDOW.
+    mapped_stream(const std::string& filename, size_t window = 0,
+                  unsigned int flags = MSTREAM_PREFETCH|MSTREAM_DROP);
+    virtual ~mapped_stream();
+
+
+    // Current window: size() bytes at file offset offset().
+    const uint8_t * data() const    { return m_data; }
+    size_t          size() const    { return m_size; }
+    off_t           offset() const  { return m_off; }
+
+    // True if the current window extends to the end of the file
+    bool  at_end() const { return m_off + off_t(m_size) >= m_file.filesize(); }
+
+
+    // Move past 'consumed' bytes of the current window; the next
+    // window starts right after them. If a caller can't consume
+    // anything (a record larger than the window), the window at
+    // the same offset is doubled instead (and stays doubled).
+    //
+    // Returns false when there is nothing left to read.
+    bool  advance(size_t consumed);
+
+    // Move past the entire window.
+    bool  advance() { return advance(m_size); }
+
+
+    size_t window() const                 { return m_window; }
+    const std::string& filename() const   { return m_file.filename(); }
+
+private:
+    mapped_stream(const mapped_stream&);
+    mapped_stream& operator=(const mapped_stream&);
+
+    void  map(off_t off, size_t window);
+    void  prefetch(off_t off);
+    static void * helper(void *);
+
+private:
+    mmap_file       m_file;
+    unsigned int    m_flags;
+    size_t          m_window;
+    size_t          m_pgsize;
+
+    uint8_t *       m_map;      // page aligned mapping
+    size_t          m_maplen;
+    const uint8_t * m_data;
+    size_t          m_size;
+    off_t           m_off;
+
+    off_t           m_dropped;  // page cache dropped up to here
+
+    // Helper thread state; guarded by m_lock
+    pthread_t       m_tid;
+    pthread_mutex_t m_lock;
+    pthread_cond_t  m_cond;
+    off_t           m_pf_off;   // next range to prefetch, -1 if none
+    size_t          m_pf_len;
+    bool            m_quit;
+    bool            m_helper;
+};
+
+}
+
+#endif /* ! __UTILS_MAPPED_STREAM_H_1471302318__ */
+
+/* EOF */
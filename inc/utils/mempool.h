@@ -72,6 +72,7 @@
 #include <assert.h>
 
 #include "utils/memmgr.h"
+#include "utils/metrics.h"
 
     /* Provide C linkage for symbols declared here .. */
 #ifdef __cplusplus
@@ -221,6 +222,21 @@ unsigned int mempool_block_size(struct mempool* a);
 unsigned int mempool_total_blocks(struct mempool* a);
 
 
+/** Record allocator metrics.
+ *
+ *  Counts allocations, frees, failed allocations and chunks taken
+ *  from the underlying allocator (counters mempool_alloc,
+ *  mempool_free, mempool_alloc_fail, mempool_chunks) and blocks in
+ *  use (gauge mempool_inuse) in 'r' under labels 'labels'.
+ *
+ *  The counters are lock-free but a mempool still needs its own
+ *  lock when shared between threads.
+ *
+ *  @return 0 on success, -ENOMEM if out of memory
+ */
+int mempool_metrics(struct mempool* a, metrics_registry* r, const char* labels);
+
+
 /** Turn the mempool into a memgr interface.
  *  Basically, given a higher level of allocator, stack the mempool
  *  interface on top of it.
@@ -0,0 +1,325 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * metrics.h - Lock-free counters, gauges and histograms.
+ *
+ * Recording never takes a lock:
+ *
+ *  - counters are sharded across cache lines; each thread adds to
+ *    its own shard and a read sums the shards.
+ *  - gauges are a single atomic word.
+ *  - histograms are HDR style log-linear: values below 2^S have a
+ *    bucket each, every power of two above is split into 2^S
+ *    linear sub-buckets (S = METRICS_HIST_BITS). Recording is a
+ *    bucket index computation and two atomic adds; the relative
+ *    error of any reported value is below 2^-S (3% for S = 5).
+ *
+ * Metrics live in a registry under a name and an optional label
+ * string ("k1=v1,k2=v2"). The registry lock is only taken to
+ * create a metric or to walk the list during an export; exports
+ * read the values with atomic loads while recorders carry on.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___METRICS_H_6630771_1476138022__
+#define ___METRICS_H_6630771_1476138022__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/*
+ * Counter shards; power of 2.
+ */
+#ifndef METRICS_SHARDS
+#define METRICS_SHARDS      16
+#endif
+
+#define METRICS_CACHELINE   64
+
+/*
+ * Histogram precision: 2^METRICS_HIST_BITS sub-buckets per power
+ * of two.
+ */
+#define METRICS_HIST_BITS       5
+#define METRICS_HIST_SUB        (1 << METRICS_HIST_BITS)
+#define METRICS_HIST_BUCKETS    ((64 - METRICS_HIST_BITS + 1) << METRICS_HIST_BITS)
+
+
+/*
+ * Metric types
+ */
+#define METRICS_COUNTER     1
+#define METRICS_GAUGE       2
+#define METRICS_HIST        3
+
+/*
+ * Export formats
+ */
+#define METRICS_TEXT        1   /* one "name{labels} value" per line */
+#define METRICS_BINARY      2   /* see metrics_export() */
+
+
+struct metrics_counter
+{
+    struct {
+        uint64_t v;
+        uint8_t  pad[METRICS_CACHELINE - sizeof(uint64_t)];
+    } s[METRICS_SHARDS] __attribute__((aligned(METRICS_CACHELINE)));
+};
+typedef struct metrics_counter metrics_counter;
+
+
+struct metrics_gauge
+{
+    int64_t v;
+};
+typedef struct metrics_gauge metrics_gauge;
+
+
+struct metrics_hist
+{
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t b[METRICS_HIST_BUCKETS];
+};
+typedef struct metrics_hist metrics_hist;
+
+
+/*
+ * Point in time copy of a histogram.
+ */
+struct metrics_hist_snap
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t b[METRICS_HIST_BUCKETS];
+};
+typedef struct metrics_hist_snap metrics_hist_snap;
+
+
+struct metrics_registry;
+typedef struct metrics_registry metrics_registry;
+
+
+/*
+ * Shard of the calling thread
+ */
+extern __thread unsigned __metrics_shard;
+extern unsigned __metrics_shard_init(void);
+
+static inline unsigned
+__metrics_my_shard(void)
+{
+    unsigned i = __metrics_shard;
+
+    return (i ? i : __metrics_shard_init()) - 1;
+}
+
+
+static inline void
+metrics_counter_add(metrics_counter * c, uint64_t n)
+{
+    __atomic_fetch_add(&c->s[__metrics_my_shard()].v, n, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_counter_inc(metrics_counter * c)
+{
+    metrics_counter_add(c, 1);
+}
+
+
+static inline void
+metrics_gauge_set(metrics_gauge * g, int64_t v)
+{
+    __atomic_store_n(&g->v, v, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_gauge_add(metrics_gauge * g, int64_t v)
+{
+    __atomic_fetch_add(&g->v, v, __ATOMIC_RELAXED);
+}
+
+static inline int64_t
+metrics_gauge_read(metrics_gauge * g)
+{
+    return __atomic_load_n(&g->v, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Bucket of value 'v'
+ */
+static inline unsigned
+metrics_hist_index(uint64_t v)
+{
+    unsigned e;
+
+    if (v < METRICS_HIST_SUB) return (unsigned)v;
+
+    e = 63 - __builtin_clzll(v);
+    return ((e - METRICS_HIST_BITS + 1) << METRICS_HIST_BITS)
+         | (unsigned)((v >> (e - METRICS_HIST_BITS)) & (METRICS_HIST_SUB - 1));
+}
+
+
+static inline void
+metrics_hist_record(metrics_hist * h, uint64_t v)
+{
+    uint64_t x;
+
+    __atomic_fetch_add(&h->b[metrics_hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+
+    /* New extremes are rare; the loads are almost always enough */
+    x = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (v < x && !__atomic_compare_exchange_n(&h->min, &x, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    x = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > x && !__atomic_compare_exchange_n(&h->max, &x, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/*
+ * Sum of all shards
+ */
+extern uint64_t metrics_counter_read(metrics_counter * c);
+
+
+/*
+ * Copy a histogram; recorders are not paused, so the copy may be
+ * a few records out of step with the sum.
+ */
+extern void metrics_hist_snapshot(metrics_hist * h, metrics_hist_snap * s);
+
+
+/*
+ * Value at quantile 'q' (0.0 .. 1.0): the highest value that falls
+ * in the same bucket. 0 if the histogram is empty.
+ */
+extern uint64_t metrics_hist_quantile(const metrics_hist_snap * s, double q);
+
+
+/*
+ * Smallest value that falls into bucket 'idx'.
+ */
+extern uint64_t metrics_hist_bucket_lo(unsigned idx);
+
+
+/*
+ * Make an empty registry; returns NULL if out of memory.
+ */
+extern metrics_registry * metrics_registry_new(void);
+
+/*
+ * Free a registry and all its metrics. Nothing may record into its
+ * metrics any more.
+ */
+extern void metrics_registry_delete(metrics_registry * r);
+
+/*
+ * The process wide registry.
+ */
+extern metrics_registry * metrics_default(void);
+
+
+/*
+ * Find or make a metric called 'name' with labels 'labels' (may be
+ * NULL). Asking for an existing name and labels with a different
+ * type, or running out of memory, returns NULL.
+ *
+ * The metric lives as long as the registry; look it up once and
+ * keep the pointer.
+ */
+extern metrics_counter * metrics_counter_get(metrics_registry * r, const char * name, const char * labels);
+extern metrics_gauge *   metrics_gauge_get(metrics_registry * r, const char * name, const char * labels);
+extern metrics_hist *    metrics_hist_get(metrics_registry * r, const char * name, const char * labels);
+
+
+/*
+ * Counters for a queue called 'name': name_enq, name_deq and
+ * name_enq_blocked, name_deq_blocked (producer found the queue full,
+ * consumer found it empty). Attach to a SYNCQ with SYNCQ_METRICS().
+ */
+struct metrics_queue
+{
+    metrics_counter * enq;
+    metrics_counter * deq;
+    metrics_counter * enq_blocked;
+    metrics_counter * deq_blocked;
+};
+typedef struct metrics_queue metrics_queue;
+
+/*
+ * Returns 0 or -ENOMEM.
+ */
+extern int metrics_queue_init(metrics_queue * m, metrics_registry * r,
+                              const char * name, const char * labels);
+
+
+/*
+ * Number of metrics in the registry
+ */
+extern size_t metrics_count(metrics_registry * r);
+
+
+/*
+ * Export sink; returns 0 or -errno to stop the export.
+ */
+typedef int (*metrics_writer)(void * ctx, const void * buf, size_t n);
+
+
+/*
+ * Write every metric in 'r' to 'w' in format 'fmt'.
+ *
+ * METRICS_TEXT writes counters and gauges as "name{labels} value"
+ * and histograms as name_count, name_sum, name_min, name_max and
+ * name{labels,quantile="q"} lines for q = 0.5, 0.9, 0.99, 0.999.
+ *
+ * METRICS_BINARY writes, all little endian:
+ *
+ *    "MTRC" u32 version(1) u64 time(us) u32 nmetrics
+ *    per metric:
+ *      u8 type, u16 namelen, name, u16 labellen, labels
+ *      counter, gauge: u64 value
+ *      histogram:      u64 count, sum, min, max; u16 nbuckets;
+ *                      nbuckets x (u16 index, u64 count)
+ *    with only non-empty histogram buckets written.
+ *
+ * Returns 0 or the error from the writer.
+ */
+extern int metrics_export(metrics_registry * r, int fmt, metrics_writer w, void * ctx);
+
+
+/*
+ * metrics_export() to a stdio stream.
+ */
+extern int metrics_export_file(metrics_registry * r, int fmt, FILE * fp);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___METRICS_H_6630771_1476138022__ */
+
+/* EOF */
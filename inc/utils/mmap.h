@@ -18,7 +18,7 @@
 #define __UTILS_MMAP_H_1126972734__ 1
 
 #include <string>
-#include <list>
+#include <map>
 #include <utility>
 
 #include <sys/types.h>
@@ -36,6 +36,7 @@ public:
 //
 //   o MMAP_PRIVATE and MMAP_SHARED are exclusive
 //   o MMAP_RDONLY  and MMAP_RDWR   are ecclusive
+//   o MMAP_CREATE with MMAP_RDWR creates the file if needed
 #define MMAP_CREATE       1
 #define MMAP_RDONLY      (0 << 1)   // default is read-only
 #define MMAP_RDWR        (1 << 1)
@@ -43,13 +44,40 @@ public:
 #define MMAP_PRIVATE     (0 << 2)   // default is private
 #define MMAP_SHARED      (1 << 2)
 
+// Mapping options. These can be given to the CTOR (they apply to
+// every mapping of the file) or to mmap() for one mapping. All of
+// them are hints: they are silently ignored where the OS doesn't
+// support them.
+//
+//   o MMAP_SEQUENTIAL, MMAP_RANDOM and MMAP_WILLNEED are exclusive
+//     access pattern advice (madvise(2)).
+//   o MMAP_POPULATE pre-faults the whole mapping (MAP_POPULATE).
+//   o MMAP_HUGEPAGE asks for transparent huge pages.
+#define MMAP_SEQUENTIAL  (1 << 8)
+#define MMAP_RANDOM      (2 << 8)
+#define MMAP_WILLNEED    (3 << 8)
+#define MMAP_ADVICE_MASK (3 << 8)
+#define MMAP_POPULATE    (1 << 10)
+#define MMAP_HUGEPAGE    (1 << 11)
+
+#define MMAP_OPTS_MASK   (MMAP_ADVICE_MASK | MMAP_POPULATE | MMAP_HUGEPAGE)
+
 
     mmap_file(const std::string& filename, unsigned int flags = 0);
     virtual ~mmap_file();
 
-    // map 'mapsize' bytes at 'mapoff'
+    // map 'mapsize' bytes at 'mapoff' with the options given to
+    // the CTOR
     void * mmap(off_t mapoff, size_t mapsize);
 
+    // map 'mapsize' bytes at 'mapoff' with options 'opts'
+    // (MMAP_SEQUENTIAL etc.) instead of the ones given to the CTOR.
+    // If 'numa_node' is >= 0, the pages of the mapping are bound
+    // to that NUMA node. An existing mapping of the same range is
+    // returned only if it has the same options and node.
+    void * mmap(off_t mapoff, size_t mapsize, unsigned int opts,
+                int numa_node = -1);
+
     // mmap entire file
     void * mmap() { return mmap(0, size_t(m_filesize)); }
 
@@ -57,6 +85,24 @@ public:
     void  unmap(void * ptr);
 
 
+    // Change the access pattern advice (MMAP_SEQUENTIAL,
+    // MMAP_RANDOM, MMAP_WILLNEED, MMAP_HUGEPAGE) for 'n' bytes at
+    // 'p'. 'p' is rounded down and 'n' up to page boundaries.
+    void  advise(void * p, size_t n, unsigned int opts);
+
+
+    // Start reading 'n' bytes at file offset 'off' into memory
+    // without waiting for it; later mappings (or faults on existing
+    // ones) of this range don't have to wait for I/O.
+    void  prefetch(off_t off, size_t n);
+
+
+    // Tell the OS that 'n' bytes at file offset 'off' won't be
+    // needed again and can be dropped from the page cache. Only
+    // unmapped, clean pages are dropped.
+    void  drop(off_t off, size_t n);
+
+
     // lock 'n' bytes of memory at address 'p'. This prevents these
     // pages from being paged out.
     //
@@ -81,9 +127,16 @@ public:
     void  munlock(void * p, size_t n);
 
 
+    // Number of live mappings
+    size_t nmappings() const            { return m_mappings.size(); }
+
     off_t filesize() const              { return m_filesize; }
     const std::string& filename() const { return m_filename; }
 
+    // The open file descriptor (for locks etc.); owned by this
+    // object.
+    int fd() const                      { return int(m_fd); }
+
 #if 0
     // Ensure that file 'f' is exactly 'size' bytes big, create if
     // required.
@@ -98,58 +151,78 @@ protected:
     mmap_file();
     const char * fn() const { return m_filename.c_str(); };
 
-    // Find off+size pair in m_mappings
-    void * find(off_t off, size_t size)
+    // Find a mapping of off+size with the same options
+    void * find(off_t off, size_t size, unsigned int opts, int numa_node)
     {
-        all_mappings::iterator i  = m_mappings.begin(),
-                              end = m_mappings.end();
-        while (i != end)
-        {
-            const mapping& m = *i;
+        by_extent::const_iterator i = m_extents.find(extent(off, size, opts, numa_node));
+
+        return i == m_extents.end() ? 0 : i->second;
+    };
 
-            if ( m.off == off && m.size == size )
-                return m.ptr;
-            ++i;
-        }
 
-        return 0;
+    // Record a new mapping
+    void add_mapping(void * ptr, size_t size, off_t off, unsigned int opts, int numa_node)
+    {
+        m_mappings.insert(std::make_pair(ptr, mapping(ptr, size, off, opts, numa_node)));
+        m_extents.insert(std::make_pair(extent(off, size, opts, numa_node), ptr));
     };
 
 
     // Erase node containing 'ptr'
     std::pair<void *, size_t> maybe_erase(void * ptr)
     {
-        all_mappings::iterator i  = m_mappings.begin(),
-                              end = m_mappings.end();
-        while (i != end)
-        {
-            const mapping& m = *i;
+        all_mappings::iterator i = m_mappings.find(ptr);
 
-            if ( ptr == m.ptr )
-            {
-                std::pair<void *, size_t> p(ptr, m.size);
+        if ( i == m_mappings.end() )
+            return std::make_pair((void *)0, 0);
 
-                m_mappings.erase(i);
-                return p;
-            }
-            ++i;
-        }
+        const mapping& m = i->second;
+        std::pair<void *, size_t> p(ptr, m.size);
 
-        return std::make_pair((void *)0, 0);
+        m_extents.erase(extent(m.off, m.size, m.opts, m.numa));
+        m_mappings.erase(i);
+        return p;
     };
 
 protected:
     struct mapping
     {
-        void * ptr;
-        size_t size;
-        off_t  off;
+        void *       ptr;
+        size_t       size;
+        off_t        off;
+        unsigned int opts;
+        int          numa;
+
+        mapping(void * p, size_t sz, off_t offset, unsigned int o, int n):
+            ptr(p), size(sz), off(offset), opts(o), numa(n) { }
+    };
+
+    // A mapping is reused only for the same range, options and
+    // NUMA node; the same range with other options is mapped again.
+    struct extent
+    {
+        off_t        off;
+        size_t       size;
+        unsigned int opts;
+        int          numa;
 
-        mapping(void * p, size_t sz, off_t offset):
-            ptr(p), size(sz), off(offset) { }
+        extent(off_t offset, size_t sz, unsigned int o, int n):
+            off(offset), size(sz), opts(o), numa(n) { }
+
+        bool operator<(const extent& x) const
+        {
+            if ( off  != x.off )  return off  < x.off;
+            if ( size != x.size ) return size < x.size;
+            if ( opts != x.opts ) return opts < x.opts;
+            return numa < x.numa;
+        }
     };
 
-    typedef std::list<mapping> all_mappings;
+    // Mappings are indexed by address (for unmap()) and by extent
+    // (for find()); both are O(log n) so that files with thousands
+    // of windows don't pay a linear scan per call.
+    typedef std::map<void *, mapping>       all_mappings;
+    typedef std::map<extent, void *>        by_extent;
 
     unsigned long  m_fd;
     unsigned int   m_flags;
@@ -158,6 +231,7 @@ protected:
     std::string m_filename;
 
     all_mappings m_mappings;
+    by_extent    m_extents;
 
     // XXX Do we keep a list of all locked pages?
 };
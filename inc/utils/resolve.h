@@ -19,6 +19,7 @@
 #ifndef ___RESOLVE_H_3766274_1282531100__
 #define ___RESOLVE_H_3766274_1282531100__ 1
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <net/if.h>
@@ -99,6 +100,106 @@ extern int resolve_host_or_ifname(const char* name, if_addr_vect*, unsigned int
 extern const char* sockaddr_to_string(char * buf, size_t bufsize, const struct sockaddr*);
 
 
+
+/*
+ * Resolution cache
+ * ================
+ * The calls above walk getifaddrs(3) (and maybe ask DNS) every
+ * time. A resolve_cache keeps an immutable snapshot of all the
+ * interfaces and their addresses, and of the hostnames resolved
+ * through it (keyed by name and mask, for 'host_ttl' seconds; at
+ * most RESOLVE_MAXHOSTS of them, the oldest make room).
+ *
+ *   o Lookups read the current snapshot without locks: a reader
+ *     announces itself in a per-thread counter of the current
+ *     epoch; a writer publishes a new snapshot, moves to the next
+ *     epoch and frees the old snapshot once the counters of the
+ *     previous epoch drain.
+ *
+ *   o With RESOLVE_WATCH (Linux), a background thread listens for
+ *     netlink address and link changes (RTM_NEWADDR, RTM_DELADDR,
+ *     ...) and rebuilds the interface table when they happen.
+ *     Elsewhere, call resolve_cache_refresh().
+ *
+ *   o Asynchronous lookups run on the cache's own job_manager
+ *     threads and complete by calling back on one of them.
+ */
+
+#define RESOLVE_WATCH   (1 << 0)    /* refresh on netlink changes */
+
+/* Most hostnames a cache keeps */
+#define RESOLVE_MAXHOSTS    1024
+
+struct resolve_cache;
+typedef struct resolve_cache resolve_cache;
+
+struct resolve_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refreshes;     /* of the interface table */
+    uint64_t gen;           /* snapshots published */
+    uint64_t hosts;         /* hostnames cached */
+};
+typedef struct resolve_cache_stats resolve_cache_stats;
+
+
+/**
+ * Make a cache with 'nthreads' threads for asynchronous lookups (0
+ * for none) that keeps hostnames for 'host_ttl' seconds (0: never).
+ *
+ * Returns:
+ *   0 on success
+ *   -errno  on failure
+ */
+extern int resolve_cache_new(resolve_cache** p_c, int nthreads, unsigned int host_ttl,
+                             unsigned int flags);
+
+
+/**
+ * Wait for pending asynchronous lookups, stop the threads and free
+ * the cache.
+ */
+extern void resolve_cache_delete(resolve_cache*);
+
+
+/**
+ * Cached get_all_if_address() and resolve_host_or_ifname(). A
+ * lookup of an interface that has no addresses returns -ENOENT.
+ */
+extern int resolve_cache_if_address(resolve_cache*, if_address_vect*, unsigned int mask);
+extern int resolve_cache_lookup(resolve_cache*, const char* name, if_addr_vect*,
+                                unsigned int mask);
+
+
+/**
+ * Look up 'name' on a cache thread and call 'fn' there with the
+ * result ('av' is freed when 'fn' returns; VECT_SWAP() it to keep
+ * it).
+ *
+ * Returns:
+ *   0 if the lookup is queued
+ *   -ENOTSUP if the cache has no threads
+ *   -ENOMEM
+ */
+typedef void (*resolve_done_fn)(void* arg, int err, if_addr_vect* av);
+
+extern int resolve_cache_lookup_async(resolve_cache*, const char* name, unsigned int mask,
+                                      resolve_done_fn fn, void* arg);
+
+
+/**
+ * Rebuild the interface table now.
+ *
+ * Returns:
+ *   0 on success
+ *   -errno  on failure
+ */
+extern int resolve_cache_refresh(resolve_cache*);
+
+extern void resolve_cache_stats_get(resolve_cache*, resolve_cache_stats*);
+
+
 #ifdef __cplusplus
 }
 #endif
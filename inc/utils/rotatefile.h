@@ -25,12 +25,24 @@
 namespace putils
 {
 
+/*
+ * Copy the file to its first backup and truncate it instead of
+ * renaming it; for files that writers hold open. The copy is done
+ * in the kernel (see posix/fcopy.h).
+ *
+ * Caveats:
+ *   o Whatever is written between the end of the copy and the
+ *     truncate is lost: it is in neither file.
+ *   o A writer that doesn't use O_APPEND keeps writing at its old
+ *     offset; the file becomes sparse, with a hole as long as what
+ *     was truncated (it reads as zeroes). Writers should open the
+ *     file with O_APPEND.
+ */
+#define ROTATE_COPYTRUNCATE     0x01
 
 
 /**
  * Unconditionally rotate a file and keep the last 'nsaved' copies.
- * Flags is currently unused. It can be used to communicate things
- * like "compress" etc.
  *
  * @param filename  File to rotate
  * @param nsaved    Number of backups to save
@@ -42,8 +54,6 @@ int rotate_filename(const std::string& filename, int nsaved, unsigned int flags
 
 /**
  * Rotate a file if it exceeds size_mb MBytes and keep the last 'nsaved' copies.
- * Flags is currently unused. It can be used to communicate things
- * like "compress" etc.
  *
  * @param filename  File to rotate
  * @param size_mb   File size in Mega bytes (1024*1024 bytes) beyond
@@ -0,0 +1,198 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/shard.h - Map keys to nodes with minimal disruption.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * hash % N moves nearly every key when N changes. The schemes here
+ * move only about 1/N of the keys when a node is added or removed:
+ *
+ *   o Jump consistent hash [1]: no state, O(log N) and very fast;
+ *     but nodes are numbered 0..N-1 and only the last one can be
+ *     removed. Good for shards of a data set that only grows.
+ *
+ *   o Ring (consistent hashing [2]): every node places 'vnodes'
+ *     (times its weight) tokens on a ring of 64-bit hashes; a key
+ *     belongs to the first token at or after it. Lookup is a binary
+ *     search of the sorted tokens. Any node can leave; only its keys
+ *     move.
+ *
+ *   o Maglev [3]: every node fills slots of a table of prime size M
+ *     in the order of its own permutation, in turns. Lookup is one
+ *     table access. Removing a node moves its keys and a few others
+ *     (about 1% with M = 100 x nodes); the table must be rebuilt
+ *     (O(M log M)) on every change.
+ *
+ *   o Weighted rendezvous (HRW [4]): every node scores each key and
+ *     the best score wins; with the logarithmic method of [5] the
+ *     share of node i is exactly w_i / sum(w). Moves the fewest keys
+ *     and has no table, but a lookup is O(N) - fine for tens of
+ *     nodes, or to pick among replicas.
+ *
+ * Nodes are identified by a caller supplied 64-bit id (e.g., a hash
+ * of the node name); keys are 64-bit hashes of the items (use one
+ * of the functions in hashfunc.h). Lookups return the index of the
+ * node in the array of ids given at init time. Tables are built
+ * once and then read only: lookups can be done from many threads.
+ *
+ * References:
+ * ===========
+ * [1] A Fast, Minimal Memory, Consistent Hash Algorithm, Lamping &
+ *     Veach; https://arxiv.org/abs/1406.2294
+ *
+ * [2] Consistent Hashing and Random Trees, Karger et al.
+ *
+ * [3] Maglev: A Fast and Reliable Software Network Load Balancer,
+ *     Eisenbud et al., NSDI 2016
+ *
+ * [4] A Name-Based Mapping Scheme for Rendezvous, Thaler & Ravishankar
+ *
+ * [5] Weighted Distributed Hash Tables, Schindelhauer & Schomaker
+ */
+
+#ifndef ___UTILS_SHARD_H_4417305_1476912630__
+#define ___UTILS_SHARD_H_4417305_1476912630__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include "utils/utils.h"
+
+
+/*
+ * Jump consistent hash: bucket in [0, n) for 'key'; n must be > 0.
+ */
+extern uint32_t jump_hash(uint64_t key, uint32_t n);
+
+/*
+ * Bucket of each of 'nkeys' keys in 'out'.
+ */
+extern void jump_hash_v(const uint64_t * keys, uint32_t * out, size_t nkeys, uint32_t n);
+
+
+/*
+ * Consistent hash ring
+ */
+struct hashring
+{
+    uint64_t *  tok;        // sorted tokens
+    uint32_t *  node;       // node of each token
+    uint32_t    ntok;
+    uint32_t    nnodes;
+};
+typedef struct hashring hashring;
+
+/*
+ * Build a ring of the 'n' nodes in 'ids' with 'vnodes' tokens per
+ * unit of weight. 'wt' is the integer weight of each node; NULL
+ * means all weights are 1 and a weight of 0 leaves a node out.
+ *
+ * Returns 0 on success, -EINVAL if there are no tokens, -ENOMEM.
+ */
+extern int hashring_init(hashring * r, const uint64_t * ids, const uint32_t * wt,
+                         uint32_t n, uint32_t vnodes);
+
+extern void hashring_fini(hashring * r);
+
+/*
+ * Node index for 'key'.
+ */
+extern uint32_t hashring_lookup(const hashring * r, uint64_t key);
+
+extern void hashring_lookup_v(const hashring * r, const uint64_t * keys,
+                              uint32_t * out, size_t nkeys);
+
+
+/*
+ * Maglev lookup table
+ */
+struct maglev
+{
+    uint32_t *  tab;        // m slots
+    uint32_t    m;          // table size - a prime
+    uint32_t    nnodes;
+};
+typedef struct maglev maglev;
+
+/*
+ * Build a table of prime size 'm' (m >= n; about 100 x n keeps the
+ * shares within 1% of each other) for the 'n' nodes in 'ids'. 'wt'
+ * is the weight of each node; NULL means all weights are 1 and a
+ * weight of 0 leaves a node out.
+ *
+ * Returns 0 on success, -EINVAL if 'm' is not a prime or is too
+ * small or there are no nodes, -ENOMEM.
+ */
+extern int maglev_init(maglev * g, const uint64_t * ids, const uint32_t * wt,
+                       uint32_t n, uint32_t m);
+
+extern void maglev_fini(maglev * g);
+
+/*
+ * Node index for 'key'.
+ */
+static inline uint32_t
+maglev_lookup(const maglev * g, uint64_t key)
+{
+    return g->tab[((key >> 32) * (uint64_t)g->m) >> 32];
+}
+
+extern void maglev_lookup_v(const maglev * g, const uint64_t * keys,
+                            uint32_t * out, size_t nkeys);
+
+
+/*
+ * Weighted rendezvous hashing
+ */
+struct hrw
+{
+    uint64_t *  seed;       // mixed node ids
+    double *    wt;         // weights
+    uint32_t    nnodes;
+    uint32_t    uniform;    // all weights equal: compare hashes
+};
+typedef struct hrw hrw;
+
+/*
+ * Prepare the 'n' nodes in 'ids' with weights 'wt' (NULL means all
+ * weights are 1; a weight <= 0 leaves a node out).
+ *
+ * Returns 0 on success, -EINVAL if there are no nodes, -ENOMEM.
+ */
+extern int hrw_init(hrw * h, const uint64_t * ids, const double * wt, uint32_t n);
+
+extern void hrw_fini(hrw * h);
+
+/*
+ * Node index for 'key'.
+ */
+extern uint32_t hrw_lookup(const hrw * h, uint64_t key);
+
+extern void hrw_lookup_v(const hrw * h, const uint64_t * keys,
+                         uint32_t * out, size_t nkeys);
+
+/*
+ * The 'k' best nodes for 'key' (e.g., replicas) in 'out', best
+ * first. Returns the number found: min(k, nodes with weight > 0).
+ */
+extern uint32_t hrw_lookup_k(const hrw * h, uint64_t key, uint32_t * out, uint32_t k);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_SHARD_H_4417305_1476912630__ */
+
+/* EOF */
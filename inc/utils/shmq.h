@@ -0,0 +1,183 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/shmq.h - Bounded inter-process queues in shared memory.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Introduction
+ * ============
+ *   The inter-process cousins of SPSCQ and MPMCQ: a ring of fixed
+ *   size slots in a shared file mapping (mmap_file with
+ *   MMAP_SHARED), so that processes can hand each other messages
+ *   without a system call when the peer is running.
+ *
+ *   The file can be on a tmpfs (/dev/shm) or be a memfd that is
+ *   passed to the other process (fork or SCM_RIGHTS) and opened by
+ *   its name in /proc/self/fd.
+ *
+ *   o  Layout: a versioned header followed by the slots. The header
+ *      has no pointers - only sizes and offsets - so each process
+ *      can map the file anywhere. Attaching to a file of another
+ *      version, word size or geometry fails.
+ *
+ *   o  Queues are either SHMQ_SPSC (one producer and one consumer
+ *      process; a slot handoff is a load and a store-release) or
+ *      SHMQ_MPMC (any number of both; each slot has a sequence
+ *      number as in D. Vyukov's bounded MPMC queue).
+ *
+ *   o  put() and get() never block. put_wait() and get_wait() spin
+ *      briefly and then sleep on a process-shared futex in the
+ *      header; the other side makes the wake-up system call only if
+ *      someone went to sleep since its last one. (Elsewhere they
+ *      poll.)
+ *
+ *   o  Each attached process holds an OFD lock on its entry in the
+ *      header's peer table. The kernel drops the lock when the
+ *      process dies, however it dies; so peers() can tell live
+ *      peers from dead ones (and clears the dead entries), and a
+ *      waiter returns -EPIPE rather than waiting forever for a peer
+ *      that is gone.
+ *
+ *   Caveats:
+ *
+ *   o  An MPMC producer (consumer) that dies between claiming a
+ *      slot and publishing it leaves that slot unfinished; the
+ *      consumers (producers) stop at it. Crash detection tells you
+ *      this may have happened; it doesn't repair the queue.
+ *
+ *   o  Where OFD locks aren't available, process (POSIX) locks are
+ *      used: a process must then attach to a queue only once.
+ *
+ *   o  The lock belongs to the open file: a child forked after
+ *      attaching keeps its parent's entry alive. The child attaches
+ *      on its own (and leaves the inherited object alone).
+ *
+ *   Use:
+ *       // Process A
+ *       shm_queue q("/dev/shm/q", SHMQ_SPSC, 1024, 256, SHMQ_PRODUCER);
+ *       q.put_wait(msg, n, -1);
+ *
+ *       // Process B
+ *       shm_queue q("/dev/shm/q", SHMQ_CONSUMER);
+ *       ssize_t n = q.get_wait(buf, sizeof buf, 1000);
+ */
+
+#ifndef ___UTILS_SHMQ_H_2330917_1477694520__
+#define ___UTILS_SHMQ_H_2330917_1477694520__ 1
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+#include "utils/mmap.h"
+
+namespace putils {
+
+// Queue types
+#define SHMQ_SPSC           1
+#define SHMQ_MPMC           2
+
+// Roles of an attached process
+#define SHMQ_PRODUCER       1
+#define SHMQ_CONSUMER       2
+
+// Layout version; bumped on any change to the shared header or
+// slots.
+#define SHMQ_VERSION        1
+
+// Most processes attached to a queue at a time
+#define SHMQ_MAXPEERS       64
+
+
+struct shmq_hdr;
+
+class shm_queue
+{
+public:
+    // Create (or re-initialize) the queue in file 'fn' with
+    // 'nelem' slots (rounded up to a power of 2) of up to 'elsize'
+    // bytes, and attach as 'role'. Throws EBUSY if a live process
+    // is attached to the queue in the file.
+    shm_queue(const std::string& fn, unsigned int type, uint32_t nelem,
+              uint32_t elsize, unsigned int role);
+
+    // Attach as 'role' to the queue in file 'fn'.
+    shm_queue(const std::string& fn, unsigned int role);
+
+    // Detach; the queue stays in the file.
+    virtual ~shm_queue();
+
+
+    // Add a message of 'n' bytes. Returns 0, -EAGAIN if the queue
+    // is full, -E2BIG if 'n' is more than elsize().
+    int put(const void * msg, size_t n);
+
+    // Take the oldest message and copy at most 'bufsz' bytes of it
+    // to 'buf' (the rest is dropped). Returns the length of the
+    // message or -EAGAIN if the queue is empty.
+    ssize_t get(void * buf, size_t bufsz);
+
+
+    // Blocking versions: wait up to 'timeout' ms (-1: forever) for
+    // space or a message (on CLOCK_MONOTONIC). Return -ETIMEDOUT,
+    // or -EPIPE if no consumer (producer) is alive.
+    int     put_wait(const void * msg, size_t n, int timeout);
+    ssize_t get_wait(void * buf, size_t bufsz, int timeout);
+
+
+    // Number of live peers attached as 'role' (including this one);
+    // entries of dead peers are cleared.
+    int peers(unsigned int role);
+
+
+    // Messages in the queue (a guess, if it is busy)
+    size_t   size() const;
+
+    uint32_t capacity() const   { return uint32_t(m_mask + 1); }
+    uint32_t elsize() const     { return m_elsize; }
+    unsigned int type() const   { return m_type; }
+
+private:
+    shm_queue(const shm_queue&);
+    shm_queue& operator=(const shm_queue&);
+
+    void     attach(unsigned int role);
+    void     detach();
+    bool     alive(int i);
+    uint8_t *slot(uint64_t pos) const { return m_data + (pos & m_mask) * m_slotsize; }
+
+    bool     ready(bool put) const;
+    int      wait(uint32_t * sleep, bool put, uint64_t deadline);
+    void     wake(uint32_t * sleep);
+
+private:
+    mmap_file    m_file;
+    shmq_hdr *   m_hdr;
+    uint8_t *    m_data;
+
+    uint64_t     m_mask;
+    uint32_t     m_slotsize;
+    uint32_t     m_elsize;
+    unsigned int m_type;
+    bool         m_spin;    // more than one CPU
+
+    int          m_peer;    // our entry in the peer table
+
+    // SPSC: last known position of the other side
+    uint64_t     m_rcache;
+    uint64_t     m_wcache;
+};
+
+}
+
+#endif /* ! ___UTILS_SHMQ_H_2330917_1477694520__ */
+
+/* EOF */
@@ -0,0 +1,141 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/topk.h - Space-Saving heavy hitters (top-k) tracker.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Space-Saving [1] monitors at most 'm' items in fixed memory. A
+ * monitored item has its count bumped; a new item replaces the
+ * item with the smallest count 'min' and starts at min+1 (with an
+ * error of 'min'). Hence, with N the sum of the weights:
+ *
+ *   o every item with a true count > N/m is monitored;
+ *   o for a monitored item, count - err <= true count <= count.
+ *
+ * Items are kept in a min-heap on count (to find the item to
+ * replace) and in a fast-ht hash table (to find the monitored item
+ * for a key); an update is O(1) lookup + O(log m) sift.
+ *
+ * Like the other sketches, items are identified by a 64-bit hash
+ * (use one of the functions in hashfunc.h). fast-ht reserves the
+ * hash value 0; it is treated as 1.
+ *
+ * A tracker is not thread safe.
+ *
+ * References:
+ * ===========
+ * [1] Efficient Computation of Frequent and Top-k Elements in Data
+ *     Streams, Metwally, Agrawal & El Abbadi
+ *     http://www.cs.ucsb.edu/research/tech_reports/reports/2005-23.pdf
+ */
+
+#ifndef ___UTILS_TOPK_H_1822754_1476845262__
+#define ___UTILS_TOPK_H_1822754_1476845262__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include "utils/utils.h"
+#include "utils/fast-ht.h"
+
+
+/*
+ * A monitored item
+ */
+struct topk_item
+{
+    uint64_t key;       // hash of the item
+    uint64_t count;     // upper bound of the true count
+    uint64_t err;       // count - err is a lower bound
+};
+typedef struct topk_item topk_item;
+
+
+struct topk_node
+{
+    topk_item it;
+    uint32_t  pos;      // index in the heap
+};
+typedef struct topk_node topk_node;
+
+
+struct topk
+{
+    uint32_t     m;         // capacity
+    uint32_t     n;         // items monitored
+    topk_node *  nodes;
+    topk_node ** heap;      // min-heap on count
+    ht           idx;       // key -> node
+    uint64_t     total;     // N
+};
+typedef struct topk topk;
+
+
+/*
+ * Initialize a tracker that monitors up to 'm' items.
+ *
+ * Returns 0 on success, -EINVAL if m is 0, -ENOMEM.
+ */
+extern int topk_init(topk * t, uint32_t m);
+
+extern void topk_fini(topk * t);
+
+extern topk * topk_new(uint32_t m);
+
+extern void topk_delete(topk * t);
+
+/*
+ * Add 'w' occurrences of item 'key'; returns its new count.
+ */
+extern uint64_t topk_add(topk * t, uint64_t key, uint64_t w);
+
+/*
+ * Fill 'it' with monitored item 'key'; return true if it is
+ * monitored, false otherwise.
+ */
+extern int topk_find(topk * t, uint64_t key, topk_item * it);
+
+/*
+ * Copy at most 'n' monitored items into 'out' by descending count
+ * and return the number copied.
+ */
+extern size_t topk_list(topk * t, topk_item * out, size_t n);
+
+/*
+ * Smallest count being monitored; 0 while the tracker isn't full.
+ * Any item not being monitored has a true count <= this.
+ */
+static inline uint64_t
+topk_min(const topk * t)
+{
+    return t->n < t->m ? 0 : t->heap[0]->it.count;
+}
+
+/*
+ * Sum of all the weights added.
+ */
+static inline uint64_t
+topk_total(const topk * t)
+{
+    return t->total;
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_TOPK_H_1822754_1476845262__ */
+
+/* EOF */
@@ -18,6 +18,7 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include <sys/types.h>
 #include "zlib.h"
 
 
@@ -120,6 +121,13 @@ struct z_buf_context
 
 
 
+/*
+ * Compression level used when the one asked for is not 1..9
+ * (z_buf) or 0..9 (z_zc, z_par), and the z_par default.
+ */
+#define Z_BUF_DEFAULT_LEVEL     5
+
+
 /*
  * Initialize compression at level 'lev' to use 'wbits' of
  * compression window size.
@@ -180,6 +188,242 @@ int z_buf_uncompress_end (z_buf_context * zc);
 
 
 
+/*
+ * Parallel (pigz style) compression and decompression.
+ *
+ * The input is split into blocks of 'blksize' bytes and each block
+ * is deflated on a job_manager thread. In the single stream formats
+ * (Z_PAR_ZLIB, Z_PAR_GZIP), every block is primed with the last 32k
+ * of the preceding block as its dictionary and ends on a byte
+ * boundary (Z_SYNC_FLUSH); the blocks are stitched together in
+ * order and the per-block checksums are combined into one trailer.
+ * The result is a single valid zlib or gzip stream that any inflate
+ * can read.
+ *
+ * Z_PAR_MEMBERS writes each block as a self contained gzip member
+ * without a dictionary. Each member carries its total length in a
+ * gzip extra field ("PZ" subfield), so z_buf_par_uncompress() can
+ * locate every member without inflating and decompress them in
+ * parallel. The output is still a valid multi-member gzip file.
+ *
+ * In both directions the output is delivered in order through
+ * 'zc->process_output'; at most 2 x nthreads blocks are in flight
+ * at any time.
+ */
+#define Z_PAR_ZLIB      0   /* single zlib stream */
+#define Z_PAR_GZIP      1   /* single gzip stream */
+#define Z_PAR_MEMBERS   2   /* independently decodable gzip members */
+
+/* Default input block size for parallel compression */
+#define Z_PAR_BLKSIZE   (128 * 1024)
+
+typedef struct z_par_opt z_par_opt;
+struct z_par_opt
+{
+    int  level;     /* 0..9; 0 stores; out of range => Z_BUF_DEFAULT_LEVEL */
+    int  nthreads;  /* worker threads; 0 => one per CPU */
+    int  format;    /* one of Z_PAR_xxx above */
+    uInt blksize;   /* input block size; 0 => Z_PAR_BLKSIZE */
+};
+
+
+/*
+ * Compress 'len' bytes in 'buf' using 'opt' (NULL for defaults).
+ * 'zc' must be initialized with z_buf_context_init(); only its
+ * output processor is used.
+ *
+ * Returns:
+ *      Z_OK on success
+ *      Z_xxx_ERROR on error.
+ */
+int z_buf_par_compress (z_buf_context * zc, const z_par_opt * opt,
+                        const void * buf, size_t len);
+
+
+/*
+ * Uncompress 'len' bytes of Z_PAR_MEMBERS formatted data in 'buf'
+ * using 'nthreads' workers (0 => one per CPU). Plain zlib/gzip
+ * streams are rejected with Z_DATA_ERROR; use z_buf_uncompress()
+ * for those.
+ *
+ * Returns:
+ *      Z_OK on success
+ *      Z_xxx_ERROR on error.
+ */
+int z_buf_par_uncompress (z_buf_context * zc, int nthreads,
+                          const void * buf, size_t len);
+
+
+
+/*
+ * Pool of z_streams.
+ *
+ * deflateInit()/inflateInit() allocate several hundred KB of state
+ * per stream. A pool keeps finished streams around and hands them
+ * out again after a deflateReset()/inflateReset() -- provided the
+ * parameters (level, wbits) match. The pool is thread safe.
+ */
+typedef struct z_stream_pool z_stream_pool;
+
+/*
+ * Make a new pool that keeps at most 'max' idle streams.
+ * Returns 0 on allocation failure.
+ */
+z_stream_pool * z_stream_pool_new (int max);
+
+/*
+ * Free all idle streams and the pool itself. Streams still checked
+ * out must have been returned first.
+ */
+void z_stream_pool_delete (z_stream_pool * p);
+
+/*
+ * Return a deflate stream at 'lev' and 'wbits' (negative for raw
+ * deflate; +16 for gzip). Returns 0 on failure.
+ */
+z_stream * z_stream_pool_deflate (z_stream_pool * p, int lev, int wbits);
+
+/*
+ * Return an inflate stream for 'wbits'. Returns 0 on failure.
+ */
+z_stream * z_stream_pool_inflate (z_stream_pool * p, int wbits);
+
+/*
+ * Reset 'zs' and return it to the pool (or release it if the pool
+ * is full).
+ */
+void z_stream_pool_put (z_stream_pool * p, z_stream * zs);
+
+
+
+/*
+ * Zero-copy interface.
+ *
+ * Instead of compressing into a private buffer and handing it to
+ * 'process_output' (which usually copies it again), the caller lends
+ * zbuf output windows: slices of an mmap'd file, entries of an
+ * iovec ring etc. zlib writes directly into each window.
+ *
+ * The window callback is called with the window that was just
+ * filled and the number of bytes 'used' in it. Unless 'last' is
+ * set, it must point 'w' at the next window to fill and return 0.
+ * The very first call has w->buf == 0 and used == 0. A negative
+ * return aborts the operation.
+ */
+typedef struct z_window z_window;
+struct z_window
+{
+    Byte * buf;
+    uInt   size;
+};
+
+typedef int (*z_window_fn) (void * opaq, z_window * w, uInt used, int last);
+
+typedef struct z_zc_context z_zc_context;
+struct z_zc_context
+{
+    z_stream *      z;
+    z_stream_pool * pool;
+
+    z_window        win;
+    z_window_fn     next_window;
+    void *          opaq;
+};
+
+
+/*
+ * Start compressing at level 'lev' (0..9; 0 stores; out-of-range
+ * values use Z_BUF_DEFAULT_LEVEL) with 'wbits' of window into
+ * windows supplied by 'fn'. If 'pool' is non-null the z_stream is taken
+ * from (and returned to) it.
+ *
+ * Returns:
+ *      Z_OK on success
+ *      Z_xxx_ERROR on error.
+ */
+int z_zc_compress_init (z_zc_context * zc, z_stream_pool * pool, int lev,
+                        int wbits, z_window_fn fn, void * opaq);
+
+/*
+ * Compress 'len' bytes in 'buf'.
+ */
+int z_zc_compress (z_zc_context * zc, const void * buf, size_t len);
+
+/*
+ * Finish the stream and retire the last window.
+ */
+int z_zc_compress_end (z_zc_context * zc);
+
+
+/*
+ * Start uncompressing with 'wbits' of window into windows supplied
+ * by 'fn'.
+ */
+int z_zc_uncompress_init (z_zc_context * zc, z_stream_pool * pool,
+                          int wbits, z_window_fn fn, void * opaq);
+
+/*
+ * Uncompress 'len' bytes in 'buf'.
+ * Returns:
+ *      Z_OK on success
+ *      Z_STREAM_END on EOF
+ *      Z_xxx_ERROR on error.
+ */
+int z_zc_uncompress (z_zc_context * zc, const void * buf, size_t len);
+
+/*
+ * Drain any pending output and retire the last window.
+ * Returns Z_DATA_ERROR if the stream was truncated.
+ */
+int z_zc_uncompress_end (z_zc_context * zc);
+
+
+/*
+ * Uncompress all of 'in' straight into the caller's region 'out'
+ * (e.g., an mmap'd destination file) of 'outsz' bytes. The number
+ * of bytes produced is returned in 'p_outlen'.
+ *
+ * Returns:
+ *      Z_OK on success
+ *      Z_BUF_ERROR if 'out' is too small
+ *      Z_xxx_ERROR on other errors.
+ */
+int z_zc_uncompress_into (z_stream_pool * pool, int wbits,
+                          const void * in, size_t inlen,
+                          void * out, size_t outsz, size_t * p_outlen);
+
+
+/*
+ * Window provider that maps successive 'chunk' sized slices of the
+ * file 'fd' starting at offset 'off'. The file is extended as
+ * needed and truncated to the exact output length when the last
+ * window is retired, or to the output so far if a window can't be
+ * had.
+ */
+typedef struct z_mmap_sink z_mmap_sink;
+struct z_mmap_sink
+{
+    int    fd;
+    off_t  off;         /* current end of output */
+    size_t chunk;
+
+    Byte * map;
+    size_t maplen;
+};
+
+/*
+ * Initialize a mmap sink; 'chunk' is rounded up to the page size.
+ * Returns 0 on success, -errno on failure.
+ */
+int z_mmap_sink_init (z_mmap_sink * s, int fd, off_t off, size_t chunk);
+
+/*
+ * z_window_fn for use with 'opaq' pointing to a z_mmap_sink.
+ */
+int z_mmap_sink_window (void * opaq, z_window * w, uInt used, int last);
+
+
+
 /*
  * Handy macros to query statistics.
  */
@@ -29,7 +29,10 @@ win32_ldlibs  += -lwsock32
 all_posix_objs = daemon.o
 
 #all_posix_objs += resolve.o
-all_posix_objs += c_resolve.o work.o job.o
+all_posix_objs += c_resolve.o work.o job.o zbuf_par.o zbuf_zc.o hashtab_par.o \
+                  pwalk.o cdb_read.o cdb_write.o mapped_stream.o \
+                  aioq.o blkwriter.o fcopy.o perfprof.o \
+                  cdc.o cache.o shmq.o clock.o
 
 posix_vpath    += $(PORTABLE)/src/posix
 posix_incdirs  +=
@@ -72,21 +75,22 @@ OpenBSD_defobjs   = $(all_posix_objs) openbsd_cpu.o
 #timerobjs = timer.o timer_int.o ctimer.o
 
 
-baseobjs = mempool.o dirname.o \
+baseobjs = mempool.o metrics.o dirname.o \
            escape.o unescape.o mmap.o sysexception.o syserror.o \
 		   getopt_long.o error.o jenkins_hash.o  \
-		   bloom.o bloom_marshal.o str2hex.o frand.o fast-ht.o \
+		   bloom.o bloom_marshal.o hll.o cmsketch.o topk.o shard.o \
+		   str2hex.o frand.o fast-ht.o \
 		   b64_encode.o b64_decode.o humanize.o strtosize.o \
 		   cmutex.o arena.o memmgr.o hexdump.o \
 		   hashtab.o  hashtab_iter.o strunquote.o \
 		   readpass.o cmdline.o  uuid.o ulid.o \
 		   hsieh_hash.o fnvhash.o murmur3_hash.o cityhash.o \
-		   fasthash.o siphash24.o yorrike.o xorshift.o xxhash.o \
+		   fasthash.o siphash24.o yorrike.o xorshift.o xxhash.o lz.o \
 		   metrohash64.o metrohash128.o xoroshiro.o \
 		   mkdirhier.o parse-ip.o strcopy.o \
 		   gstring.o gstring_var.o freadline.o rotatefile.o \
 		   strsplit.o strsplit_csv.o strtrim.o \
-		   pack.o \
+		   pack.o zbuf_c.o zbuf_unc.o \
 		   $($(platform)_objs)
 
 
@@ -25,6 +25,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
 #include <ifaddrs.h>
 
 #if defined(BSD)
@@ -37,6 +43,8 @@
 #elif defined(__linux__)
 
     #include <linux/if_packet.h>
+    #include <linux/netlink.h>
+    #include <linux/rtnetlink.h>
 
     #define AF_LINK AF_PACKET
     typedef struct sockaddr_ll  macaddr_type;
@@ -48,6 +56,8 @@
 
 #include "utils/resolve.h"
 #include "utils/utils.h"
+#include "utils/metrics.h"
+#include "posix/job.h"
 
 struct iftmp
 {
@@ -178,6 +188,28 @@ sockaddr_to_string(char * buf, size_t bufsiz, const struct sockaddr * sa)
 
 
 
+/*
+ * Return true if addresses of family 'fam' pass 'mask'; families
+ * other than the known ones count as F_INET.
+ */
+static int
+family_ok(int fam, unsigned int mask)
+{
+    switch (fam)
+    {
+        default:
+        case AF_INET:
+            return mask & F_INET;
+
+        case AF_INET6:
+            return mask & F_INET6;
+
+        case AF_LINK:
+            return mask & F_LINK;
+    }
+}
+
+
 static int
 iftmp_cmp(const void* a, const void* b)
 {
@@ -210,7 +242,7 @@ get_all_if_address(if_address_vect* addrv, unsigned int mask)
 
     r = getifaddrs(&ifa);
     if (r < 0)
-        return r;
+        return -errno;
 
     for (ifp = ifa; ifp; ifp = ifp->ifa_next)
     {
@@ -219,26 +251,11 @@ get_all_if_address(if_address_vect* addrv, unsigned int mask)
         size_t len  = 0;
 
 
-        switch (ifp->ifa_addr->sa_family)
-        {
-            default:
-            case AF_INET:
-                if (!(mask & F_INET))
-                    continue;
-                break;
-
-            case AF_INET6:
-                if (!(mask & F_INET6))
-                    continue;
-                break;
-
-            case AF_LINK:
-                if (! (mask & F_LINK))
-                    continue;
-                break;
-
-        }
+        // Interfaces without an address have none
+        if (!ifp->ifa_addr || !family_ok(ifp->ifa_addr->sa_family, mask))
+            continue;
 
+        memset(&t, 0, sizeof t);
         strcopy(t.nm, sizeof t.nm, ifp->ifa_name);
 
         /*
@@ -453,41 +470,755 @@ resolve_host_or_ifname(const char* name, if_addr_vect* addrv, unsigned int mask)
 
     n = getaddrinfo(name, 0, &hints, &ai);
     if (n != 0)
-        return -errno;
+        return n == EAI_SYSTEM ? -errno : -ENOENT;
 
     for (ptr = ai; ptr; ptr = ptr->ai_next)
     {
         struct sockaddr* s = ptr->ai_addr;
         if_addr x;
 
-        switch (s->sa_family)
-        {
-            default:
-            case AF_INET:
-                if (!(mask & F_INET))
-                    continue;
-                break;
+        if (!family_ok(s->sa_family, mask))
+            continue;
 
-            case AF_INET6:
-                if (!(mask & F_INET6))
-                    continue;
-                break;
+        memset(&x, 0, sizeof x);
+        memcpy(&x.sa, s, ptr->ai_addrlen);
 
-            case AF_LINK:
-                if (! (mask & F_LINK))
-                    continue;
-                break;
+        VECT_APPEND(addrv, x);
+    }
+
+    freeaddrinfo(ai);
+    return 0;
+}
+
+
+
+
+
+/*
+ * Resolution cache.
+ *
+ * A snapshot is never changed once published: every update builds
+ * a new one (copying what it keeps) under the writer lock. Readers
+ * pin the current epoch in their shard's counter; see
+ * snap_get()/snap_publish().
+ */
+
+struct rs_if
+{
+    char      name[IF_NAMESIZE];
+    if_addr * a;
+    size_t    n;
+};
+
+struct rs_host
+{
+    char *    name;
+    unsigned  mask;
+    time_t    expires;
+    uint64_t  gen;              // snapshot that added it
+    if_addr * a;
+    size_t    n;
+};
+
+struct rsnap
+{
+    struct rs_if *   ifs;       // sorted by name
+    size_t           nifs;
+    struct rs_host * hosts;     // sorted by name, mask
+    size_t           nhosts;
+};
+
+struct rs_readers
+{
+    uint32_t n[2];              // readers in even, odd epochs
+    uint8_t  pad[METRICS_CACHELINE - 2 * sizeof(uint32_t)];
+};
+
+struct resolve_cache
+{
+    struct rsnap *    snap;
+    uint32_t          epoch;
+
+    struct rs_readers rd[METRICS_SHARDS] __attribute__((aligned(METRICS_CACHELINE)));
+
+    pthread_mutex_t   lock;     // writers
+    unsigned int      ttl;
+    uint64_t          gen;
+
+    uint64_t          hits;     // atomic
+    uint64_t          misses;   // atomic
+    uint64_t          refreshes;
+
+    // netlink watcher
+    int               nl;
+    int               stop[2];
+    pthread_t         watcher;
+
+    // asynchronous lookups
+    job_manager       jm;
+    int               nthreads;
+};
+
+struct rs_job
+{
+    resolve_done_fn fn;
+    void *          arg;
+    unsigned int    mask;
+    char            name[];
+};
+
+
+static time_t
+mono_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+static if_addr *
+addr_dup(const if_addr * a, size_t n)
+{
+    if_addr * d = NEWA(if_addr, n ? n : 1);
 
+    if (d) memcpy(d, a, n * sizeof *a);
+    return d;
+}
+
+
+static void
+snap_free(struct rsnap * s)
+{
+    size_t i;
+
+    if (!s) return;
+
+    for (i = 0; i < s->nifs; i++)   DEL(s->ifs[i].a);
+    for (i = 0; i < s->nhosts; i++) {
+        DEL(s->hosts[i].name);
+        DEL(s->hosts[i].a);
+    }
+    DEL(s->ifs);
+    DEL(s->hosts);
+    DEL(s);
+}
+
+
+/*
+ * Build the interface table of a new snapshot from getifaddrs().
+ */
+static int
+snap_load_ifs(struct rsnap * s)
+{
+    if_address_vect av;
+    size_t i;
+    int r;
+
+    VECT_INIT(&av, 8);
+    if ((r = get_all_if_address(&av, F_INET|F_INET6|F_LINK)) < 0)
+        goto end;
+
+    r = -ENOMEM;
+    s->ifs = NEWZA(struct rs_if, VECT_SIZE(&av) + 1);
+    if (!s->ifs) goto end;
+
+    for (i = 0; i < VECT_SIZE(&av); i++) {
+        if_address * x   = &VECT_ELEM(&av, i);
+        struct rs_if * y = &s->ifs[i];
+
+        strcopy(y->name, sizeof y->name, x->if_name);
+        y->n = VECT_SIZE(&x->if_addr);
+        y->a = addr_dup(x->if_addr.array, y->n);
+        s->nifs++;
+        if (!y->a) goto end;
+    }
+    r = 0;
+
+end:
+    // get_all_if_address() leaves an initialized slot past the end
+    for (i = 0; i < VECT_SIZE(&av) + 1 && i < VECT_CAPACITY(&av); i++)
+        VECT_FINI(&VECT_ELEM(&av, i).if_addr);
+    VECT_FINI(&av);
+    return r;
+}
+
+
+/*
+ * Copy the host entries of 'o' that are still good (and not 'skip')
+ * to 's', leaving room for one more.
+ */
+static int
+snap_copy_hosts(struct rsnap * s, const struct rsnap * o, time_t now,
+                const char * skip, unsigned skipmask)
+{
+    size_t i;
+
+    s->hosts = NEWZA(struct rs_host, o->nhosts + 1);
+    if (!s->hosts) return -ENOMEM;
+
+    for (i = 0; i < o->nhosts; i++) {
+        const struct rs_host * h = &o->hosts[i];
+        struct rs_host * d       = &s->hosts[s->nhosts];
+
+        if (h->expires <= now) continue;
+        if (skip && h->mask == skipmask && 0 == strcmp(h->name, skip)) continue;
+
+        *d      = *h;
+        d->name = strdup(h->name);
+        d->a    = addr_dup(h->a, h->n);
+        if (!d->name || !d->a) {
+            DEL(d->name);
+            DEL(d->a);
+            return -ENOMEM;
         }
+        s->nhosts++;
+    }
+    return 0;
+}
+
+
+static int
+snap_copy_ifs(struct rsnap * s, const struct rsnap * o)
+{
+    size_t i;
+
+    s->ifs = NEWZA(struct rs_if, o->nifs + 1);
+    if (!s->ifs) return -ENOMEM;
+
+    for (i = 0; i < o->nifs; i++) {
+        s->ifs[i]   = o->ifs[i];
+        s->ifs[i].a = addr_dup(o->ifs[i].a, o->ifs[i].n);
+        s->nifs++;
+        if (!s->ifs[i].a) return -ENOMEM;
+    }
+    return 0;
+}
+
+
+/*
+ * Pin the current snapshot; returns it and the counter to give
+ * back to snap_put().
+ */
+static struct rsnap *
+snap_get(resolve_cache * c, uint32_t ** p_ctr)
+{
+    uint32_t * rd = c->rd[__metrics_my_shard()].n;
+    uint32_t e;
+
+    // A writer may move on between loading the epoch and counting
+    // ourselves in it; then count ourselves in the new one.
+    for (;;) {
+        e = __atomic_load_n(&c->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&rd[e & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&c->epoch, __ATOMIC_SEQ_CST) == e) break;
+        __atomic_fetch_sub(&rd[e & 1], 1, __ATOMIC_RELEASE);
+    }
+
+    *p_ctr = &rd[e & 1];
+    return __atomic_load_n(&c->snap, __ATOMIC_SEQ_CST);
+}
+
+
+static inline void
+snap_put(uint32_t * ctr)
+{
+    __atomic_fetch_sub(ctr, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Make 's' the current snapshot and free the old one when no reader
+ * can see it. Called with the lock held.
+ */
+static void
+snap_publish(resolve_cache * c, struct rsnap * s)
+{
+    struct rsnap * old = c->snap;
+    uint32_t e         = c->epoch;
+    int i;
+
+    __atomic_store_n(&c->snap, s, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&c->epoch, e + 1, __ATOMIC_SEQ_CST);
+    c->gen++;
+
+    // Readers that counted themselves in epoch 'e' may hold 'old';
+    // those that come later see 's'.
+    for (i = 0; i < METRICS_SHARDS; i++) {
+        while (__atomic_load_n(&c->rd[i].n[e & 1], __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+    snap_free(old);
+}
+
+
+int
+resolve_cache_refresh(resolve_cache * c)
+{
+    struct rsnap * s = NEWZ(struct rsnap);
+    int r;
+
+    if (!s) return -ENOMEM;
+
+    // getifaddrs() outside the lock
+    if ((r = snap_load_ifs(s)) < 0) goto fail;
+
+    pthread_mutex_lock(&c->lock);
+    if ((r = snap_copy_hosts(s, c->snap, mono_sec(), 0, 0)) < 0) {
+        pthread_mutex_unlock(&c->lock);
+        goto fail;
+    }
+    snap_publish(c, s);
+    c->refreshes++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+
+fail:
+    snap_free(s);
+    return r;
+}
+
+
+/*
+ * Drop the host entry added first.
+ */
+static void
+snap_evict_host(struct rsnap * s)
+{
+    size_t i, k = 0;
+
+    for (i = 1; i < s->nhosts; i++) {
+        if (s->hosts[i].gen < s->hosts[k].gen) k = i;
+    }
+
+    DEL(s->hosts[k].name);
+    DEL(s->hosts[k].a);
+    memmove(&s->hosts[k], &s->hosts[k+1], (s->nhosts - k - 1) * sizeof s->hosts[0]);
+    s->nhosts--;
+}
+
+
+/*
+ * Add a host entry for 'name' and 'mask'; if the cache is full,
+ * the oldest one makes room.
+ */
+static int
+add_host(resolve_cache * c, const char * name, unsigned mask, const if_addr_vect * av)
+{
+    struct rsnap * s = NEWZ(struct rsnap);
+    struct rs_host h;
+    size_t i;
+    int r;
+
+    if (!s) return -ENOMEM;
+
+    memset(&h, 0, sizeof h);
+    h.mask    = mask;
+    h.expires = mono_sec() + c->ttl;
+    h.n       = VECT_SIZE(av);
+    h.name    = strdup(name);
+    h.a       = addr_dup(av->array, h.n);
+
+    pthread_mutex_lock(&c->lock);
+    h.gen = c->gen;
+    r = -ENOMEM;
+    if (!h.name || !h.a) goto fail;
+    if ((r = snap_copy_ifs(s, c->snap)) < 0) goto fail;
+    if ((r = snap_copy_hosts(s, c->snap, mono_sec(), name, mask)) < 0) goto fail;
+    if (s->nhosts >= RESOLVE_MAXHOSTS) snap_evict_host(s);
+
+    // Insert in order
+    for (i = s->nhosts; i > 0; i--) {
+        struct rs_host * p = &s->hosts[i-1];
+        int k = strcmp(p->name, name);
+
+        if (k < 0 || (k == 0 && p->mask < mask)) break;
+        s->hosts[i] = *p;
+    }
+    s->hosts[i] = h;
+    s->nhosts++;
+
+    snap_publish(c, s);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+
+fail:
+    pthread_mutex_unlock(&c->lock);
+    DEL(h.name);
+    DEL(h.a);
+    snap_free(s);
+    return r;
+}
+
+
+static const struct rs_if *
+find_if(const struct rsnap * s, const char * name)
+{
+    size_t lo = 0, hi = s->nifs;
+
+    while (lo < hi) {
+        size_t m = (lo + hi) / 2;
+        int k    = strcmp(s->ifs[m].name, name);
+
+        if (k == 0) return &s->ifs[m];
+        if (k < 0)  lo = m + 1;
+        else        hi = m;
+    }
+    return 0;
+}
+
+
+static const struct rs_host *
+find_host(const struct rsnap * s, const char * name, unsigned mask)
+{
+    size_t lo = 0, hi = s->nhosts;
+
+    while (lo < hi) {
+        size_t m = (lo + hi) / 2;
+        const struct rs_host * h = &s->hosts[m];
+        int k = strcmp(h->name, name);
+
+        if (k == 0) k = h->mask < mask ? -1 : h->mask > mask;
+        if (k == 0) return h;
+        if (k < 0)  lo = m + 1;
+        else        hi = m;
+    }
+    return 0;
+}
+
+
+static void
+copy_addrs(if_addr_vect * v, const if_addr * a, size_t n, unsigned mask)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (family_ok(a[i].sa.ss_family, mask))
+            VECT_APPEND(v, a[i]);
+    }
+}
+
+
+int
+resolve_cache_if_address(resolve_cache * c, if_address_vect * addrv, unsigned int mask)
+{
+    struct rsnap * s;
+    uint32_t * ctr;
+    size_t i;
+
+    if (!mask)
+        mask = F_INET|F_INET6;
+
+    VECT_RESET(addrv);
+
+    s = snap_get(c, &ctr);
+    for (i = 0; i < s->nifs; i++) {
+        const struct rs_if * f = &s->ifs[i];
+        if_address x;
 
         memset(&x, 0, sizeof x);
-        memcpy(&x.sa, s, ptr->ai_addrlen);
+        VECT_INIT(&x.if_addr, f->n);
+        copy_addrs(&x.if_addr, f->a, f->n, mask);
+        if (VECT_SIZE(&x.if_addr) == 0) {
+            VECT_FINI(&x.if_addr);
+            continue;
+        }
 
+        strcopy(x.if_name, sizeof x.if_name, f->name);
         VECT_APPEND(addrv, x);
     }
+    snap_put(ctr);
 
-    freeaddrinfo(ai);
+    __atomic_fetch_add(&c->hits, 1, __ATOMIC_RELAXED);
     return 0;
 }
 
 
+int
+resolve_cache_lookup(resolve_cache * c, const char * name, if_addr_vect * addrv,
+                     unsigned int mask)
+{
+    const struct rs_host * h;
+    const struct rs_if * f;
+    struct rsnap * s;
+    struct in_addr ia;
+    uint32_t * ctr;
+    int r, again = 1;
+
+    // Literals and wildcards need no cache
+    if (!*name || *name == '*' || inet_aton(name, &ia))
+        return resolve_host_or_ifname(name, addrv, mask);
+
+    if (!mask)
+        mask = F_INET|F_INET6;
+
+retry:
+    VECT_RESET(addrv);
+
+    s = snap_get(c, &ctr);
+    if ((f = find_if(s, name))) {
+        copy_addrs(addrv, f->a, f->n, mask);
+        snap_put(ctr);
+        __atomic_fetch_add(&c->hits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if ((h = find_host(s, name, mask)) && h->expires > mono_sec()) {
+        copy_addrs(addrv, h->a, h->n, mask);
+        snap_put(ctr);
+        __atomic_fetch_add(&c->hits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    snap_put(ctr);
+
+    // An interface that is newer than the snapshot?
+    if (is_ifname(name)) {
+        if (again-- && resolve_cache_refresh(c) == 0) goto retry;
+
+        // Up, but no addresses
+        __atomic_fetch_add(&c->misses, 1, __ATOMIC_RELAXED);
+        return -ENOENT;
+    }
+
+    __atomic_fetch_add(&c->misses, 1, __ATOMIC_RELAXED);
+    if ((r = resolve_host_or_ifname(name, addrv, mask)) < 0)
+        return r;
+
+    if (c->ttl > 0) add_host(c, name, mask, addrv);
+    return 0;
+}
+
+
+
+#if defined(__linux__)
+
+/*
+ * Wait for address and link changes on the netlink socket and
+ * rebuild the interface table after each batch of them.
+ */
+static void *
+watcher(void * v)
+{
+    resolve_cache * c = v;
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    for (;;) {
+        struct pollfd pfd[2];
+        int changed = 0;
+        ssize_t n;
+
+        pfd[0].fd = c->nl;      pfd[0].events = POLLIN;
+        pfd[1].fd = c->stop[0]; pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd[1].revents) break;
+
+        while ((n = recv(c->nl, buf, sizeof buf, MSG_DONTWAIT)) != 0) {
+            struct nlmsghdr * nh;
+
+            if (n < 0) {
+                if (errno == EINTR) continue;
+
+                // We missed some: assume the worst
+                if (errno == ENOBUFS) changed = 1;
+                break;
+            }
+
+            for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n); nh = NLMSG_NEXT(nh, n)) {
+                switch (nh->nlmsg_type) {
+                    case RTM_NEWADDR:
+                    case RTM_DELADDR:
+                    case RTM_NEWLINK:
+                    case RTM_DELLINK:
+                        changed = 1;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        if (changed) resolve_cache_refresh(c);
+    }
+    return 0;
+}
+
+
+static int
+watch_start(resolve_cache * c)
+{
+    struct sockaddr_nl sa;
+    int r;
+
+    c->nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (c->nl < 0) return -errno;
+
+    memset(&sa, 0, sizeof sa);
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(c->nl, (struct sockaddr *)&sa, sizeof sa) < 0) goto fail;
+    if (pipe2(c->stop, O_CLOEXEC) < 0) goto fail;
+
+    if ((r = pthread_create(&c->watcher, 0, watcher, c)) != 0) {
+        close(c->stop[0]);
+        close(c->stop[1]);
+        c->stop[0] = c->stop[1] = -1;
+        errno = r;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    r = -errno;
+    close(c->nl);
+    c->nl = -1;
+    return r;
+}
+
+#else
+
+static int
+watch_start(resolve_cache * c)
+{
+    USEARG(c);
+    return -ENOTSUP;
+}
+
+#endif /* __linux__ */
+
+
+static void
+watch_stop(resolve_cache * c)
+{
+    if (c->stop[1] >= 0) {
+        char x = 0;
+
+        while (write(c->stop[1], &x, 1) < 0 && errno == EINTR)
+            ;
+        pthread_join(c->watcher, 0);
+        close(c->stop[0]);
+        close(c->stop[1]);
+    }
+    if (c->nl >= 0) close(c->nl);
+}
+
+
+static int
+async_job(void * ctx, void * j, int thr)
+{
+    resolve_cache * c = ctx;
+    struct rs_job * a = j;
+    if_addr_vect av;
+    int r;
+
+    USEARG(thr);
+
+    VECT_INIT(&av, 8);
+    r = resolve_cache_lookup(c, a->name, &av, a->mask);
+    (*a->fn)(a->arg, r, &av);
+
+    VECT_FINI(&av);
+    DEL(a);
+    return 0;
+}
+
+
+int
+resolve_cache_new(resolve_cache ** p_c, int nthreads, unsigned int host_ttl,
+                  unsigned int flags)
+{
+    resolve_cache * c;
+    int r;
+
+    if (posix_memalign((void **)&c, METRICS_CACHELINE, sizeof *c) != 0)
+        return -ENOMEM;
+
+    memset(c, 0, sizeof *c);
+    c->ttl     = host_ttl;
+    c->nl      = -1;
+    c->stop[0] = c->stop[1] = -1;
+    pthread_mutex_init(&c->lock, 0);
+
+    c->snap = NEWZ(struct rsnap);
+    if (!c->snap) {
+        r = -ENOMEM;
+        goto fail;
+    }
+    if ((r = snap_load_ifs(c->snap)) < 0) goto fail;
+
+    if ((flags & RESOLVE_WATCH) && (r = watch_start(c)) < 0) goto fail;
+
+    if (nthreads > 0) {
+        if ((r = job_manager_init(&c->jm, nthreads, async_job, c)) <= 0) {
+            job_manager_wait(&c->jm);
+            job_manager_destroy(&c->jm);
+            if (r == 0) r = -ENOMEM;
+            watch_stop(c);
+            goto fail;
+        }
+        c->nthreads = nthreads;
+    }
+
+    *p_c = c;
+    return 0;
+
+fail:
+    snap_free(c->snap);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+    return r;
+}
+
+
+void
+resolve_cache_delete(resolve_cache * c)
+{
+    if (c->nthreads > 0) {
+        job_manager_wait(&c->jm);
+        job_manager_destroy(&c->jm);
+    }
+    watch_stop(c);
+
+    snap_free(c->snap);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+
+int
+resolve_cache_lookup_async(resolve_cache * c, const char * name, unsigned int mask,
+                           resolve_done_fn fn, void * arg)
+{
+    size_t n = strlen(name) + 1;
+    struct rs_job * a;
+
+    if (c->nthreads <= 0) return -ENOTSUP;
+
+    a = (struct rs_job *)malloc(sizeof *a + n);
+    if (!a) return -ENOMEM;
+
+    a->fn   = fn;
+    a->arg  = arg;
+    a->mask = mask;
+    memcpy(a->name, name, n);
+    job_manager_submit_job(&c->jm, a);
+    return 0;
+}
+
+
+void
+resolve_cache_stats_get(resolve_cache * c, resolve_cache_stats * st)
+{
+    st->hits   = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+    st->misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&c->lock);
+    st->refreshes = c->refreshes;
+    st->gen       = c->gen;
+    st->hosts     = c->snap->nhosts;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* EOF */
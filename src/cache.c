@@ -0,0 +1,646 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cache.c - Bounded memory, concurrent S3-FIFO cache.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in cache.h.
+ *
+ * o  fast-ht keys are hashes: two keys with the same hash can't
+ *    both be cached. The entry keeps the key and a lookup compares
+ *    it; a put of the other key replaces the entry.
+ *
+ * o  The ghost FIFO is a ring of key hashes and a fast-ht of the
+ *    hashes in it; the ht value is the sequence number of the hash
+ *    in the ring, so that a hash that was re-added isn't removed
+ *    from the index when its older copy leaves the ring.
+ *
+ * o  The timer wheel is scheme 6 of [2]: unsorted lists hashed by
+ *    expiry tick; a slot holds entries of later rounds too and they
+ *    are skipped when the slot is swept.
+ *
+ * o  The slot of the current tick can hold many live entries (all
+ *    those a wheel turn or more out). A put sweeps it only on the
+ *    first put of the tick and again once the tick is over;
+ *    cache_expire() always sweeps it.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utils/cache.h"
+#include "utils/fast-ht.h"
+#include "utils/hashfunc.h"
+#include "utils/mempool.h"
+#include "utils/cpu.h"
+#include "utils/utils.h"
+#include "fast/list.h"
+
+
+#define WHEEL           256     // timer wheel slots
+#define SMALL_PCT       10      // size of the small FIFO
+#define FREQ_MAX        3
+#define GHOST_MIN       64      // min ghost entries
+#define SHARD_MIN       (64 * 1024)
+#define DEF_TICK        100
+
+#define Q_SMALL         0
+#define Q_MAIN          1
+
+#define CLS_BIG         0xff    // malloc'd
+
+static const uint32_t Class[] = {
+      64,   96,  128,  192,  256,  384,  512,  768,
+    1024, 1536, 2048, 3072, 4096
+};
+#define NCLASS          (sizeof Class / sizeof Class[0])
+
+
+struct centry
+{
+    DL_ENTRY(centry) q;     // small or main FIFO
+    DL_ENTRY(centry) tw;    // timer wheel slot
+
+    uint64_t h;
+    uint64_t expire;        // ms; 0 if none
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t size;          // bytes charged
+    uint8_t  freq;
+    uint8_t  queue;
+    uint8_t  cls;
+    uint8_t  slot;          // in the timer wheel
+
+    uint8_t  data[];        // key, value
+};
+typedef struct centry centry;
+
+DL_HEAD_TYPEDEF(cq, centry);
+
+
+struct ghost
+{
+    uint64_t * v;           // ring of hashes
+    uint32_t   cap;
+    uint32_t   head;        // oldest
+    uint32_t   n;
+    uint64_t   seq;         // hashes ever added
+    ht         idx;         // hash -> seq
+};
+typedef struct ghost ghost;
+
+
+struct shard
+{
+    pthread_rwlock_t lock;
+
+    ht       idx;
+    cq       small;
+    cq       main;
+    uint64_t bytes;
+    uint64_t sbytes;        // in the small FIFO
+    uint64_t cap;
+    uint64_t scap;
+    uint64_t items;
+    uint64_t mitems;        // in the main FIFO
+
+    ghost    g;
+
+    cq       wheel[WHEEL];
+    uint64_t tick;          // last tick swept; maybe only in part
+    uint64_t nttl;          // entries in the wheel
+
+    struct mempool * pool[NCLASS];
+
+    uint64_t hits;          // atomic: updated under the shared lock
+    uint64_t misses;        // atomic
+    uint64_t puts;
+    uint64_t evictions;
+    uint64_t expired;
+} __attribute__((aligned(64)));
+typedef struct shard shard;
+
+
+struct cache
+{
+    uint32_t  nshards;
+    uint32_t  tick;
+    uint64_t  seed;
+    uint64_t  (*clock)(void);
+    shard *   s;
+};
+
+
+static uint64_t
+mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+static inline uint64_t
+now(const cache *c)
+{
+    return c->clock ? (*c->clock)() : mono_ms();
+}
+
+
+static inline uint64_t
+keyhash(const cache *c, const void *key, size_t klen)
+{
+    uint64_t h = fasthash64(key, klen, c->seed);
+
+    return h ? h : 1;
+}
+
+
+static inline shard *
+shard_of(const cache *c, uint64_t h)
+{
+    return &c->s[(h >> 32) & (c->nshards - 1)];
+}
+
+
+static inline int
+keyeq(const centry *e, const void *key, size_t klen)
+{
+    return e->klen == klen && 0 == memcmp(e->data, key, klen);
+}
+
+
+
+/*
+ * Entry allocation
+ */
+
+static centry *
+ealloc(shard *s, size_t sz)
+{
+    centry *e;
+    uint32_t k;
+
+    for (k = 0; k < NCLASS; k++) {
+        if (sz <= Class[k]) break;
+    }
+
+    if (k == NCLASS) {
+        if (!(e = malloc(sz))) return 0;
+
+        e->cls  = CLS_BIG;
+        e->size = (uint32_t)sz;
+        return e;
+    }
+
+    if (!s->pool[k]) {
+        if (mempool_new(&s->pool[k], 0, Class[k], 0, (64 * 1024) / Class[k]) < 0)
+            return 0;
+    }
+
+    if (!(e = mempool_alloc(s->pool[k]))) return 0;
+
+    e->cls  = k;
+    e->size = Class[k];
+    return e;
+}
+
+
+static inline void
+efree(shard *s, centry *e)
+{
+    if (e->cls == CLS_BIG) free(e);
+    else                   mempool_free(s->pool[e->cls], e);
+}
+
+
+
+/*
+ * Ghost FIFO
+ */
+
+static void
+ghost_drop(ghost *g)
+{
+    uint64_t h   = g->v[g->head],
+             seq = g->seq - g->n + 1;
+    void *x;
+
+    // Rarely, it was re-added since; then it stays
+    if (ht_remove(&g->idx, h, &x) && (uint64_t)(uintptr_t)x != seq)
+        ht_probe(&g->idx, h, x);
+
+    g->head = (g->head + 1) % g->cap;
+    g->n--;
+}
+
+
+static void
+ghost_add(ghost *g, uint64_t h, uint64_t limit)
+{
+    while (g->n > 0 && g->n >= limit) ghost_drop(g);
+
+    if (g->n == g->cap) {
+        uint32_t  cap = g->cap ? 2 * g->cap : GHOST_MIN;
+        uint64_t *v   = NEWA(uint64_t, cap);
+        uint32_t  i;
+
+        // No room to remember it; the ghost is only a hint
+        if (!v) return;
+
+        for (i = 0; i < g->n; i++) v[i] = g->v[(g->head + i) % g->cap];
+        DEL(g->v);
+        g->v    = v;
+        g->cap  = cap;
+        g->head = 0;
+    }
+
+    g->v[(g->head + g->n) % g->cap] = h;
+    g->n++;
+    g->seq++;
+
+    // A hash in the ghost isn't cached: a put takes it out of the
+    // ghost. But two keys can share a hash.
+    if (ht_probe(&g->idx, h, (void *)(uintptr_t)g->seq)) {
+        ht_remove(&g->idx, h, 0);
+        ht_probe(&g->idx, h, (void *)(uintptr_t)g->seq);
+    }
+}
+
+
+static inline int
+ghost_hit(ghost *g, uint64_t h)
+{
+    return ht_remove(&g->idx, h, 0);
+}
+
+
+
+/*
+ * Shard internals; all under the exclusive lock
+ */
+
+// Remove 'e' from everything and free it
+static void
+unlink_entry(shard *s, centry *e)
+{
+    ht_remove(&s->idx, e->h, 0);
+
+    if (e->queue == Q_SMALL) {
+        DL_REMOVE(&s->small, e, q);
+        s->sbytes -= e->size;
+    } else {
+        DL_REMOVE(&s->main, e, q);
+        s->mitems--;
+    }
+
+    if (e->expire) {
+        DL_REMOVE(&s->wheel[e->slot], e, tw);
+        s->nttl--;
+    }
+
+    s->bytes -= e->size;
+    s->items--;
+    efree(s, e);
+}
+
+
+static inline void
+to_main(shard *s, centry *e)
+{
+    e->queue = Q_MAIN;
+    DL_INSERT_HEAD(&s->main, e, q);
+    s->mitems++;
+}
+
+
+// Evict one entry
+static void
+evict(shard *s)
+{
+    centry *e;
+
+    for (;;) {
+        if (s->sbytes > s->scap || DL_EMPTY(&s->main)) {
+            if (!(e = DL_LAST(&s->small))) return;
+
+            if (e->freq > 1) {
+                DL_REMOVE(&s->small, e, q);
+                s->sbytes -= e->size;
+                e->freq    = 0;
+                to_main(s, e);
+                continue;
+            }
+
+            // Not hit enough: out; but remember it
+            ghost_add(&s->g, e->h, s->mitems > GHOST_MIN ? s->mitems : GHOST_MIN);
+        } else {
+            e = DL_LAST(&s->main);
+            if (e->freq > 0) {
+                e->freq--;
+                DL_REMOVE(&s->main, e, q);
+                DL_INSERT_HEAD(&s->main, e, q);
+                continue;
+            }
+        }
+
+        unlink_entry(s, e);
+        s->evictions++;
+        return;
+    }
+}
+
+
+// Free the entries that expired by 'ms'; unless 'all', leave the
+// current slot alone if it was swept already.
+static void
+advance(const cache *c, shard *s, uint64_t ms, int all)
+{
+    uint64_t t = ms / c->tick,
+             k = s->tick;
+
+    if (t < k || (t == k && !all)) return;
+    if (t - k >= WHEEL) k = t - WHEEL + 1;
+
+    for (; k <= t; k++) {
+        cq *w = &s->wheel[k % WHEEL];
+        centry *e, *nx;
+
+        for (e = DL_FIRST(w); e; e = nx) {
+            nx = DL_NEXT(e, tw);
+            if (e->expire <= ms) {
+                unlink_entry(s, e);
+                s->expired++;
+            }
+        }
+    }
+    s->tick = t;
+}
+
+
+
+/*
+ * Public interface
+ */
+
+int
+cache_new(cache **p_c, const cache_opt *o)
+{
+    uint32_t n = o->nshards ? o->nshards : 4 * (uint32_t)sys_cpu_getavail(),
+             i, k;
+    uint64_t t;
+    cache *c;
+    void *p;
+
+    *p_c = 0;
+    if (o->capacity < 4096) return -EINVAL;
+
+    // power of 2, and shards big enough to be useful
+    for (k = 1; k < n; k *= 2) ;
+    n = k;
+    while (n > 1 && (o->capacity / n) < SHARD_MIN) n /= 2;
+
+    if (!(c = NEWZ(cache))) return -ENOMEM;
+    if (posix_memalign(&p, 64, n * sizeof(shard)) != 0) {
+        DEL(c);
+        return -ENOMEM;
+    }
+
+    c->s       = p;
+    c->nshards = n;
+    c->tick    = o->tick ? o->tick : DEF_TICK;
+    c->clock   = o->clock;
+    c->seed    = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)c;
+
+    t = now(c) / c->tick;
+    memset(c->s, 0, n * sizeof(shard));
+    for (i = 0; i < n; i++) {
+        shard *s = &c->s[i];
+
+        pthread_rwlock_init(&s->lock, 0);
+        ht_init(&s->idx, 10);
+        ht_init(&s->g.idx, 10);
+        DL_INIT(&s->small);
+        DL_INIT(&s->main);
+        for (k = 0; k < WHEEL; k++) DL_INIT(&s->wheel[k]);
+
+        s->cap  = o->capacity / n;
+        s->scap = (s->cap * SMALL_PCT) / 100;
+        s->tick = t;
+        if (!s->idx.b || !s->g.idx.b) {
+            c->nshards = i + 1;
+            cache_delete(c);
+            return -ENOMEM;
+        }
+    }
+
+    *p_c = c;
+    return 0;
+}
+
+
+void
+cache_delete(cache *c)
+{
+    uint32_t i, k;
+
+    for (i = 0; i < c->nshards; i++) {
+        shard *s = &c->s[i];
+        centry *e;
+
+        // Pooled entries go with their pools
+        while ((e = DL_REMOVE_HEAD(&s->small, q))) if (e->cls == CLS_BIG) free(e);
+        while ((e = DL_REMOVE_HEAD(&s->main, q)))  if (e->cls == CLS_BIG) free(e);
+
+        for (k = 0; k < NCLASS; k++) {
+            if (s->pool[k]) mempool_delete(s->pool[k]);
+        }
+
+        if (s->idx.b)   ht_fini(&s->idx);
+        if (s->g.idx.b) ht_fini(&s->g.idx);
+        DEL(s->g.v);
+        pthread_rwlock_destroy(&s->lock);
+    }
+
+    DEL(c->s);
+    DEL(c);
+}
+
+
+int
+cache_put(cache *c, const void *key, size_t klen, const void *val, size_t vlen, uint32_t ttl)
+{
+    uint64_t h  = keyhash(c, key, klen);
+    shard   *s  = shard_of(c, h);
+    size_t   sz = sizeof(centry) + klen + vlen;
+    uint64_t ms = 0;
+    uint8_t  q  = Q_SMALL,
+             f  = 0;
+    centry  *e;
+    void    *v;
+
+    if (sz > (s->cap / 8)) return -E2BIG;
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    if (ttl || s->nttl) {
+        ms = now(c);
+        if (s->nttl) advance(c, s, ms, 0);
+    }
+
+    // A replaced entry keeps its queue and frequency; it goes to
+    // the head of the queue like a new one.
+    if (ht_find(&s->idx, h, &v)) {
+        e = v;
+        q = e->queue;
+        f = e->freq;
+        unlink_entry(s, e);
+    } else if (ghost_hit(&s->g, h)) {
+        q = Q_MAIN;
+    }
+
+    while (s->items > 0 && (s->bytes + sz) > s->cap) evict(s);
+
+    if (!(e = ealloc(s, sz))) {
+        pthread_rwlock_unlock(&s->lock);
+        return -ENOMEM;
+    }
+
+    // Charged at the size of its class
+    while (s->items > 0 && (s->bytes + e->size) > s->cap) evict(s);
+
+    e->h      = h;
+    e->klen   = (uint32_t)klen;
+    e->vlen   = (uint32_t)vlen;
+    e->freq   = f;
+    e->expire = 0;
+    memcpy(e->data, key, klen);
+    memcpy(e->data + klen, val, vlen);
+
+    ht_probe(&s->idx, h, e);
+    if (q == Q_MAIN) {
+        to_main(s, e);
+    } else {
+        e->queue = Q_SMALL;
+        DL_INSERT_HEAD(&s->small, e, q);
+        s->sbytes += e->size;
+    }
+
+    if (ttl) {
+        e->expire = ms + ttl;
+        e->slot   = (e->expire / c->tick) % WHEEL;
+        DL_INSERT_HEAD(&s->wheel[e->slot], e, tw);
+        s->nttl++;
+    }
+
+    s->bytes += e->size;
+    s->items++;
+    s->puts++;
+    pthread_rwlock_unlock(&s->lock);
+    return 0;
+}
+
+
+ssize_t
+cache_get(cache *c, const void *key, size_t klen, void *buf, size_t bufsz)
+{
+    uint64_t h = keyhash(c, key, klen);
+    shard   *s = shard_of(c, h);
+    ssize_t  r = -ENOENT;
+    centry  *e;
+    void    *v;
+
+    pthread_rwlock_rdlock(&s->lock);
+
+    if (ht_find(&s->idx, h, &v) && keyeq(e = v, key, klen)) {
+        if (!e->expire || e->expire > now(c)) {
+            uint8_t f = __atomic_load_n(&e->freq, __ATOMIC_RELAXED);
+
+            memcpy(buf, e->data + klen, e->vlen < bufsz ? e->vlen : bufsz);
+            if (f < FREQ_MAX) __atomic_store_n(&e->freq, f + 1, __ATOMIC_RELAXED);
+            r = e->vlen;
+        }
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+
+    if (r >= 0) __atomic_fetch_add(&s->hits,   1, __ATOMIC_RELAXED);
+    else        __atomic_fetch_add(&s->misses, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+
+int
+cache_del(cache *c, const void *key, size_t klen)
+{
+    uint64_t h = keyhash(c, key, klen);
+    shard   *s = shard_of(c, h);
+    int      r = -ENOENT;
+    void    *v;
+
+    pthread_rwlock_wrlock(&s->lock);
+    if (ht_find(&s->idx, h, &v) && keyeq(v, key, klen)) {
+        unlink_entry(s, v);
+        r = 0;
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return r;
+}
+
+
+void
+cache_expire(cache *c)
+{
+    uint64_t ms = now(c);
+    uint32_t i;
+
+    for (i = 0; i < c->nshards; i++) {
+        shard *s = &c->s[i];
+
+        pthread_rwlock_wrlock(&s->lock);
+        if (s->nttl) advance(c, s, ms, 1);
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+
+void
+cache_stats_get(cache *c, cache_stats *st)
+{
+    uint32_t i;
+
+    memset(st, 0, sizeof *st);
+    for (i = 0; i < c->nshards; i++) {
+        shard *s = &c->s[i];
+
+        pthread_rwlock_rdlock(&s->lock);
+        st->hits      += __atomic_load_n(&s->hits,   __ATOMIC_RELAXED);
+        st->misses    += __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+        st->puts      += s->puts;
+        st->evictions += s->evictions;
+        st->expired   += s->expired;
+        st->items     += s->items;
+        st->bytes     += s->bytes;
+        st->capacity  += s->cap;
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+/* EOF */
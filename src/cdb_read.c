@@ -18,6 +18,9 @@
  * o  This uses a memory map'd interface for READONLY access to the
  *    database.
  * o  All read offsets are checked for sanity.
+ * o  CDB64 files have the same layout with 64-bit index entries,
+ *    64-bit (hash, offset) slots and an 8 byte magic in front.
+ *    Records keep 32-bit key and value lengths.
  */
 #include <unistd.h>
 #include <fcntl.h>
@@ -31,10 +34,9 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
-#include "cdb_reader.h"
-
-#define _u32(x)     ((uint32_t)(x))
-#define pU32(x)     ((uint32_t*)(x))
+#include "utils/utils.h"
+#include "utils/cdb_reader.h"
+#include "fast/encdec.h"
 
 #ifdef __little_endian
 
@@ -42,37 +44,59 @@
         assert(off < (d)->size); \
         (*pU32((d)->mmap+off));  \
         })
-#else
 
-static inline uint32_t
-dec_LE_u32(const uint8_t * p) {
-    return         p[0]
-           | (_u32(p[1]) << 8)
-           | (_u32(p[2]) << 16)
-           | (_u32(p[3]) << 24);
-}
+#define __read64(d, off) ({ \
+        assert(off < (d)->size); \
+        (*pU64((d)->mmap+off));  \
+        })
+#else
 
 #define __read32(d, off) ({ \
         assert(off < (d)->size); \
         dec_LE_u32((d)->mmap+off);     \
         })
 
+#define __read64(d, off) ({ \
+        assert(off < (d)->size); \
+        dec_LE_u64((d)->mmap+off);     \
+        })
+
 #endif /* __little_endian */
 
-extern uint64_t fasthash64(const void*, size_t, uint64_t);
+/* Keys hashed and prefetched together by cdb_find_batch() */
+#define CDB_BATCH   16
 
-static inline uint32_t
-cdb_hash(const void* k, size_t klen)
+
+/*
+ * Decode the index of a CDB64.
+ */
+static int
+__init64(CDB* db)
 {
-    uint64_t h = fasthash64(k, klen, 0x2de9ce7b97d9569f);
-    return (uint32_t)(h - (h >> 32));
+    uint8_t * p = db->mmap + CDB64_MAGIC_SIZE;
+    int i;
+
+    if (db->size < CDB64_INDEX_SIZE) return -EINVAL;
+    if (!(db->index64 = NEWA(idx64, 256))) return -ENOMEM;
+
+    for (i = 0; i < 256; i++) {
+        idx64 *ii = &db->index64[i];
+        ii->off = dec_LE_u64(p); p += 8;
+        ii->len = dec_LE_u64(p); p += 8;
+
+        if (ii->off > db->size || ii->len > ((db->size - ii->off) / 16))
+            return -EINVAL;
+    }
+
+    db->wide = 1;
+    return 0;
 }
 
 
 // Initialize 'db' for reading from 'fname'
 // Return -errno on failure; 0 on success
 int
-cdb_read_init(CDB* db, const char* filename)
+cdb_open(CDB* db, const char* filename, unsigned flags)
 {
     int r  = 0;
     int fd = open(filename, O_RDONLY);
@@ -80,8 +104,11 @@ cdb_read_init(CDB* db, const char* filename)
 
     struct stat st;
 
+    memset(db, 0, sizeof *db);
+    db->fd = -1;
+
     if (fstat(fd, &st) < 0) { r = -errno;  goto fail; }
-    if (st.st_size < 2048)  { r = -EINVAL; goto fail; }
+    if (st.st_size < (off_t)CDB_INDEX_SIZE) { r = -EINVAL; goto fail; }
 
     void* ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     if (ptr == MAP_FAILED)  { r = -errno;  goto fail; }
@@ -95,10 +122,24 @@ cdb_read_init(CDB* db, const char* filename)
      * The entries are in little-endian format.
      */
 
-    memset(db, 0, sizeof *db);
     db->fd    = fd;
     db->mmap  = (uint8_t*)ptr;
     db->size  = st.st_size;
+    db->flags = flags;
+
+    /*
+     * Lookups touch a couple of random pages each; readahead only
+     * evicts useful pages. The index is hot on every lookup.
+     */
+    if (flags & CDB_RANDOM) madvise(ptr, st.st_size, MADV_RANDOM);
+
+    if (0 == memcmp(ptr, CDB64_MAGIC, CDB64_MAGIC_SIZE)) {
+        madvise(ptr, CDB64_INDEX_SIZE, MADV_WILLNEED);
+        if ((r = __init64(db)) < 0) goto fail;
+        return 0;
+    }
+
+    madvise(ptr, CDB_INDEX_SIZE, MADV_WILLNEED);
 
 #ifdef __little_endian
     db->index = (idx *)ptr;
@@ -115,25 +156,28 @@ cdb_read_init(CDB* db, const char* filename)
     return 0;
 
 fail:
+    if (db->mmap) {
+        cdb_close(db);
+        return r;
+    }
     close(fd);
     return r;
 }
 
 
+int
+cdb_read_init(CDB* db, const char* filename)
+{
+    return cdb_open(db, filename, CDB_RANDOM);
+}
 
 
-/**
- * Find key 'key' in the DB. If found, set 'p_ret' to the
- * corresponding value.
- *
- * Returns:
- *      >= 0     key is found; # of bytes of value
- *      -ENOENT  key is not found
+/*
+ * Probe for 'key' with hash 'h' in a CDB.
  */
-ssize_t
-cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
+static ssize_t
+__find32(CDB* db, void** p_ret, const void* key, size_t klen, uint32_t h)
 {
-    uint32_t h = cdb_hash(key, klen);
     idx *ii    = &db->index[h & 0xff];
 
     if (ii->len == 0) { return -ENOENT; }
@@ -146,24 +190,24 @@ cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
         uint32_t slothash = __read32(db, slotoff);
         uint32_t off      = __read32(db, slotoff+4);
 
-        if (slothash == 0) break;
+        // Records never live at offset 0 (the index is there); a
+        // zero offset marks an empty slot.
+        if (off == 0) break;
 
-        // Now, check to see if the key matches
+        // Now, check to see if the key matches. A different key with
+        // the same hash may sit in this slot; keep probing if so.
         if (slothash == h) {
             uint32_t dklen = __read32(db, off);
             uint32_t dvlen = __read32(db, off+4);
 
-            if (dklen != klen) return -ENOENT;
-
             // Sanity check
             assert((off+8+dklen+dvlen) <= db->size);
-        
-            // key + value is at off+8
-            if (0 != memcmp(key, db->mmap+off+8, klen)) return -ENOENT;
 
-            // Value is at off+8+dklen
-            *p_ret = db->mmap + off + 8 + dklen;
-            return dvlen;
+            // key + value is at off+8; value is at off+8+dklen
+            if (dklen == klen && 0 == memcmp(key, db->mmap+off+8, klen)) {
+                *p_ret = db->mmap + off + 8 + dklen;
+                return dvlen;
+            }
         }
 
         slot = (slot + 1) % ii->len;
@@ -172,4 +216,158 @@ cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
     return -ENOENT;
 }
 
+
+/*
+ * Probe for 'key' with hash 'h' in a CDB64.
+ */
+static ssize_t
+__find64(CDB* db, void** p_ret, const void* key, size_t klen, uint64_t h)
+{
+    idx64 *ii = &db->index64[h & 0xff];
+
+    if (ii->len == 0) { return -ENOENT; }
+
+    uint64_t start = (h >> 8) % ii->len;
+    uint64_t slot  = start;
+
+    do {
+        uint64_t slotoff  = ii->off + (16 * slot);
+        uint64_t slothash = __read64(db, slotoff);
+        uint64_t off      = __read64(db, slotoff+8);
+
+        if (off == 0) break;
+
+        if (slothash == h) {
+            uint32_t dklen = __read32(db, off);
+            uint32_t dvlen = __read32(db, off+4);
+
+            assert((off+8+dklen+dvlen) <= db->size);
+
+            if (dklen == klen && 0 == memcmp(key, db->mmap+off+8, klen)) {
+                *p_ret = db->mmap + off + 8 + dklen;
+                return dvlen;
+            }
+        }
+
+        if (++slot == ii->len) slot = 0;
+    } while (slot != start);
+
+    return -ENOENT;
+}
+
+
+/**
+ * Find key 'key' in the DB. If found, set 'p_ret' to the
+ * corresponding value.
+ *
+ * Returns:
+ *      >= 0     key is found; # of bytes of value
+ *      -ENOENT  key is not found
+ */
+ssize_t
+cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
+{
+    if (db->wide) return __find64(db, p_ret, key, klen, cdb64_hash(key, klen));
+
+    return __find32(db, p_ret, key, klen, cdb_hash(key, klen));
+}
+
+
+/*
+ * Prefetch the cache line at 'off'; for a cold DB also ask the
+ * kernel to start reading its page.
+ */
+static inline void
+__prefetch(CDB* db, uint64_t off, uintptr_t pgmask)
+{
+    const uint8_t* p = db->mmap + off;
+
+    if (off >= db->size) return;
+
+    if (db->flags & CDB_COLD)
+        madvise((void*)((uintptr_t)p & ~pgmask), pgmask+1, MADV_WILLNEED);
+
+    __builtin_prefetch(p);
+}
+
+
+/*
+ * Return the record offset in the first probed slot for hash 'h'
+ * if its hash matches; 0 otherwise.
+ */
+static inline uint64_t
+__first_slot(CDB* db, uint64_t h, int issue, uintptr_t pgmask)
+{
+    uint64_t slotoff, len;
+
+    if (db->wide) {
+        idx64 *ii = &db->index64[h & 0xff];
+
+        if ((len = ii->len) == 0) return 0;
+        slotoff = ii->off + (16 * ((h >> 8) % len));
+        if (issue) { __prefetch(db, slotoff, pgmask); return 0; }
+        return __read64(db, slotoff) == h ? __read64(db, slotoff+8) : 0;
+    } else {
+        idx *ii = &db->index[h & 0xff];
+        uint32_t h32 = (uint32_t)h;
+
+        if ((len = ii->len) == 0) return 0;
+        slotoff = ii->off + (8 * ((h32 >> 8) % len));
+        if (issue) { __prefetch(db, slotoff, pgmask); return 0; }
+        return __read32(db, slotoff) == h32 ? __read32(db, slotoff+4) : 0;
+    }
+}
+
+
+size_t
+cdb_find_batch(CDB* db, size_t n, const void* const* keys,
+               const size_t* klens, void** vals, ssize_t* vlens)
+{
+    uintptr_t pgmask = sysconf(_SC_PAGESIZE) - 1;
+    uint64_t  h[CDB_BATCH];
+    size_t found = 0;
+    size_t i, j, m;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i) < CDB_BATCH ? (n - i) : CDB_BATCH;
+
+        // 1. hash the group and fetch the first slot of each key
+        for (j = 0; j < m; j++) {
+            h[j] = db->wide ? cdb64_hash(keys[i+j], klens[i+j])
+                            : cdb_hash(keys[i+j], klens[i+j]);
+            __first_slot(db, h[j], 1, pgmask);
+        }
+
+        // 2. fetch the records those slots point to
+        for (j = 0; j < m; j++) {
+            uint64_t off = __first_slot(db, h[j], 0, pgmask);
+            if (off) __prefetch(db, off, pgmask);
+        }
+
+        // 3. the actual lookups now mostly hit memory
+        for (j = 0; j < m; j++) {
+            void* p   = 0;
+            ssize_t r = db->wide ? __find64(db, &p, keys[i+j], klens[i+j], h[j])
+                                 : __find32(db, &p, keys[i+j], klens[i+j], (uint32_t)h[j]);
+
+            vals[i+j]  = p;
+            vlens[i+j] = r;
+            if (r >= 0) found++;
+        }
+    }
+    return found;
+}
+
+
+void
+cdb_close(CDB* db)
+{
+    if (db->mmap) munmap(db->mmap, db->size);
+    if (db->fd >= 0) close(db->fd);
+
+    DEL(db->index64);
+    db->mmap = 0;
+    db->fd   = -1;
+}
+
 // EOF
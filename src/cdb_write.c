@@ -0,0 +1,480 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_write.c - CDB Writer Interface
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  The layout is what cdb_read.c expects: a 256 entry (offset,
+ *    length) index, the records as (klen, vlen, key, val) and then
+ *    the 256 hash tables of (hash, offset) slots. All integers are
+ *    little-endian u32.
+ * o  Each table has twice as many slots as records and uses linear
+ *    probing from (hash >> 8) % len. A zero offset marks an empty
+ *    slot - no record can live at offset 0.
+ * o  Records go through a large write buffer; the hash tables are
+ *    built one (or one range of) table at a time and written with
+ *    pwrite(2) at their precomputed offsets. That makes the tables
+ *    independent and lets the parallel mode hand out ranges of the
+ *    low hash byte to a job_manager.
+ * o  A CDB64 has an 8 byte magic before a 256 entry index of u64
+ *    (offset, length) and its slots are u64 (hash, offset) pairs.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/cdb_writer.h"
+#include "fast/encdec.h"
+#include "posix/job.h"
+
+/* Size of the write buffer for records */
+#define CDB_BUFSZ       (1024 * 1024)
+
+/* Max file size; all offsets are u32 */
+#define CDB_MAXSIZE     ((uint64_t)UINT32_MAX)
+
+/* Tables handed to a worker at a time in parallel mode */
+#define CDB_JOB_TABLES  16
+
+
+static int
+__pwrite_all(int fd, const uint8_t* buf, size_t n, uint64_t off)
+{
+    while (n > 0) {
+        ssize_t m = pwrite(fd, buf, n, off);
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+
+        buf += m;
+        off += m;
+        n   -= m;
+    }
+    return 0;
+}
+
+
+static int
+__flush(cdb_writer* w)
+{
+    int r = __pwrite_all(w->fd, w->buf, w->buflen, w->off - w->buflen);
+
+    w->buflen = 0;
+    return r;
+}
+
+
+static void
+__release(cdb_writer* w)
+{
+    if (w->fd >= 0) close(w->fd);
+
+    DEL(w->buf);
+    DEL(w->slots.ptr);
+    DEL(w->fname);
+    DEL(w->tmpname);
+
+    w->fd = -1;
+}
+
+
+static int
+__init(cdb_writer* w, const char* fname, int wide)
+{
+    size_t n     = strlen(fname);
+    size_t hdrsz = wide ? CDB64_INDEX_SIZE : CDB_INDEX_SIZE;
+    size_t width = wide ? sizeof(cdb_slot64) : sizeof(cdb_slot);
+    int r;
+
+    memset(w, 0, sizeof *w);
+
+    w->fd        = -1;
+    w->wide      = wide;
+    w->off       = hdrsz;
+    w->buflen    = hdrsz;     // index is zero until finish
+    w->fname     = strdup(fname);
+    w->tmpname   = NEWA(char, n + 8);
+    w->buf       = NEWZA(uint8_t, CDB_BUFSZ);
+    w->slotsz    = 65536;
+    w->slots.ptr = malloc(width * w->slotsz);
+
+    if (!w->fname || !w->tmpname || !w->buf || !w->slots.ptr) {
+        r = -ENOMEM;
+        goto fail;
+    }
+
+    snprintf(w->tmpname, n + 8, "%s.XXXXXX", fname);
+    if ((w->fd = mkstemp(w->tmpname)) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    fchmod(w->fd, 0644);
+    return 0;
+
+fail:
+    __release(w);
+    return r;
+}
+
+
+int
+cdb_write_init(cdb_writer* w, const char* fname)
+{
+    return __init(w, fname, 0);
+}
+
+
+int
+cdb64_write_init(cdb_writer* w, const char* fname)
+{
+    return __init(w, fname, 1);
+}
+
+
+int
+cdb_write(cdb_writer* w, const void* key, size_t klen,
+          const void* val, size_t vlen)
+{
+    uint64_t recsz = 8 + (uint64_t)klen + vlen;
+    uint64_t h;
+    int r;
+
+    if (klen > UINT32_MAX || vlen > UINT32_MAX) return -EFBIG;
+
+    if (w->wide) {
+        h = cdb64_hash(key, klen);
+    } else {
+        h = cdb_hash(key, klen);
+
+        /* Leave room for this record's slots (2 per record) too */
+        if ((w->off + recsz + (16 * (uint64_t)(w->nslots + 1))) > CDB_MAXSIZE)
+            return -EFBIG;
+    }
+
+    /* Table lengths are u32 in a CDB */
+    if (w->counts[h & 0xff] == (UINT32_MAX / 2)) return -EFBIG;
+
+    if (w->nslots == w->slotsz) {
+        size_t n     = w->slotsz * 2;
+        size_t width = w->wide ? sizeof(cdb_slot64) : sizeof(cdb_slot);
+        void*  ss    = realloc(w->slots.ptr, n * width);
+
+        if (!ss) return -ENOMEM;
+
+        w->slots.ptr = ss;
+        w->slotsz    = n;
+    }
+
+    if (w->wide) {
+        cdb_slot64* s = &w->slots.s64[w->nslots++];
+        s->hash = h;
+        s->off  = w->off;
+    } else {
+        cdb_slot* s = &w->slots.s32[w->nslots++];
+        s->hash = (uint32_t)h;
+        s->off  = (uint32_t)w->off;
+    }
+    w->counts[h & 0xff]++;
+
+    if ((w->buflen + recsz) > CDB_BUFSZ) {
+        if ((r = __flush(w)) < 0) return r;
+    }
+
+    w->off += recsz;
+    if (recsz > CDB_BUFSZ) {
+        uint8_t hdr[8];
+
+        enc_LE_u32(hdr,   klen);
+        enc_LE_u32(hdr+4, vlen);
+
+        if ((r = __pwrite_all(w->fd, hdr, 8, w->off - recsz)) < 0)        return r;
+        if ((r = __pwrite_all(w->fd, key, klen, w->off - recsz + 8)) < 0) return r;
+        if ((r = __pwrite_all(w->fd, val, vlen, w->off - vlen)) < 0)       return r;
+        return 0;
+    }
+
+    uint8_t* p = w->buf + w->buflen;
+
+    enc_LE_u32(p,   klen);
+    enc_LE_u32(p+4, vlen);
+    memcpy(p+8, key, klen);
+    memcpy(p+8+klen, val, vlen);
+
+    w->buflen += recsz;
+    return 0;
+}
+
+
+/*
+ * Table layout computed by cdb_write_finish(): slots sorted by the
+ * low hash byte and where each table starts in the sorted array and
+ * in the file.
+ */
+struct tables
+{
+    cdb_writer* w;
+    union {
+        cdb_slot   *s32;
+        cdb_slot64 *s64;
+        void       *ptr;
+    } sorted;
+    size_t      start[257];
+    uint64_t    toff[256];
+};
+typedef struct tables tables;
+
+
+/* A range of tables for one job */
+struct tjob
+{
+    int lo, hi;
+    int err;
+};
+typedef struct tjob tjob;
+
+
+/*
+ * Build and write tables [lo, hi) using 'tbl' as scratch; 'tbl'
+ * must hold the largest of these tables.
+ */
+static int
+build_tables(tables* t, int lo, int hi, uint8_t* tbl)
+{
+    cdb_writer* w = t->w;
+    size_t es     = w->wide ? 16 : 8;
+    int b;
+
+    for (b = lo; b < hi; b++) {
+        uint32_t n    = w->counts[b];
+        uint32_t tlen = 2 * n;
+        size_t   k;
+        int r;
+
+        if (n == 0) continue;
+
+        memset(tbl, 0, es * (size_t)tlen);
+        for (k = t->start[b]; k < t->start[b+1]; k++) {
+            if (w->wide) {
+                cdb_slot64* s = &t->sorted.s64[k];
+                size_t i      = (s->hash >> 8) % tlen;
+
+                while (dec_LE_u64(tbl + (16 * i) + 8) != 0) {
+                    if (++i == tlen) i = 0;
+                }
+
+                enc_LE_u64(tbl + (16 * i),     s->hash);
+                enc_LE_u64(tbl + (16 * i) + 8, s->off);
+            } else {
+                cdb_slot* s = &t->sorted.s32[k];
+                uint32_t i  = (s->hash >> 8) % tlen;
+
+                while (dec_LE_u32(tbl + (8 * i) + 4) != 0) {
+                    if (++i == tlen) i = 0;
+                }
+
+                enc_LE_u32(tbl + (8 * i),     s->hash);
+                enc_LE_u32(tbl + (8 * i) + 4, s->off);
+            }
+        }
+
+        if ((r = __pwrite_all(w->fd, tbl, es * (size_t)tlen, t->toff[b])) < 0) return r;
+    }
+    return 0;
+}
+
+
+/*
+ * Bytes needed for the largest of the tables [lo, hi)
+ */
+static size_t
+max_table(cdb_writer* w, int lo, int hi)
+{
+    uint32_t m = 0;
+    int b;
+
+    for (b = lo; b < hi; b++) {
+        if (w->counts[b] > m) m = w->counts[b];
+    }
+    return (2 * (size_t)m * (w->wide ? 16 : 8)) + 16;
+}
+
+
+static int
+table_job(void* ctx, void* j, int thr)
+{
+    tables* t   = (tables*)ctx;
+    tjob*  job  = (tjob*)j;
+    uint8_t* tbl = NEWA(uint8_t, max_table(t->w, job->lo, job->hi));
+
+    USEARG(thr);
+    if (!tbl) return (job->err = -ENOMEM);
+
+    job->err = build_tables(t, job->lo, job->hi, tbl);
+    DEL(tbl);
+    return job->err;
+}
+
+
+// All the tables on this thread
+static int
+serial_tables(tables* t)
+{
+    uint8_t* tbl = NEWA(uint8_t, max_table(t->w, 0, 256));
+    int r;
+
+    r = tbl ? build_tables(t, 0, 256, tbl) : -ENOMEM;
+    DEL(tbl);
+    return r;
+}
+
+
+static int
+par_tables(tables* t, int nthreads)
+{
+    tjob jobs[256 / CDB_JOB_TABLES];
+    job_manager jm;
+    int i;
+
+    if (nthreads <= 0) nthreads = sys_cpu_getavail();
+    if (nthreads > (int)ARRAY_SIZE(jobs)) nthreads = ARRAY_SIZE(jobs);
+
+    // No threads: stop the ones that did start and build them here
+    if (job_manager_init(&jm, nthreads, table_job, t) <= 0) {
+        job_manager_wait(&jm);
+        job_manager_destroy(&jm);
+        return serial_tables(t);
+    }
+
+    for (i = 0; i < (int)ARRAY_SIZE(jobs); i++) {
+        tjob* j = &jobs[i];
+
+        j->lo  = i * CDB_JOB_TABLES;
+        j->hi  = j->lo + CDB_JOB_TABLES;
+        j->err = 0;
+        job_manager_submit_job(&jm, j);
+    }
+
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+
+    for (i = 0; i < (int)ARRAY_SIZE(jobs); i++) {
+        if (jobs[i].err < 0) return jobs[i].err;
+    }
+    return 0;
+}
+
+
+int
+cdb_write_finish(cdb_writer* w, int nthreads)
+{
+    uint8_t index[CDB64_INDEX_SIZE];
+    size_t  pos[256];
+    size_t  width = w->wide ? sizeof(cdb_slot64) : sizeof(cdb_slot);
+    size_t  es    = w->wide ? 16 : 8;
+    uint8_t* p    = index;
+    uint64_t toff;
+    tables t;
+    size_t i;
+    int r;
+
+    if ((r = __flush(w)) < 0) goto fail;
+
+    /*
+     * Counting sort of the slots by table; the order within a table
+     * is preserved so that duplicate keys probe in insertion order.
+     */
+    t.w          = w;
+    t.sorted.ptr = malloc(width * (w->nslots + 1));
+    if (!t.sorted.ptr) { r = -ENOMEM; goto fail; }
+
+    if (w->wide) {
+        memcpy(p, CDB64_MAGIC, CDB64_MAGIC_SIZE);
+        p += CDB64_MAGIC_SIZE;
+    }
+
+    toff = w->off;
+    t.start[0] = 0;
+    for (i = 0; i < 256; i++) {
+        t.start[i+1] = t.start[i] + w->counts[i];
+        t.toff[i]    = toff;
+        pos[i]       = t.start[i];
+
+        if (w->wide) {
+            enc_LE_u64(p,     toff);
+            enc_LE_u64(p + 8, 2 * (uint64_t)w->counts[i]);
+            p += 16;
+        } else {
+            enc_LE_u32(p,     (uint32_t)toff);
+            enc_LE_u32(p + 4, 2 * w->counts[i]);
+            p += 8;
+        }
+
+        toff += 2 * es * (uint64_t)w->counts[i];
+    }
+
+    if (w->wide) {
+        for (i = 0; i < w->nslots; i++) {
+            cdb_slot64* s = &w->slots.s64[i];
+            t.sorted.s64[pos[s->hash & 0xff]++] = *s;
+        }
+    } else {
+        for (i = 0; i < w->nslots; i++) {
+            cdb_slot* s = &w->slots.s32[i];
+            t.sorted.s32[pos[s->hash & 0xff]++] = *s;
+        }
+    }
+    DEL(w->slots.ptr);
+
+    r = nthreads == 1 ? serial_tables(&t) : par_tables(&t, nthreads);
+    DEL(t.sorted.ptr);
+    if (r < 0) goto fail;
+
+    if ((r = __pwrite_all(w->fd, index, p - index, 0)) < 0) goto fail;
+    if (fsync(w->fd) < 0) { r = -errno; goto fail; }
+
+    r = close(w->fd);
+    w->fd = -1;
+    if (r < 0) { r = -errno; goto fail; }
+
+    if (rename(w->tmpname, w->fname) < 0) { r = -errno; goto fail; }
+
+    __release(w);
+    return 0;
+
+fail:
+    cdb_write_abort(w);
+    return r;
+}
+
+
+void
+cdb_write_abort(cdb_writer* w)
+{
+    if (w->tmpname) unlink(w->tmpname);
+    __release(w);
+}
+
+// EOF
@@ -0,0 +1,492 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdc.c - Content defined chunking (FastCDC).
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in cdc.h.
+ *
+ * o  The gear hash shifts left once per byte, so bit 63 depends on
+ *    the last 64 bytes and bit k on the last k+1; the cut masks use
+ *    the top bits.
+ *
+ * o  The gear table is fixed (made from the murmur3 finalizer):
+ *    chunks - and hence dedup - must be the same across runs and
+ *    machines.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils/cdc.h"
+#include "utils/cpu.h"
+#include "utils/utils.h"
+
+// Need libsodium to be installed.
+#include "sodium.h"
+
+
+// A slice of a parallel chunking is at least this many max size
+// chunks (and 1MB)
+#define SLICE_CHUNKS    16
+#define SLICE_MIN       (1024 * 1024)
+
+
+// murmur3 finalizer
+static inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+
+static void
+hash_init(void *hs)
+{
+    crypto_generichash_init(hs, 0, 0, CDC_HASHLEN);
+}
+
+
+static void
+hash_chunk(cdc_chunk *ch, const uint8_t *p)
+{
+    crypto_generichash_state st;
+
+    crypto_generichash_init(&st, 0, 0, CDC_HASHLEN);
+    crypto_generichash_update(&st, p, ch->len);
+    crypto_generichash_final(&st, ch->hash, CDC_HASHLEN);
+}
+
+
+int
+cdc_init(cdc *c, uint32_t min, uint32_t avg, uint32_t max, uint32_t flags)
+{
+    uint32_t i, bits = 0;
+
+    if (avg == 0) {
+        avg = 8192;
+        min = avg / 4;
+        max = avg * 8;
+    }
+
+    if (!(CDC_MIN_SIZE <= min && min < avg && avg < max && max <= CDC_MAX_SIZE))
+        return -EINVAL;
+
+    while ((2u << bits) <= avg) bits++;
+
+    memset(c, 0, sizeof *c);
+    c->min    = min;
+    c->avg    = avg;
+    c->max    = max;
+    c->flags  = flags & CDC_HASH;
+    c->mask_s = ~0ULL << (64 - (bits + 2));
+    c->mask_l = ~0ULL << (64 - (bits - 2));
+
+    for (i = 0; i < 256; i++) c->gear[i] = mix((i + 1) * 0x9e3779b97f4a7c15ULL);
+
+    if (c->flags & CDC_HASH) {
+        if (posix_memalign(&c->hs, 64, sizeof(crypto_generichash_state)) != 0)
+            return -ENOMEM;
+        hash_init(c->hs);
+    }
+    return 0;
+}
+
+
+void
+cdc_fini(cdc *c)
+{
+    DEL(c->hs);
+}
+
+
+void
+cdc_reset(cdc *c)
+{
+    c->off = 0;
+    c->fp  = 0;
+    c->len = 0;
+    if (c->hs) hash_init(c->hs);
+}
+
+
+/*
+ * Scan 'n' bytes at 'p' for the end of a chunk that already has
+ * '*plen' bytes and gear hash '*pfp'. Returns true if the chunk
+ * ends in 'p'; '*used' is the number of bytes of 'p' in the chunk
+ * and '*plen', '*pfp' are updated.
+ */
+static int
+find(const cdc *c, const uint8_t *p, size_t n, uint32_t *plen, uint64_t *pfp, size_t *used)
+{
+    const uint64_t *G = c->gear;
+    uint64_t h   = *pfp;
+    uint32_t len = *plen;
+    size_t i = 0, e;
+
+    // The first 'min' bytes are never a cut point; skip them
+    if (len < c->min) {
+        e = c->min - len;
+        if (e >= n) {
+            *plen = len + (uint32_t)n;
+            *used = n;
+            return 0;
+        }
+        i = e;
+    }
+
+    if (len + i < c->avg) {
+        e = c->avg - len;
+        if (e > n) e = n;
+
+        for (; i < e; i++) {
+            h = (h << 1) + G[p[i]];
+            if (!(h & c->mask_s)) goto cut;
+        }
+    }
+
+    e = c->max - len;
+    if (e > n) e = n;
+
+    for (; i < e; i++) {
+        h = (h << 1) + G[p[i]];
+        if (!(h & c->mask_l)) goto cut;
+    }
+
+    if ((len + i) == c->max) goto end;
+
+    *plen = len + (uint32_t)i;
+    *pfp  = h;
+    *used = i;
+    return 0;
+
+cut:
+    i++;
+end:
+    *plen = len + (uint32_t)i;
+    *pfp  = 0;
+    *used = i;
+    return 1;
+}
+
+
+size_t
+cdc_cut(const cdc *c, const void *buf, size_t n)
+{
+    uint32_t len = 0;
+    uint64_t fp  = 0;
+    size_t used;
+
+    find(c, buf, n, &len, &fp, &used);
+    return used;
+}
+
+
+// The chunk in progress is complete
+static int
+emit(cdc *c, cdc_fp *fp, void *ctx)
+{
+    cdc_chunk ch;
+
+    ch.off = c->off;
+    ch.len = c->len;
+    if (c->hs) {
+        crypto_generichash_final(c->hs, ch.hash, CDC_HASHLEN);
+        hash_init(c->hs);
+    } else {
+        memset(ch.hash, 0, sizeof ch.hash);
+    }
+
+    c->off += c->len;
+    c->len  = 0;
+    c->fp   = 0;
+    return (*fp)(ctx, &ch);
+}
+
+
+int
+cdc_update(cdc *c, const void *buf, size_t n, cdc_fp *fp, void *ctx)
+{
+    const uint8_t *p = buf;
+    int r;
+
+    while (n > 0) {
+        size_t used;
+        int    cut = find(c, p, n, &c->len, &c->fp, &used);
+
+        if (c->hs) crypto_generichash_update(c->hs, p, used);
+
+        p += used;
+        n -= used;
+        if (cut && (r = emit(c, fp, ctx)) != 0) return r;
+    }
+    return 0;
+}
+
+
+int
+cdc_final(cdc *c, cdc_fp *fp, void *ctx)
+{
+    int r = 0;
+
+    if (c->len > 0) r = emit(c, fp, ctx);
+
+    cdc_reset(c);
+    return r;
+}
+
+
+
+/*
+ * Parallel chunking of a buffer
+ */
+
+struct vec
+{
+    cdc_chunk * v;
+    size_t      n;
+    size_t      cap;
+};
+typedef struct vec vec;
+
+
+static int
+push(vec *v, uint64_t off, uint32_t len)
+{
+    cdc_chunk *ch;
+
+    if (v->n == v->cap) {
+        size_t     cap = v->cap ? 2 * v->cap : 1024;
+        cdc_chunk *x   = RENEWA(cdc_chunk, v->v, cap);
+
+        if (!x) return -ENOMEM;
+        v->v   = x;
+        v->cap = cap;
+    }
+
+    ch      = &v->v[v->n++];
+    ch->off = off;
+    ch->len = len;
+    return 0;
+}
+
+
+// Append chunk at 'pos' to 'v' and return its length
+static int
+chunk_at(const cdc *c, const uint8_t *buf, size_t n, uint64_t pos, vec *v)
+{
+    size_t len = cdc_cut(c, buf + pos, n - pos);
+    int r;
+
+    if ((r = push(v, pos, (uint32_t)len)) < 0) return r;
+    if (c->flags & CDC_HASH) hash_chunk(&v->v[v->n - 1], buf + pos);
+    return 0;
+}
+
+
+struct slice
+{
+    const cdc *     c;
+    const uint8_t * buf;
+    size_t          n;
+
+    uint64_t        start;
+    uint64_t        stop;       // chunks starting before this
+    vec             out;
+
+    pthread_t       tid;
+    int             err;
+};
+typedef struct slice slice;
+
+
+static void *
+slice_worker(void *x)
+{
+    slice *s = x;
+    uint64_t pos = s->start;
+
+    while (pos < s->stop) {
+        if ((s->err = chunk_at(s->c, s->buf, s->n, pos, &s->out)) < 0) break;
+        pos += s->out.v[s->out.n - 1].len;
+    }
+    return 0;
+}
+
+
+static inline uint64_t
+vec_end(const vec *v)
+{
+    return v->n ? v->v[v->n - 1].off + v->v[v->n - 1].len : 0;
+}
+
+
+/*
+ * Append the chunks of slice 's' to 'v': chunk from the end of 'v'
+ * until a cut point is one of the slice's, then take the rest of
+ * the slice.
+ */
+static int
+stitch(const cdc *c, const uint8_t *buf, size_t n, vec *v, const slice *s)
+{
+    const vec *w = &s->out;
+    uint64_t pos = vec_end(v);
+    size_t j = 0;
+    int r;
+
+    for (;;) {
+        while (j < w->n && w->v[j].off < pos) j++;
+        if (j == w->n) return 0;
+
+        if (w->v[j].off == pos) break;
+
+        if ((r = chunk_at(c, buf, n, pos, v)) < 0) return r;
+        pos = vec_end(v);
+    }
+
+    if ((v->n + (w->n - j)) > v->cap) {
+        size_t     cap = v->n + (w->n - j);
+        cdc_chunk *x   = RENEWA(cdc_chunk, v->v, cap);
+
+        if (!x) return -ENOMEM;
+        v->v   = x;
+        v->cap = cap;
+    }
+
+    memcpy(&v->v[v->n], &w->v[j], (w->n - j) * sizeof w->v[0]);
+    v->n += w->n - j;
+    return 0;
+}
+
+
+int
+cdc_buf(const cdc *c, const void *buf, size_t n, int nthreads,
+        cdc_chunk **p_ch, size_t *p_n)
+{
+    const uint8_t *p = buf;
+    size_t  smin = (size_t)SLICE_CHUNKS * c->max,
+            sz;
+    slice * s;
+    vec     v;
+    int i, nthr, r = 0;
+
+    *p_ch = 0;
+    *p_n  = 0;
+    if (n == 0) return 0;
+
+    if (smin < SLICE_MIN) smin = SLICE_MIN;
+    if (nthreads <= 0)    nthreads = sys_cpu_getavail();
+
+    nthr = (n / smin) < (size_t)nthreads ? (int)(n / smin) : nthreads;
+    if (nthr < 1) nthr = 1;
+
+    s = NEWZA(slice, nthr);
+    if (!s) return -ENOMEM;
+
+    sz = n / nthr;
+    for (i = 0; i < nthr; i++) {
+        s[i].c     = c;
+        s[i].buf   = p;
+        s[i].n     = n;
+        s[i].start = i * sz;
+        s[i].stop  = (i == nthr-1) ? n : (i + 1) * sz;
+    }
+
+    if (nthr == 1) {
+        slice_worker(&s[0]);
+    } else {
+        for (i = 0; i < nthr; i++) {
+            if ((r = pthread_create(&s[i].tid, 0, slice_worker, &s[i])) != 0) {
+                r = -r;
+                break;
+            }
+        }
+        nthr = i;
+        for (i = 0; i < nthr; i++) pthread_join(s[i].tid, 0);
+    }
+
+    for (i = 0; i < nthr; i++) {
+        if (s[i].err < 0) r = s[i].err;
+    }
+
+    v = s[0].out;
+    memset(&s[0].out, 0, sizeof s[0].out);
+
+    for (i = 1; r == 0 && i < nthr; i++) r = stitch(c, p, n, &v, &s[i]);
+
+    // Tail that no slice got in sync with
+    while (r == 0 && vec_end(&v) < n) r = chunk_at(c, p, n, vec_end(&v), &v);
+
+    for (i = 0; i < nthr; i++) DEL(s[i].out.v);
+    DEL(s);
+
+    if (r < 0) {
+        DEL(v.v);
+        return r;
+    }
+
+    *p_ch = v.v;
+    *p_n  = v.n;
+    return 0;
+}
+
+
+int
+cdc_file(const cdc *c, const char *fn, int nthreads, cdc_chunk **p_ch, size_t *p_n)
+{
+    struct stat st;
+    void *p;
+    int fd, r;
+
+    *p_ch = 0;
+    *p_n  = 0;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    r = -errno;
+    close(fd);
+    if (p == MAP_FAILED) return r;
+
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    r = cdc_buf(c, p, st.st_size, nthreads, p_ch, p_n);
+    munmap(p, st.st_size);
+    return r;
+}
+
+/* EOF */
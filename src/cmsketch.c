@@ -0,0 +1,344 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cmsketch.c - Count-Min and Count-Sketch frequency sketches.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in cmsketch.h.
+ *
+ * o  The top 32 bits of the hash pick the cache line (by multiply
+ *    and shift, so the number of lines needn't be a power of 2).
+ *    Row i uses slots [i*s, (i+1)*s) of the line; nibble i of a
+ *    remix of the hash picks one of them. Bit i of the low bits of
+ *    the hash is the Count-Sketch sign of row i.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+
+#include "utils/cmsketch.h"
+#include "utils/utils.h"
+
+
+// murmur3 finalizer
+static inline uint64_t
+remix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+
+static inline uint32_t *
+line(const cms *c, uint64_t hash)
+{
+    uint64_t i = ((hash >> 32) * (uint64_t)c->nlines) >> 32;
+
+    return c->c + CMS_LINE * i;
+}
+
+static inline uint32_t
+slot(const cms *c, uint64_t g, uint32_t i)
+{
+    return i * c->slots + ((((g >> (4 * i)) & 15) * c->slots) >> 4);
+}
+
+// Signed counter value of row 'i'
+static inline int64_t
+signed_val(uint64_t hash, uint32_t i, uint32_t v)
+{
+    int64_t x = (int32_t)v;
+
+    return ((hash >> i) & 1) ? -x : x;
+}
+
+
+int
+cms_init(cms *c, int type, double eps, double delta, uint32_t flags)
+{
+    double w, k;
+    uint64_t nl;
+    void *p;
+
+    if (!(eps > 0.0 && eps < 1.0) || !(delta > 0.0 && delta < 1.0)) return -EINVAL;
+
+    switch (type) {
+        case CMS_COUNT_MIN:
+        case CMS_CONSERVATIVE:
+            w = M_E / eps;
+            break;
+
+        case CMS_COUNT_SKETCH:
+            w = 3.0 / (eps * eps);
+            break;
+
+        default:
+            return -EINVAL;
+    }
+
+    k = ceil(log(1.0 / delta));
+    if (k < 1.0) k = 1.0;
+    if (type == CMS_COUNT_SKETCH && !(((int)k) & 1)) k += 1.0;
+    if (k > CMS_MAX_ROWS) return -EINVAL;
+
+    memset(c, 0, sizeof *c);
+    c->type  = type;
+    c->flags = flags & CMS_ATOMIC;
+    c->rows  = (uint8_t)k;
+    c->slots = CMS_LINE / c->rows;
+    c->eps   = eps;
+    c->delta = delta;
+
+    nl = (uint64_t)ceil(w / c->slots);
+    if (nl > (UINT32_MAX / CMS_LINE)) return -EINVAL;
+
+    c->nlines = (uint32_t)nl;
+    c->width  = c->nlines * c->slots;
+
+    if (posix_memalign(&p, 64, cms_size(c)) != 0) return -ENOMEM;
+
+    c->c = p;
+    memset(c->c, 0, cms_size(c));
+    return 0;
+}
+
+
+void
+cms_fini(cms *c)
+{
+    DEL(c->c);
+}
+
+
+cms *
+cms_new(int type, double eps, double delta, uint32_t flags)
+{
+    cms *c = NEW(cms);
+
+    if (!c) return 0;
+    if (cms_init(c, type, eps, delta, flags) < 0) {
+        DEL(c);
+        return 0;
+    }
+    return c;
+}
+
+
+void
+cms_delete(cms *c)
+{
+    cms_fini(c);
+    DEL(c);
+}
+
+
+void
+cms_reset(cms *c)
+{
+    memset(c->c, 0, cms_size(c));
+    c->total = 0;
+}
+
+
+// Minimum over the rows of line 'L'
+static inline uint32_t
+min_rows(const cms *c, const uint32_t *L, uint64_t g)
+{
+    uint32_t m = UINT32_MAX;
+    uint32_t i;
+
+    if (c->flags & CMS_ATOMIC) {
+        for (i = 0; i < c->rows; i++) {
+            uint32_t v = __atomic_load_n(&L[slot(c, g, i)], __ATOMIC_RELAXED);
+
+            if (v < m) m = v;
+        }
+    } else {
+        for (i = 0; i < c->rows; i++) {
+            uint32_t v = L[slot(c, g, i)];
+
+            if (v < m) m = v;
+        }
+    }
+    return m;
+}
+
+
+// Median over the rows of line 'L'
+static uint64_t
+median_rows(const cms *c, const uint32_t *L, uint64_t hash, uint64_t g)
+{
+    int64_t v[CMS_MAX_ROWS];
+    uint32_t i, j;
+
+    for (i = 0; i < c->rows; i++) {
+        const uint32_t *p = &L[slot(c, g, i)];
+        uint32_t  x = (c->flags & CMS_ATOMIC) ? __atomic_load_n(p, __ATOMIC_RELAXED) : *p;
+        int64_t   y = signed_val(hash, i, x);
+
+        for (j = i; j > 0 && v[j-1] > y; j--) v[j] = v[j-1];
+        v[j] = y;
+    }
+
+    // rows is odd
+    return v[c->rows / 2] > 0 ? (uint64_t)v[c->rows / 2] : 0;
+}
+
+
+/*
+ * Conservative update shared by threads: raise the rows to min+w
+ * with each CAS expecting the value the min was computed from. If
+ * any row moved, start over with fresh values - two updates that
+ * read the same counters can't both raise them to the same value
+ * (and lose a count); at worst a retry overestimates.
+ */
+static uint32_t
+cu_atomic(const cms *c, uint32_t *L, uint64_t g, uint32_t w)
+{
+    uint32_t v[CMS_MAX_ROWS];
+    uint32_t i, m, t;
+
+again:
+    m = UINT32_MAX;
+    for (i = 0; i < c->rows; i++) {
+        v[i] = __atomic_load_n(&L[slot(c, g, i)], __ATOMIC_RELAXED);
+        if (v[i] < m) m = v[i];
+    }
+
+    t = m + w;
+    for (i = 0; i < c->rows; i++) {
+        if (v[i] >= t) continue;
+        if (!__atomic_compare_exchange_n(&L[slot(c, g, i)], &v[i], t, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            goto again;
+    }
+    return t;
+}
+
+
+uint64_t
+cms_add_estimate(cms *c, uint64_t hash, uint32_t w)
+{
+    uint32_t *L  = line(c, hash);
+    uint64_t g   = remix(hash);
+    int atomic   = c->flags & CMS_ATOMIC;
+    uint32_t i, t;
+
+    if (atomic) __atomic_fetch_add(&c->total, w, __ATOMIC_RELAXED);
+    else        c->total += w;
+
+    switch (c->type) {
+        case CMS_COUNT_MIN:
+            t = UINT32_MAX;
+            for (i = 0; i < c->rows; i++) {
+                uint32_t *p = &L[slot(c, g, i)];
+                uint32_t  v = atomic ? __atomic_add_fetch(p, w, __ATOMIC_RELAXED)
+                                     : (*p += w);
+
+                if (v < t) t = v;
+            }
+            return t;
+
+        case CMS_CONSERVATIVE:
+            if (atomic) return cu_atomic(c, L, g, w);
+
+            t = min_rows(c, L, g) + w;
+            for (i = 0; i < c->rows; i++) {
+                uint32_t *p = &L[slot(c, g, i)];
+
+                if (*p < t) *p = t;
+            }
+            return t;
+
+        default:
+            for (i = 0; i < c->rows; i++) {
+                uint32_t *p = &L[slot(c, g, i)];
+                uint32_t  v = ((hash >> i) & 1) ? -w : w;
+
+                if (atomic) __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+                else        *p += v;
+            }
+            return median_rows(c, L, hash, g);
+    }
+}
+
+
+void
+cms_add(cms *c, uint64_t hash, uint32_t w)
+{
+    uint32_t *L = line(c, hash);
+    uint64_t g  = remix(hash);
+    uint32_t i;
+
+    // The estimate is only needed for the conservative update
+    if (c->type == CMS_CONSERVATIVE) {
+        cms_add_estimate(c, hash, w);
+        return;
+    }
+
+    if (c->flags & CMS_ATOMIC) {
+        __atomic_fetch_add(&c->total, w, __ATOMIC_RELAXED);
+        for (i = 0; i < c->rows; i++) {
+            uint32_t v = (c->type == CMS_COUNT_SKETCH && ((hash >> i) & 1)) ? -w : w;
+
+            __atomic_fetch_add(&L[slot(c, g, i)], v, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    c->total += w;
+    if (c->type == CMS_COUNT_SKETCH) {
+        for (i = 0; i < c->rows; i++) L[slot(c, g, i)] += ((hash >> i) & 1) ? -w : w;
+    } else {
+        for (i = 0; i < c->rows; i++) L[slot(c, g, i)] += w;
+    }
+}
+
+
+uint64_t
+cms_estimate(cms *c, uint64_t hash)
+{
+    uint32_t *L = line(c, hash);
+    uint64_t g  = remix(hash);
+
+    if (c->type == CMS_COUNT_SKETCH) return median_rows(c, L, hash, g);
+
+    return min_rows(c, L, g);
+}
+
+
+int
+cms_merge(cms *dst, const cms *src)
+{
+    size_t i, n = (size_t)dst->nlines * CMS_LINE;
+
+    if (dst->type   != src->type   ||
+        dst->rows   != src->rows   ||
+        dst->nlines != src->nlines)
+        return -EINVAL;
+
+    for (i = 0; i < n; i++) dst->c[i] += src->c[i];
+
+    dst->total += cms_total(src);
+    return 0;
+}
+
+/* EOF */
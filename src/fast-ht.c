@@ -199,7 +199,11 @@ __findx(ht *h, uint64_t hv, void** p_ret, int zero)
 
 found:
     if (p_ret) *p_ret = x->v;
-    if (zero)      *x = zn;
+    if (zero) {
+        *x = zn;
+        h->nodes--;
+        if (--b->n == 0) h->fill--;
+    }
     return 1;
 }
 
@@ -286,6 +290,7 @@ void
 ht_fini(ht* h)
 {
     free_nodes(h->b, h->n);
+    DEL(h->b);
 }
 
 
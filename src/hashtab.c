@@ -26,6 +26,7 @@
 static int  insert_internal(hash_table * tab, void ** p_data, int op);
 static int  resize(hash_table * tab);
 static void remove_node(hash_table * tab, hash_bucket * b, hash_node * gone);
+static void free_node(hash_table * tab, hash_node * gone);
 
 // Found on every contemporary system.
 extern uint32_t arc4random(void);
@@ -280,9 +281,8 @@ int
 hash_table_remove_if(hash_table * tab,
          int (*pred)(void *, const void * p), void * cookie)
 {
-    int retval;
-    size_t i, 
-           n;
+    hash_sweep w = { 0, pred, cookie, 0, 0 };
+    size_t n;
 
     if (!(tab && pred)) return -EINVAL;
 
@@ -291,31 +291,11 @@ hash_table_remove_if(hash_table * tab,
     // we are traversing!
     lockmgr_lock(&tab->lock);
 
-    retval = 0;
-    n      = tab->size;
-    for (i = 0; i < n; ++i) {
-        hash_bucket* b = &tab->buckets[i];
-        hash_node *  p,
-                  ** p_next;
-
-        // And, protect the bucket against nodes that are being
-        // deleted whilst we are walking the bucket.
-        lockmgr_lock(&b->lock);
-        p_next = &SL_FIRST(&b->head);
-        while ((p = *p_next)) {
-            if ((*pred)(cookie, &p->data)) {
-                ++retval;
-                *p_next = SL_NEXT(p, link);
-                remove_node(tab, b, p);
-            }
-            else
-                p_next = &SL_NEXT(p, link);
-        }
-        lockmgr_unlock(&b->lock);
-    }
+    n = __hash_table_sweep(tab, 0, tab->size, tab->size, &w);
+    __hash_table_account(tab, &w);
 
     lockmgr_unlock(&tab->lock);
-    return retval;
+    return (int)n;
 }
 
 
@@ -325,25 +305,153 @@ void
 hash_table_apply(hash_table * tab,
         void (*apply)(void*, const void*), void* cookie)
 {
-    size_t i, n;
+    hash_sweep w = { apply, 0, cookie, 0, 0 };
 
     if (!tab || !apply) return;
 
 
+    lockmgr_lock(&tab->lock);
+    __hash_table_sweep(tab, 0, tab->size, tab->size, &w);
+    lockmgr_unlock(&tab->lock);
+}
+
+
+
+/* -- partitions and incremental sweeps -- */
+
+
+int
+hash_table_cursor_init(hash_table * tab, hash_table_cursor * c,
+                       size_t part, size_t nparts)
+{
+    size_t n;
+
+    if (!(tab && c)) return -EINVAL;
+    if (nparts == 0) part = 0, nparts = 1;
+    if (part >= nparts) return -EINVAL;
+
     lockmgr_lock(&tab->lock);
     n = tab->size;
-    for (i = 0; i < n; ++i) {
-        hash_node * p;
-        hash_bucket* b = &tab->buckets[i];
+    lockmgr_unlock(&tab->lock);
 
-        lockmgr_lock(&b->lock);
-        SL_FOREACH(p, &b->head, link) {
-            (*apply)(cookie, p->data);
-        }
-        lockmgr_unlock(&b->lock);
+    c->size = n;
+    __hash_table_part(n, part, nparts, &c->pos, &c->end);
+    return 0;
+}
+
+
+/*
+ * Advance 'c' by about 'k' buckets of the table as it is now; each
+ * old bucket is split over size/c->size new ones.
+ */
+static int
+sweep_step(hash_table * tab, hash_table_cursor * c, size_t k, hash_sweep * w)
+{
+    size_t n, lo, hi;
+
+    lockmgr_lock(&tab->lock);
+
+    n  = (k + (tab->size / c->size) - 1) / (tab->size / c->size);
+    lo = c->pos;
+    hi = (n == 0 || c->end - lo < n) ? c->end : lo + n;
+    if (lo < hi) {
+        n = __hash_table_sweep(tab, lo, hi, c->size, w);
+        __hash_table_account(tab, w);
+    } else {
+        n = 0;
     }
+    c->pos = hi;
 
     lockmgr_unlock(&tab->lock);
+    return (int)n;
+}
+
+
+int
+hash_table_sweep_apply(hash_table * tab, hash_table_cursor * c, size_t k,
+        void (*apply)(void*, const void*), void* cookie)
+{
+    hash_sweep w = { apply, 0, cookie, 0, 0 };
+
+    if (!(tab && c && apply)) return -EINVAL;
+
+    return sweep_step(tab, c, k, &w);
+}
+
+
+int
+hash_table_sweep_remove_if(hash_table * tab, hash_table_cursor * c, size_t k,
+         int (*pred)(void *, const void * p), void * cookie)
+{
+    hash_sweep w = { 0, pred, cookie, 0, 0 };
+
+    if (!(tab && c && pred)) return -EINVAL;
+
+    return sweep_step(tab, c, k, &w);
+}
+
+
+/*
+ * Walk buckets [lo, hi) of a table that had 'size' buckets; the
+ * caller holds the table lock, so we only lock each bucket.
+ */
+size_t
+__hash_table_sweep(hash_table * tab, size_t lo, size_t hi, size_t size, hash_sweep * w)
+{
+    size_t i, j, n = 0;
+
+    for (i = lo; i < hi; ++i) {
+        for (j = i; j < tab->size; j += size) {
+            hash_bucket* b = &tab->buckets[j];
+            hash_node *  p,
+                      ** p_next;
+            size_t gone = 0;
+
+            lockmgr_lock(&b->lock);
+            if (w->apply) {
+                SL_FOREACH(p, &b->head, link) {
+                    (*w->apply)(w->cookie, p->data);
+                    ++n;
+                }
+                lockmgr_unlock(&b->lock);
+                continue;
+            }
+
+            // And, protect the bucket against nodes that are being
+            // deleted whilst we are walking the bucket.
+            p_next = &SL_FIRST(&b->head);
+            while ((p = *p_next)) {
+                if ((*w->pred)(w->cookie, p->data)) {
+                    *p_next = SL_NEXT(p, link);
+                    free_node(tab, p);
+                    ++gone;
+                }
+                else
+                    p_next = &SL_NEXT(p, link);
+            }
+
+            if (gone) {
+                b->count -= gone;
+                if (b->count == 0) ++w->emptied;
+                w->removed += gone;
+                n += gone;
+            }
+            lockmgr_unlock(&b->lock);
+        }
+    }
+    return n;
+}
+
+
+void
+__hash_table_account(hash_table * tab, hash_sweep * w)
+{
+    tab->stats.deletes += w->removed;
+    tab->stats.nodes   -= w->removed;
+    tab->stats.fill    -= w->emptied;
+
+    w->removed = 0;
+    w->emptied = 0;
 }
 
 
@@ -377,6 +485,7 @@ insert_internal(hash_table * tab, void ** p_data, int op)
     void * data = *p_data;
     int retval  = -ENOMEM;
     hash_node* e;
+    size_t count;
     int (*cmp)(const void*, const void*) = tab->cmp;
 
     uint32_t hash  = hashfunc(tab, data);
@@ -412,7 +521,7 @@ insert_internal(hash_table * tab, void ** p_data, int op)
                 break;
         }
 
-        goto _done;
+        goto _unlock;
     }
 
 
@@ -422,12 +531,16 @@ insert_internal(hash_table * tab, void ** p_data, int op)
      */
 
     e = tNEW(hash_node, tab);
-    if (!e) goto _done;
+    if (!e) goto _unlock;
 
     retval  = 0;
     e->data = data;
     e->hash = hash;
     SL_INSERT_HEAD(&b->head, e, link);
+
+    // Count the node with it in the bucket; a sweep under the table
+    // lock may remove it before we get that lock below.
+    count = ++b->count;
     lockmgr_unlock(&b->lock);
 
 
@@ -438,9 +551,8 @@ insert_internal(hash_table * tab, void ** p_data, int op)
 
     ++tab->stats.inserts;
     ++tab->stats.nodes;
-    ++b->count;
-    if (b->count > tab->stats.maxchainlen)
-        tab->stats.maxchainlen = b->count;
+    if (count > tab->stats.maxchainlen)
+        tab->stats.maxchainlen = count;
 
 
     /*
@@ -448,15 +560,17 @@ insert_internal(hash_table * tab, void ** p_data, int op)
      * filled buckets and determine if we need to grow the hash
      * table.
      */
-    if (b->count == 1) {
+    if (count == 1) {
         ++tab->stats.fill;
         if ( ((tab->stats.fill * 100) / (tab->size + 1)) > tab->fillmax )
             retval = resize(tab);
     }
 
     lockmgr_unlock(&tab->lock);
+    return retval;
 
-_done:
+_unlock:
+    lockmgr_unlock(&b->lock);
     return retval;
 }
 
@@ -527,13 +641,21 @@ resize(hash_table * tab)
 }
 
 
-/* delete 'gone' and adjust statistics for bucket 'b' */
+/* delete 'gone' */
 static void
-remove_node(hash_table * tab, hash_bucket * b, hash_node * gone)
+free_node(hash_table * tab, hash_node * gone)
 {
     if (tab->dtor) (*tab->dtor) (gone->data);
 
     tFREE(tab, gone);
+}
+
+
+/* delete 'gone' and adjust statistics for bucket 'b' */
+static void
+remove_node(hash_table * tab, hash_bucket * b, hash_node * gone)
+{
+    free_node(tab, gone);
 
     ++tab->stats.deletes;
     --tab->stats.nodes;
@@ -118,6 +118,10 @@ struct table_iter
 {
     /* Current bucket being visited. */
     int bucket;
+
+    /* Buckets [lo, hi) to visit; hi is capped at the table size. */
+    size_t lo,
+           hi;
 };
 typedef struct table_iter table_iter;
 
@@ -207,6 +211,50 @@ struct hash_table_iter
 
 
 
+/*
+ * A walk over some buckets; one of 'apply' or 'pred' is set. When
+ * removing, 'removed' and 'emptied' (buckets left empty) count what
+ * the walk did; __hash_table_account() folds them into the table
+ * stats. That way several walks can run at once on different
+ * buckets with only the bucket locks.
+ */
+struct hash_sweep
+{
+    void (*apply)(void *, const void *);
+    int  (*pred)(void *, const void *);
+    void * cookie;
+
+    size_t removed;
+    size_t emptied;
+};
+typedef struct hash_sweep hash_sweep;
+
+
+/*
+ * Walk buckets [lo, hi) of the table as it was when it had 'size'
+ * buckets (see hash_table_cursor); the caller holds the table lock.
+ * Returns the number of items visited or removed.
+ */
+extern size_t __hash_table_sweep(hash_table * tab, size_t lo, size_t hi, size_t size,
+                                 hash_sweep * w);
+
+/* Fold the counts of 'w' into the stats; with the table lock held. */
+extern void __hash_table_account(hash_table * tab, hash_sweep * w);
+
+
+/* Buckets [*lo, *hi) of partition 'part' of 'nparts' of 'n' buckets */
+static inline void
+__hash_table_part(size_t n, size_t part, size_t nparts, size_t * lo, size_t * hi)
+{
+    size_t q = n / nparts,
+           r = n % nparts;
+
+    *lo = q * part + (part < r ? part : r);
+    *hi = *lo + q + (part < r);
+}
+
+
+
 #define tNEW(typ,tab)       (typ*)memmgr_alloc(&(tab)->mem, sizeof(typ))
 #define tNEWA(typ,tab,n)    (typ*)memmgr_alloc(&(tab)->mem, (n)*sizeof(typ))
 #define tFREE(tab,p)        memmgr_free(&(tab)->mem, (p))
@@ -24,8 +24,11 @@
 #define VANILLA_ITER        0 /* unsorted iter */
 #define SORTED_ITER         1 /* sorted iter */
 #define BUCKET_ITER         2 /* bucket iter */
+#define PART_ITER           3 /* unsorted iter over a partition */
 
 /* unsorted iterator ops */
+static int vanilla_iter_init(hash_table_iter * it, const void * param);
+static int part_iter_init(hash_table_iter * it, const void * param);
 static int vanilla_iter_end(hash_table_iter * it);
 static int vanilla_iter_next(hash_table_iter * it);
 static int vanilla_iter_begin(hash_table_iter * it);
@@ -49,7 +52,11 @@ static void * bucket_iter_item(hash_table_iter * it);
 
 
 static const hash_table_iter_op Hash_vanilla_iter_op =
-                _OPINIT(0, vanilla_iter_begin,
+                _OPINIT(vanilla_iter_init, vanilla_iter_begin,
+                        vanilla_iter_next, vanilla_iter_end, vanilla_iter_item);
+
+static const hash_table_iter_op Hash_part_iter_op =
+                _OPINIT(part_iter_init, vanilla_iter_begin,
                         vanilla_iter_next, vanilla_iter_end, vanilla_iter_item);
 
 static const hash_table_iter_op Hash_sorted_iter_op =
@@ -65,6 +72,14 @@ static const hash_table_iter_op * Iter_tab[] =
     &Hash_vanilla_iter_op,
     &Hash_sorted_iter_op,
     &Hash_bucket_iter_op,
+    &Hash_part_iter_op,
+};
+
+/* Parameter of a partition iterator */
+struct part
+{
+    size_t part,
+           nparts;
 };
 
 static int _mk_iter(hash_table_iter_t* p_ret,
@@ -107,6 +122,25 @@ hash_table_bucket_iter_new(hash_table_iter_t* p_ret, hash_table * tab,
 
 
 
+/*
+ * Create a hash table iterator to walk partition 'part' of 'nparts'
+ * of the buckets.
+ *
+ * Return pointer to the iterator if successful, 0 otherwise.
+ */
+int
+hash_table_part_iter_new(hash_table_iter_t* p_ret, hash_table * tab,
+                         size_t part, size_t nparts)
+{
+    struct part p = { part, nparts };
+
+    if (!(tab && p_ret && part < nparts)) return -EINVAL;
+
+    return _mk_iter(p_ret, tab, PART_ITER, &p);
+}
+
+
+
 /*
  * Delete and finalize a created iterator.
  */
@@ -251,7 +285,7 @@ static inline void
 find_next_node(hash_table_iter* it, size_t i)
 {
     hash_table* tab = it->table;
-    size_t n = tab->size;
+    size_t n = it->un.table.hi < tab->size ? it->un.table.hi : tab->size;
 
     for (; i < n; ++i) {
         it->cur = SL_FIRST(&tab->buckets[i].head);
@@ -263,6 +297,30 @@ find_next_node(hash_table_iter* it, size_t i)
 }
 
 
+/* Initialize the iterator to visit every bucket. */
+static int
+vanilla_iter_init(hash_table_iter * it, const void * param)
+{
+    USEARG(param);
+
+    it->un.table.lo = 0;
+    it->un.table.hi = ~(size_t)0;
+    return 0;
+}
+
+
+/* Initialize the iterator to visit one partition of the buckets. */
+static int
+part_iter_init(hash_table_iter * it, const void * param)
+{
+    const struct part * p = (const struct part *)param;
+
+    __hash_table_part(it->table->size, p->part, p->nparts,
+                      &it->un.table.lo, &it->un.table.hi);
+    return 0;
+}
+
+
 /* Start the iterator by pointing at the first usable element.  */
 static int
 vanilla_iter_begin(hash_table_iter * it)
@@ -270,7 +328,7 @@ vanilla_iter_begin(hash_table_iter * it)
     it->un.table.bucket = -1;
     it->cur             = 0;
 
-    find_next_node(it, 0);
+    find_next_node(it, it->un.table.lo);
 
     return it->cur ? 0 : EOF;
 }
@@ -0,0 +1,147 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * hashtab_par.c - Parallel apply and remove_if for the hash table.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o See commentary in utils/hashtab.h.
+ * o The calling thread holds the table lock (no splits) while the
+ *   job_manager threads walk PARTS_PER_THREAD partitions each with
+ *   only the bucket locks; smaller partitions even out the threads
+ *   when some parts of the table are slower to walk.
+ * o Each partition counts what it removed; the caller folds the
+ *   counts into the table stats once the threads are done.
+ */
+#include "hashtab_imp.h"
+#include "posix/job.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+
+
+#define PARTS_PER_THREAD    4
+
+struct part
+{
+    size_t     lo,
+               hi;
+    size_t     n;
+    hash_sweep w;
+};
+typedef struct part part;
+
+
+struct par
+{
+    hash_table * tab;
+    size_t       size;
+};
+typedef struct par par;
+
+
+static int
+run_part(void * ctx, void * j, int threadnr)
+{
+    par  * pr = (par *)ctx;
+    part * p  = (part *)j;
+
+    USEARG(threadnr);
+
+    p->n = __hash_table_sweep(pr->tab, p->lo, p->hi, pr->size, &p->w);
+    return 0;
+}
+
+
+static int
+sweep_par(hash_table * tab, int nthreads, const hash_sweep * w)
+{
+    job_manager jm;
+    hash_sweep  tot = *w;
+    par    pr;
+    part * parts;
+    size_t i, np, n = 0;
+
+    if (nthreads <= 0)
+        nthreads = sys_cpu_getavail();
+
+    lockmgr_lock(&tab->lock);
+
+    pr.tab  = tab;
+    pr.size = tab->size;
+
+    np = (size_t)nthreads * PARTS_PER_THREAD;
+    if (np > pr.size) np = pr.size;
+
+    if (nthreads == 1 || !(parts = NEWZA(part, np))) {
+        n = __hash_table_sweep(tab, 0, pr.size, pr.size, &tot);
+        goto _done;
+    }
+
+    // No threads: stop the ones that did start and sweep here
+    if (job_manager_init(&jm, nthreads, run_part, &pr) <= 0) {
+        job_manager_wait(&jm);
+        job_manager_destroy(&jm);
+        DEL(parts);
+
+        n = __hash_table_sweep(tab, 0, pr.size, pr.size, &tot);
+        goto _done;
+    }
+
+    for (i = 0; i < np; i++) {
+        part * p = &parts[i];
+
+        p->w = *w;
+        __hash_table_part(pr.size, i, np, &p->lo, &p->hi);
+        job_manager_submit_job(&jm, p);
+    }
+
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+
+    for (i = 0; i < np; i++) {
+        n           += parts[i].n;
+        tot.removed += parts[i].w.removed;
+        tot.emptied += parts[i].w.emptied;
+    }
+    DEL(parts);
+
+_done:
+    __hash_table_account(tab, &tot);
+    lockmgr_unlock(&tab->lock);
+    return (int)n;
+}
+
+
+int
+hash_table_apply_par(hash_table * tab, int nthreads,
+        void (*apply)(void*, const void*), void* cookie)
+{
+    hash_sweep w = { apply, 0, cookie, 0, 0 };
+    int r;
+
+    if (!(tab && apply)) return -EINVAL;
+
+    r = sweep_par(tab, nthreads, &w);
+    return r < 0 ? r : 0;
+}
+
+
+int
+hash_table_remove_if_par(hash_table * tab, int nthreads,
+         int (*pred)(void *, const void * p), void * cookie)
+{
+    hash_sweep w = { 0, pred, cookie, 0, 0 };
+
+    if (!(tab && pred)) return -EINVAL;
+
+    return sweep_par(tab, nthreads, &w);
+}
+
+/* EOF */
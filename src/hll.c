@@ -0,0 +1,929 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * hll.c - HyperLogLog cardinality estimator.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in hll.h.
+ *
+ * o  Register j of a dense sketch is the 6-bit field at bit 6*(j&3)
+ *    of the little endian 24-bit group at byte 3*(j>>2). Its value
+ *    is the rank - position of the first 1 bit - of the hash bits
+ *    after the top 'p' bits that index the register; at most
+ *    65 - p.
+ *
+ * o  A sparse entry is (index' << 6 | rank') for the top 25 bits of
+ *    the hash and the rank of the remaining 39 bits. It converts
+ *    exactly to the dense (index, rank) for any p <= 25, so a
+ *    sparse sketch turns dense without losing anything.
+ *
+ * o  All integers are in little endian order. The data always
+ *    starts at a 64-byte boundary; a mapped file can be used as the
+ *    register array.
+ *
+ * Marshalled layout:
+ * ------------------
+ *
+ * - 64 byte header:
+ *     o magic           4  -- "HLLS"
+ *     o version         1  -- monotonically increasing
+ *     o encoding        1  -- one of HLL_ENC_xxx
+ *     o p               1  -- precision
+ *     o checksum algo   1  -- one of HLL_CKSUM_xxx
+ *     o m               4  -- number of registers
+ *     o n               4  -- number of sparse entries; 0 if dense
+ *     o marshalled size 8  -- total bytes before the checksum
+ *     o ZEROES          -  -- padding to 64 bytes
+ *
+ * - Data:
+ *     o dense:  the packed registers (3*m/4 bytes)
+ *     o sparse: 'n' u32 entries in ascending order
+ *     o ZEROES to the next 64 byte boundary
+ *
+ * - Last 'n' bytes of the marshaled data is the checksum over
+ *   everything before it.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <limits.h>
+
+#include "utils/hll.h"
+#include "utils/utils.h"
+#include "fast/encdec.h"
+
+// Need libsodium to be installed.
+#include "sodium.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSSE3  1
+#include <immintrin.h>
+#endif
+
+
+#define HDRSIZ              64
+
+#define HLL_VER0            0
+
+#define HLL_ENC_SPARSE      0
+#define HLL_ENC_DENSE       1
+
+#define HLL_CKSUM_SHA256    0
+#define HLL_CKSUMSZ         crypto_hash_sha256_BYTES
+
+// Rank of a sparse entry: 39 bits after the sparse index
+#define SPARSE_Q            (64 - HLL_SPARSE_P)
+
+#define _d(x)       ((double)(x))
+
+
+/*
+ * Decoded header
+ */
+struct hdr
+{
+    int      enc;
+    int      p;
+    uint32_t m;
+    uint32_t n;
+    uint64_t datasize;
+};
+typedef struct hdr hdr;
+
+
+static inline uint32_t
+rd24(const uint8_t *g)
+{
+    return g[0] | (g[1] << 8) | ((uint32_t)g[2] << 16);
+}
+
+static inline void
+wr24(uint8_t *g, uint32_t x)
+{
+    g[0] = x;
+    g[1] = x >> 8;
+    g[2] = x >> 16;
+}
+
+
+// Raise register 'j' to 'r' if it is smaller
+static inline void
+setmax(uint8_t *regs, uint32_t j, uint32_t r)
+{
+    uint8_t *g  = regs + 3 * (j >> 2);
+    uint32_t sh = 6 * (j & 3);
+    uint32_t x  = rd24(g);
+
+    if (r > ((x >> sh) & 63)) wr24(g, (x & ~(63u << sh)) | (r << sh));
+}
+
+
+// Dense register and rank of sparse entry 'e' at precision 'p'
+static inline void
+sparse2dense(uint32_t e, int p, uint32_t *pj, uint32_t *pr)
+{
+    uint32_t idx = e >> 6;
+    uint32_t d   = HLL_SPARSE_P - p;
+    uint32_t low = idx & ((1u << d) - 1);
+
+    *pj = idx >> d;
+    *pr = low ? (uint32_t)__builtin_clz(low) - (32 - d) + 1 : d + (e & 63);
+}
+
+
+int
+hll_init(hll *h, int p)
+{
+    if (p < HLL_MIN_P || p > HLL_MAX_P) return -EINVAL;
+
+    memset(h, 0, sizeof *h);
+    h->p      = p;
+    h->m      = 1u << p;
+    h->nbytes = 3 * (h->m / 4);
+    return 0;
+}
+
+
+void
+hll_fini(hll *h)
+{
+    if (h->map) {
+        munmap(h->map, h->maplen);
+        h->map  = 0;
+        h->regs = 0;
+    } else {
+        DEL(h->regs);
+    }
+
+    DEL(h->sparse);
+    h->nsparse = h->sparse_cap = h->ntmp = 0;
+    h->flags   = 0;
+}
+
+
+hll *
+hll_new(int p)
+{
+    hll *h = NEW(hll);
+
+    if (!h) return 0;
+    if (hll_init(h, p) < 0) {
+        DEL(h);
+        return 0;
+    }
+    return h;
+}
+
+
+void
+hll_delete(hll *h)
+{
+    hll_fini(h);
+    DEL(h);
+}
+
+
+void
+hll_reset(hll *h)
+{
+    hll_fini(h);
+    hll_init(h, h->p);
+}
+
+
+/*
+ * Sort the buffered entries and merge them into the sorted list;
+ * for entries with the same index the highest rank wins.
+ */
+static void
+flush(hll *h)
+{
+    uint32_t *t = h->tmp;
+    uint32_t n  = h->ntmp;
+    uint32_t i, j;
+
+    if (n == 0) return;
+
+    // Insertion sort; then drop all but the last (highest rank) of
+    // each index.
+    for (i = 1; i < n; i++) {
+        uint32_t x = t[i];
+
+        for (j = i; j > 0 && t[j-1] > x; j--) t[j] = t[j-1];
+        t[j] = x;
+    }
+    for (i = 0, j = 0; i < n; i++) {
+        if (i+1 < n && (t[i] >> 6) == (t[i+1] >> 6)) continue;
+        t[j++] = t[i];
+    }
+    n = j;
+
+    if ((h->nsparse + n) > h->sparse_cap) {
+        uint32_t cap = h->sparse_cap ? 2 * h->sparse_cap : HLL_TMPSZ;
+
+        if (cap < (h->nsparse + n)) cap = h->nsparse + n;
+
+        h->sparse = RENEWA(uint32_t, h->sparse, cap);
+        assert(h->sparse);
+        h->sparse_cap = cap;
+    }
+
+    /*
+     * Merge from the back; the write position never overtakes the
+     * unread part of the list. Duplicates leave a gap between the
+     * untouched head and the merged tail which we close after.
+     */
+    uint32_t *s = h->sparse;
+    int64_t a   = (int64_t)h->nsparse - 1,
+            b   = (int64_t)n - 1,
+            k   = (int64_t)h->nsparse + n - 1,
+            end = k;
+
+    while (b >= 0) {
+        if (a >= 0 && (s[a] >> 6) > (t[b] >> 6)) {
+            s[k--] = s[a--];
+        } else if (a >= 0 && (s[a] >> 6) == (t[b] >> 6)) {
+            s[k--] = s[a] > t[b] ? s[a] : t[b];
+            a--;
+            b--;
+        } else {
+            s[k--] = t[b--];
+        }
+    }
+
+    if (k > a) memmove(s + a + 1, s + k + 1, (end - k) * sizeof s[0]);
+
+    h->nsparse = (uint32_t)(a + 1 + end - k);
+    h->ntmp    = 0;
+}
+
+
+// Flush the sparse buffer; go dense if the list outgrew the
+// registers.
+static void
+compact(hll *h)
+{
+    if (h->regs) return;
+
+    flush(h);
+    if (h->nsparse > (h->nbytes / 4)) hll_todense(h);
+}
+
+
+void
+hll_todense(hll *h)
+{
+    uint32_t i, j, r;
+
+    if (h->regs) return;
+
+    h->regs = NEWZA(uint8_t, h->nbytes);
+    assert(h->regs);
+
+    for (i = 0; i < h->nsparse; i++) {
+        sparse2dense(h->sparse[i], h->p, &j, &r);
+        setmax(h->regs, j, r);
+    }
+    for (i = 0; i < h->ntmp; i++) {
+        sparse2dense(h->tmp[i], h->p, &j, &r);
+        setmax(h->regs, j, r);
+    }
+
+    DEL(h->sparse);
+    h->nsparse = h->sparse_cap = h->ntmp = 0;
+}
+
+
+static inline void
+add_entry(hll *h, uint32_t e)
+{
+    if (h->regs) {
+        uint32_t j, r;
+
+        sparse2dense(e, h->p, &j, &r);
+        setmax(h->regs, j, r);
+        return;
+    }
+
+    h->tmp[h->ntmp++] = e;
+    if (h->ntmp == HLL_TMPSZ) compact(h);
+}
+
+
+void
+__hll_add_sparse(hll *h, uint64_t hash)
+{
+    uint32_t idx = (uint32_t)(hash >> SPARSE_Q);
+    uint64_t w   = hash << HLL_SPARSE_P;
+    uint32_t r   = w ? (uint32_t)__builtin_clzll(w) + 1 : SPARSE_Q + 1;
+
+    add_entry(h, (idx << 6) | r);
+}
+
+
+/*
+ * Improved raw estimator of Ertl [3]: 'c[k]' is the number of
+ * registers with value k, 0 <= k <= q+1, out of 'm'.
+ */
+static double
+sigma(double x)
+{
+    double y = 1.0, z = x, zp;
+
+    if (x == 1.0) return INFINITY;
+    do {
+        x *= x;
+        zp = z;
+        z += x * y;
+        y += y;
+    } while (z != zp);
+    return z;
+}
+
+
+static double
+tau(double x)
+{
+    double y = 1.0, z = 1.0 - x, zp;
+
+    if (x == 0.0 || x == 1.0) return 0.0;
+    do {
+        x  = sqrt(x);
+        zp = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != zp);
+    return z / 3.0;
+}
+
+
+static double
+estimate(const uint32_t *c, int q, double m)
+{
+    double z = m * tau(1.0 - _d(c[q+1]) / m);
+    int k;
+
+    for (k = q; k >= 1; k--) z = 0.5 * (z + _d(c[k]));
+
+    z += m * sigma(_d(c[0]) / m);
+    return (m * m) / (2.0 * M_LN2 * z);
+}
+
+
+uint64_t
+hll_count(hll *h)
+{
+    uint32_t c[66];
+    uint32_t i;
+
+    memset(c, 0, sizeof c);
+    compact(h);
+
+    if (!h->regs) {
+        for (i = 0; i < h->nsparse; i++) c[h->sparse[i] & 63]++;
+
+        c[0] = (1u << HLL_SPARSE_P) - h->nsparse;
+        return (uint64_t)(estimate(c, SPARSE_Q, _d(1u << HLL_SPARSE_P)) + 0.5);
+    }
+
+    for (i = 0; i < h->nbytes; i += 3) {
+        uint32_t x = rd24(h->regs + i);
+
+        c[x & 63]++;
+        c[(x >> 6)  & 63]++;
+        c[(x >> 12) & 63]++;
+        c[(x >> 18) & 63]++;
+    }
+    return (uint64_t)(estimate(c, 64 - h->p, _d(h->m)) + 0.5);
+}
+
+
+/*
+ * Register-wise max of two packed register arrays; 'n' is a
+ * multiple of 12.
+ */
+static void
+merge_generic(uint8_t *d, const uint8_t *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i += 3) {
+        uint32_t x = rd24(d + i),
+                 y = rd24(s + i),
+                 z = 0;
+        int k;
+
+        for (k = 0; k < 24; k += 6) {
+            uint32_t a = (x >> k) & 63,
+                     b = (y >> k) & 63;
+
+            z |= (a > b ? a : b) << k;
+        }
+        wr24(d + i, z);
+    }
+}
+
+
+#ifdef HAVE_SSSE3
+
+/*
+ * 12 bytes (16 registers) at a time: spread each 3 byte group into
+ * a 32-bit lane, move its four 6-bit fields to their own byte, take
+ * the bytewise max and pack back. Loads and stores are exactly 12
+ * bytes so that we never touch memory past the registers.
+ */
+static inline __m128i __attribute__((target("ssse3")))
+unpack12(const uint8_t *p)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                         6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i m0 = _mm_set1_epi32(0x3f);
+    const __m128i m1 = _mm_set1_epi32(0x3f00);
+    const __m128i m2 = _mm_set1_epi32(0x3f0000);
+    const __m128i m3 = _mm_set1_epi32(0x3f000000);
+    uint32_t hi;
+    __m128i g;
+
+    memcpy(&hi, p + 8, 4);
+    g = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p), _mm_cvtsi32_si128(hi));
+    g = _mm_shuffle_epi8(g, spread);
+
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(g, m0),
+                                     _mm_and_si128(_mm_slli_epi32(g, 2), m1)),
+                        _mm_or_si128(_mm_and_si128(_mm_slli_epi32(g, 4), m2),
+                                     _mm_and_si128(_mm_slli_epi32(g, 6), m3)));
+}
+
+
+static inline void __attribute__((target("ssse3")))
+pack12(uint8_t *p, __m128i u)
+{
+    const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                         10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i m0 = _mm_set1_epi32(0x3f);
+    const __m128i m1 = _mm_set1_epi32(0xfc0);
+    const __m128i m2 = _mm_set1_epi32(0x3f000);
+    const __m128i m3 = _mm_set1_epi32(0xfc0000);
+    uint32_t hi;
+    __m128i g;
+
+    g = _mm_or_si128(_mm_or_si128(_mm_and_si128(u, m0),
+                                  _mm_and_si128(_mm_srli_epi32(u, 2), m1)),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(u, 4), m2),
+                                  _mm_and_si128(_mm_srli_epi32(u, 6), m3)));
+    g  = _mm_shuffle_epi8(g, gather);
+    hi = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(g, 8));
+
+    _mm_storel_epi64((__m128i *)p, g);
+    memcpy(p + 8, &hi, 4);
+}
+
+
+static void __attribute__((target("ssse3")))
+merge_ssse3(uint8_t *d, const uint8_t *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i += 12) {
+        __m128i a = unpack12(d + i),
+                b = unpack12(s + i);
+
+        pack12(d + i, _mm_max_epu8(a, b));
+    }
+}
+
+#endif /* HAVE_SSSE3 */
+
+
+typedef void (*merge_fp)(uint8_t *, const uint8_t *, size_t);
+
+static merge_fp
+merger(void)
+{
+    static merge_fp fp = 0;
+
+    if (!fp) {
+#ifdef HAVE_SSSE3
+        __builtin_cpu_init();
+        fp = __builtin_cpu_supports("ssse3") ? merge_ssse3 : merge_generic;
+#else
+        fp = merge_generic;
+#endif
+    }
+    return fp;
+}
+
+
+int
+hll_merge(hll *dst, hll *src)
+{
+    uint32_t i;
+
+    if (dst->p != src->p) return -EINVAL;
+    if (dst == src)       return 0;
+
+    if (src->regs) {
+        hll_todense(dst);
+        (*merger())(dst->regs, src->regs, dst->nbytes);
+        return 0;
+    }
+
+    for (i = 0; i < src->nsparse; i++) add_entry(dst, src->sparse[i]);
+    for (i = 0; i < src->ntmp; i++)    add_entry(dst, src->tmp[i]);
+    return 0;
+}
+
+
+// Dense registers of 'h' in a new array
+static uint8_t *
+dense_copy(hll *h)
+{
+    uint8_t *r = NEWZA(uint8_t, h->nbytes);
+    uint32_t i, j, k;
+
+    assert(r);
+    if (h->regs) {
+        memcpy(r, h->regs, h->nbytes);
+        return r;
+    }
+
+    for (i = 0; i < h->nsparse; i++) {
+        sparse2dense(h->sparse[i], h->p, &j, &k);
+        setmax(r, j, k);
+    }
+    for (i = 0; i < h->ntmp; i++) {
+        sparse2dense(h->tmp[i], h->p, &j, &k);
+        setmax(r, j, k);
+    }
+    return r;
+}
+
+
+int
+hll_eq(hll *a, hll *b)
+{
+    uint8_t *x, *y;
+    int r;
+
+    if (a->p != b->p) return 0;
+
+    compact(a);
+    compact(b);
+
+    if (!a->regs && !b->regs) {
+        return a->nsparse == b->nsparse &&
+               0 == memcmp(a->sparse, b->sparse, a->nsparse * sizeof a->sparse[0]);
+    }
+
+    x = dense_copy(a);
+    y = dense_copy(b);
+    r = 0 == memcmp(x, y, a->nbytes);
+    DEL(x);
+    DEL(y);
+    return r;
+}
+
+
+/*
+ * Marshal/Unmarshal
+ */
+
+/*
+ * SHA256 of 'n' bytes followed by their length; like
+ * bloom_marshal.c.
+ */
+static void
+cksum(uint8_t *out, const uint8_t *buf, uint64_t n)
+{
+    crypto_hash_sha256_state st;
+    uint8_t b0[8];
+
+    enc_BE_u64(b0, n);
+    crypto_hash_sha256_init(&st);
+    crypto_hash_sha256_update(&st, buf, n);
+    crypto_hash_sha256_update(&st, b0,  8);
+    crypto_hash_sha256_final(&st, out);
+    sodium_memzero(&st, sizeof st);
+}
+
+
+static uint64_t
+datasize(hll *h)
+{
+    uint64_t n = h->regs ? h->nbytes : h->nsparse * 4;
+
+    return _ALIGN_UP(HDRSIZ + n, 64);
+}
+
+
+size_t
+hll_marshal_size(hll *h)
+{
+    compact(h);
+    return datasize(h) + HLL_CKSUMSZ;
+}
+
+
+ssize_t
+hll_marshal_buf(hll *h, void *buf, size_t bufsz)
+{
+    uint8_t *start = buf,
+            *p     = start;
+    uint64_t dsz;
+    uint32_t i;
+
+    compact(h);
+
+    dsz = datasize(h);
+    if (bufsz < (dsz + HLL_CKSUMSZ)) return -ENOSPC;
+
+    memset(start, 0, dsz);
+    memcpy(p, "HLLS", 4);   p += 4;
+
+    *p++ = HLL_VER0;
+    *p++ = h->regs ? HLL_ENC_DENSE : HLL_ENC_SPARSE;
+    *p++ = h->p;
+    *p++ = HLL_CKSUM_SHA256;
+    p    = enc_LE_u32(p, h->m);
+    p    = enc_LE_u32(p, h->regs ? 0 : h->nsparse);
+    p    = enc_LE_u64(p, dsz);
+
+    assert((p - start) <= HDRSIZ);
+
+    p = start + HDRSIZ;
+    if (h->regs) {
+        memcpy(p, h->regs, h->nbytes);
+    } else {
+        for (i = 0; i < h->nsparse; i++) p = enc_LE_u32(p, h->sparse[i]);
+    }
+
+    cksum(start + dsz, start, dsz);
+    return dsz + HLL_CKSUMSZ;
+}
+
+
+/*
+ * Verify the checksum and decode the header of 'sz' bytes at
+ * 'buf'.
+ *
+ * Return 0 on success, -EILSEQ on failure.
+ */
+static int
+rdhdr(const uint8_t *buf, size_t sz, hdr *hd)
+{
+    uint8_t ck[HLL_CKSUMSZ];
+    const uint8_t *p = buf;
+    uint64_t dsz, need;
+
+    if (sz < (HDRSIZ + HLL_CKSUMSZ))     return -EILSEQ;
+    if (buf[7] != HLL_CKSUM_SHA256)      return -EILSEQ;
+
+    dsz = sz - HLL_CKSUMSZ;
+    cksum(ck, buf, dsz);
+    if (0 != sodium_memcmp(ck, buf + dsz, HLL_CKSUMSZ)) return -EILSEQ;
+
+    if (0 != memcmp(p, "HLLS", 4)) return -EILSEQ;
+    p += 4;
+
+    if (*p++ != HLL_VER0) return -EILSEQ;
+
+    hd->enc = *p++;
+    hd->p   = *p++;
+    p++;    // checksum type
+
+    hd->m        = dec_LE_u32(p); p += 4;
+    hd->n        = dec_LE_u32(p); p += 4;
+    hd->datasize = dec_LE_u64(p); p += 8;
+
+    if (hd->p < HLL_MIN_P || hd->p > HLL_MAX_P) return -EILSEQ;
+    if (hd->m != (1u << hd->p))                 return -EILSEQ;
+    if (hd->datasize != dsz)                    return -EILSEQ;
+
+    switch (hd->enc) {
+        case HLL_ENC_DENSE:
+            if (hd->n != 0) return -EILSEQ;
+            need = 3 * (hd->m / 4);
+            break;
+
+        case HLL_ENC_SPARSE:
+            if (hd->n > (3 * (hd->m / 4)) / 4) return -EILSEQ;
+            need = hd->n * 4;
+            break;
+
+        default:
+            return -EILSEQ;
+    }
+
+    if (_ALIGN_UP(HDRSIZ + need, 64) != dsz) return -EILSEQ;
+    return 0;
+}
+
+
+/*
+ * Build 'h' from the verified data; dense registers are copied
+ * unless 'inplace'.
+ */
+static int
+rddata(hll *h, const hdr *hd, const uint8_t *buf, int inplace)
+{
+    const uint8_t *p = buf + HDRSIZ;
+    uint32_t i, prev = 0;
+
+    hll_init(h, hd->p);
+
+    if (hd->enc == HLL_ENC_DENSE) {
+        // Every register is at most 65 - p
+        for (i = 0; i < h->nbytes; i += 3) {
+            uint32_t x = rd24(p + i);
+            int k;
+
+            for (k = 0; k < 24; k += 6) {
+                if (((x >> k) & 63) > (uint32_t)(65 - h->p)) return -EILSEQ;
+            }
+        }
+
+        if (inplace) {
+            h->regs = (uint8_t *)p;
+            return 0;
+        }
+
+        h->regs = NEWA(uint8_t, h->nbytes);
+        if (!h->regs) return -ENOMEM;
+
+        memcpy(h->regs, p, h->nbytes);
+        return 0;
+    }
+
+    if (hd->n == 0) return 0;
+
+    h->sparse = NEWA(uint32_t, hd->n);
+    if (!h->sparse) return -ENOMEM;
+
+    h->sparse_cap = hd->n;
+    for (i = 0; i < hd->n; i++, p += 4) {
+        uint32_t e = dec_LE_u32(p);
+        uint32_t r = e & 63;
+
+        // Strictly ascending index; valid rank.
+        if ((i > 0 && (e >> 6) <= (prev >> 6)) ||
+            (e >> 6) >= (1u << HLL_SPARSE_P)   ||
+            r == 0 || r > (SPARSE_Q + 1)) {
+            hll_fini(h);
+            return -EILSEQ;
+        }
+
+        h->sparse[i] = prev = e;
+    }
+    h->nsparse = hd->n;
+    return 0;
+}
+
+
+int
+hll_unmarshal_buf(hll *h, const void *buf, size_t bufsz)
+{
+    hdr hd;
+    int r;
+
+    if ((r = rdhdr(buf, bufsz, &hd)) < 0) return r;
+
+    return rddata(h, &hd, buf, 0);
+}
+
+
+int
+hll_marshal(hll *h, const char *fname)
+{
+    char file[PATH_MAX];
+    uint64_t sz = hll_marshal_size(h);
+    void *mptr;
+    int fd, r = 0;
+
+    snprintf(file, sizeof file, "%s.tmp.XXXXXX", fname);
+
+    fd = mkostemp(file, 0);
+    if (fd < 0) return -errno;
+
+    if (ftruncate(fd, sz) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    mptr = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mptr == MAP_FAILED) {
+        r = -errno;
+        goto fail;
+    }
+
+    hll_marshal_buf(h, mptr, sz);
+    munmap(mptr, sz);
+
+    if (fdatasync(fd) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    close(fd);
+    if (rename(file, fname) < 0) {
+        r = -errno;
+        unlink(file);
+        return r;
+    }
+    return 0;
+
+fail:
+    close(fd);
+    unlink(file);
+    return r;
+}
+
+
+int
+hll_unmarshal(hll **p_h, const char *fname, uint32_t flags)
+{
+    struct stat st;
+    void *mptr;
+    hll *h;
+    hdr hd;
+    int fd, r;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    if (st.st_size < (HDRSIZ + HLL_CKSUMSZ)) {
+        close(fd);
+        return -EILSEQ;
+    }
+
+    /*
+     * A private writable mapping: adds to an in-situ sketch go to
+     * copy-on-write pages and never to the file.
+     */
+    mptr = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    r    = -errno;
+
+    /*
+     * POSIX allows us to close() and still keep the memory mapping
+     * as long as the process is alive.
+     */
+    close(fd);
+    if (mptr == MAP_FAILED) return r;
+
+    if ((r = rdhdr(mptr, st.st_size, &hd)) < 0) goto fail;
+
+    h = NEW(hll);
+    if (!h) {
+        r = -ENOMEM;
+        goto fail;
+    }
+
+    flags &= HLL_MMAP;
+    if (hd.enc != HLL_ENC_DENSE) flags = 0;
+
+    if ((r = rddata(h, &hd, mptr, flags)) < 0) {
+        DEL(h);
+        goto fail;
+    }
+
+    if (flags) {
+        h->flags |= HLL_MMAP;
+        h->map    = mptr;
+        h->maplen = st.st_size;
+    } else {
+        munmap(mptr, st.st_size);
+    }
+
+    *p_h = h;
+    return 0;
+
+fail:
+    munmap(mptr, st.st_size);
+    return r;
+}
+
+/* EOF */
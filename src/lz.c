@@ -0,0 +1,1208 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * lz.c - Fast LZ77 block and frame codec.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in utils/lz.h.
+ * o  The compressors work in "positions": a dictionary (if any) is
+ *    positions [0, dictlen) and the input buffer follows it. Hash
+ *    and chain tables hold positions, so a candidate is a valid
+ *    pointer whatever stale value the table has; every candidate is
+ *    checked against the data before it is used.
+ * o  A match that starts in the dictionary is extended up to its
+ *    end and then continues into the start of the input buffer.
+ * o  The streams keep their input (output) in one buffer with up to
+ *    128KB (64KB) of history in front of the current block. The
+ *    compressor drops history in multiples of 64KB, so that the
+ *    position of a hash chain entry (pos & 0xffff) doesn't change.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utils/utils.h"
+#include "utils/lz.h"
+#include "utils/xxhash.h"
+
+
+#define MINMATCH        4
+#define LASTLIT         5           /* last bytes are literals */
+#define MFLIMIT         12          /* no match starts after this */
+#define MAXDIST         65535
+#define WINDOW          65536
+
+#define FAST_HBITS      12
+#define SKIP_TRIGGER    6           /* skip faster after 2^6 misses */
+
+#define HC_HBITS        15
+#define HC_CHAIN        (1 << 16)
+
+#define LZ_MAGIC        0x46425a4c  /* "LZBF" */
+#define LZ_VERSION      1
+#define LZ_HDRSIZE      8
+#define LZ_RAW          0x80000000U /* stored block */
+
+
+
+static inline uint32_t
+rd32(const void * p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t
+rd64(const void * p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t
+get_le32(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void
+put_le32(uint8_t * p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+static inline uint32_t
+hash4(const uint8_t * p, int bits)
+{
+    return (rd32(p) * 2654435761U) >> (32 - bits);
+}
+
+
+/*
+ * Number of equal bytes at 'p' and 'm', up to 'lim'.
+ */
+static inline size_t
+count(const uint8_t * p, const uint8_t * m, const uint8_t * lim)
+{
+    const uint8_t * p0 = p;
+
+    while (p + 8 <= lim) {
+        uint64_t x = rd64(p) ^ rd64(m);
+
+        if (x) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return (p - p0) + (__builtin_clzll(x) >> 3);
+#else
+            return (p - p0) + (__builtin_ctzll(x) >> 3);
+#endif
+        }
+        p += 8;
+        m += 8;
+    }
+    while (p < lim && *p == *m) {
+        p++;
+        m++;
+    }
+    return p - p0;
+}
+
+
+/*
+ * The window of a compression: an optional dictionary followed by
+ * the input buffer.
+ */
+struct lzwin
+{
+    const uint8_t * dict;
+    uint32_t        dictlen;
+    const uint8_t * src;        /* position 'dictlen' */
+};
+
+
+static inline const uint8_t *
+wptr(const struct lzwin * w, uint32_t pos, const int ext)
+{
+    if (ext && pos < w->dictlen) return w->dict + pos;
+    return w->src + (pos - w->dictlen);
+}
+
+
+/*
+ * Match length at 'ip' of the candidate at position 'mpos' (which
+ * is known to match 4 bytes).
+ */
+static inline size_t
+mlen(const struct lzwin * w, const uint8_t * ip, uint32_t mpos,
+     const uint8_t * mlimit, const int ext)
+{
+    const uint8_t * m = wptr(w, mpos, ext);
+
+    if (ext && mpos < w->dictlen) {
+        const uint8_t * dend = w->dict + w->dictlen;
+        const uint8_t * lim  = ip + (dend - m) < mlimit ? ip + (dend - m) : mlimit;
+        size_t n = MINMATCH + count(ip + MINMATCH, m + MINMATCH, lim);
+
+        if (ip + n == lim && lim < mlimit)
+            n += count(ip + n, w->src, mlimit);
+        return n;
+    }
+    return MINMATCH + count(ip + MINMATCH, m + MINMATCH, mlimit);
+}
+
+
+/*
+ * Does position 'mpos' (from a table) have 4 bytes equal to 'ip' at
+ * a valid distance from 'ipos'?
+ */
+static inline int
+is_match(const struct lzwin * w, const uint8_t * ip, uint32_t ipos,
+         uint32_t mpos, const int ext)
+{
+    if ((ipos - mpos - 1) >= MAXDIST) return 0;
+    if (ext && mpos < w->dictlen && mpos + MINMATCH > w->dictlen) return 0;
+    return rd32(wptr(w, mpos, ext)) == rd32(ip);
+}
+
+
+
+/*
+ * Write one sequence; returns the new output pointer or NULL if it
+ * doesn't fit.
+ */
+static inline uint8_t *
+put_seq(uint8_t * op, uint8_t * oend, const uint8_t * lit, size_t nlit,
+        const uint8_t * iend, uint32_t off, size_t len)
+{
+    uint8_t * tok = op++;
+    size_t ml     = len - MINMATCH;
+
+    if (unlikely(op + nlit + nlit / 255 + ml / 255 + 4 > oend)) return 0;
+
+    if (nlit >= 15) {
+        size_t l = nlit - 15;
+
+        *tok = 15 << 4;
+        for (; l >= 255; l -= 255) *op++ = 255;
+        *op++ = (uint8_t)l;
+    } else {
+        *tok = (uint8_t)(nlit << 4);
+    }
+
+    // Short literals: one 16 byte copy if there's room either side
+    if (nlit <= 16 && op + 16 <= oend && lit + 16 <= iend) memcpy(op, lit, 16);
+    else                                                   memcpy(op, lit, nlit);
+    op += nlit;
+
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+
+    if (ml >= 15) {
+        *tok |= 15;
+        for (ml -= 15; ml >= 255; ml -= 255) *op++ = 255;
+        *op++ = (uint8_t)ml;
+    } else {
+        *tok |= (uint8_t)ml;
+    }
+    return op;
+}
+
+
+/*
+ * Write the last literals; returns the size of the block.
+ */
+static ssize_t
+put_last(uint8_t * dst, uint8_t * op, uint8_t * oend, const uint8_t * lit, size_t nlit)
+{
+    if (op + 1 + nlit + (nlit + 240) / 255 > oend) return -ENOSPC;
+
+    if (nlit >= 15) {
+        size_t l = nlit - 15;
+
+        *op++ = 15 << 4;
+        for (; l >= 255; l -= 255) *op++ = 255;
+        *op++ = (uint8_t)l;
+    } else {
+        *op++ = (uint8_t)(nlit << 4);
+    }
+    memcpy(op, lit, nlit);
+    return (op + nlit) - dst;
+}
+
+
+
+/*
+ * Fast compressor: one candidate per position from 'tab' (1 <<
+ * 'hbits' positions). Compresses positions [start, end).
+ */
+static inline __attribute__((always_inline)) ssize_t
+__fast(uint8_t * dst, size_t dstsz, const struct lzwin * w, uint32_t start,
+       uint32_t end, uint32_t * tab, int hbits, const int ext)
+{
+    const uint8_t * ip      = w->src + (start - w->dictlen);
+    const uint8_t * iend    = w->src + (end - w->dictlen);
+    const uint8_t * anchor  = ip;
+    const uint8_t * mflimit = iend - MFLIMIT;
+    const uint8_t * mlimit  = iend - LASTLIT;
+    uint8_t * op   = dst;
+    uint8_t * oend = dst + dstsz;
+
+#define _pos(p)     ((uint32_t)((p) - w->src) + w->dictlen)
+
+    if (end - start < MFLIMIT + 1) goto last;
+
+    tab[hash4(ip, hbits)] = _pos(ip);
+    ip++;
+
+    for (;;) {
+        const uint8_t * fwd = ip;
+        unsigned misses     = 1 << SKIP_TRIGGER;
+        uint32_t mpos, ipos;
+        size_t len;
+
+        // Find a match; the step grows with the misses
+        do {
+            uint32_t h = hash4(fwd, hbits);
+
+            ip   = fwd;
+            fwd += misses++ >> SKIP_TRIGGER;
+            if (unlikely(fwd > mflimit)) goto last;
+
+            ipos   = _pos(ip);
+            mpos   = tab[h];
+            tab[h] = ipos;
+        } while (!is_match(w, ip, ipos, mpos, ext));
+
+        // Extend backwards
+        {
+            const uint8_t * m  = wptr(w, mpos, ext);
+            const uint8_t * lo = (ext && mpos < w->dictlen) ? w->dict : w->src;
+
+            while (ip > anchor && m > lo && ip[-1] == m[-1]) {
+                ip--;
+                m--;
+                mpos--;
+            }
+        }
+
+        for (;;) {
+            len = mlen(w, ip, mpos, mlimit, ext);
+            op  = put_seq(op, oend, anchor, ip - anchor, iend, _pos(ip) - mpos, len);
+            if (unlikely(!op)) return -ENOSPC;
+
+            ip    += len;
+            anchor = ip;
+            if (ip > mflimit) goto last;
+
+            tab[hash4(ip - 2, hbits)] = _pos(ip - 2);
+
+            // A match right away?
+            {
+                uint32_t h = hash4(ip, hbits);
+
+                ipos   = _pos(ip);
+                mpos   = tab[h];
+                tab[h] = ipos;
+                if (!is_match(w, ip, ipos, mpos, ext)) break;
+            }
+        }
+        ip++;
+    }
+
+last:
+    return put_last(dst, op, oend, anchor, iend - anchor);
+
+#undef _pos
+}
+
+
+
+/*
+ * High compression: hash chains of all positions, longest match,
+ * one step lazy matching.
+ */
+struct hc
+{
+    uint32_t * head;            /* 1 << HC_HBITS */
+    uint16_t * chain;           /* HC_CHAIN: distance to the previous */
+    uint32_t   next;            /* next position to insert */
+    int        depth;
+};
+
+
+static inline void
+hc_insert(struct hc * c, const struct lzwin * w, uint32_t upto, const int ext)
+{
+    uint32_t p;
+
+    for (p = c->next; p < upto; p++) {
+        const uint8_t * s;
+        uint32_t h, d;
+
+        // The last 3 positions of the dictionary have no 4 bytes
+        if (ext && p < w->dictlen && p + MINMATCH > w->dictlen) continue;
+
+        s = wptr(w, p, ext);
+        h = hash4(s, HC_HBITS);
+        d = p - c->head[h];
+
+        c->chain[p & (HC_CHAIN - 1)] = d > MAXDIST ? MAXDIST : (uint16_t)d;
+        c->head[h] = p;
+    }
+    if (upto > c->next) c->next = upto;
+}
+
+
+/*
+ * Longest match at 'ip'; 0 if none.
+ */
+static inline size_t
+hc_find(struct hc * c, const struct lzwin * w, const uint8_t * ip,
+        uint32_t ipos, const uint8_t * mlimit, uint32_t * p_mpos, const int ext)
+{
+    uint32_t mpos;
+    size_t best = 0;
+    int n       = c->depth;
+
+    hc_insert(c, w, ipos, ext);
+
+    mpos = c->head[hash4(ip, HC_HBITS)];
+    while (n-- > 0 && (ipos - mpos - 1) < MAXDIST) {
+        const uint8_t * m = wptr(w, mpos, ext);
+        uint16_t d;
+
+        if (ext && mpos < w->dictlen) {
+            if (mpos + MINMATCH <= w->dictlen && rd32(m) == rd32(ip)) {
+                size_t len = mlen(w, ip, mpos, mlimit, ext);
+
+                if (len > best) {
+                    best    = len;
+                    *p_mpos = mpos;
+                }
+            }
+        } else if (m[best] == ip[best] && rd32(m) == rd32(ip)) {
+            size_t len = MINMATCH + count(ip + MINMATCH, m + MINMATCH, mlimit);
+
+            if (len > best) {
+                best    = len;
+                *p_mpos = mpos;
+                if (ip + best == mlimit) break;
+            }
+        }
+
+        d = c->chain[mpos & (HC_CHAIN - 1)];
+        if (d == 0) break;
+        mpos -= d;
+    }
+    return best;
+}
+
+
+static inline __attribute__((always_inline)) ssize_t
+__hc(uint8_t * dst, size_t dstsz, const struct lzwin * w, uint32_t start,
+     uint32_t end, struct hc * c, const int ext)
+{
+    const uint8_t * ip      = w->src + (start - w->dictlen);
+    const uint8_t * iend    = w->src + (end - w->dictlen);
+    const uint8_t * anchor  = ip;
+    const uint8_t * mflimit = iend - MFLIMIT;
+    const uint8_t * mlimit  = iend - LASTLIT;
+    uint8_t * op   = dst;
+    uint8_t * oend = dst + dstsz;
+
+#define _pos(p)     ((uint32_t)((p) - w->src) + w->dictlen)
+
+    if (end - start < MFLIMIT + 1) goto last;
+
+    while (ip <= mflimit) {
+        uint32_t mpos, mpos2;
+        size_t len, len2;
+
+        len = hc_find(c, w, ip, _pos(ip), mlimit, &mpos, ext);
+        if (len < MINMATCH) {
+            ip++;
+            continue;
+        }
+
+        // Lazy: a longer match one byte on?
+        while (ip + 1 <= mflimit &&
+               (len2 = hc_find(c, w, ip + 1, _pos(ip + 1), mlimit, &mpos2, ext)) > len) {
+            ip++;
+            len  = len2;
+            mpos = mpos2;
+        }
+
+        op = put_seq(op, oend, anchor, ip - anchor, iend, _pos(ip) - mpos, len);
+        if (unlikely(!op)) return -ENOSPC;
+
+        ip    += len;
+        anchor = ip;
+    }
+
+last:
+    return put_last(dst, op, oend, anchor, iend - anchor);
+
+#undef _pos
+}
+
+
+static int
+hc_init(struct hc * c, int level)
+{
+    c->head  = NEWA(uint32_t, 1 << HC_HBITS);
+    c->chain = NEWA(uint16_t, HC_CHAIN);
+    if (!c->head || !c->chain) {
+        DEL(c->head);
+        DEL(c->chain);
+        return -ENOMEM;
+    }
+
+    memset(c->head, 0, sizeof(uint32_t) << HC_HBITS);
+    memset(c->chain, 0, sizeof(uint16_t) * HC_CHAIN);
+    c->next  = 0;
+    c->depth = 1 << ((level > LZ_MAXLEVEL ? LZ_MAXLEVEL : level) - 1);
+    return 0;
+}
+
+
+static void
+hc_fini(struct hc * c)
+{
+    DEL(c->head);
+    DEL(c->chain);
+}
+
+
+/* Hash bits for a block of 'n' bytes: small blocks, small tables */
+static inline int
+fast_hbits(size_t n)
+{
+    int b = 8;
+
+    while (b < FAST_HBITS && ((size_t)1 << (b + 2)) < n) b++;
+    return b;
+}
+
+
+
+/*
+ * Block API
+ */
+
+struct lz_dict
+{
+    uint8_t * data;
+    uint32_t  len;
+    uint32_t  tab[1 << FAST_HBITS];     /* positions in 'data' */
+};
+
+
+static ssize_t
+compress(void * dst, size_t dstsz, const void * src, size_t n,
+         const lz_dict * d, int level)
+{
+    struct lzwin w;
+    ssize_t r;
+
+    if (n > LZ_MAXBLOCK) return -E2BIG;
+
+    w.dict    = d ? d->data : 0;
+    w.dictlen = d ? d->len : 0;
+    w.src     = src;
+
+    if (level <= LZ_FAST) {
+        uint32_t tab[1 << FAST_HBITS];
+
+        if (d) {
+            memcpy(tab, d->tab, sizeof tab);
+            return __fast(dst, dstsz, &w, w.dictlen, w.dictlen + n, tab, FAST_HBITS, 1);
+        }
+
+        int hb = fast_hbits(n);
+
+        memset(tab, 0, sizeof(uint32_t) << hb);
+        return __fast(dst, dstsz, &w, 0, n, tab, hb, 0);
+    } else {
+        struct hc c;
+
+        if ((r = hc_init(&c, level)) < 0) return r;
+        if (d) {
+            hc_insert(&c, &w, w.dictlen, 1);
+            r = __hc(dst, dstsz, &w, w.dictlen, w.dictlen + n, &c, 1);
+        } else {
+            r = __hc(dst, dstsz, &w, 0, n, &c, 0);
+        }
+        hc_fini(&c);
+        return r;
+    }
+}
+
+
+ssize_t
+lz_compress(void * dst, size_t dstsz, const void * src, size_t n, int level)
+{
+    return compress(dst, dstsz, src, n, 0, level);
+}
+
+
+ssize_t
+lz_compress_dict(void * dst, size_t dstsz, const void * src, size_t n,
+                 const lz_dict * d, int level)
+{
+    return compress(dst, dstsz, src, n, d, level);
+}
+
+
+int
+lz_dict_new(lz_dict ** p_d, const void * data, size_t n)
+{
+    lz_dict * d = NEWZ(lz_dict);
+    uint32_t p;
+
+    if (!d) return -ENOMEM;
+
+    if (n > WINDOW) {
+        data = (const uint8_t *)data + (n - WINDOW);
+        n    = WINDOW;
+    }
+
+    d->len  = (uint32_t)n;
+    d->data = NEWA(uint8_t, n + 1);
+    if (!d->data) {
+        DEL(d);
+        return -ENOMEM;
+    }
+    memcpy(d->data, data, n);
+
+    for (p = 0; p + MINMATCH <= d->len; p++)
+        d->tab[hash4(d->data + p, FAST_HBITS)] = p;
+
+    *p_d = d;
+    return 0;
+}
+
+
+void
+lz_dict_delete(lz_dict * d)
+{
+    DEL(d->data);
+    DEL(d);
+}
+
+
+
+/*
+ * Copy 'n' bytes 16 at a time; writes up to 15 bytes past 'd + n'.
+ * The source must not overlap a 16 byte chunk of the destination.
+ */
+static inline void
+wild16(uint8_t * d, const uint8_t * s, size_t n)
+{
+    uint8_t * e = d + n;
+
+    do {
+        memcpy(d, s, 16);
+        d += 16;
+        s += 16;
+    } while (d < e);
+}
+
+
+/*
+ * Copy a match of 'n' bytes from 'op - off'; it may overlap 'op'.
+ * Copies in chunks while that stays 16 bytes short of 'oend', and
+ * the rest byte by byte.
+ */
+static inline void
+copy_match(uint8_t * op, size_t off, size_t n, const uint8_t * oend)
+{
+    const uint8_t * m = op - off;
+    uint8_t * e       = op + n;
+    uint8_t * fe      = op;             /* chunks end here */
+    size_t room       = oend - op;
+
+    if (room >= 32) fe = op + (n < room - 16 ? n : room - 16);
+
+    if (off >= 16) {
+        for (; op < fe; op += 16, m += 16) memcpy(op, m, 16);
+    } else if (off >= 8) {
+        for (; op < fe; op += 8, m += 8) memcpy(op, m, 8);
+    } else if (fe - op > 16) {
+        // Short period: copy a multiple of the period that is at
+        // least 8 bytes, then 8 at a time from that far back.
+        size_t d = off * ((8 + off - 1) / off), i;
+
+        for (i = 0; i < d; i++) op[i] = m[i];
+        op += d;
+        m   = op - d;
+        for (; op < fe; op += 8, m += 8) memcpy(op, m, 8);
+    }
+
+    while (op < e) *op++ = *m++;
+}
+
+
+/*
+ * Decode block 'src' into 'dst'. The 'prefix' bytes before 'dst'
+ * are history (decoded before it), and before them 'dict'.
+ */
+static ssize_t
+decode(uint8_t * dst, size_t dstsz, const uint8_t * src, size_t n,
+       size_t prefix, const uint8_t * dict, size_t dictlen)
+{
+    const uint8_t * ip   = src;
+    const uint8_t * iend = src + n;
+    const uint8_t * low  = dst - prefix;
+    uint8_t * op   = dst;
+    uint8_t * oend = dst + dstsz;
+
+    for (;;) {
+        size_t lit, len, off;
+        unsigned tok;
+
+        if (unlikely(ip >= iend)) return -EINVAL;
+        tok = *ip++;
+
+        // Literals
+        lit = tok >> 4;
+        if (lit == 15) {
+            unsigned b;
+
+            do {
+                if (unlikely(ip >= iend)) return -EINVAL;
+                b    = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+
+        if (unlikely(lit > (size_t)(iend - ip))) return -EINVAL;
+        if (unlikely(lit > (size_t)(oend - op))) return -ENOSPC;
+
+        if (op + lit + 16 <= oend && ip + lit + 16 <= iend) wild16(op, ip, lit);
+        else                                                memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend) break;
+
+        // Match
+        if (unlikely(iend - ip < 2)) return -EINVAL;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        len = tok & 15;
+        if (len == 15) {
+            unsigned b;
+
+            do {
+                if (unlikely(ip >= iend)) return -EINVAL;
+                b    = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += MINMATCH;
+
+        if (unlikely(off == 0)) return -EINVAL;
+        if (unlikely(len > (size_t)(oend - op))) return -ENOSPC;
+
+        if (unlikely(off > (size_t)(op - low))) {
+            // From the dictionary, then maybe on into the output
+            size_t back = off - (op - low), k;
+
+            if (back > dictlen) return -EINVAL;
+
+            k = back < len ? back : len;
+            memcpy(op, dict + dictlen - back, k);
+            op  += k;
+            len -= k;
+            if (len == 0) continue;
+
+            // The rest starts at the first byte of the history
+            if (len <= (size_t)(op - low)) {
+                memcpy(op, low, len);
+                op += len;
+            } else {
+                const uint8_t * m = low;
+
+                while (len--) *op++ = *m++;
+            }
+            continue;
+        }
+
+        copy_match(op, off, len, oend);
+        op += len;
+    }
+    return op - dst;
+}
+
+
+ssize_t
+lz_decompress(void * dst, size_t dstsz, const void * src, size_t n)
+{
+    return decode(dst, dstsz, src, n, 0, 0, 0);
+}
+
+
+ssize_t
+lz_decompress_dict(void * dst, size_t dstsz, const void * src, size_t n,
+                   const lz_dict * d)
+{
+    return decode(dst, dstsz, src, n, 0, d->data, d->len);
+}
+
+
+
+/*
+ * Frames
+ */
+
+#define LZ_DEFAULT_BS   (256 * 1024)
+
+enum {
+    S_HDR = 0, S_BSIZE, S_BDATA, S_BCSUM, S_CCSUM, S_DONE,
+};
+
+struct lz_stream
+{
+    int        compress;
+    lz_opt     o;
+    lz_writer  w;
+    void *     ctx;
+
+    XXH32_state_t * xs;     /* content checksum */
+
+    /* Uncompressed data: 'hist' bytes of history, then the block */
+    uint8_t *  buf;
+    size_t     bufsz;
+    size_t     hist;
+    size_t     len;
+
+    /* Compressed block */
+    uint8_t *  cbuf;
+    size_t     cbufsz;
+
+    /* Compressor state */
+    uint32_t * tab;
+    struct hc  hc;
+
+    /* Decompressor state */
+    int        state;
+    size_t     need;        /* bytes of this state */
+    size_t     have;        /* .. of them in 'cbuf' */
+    uint32_t   bsize;       /* current block, with LZ_RAW */
+};
+
+
+static int
+stream_new(lz_stream ** p_s, const lz_opt * o, lz_writer w, void * ctx,
+           int compress)
+{
+    lz_stream * s = NEWZ(lz_stream);
+
+    if (!s) return -ENOMEM;
+
+    s->compress = compress;
+    s->o        = *o;
+    s->w        = w;
+    s->ctx      = ctx;
+    s->xs       = XXH32_createState();
+    if (!s->xs) goto nomem;
+    XXH32_reset(s->xs, 0);
+
+    // Compressor: 128KB history; decompressor: 64KB.
+    s->bufsz  = (compress ? 2 * WINDOW : WINDOW) + o->blocksize;
+    s->buf    = NEWA(uint8_t, s->bufsz);
+    s->cbufsz = LZ_BOUND(o->blocksize) + LZ_HDRSIZE;
+    s->cbuf   = NEWA(uint8_t, s->cbufsz);
+    if (!s->buf || !s->cbuf) goto nomem;
+
+    if (compress) {
+        if (o->level <= LZ_FAST) {
+            s->tab = NEWZA(uint32_t, 1 << FAST_HBITS);
+            if (!s->tab) goto nomem;
+        } else if (hc_init(&s->hc, o->level) < 0) {
+            goto nomem;
+        }
+    }
+
+    *p_s = s;
+    return 0;
+
+nomem:
+    lz_stream_delete(s);
+    return -ENOMEM;
+}
+
+
+int
+lz_stream_compress_new(lz_stream ** p_s, const lz_opt * o, lz_writer w, void * ctx)
+{
+    lz_opt d = { LZ_FAST, LZ_DEFAULT_BS, LZ_CONTENT_CSUM };
+    uint8_t h[LZ_HDRSIZE];
+    int r;
+
+    if (o) {
+        d = *o;
+        if (!d.blocksize) d.blocksize = LZ_DEFAULT_BS;
+        if (d.blocksize < WINDOW || d.blocksize > (4U << 20) ||
+            (d.blocksize & (d.blocksize - 1)))
+            return -EINVAL;
+        if (d.flags & ~(LZ_BLOCK_CSUM | LZ_CONTENT_CSUM | LZ_LINKED))
+            return -EINVAL;
+    }
+
+    if ((r = stream_new(p_s, &d, w, ctx, 1)) < 0) return r;
+
+    put_le32(h, LZ_MAGIC);
+    h[4] = LZ_VERSION;
+    h[5] = (uint8_t)d.flags;
+    h[6] = (uint8_t)__builtin_ctz(d.blocksize);
+    h[7] = (uint8_t)(XXH32(h, 7, 0) >> 8);
+
+    if ((r = (*w)(ctx, h, sizeof h)) < 0) {
+        lz_stream_delete(*p_s);
+        *p_s = 0;
+    }
+    return r;
+}
+
+
+int
+lz_stream_decompress_new(lz_stream ** p_s, lz_writer w, void * ctx)
+{
+    // The block size is known once the header is in; start with
+    // room for the header.
+    lz_opt d = { 0, 0, 0 };
+    lz_stream * s = NEWZ(lz_stream);
+
+    if (!s) return -ENOMEM;
+
+    s->o      = d;
+    s->w      = w;
+    s->ctx    = ctx;
+    s->cbufsz = LZ_HDRSIZE;
+    s->cbuf   = NEWA(uint8_t, s->cbufsz);
+    s->xs     = XXH32_createState();
+    if (!s->cbuf || !s->xs) {
+        lz_stream_delete(s);
+        return -ENOMEM;
+    }
+    XXH32_reset(s->xs, 0);
+
+    s->state = S_HDR;
+    s->need  = LZ_HDRSIZE;
+    *p_s = s;
+    return 0;
+}
+
+
+void
+lz_stream_delete(lz_stream * s)
+{
+    if (!s) return;
+
+    if (s->xs) XXH32_freeState(s->xs);
+    hc_fini(&s->hc);
+    DEL(s->tab);
+    DEL(s->buf);
+    DEL(s->cbuf);
+    DEL(s);
+}
+
+
+/*
+ * Compress and write the current block.
+ */
+static int
+flush_block(lz_stream * s)
+{
+    uint8_t * blk = s->buf + s->hist;
+    uint8_t * out = s->cbuf + 4;
+    struct lzwin w = { 0, 0, s->buf };
+    size_t n = s->len;
+    uint32_t start = (uint32_t)s->hist,
+             end   = (uint32_t)(s->hist + n);
+    ssize_t z;
+    int r;
+
+    if (n == 0) return 0;
+
+    XXH32_update(s->xs, blk, n);
+
+    // Only worth it if it saves something
+    if (s->o.level <= LZ_FAST) z = __fast(out, n - 1, &w, start, end, s->tab, FAST_HBITS, 0);
+    else                       z = __hc(out, n - 1, &w, start, end, &s->hc, 0);
+
+    if (z < 0) {
+        memcpy(out, blk, n);
+        put_le32(s->cbuf, (uint32_t)n | LZ_RAW);
+        z = n;
+    } else {
+        put_le32(s->cbuf, (uint32_t)z);
+    }
+
+    if (s->o.flags & LZ_BLOCK_CSUM) {
+        put_le32(out + z, XXH32(out, z, 0));
+        z += 4;
+    }
+
+    if ((r = (*s->w)(s->ctx, s->cbuf, z + 4)) < 0) return r;
+
+    s->len = 0;
+    if (s->o.flags & LZ_LINKED) {
+        size_t tot = end, shift, i;
+
+        s->hist = tot;
+        if (tot <= 2 * WINDOW) return 0;
+
+        // Keep 64KB .. 128KB; tables move by the same amount.
+        shift = (tot - WINDOW) & ~((size_t)WINDOW - 1);
+        memmove(s->buf, s->buf + shift, tot - shift);
+        s->hist = tot - shift;
+
+        if (s->tab) {
+            for (i = 0; i < (1 << FAST_HBITS); i++)
+                s->tab[i] = s->tab[i] > shift ? s->tab[i] - shift : 0;
+        } else {
+            for (i = 0; i < (1 << HC_HBITS); i++)
+                s->hc.head[i] = s->hc.head[i] > shift ? s->hc.head[i] - shift : 0;
+            s->hc.next -= shift;
+        }
+    } else {
+        s->hist = 0;
+        if (s->tab) memset(s->tab, 0, sizeof(uint32_t) << FAST_HBITS);
+        else {
+            memset(s->hc.head, 0, sizeof(uint32_t) << HC_HBITS);
+            s->hc.next = 0;
+        }
+    }
+    return 0;
+}
+
+
+int
+lz_stream_compress(lz_stream * s, const void * buf, size_t n)
+{
+    const uint8_t * p = buf;
+    int r;
+
+    while (n > 0) {
+        size_t k = s->o.blocksize - s->len;
+
+        if (k > n) k = n;
+        memcpy(s->buf + s->hist + s->len, p, k);
+        s->len += k;
+        p      += k;
+        n      -= k;
+
+        if (s->len == s->o.blocksize && (r = flush_block(s)) < 0)
+            return r;
+    }
+    return 0;
+}
+
+
+int
+lz_stream_compress_end(lz_stream * s)
+{
+    uint8_t e[8];
+    size_t n = 4;
+    int r;
+
+    if ((r = flush_block(s)) < 0) return r;
+
+    put_le32(e, 0);
+    if (s->o.flags & LZ_CONTENT_CSUM) {
+        put_le32(e + 4, XXH32_digest(s->xs));
+        n += 4;
+    }
+    return (*s->w)(s->ctx, e, n);
+}
+
+
+
+/*
+ * Frame header in 'h'; sets up the buffers.
+ */
+static int
+dec_header(lz_stream * s, const uint8_t * h)
+{
+    uint32_t bs;
+    uint8_t * p;
+
+    if (get_le32(h) != LZ_MAGIC) return -EINVAL;
+    if ((uint8_t)(XXH32(h, 7, 0) >> 8) != h[7]) return -EBADMSG;
+    if (h[4] != LZ_VERSION) return -EPROTO;
+    if (h[5] & ~(LZ_BLOCK_CSUM | LZ_CONTENT_CSUM | LZ_LINKED)) return -EINVAL;
+    if (h[6] < 16 || h[6] > 22) return -EINVAL;
+
+    bs = 1U << h[6];
+    s->o.flags     = h[5];
+    s->o.blocksize = bs;
+
+    s->bufsz  = WINDOW + bs;
+    s->buf    = NEWA(uint8_t, s->bufsz);
+    s->cbufsz = LZ_BOUND(bs) + LZ_HDRSIZE;
+    p         = NEWA(uint8_t, s->cbufsz);
+    if (!s->buf || !p) return -ENOMEM;
+
+    DEL(s->cbuf);
+    s->cbuf = p;
+    return 0;
+}
+
+
+/*
+ * Decode the block 'p' (s->bsize bytes) and write it out.
+ */
+static int
+dec_block(lz_stream * s, const uint8_t * p)
+{
+    uint32_t n   = s->bsize & ~LZ_RAW;
+    uint8_t * op = s->buf + s->hist;
+    ssize_t z;
+    int r;
+
+    if (s->bsize & LZ_RAW) {
+        memcpy(op, p, n);
+        z = n;
+    } else {
+        z = decode(op, s->o.blocksize, p, n, s->hist, 0, 0);
+        if (z < 0) return -EINVAL;
+    }
+
+    XXH32_update(s->xs, op, z);
+    if ((r = (*s->w)(s->ctx, op, z)) < 0) return r;
+
+    if (s->o.flags & LZ_LINKED) {
+        size_t tot = s->hist + z,
+               keep = tot < WINDOW ? tot : WINDOW;
+
+        memmove(s->buf, s->buf + tot - keep, keep);
+        s->hist = keep;
+    }
+    return 0;
+}
+
+
+/*
+ * Process the 'need' bytes of the current state at 'p'; move to the
+ * next state.
+ */
+static int
+dec_step(lz_stream * s, const uint8_t * p)
+{
+    int r;
+
+    switch (s->state) {
+    case S_HDR:
+        if ((r = dec_header(s, p)) < 0) return r;
+        s->state = S_BSIZE;
+        s->need  = 4;
+        break;
+
+    case S_BSIZE:
+        s->bsize = get_le32(p);
+        if (s->bsize == 0) {
+            if (s->o.flags & LZ_CONTENT_CSUM) {
+                s->state = S_CCSUM;
+                s->need  = 4;
+            } else {
+                s->state = S_DONE;
+                s->need  = 0;
+            }
+            break;
+        }
+
+        if ((s->bsize & LZ_RAW) ? (s->bsize & ~LZ_RAW) > s->o.blocksize
+                                : s->bsize > LZ_BOUND(s->o.blocksize))
+            return -EINVAL;
+
+        s->state = S_BDATA;
+        s->need  = s->bsize & ~LZ_RAW;
+        if (s->o.flags & LZ_BLOCK_CSUM) s->need += 4;
+        break;
+
+    case S_BDATA:
+        if (s->o.flags & LZ_BLOCK_CSUM) {
+            size_t n = s->need - 4;
+
+            if (XXH32(p, n, 0) != get_le32(p + n)) return -EBADMSG;
+        }
+        if ((r = dec_block(s, p)) < 0) return r;
+        s->state = S_BSIZE;
+        s->need  = 4;
+        break;
+
+    case S_CCSUM:
+        if (XXH32_digest(s->xs) != get_le32(p)) return -EBADMSG;
+        s->state = S_DONE;
+        s->need  = 0;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+
+int
+lz_stream_decompress(lz_stream * s, const void * buf, size_t n)
+{
+    const uint8_t * p = buf;
+    int r;
+
+    while (n > 0) {
+        if (s->state == S_DONE) return -EINVAL;   /* trailing data */
+
+        // Whole state in the input: use it in place
+        if (s->have == 0 && n >= s->need) {
+            size_t k = s->need;
+
+            if ((r = dec_step(s, p)) < 0) return r;
+            p += k;
+            n -= k;
+            continue;
+        }
+
+        size_t k = s->need - s->have;
+
+        if (k > n) k = n;
+        memcpy(s->cbuf + s->have, p, k);
+        s->have += k;
+        p       += k;
+        n       -= k;
+
+        if (s->have == s->need) {
+            s->have = 0;
+            if ((r = dec_step(s, s->cbuf)) < 0) return r;
+        }
+    }
+    return 0;
+}
+
+
+int
+lz_stream_decompress_end(lz_stream * s)
+{
+    return s->state == S_DONE ? 0 : -EINVAL;
+}
+
+/* EOF */
@@ -25,6 +25,7 @@
 #include <assert.h>
 
 #include "utils/mempool.h"
+#include "utils/metrics.h"
 #include "fast/list.h"
 
 /*
@@ -179,10 +180,23 @@ struct mempool
 
     /* OS Traits */
     struct memmgr traits;
+
+    /* Optional instrumentation; see mempool_metrics() */
+    struct mempool_metrics * metrics;
 };
 typedef struct mempool state;
 
 
+struct mempool_metrics
+{
+    metrics_counter * allocs;
+    metrics_counter * frees;
+    metrics_counter * fails;
+    metrics_counter * chunks;
+    metrics_gauge   * inuse;
+};
+
+
 
 
 /*
@@ -296,6 +310,8 @@ new_chunk(state * a)
     ch->next  = a->chunks;
     a->chunks = ch;
 
+    if (a->metrics) metrics_counter_inc(a->metrics->chunks);
+
 
     /*
      * Setup the pointers within this chunk so that all alignment
@@ -541,6 +557,7 @@ mempool_delete(state* a)
         ch = next;
     }
 
+    if (a->metrics) free(a->metrics);
     (*tr->free)(tr->context, a);
 
 end:
@@ -586,6 +603,16 @@ mempool_alloc(state* a)
 
 _end:
     //printf("state-%p: alloc() => %p\n", a, ptr);
+    if (a->metrics) {
+        struct mempool_metrics * m = a->metrics;
+
+        if (ptr) {
+            metrics_counter_inc(m->allocs);
+            metrics_gauge_add(m->inuse, 1);
+        } else {
+            metrics_counter_inc(m->fails);
+        }
+    }
     return ptr ? fill_memory(a, ptr) : 0;
 }
 
@@ -605,6 +632,39 @@ mempool_free(state* a, void * ptr)
     clear_memory(a, ptr);
 
     DL_INSERT_HEAD(&a->mru_head, blk, link);
+
+    if (a->metrics) {
+        metrics_counter_inc(a->metrics->frees);
+        metrics_gauge_add(a->metrics->inuse, -1);
+    }
+}
+
+
+/*
+ * Record allocator metrics in 'r'.
+ */
+int
+mempool_metrics(state* a, metrics_registry* r, const char* labels)
+{
+    struct mempool_metrics * m = (struct mempool_metrics *)calloc(1, sizeof *m);
+
+    if (!m)
+        return -ENOMEM;
+
+    m->allocs = metrics_counter_get(r, "mempool_alloc", labels);
+    m->frees  = metrics_counter_get(r, "mempool_free", labels);
+    m->fails  = metrics_counter_get(r, "mempool_alloc_fail", labels);
+    m->chunks = metrics_counter_get(r, "mempool_chunks", labels);
+    m->inuse  = metrics_gauge_get(r, "mempool_inuse", labels);
+
+    if (!(m->allocs && m->frees && m->fails && m->chunks && m->inuse)) {
+        free(m);
+        return -ENOMEM;
+    }
+
+    if (a->metrics) free(a->metrics);
+    a->metrics = m;
+    return 0;
 }
 
 
@@ -0,0 +1,502 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * metrics.c - Lock-free counters, gauges and histograms.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Threads get a counter shard round robin on first use; with
+ *    more threads than shards a few share a cache line, which costs
+ *    some contention but is still correct.
+ * o  The registry is an insertion ordered list; lookups are linear
+ *    and only happen when a metric is created.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "utils/metrics.h"
+#include "fast/encdec.h"
+
+
+struct metric
+{
+    struct metric * next;
+    int     type;
+    char *  name;
+    char *  labels;         /* "" if none */
+    void *  raw;            /* allocation; 'p' is aligned within it */
+
+    union {
+        metrics_counter * c;
+        metrics_gauge *   g;
+        metrics_hist *    h;
+        void *            p;
+    };
+};
+typedef struct metric metric;
+
+
+struct metrics_registry
+{
+    pthread_mutex_t lock;
+    metric * head;
+    metric * tail;
+    size_t   n;
+};
+
+
+__thread unsigned __metrics_shard = 0;
+
+static unsigned Next_shard = 0;
+
+
+unsigned
+__metrics_shard_init(void)
+{
+    unsigned i = __atomic_fetch_add(&Next_shard, 1, __ATOMIC_RELAXED);
+
+    __metrics_shard = (i & (METRICS_SHARDS - 1)) + 1;
+    return __metrics_shard;
+}
+
+
+uint64_t
+metrics_counter_read(metrics_counter * c)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < METRICS_SHARDS; i++) v += __atomic_load_n(&c->s[i].v, __ATOMIC_RELAXED);
+    return v;
+}
+
+
+void
+metrics_hist_snapshot(metrics_hist * h, metrics_hist_snap * s)
+{
+    unsigned i;
+
+    s->count = 0;
+    for (i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        s->b[i]   = __atomic_load_n(&h->b[i], __ATOMIC_RELAXED);
+        s->count += s->b[i];
+    }
+
+    s->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    s->min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    s->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (s->count == 0) s->min = 0;
+}
+
+
+uint64_t
+metrics_hist_bucket_lo(unsigned idx)
+{
+    unsigned e;
+
+    if (idx < METRICS_HIST_SUB) return idx;
+
+    e = (idx >> METRICS_HIST_BITS) + METRICS_HIST_BITS - 1;
+    return (1ULL << e) | ((uint64_t)(idx & (METRICS_HIST_SUB - 1)) << (e - METRICS_HIST_BITS));
+}
+
+
+/* Highest value in bucket 'idx' */
+static uint64_t
+bucket_hi(unsigned idx)
+{
+    if (idx + 1 >= METRICS_HIST_BUCKETS) return ~0ULL;
+    return metrics_hist_bucket_lo(idx + 1) - 1;
+}
+
+
+uint64_t
+metrics_hist_quantile(const metrics_hist_snap * s, double q)
+{
+    uint64_t want, seen = 0;
+    unsigned i;
+
+    if (s->count == 0) return 0;
+    if (q <= 0.0) return s->min;
+    if (q >= 1.0) return s->max;
+
+    want = (uint64_t)(q * (double)s->count);
+    if (want == 0) want = 1;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += s->b[i];
+        if (seen >= want) {
+            uint64_t v = bucket_hi(i);
+
+            return v > s->max ? s->max : v;
+        }
+    }
+    return s->max;
+}
+
+
+metrics_registry *
+metrics_registry_new(void)
+{
+    metrics_registry * r = NEWZ(metrics_registry);
+
+    if (!r) return 0;
+
+    pthread_mutex_init(&r->lock, 0);
+    return r;
+}
+
+
+static void
+free_list(metric * m)
+{
+    while (m) {
+        metric * n = m->next;
+
+        free(m->raw);
+        DEL(m->name);
+        DEL(m->labels);
+        DEL(m);
+        m = n;
+    }
+}
+
+
+void
+metrics_registry_delete(metrics_registry * r)
+{
+    free_list(r->head);
+    pthread_mutex_destroy(&r->lock);
+    DEL(r);
+}
+
+
+metrics_registry *
+metrics_default(void)
+{
+    static metrics_registry Default = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+
+    return &Default;
+}
+
+
+static metric *
+make(int type, const char * name, const char * labels)
+{
+    size_t sz   = type == METRICS_COUNTER ? sizeof(metrics_counter)
+                : type == METRICS_GAUGE   ? sizeof(metrics_gauge)
+                :                           sizeof(metrics_hist);
+    metric * m  = NEWZ(metric);
+
+    if (!m) return 0;
+
+    m->type   = type;
+    m->name   = strdup(name);
+    m->labels = strdup(labels);
+    m->raw    = calloc(1, sz + METRICS_CACHELINE);
+    if (!m->name || !m->labels || !m->raw) {
+        free_list(m);
+        return 0;
+    }
+
+    m->p = (void *)_ALIGN_UP((uintptr_t)m->raw, METRICS_CACHELINE);
+    if (type == METRICS_HIST) m->h->min = ~0ULL;
+    return m;
+}
+
+
+static void *
+get(metrics_registry * r, int type, const char * name, const char * labels)
+{
+    metric * m;
+
+    if (!labels) labels = "";
+
+    pthread_mutex_lock(&r->lock);
+    for (m = r->head; m; m = m->next) {
+        if (0 == strcmp(m->name, name) && 0 == strcmp(m->labels, labels)) break;
+    }
+
+    if (m) {
+        if (m->type != type) m = 0;
+    } else if ((m = make(type, name, labels))) {
+        if (r->tail) r->tail->next = m;
+        else         r->head = m;
+
+        r->tail = m;
+        r->n++;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return m ? m->p : 0;
+}
+
+
+metrics_counter *
+metrics_counter_get(metrics_registry * r, const char * name, const char * labels)
+{
+    return (metrics_counter *)get(r, METRICS_COUNTER, name, labels);
+}
+
+
+metrics_gauge *
+metrics_gauge_get(metrics_registry * r, const char * name, const char * labels)
+{
+    return (metrics_gauge *)get(r, METRICS_GAUGE, name, labels);
+}
+
+
+metrics_hist *
+metrics_hist_get(metrics_registry * r, const char * name, const char * labels)
+{
+    return (metrics_hist *)get(r, METRICS_HIST, name, labels);
+}
+
+
+int
+metrics_queue_init(metrics_queue * m, metrics_registry * r,
+                   const char * name, const char * labels)
+{
+    char nm[256];
+
+    snprintf(nm, sizeof nm, "%s_enq", name);
+    m->enq = metrics_counter_get(r, nm, labels);
+
+    snprintf(nm, sizeof nm, "%s_deq", name);
+    m->deq = metrics_counter_get(r, nm, labels);
+
+    snprintf(nm, sizeof nm, "%s_enq_blocked", name);
+    m->enq_blocked = metrics_counter_get(r, nm, labels);
+
+    snprintf(nm, sizeof nm, "%s_deq_blocked", name);
+    m->deq_blocked = metrics_counter_get(r, nm, labels);
+
+    return (m->enq && m->deq && m->enq_blocked && m->deq_blocked) ? 0 : -ENOMEM;
+}
+
+
+size_t
+metrics_count(metrics_registry * r)
+{
+    size_t n;
+
+    pthread_mutex_lock(&r->lock);
+    n = r->n;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+
+/*
+ * Text export
+ */
+
+static int
+put_line(metrics_writer w, void * ctx, const metric * m, const char * suffix,
+         const char * extra, const char * val)
+{
+    char buf[1024];
+    char lab[512];
+    int n;
+
+    if (*m->labels && extra) snprintf(lab, sizeof lab, "{%s,%s}", m->labels, extra);
+    else if (*m->labels)     snprintf(lab, sizeof lab, "{%s}", m->labels);
+    else if (extra)          snprintf(lab, sizeof lab, "{%s}", extra);
+    else                     lab[0] = 0;
+
+    n = snprintf(buf, sizeof buf, "%s%s%s %s\n", m->name, suffix, lab, val);
+    if (n >= (int)sizeof buf) n = sizeof buf - 1;
+
+    return (*w)(ctx, buf, n);
+}
+
+
+static int
+export_text(const metric * m, metrics_writer w, void * ctx, metrics_hist_snap * s)
+{
+    static const struct {
+        const char * label;
+        double q;
+    } Quantiles[] = {
+        { "quantile=0.5",   0.5   },
+        { "quantile=0.9",   0.9   },
+        { "quantile=0.99",  0.99  },
+        { "quantile=0.999", 0.999 },
+    };
+    char v[32];
+    size_t i;
+    int r;
+
+#define _u(x)   snprintf(v, sizeof v, "%llu", (unsigned long long)(x))
+
+    switch (m->type) {
+        case METRICS_COUNTER:
+            _u(metrics_counter_read(m->c));
+            return put_line(w, ctx, m, "", 0, v);
+
+        case METRICS_GAUGE:
+            snprintf(v, sizeof v, "%lld", (long long)metrics_gauge_read(m->g));
+            return put_line(w, ctx, m, "", 0, v);
+
+        case METRICS_HIST:
+            metrics_hist_snapshot(m->h, s);
+            _u(s->count);
+            if ((r = put_line(w, ctx, m, "_count", 0, v)) < 0) return r;
+            _u(s->sum);
+            if ((r = put_line(w, ctx, m, "_sum", 0, v)) < 0)   return r;
+            _u(s->min);
+            if ((r = put_line(w, ctx, m, "_min", 0, v)) < 0)   return r;
+            _u(s->max);
+            if ((r = put_line(w, ctx, m, "_max", 0, v)) < 0)   return r;
+
+            for (i = 0; i < ARRAY_SIZE(Quantiles); i++) {
+                _u(metrics_hist_quantile(s, Quantiles[i].q));
+                if ((r = put_line(w, ctx, m, "", Quantiles[i].label, v)) < 0) return r;
+            }
+            return 0;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+
+/*
+ * Binary export
+ */
+
+static uint8_t *
+enc_str(uint8_t * p, const char * s)
+{
+    size_t n = strlen(s);
+
+    if (n > 65535) n = 65535;
+    p = enc_LE_u16(p, (uint16_t)n);
+    memcpy(p, s, n);
+    return p + n;
+}
+
+
+static int
+export_binary(const metric * m, metrics_writer w, void * ctx, metrics_hist_snap * s, uint8_t * buf)
+{
+    uint8_t * p = buf;
+    uint8_t * nb;
+    unsigned i, n = 0;
+
+    *p++ = (uint8_t)m->type;
+    p    = enc_str(p, m->name);
+    p    = enc_str(p, m->labels);
+
+    switch (m->type) {
+        case METRICS_COUNTER:
+            p = enc_LE_u64(p, metrics_counter_read(m->c));
+            break;
+
+        case METRICS_GAUGE:
+            p = enc_LE_u64(p, (uint64_t)metrics_gauge_read(m->g));
+            break;
+
+        case METRICS_HIST:
+            metrics_hist_snapshot(m->h, s);
+            p  = enc_LE_u64(p, s->count);
+            p  = enc_LE_u64(p, s->sum);
+            p  = enc_LE_u64(p, s->min);
+            p  = enc_LE_u64(p, s->max);
+            nb = p;
+            p += 2;
+            for (i = 0; i < METRICS_HIST_BUCKETS; i++) {
+                if (s->b[i] == 0) continue;
+
+                p = enc_LE_u16(p, (uint16_t)i);
+                p = enc_LE_u64(p, s->b[i]);
+                n++;
+            }
+            enc_LE_u16(nb, (uint16_t)n);
+            break;
+
+        default:
+            break;
+    }
+
+    return (*w)(ctx, buf, p - buf);
+}
+
+
+/* Largest binary record: two max length strings and every bucket */
+#define BINREC_MAX  (1 + 2 * (2 + 65535) + 4 * 8 + 2 + METRICS_HIST_BUCKETS * 10)
+
+
+int
+metrics_export(metrics_registry * r, int fmt, metrics_writer w, void * ctx)
+{
+    metrics_hist_snap * s = NEW(metrics_hist_snap);
+    uint8_t * buf = 0;
+    metric * m;
+    int e = 0;
+
+    if (!s) return -ENOMEM;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (fmt == METRICS_BINARY) {
+        uint8_t hdr[20];
+        uint8_t * p = hdr;
+
+        if (!(buf = NEWA(uint8_t, BINREC_MAX))) {
+            e = -ENOMEM;
+            goto done;
+        }
+
+        memcpy(p, "MTRC", 4);
+        p = enc_LE_u32(p + 4, 1);
+        p = enc_LE_u64(p, timenow());
+        p = enc_LE_u32(p, (uint32_t)r->n);
+        if ((e = (*w)(ctx, hdr, p - hdr)) < 0) goto done;
+    } else if (fmt != METRICS_TEXT) {
+        e = -EINVAL;
+        goto done;
+    }
+
+    for (m = r->head; m; m = m->next) {
+        e = fmt == METRICS_TEXT ? export_text(m, w, ctx, s)
+                                : export_binary(m, w, ctx, s, buf);
+        if (e < 0) break;
+    }
+
+done:
+    pthread_mutex_unlock(&r->lock);
+    if (buf) DEL(buf);
+    DEL(s);
+    return e;
+}
+
+
+static int
+file_writer(void * ctx, const void * buf, size_t n)
+{
+    FILE * fp = (FILE *)ctx;
+
+    return fwrite(buf, 1, n, fp) == n ? 0 : -EIO;
+}
+
+
+int
+metrics_export_file(metrics_registry * r, int fmt, FILE * fp)
+{
+    return metrics_export(r, fmt, file_writer, fp);
+}
+
+/* EOF */
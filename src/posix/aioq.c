@@ -0,0 +1,826 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * aioq.c - Asynchronous file I/O queue: io_uring on Linux, a
+ *          thread pool elsewhere.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  A queue is meant to be driven by one thread (prep, submit and
+ *    reap); the thread pool is internal.
+ * o  io_uring is driven with the raw syscalls; no liburing needed.
+ *    The number of requests in flight is capped at the SQ size so
+ *    the CQ (twice as large) can never overflow.
+ * o  Completion notification is an eventfd (a pipe outside Linux);
+ *    io_uring posts to it directly via IORING_REGISTER_EVENTFD.
+ * o  Built with AIOQ_TEST (only t_aioq is), __aioq_fail_submit()
+ *    makes the next aioq_submit() of a queue fail. It is not part
+ *    of the library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "posix/aioq.h"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING  1
+#endif
+#endif /* __NR_io_uring_setup */
+#endif /* __linux__ */
+
+/* O_DIRECT alignment that works for every device we care about */
+#define DIRECT_ALIGN    4096
+
+#define BACKEND_URING   1
+#define BACKEND_THREADS 2
+
+
+struct aioq
+{
+    int         backend;
+    unsigned    depth;
+    unsigned    inflight;   // prepped + submitted, not reaped
+    unsigned    nprep;      // prepped, not submitted
+
+    int         evfd[2];    // [0] read end, [1] write end
+
+    int *       files;
+    unsigned    nfiles;
+
+#ifdef AIOQ_TEST
+    int         fail;       // next aioq_submit() returns this
+#endif /* AIOQ_TEST */
+
+#ifdef HAVE_URING
+    int         ringfd;
+
+    unsigned *  sq_head;
+    unsigned *  sq_tail;
+    unsigned *  sq_mask;
+    unsigned *  sq_array;
+    unsigned    sq_entries;
+    unsigned    sq_local;   // our tail; published on submit
+    struct io_uring_sqe * sqes;
+
+    unsigned *  cq_head;
+    unsigned *  cq_tail;
+    unsigned *  cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void *      sqmap;
+    size_t      sqmaplen;
+    void *      cqmap;
+    size_t      cqmaplen;
+    size_t      sqeslen;
+#endif /* HAVE_URING */
+
+    /* Thread pool backend */
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cv;
+    pthread_cond_t  done_cv;
+
+    aioq_req *  prep_head, * prep_tail;    // caller thread only
+    aioq_req *  work_head, * work_tail;
+    aioq_req *  done_head, * done_tail;
+    unsigned    ndone;
+
+    pthread_t * threads;
+    int         nthreads;
+    int         quit;
+};
+
+
+/*
+ * Completion notification
+ */
+
+static int
+notify_init(aioq * q)
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+    if (fd < 0) return -errno;
+    q->evfd[0] = q->evfd[1] = fd;
+#else
+    if (pipe(q->evfd) < 0) return -errno;
+
+    fcntl(q->evfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(q->evfd[1], F_SETFL, O_NONBLOCK);
+#endif /* __linux__ */
+    return 0;
+}
+
+
+static void
+notify(aioq * q)
+{
+#ifdef __linux__
+    uint64_t v = 1;
+    ssize_t  r = write(q->evfd[1], &v, sizeof v);
+#else
+    char     c = 1;
+    ssize_t  r = write(q->evfd[1], &c, 1);
+#endif /* __linux__ */
+
+    // A full pipe or eventfd already means "readable"
+    USEARG(r);
+}
+
+
+static void
+notify_drain(aioq * q)
+{
+    uint64_t v[8];
+
+    while (read(q->evfd[0], v, sizeof v) > 0)
+        ;
+}
+
+
+static void
+notify_fini(aioq * q)
+{
+    if (q->evfd[0] >= 0) close(q->evfd[0]);
+    if (q->evfd[1] >= 0 && q->evfd[1] != q->evfd[0]) close(q->evfd[1]);
+}
+
+
+static inline int
+req_fd(aioq * q, aioq_req * r)
+{
+    if (!(r->flags & AIOQ_FIXED_FILE)) return r->fd;
+    return (r->fd >= 0 && (unsigned)r->fd < q->nfiles) ? q->files[r->fd] : -1;
+}
+
+
+/*
+ * io_uring backend
+ */
+
+#ifdef HAVE_URING
+
+static inline int
+__setup(unsigned entries, struct io_uring_params * p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, 0, 0);
+}
+
+static inline int
+__register(int fd, unsigned op, const void * arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+static void
+uring_fini(aioq * q)
+{
+    if (q->sqes)  munmap(q->sqes, q->sqeslen);
+    if (q->cqmap && q->cqmap != q->sqmap) munmap(q->cqmap, q->cqmaplen);
+    if (q->sqmap) munmap(q->sqmap, q->sqmaplen);
+    if (q->ringfd >= 0) close(q->ringfd);
+
+    q->ringfd = -1;
+}
+
+
+static int
+uring_init(aioq * q)
+{
+    struct io_uring_params p;
+    uint8_t * sq, * cq;
+    int r;
+
+    memset(&p, 0, sizeof p);
+    if ((q->ringfd = __setup(q->depth, &p)) < 0) return -errno;
+
+    q->sqmaplen = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+    q->cqmaplen = p.cq_off.cqes  + (p.cq_entries * sizeof(struct io_uring_cqe));
+    q->sqeslen  = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (q->cqmaplen > q->sqmaplen) q->sqmaplen = q->cqmaplen;
+        q->cqmaplen = q->sqmaplen;
+    }
+
+    sq = mmap(0, q->sqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              q->ringfd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    q->sqmap = sq;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(0, q->cqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  q->ringfd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    q->cqmap = cq;
+
+    q->sqes = mmap(0, q->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   q->ringfd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED) {
+        q->sqes = 0;
+        goto fail;
+    }
+
+    q->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    q->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    q->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    q->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    q->sq_entries = p.sq_entries;
+    q->sq_local   = *q->sq_tail;
+
+    q->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    q->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    q->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    q->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (q->depth > q->sq_entries) q->depth = q->sq_entries;
+
+    // Best effort; without it aioq_fd() just never fires
+    __register(q->ringfd, IORING_REGISTER_EVENTFD, &q->evfd[0], 1);
+
+    q->backend = BACKEND_URING;
+    return 0;
+
+fail:
+    r = -errno;
+    uring_fini(q);
+    return r;
+}
+
+
+static int
+uring_prep(aioq * q, aioq_req * r)
+{
+    unsigned head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+    unsigned idx;
+    struct io_uring_sqe * sqe;
+
+    if ((q->sq_local - head) >= q->sq_entries) return -EAGAIN;
+
+    idx = q->sq_local & *q->sq_mask;
+    sqe = &q->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+
+    sqe->fd        = r->fd;
+    sqe->off       = r->off;
+    sqe->user_data = (uint64_t)(uintptr_t)r;
+
+    if (r->flags & AIOQ_FIXED_FILE) sqe->flags |= IOSQE_FIXED_FILE;
+
+    switch (r->op) {
+    case AIOQ_READ:
+    case AIOQ_WRITE:
+        if (r->flags & AIOQ_FIXED_BUF) {
+            sqe->opcode    = r->op == AIOQ_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr      = (uint64_t)(uintptr_t)r->buf;
+            sqe->len       = r->len;
+            sqe->buf_index = r->buf_index;
+        } else {
+            r->iov.iov_base = r->buf;
+            r->iov.iov_len  = r->len;
+
+            sqe->opcode = r->op == AIOQ_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr   = (uint64_t)(uintptr_t)&r->iov;
+            sqe->len    = 1;
+        }
+        break;
+
+    case AIOQ_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    q->sq_array[idx] = idx;
+    q->sq_local++;
+    return 0;
+}
+
+
+static int
+uring_submit(aioq * q)
+{
+    int n;
+
+    __atomic_store_n(q->sq_tail, q->sq_local, __ATOMIC_RELEASE);
+
+    do {
+        n = __enter(q->ringfd, q->nprep, 0, 0);
+    } while (n < 0 && errno == EINTR);
+
+    return n < 0 ? -errno : n;
+}
+
+
+static int
+uring_reap(aioq * q, unsigned min)
+{
+    unsigned n = 0;
+
+    while (1) {
+        unsigned head = *q->cq_head;
+        unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe * cqe = &q->cqes[head & *q->cq_mask];
+            aioq_req * r = (aioq_req *)(uintptr_t)cqe->user_data;
+
+            r->res = cqe->res;
+            head++;
+
+            // Release the CQ slot before the callback so it can
+            // queue more I/O.
+            __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+            q->inflight--;
+            n++;
+
+            (*r->cb)(r->ctx, r);
+
+            tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        if (n >= min) break;
+
+        if (__enter(q->ringfd, 0, min - n, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            return -errno;
+    }
+    return n;
+}
+
+#endif /* HAVE_URING */
+
+
+/*
+ * Thread pool backend
+ */
+
+static void
+do_io(aioq * q, aioq_req * r)
+{
+    int fd = req_fd(q, r);
+    ssize_t n;
+
+    if (fd < 0) {
+        r->res = -EBADF;
+        return;
+    }
+
+    switch (r->op) {
+    case AIOQ_READ:
+        n = pread(fd, r->buf, r->len, (off_t)r->off);
+        break;
+
+    case AIOQ_WRITE:
+        n = pwrite(fd, r->buf, r->len, (off_t)r->off);
+        break;
+
+    case AIOQ_FSYNC:
+        n = fsync(fd);
+        break;
+
+    default:
+        n = -1;
+        errno = EINVAL;
+        break;
+    }
+
+    r->res = n < 0 ? -errno : n;
+}
+
+
+static void *
+worker(void * p)
+{
+    aioq * q = (aioq *)p;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        aioq_req * r;
+
+        while (!q->work_head && !q->quit)
+            pthread_cond_wait(&q->work_cv, &q->lock);
+
+        if (!(r = q->work_head)) break;
+
+        if (!(q->work_head = r->next)) q->work_tail = 0;
+        pthread_mutex_unlock(&q->lock);
+
+        do_io(q, r);
+
+        pthread_mutex_lock(&q->lock);
+        r->next = 0;
+        if (q->done_tail) q->done_tail->next = r;
+        else              q->done_head = r;
+        q->done_tail = r;
+        q->ndone++;
+
+        pthread_cond_signal(&q->done_cv);
+        notify(q);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+
+static int
+threads_init(aioq * q, int nthreads)
+{
+    int i, r;
+
+    if (nthreads <= 0) nthreads = 2 * sys_cpu_getavail();
+
+    if (!(q->threads = NEWZA(pthread_t, nthreads))) return -ENOMEM;
+
+    for (i = 0; i < nthreads; i++) {
+        if ((r = pthread_create(&q->threads[i], 0, worker, q)) != 0) break;
+        q->nthreads++;
+    }
+
+    q->backend = BACKEND_THREADS;
+    return q->nthreads > 0 ? 0 : -r;
+}
+
+
+static void
+threads_fini(aioq * q)
+{
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    q->quit = 1;
+    pthread_cond_broadcast(&q->work_cv);
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 0; i < q->nthreads; i++)
+        pthread_join(q->threads[i], 0);
+
+    DEL(q->threads);
+}
+
+
+static int
+threads_prep(aioq * q, aioq_req * r)
+{
+    if (r->op != AIOQ_READ && r->op != AIOQ_WRITE && r->op != AIOQ_FSYNC)
+        return -EINVAL;
+
+    r->next = 0;
+    if (q->prep_tail) q->prep_tail->next = r;
+    else              q->prep_head = r;
+    q->prep_tail = r;
+    return 0;
+}
+
+
+static int
+threads_submit(aioq * q)
+{
+    int n = q->nprep;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->work_tail) q->work_tail->next = q->prep_head;
+    else              q->work_head = q->prep_head;
+    q->work_tail = q->prep_tail;
+
+    pthread_cond_broadcast(&q->work_cv);
+    pthread_mutex_unlock(&q->lock);
+
+    q->prep_head = q->prep_tail = 0;
+    return n;
+}
+
+
+static int
+threads_reap(aioq * q, unsigned min)
+{
+    aioq_req * r, * next;
+    int n = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->ndone < min)
+        pthread_cond_wait(&q->done_cv, &q->lock);
+
+    r = q->done_head;
+    q->done_head = q->done_tail = 0;
+    q->ndone = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    for (; r; r = next) {
+        next = r->next;
+        q->inflight--;
+        n++;
+
+        (*r->cb)(r->ctx, r);
+    }
+    return n;
+}
+
+
+/*
+ * Fail the requests that were prepped but never submitted with
+ * -ECANCELED.
+ */
+static void
+cancel_prepped(aioq * q)
+{
+    aioq_req * r, * next;
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) {
+        unsigned head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+
+        // The kernel only takes SQEs in io_uring_enter(); take back
+        // the ones it didn't.
+        __atomic_store_n(q->sq_tail, head, __ATOMIC_RELEASE);
+        while (head != q->sq_local) {
+            struct io_uring_sqe * sqe = &q->sqes[q->sq_array[head & *q->sq_mask]];
+
+            r = (aioq_req *)(uintptr_t)sqe->user_data;
+            head++;
+
+            r->res = -ECANCELED;
+            q->inflight--;
+            q->nprep--;
+            (*r->cb)(r->ctx, r);
+        }
+        q->sq_local = head;
+        return;
+    }
+#endif /* HAVE_URING */
+
+    for (r = q->prep_head; r; r = next) {
+        next = r->next;
+
+        r->res = -ECANCELED;
+        q->inflight--;
+        q->nprep--;
+        (*r->cb)(r->ctx, r);
+    }
+    q->prep_head = q->prep_tail = 0;
+}
+
+
+/*
+ * Public interface
+ */
+
+int
+aioq_init(aioq ** pq, unsigned depth, unsigned flags, int nthreads)
+{
+    aioq * q = NEWZ(aioq);
+    int r;
+
+    if (!q) return -ENOMEM;
+
+    q->depth   = depth ? depth : 64;
+    q->evfd[0] = q->evfd[1] = -1;
+
+#ifdef HAVE_URING
+    q->ringfd = -1;
+#endif /* HAVE_URING */
+
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->work_cv, 0);
+    pthread_cond_init(&q->done_cv, 0);
+
+    if ((r = notify_init(q)) < 0) goto fail;
+
+#ifdef HAVE_URING
+    if (!(flags & AIOQ_THREADS) && uring_init(q) == 0) {
+        *pq = q;
+        return 0;
+    }
+#else
+    USEARG(flags);
+#endif /* HAVE_URING */
+
+    if ((r = threads_init(q, nthreads)) < 0) goto fail;
+
+    *pq = q;
+    return 0;
+
+fail:
+    aioq_destroy(q);
+    return r;
+}
+
+
+void
+aioq_destroy(aioq * q)
+{
+    if (q->backend) {
+        if (q->nprep) aioq_submit(q);
+
+        // Wait only for what went in; a failed (or short) submit
+        // leaves the rest prepped.
+        while (q->inflight > q->nprep) {
+            if (aioq_reap(q, q->inflight - q->nprep) < 0) break;
+        }
+        cancel_prepped(q);
+    }
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) uring_fini(q);
+#endif /* HAVE_URING */
+
+    if (q->backend == BACKEND_THREADS) threads_fini(q);
+
+    notify_fini(q);
+    pthread_cond_destroy(&q->done_cv);
+    pthread_cond_destroy(&q->work_cv);
+    pthread_mutex_destroy(&q->lock);
+
+    DEL(q->files);
+    DEL(q);
+}
+
+
+const char *
+aioq_backend(aioq * q)
+{
+    return q->backend == BACKEND_URING ? "io_uring" : "threads";
+}
+
+
+int
+aioq_register_files(aioq * q, const int * fds, unsigned n)
+{
+    if (q->files) return -EBUSY;
+    if (!(q->files = NEWA(int, n))) return -ENOMEM;
+
+    memcpy(q->files, fds, n * sizeof(int));
+    q->nfiles = n;
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) {
+        if (__register(q->ringfd, IORING_REGISTER_FILES, fds, n) < 0) {
+            int r = -errno;
+
+            DEL(q->files);
+            q->nfiles = 0;
+            return r;
+        }
+    }
+#endif /* HAVE_URING */
+    return 0;
+}
+
+
+int
+aioq_register_buffers(aioq * q, const struct iovec * iov, unsigned n)
+{
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) {
+        if (__register(q->ringfd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+            return -errno;
+    }
+#else
+    USEARG(iov);
+#endif /* HAVE_URING */
+
+    // The thread pool does plain pread/pwrite on the same memory
+    USEARG(q);
+    USEARG(n);
+    return 0;
+}
+
+
+int
+aioq_prep(aioq * q, aioq_req * r)
+{
+    int e;
+
+    if (q->inflight >= q->depth) return -EAGAIN;
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) e = uring_prep(q, r);
+    else
+#endif /* HAVE_URING */
+    e = threads_prep(q, r);
+
+    if (e == 0) {
+        q->inflight++;
+        q->nprep++;
+    }
+    return e;
+}
+
+
+int
+aioq_submit(aioq * q)
+{
+    int n;
+
+    if (q->nprep == 0) return 0;
+
+#ifdef AIOQ_TEST
+    if (unlikely(q->fail)) {
+        n = q->fail;
+        q->fail = 0;
+        return n;
+    }
+#endif /* AIOQ_TEST */
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) n = uring_submit(q);
+    else
+#endif /* HAVE_URING */
+    n = threads_submit(q);
+
+    if (n > 0) q->nprep -= n;
+    return n;
+}
+
+
+int
+aioq_reap(aioq * q, unsigned min)
+{
+    unsigned busy = q->inflight - q->nprep;
+
+    // Never wait for more than what's been submitted
+    if (min > busy) min = busy;
+
+    notify_drain(q);
+
+#ifdef HAVE_URING
+    if (q->backend == BACKEND_URING) return uring_reap(q, min);
+#endif /* HAVE_URING */
+
+    return threads_reap(q, min);
+}
+
+
+unsigned
+aioq_pending(aioq * q)
+{
+    return q->inflight;
+}
+
+
+int
+aioq_fd(aioq * q)
+{
+    return q->evfd[0];
+}
+
+
+void *
+aioq_buf_alloc(size_t n)
+{
+    void * p = 0;
+
+    if (posix_memalign(&p, DIRECT_ALIGN, _ALIGN_UP(n, DIRECT_ALIGN)) != 0)
+        return 0;
+    return p;
+}
+
+
+#ifdef AIOQ_TEST
+/*
+ * Make the next aioq_submit() of 'q' fail with 'err' (-errno)
+ * without submitting anything.
+ */
+void
+__aioq_fail_submit(aioq * q, int err)
+{
+    q->fail = err;
+}
+#endif /* AIOQ_TEST */
+
+/* EOF */
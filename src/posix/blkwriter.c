@@ -0,0 +1,622 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * blkwriter.c - Parallel bulk block writer.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  The range is split into one contiguous, aligned slice per
+ *    thread so that each thread's writes are sequential.
+ * o  With io_uring each thread has its own ring with its fd and
+ *    buffers registered; a buffer goes back to the thread's free
+ *    list when its write completes. Without io_uring 'depth' blocks
+ *    are filled and written with one pwritev(2).
+ * o  Progress counters have a single writer (the owning thread) and
+ *    are read with atomic loads by blkwriter_get_stats().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "posix/aioq.h"
+#include "posix/blkwriter.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX         1024
+#endif
+
+#define _load(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define _store(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+struct blkwriter;
+
+/*
+ * Per thread state
+ */
+struct bw_thread
+{
+    struct blkwriter * w;
+    pthread_t   id;
+    int         idx;
+
+    uint64_t    start;      /* slice of the range */
+    uint64_t    end;
+
+    uint64_t    done;       /* progress; written only by this thread */
+    uint64_t    writes;
+    uint64_t    fsyncs;
+
+    uint64_t    unsynced;   /* bytes since the last fdatasync */
+    int         err;
+
+    uint8_t *   bufs;       /* depth * blksize */
+
+    /* io_uring backend */
+    aioq *      q;
+    aioq_req *  reqs;
+    int *       freel;      /* stack of free buffer slots */
+    int         nfree;
+};
+typedef struct bw_thread bw_thread;
+
+
+struct blkwriter
+{
+    int         fd;
+    int         direct;
+    int         uring;
+    int         nthreads;
+    unsigned    depth;
+    size_t      blksize;
+    int         fsync;
+    uint64_t    sync_bytes;
+
+    uint64_t    off;
+    uint64_t    size;
+    uint64_t    tail;       /* unaligned bytes at the end */
+
+    blkwriter_fill fill;
+    void *      ctx;
+
+    int         err;        /* first error; set atomically */
+    int         running;
+    int         waited;
+    uint64_t    t0;
+
+    bw_thread * thr;
+};
+
+
+static void
+set_err(blkwriter * w, int err)
+{
+    int z = 0;
+
+    __atomic_compare_exchange_n(&w->err, &z, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+static int
+maybe_sync(bw_thread * t, int force)
+{
+    blkwriter * w = t->w;
+
+    if (w->fsync != BLKW_FSYNC_EVERY || t->unsynced == 0) return 0;
+    if (!force && t->unsynced < w->sync_bytes)            return 0;
+
+    if (fdatasync(w->fd) < 0) return -errno;
+
+    t->unsynced = 0;
+    _store(t->fsyncs, t->fsyncs + 1);
+    return 0;
+}
+
+
+/*
+ * pwritev(2) backend
+ */
+
+/* pwritev(2) that resumes after short writes and EINTR */
+static int
+fullwritev(int fd, struct iovec * iov, int n, uint64_t off)
+{
+    while (n > 0) {
+        ssize_t m = pwritev(fd, iov, n, off);
+
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (m == 0) return -EIO;
+
+        off += m;
+        while (n > 0 && (size_t)m >= iov->iov_len) {
+            m -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base  = (uint8_t *)iov->iov_base + m;
+            iov->iov_len  -= m;
+        }
+    }
+    return 0;
+}
+
+
+static int
+pwritev_loop(bw_thread * t)
+{
+    blkwriter * w = t->w;
+    int maxv      = w->depth > IOV_MAX ? IOV_MAX : (int)w->depth;
+    struct iovec iov[maxv];
+    uint64_t off  = t->start;
+    int r;
+
+    while (off < t->end && !_load(w->err)) {
+        uint64_t o = off;
+        size_t tot = 0;
+        int n;
+
+        for (n = 0; n < maxv && o < t->end; n++) {
+            uint64_t rem = t->end - o;
+            size_t   sz  = rem > w->blksize ? w->blksize : rem;
+            uint8_t *b   = t->bufs + (n * w->blksize);
+
+            if ((r = (*w->fill)(w->ctx, t->idx, b, sz, o)) < 0) return r;
+
+            iov[n].iov_base = b;
+            iov[n].iov_len  = sz;
+            o   += sz;
+            tot += sz;
+        }
+
+        if ((r = fullwritev(w->fd, iov, n, off)) < 0) return r;
+
+        off          += tot;
+        t->unsynced  += tot;
+        _store(t->writes, t->writes + 1);
+        _store(t->done, t->done + tot);
+
+        if ((r = maybe_sync(t, 0)) < 0) return r;
+    }
+    return maybe_sync(t, 1);
+}
+
+
+/*
+ * io_uring backend
+ */
+
+static void
+uring_done(void * ctx, aioq_req * r)
+{
+    bw_thread * t = (bw_thread *)ctx;
+
+    if (r->res < 0)
+        t->err = (int)r->res;
+    else if ((size_t)r->res != r->len)
+        t->err = -EIO;
+    else {
+        t->unsynced += r->len;
+        _store(t->done, t->done + r->len);
+    }
+
+    t->freel[t->nfree++] = r->buf_index;
+}
+
+
+static int
+uring_setup(bw_thread * t)
+{
+    blkwriter * w = t->w;
+    struct iovec iov[w->depth];
+    unsigned i;
+    int r;
+
+    if ((r = aioq_init(&t->q, w->depth, 0, 1)) < 0) return r;
+
+    t->reqs  = NEWZA(aioq_req, w->depth);
+    t->freel = NEWA(int, w->depth);
+    if (!t->reqs || !t->freel) return -ENOMEM;
+
+    for (i = 0; i < w->depth; i++) {
+        iov[i].iov_base = t->bufs + (i * w->blksize);
+        iov[i].iov_len  = w->blksize;
+        t->freel[i]     = w->depth - 1 - i;
+    }
+    t->nfree = w->depth;
+
+    if ((r = aioq_register_files(t->q, &w->fd, 1)) < 0)         return r;
+    if ((r = aioq_register_buffers(t->q, iov, w->depth)) < 0)   return r;
+    return 0;
+}
+
+
+static int
+uring_loop(bw_thread * t)
+{
+    blkwriter * w = t->w;
+    uint64_t off  = t->start;
+    int r;
+
+    if ((r = uring_setup(t)) < 0) return r;
+
+    while (off < t->end || aioq_pending(t->q) > 0) {
+        int stop = t->err || _load(w->err);
+
+        /* Keep the queue full */
+        while (!stop && t->nfree > 0 && off < t->end) {
+            int slot     = t->freel[--t->nfree];
+            aioq_req * q = &t->reqs[slot];
+            uint64_t rem = t->end - off;
+            size_t   sz  = rem > w->blksize ? w->blksize : rem;
+            uint8_t *b   = t->bufs + (slot * w->blksize);
+
+            if ((r = (*w->fill)(w->ctx, t->idx, b, sz, off)) < 0) {
+                t->freel[t->nfree++] = slot;
+                t->err = r;
+                break;
+            }
+
+            q->op        = AIOQ_WRITE;
+            q->fd        = 0;
+            q->flags     = AIOQ_FIXED_FILE | AIOQ_FIXED_BUF;
+            q->buf_index = slot;
+            q->buf       = b;
+            q->len       = sz;
+            q->off       = off;
+            q->cb        = uring_done;
+            q->ctx       = t;
+            if ((r = aioq_prep(t->q, q)) < 0) {
+                t->freel[t->nfree++] = slot;
+                t->err = r;
+                break;
+            }
+            off += sz;
+            _store(t->writes, t->writes + 1);
+        }
+
+        if ((r = aioq_submit(t->q)) < 0) {
+            t->err = r;
+            break;
+        }
+
+        if (aioq_pending(t->q) == 0) {
+            if (t->err || _load(w->err)) break;
+            continue;
+        }
+
+        if ((r = aioq_reap(t->q, 1)) < 0) t->err = r;
+
+        /* Periodic syncs cover only completed writes */
+        if (w->fsync == BLKW_FSYNC_EVERY && t->unsynced >= w->sync_bytes) {
+            while (aioq_pending(t->q) > 0) aioq_reap(t->q, aioq_pending(t->q));
+            if (!t->err && (r = maybe_sync(t, 0)) < 0) t->err = r;
+        }
+    }
+
+    if (t->err) return t->err;
+    return maybe_sync(t, 1);
+}
+
+
+static void *
+writer(void * p)
+{
+    bw_thread * t = (bw_thread *)p;
+    blkwriter * w = t->w;
+    int r;
+
+    r = w->uring ? uring_loop(t) : pwritev_loop(t);
+    if (r < 0) set_err(w, r);
+
+    __atomic_sub_fetch(&w->running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+static void
+thread_fini(bw_thread * t)
+{
+    if (t->q)   aioq_destroy(t->q);
+    if (t->reqs)  DEL(t->reqs);
+    if (t->freel) DEL(t->freel);
+    free(t->bufs);
+}
+
+
+/*
+ * Is io_uring usable here? aioq silently falls back to threads;
+ * for us pwritev is the better fallback.
+ */
+static int
+have_uring(void)
+{
+    aioq * q = 0;
+    int r;
+
+    if (aioq_init(&q, 1, 0, 1) < 0) return 0;
+
+    r = 0 == strcmp(aioq_backend(q), "io_uring");
+    aioq_destroy(q);
+    return r;
+}
+
+
+int
+blkwriter_start(blkwriter ** pw, int fd, uint64_t off, uint64_t size,
+                const blkwriter_opt * opt, blkwriter_fill fill, void * ctx)
+{
+    blkwriter_opt o;
+    blkwriter * w;
+    uint64_t body, slice, st;
+    int fl, i, r;
+
+    if (opt) o = *opt;
+    else     memset(&o, 0, sizeof o);
+
+    if (o.nthreads <= 0) o.nthreads = sys_cpu_getavail();
+    if (o.depth == 0)    o.depth    = 4;
+    if (o.blksize == 0)  o.blksize  = 1048576;
+
+    if (!fill || !_IS_ALIGNED(o.blksize, BLKW_ALIGN))       return -EINVAL;
+    if (o.fsync == BLKW_FSYNC_EVERY && o.sync_bytes == 0)   return -EINVAL;
+    if ((fl = fcntl(fd, F_GETFL)) < 0)                      return -errno;
+
+    w = NEWZ(blkwriter);
+    if (!w) return -ENOMEM;
+
+    w->fd         = fd;
+#ifdef O_DIRECT
+    w->direct     = !!(fl & O_DIRECT);
+#endif
+    w->depth      = o.depth;
+    w->blksize    = o.blksize;
+    w->fsync      = o.fsync;
+    w->sync_bytes = o.sync_bytes;
+    w->off        = off;
+    w->size       = size;
+    w->fill       = fill;
+    w->ctx        = ctx;
+    w->uring      = !(o.flags & BLKW_PWRITEV) && have_uring();
+
+    if (w->direct && !_IS_ALIGNED(off, BLKW_ALIGN)) {
+        DEL(w);
+        return -EINVAL;
+    }
+
+    /*
+     * Aligned body split into aligned slices; the last thread picks
+     * up the slack. Tiny ranges use fewer threads.
+     */
+    body     = _ALIGN_DOWN(size, BLKW_ALIGN);
+    w->tail  = size - body;
+    slice    = _ALIGN_DOWN(body / o.nthreads, BLKW_ALIGN);
+    if (slice == 0) {
+        o.nthreads = 1;
+        slice      = body;
+    }
+
+    w->nthreads = o.nthreads;
+    w->thr      = NEWZA(bw_thread, w->nthreads);
+    if (!w->thr) {
+        DEL(w);
+        return -ENOMEM;
+    }
+
+    st = off;
+    for (i = 0; i < w->nthreads; i++) {
+        bw_thread * t = &w->thr[i];
+
+        t->w     = w;
+        t->idx   = i;
+        t->start = st;
+        t->end   = (i == w->nthreads - 1) ? off + body : st + slice;
+        t->bufs  = aioq_buf_alloc(w->depth * w->blksize);
+        st       = t->end;
+
+        if (!t->bufs) {
+            r = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    w->t0 = timenow();
+    __atomic_store_n(&w->running, w->nthreads, __ATOMIC_RELEASE);
+    for (i = 0; i < w->nthreads; i++) {
+        bw_thread * t = &w->thr[i];
+
+        if ((r = pthread_create(&t->id, 0, writer, t)) != 0) {
+            int j;
+
+            /* Stop and reap the ones already started */
+            for (j = i; j < w->nthreads; j++) free(w->thr[j].bufs);
+            set_err(w, -r);
+            __atomic_sub_fetch(&w->running, w->nthreads - i, __ATOMIC_RELEASE);
+            w->nthreads = i;
+            blkwriter_wait(w);
+            blkwriter_destroy(w);
+            return -r;
+        }
+
+        if (i < sys_cpu_getavail()) sys_cpu_set_thread_affinity(t->id, i);
+    }
+
+    *pw = w;
+    return 0;
+
+fail:
+    for (i = 0; i < w->nthreads; i++) free(w->thr[i].bufs);
+    DEL(w->thr);
+    DEL(w);
+    return r;
+}
+
+
+/*
+ * fd to write the tail with: for O_DIRECT, the file opened again
+ * without it. Clearing O_DIRECT on 'w->fd' would change it for
+ * everyone sharing that file description.
+ */
+static int
+tail_fd(blkwriter * w)
+{
+#ifdef O_DIRECT
+    char fn[64];
+    int fd;
+
+    if (!w->direct) return w->fd;
+
+    snprintf(fn, sizeof fn, "/proc/self/fd/%d", w->fd);
+    fd = open(fn, O_WRONLY|O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+#else
+    return w->fd;
+#endif
+}
+
+
+/*
+ * Write the unaligned tail through the page cache.
+ */
+static int
+write_tail(blkwriter * w)
+{
+    uint64_t off = w->off + w->size - w->tail;
+    uint8_t * b  = aioq_buf_alloc(BLKW_ALIGN);
+    struct iovec iov;
+    int fd, r;
+
+    if (!b) return -ENOMEM;
+
+    if ((r = (*w->fill)(w->ctx, w->nthreads - 1, b, w->tail, off)) < 0) goto done;
+    if ((r = fd = tail_fd(w)) < 0) goto done;
+
+    iov.iov_base = b;
+    iov.iov_len  = w->tail;
+    r = fullwritev(fd, &iov, 1, off);
+    if (fd != w->fd) close(fd);
+
+    if (r == 0) {
+        bw_thread * t = &w->thr[w->nthreads - 1];
+
+        _store(t->done, t->done + w->tail);
+        _store(t->writes, t->writes + 1);
+    }
+
+done:
+    free(b);
+    return r;
+}
+
+
+int
+blkwriter_wait(blkwriter * w)
+{
+    int i, r;
+
+    if (w->waited) return w->err;
+
+    for (i = 0; i < w->nthreads; i++) {
+        void * x;
+
+        pthread_join(w->thr[i].id, &x);
+    }
+    w->waited = 1;
+
+    if (w->err) return w->err;
+
+    if (w->tail > 0 && (r = write_tail(w)) < 0) {
+        w->err = r;
+        return r;
+    }
+
+    if (w->fsync == BLKW_FSYNC_END || (w->fsync == BLKW_FSYNC_EVERY && w->tail > 0)) {
+        if (fsync(w->fd) < 0) {
+            /* Not an error for things that can't be synced */
+            if (errno != EINVAL && errno != EROFS) w->err = -errno;
+        } else {
+            bw_thread * t = &w->thr[w->nthreads - 1];
+
+            _store(t->fsyncs, t->fsyncs + 1);
+        }
+    }
+    return w->err;
+}
+
+
+void
+blkwriter_destroy(blkwriter * w)
+{
+    int i;
+
+    if (!w->waited) blkwriter_wait(w);
+
+    for (i = 0; i < w->nthreads; i++) thread_fini(&w->thr[i]);
+
+    DEL(w->thr);
+    DEL(w);
+}
+
+
+void
+blkwriter_get_stats(blkwriter * w, blkwriter_stats * st)
+{
+    int i;
+
+    memset(st, 0, sizeof *st);
+    st->total   = w->size;
+    st->usecs   = timenow() - w->t0;
+    st->running = __atomic_load_n(&w->running, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < w->nthreads; i++) {
+        bw_thread * t = &w->thr[i];
+
+        st->done   += _load(t->done);
+        st->writes += _load(t->writes);
+        st->fsyncs += _load(t->fsyncs);
+    }
+}
+
+
+void
+blkwriter_progress(blkwriter * w, int thread, uint64_t * done, uint64_t * total)
+{
+    bw_thread * t = &w->thr[thread];
+
+    *done  = _load(t->done);
+    *total = t->end - t->start;
+    if (thread == w->nthreads - 1) *total += w->tail;
+}
+
+
+int
+blkwriter_nthreads(blkwriter * w)
+{
+    return w->nthreads;
+}
+
+
+const char *
+blkwriter_backend(blkwriter * w)
+{
+    return w->uring ? "io_uring" : "pwritev";
+}
+
+/* EOF */
@@ -0,0 +1,351 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * clock.c - Calibrated TSC clock and a coarse clock.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o See commentary in utils/clock.h.
+ * o Each (tsc, ns) sample is the best of a few tries: the one with
+ *   the fewest TSC ticks around the clock_gettime() is the one
+ *   least disturbed by an interrupt; its TSC is taken halfway.
+ * o The scale is 'mult' and 'shift' with the largest shift that
+ *   keeps mult in 32 bits. At 3 GHz that is shift 32 and a mult
+ *   good to 1 in 2^30, ie ~1ns a second before any sync.
+ * o Only clk_init() and the ticker write the scale, both with
+ *   Lock held. The ticker only trylocks it: clk_coarse_stop()
+ *   holds Lock while it joins the ticker.
+ * o __clk.floor only rises, also with Lock held: to the last
+ *   clk_ns() when clk_init() drops the TSC and to the last tick
+ *   when the ticker stops. Readers of CLOCK_MONOTONIC (and
+ *   _COARSE) never return less. A recalibrated TSC is anchored no
+ *   lower than the last clk_ns() instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "utils/utils.h"
+#include "utils/clock.h"
+
+
+#define SAMPLE_TRIES    8
+#define CALIBRATE_NS    (20 * 1000000)
+#define SYNC_NS         1000000000      // ticker syncs this often
+#define MAX_SLEW        (500e-6)        // 500 ppm
+#define MAX_OFFSET      10000000        // step forward beyond 10ms
+
+
+struct __clk_scale __clk;
+uint64_t           __clk_coarse __attribute__((aligned(64)));
+
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Start of the calibration baseline: the TSC rate is measured
+// over the whole time since.
+static uint64_t Base_tsc;
+static uint64_t Base_ns;
+
+// Coarse clock ticker
+static pthread_t    Ticker;
+static unsigned int Ticker_refs;
+static unsigned int Ticker_res;
+static volatile int Ticker_stop;
+
+
+// Is the TSC invariant and the one the kernel trusts?
+static int
+tsc_ok(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007) return 0;
+
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    if (!(d & (1 << 8))) return 0;
+
+#ifdef __linux__
+    // The kernel moves off the TSC if it finds it unstable (or
+    // unsynchronized across sockets); so should we.
+    FILE* fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (fp) {
+        char buf[32];
+        int ok = fgets(buf, sizeof buf, fp) && 0 == strncmp(buf, "tsc", 3);
+
+        fclose(fp);
+        if (!ok) return 0;
+    }
+#endif
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+static void
+sample(uint64_t* p_tsc, uint64_t* p_ns)
+{
+    uint64_t best = ~0ULL;
+    int i;
+
+    // Callers reject a zero sample
+    *p_tsc = *p_ns = 0;
+    for (i = 0; i < SAMPLE_TRIES; i++) {
+        uint64_t t0 = sys_cpu_timestamp();
+        uint64_t ns = clk_mono_ns();
+        uint64_t t1 = sys_cpu_timestamp();
+
+        if (t1 > t0 && (t1 - t0) < best) {
+            best   = t1 - t0;
+            *p_tsc = t0 + (t1 - t0) / 2;
+            *p_ns  = ns;
+        }
+    }
+}
+
+
+// Scale for 'nspt' ns per tick; returns 0 if it is implausible.
+static int
+make_scale(double nspt, uint32_t* p_mult, uint32_t* p_shift)
+{
+    uint32_t shift = 32;
+
+    // 10 MHz .. 100 GHz
+    if (!(nspt > 0.01 && nspt < 100.0)) return 0;
+
+    while (shift > 0 && nspt * (double)(1ULL << shift) >= 4294967295.0) shift--;
+
+    *p_mult  = (uint32_t)(nspt * (double)(1ULL << shift) + 0.5);
+    *p_shift = shift;
+    return 1;
+}
+
+
+static void
+publish(int src, uint64_t tsc0, uint64_t ns0, uint32_t mult, uint32_t shift)
+{
+    __atomic_store_n(&__clk.seq, __clk.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&__clk.tsc0,  tsc0,  __ATOMIC_RELAXED);
+    __atomic_store_n(&__clk.ns0,   ns0,   __ATOMIC_RELAXED);
+    __atomic_store_n(&__clk.mult,  mult,  __ATOMIC_RELAXED);
+    __atomic_store_n(&__clk.shift, shift, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&__clk.seq, __clk.seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&__clk.src, src, __ATOMIC_RELEASE);
+}
+
+
+static void
+raise_floor(uint64_t v)
+{
+    if (v > __clk.floor) __atomic_store_n(&__clk.floor, v, __ATOMIC_RELAXED);
+}
+
+
+static int
+init_locked(unsigned int flags)
+{
+    uint64_t t0, n0, t1, n1, last;
+    uint32_t mult, shift;
+    struct timespec ts = { 0, CALIBRATE_NS };
+
+    if ((flags & CLK_NOTSC) || !tsc_ok()) goto mono;
+
+    sample(&t0, &n0);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    sample(&t1, &n1);
+
+    if (t1 <= t0 || n1 <= n0) goto mono;
+    if (!make_scale((double)(n1 - n0) / (double)(t1 - t0), &mult, &shift)) goto mono;
+
+    // Not behind what the old source handed out
+    last = __clk.src ? clk_ns() : 0;
+    if (last > n1) n1 = last;
+
+    Base_tsc = t0;
+    Base_ns  = n0;
+    publish(CLK_TSC, t1, n1, mult, shift);
+    return CLK_TSC;
+
+mono:
+    if (__clk.src) raise_floor(clk_ns());
+    __atomic_store_n(&__clk.src, CLK_MONOTONIC, __ATOMIC_RELEASE);
+    return CLK_MONOTONIC;
+}
+
+
+int
+clk_init(unsigned int flags)
+{
+    int r;
+
+    pthread_mutex_lock(&Lock);
+    r = init_locked(flags);
+    pthread_mutex_unlock(&Lock);
+    return r;
+}
+
+
+uint64_t
+__clk_init_ns(void)
+{
+    pthread_mutex_lock(&Lock);
+    if (__clk.src == 0) init_locked(0);
+    pthread_mutex_unlock(&Lock);
+
+    return clk_ns();
+}
+
+
+uint64_t
+__clk_coarse_slow(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    struct timespec ts;
+    uint64_t v, f;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    v = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    f = __atomic_load_n(&__clk.floor, __ATOMIC_RELAXED);
+    return v > f ? v : f;
+#else
+    return clk_ns();
+#endif
+}
+
+
+/*
+ * Re-anchor the scale at 'now' and steer it so that, over the next
+ * SYNC_NS, clk_ns() meets CLOCK_MONOTONIC; called with Lock held.
+ */
+static void
+sync_locked(void)
+{
+    uint64_t t, m, n;
+    uint32_t mult, shift;
+    double nspt, off;
+
+    if (__clk.src != CLK_TSC) return;
+
+    sample(&t, &m);
+    if (t <= Base_tsc || m <= Base_ns) return;
+
+    n    = __clk.ns0 + __clk_mulshift(t - __clk.tsc0, __clk.mult, __clk.shift);
+    nspt = (double)(m - Base_ns) / (double)(t - Base_tsc);
+    off  = (double)m - (double)n;
+
+    if (off > MAX_OFFSET) {
+        // eg. a suspend; catch up at once
+        n   = m;
+        off = 0;
+    }
+
+    off /= SYNC_NS;
+    if (off >  MAX_SLEW) off =  MAX_SLEW;
+    if (off < -MAX_SLEW) off = -MAX_SLEW;
+
+    if (make_scale(nspt * (1.0 + off), &mult, &shift))
+        publish(CLK_TSC, t, n, mult, shift);
+}
+
+
+static void*
+ticker(void* unused)
+{
+    uint64_t next_sync = clk_ns() + SYNC_NS;
+    struct timespec ts;
+
+    USEARG(unused);
+
+    ts.tv_sec  = Ticker_res / 1000000;
+    ts.tv_nsec = (Ticker_res % 1000000) * 1000;
+
+    while (!Ticker_stop) {
+        uint64_t now = clk_ns();
+
+        // clk_coarse_stop() joins with Lock held
+        if (now >= next_sync && pthread_mutex_trylock(&Lock) == 0) {
+            sync_locked();
+            pthread_mutex_unlock(&Lock);
+
+            now       = clk_ns();
+            next_sync = now + SYNC_NS;
+        }
+
+        // Never behind a value already handed out
+        if (now > __clk_coarse) __atomic_store_n(&__clk_coarse, now, __ATOMIC_RELAXED);
+        nanosleep(&ts, 0);
+    }
+    return 0;
+}
+
+
+int
+clk_coarse_start(unsigned int res)
+{
+    int r = 0;
+
+    clk_ns();
+
+    pthread_mutex_lock(&Lock);
+    if (Ticker_refs == 0) {
+        uint64_t now  = clk_ns(),
+                 slow = __clk_coarse_slow();
+
+        Ticker_res  = res ? res : 1000;
+        Ticker_stop = 0;
+        __atomic_store_n(&__clk_coarse, now > slow ? now : slow, __ATOMIC_RELAXED);
+
+        r = pthread_create(&Ticker, 0, ticker, 0);
+        if (r != 0) {
+            __atomic_store_n(&__clk_coarse, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&Lock);
+            return -r;
+        }
+    }
+    Ticker_refs++;
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+
+void
+clk_coarse_stop(void)
+{
+    pthread_mutex_lock(&Lock);
+    if (Ticker_refs == 0 || --Ticker_refs > 0) {
+        pthread_mutex_unlock(&Lock);
+        return;
+    }
+
+    Ticker_stop = 1;
+    pthread_join(Ticker, 0);
+
+    // CLOCK_MONOTONIC_COARSE may lag the last tick
+    raise_floor(__clk_coarse);
+    __atomic_store_n(&__clk_coarse, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&Lock);
+}
+
+/* EOF */
@@ -0,0 +1,416 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fcopy.c - Copy files and file ranges in the kernel.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Every method copies at most one chunk per call at offsets
+ *    tracked here; when a method turns out to be unsupported (for
+ *    this kernel, file system or pair of files) the next one picks
+ *    up at the same place - even in the middle of a copy.
+ * o  sendfile(2) writes at the destination's file offset; it is
+ *    saved and restored around the copy.
+ * o  Only the bytes that reached the destination are counted; data
+ *    stranded in the splice pipe by a failure is re-read by the
+ *    next method.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "utils/utils.h"
+#include "posix/fcopy.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif /* __linux__ */
+
+#define FCOPY_CHUNK     (16 * 1048576)
+#define FCOPY_BUFSIZE   (1048576)
+#define PIPE_SIZE       (1048576)
+
+
+/*
+ * State of one copy
+ */
+struct xfer
+{
+    int         sfd;
+    int         dfd;
+    int         dstream;    /* dfd is a pipe or socket */
+    uint64_t    soff;
+    uint64_t    doff;
+    uint64_t    rem;        /* FCOPY_EOF => until EOF */
+
+    int         pfd[2];     /* splice pipe */
+    uint8_t *   buf;        /* read/write buffer */
+};
+typedef struct xfer xfer;
+
+typedef ssize_t (*copier)(xfer * x, size_t n);
+
+
+/*
+ * Errors that mean "try another method"
+ */
+static int
+unsupported(int err)
+{
+    switch (err) {
+        case ENOSYS:
+        case EXDEV:
+        case EINVAL:
+        case ENOTTY:
+        case EBADF:
+        case EOPNOTSUPP:
+#if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+        case ENOTSUP:
+#endif
+            return 1;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+
+#if defined(__linux__)
+
+static ssize_t
+do_cfr(xfer * x, size_t n)
+{
+#ifdef __NR_copy_file_range
+    loff_t so = x->soff,
+           d0 = x->doff;
+    ssize_t r;
+
+    if (x->dstream) return -EINVAL;
+
+    do {
+        r = syscall(__NR_copy_file_range, x->sfd, &so, x->dfd, &d0, n, 0);
+    } while (r < 0 && errno == EINTR);
+
+    return r < 0 ? -errno : r;
+#else
+    USEARG(x);
+    USEARG(n);
+    return -ENOSYS;
+#endif /* __NR_copy_file_range */
+}
+
+
+/*
+ * Clones are all or nothing; the whole remaining range is done in
+ * one go. A length of 0 means "to EOF" and is the only way to clone
+ * a tail that isn't block aligned.
+ */
+static ssize_t
+do_clone(xfer * x, size_t n)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range fcr;
+    struct stat st;
+    uint64_t avail, len;
+
+    USEARG(n);
+
+    if (x->dstream) return -EINVAL;
+    if (fstat(x->sfd, &st) < 0) return -errno;
+    if ((uint64_t)st.st_size <= x->soff) return 0;
+
+    avail = st.st_size - x->soff;
+    len   = x->rem < avail ? x->rem : avail;
+
+    fcr.src_fd      = x->sfd;
+    fcr.src_offset  = x->soff;
+    fcr.src_length  = len == avail ? 0 : len;
+    fcr.dest_offset = x->doff;
+
+    if (ioctl(x->dfd, FICLONERANGE, &fcr) < 0) return -errno;
+
+    /* A clone shorter than the old destination leaves it as is */
+    return (ssize_t)len;
+#else
+    USEARG(x);
+    USEARG(n);
+    return -ENOSYS;
+#endif /* FICLONERANGE */
+}
+
+
+static ssize_t
+do_sendfile(xfer * x, size_t n)
+{
+    off_t so = x->soff;
+    off_t pos = 0;
+    ssize_t r;
+
+    if (!x->dstream) {
+        if ((pos = lseek(x->dfd, 0, SEEK_CUR)) < 0)     return -errno;
+        if (lseek(x->dfd, x->doff, SEEK_SET) < 0)       return -errno;
+    }
+
+    do {
+        r = sendfile(x->dfd, x->sfd, &so, n);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) r = -errno;
+    if (!x->dstream) lseek(x->dfd, pos, SEEK_SET);
+    return r;
+}
+
+
+static ssize_t
+do_splice(xfer * x, size_t n)
+{
+    loff_t so = x->soff,
+           d0 = x->doff;
+    ssize_t r, m;
+    size_t done = 0;
+
+    if (x->pfd[0] < 0) {
+        if (pipe(x->pfd) < 0) return -errno;
+        fcntl(x->pfd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+
+    if (n > PIPE_SIZE) n = PIPE_SIZE;
+
+    do {
+        r = splice(x->sfd, &so, x->pfd[1], 0, n, SPLICE_F_MOVE);
+    } while (r < 0 && errno == EINTR);
+
+    if (r <= 0) return r < 0 ? -errno : 0;
+
+    while (done < (size_t)r) {
+        m = splice(x->pfd[0], 0, x->dfd, x->dstream ? 0 : &d0, r - done, SPLICE_F_MOVE);
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += m;
+    }
+
+    if (done < (size_t)r) {
+        int err = errno;
+
+        /* Drop what's stranded in the pipe */
+        close(x->pfd[0]);
+        close(x->pfd[1]);
+        x->pfd[0] = x->pfd[1] = -1;
+        if (done == 0) return -err;
+    }
+    return done;
+}
+
+#else
+
+static ssize_t
+nosys(xfer * x, size_t n)
+{
+    USEARG(x);
+    USEARG(n);
+    return -ENOSYS;
+}
+
+#define do_cfr          nosys
+#define do_clone        nosys
+#define do_sendfile     nosys
+#define do_splice       nosys
+
+#endif /* __linux__ */
+
+
+static ssize_t
+do_rw(xfer * x, size_t n)
+{
+    ssize_t r, m;
+    size_t done = 0;
+
+    if (!x->buf && !(x->buf = NEWA(uint8_t, FCOPY_BUFSIZE))) return -ENOMEM;
+    if (n > FCOPY_BUFSIZE) n = FCOPY_BUFSIZE;
+
+    do {
+        r = pread(x->sfd, x->buf, n, x->soff);
+    } while (r < 0 && errno == EINTR);
+
+    if (r <= 0) return r < 0 ? -errno : 0;
+
+    while (done < (size_t)r) {
+        if (x->dstream) m = write(x->dfd, x->buf + done, r - done);
+        else            m = pwrite(x->dfd, x->buf + done, r - done, x->doff + done);
+
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            return done > 0 ? (ssize_t)done : -errno;
+        }
+        done += m;
+    }
+    return done;
+}
+
+
+static const copier Copiers[] = {
+    0,
+    do_cfr,
+    do_clone,
+    do_sendfile,
+    do_splice,
+    do_rw,
+};
+
+
+/* Next method at or after 'm' that isn't disabled */
+static int
+next_method(int m, unsigned flags)
+{
+    for (; m < FCOPY_RW; m++) {
+        if (!(flags & (1 << (m - 1)))) return m;
+    }
+    return FCOPY_RW;
+}
+
+
+int
+fcopy_range(fcopy * c, int dfd, uint64_t doff, int sfd, uint64_t soff, uint64_t len)
+{
+    fcopy dummy;
+    struct stat st;
+    size_t chunk;
+    xfer x;
+    int m, r = 0;
+
+    if (!c) {
+        memset(&dummy, 0, sizeof dummy);
+        c = &dummy;
+    }
+
+    c->copied = 0;
+    c->method = 0;
+    chunk     = c->chunk > 0 ? c->chunk : FCOPY_CHUNK;
+
+    if (fstat(dfd, &st) < 0) return -errno;
+
+    memset(&x, 0, sizeof x);
+    x.sfd     = sfd;
+    x.dfd     = dfd;
+    x.dstream = !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+    x.soff    = soff;
+    x.doff    = doff;
+    x.rem     = len;
+    x.pfd[0]  = x.pfd[1] = -1;
+
+    m = next_method(FCOPY_CFR, c->flags);
+    while (x.rem > 0) {
+        size_t n  = x.rem < chunk ? x.rem : chunk;
+        ssize_t z = (*Copiers[m])(&x, n);
+
+        if (z < 0) {
+            if (m < FCOPY_RW && unsupported(-z)) {
+                m = next_method(m + 1, c->flags);
+                continue;
+            }
+            r = (int)z;
+            break;
+        }
+        if (z == 0) break;
+
+        x.soff    += z;
+        x.doff    += z;
+        c->copied += z;
+        c->method  = m;
+        if (len != FCOPY_EOF) x.rem -= z;
+
+        if (c->progress && (r = (*c->progress)(c->ctx, c->copied, len)) < 0) break;
+        r = 0;
+    }
+
+    if (x.pfd[0] >= 0) {
+        close(x.pfd[0]);
+        close(x.pfd[1]);
+    }
+    if (x.buf) DEL(x.buf);
+    return r;
+}
+
+
+int
+fcopy_file(fcopy * c, const char * dst, const char * src)
+{
+    struct stat st, dst_st;
+    int sfd, dfd, r;
+
+    if ((sfd = open(src, O_RDONLY|O_CLOEXEC)) < 0) return -errno;
+    if (fstat(sfd, &st) < 0) {
+        r = -errno;
+        close(sfd);
+        return r;
+    }
+
+    // Truncate only once we know it isn't 'src'
+    if ((dfd = open(dst, O_WRONLY|O_CREAT|O_CLOEXEC, st.st_mode & 07777)) < 0) {
+        r = -errno;
+        close(sfd);
+        return r;
+    }
+
+    if (fstat(dfd, &dst_st) < 0) {
+        r = -errno;
+        goto fail;
+    }
+    if (dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+        r = -EINVAL;
+        goto fail;
+    }
+    if (ftruncate(dfd, 0) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    r = fcopy_range(c, dfd, 0, sfd, 0, FCOPY_EOF);
+    if (r == 0 && c && (c->flags & FCOPY_FSYNC) && fsync(dfd) < 0) r = -errno;
+    if (close(dfd) < 0 && r == 0) r = -errno;
+    close(sfd);
+
+    if (r < 0) unlink(dst);
+    return r;
+
+fail:
+    close(dfd);
+    close(sfd);
+    return r;
+}
+
+
+const char *
+fcopy_method_name(int m)
+{
+    static const char * Names[] = {
+        "none",
+        "copy_file_range",
+        "clone",
+        "sendfile",
+        "splice",
+        "read/write",
+    };
+
+    return (m >= 0 && m <= FCOPY_RW) ? Names[m] : "unknown";
+}
+
+/* EOF */
@@ -4,7 +4,7 @@
  *
  * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
  *
-p * Licensing Terms: GPLv2
+ * Licensing Terms: GPLv2
  *
  * This software does not come with any express or implied
  * warranty; it is provided "as is". No claim  is made to its
@@ -16,6 +16,18 @@ p * Licensing Terms: GPLv2
  * A Job manager starts N threads (one per CPU). Each thread gets
  * its quanta from a common queue. A producer-consumer paradigm is
  * used to get/put jobs from the queue.
+ *
+ * The queue is one heap per priority level under a single lock;
+ * jobs without a deadline sort after those with one and among
+ * themselves by submission order (seq).
+ *
+ * Weighted round robin: each level starts a round with 'weight'
+ * credits and a dispatch takes one from the highest level that has
+ * jobs and credits; when no level with jobs has credits left, a new
+ * round starts.
+ *
+ * A NULL job is an end of work marker: it is handed to a thread -
+ * which then exits - only when all the levels are empty.
  */
 
 #include <stdio.h>
@@ -29,6 +41,7 @@ p * Licensing Terms: GPLv2
 #include <sys/time.h>
 
 #include "utils/cpu.h"
+#include "utils/clock.h"
 #include "posix/job.h"
 #include "utils/utils.h"
 #include "error.h"
@@ -45,6 +58,21 @@ struct job_context
 };
 typedef struct job_context job_context;
 
+
+struct job_metrics
+{
+    metrics_queue    q;
+    metrics_counter* completed;
+    metrics_counter* errors;
+    metrics_gauge*   busy;
+    metrics_hist*    run_us;
+
+    metrics_gauge*   depth[JOB_NPRIO];
+    metrics_hist*    wait_us[JOB_NPRIO];
+};
+typedef struct job_metrics job_metrics;
+
+
 /*
  * Get the next job for processing
  * Return 0 if no job, job_ptr otherwise.
@@ -67,13 +95,29 @@ thread_func(void* p)
 
     while (1)
     {
+        job_metrics* m = tj->jm->metrics;
         void* j = job_manager_get(tj->jm);
+        uint64_t t0 = 0;
+        int r;
 
         if (!j)
             break;
 
-        if ((*tj->func)(tj->context, j, tj->cpunr) < 0)
+        if (m) {
+            metrics_gauge_add(m->busy, 1);
+            t0 = clk_us();
+        }
+
+        r = (*tj->func)(tj->context, j, tj->cpunr);
+        if (r < 0)
             err++;
+
+        if (m) {
+            metrics_hist_record(m->run_us, clk_us() - t0);
+            metrics_gauge_add(m->busy, -1);
+            metrics_counter_inc(m->completed);
+            if (r < 0) metrics_counter_inc(m->errors);
+        }
     }
 
     sem_post(&tj->jm->done);
@@ -92,17 +136,34 @@ job_manager_init(job_manager* jm, int nthreads, jobfunc_t func, void* ctx)
     int i;
     int r;
 
+    static const unsigned int weights[JOB_NPRIO] = JOB_WEIGHTS;
+
     memset(jm, 0, sizeof *jm);
 
+    // Calibrate the clock now rather than in the first submit,
+    // under jm->lock
+    clk_ns();
+
     if (nthreads <= 0)
         nthreads = sys_cpu_getavail();
 
-    jm->threads  = NEWZA(job_context, nthreads);
-    jm->nthreads = nthreads;
+    // nthreads counts the threads started: after a failure,
+    // job_manager_wait() and _destroy() clean up those.
+    jm->threads = NEWZA(job_context, nthreads);
+    if (!jm->threads) return -ENOMEM;
+
+    if ((r = pthread_mutex_init(&jm->lock, 0)) != 0)     return -r;
+    if ((r = pthread_cond_init(&jm->notempty, 0)) != 0)  return -r;
 
+    for (i = 0; i < JOB_NPRIO; i++) {
+        struct job_level* l = &jm->lvl[i];
 
-    r = SYNCQ_INIT(&jm->q, JOB_MAX);
-    if (r != 0) return r;
+        l->heap = NEWA(struct job_entry, JOB_MAX);
+        if (!l->heap) return -ENOMEM;
+
+        if ((r = pthread_cond_init(&l->notfull, 0)) != 0) return -r;
+    }
+    job_manager_set_weights(jm, weights);
 
     if ((r = sem_init(&jm->done, 0, 0)) != 0)
         return -errno;
@@ -126,6 +187,7 @@ job_manager_init(job_manager* jm, int nthreads, jobfunc_t func, void* ctx)
             error(0, r, "job manager coulnd't create thread-%d", i);
             return -r;
         }
+        jm->nthreads++;
     }
 
     return nthreads;
@@ -137,19 +199,187 @@ job_manager_init(job_manager* jm, int nthreads, jobfunc_t func, void* ctx)
  * for all threads to exit.
  */
 void
-job_manager_cleanup(job_manager* jm)
+job_manager_destroy(job_manager* jm)
 {
-    SYNCQ_FINI(&jm->q);
+    int i;
+
+    for (i = 0; i < JOB_NPRIO; i++) {
+        pthread_cond_destroy(&jm->lvl[i].notfull);
+        DEL(jm->lvl[i].heap);
+    }
+    pthread_cond_destroy(&jm->notempty);
+    pthread_mutex_destroy(&jm->lock);
     sem_destroy(&jm->done);
 
     DEL(jm->threads);
+    if (jm->metrics) DEL(jm->metrics);
+}
+
+
+int
+job_manager_metrics(job_manager* jm, metrics_registry* r, const char* labels)
+{
+    job_metrics* m = NEWZ(job_metrics);
+    char lb[256];
+    int i;
+
+    if (!m) return -ENOMEM;
+
+    m->completed = metrics_counter_get(r, "job_completed", labels);
+    m->errors    = metrics_counter_get(r, "job_errors", labels);
+    m->busy      = metrics_gauge_get(r, "job_busy", labels);
+    m->run_us    = metrics_hist_get(r, "job_run_us", labels);
+
+    if (!m->completed || !m->errors || !m->busy || !m->run_us ||
+        metrics_queue_init(&m->q, r, "jobq", labels) < 0)
+        goto fail;
+
+    for (i = 0; i < JOB_NPRIO; i++) {
+        if (labels && *labels) snprintf(lb, sizeof lb, "%s,prio=%d", labels, i);
+        else                   snprintf(lb, sizeof lb, "prio=%d", i);
+
+        m->depth[i]   = metrics_gauge_get(r, "jobq_depth", lb);
+        m->wait_us[i] = metrics_hist_get(r, "jobq_wait_us", lb);
+        if (!m->depth[i] || !m->wait_us[i]) goto fail;
+    }
+
+    jm->metrics = m;
+    return 0;
+
+fail:
+    DEL(m);
+    return -ENOMEM;
+}
+
+
+void
+job_manager_set_weights(job_manager* jm, const unsigned int* w)
+{
+    int i;
+
+    pthread_mutex_lock(&jm->lock);
+    for (i = 0; i < JOB_NPRIO; i++) {
+        struct job_level* l = &jm->lvl[i];
+
+        l->weight = w[i] ? w[i] : 1;
+        l->credit = l->weight;
+    }
+    pthread_mutex_unlock(&jm->lock);
+}
+
+
+void
+job_manager_stats(job_manager* jm, job_stats* st)
+{
+    int i;
+
+    pthread_mutex_lock(&jm->lock);
+    for (i = 0; i < JOB_NPRIO; i++) {
+        st[i]       = jm->lvl[i].st;
+        st[i].depth = jm->lvl[i].n;
+    }
+    pthread_mutex_unlock(&jm->lock);
+}
+
+
+/* a runs before b */
+static inline int
+before(const struct job_entry* a, const struct job_entry* b)
+{
+    return a->deadline < b->deadline ||
+           (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+
+static void
+heap_push(struct job_level* l, const struct job_entry* e)
+{
+    struct job_entry* h = l->heap;
+    int i = l->n++;
+
+    while (i > 0) {
+        int p = (i - 1) / 2;
+
+        if (!before(e, &h[p])) break;
+        h[i] = h[p];
+        i    = p;
+    }
+    h[i] = *e;
+}
+
+
+static void
+heap_pop(struct job_level* l, struct job_entry* e)
+{
+    struct job_entry* h = l->heap;
+    struct job_entry* x;
+    int n = --l->n;
+    int i = 0;
+
+    *e = h[0];
+    x  = &h[n];
+    for (;;) {
+        int c = 2 * i + 1;
+
+        if (c >= n) break;
+        if (c + 1 < n && before(&h[c + 1], &h[c])) c++;
+        if (!before(&h[c], x)) break;
+        h[i] = h[c];
+        i    = c;
+    }
+    h[i] = *x;
+}
+
+
+int
+job_manager_submit(job_manager* jm, void* j, int prio, uint64_t deadline)
+{
+    job_metrics* m = jm->metrics;
+    struct job_level* l;
+    struct job_entry e;
+
+    if (prio < 0 || prio >= JOB_NPRIO) return -EINVAL;
+
+    l = &jm->lvl[prio];
+
+    pthread_mutex_lock(&jm->lock);
+    if (!j) {
+        // End of work marker; it doesn't take a slot
+        jm->nstop++;
+    } else {
+        if (l->n == JOB_MAX) {
+            if (m) metrics_counter_inc(m->q.enq_blocked);
+            do {
+                pthread_cond_wait(&l->notfull, &jm->lock);
+            } while (l->n == JOB_MAX);
+        }
+
+        e.t_enq    = clk_us();
+        e.deadline = UINT64_MAX;
+        if (deadline && deadline < UINT64_MAX - e.t_enq) e.deadline = e.t_enq + deadline;
+        e.seq      = jm->seq++;
+        e.job      = j;
+        heap_push(l, &e);
+        jm->njobs++;
+
+        l->st.submitted++;
+        if ((uint64_t)l->n > l->st.max_depth) l->st.max_depth = l->n;
+    }
+    pthread_cond_signal(&jm->notempty);
+    pthread_mutex_unlock(&jm->lock);
+
+    if (m) {
+        metrics_counter_inc(m->q.enq);
+        if (j) metrics_gauge_add(m->depth[prio], 1);
+    }
+    return 0;
 }
 
 
 void
 job_manager_submit_job(job_manager* jm, void* j)
 {
-    SYNCQ_ENQ(&jm->q, j);
+    job_manager_submit(jm, j, JOB_PRIO_NORMAL, 0);
 }
 
 
@@ -187,16 +417,78 @@ job_manager_wait(job_manager* jm)
 
 
 
+/*
+ * Level to take the next job from; there must be a job.
+ */
+static int
+pick_level(job_manager* jm)
+{
+    int i;
+
+    for (;;) {
+        for (i = 0; i < JOB_NPRIO; i++) {
+            struct job_level* l = &jm->lvl[i];
+
+            if (l->n > 0 && l->credit > 0) {
+                l->credit--;
+                return i;
+            }
+        }
+
+        // New round
+        for (i = 0; i < JOB_NPRIO; i++) jm->lvl[i].credit = jm->lvl[i].weight;
+    }
+}
+
+
 /*
  * This is an internal function. No need for outsiders to see this.
  */
 static void*
 job_manager_get(job_manager* jm)
 {
-    void* j = 0;
+    job_metrics* m = jm->metrics;
+    struct job_level* l;
+    struct job_entry e;
+    uint64_t now, w;
+    int prio;
+
+    pthread_mutex_lock(&jm->lock);
+    if (jm->njobs == 0 && jm->nstop == 0) {
+        if (m) metrics_counter_inc(m->q.deq_blocked);
+        do {
+            pthread_cond_wait(&jm->notempty, &jm->lock);
+        } while (jm->njobs == 0 && jm->nstop == 0);
+    }
 
-    SYNCQ_DEQ(&jm->q, j);
-    return j;
+    if (jm->njobs == 0) {
+        jm->nstop--;
+        pthread_mutex_unlock(&jm->lock);
+        if (m) metrics_counter_inc(m->q.deq);
+        return 0;
+    }
+
+    prio = pick_level(jm);
+    l    = &jm->lvl[prio];
+    heap_pop(l, &e);
+    jm->njobs--;
+
+    now = clk_us();
+    w   = now > e.t_enq ? now - e.t_enq : 0;
+    l->st.dispatched++;
+    l->st.wait_us += w;
+    if (w > l->st.max_wait_us) l->st.max_wait_us = w;
+    if (now > e.deadline)      l->st.late++;
+
+    pthread_cond_signal(&l->notfull);
+    pthread_mutex_unlock(&jm->lock);
+
+    if (m) {
+        metrics_counter_inc(m->q.deq);
+        metrics_gauge_add(m->depth[prio], -1);
+        metrics_hist_record(m->wait_us[prio], w);
+    }
+    return e.job;
 }
 
 /* EOF */
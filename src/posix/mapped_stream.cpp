@@ -0,0 +1,231 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * mapped_stream.cpp - Sliding window sequential reader over
+ *                     mmap_file.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Windows are mapped at page aligned offsets; data() points into
+ *    the mapping at the (unaligned) start of the window.
+ * o  The helper thread only issues readahead for the next window.
+ *    Submitting readahead can block on a busy device; doing it off
+ *    the caller's thread keeps the parser running meanwhile.
+ * o  Consumed ranges are dropped with POSIX_FADV_DONTNEED after the
+ *    window covering them is unmapped; the page holding the start
+ *    of the current window is kept.
+ */
+#include "utils/mapped_stream.h"
+#include "utils/utils.h"
+
+#include <errno.h>
+#include <assert.h>
+
+using namespace std;
+using namespace putils;
+
+namespace putils {
+
+mapped_stream::mapped_stream(const string& filename, size_t window,
+                             unsigned int flags)
+        : m_file(filename, MMAP_RDONLY),
+          m_flags(flags),
+          m_window(window ? window : MSTREAM_DEFAULT_WINDOW),
+          m_pgsize(mmap_file::pagesize()),
+          m_map(0),
+          m_maplen(0),
+          m_data(0),
+          m_size(0),
+          m_off(0),
+          m_dropped(0),
+          m_pf_off(-1),
+          m_pf_len(0),
+          m_quit(false),
+          m_helper(false)
+{
+    m_window = align_up(m_window, m_pgsize);
+
+    map(0, m_window);
+
+    pthread_mutex_init(&m_lock, 0);
+    pthread_cond_init(&m_cond, 0);
+
+    // Without a helper thread, prefetch falls back to asking the
+    // kernel for readahead from the caller's thread.
+    if ( flags & MSTREAM_PREFETCH )
+        m_helper = 0 == pthread_create(&m_tid, 0, helper, this);
+
+    if ( !at_end() )
+        prefetch(m_off + off_t(m_size));
+}
+
+
+mapped_stream::~mapped_stream()
+{
+    if ( m_helper )
+    {
+        pthread_mutex_lock(&m_lock);
+        m_quit = true;
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_lock);
+
+        pthread_join(m_tid, 0);
+    }
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+
+    if ( m_map )
+        m_file.unmap(m_map);
+
+    if ( (m_flags & MSTREAM_DROP) && m_off + off_t(m_size) > m_dropped )
+        m_file.drop(m_dropped, size_t(m_off + off_t(m_size) - m_dropped));
+}
+
+
+// Map 'window' bytes starting at file offset 'off'. If mmap throws,
+// the stream is left at the old window.
+void
+mapped_stream::map(off_t off, size_t window)
+{
+    off_t  mapoff = align_down(off, m_pgsize);
+    off_t  fsize  = m_file.filesize();
+    size_t delta  = size_t(off - mapoff);
+    size_t maplen;
+
+    if ( off >= fsize )
+    {
+        m_off    = off;
+        m_map    = 0;
+        m_maplen = 0;
+        m_data   = 0;
+        m_size   = 0;
+        return;
+    }
+
+    maplen = window + delta;
+    if ( mapoff + off_t(maplen) > fsize )
+        maplen = size_t(fsize - mapoff);
+
+    m_map    = (uint8_t *)m_file.mmap(mapoff, maplen, MMAP_SEQUENTIAL);
+    m_off    = off;
+    m_maplen = maplen;
+    m_data   = m_map + delta;
+    m_size   = maplen - delta;
+}
+
+
+// Queue readahead of the window at 'off'
+void
+mapped_stream::prefetch(off_t off)
+{
+    off_t  fsize = m_file.filesize();
+    size_t len   = m_window;
+
+    if ( off >= fsize )
+        return;
+
+    if ( off + off_t(len) > fsize )
+        len = size_t(fsize - off);
+
+    if ( !m_helper )
+    {
+        m_file.prefetch(off, len);
+        return;
+    }
+
+    pthread_mutex_lock(&m_lock);
+    m_pf_off = off;
+    m_pf_len = len;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+}
+
+
+void *
+mapped_stream::helper(void * p)
+{
+    mapped_stream * ms = (mapped_stream *)p;
+
+    pthread_mutex_lock(&ms->m_lock);
+    while ( 1 )
+    {
+        while ( ms->m_pf_off < 0 && !ms->m_quit )
+            pthread_cond_wait(&ms->m_cond, &ms->m_lock);
+
+        if ( ms->m_quit )
+            break;
+
+        off_t  off = ms->m_pf_off;
+        size_t len = ms->m_pf_len;
+
+        ms->m_pf_off = -1;
+        pthread_mutex_unlock(&ms->m_lock);
+
+        ms->m_file.prefetch(off, len);
+
+        pthread_mutex_lock(&ms->m_lock);
+    }
+    pthread_mutex_unlock(&ms->m_lock);
+
+    return 0;
+}
+
+
+bool
+mapped_stream::advance(size_t consumed)
+{
+    uint8_t * old = m_map;
+
+    assert(consumed <= m_size);
+
+    if ( consumed == 0 )
+    {
+        // Nothing more will show up at the end of the file;
+        // otherwise grow the window to fit the caller's record.
+        if ( m_size == 0 || at_end() )
+            return false;
+
+        size_t window = m_window * 2;
+
+        map(m_off, window);
+        m_window = window;
+    }
+    else
+    {
+        map(m_off + off_t(consumed), m_window);
+    }
+
+    if ( old && old != m_map )
+        m_file.unmap(old);
+
+    if ( m_size > 0 && !at_end() )
+        prefetch(m_off + off_t(m_size));
+
+    if ( m_flags & MSTREAM_DROP )
+    {
+        off_t upto = align_down(m_off, m_pgsize);
+
+        if ( upto > m_dropped )
+        {
+            m_file.drop(m_dropped, size_t(upto - m_dropped));
+            m_dropped = upto;
+        }
+    }
+
+    return m_size > 0;
+}
+
+}
+
+/* EOF */
@@ -27,6 +27,14 @@
 #include <errno.h>
 #include <assert.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND   2
+#endif
+#endif /* __linux__ */
+
 using namespace std;
 using namespace putils;
 
@@ -40,11 +48,14 @@ mmap_file::mmap_file(const string& filename, unsigned int flags)
 {
     unsigned int mode = O_RDONLY;
 
-    if ( flags & MMAP_RDWR )
+    if ( flags & MMAP_RDWR ) {
         mode = O_RDWR;
+        if ( flags & MMAP_CREATE )
+            mode |= O_CREAT;
+    }
 
 
-    int fd  = ::open(fn(), mode);
+    int fd  = ::open(fn(), mode, 0660);
     if (fd < 0)
         throw sys_exception(geterror(), "Can't open '%s'", fn());
 
@@ -69,17 +80,81 @@ mmap_file::~mmap_file()
                           end = m_mappings.end();
     while (i != end)
     {
-        const mapping& m = *i;
+        const mapping& m = i->second;
         ::munmap(m.ptr, m.size);
         ++i;
     }
 }
 
 
+// Map MMAP_xxx advice to madvise(2) advice; -1 if none.
+static int
+madvice(unsigned int opts)
+{
+    switch (opts & MMAP_ADVICE_MASK) {
+        case MMAP_SEQUENTIAL: return MADV_SEQUENTIAL;
+        case MMAP_RANDOM:     return MADV_RANDOM;
+        case MMAP_WILLNEED:   return MADV_WILLNEED;
+        default:              break;
+    }
+    return -1;
+}
+
+
+// Apply the hints in 'opts' to a page aligned range. These are
+// all advisory; errors are ignored.
+static void
+apply_opts(void * ptr, size_t size, unsigned int opts)
+{
+    int adv = madvice(opts);
+
+    if ( adv >= 0 )
+        ::madvise(ptr, size, adv);
+
+#ifdef MADV_HUGEPAGE
+    if ( opts & MMAP_HUGEPAGE )
+        ::madvise(ptr, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+}
+
+
+// Bind the pages of a mapping to one NUMA node. Advisory as well:
+// no NUMA support (or one node) is not an error.
+static void
+numa_bind(void * ptr, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[4] = { 0, 0, 0, 0 };
+    const int maxnode     = 8 * sizeof mask;
+
+    if ( node < 0 || node >= maxnode )
+        return;
+
+    mask[node / (8 * sizeof mask[0])] |= 1UL << (node % (8 * sizeof mask[0]));
+    ::syscall(SYS_mbind, ptr, size, MPOL_BIND, mask, maxnode + 1, 0);
+#else
+    USEARG(ptr);
+    USEARG(size);
+    USEARG(node);
+#endif /* __linux__ */
+}
+
+
 void *
 mmap_file::mmap(off_t off, size_t size)
 {
-    void * ptr = find(off, size);
+    return mmap(off, size, m_flags & MMAP_OPTS_MASK, -1);
+}
+
+
+void *
+mmap_file::mmap(off_t off, size_t size, unsigned int opts, int numa_node)
+{
+    opts &= MMAP_OPTS_MASK;
+    if ( numa_node < 0 )
+        numa_node = -1;
+
+    void * ptr = find(off, size, opts, numa_node);
 
     if (ptr) return ptr;
 
@@ -105,13 +180,26 @@ mmap_file::mmap(off_t off, size_t size)
     if ( m_flags & MMAP_SHARED )
         mode |= MAP_SHARED;
 
+#ifdef MAP_POPULATE
+    // Populating before the NUMA binding would place the pages
+    // on the wrong node; in that case fault them in afterwards.
+    if ( (opts & MMAP_POPULATE) && numa_node < 0 )
+        mode |= MAP_POPULATE;
+#endif /* MAP_POPULATE */
+
     ptr = ::mmap(0, size, prot, mode, int(m_fd), off_t(off));
     if ( (void *)-1 == ptr )
         throw sys_exception(geterror(), "%s: Can't mmap %llu bytes at %llu ", fn(), size, off);
 
-    mapping m(ptr, size, off);
+    apply_opts(ptr, size, opts);
 
-    m_mappings.push_back(m);
+    if ( numa_node >= 0 ) {
+        numa_bind(ptr, size, numa_node);
+        if ( opts & MMAP_POPULATE )
+            ::madvise(ptr, size, MADV_WILLNEED);
+    }
+
+    add_mapping(ptr, size, off, opts, numa_node);
 
     return ptr;
 }
@@ -128,6 +216,41 @@ mmap_file::unmap(void * ptr)
 }
 
 
+void
+mmap_file::advise(void * ptr, size_t n, unsigned int opts)
+{
+    const size_t pgsize = pagesize();
+    uint8_t * p = (uint8_t *)ptr;
+    uint8_t * a = (uint8_t *)align_down(ptr, pgsize);
+
+    apply_opts(a, align_up(n + (p - a), pgsize), opts);
+}
+
+
+void
+mmap_file::prefetch(off_t off, size_t n)
+{
+#ifdef POSIX_FADV_WILLNEED
+    ::posix_fadvise(int(m_fd), off, n, POSIX_FADV_WILLNEED);
+#else
+    USEARG(off);
+    USEARG(n);
+#endif /* POSIX_FADV_WILLNEED */
+}
+
+
+void
+mmap_file::drop(off_t off, size_t n)
+{
+#ifdef POSIX_FADV_DONTNEED
+    ::posix_fadvise(int(m_fd), off, n, POSIX_FADV_DONTNEED);
+#else
+    USEARG(off);
+    USEARG(n);
+#endif /* POSIX_FADV_DONTNEED */
+}
+
+
 // lock and unlock memory
 void
 mmap_file::mlock(void * ptr, size_t n)
@@ -0,0 +1,577 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * perfprof.c - Hardware counter profiling of code regions.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Every thread has its own counter group and its own totals per
+ *    region; recording touches nothing shared. Reports read the
+ *    totals of running threads without stopping them.
+ * o  The group counts continuously from when it is opened; a read
+ *    is a snapshot and regions are deltas of two snapshots. Counters
+ *    multiplexed by the kernel (more events than PMU registers) are
+ *    not scaled.
+ * o  rdpmc reads follow the seqlock protocol of
+ *    perf_event_mmap_page; when a counter is not on the PMU at that
+ *    moment (index 0) the whole group is read with read(2) instead.
+ * o  A thread's totals outlive the thread; perfprof_reset() frees
+ *    those of threads that have exited.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "posix/perfprof.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif /* __linux__ */
+
+
+struct region_acc
+{
+    uint64_t calls;
+    uint64_t tsc;
+    uint64_t v[PERFPROF_NCTR];
+};
+typedef struct region_acc region_acc;
+
+
+struct pthr
+{
+    struct pthr * next;
+    char          name[32];
+    int           exited;
+
+    unsigned      avail;
+    int           lead;                 /* index of the group leader */
+    int           fd[PERFPROF_NCTR];
+    int           rdpmc;
+    void *        pg[PERFPROF_NCTR];    /* mmap'd perf_event_mmap_page */
+    long          pgsize;
+
+    region_acc    acc[PERFPROF_MAX_REGIONS];
+};
+typedef struct pthr pthr;
+
+
+static pthread_mutex_t  Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   Once = PTHREAD_ONCE_INIT;
+static pthread_key_t    Key;
+
+static pthr *           Threads;
+static char *           Regions[PERFPROF_MAX_REGIONS];
+static int              Nregions;
+static double           NsPerTick;
+
+static __thread pthr *  Me;
+
+
+static const char * CtrNames[PERFPROF_NCTR] = {
+    "instructions",
+    "cycles",
+    "llc-misses",
+    "branch-misses",
+};
+
+
+
+#if defined(__linux__)
+
+static void
+close_counters(pthr * t)
+{
+    int i;
+
+    for (i = 0; i < PERFPROF_NCTR; i++) {
+        if (t->pg[i]) munmap(t->pg[i], t->pgsize);
+        if (t->fd[i] >= 0) close(t->fd[i]);
+        t->pg[i] = 0;
+        t->fd[i] = -1;
+    }
+    t->avail = 0;
+    t->rdpmc = 0;
+}
+
+
+static void
+open_counters(pthr * t)
+{
+    static const uint64_t Events[PERFPROF_NCTR] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    int i, lead = -1;
+
+    for (i = 0; i < PERFPROF_NCTR; i++) {
+        struct perf_event_attr a;
+
+        memset(&a, 0, sizeof a);
+        a.type           = PERF_TYPE_HARDWARE;
+        a.size           = sizeof a;
+        a.config         = Events[i];
+        a.exclude_kernel = 1;
+        a.exclude_hv     = 1;
+        a.read_format    = lead < 0 ? PERF_FORMAT_GROUP : 0;
+
+        t->fd[i] = syscall(__NR_perf_event_open, &a, 0, -1, lead, 0);
+        if (t->fd[i] < 0) {
+            t->fd[i] = -1;
+            continue;
+        }
+
+        if (lead < 0) {
+            lead    = t->fd[i];
+            t->lead = i;
+        }
+        t->avail |= 1 << i;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (t->avail) {
+        t->pgsize = sysconf(_SC_PAGESIZE);
+        t->rdpmc  = 1;
+        for (i = 0; i < PERFPROF_NCTR; i++) {
+            struct perf_event_mmap_page * pg;
+            void * p;
+
+            if (t->fd[i] < 0) continue;
+
+            p = mmap(0, t->pgsize, PROT_READ, MAP_SHARED, t->fd[i], 0);
+            if (p == MAP_FAILED) {
+                t->rdpmc = 0;
+                break;
+            }
+
+            t->pg[i] = p;
+            pg       = (struct perf_event_mmap_page *)p;
+            if (!pg->cap_user_rdpmc) t->rdpmc = 0;
+        }
+
+        if (!t->rdpmc) {
+            for (i = 0; i < PERFPROF_NCTR; i++) {
+                if (t->pg[i]) munmap(t->pg[i], t->pgsize);
+                t->pg[i] = 0;
+            }
+        }
+    }
+#endif /* x86 */
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * Counter value via rdpmc; -1 if the counter isn't on the PMU now.
+ */
+static int
+read_pmc(void * p, uint64_t * out)
+{
+    volatile struct perf_event_mmap_page * pg = (volatile struct perf_event_mmap_page *)p;
+    uint32_t seq, idx, lo, hi;
+    uint64_t count, pmc;
+    unsigned w;
+
+    do {
+        seq = pg->lock;
+        __asm__ __volatile__ ("" ::: "memory");
+
+        idx   = pg->index;
+        count = pg->offset;
+        w     = pg->pmc_width;
+        if (idx == 0 || w == 0 || w > 64) return -1;
+
+        __asm__ __volatile__ ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        pmc    = ((uint64_t)hi << 32) | lo;
+        count += (uint64_t)((int64_t)(pmc << (64 - w)) >> (64 - w));
+
+        __asm__ __volatile__ ("" ::: "memory");
+    } while (pg->lock != seq);
+
+    *out = count;
+    return 0;
+}
+
+#endif /* x86 */
+
+
+static void
+read_counters(pthr * t, uint64_t * v)
+{
+    uint64_t buf[1 + PERFPROF_NCTR];
+    int i, k;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (t->rdpmc) {
+        for (i = 0; i < PERFPROF_NCTR; i++) {
+            if (!t->pg[i]) continue;
+            if (read_pmc(t->pg[i], &v[i]) < 0) goto slow;
+        }
+        return;
+    }
+slow:
+#endif /* x86 */
+
+    if (read(t->fd[t->lead], buf, sizeof buf) < (ssize_t)sizeof(uint64_t)) return;
+
+    for (i = 0, k = 0; i < PERFPROF_NCTR; i++) {
+        if ((t->avail & (1 << i)) && (uint64_t)k < buf[0]) v[i] = buf[1 + k++];
+    }
+}
+
+
+static void
+thread_name(pthr * t)
+{
+    snprintf(t->name, sizeof t->name, "tid-%ld", (long)syscall(SYS_gettid));
+}
+
+#else
+
+static void
+close_counters(pthr * t)
+{
+    USEARG(t);
+}
+
+static void
+open_counters(pthr * t)
+{
+    USEARG(t);
+}
+
+static void
+read_counters(pthr * t, uint64_t * v)
+{
+    USEARG(t);
+    USEARG(v);
+}
+
+static void
+thread_name(pthr * t)
+{
+    snprintf(t->name, sizeof t->name, "thr-%p", (void *)pthread_self());
+}
+
+#endif /* __linux__ */
+
+
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Thread exit */
+static void
+thread_gone(void * p)
+{
+    pthr * t = (pthr *)p;
+
+    close_counters(t);
+    t->exited = 1;
+}
+
+
+static void
+once(void)
+{
+    struct timespec d = { 0, 10 * 1000 * 1000 };
+    uint64_t n0, n1, c0, c1;
+
+    pthread_key_create(&Key, thread_gone);
+
+    n0 = monotonic_ns();
+    c0 = sys_cpu_timestamp();
+    nanosleep(&d, 0);
+    n1 = monotonic_ns();
+    c1 = sys_cpu_timestamp();
+
+    NsPerTick = c1 > c0 ? (double)(n1 - n0) / (double)(c1 - c0) : 1.0;
+}
+
+
+static pthr *
+setup(const char * name)
+{
+    pthr * t = NEWZ(pthr);
+    int i;
+
+    if (!t) return 0;
+
+    pthread_once(&Once, once);
+
+    for (i = 0; i < PERFPROF_NCTR; i++) t->fd[i] = -1;
+
+    if (name) snprintf(t->name, sizeof t->name, "%s", name);
+    else      thread_name(t);
+
+    open_counters(t);
+    pthread_setspecific(Key, t);
+
+    pthread_mutex_lock(&Lock);
+    t->next = Threads;
+    Threads = t;
+    pthread_mutex_unlock(&Lock);
+
+    return t;
+}
+
+
+static inline pthr *
+me(void)
+{
+    return Me ? Me : (Me = setup(0));
+}
+
+
+unsigned
+perfprof_thread_init(const char * name)
+{
+    if (Me) {
+        if (name) snprintf(Me->name, sizeof Me->name, "%s", name);
+        if (!Me->avail) open_counters(Me);
+        return Me->avail;
+    }
+
+    Me = setup(name);
+    return Me ? Me->avail : 0;
+}
+
+
+void
+perfprof_thread_fini(void)
+{
+    if (Me) close_counters(Me);
+}
+
+
+unsigned
+perfprof_avail(void)
+{
+    pthr * t = me();
+
+    return t ? t->avail : 0;
+}
+
+
+int
+perfprof_rdpmc(void)
+{
+    pthr * t = me();
+
+    return t ? t->rdpmc : 0;
+}
+
+
+void
+perfprof_read(perfprof_sample * s)
+{
+    pthr * t = me();
+
+    memset(s->v, 0, sizeof s->v);
+    if (t && t->avail) read_counters(t, s->v);
+    s->tsc = sys_cpu_timestamp();
+}
+
+
+void
+perfprof_end(perfprof_scope * s)
+{
+    uint64_t tsc = sys_cpu_timestamp();
+    pthr * t     = Me;
+    region_acc * a;
+    int i;
+
+    if (!t || s->region < 0 || s->region >= PERFPROF_MAX_REGIONS) return;
+
+    a = &t->acc[s->region];
+    a->calls++;
+    a->tsc += tsc - s->s0.tsc;
+
+    if (t->avail) {
+        uint64_t v[PERFPROF_NCTR];
+
+        memset(v, 0, sizeof v);
+        read_counters(t, v);
+        for (i = 0; i < PERFPROF_NCTR; i++) a->v[i] += v[i] - s->s0.v[i];
+    }
+}
+
+
+int
+perfprof_region(const char * name)
+{
+    int i, r = -ENOSPC;
+
+    pthread_mutex_lock(&Lock);
+    for (i = 0; i < Nregions; i++) {
+        if (0 == strcmp(Regions[i], name)) {
+            r = i;
+            goto done;
+        }
+    }
+
+    if (Nregions < PERFPROF_MAX_REGIONS) {
+        if ((Regions[Nregions] = strdup(name))) r = Nregions++;
+        else                                    r = -ENOMEM;
+    }
+
+done:
+    pthread_mutex_unlock(&Lock);
+    return r;
+}
+
+
+int
+perfprof_walk(int per_thread, perfprof_walker fn, void * ctx)
+{
+    perfprof_stats st;
+    pthr * t;
+    int i, k, r = 0;
+
+    pthread_mutex_lock(&Lock);
+    if (per_thread) {
+        for (t = Threads; t && r == 0; t = t->next) {
+            for (i = 0; i < Nregions && r == 0; i++) {
+                region_acc * a = &t->acc[i];
+
+                if (a->calls == 0) continue;
+
+                memset(&st, 0, sizeof st);
+                st.region = Regions[i];
+                st.thread = t->name;
+                st.avail  = t->avail;
+                st.calls  = a->calls;
+                st.tsc    = a->tsc;
+                memcpy(st.v, a->v, sizeof st.v);
+                r = (*fn)(ctx, &st);
+            }
+        }
+    } else {
+        for (i = 0; i < Nregions && r == 0; i++) {
+            memset(&st, 0, sizeof st);
+            st.region = Regions[i];
+            st.avail  = (1 << PERFPROF_NCTR) - 1;
+
+            for (t = Threads; t; t = t->next) {
+                region_acc * a = &t->acc[i];
+
+                if (a->calls == 0) continue;
+
+                /* A counter some thread lacked is only a partial sum */
+                st.avail &= t->avail;
+                st.calls += a->calls;
+                st.tsc   += a->tsc;
+                for (k = 0; k < PERFPROF_NCTR; k++) st.v[k] += a->v[k];
+            }
+            if (st.calls > 0) r = (*fn)(ctx, &st);
+        }
+    }
+    pthread_mutex_unlock(&Lock);
+    return r;
+}
+
+
+double
+perfprof_ns_per_tick(void)
+{
+    pthread_once(&Once, once);
+    return NsPerTick;
+}
+
+
+static int
+print_stats(void * ctx, const perfprof_stats * st)
+{
+    FILE * fp = (FILE *)ctx;
+    double n  = (double)st->calls;
+    char who[96];
+    int i;
+
+    if (st->thread) snprintf(who, sizeof who, "%s [%s]", st->region, st->thread);
+    else            snprintf(who, sizeof who, "%s", st->region);
+
+    fprintf(fp, "%-32s %12llu %10.1f", who, (unsigned long long)st->calls,
+            (double)st->tsc * NsPerTick / n);
+
+    for (i = 0; i < PERFPROF_NCTR; i++) {
+        if (st->avail & (1 << i)) fprintf(fp, " %12.2f", (double)st->v[i] / n);
+        else                      fprintf(fp, " %12s", "-");
+
+        if (i == PERFPROF_CYCLES) {
+            unsigned both = (1 << PERFPROF_INSTRUCTIONS) | (1 << PERFPROF_CYCLES);
+
+            if ((st->avail & both) == both && st->v[PERFPROF_CYCLES] > 0)
+                fprintf(fp, " %6.2f", (double)st->v[PERFPROF_INSTRUCTIONS] / (double)st->v[PERFPROF_CYCLES]);
+            else
+                fprintf(fp, " %6s", "-");
+        }
+    }
+    fputc('\n', fp);
+    return 0;
+}
+
+
+void
+perfprof_report(FILE * fp, int per_thread)
+{
+    int i;
+
+    pthread_once(&Once, once);
+
+    fprintf(fp, "%-32s %12s %10s", "region", "calls", "ns/call");
+    for (i = 0; i < PERFPROF_NCTR; i++) {
+        fprintf(fp, " %12s", CtrNames[i]);
+        if (i == PERFPROF_CYCLES) fprintf(fp, " %6s", "IPC");
+    }
+    fprintf(fp, "\n");
+
+    perfprof_walk(per_thread, print_stats, fp);
+}
+
+
+void
+perfprof_reset(void)
+{
+    pthr ** pp;
+    pthr * t;
+
+    pthread_mutex_lock(&Lock);
+    for (pp = &Threads; (t = *pp); ) {
+        if (t->exited) {
+            *pp = t->next;
+            DEL(t);
+            continue;
+        }
+
+        memset(t->acc, 0, sizeof t->acc);
+        pp = &t->next;
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/* EOF */
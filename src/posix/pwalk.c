@@ -0,0 +1,967 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * pwalk.c - Parallel directory tree walker.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Each worker owns a deque of directories waiting to be scanned.
+ * It pushes the sub-directories it finds to the tail of its own
+ * deque and pops from the tail (depth first, good locality); idle
+ * workers steal from the head of other deques (breadth first; big
+ * subtrees near the root). A global count of pending directories
+ * tells the workers when the walk is done.
+ *
+ * In ordered mode, workers buffer the sorted entries of each
+ * directory in the directory node; the calling thread walks the
+ * resulting tree in pre-order, waiting for each directory to be
+ * scanned before delivering its entries.
+ *
+ * Notes
+ * =====
+ * o Ordered mode scans ahead of delivery. Once PW_HIWAT entries
+ *   are buffered the workers stall; if the directory the deliverer
+ *   waits for is still queued then, it scans it itself (with a
+ *   deque of its own that the workers steal from).
+ * o A directory node is then shared between the tree and a deque:
+ *   'claimed' makes sure only one thread scans it and 'refs' that
+ *   the last of the two frees it.
+ * o PWALK_SKIP marks the child; a scan checks the marks of its
+ *   ancestors before it opens a directory and between getdents
+ *   batches, so a skipped subtree stops being read right away.
+ * o The root is opened without O_NOFOLLOW: pwalk() stat()s it, so
+ *   a symlink to a directory is walked as that directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "posix/pwalk.h"
+
+
+/* Size of the getdents64() buffer per thread */
+#define PW_DENTBUF      (256 * 1024)
+
+/* Idle rounds before a worker starts sleeping between steals */
+#define PW_SPINS        16
+
+/* Ordered mode: buffered entries at which the workers stall */
+#define PW_HIWAT        (64 * 1024)
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC       0
+#endif
+
+struct pw_dir;
+
+/*
+ * Buffered entry of a directory in ordered mode.
+ */
+struct pw_item
+{
+    union {
+        size_t       off;   /* offset into names while scanning */
+        const char * name;  /* .. and pointer once scan is done */
+    };
+
+    int type;
+    int err;
+    struct stat st;
+
+    struct pw_dir * child;
+};
+typedef struct pw_item pw_item;
+
+
+/*
+ * A directory to be scanned.
+ */
+struct pw_dir
+{
+    char * path;
+    int    depth;
+    int    err;
+
+    atomic_int done;
+    atomic_int skip;
+    atomic_int claimed;
+    atomic_int refs;
+
+    /* Only used in ordered mode */
+    struct pw_dir * parent;
+
+    pw_item * ents;
+    size_t    nents;
+    size_t    entcap;
+
+    char *    names;
+    size_t    namelen;
+    size_t    namecap;
+};
+typedef struct pw_dir pw_dir;
+
+
+/*
+ * Mutex protected deque of directories.
+ */
+struct pw_deque
+{
+    pthread_mutex_t lock;
+
+    pw_dir ** v;
+    size_t    head;
+    size_t    tail;
+    size_t    cap;
+};
+typedef struct pw_deque pw_deque;
+
+
+struct pw_walk;
+
+struct pw_thread
+{
+    struct pw_walk * w;
+    int       id;
+    pthread_t tid;
+
+    pw_deque  q;
+
+    char *    path;
+    size_t    pathcap;
+
+    uint8_t * dbuf;
+};
+typedef struct pw_thread pw_thread;
+
+
+struct pw_walk
+{
+    pwalk_fn  fn;
+    void *    ctx;
+    unsigned  flags;
+    dev_t     dev;
+
+    pw_thread * thr;
+    int         nthreads;
+    int         nq;         /* deques: workers' and the deliverer's */
+
+    atomic_long pending;
+    atomic_long nbuf;       /* ordered mode: buffered entries */
+    atomic_int  abort;
+    atomic_int  rv;
+
+    /* Ordered mode: signals directory completion */
+    pthread_mutex_t olock;
+    pthread_cond_t  ocond;
+
+    char *    path;
+    size_t    pathcap;
+};
+typedef struct pw_walk pw_walk;
+
+
+
+static int
+dq_init(pw_deque* q)
+{
+    memset(q, 0, sizeof *q);
+    return -pthread_mutex_init(&q->lock, 0);
+}
+
+
+static int
+dq_push(pw_deque* q, pw_dir* d)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->v, q->v + q->head, (q->tail - q->head) * sizeof q->v[0]);
+            q->tail -= q->head;
+            q->head  = 0;
+        } else {
+            size_t n    = q->cap ? 2 * q->cap : 256;
+            pw_dir** nv = RENEWA(pw_dir*, q->v, n);
+
+            if (nv) {
+                q->v   = nv;
+                q->cap = n;
+            } else {
+                r = -ENOMEM;
+            }
+        }
+    }
+
+    if (r == 0) q->v[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+
+static pw_dir*
+dq_pop(pw_deque* q)
+{
+    pw_dir* d = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        d = q->v[--q->tail];
+        if (q->tail == q->head) q->tail = q->head = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+
+static pw_dir*
+dq_steal(pw_deque* q)
+{
+    pw_dir* d = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) d = q->v[q->head++];
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+
+static void
+dq_fini(pw_deque* q)
+{
+    pthread_mutex_destroy(&q->lock);
+    DEL(q->v);
+}
+
+
+
+/*
+ * Join 'dir' and 'name' into the growable buffer '*pbuf'.
+ */
+static char*
+pw_join(char** pbuf, size_t* pcap, const char* dir, const char* name)
+{
+    size_t dn = strlen(dir),
+           nn = strlen(name),
+           n  = dn + nn + 2;
+    char*  p;
+
+    if (n > *pcap) {
+        char* nb = RENEWA(char, *pbuf, n + 256);
+        if (!nb) return 0;
+
+        *pbuf = nb;
+        *pcap = n + 256;
+    }
+
+    p = *pbuf;
+    memcpy(p, dir, dn);
+    if (dn > 0 && p[dn-1] != '/') p[dn++] = '/';
+    memcpy(p+dn, name, nn+1);
+    return p;
+}
+
+
+static const char*
+pw_basename(const char* path)
+{
+    const char* p = strrchr(path, '/');
+
+    return (p && p[1]) ? p+1 : path;
+}
+
+
+static pw_dir*
+pw_dir_new(const char* path, int depth, pw_dir* parent, int refs)
+{
+    pw_dir* d = NEWZ(pw_dir);
+
+    if (!d) return 0;
+
+    if (!(d->path = strdup(path))) {
+        DEL(d);
+        return 0;
+    }
+
+    d->depth  = depth;
+    d->parent = parent;
+    atomic_init(&d->done, 0);
+    atomic_init(&d->skip, 0);
+    atomic_init(&d->claimed, 0);
+    atomic_init(&d->refs, refs);
+    return d;
+}
+
+
+static void
+pw_dir_free(pw_dir* d)
+{
+    DEL(d->ents);
+    DEL(d->names);
+    DEL(d->path);
+    DEL(d);
+}
+
+
+static void
+pw_unref(pw_dir* d)
+{
+    if (atomic_fetch_sub(&d->refs, 1) == 1) pw_dir_free(d);
+}
+
+
+/*
+ * Claim 'd' for scanning; only one thread wins.
+ */
+static int
+pw_claim(pw_dir* d)
+{
+    return atomic_exchange(&d->claimed, 1) == 0;
+}
+
+
+/*
+ * Is 'd' or one of its ancestors skipped? The ancestors outlive
+ * the scan of 'd': the deliverer waits for it before freeing them.
+ */
+static int
+pw_skipped(const pw_dir* d)
+{
+    for (; d; d = d->parent) {
+        if (atomic_load_explicit(&d->skip, memory_order_relaxed)) return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Free a (partially delivered) tree of ordered mode directories.
+ */
+static void
+pw_tree_free(pw_dir* d)
+{
+    size_t i;
+
+    for (i = 0; i < d->nents; i++) {
+        if (d->ents[i].child) pw_tree_free(d->ents[i].child);
+    }
+    pw_unref(d);
+}
+
+
+static void
+pw_abort(pw_walk* w, int rv)
+{
+    int zero = 0;
+
+    atomic_compare_exchange_strong(&w->rv, &zero, rv);
+    atomic_store(&w->abort, 1);
+
+    pthread_mutex_lock(&w->olock);
+    pthread_cond_broadcast(&w->ocond);
+    pthread_mutex_unlock(&w->olock);
+}
+
+
+
+/*
+ * Stat 'name' relative to 'fd', asking only for what the caller
+ * wants. Return 0 on success, -errno on failure.
+ */
+static int
+pw_stat(int fd, const char* name, unsigned flags, struct stat* st)
+{
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    unsigned mask = STATX_TYPE;
+    struct statx sx;
+
+    if (flags & PWALK_SIZE) mask |= STATX_SIZE | STATX_BLOCKS;
+    if (flags & PWALK_MODE) mask |= STATX_MODE | STATX_UID | STATX_GID | STATX_NLINK;
+    if (flags & PWALK_TIME) mask |= STATX_ATIME | STATX_MTIME | STATX_CTIME;
+    if (flags & PWALK_INO)  mask |= STATX_INO;
+
+    if (statx(fd, name, AT_SYMLINK_NOFOLLOW, mask, &sx) < 0)
+        return -errno;
+
+    st->st_mode    = sx.stx_mode;
+    st->st_dev     = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    st->st_ino     = sx.stx_ino;
+    st->st_nlink   = sx.stx_nlink;
+    st->st_uid     = sx.stx_uid;
+    st->st_gid     = sx.stx_gid;
+    st->st_size    = sx.stx_size;
+    st->st_blocks  = sx.stx_blocks;
+    st->st_blksize = sx.stx_blksize;
+
+    st->st_atim.tv_sec  = sx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec  = sx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec  = sx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+    return 0;
+#else
+    USEARG(flags);
+    return fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW) < 0 ? -errno : 0;
+#endif
+}
+
+
+/*
+ * Queue sub-directory 'path' of 'd' on thread 't'. In ordered mode
+ * the tree holds a second reference.
+ */
+static pw_dir*
+pw_queue(pw_thread* t, pw_dir* d, const char* path)
+{
+    int ordered = !!(t->w->flags & PWALK_ORDERED);
+    pw_dir* c   = pw_dir_new(path, d->depth+1, ordered ? d : 0, 1 + ordered);
+
+    if (!c) return 0;
+
+    atomic_fetch_add(&t->w->pending, 1);
+    if (dq_push(&t->q, c) < 0) {
+        atomic_fetch_sub(&t->w->pending, 1);
+        pw_dir_free(c);
+        return 0;
+    }
+    return c;
+}
+
+
+/*
+ * Process one entry 'name' of directory 'd' (open as 'fd').
+ * Return < 0 to stop the scan.
+ */
+static int
+pw_entry(pw_thread* t, pw_dir* d, int fd, const char* name, int type)
+{
+    pw_walk* w = t->w;
+    unsigned want = w->flags & PWALK_STAT;
+    pwalk_ent e;
+    char* path;
+    int descend;
+    int r;
+
+    e.err = 0;
+    if (want || type == DT_UNKNOWN || (type == DT_DIR && (w->flags & PWALK_XDEV))) {
+        if ((r = pw_stat(fd, name, want, &e.st)) < 0)
+            e.err = -r;
+        else if (type == DT_UNKNOWN)
+            type = IFTODT(e.st.st_mode);
+    }
+
+    descend = type == DT_DIR;
+    if (descend && (w->flags & PWALK_XDEV))
+        descend = e.err == 0 && e.st.st_dev == w->dev;
+
+    if (!(path = pw_join(&t->path, &t->pathcap, d->path, name)))
+        return -ENOMEM;
+
+    if (w->flags & PWALK_ORDERED) {
+        size_t n = strlen(name) + 1;
+        pw_item* it;
+
+        if (d->nents == d->entcap) {
+            size_t   nc = d->entcap ? 2 * d->entcap : 32;
+            pw_item* ni = RENEWA(pw_item, d->ents, nc);
+
+            if (!ni) return -ENOMEM;
+            d->ents   = ni;
+            d->entcap = nc;
+        }
+
+        if ((d->namelen + n) > d->namecap) {
+            size_t nc = 2 * (d->namecap + n);
+            char*  nn = RENEWA(char, d->names, nc);
+
+            if (!nn) return -ENOMEM;
+            d->names   = nn;
+            d->namecap = nc;
+        }
+
+        it        = &d->ents[d->nents++];
+        it->off   = d->namelen;
+        it->type  = type;
+        it->err   = e.err;
+        it->st    = e.st;
+        it->child = 0;
+
+        memcpy(d->names + d->namelen, name, n);
+        d->namelen += n;
+        atomic_fetch_add_explicit(&w->nbuf, 1, memory_order_relaxed);
+
+        if (descend && !(it->child = pw_queue(t, d, path)))
+            return -ENOMEM;
+
+        return 0;
+    }
+
+    e.path  = path;
+    e.name  = pw_basename(path);
+    e.dirfd = fd;
+    e.depth = d->depth + 1;
+    e.type  = type;
+
+    r = (*w->fn)(w->ctx, &e, t->id);
+    if (r < 0) {
+        pw_abort(w, r);
+        return r;
+    }
+
+    if (descend && r != PWALK_SKIP && !pw_queue(t, d, path))
+        return -ENOMEM;
+
+    return 0;
+}
+
+
+#ifdef __linux__
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t  d_off;
+    uint16_t d_reclen;
+    uint8_t  d_type;
+    char     d_name[];
+};
+
+
+static int
+pw_readdir(pw_thread* t, pw_dir* d, int fd)
+{
+    while (!atomic_load_explicit(&t->w->abort, memory_order_relaxed) && !pw_skipped(d)) {
+        long n = syscall(SYS_getdents64, fd, t->dbuf, PW_DENTBUF);
+        long off;
+
+        if (n < 0)  return -errno;
+        if (n == 0) break;
+
+        for (off = 0; off < n; ) {
+            struct linux_dirent64* de = (struct linux_dirent64*)(t->dbuf + off);
+            const char* nm = de->d_name;
+            int r;
+
+            off += de->d_reclen;
+            if (nm[0] == '.' && (nm[1] == 0 || (nm[1] == '.' && nm[2] == 0)))
+                continue;
+
+            if ((r = pw_entry(t, d, fd, nm, de->d_type)) < 0)
+                return r;
+        }
+    }
+    return 0;
+}
+
+#else
+
+static int
+pw_readdir(pw_thread* t, pw_dir* d, int fd)
+{
+    int dfd = dup(fd);
+    struct dirent* de;
+    DIR* dir;
+    int r = 0;
+
+    if (dfd < 0) return -errno;
+    if (!(dir = fdopendir(dfd))) {
+        r = -errno;
+        close(dfd);
+        return r;
+    }
+
+    while (!atomic_load_explicit(&t->w->abort, memory_order_relaxed) && !pw_skipped(d)) {
+        const char* nm;
+
+        errno = 0;
+        if (!(de = readdir(dir))) {
+            r = -errno;
+            break;
+        }
+
+        nm = de->d_name;
+        if (nm[0] == '.' && (nm[1] == 0 || (nm[1] == '.' && nm[2] == 0)))
+            continue;
+
+        if ((r = pw_entry(t, d, fd, nm, de->d_type)) < 0)
+            break;
+    }
+
+    closedir(dir);
+    return r;
+}
+
+#endif /* __linux__ */
+
+
+static int
+pw_cmp(const void* a, const void* b)
+{
+    const pw_item* x = (const pw_item*)a;
+    const pw_item* y = (const pw_item*)b;
+
+    return strcmp(x->name, y->name);
+}
+
+
+/*
+ * Scan one directory; the caller has claimed it and frees it.
+ */
+static void
+pw_scan(pw_thread* t, pw_dir* d)
+{
+    pw_walk* w = t->w;
+    int fl = O_RDONLY|O_DIRECTORY|O_CLOEXEC;
+    int fd = -1;
+    int r  = 0;
+
+    if (pw_skipped(d)) goto done;
+
+    if (d->depth > 0) fl |= O_NOFOLLOW;
+
+    fd = open(d->path, fl);
+    if (fd < 0) {
+        r = -errno;
+    } else {
+        r = pw_readdir(t, d, fd);
+        close(fd);
+    }
+
+    /* Aborts are already recorded; only report I/O errors. */
+    if (r < 0 && !atomic_load(&w->abort)) {
+        d->err = -r;
+
+        if (!(w->flags & PWALK_ORDERED)) {
+            pwalk_ent e;
+
+            memset(&e, 0, sizeof e);
+            e.path  = d->path;
+            e.name  = pw_basename(d->path);
+            e.dirfd = -1;
+            e.depth = d->depth;
+            e.type  = DT_DIR;
+            e.err   = d->err;
+
+            if ((r = (*w->fn)(w->ctx, &e, t->id)) < 0)
+                pw_abort(w, r);
+        }
+    }
+
+done:
+    if (w->flags & PWALK_ORDERED) {
+        size_t i;
+
+        for (i = 0; i < d->nents; i++)
+            d->ents[i].name = d->names + d->ents[i].off;
+
+        qsort(d->ents, d->nents, sizeof d->ents[0], pw_cmp);
+
+        pthread_mutex_lock(&w->olock);
+        atomic_store(&d->done, 1);
+        pthread_cond_broadcast(&w->ocond);
+        pthread_mutex_unlock(&w->olock);
+    }
+}
+
+
+static void*
+pw_worker(void* p)
+{
+    pw_thread* t = (pw_thread*)p;
+    pw_walk* w   = t->w;
+    int idle     = 0;
+    int stalled  = 0;
+
+    while (!atomic_load_explicit(&w->abort, memory_order_relaxed)) {
+        pw_dir* d;
+        int i;
+
+        /* Ordered mode: let the deliverer catch up */
+        if ((w->flags & PWALK_ORDERED) && atomic_load(&w->nbuf) >= PW_HIWAT) {
+            if (atomic_load(&w->pending) == 0) break;
+
+            if (!stalled) {
+                /* The deliverer may be waiting on a queued dir */
+                stalled = 1;
+                pthread_mutex_lock(&w->olock);
+                pthread_cond_broadcast(&w->ocond);
+                pthread_mutex_unlock(&w->olock);
+            }
+            usleep(50);
+            continue;
+        }
+        stalled = 0;
+
+        d = dq_pop(&t->q);
+        for (i = 1; !d && i < w->nq; i++)
+            d = dq_steal(&w->thr[(t->id + i) % w->nq].q);
+
+        if (!d) {
+            if (atomic_load(&w->pending) == 0) break;
+
+            if (++idle < PW_SPINS)
+                sched_yield();
+            else
+                usleep(50);
+            continue;
+        }
+
+        idle = 0;
+        if (pw_claim(d)) pw_scan(t, d);
+        pw_unref(d);
+        atomic_fetch_sub(&w->pending, 1);
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for 'd' to be scanned. If it is skipped or the workers have
+ * stalled and it is still queued, scan it here instead.
+ */
+static void
+pw_wait(pw_walk* w, pw_dir* d, int quiet)
+{
+    pthread_mutex_lock(&w->olock);
+    while (!atomic_load(&d->done) && !atomic_load(&w->abort)) {
+        if (quiet || atomic_load(&w->nbuf) >= PW_HIWAT) {
+            /*
+             * 'd' is queued or being scanned, so pending is not 0;
+             * count ourselves before the worker that pops 'd' lets
+             * go of it, so the workers stay for its children.
+             */
+            atomic_fetch_add(&w->pending, 1);
+            if (pw_claim(d)) {
+                pthread_mutex_unlock(&w->olock);
+                pw_scan(&w->thr[w->nthreads], d);
+                atomic_fetch_sub(&w->pending, 1);
+                pthread_mutex_lock(&w->olock);
+                continue;
+            }
+            atomic_fetch_sub(&w->pending, 1);
+        }
+        pthread_cond_wait(&w->ocond, &w->olock);
+    }
+    pthread_mutex_unlock(&w->olock);
+}
+
+
+/*
+ * Deliver the entries of 'd' and its descendants in order. Returns
+ * 0 when 'd' has been delivered and released, < 0 on abort (the
+ * undelivered part of the tree is left for pw_tree_free()).
+ */
+static int
+pw_deliver(pw_walk* w, pw_dir* d, int quiet)
+{
+    size_t i;
+
+    pw_wait(w, d, quiet);
+
+    if (atomic_load(&w->abort)) return -1;
+
+    if (d->err && !quiet) {
+        pwalk_ent e;
+        int r;
+
+        memset(&e, 0, sizeof e);
+        e.path  = d->path;
+        e.name  = pw_basename(d->path);
+        e.dirfd = -1;
+        e.depth = d->depth;
+        e.type  = DT_DIR;
+        e.err   = d->err;
+
+        if ((r = (*w->fn)(w->ctx, &e, 0)) < 0) {
+            pw_abort(w, r);
+            return r;
+        }
+    }
+
+    for (i = 0; i < d->nents; i++) {
+        pw_item* it = &d->ents[i];
+        int r = 0;
+
+        if (!quiet) {
+            pwalk_ent e;
+
+            e.path  = pw_join(&w->path, &w->pathcap, d->path, it->name);
+            e.name  = it->name;
+            e.dirfd = -1;
+            e.depth = d->depth + 1;
+            e.type  = it->type;
+            e.err   = it->err;
+            e.st    = it->st;
+
+            if (!e.path) r = -ENOMEM;
+            else         r = (*w->fn)(w->ctx, &e, 0);
+
+            if (r < 0) {
+                pw_abort(w, r);
+                return r;
+            }
+        }
+
+        if (it->child) {
+            int skip = quiet || r == PWALK_SKIP;
+
+            if (skip) atomic_store(&it->child->skip, 1);
+            if (pw_deliver(w, it->child, skip) < 0)
+                return -1;
+
+            it->child = 0;
+        }
+    }
+
+    /* A worker may still hold 'd'; the entries can go now */
+    atomic_fetch_sub(&w->nbuf, (long)d->nents);
+    DEL(d->ents);
+    DEL(d->names);
+    d->nents = 0;
+    pw_unref(d);
+    return 0;
+}
+
+
+int
+pwalk(const char* root, int nthreads, unsigned int flags, pwalk_fn fn, void* ctx)
+{
+    pw_walk  wx;
+    pw_walk* w = &wx;
+    pw_dir*  rd;
+    pwalk_ent e;
+    int started = 0;
+    int i, r;
+
+    assert(fn);
+
+    memset(&e, 0, sizeof e);
+    if (stat(root, &e.st) < 0) return -errno;
+
+    e.path  = root;
+    e.name  = pw_basename(root);
+    e.dirfd = AT_FDCWD;
+    e.type  = IFTODT(e.st.st_mode);
+
+    r = (*fn)(ctx, &e, 0);
+    if (r < 0)                             return r;
+    if (r == PWALK_SKIP || e.type != DT_DIR) return 0;
+
+    if (nthreads <= 0) nthreads = sys_cpu_getavail();
+    if (nthreads <= 0) nthreads = 1;
+
+    memset(w, 0, sizeof *w);
+    w->fn       = fn;
+    w->ctx      = ctx;
+    w->flags    = flags;
+    w->dev      = e.st.st_dev;
+    w->nthreads = nthreads;
+    w->nq       = nthreads + 1;
+
+    atomic_init(&w->pending, 0);
+    atomic_init(&w->nbuf, 0);
+    atomic_init(&w->abort, 0);
+    atomic_init(&w->rv, 0);
+    pthread_mutex_init(&w->olock, 0);
+    pthread_cond_init(&w->ocond, 0);
+
+    if (!(w->thr = NEWZA(pw_thread, w->nq))) return -ENOMEM;
+
+    if (!(rd = pw_dir_new(root, 0, 0, 1))) {
+        r = -ENOMEM;
+        goto end;
+    }
+
+    /* The last one is the deliverer's, in ordered mode */
+    for (i = 0; i < w->nq; i++) {
+        pw_thread* t = &w->thr[i];
+
+        t->w  = w;
+        t->id = i;
+        dq_init(&t->q);
+
+        if (!(t->dbuf = NEWA(uint8_t, PW_DENTBUF))) {
+            r = -ENOMEM;
+            goto end;
+        }
+    }
+
+    atomic_store(&w->pending, 1);
+    dq_push(&w->thr[0].q, rd);
+
+    /*
+     * The queue now holds 'rd'; in ordered mode so does the tree
+     * under it, until delivered.
+     */
+    if (flags & PWALK_ORDERED) atomic_fetch_add(&rd->refs, 1);
+    else                       rd = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        pw_thread* t = &w->thr[i];
+
+        if ((r = pthread_create(&t->tid, 0, pw_worker, t)) != 0) {
+            pw_abort(w, -r);
+            break;
+        }
+        started++;
+    }
+
+    if ((flags & PWALK_ORDERED) && started == nthreads) {
+        if (pw_deliver(w, rd, 0) == 0) rd = 0;
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(w->thr[i].tid, 0);
+
+    r = atomic_load(&w->rv);
+
+end:
+    for (i = 0; i < w->nq; i++) {
+        pw_thread* t = &w->thr[i];
+        pw_dir* d;
+
+        if (!t->w) continue;
+
+        /* Drop the references of whatever is still queued */
+        while ((d = dq_pop(&t->q))) pw_unref(d);
+
+        dq_fini(&t->q);
+        DEL(t->dbuf);
+        DEL(t->path);
+    }
+
+    if (rd) pw_tree_free(rd);
+
+    pthread_mutex_destroy(&w->olock);
+    pthread_cond_destroy(&w->ocond);
+    DEL(w->thr);
+    DEL(w->path);
+    return r;
+}
+
+/* EOF */
@@ -0,0 +1,652 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * shmq.cpp - Bounded inter-process queues in shared memory.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in utils/shmq.h.
+ * o  Positions are 64-bit counts that never wrap; the slot is the
+ *    position modulo the (power of 2) number of slots.
+ * o  Sleep/wake-up: a waiter sets the 'sleeping' futex word of its
+ *    side, checks the queue once more and sleeps while the word is
+ *    still set. The other side publishes, fences and - only if the
+ *    word is set - clears it and wakes all the sleepers. Either the
+ *    waiter sees the message (space) or the other side sees the
+ *    waiter; and a burst of messages costs one wake-up call.
+ * o  Sleeps are cut into SHMQ_SLICE ms slices; a waiter that wasn't
+ *    woken for a slice checks that the other side is still alive.
+ * o  Peer entries are 'pid << 32 | role'. An entry is claimed with
+ *    role 0, locked and then given its role: an entry with a role
+ *    and no lock is dead. A claimed entry without a role is dead if
+ *    its pid is gone.
+ * o  Creating a queue write-locks the whole peer table first: the
+ *    lock fails while any peer holds its entry's lock. A valid
+ *    header with a live claimed entry is also in use.
+ * o  Deadlines are on clk_us() (CLOCK_MONOTONIC), not the wall
+ *    clock, so that a clock step doesn't cut or stretch a wait.
+ */
+#include "utils/shmq.h"
+#include "utils/utils.h"
+#include "utils/clock.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif /* __linux__ */
+
+using namespace std;
+using namespace putils;
+
+#define SHMQ_MAGIC      0x65756575716d6873ULL   // "shmqueue"
+
+// Spins before sleeping; and ms slice of a sleep
+#define SHMQ_SPIN       2048
+#define SHMQ_SLICE      100
+
+#define SHMQ_SLOTHDR    16
+
+#define __CL            __attribute__((aligned(64)))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __pause()       __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define __pause()       __asm__ __volatile__("yield")
+#else
+#define __pause()       do { } while (0)
+#endif
+
+#define _load(p, o)         __atomic_load_n(p, __ATOMIC_##o)
+#define _store(p, v, o)     __atomic_store_n(p, v, __ATOMIC_##o)
+#define _cas(p, e, v)       __atomic_compare_exchange_n(p, e, v, false, \
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+#ifdef F_OFD_SETLK
+#define _SETLK          F_OFD_SETLK
+#define _GETLK          F_OFD_GETLK
+#else
+#define _SETLK          F_SETLK
+#define _GETLK          F_GETLK
+#endif /* F_OFD_SETLK */
+
+namespace putils {
+
+// Slot: seq, len and the message
+struct shmq_slot
+{
+    uint64_t seq;       // MPMC
+    uint32_t len;
+    uint32_t pad;
+};
+
+
+// The shared header. Everything here is a size or an offset.
+struct shmq_hdr
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdrsize;
+
+    uint32_t type;
+    uint32_t elsize;
+    uint32_t nelem;
+    uint32_t slotsize;
+    uint64_t dataoff;
+    uint64_t mapsize;
+
+    // Producers: position; and set if some wait for space
+    uint64_t wr       __CL;
+    uint32_t psleep;
+
+    // Consumers: position; and set if some wait for messages
+    uint64_t rd       __CL;
+    uint32_t csleep;
+
+    // Attached processes; 'pid << 32 | role'
+    uint64_t peer[SHMQ_MAXPEERS] __CL;
+};
+
+
+#ifdef __linux__
+static int
+futex_wait(uint32_t * p, uint32_t v, uint64_t us)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = time_t(us / 1000000);
+    ts.tv_nsec = long(us % 1000000) * 1000;
+    return ::syscall(SYS_futex, p, FUTEX_WAIT, v, &ts, 0, 0) < 0 ? -errno : 0;
+}
+
+static void
+futex_wake(uint32_t * p)
+{
+    ::syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+#else
+
+// Poll the futex word
+static int
+futex_wait(uint32_t * p, uint32_t v, uint64_t us)
+{
+    ::usleep(us < 1000 ? useconds_t(us) : 1000);
+    return _load(p, ACQUIRE) == v ? -ETIMEDOUT : 0;
+}
+
+static void
+futex_wake(uint32_t *)
+{
+}
+#endif /* __linux__ */
+
+
+// Byte of the file that entry 'i' of the peer table locks
+static inline off_t
+lockoff(int i)
+{
+    return off_t(offsetof(shmq_hdr, peer) + i * sizeof(uint64_t));
+}
+
+
+// Lock (F_WRLCK) or unlock the whole peer table
+static int
+lockpeers(int fd, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof fl);
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = lockoff(0);
+    fl.l_len    = SHMQ_MAXPEERS * sizeof(uint64_t);
+    return ::fcntl(fd, _SETLK, &fl);
+}
+
+
+static inline uint32_t
+pow2(uint32_t n)
+{
+    uint32_t v = 2;
+
+    while (v < n) v <<= 1;
+    return v;
+}
+
+
+shm_queue::shm_queue(const string& fn, unsigned int type, uint32_t nelem,
+                     uint32_t elsize, unsigned int role)
+        : m_file(fn, MMAP_CREATE | MMAP_RDWR | MMAP_SHARED),
+          m_hdr(0),
+          m_data(0),
+          m_peer(-1),
+          m_rcache(0),
+          m_wcache(0)
+{
+    if ( (type != SHMQ_SPSC && type != SHMQ_MPMC) ||
+         nelem == 0 || nelem > (1U << 30) ||
+         elsize == 0 || elsize > (1U << 24) )
+        throw sys_exception(geterror(EINVAL), "%s: bad queue geometry", fn.c_str());
+
+    nelem = pow2(nelem);
+
+    uint32_t slotsize = align_up(SHMQ_SLOTHDR + elsize, 64U);
+    uint64_t dataoff  = align_up(sizeof(shmq_hdr), mmap_file::pagesize());
+    uint64_t mapsize  = dataoff + uint64_t(nelem) * slotsize;
+
+    const char * f = fn.c_str();
+
+    // Nobody may be attached while we re-initialize
+    if ( lockpeers(m_file.fd(), F_WRLCK) < 0 ) {
+        if ( errno == EACCES || errno == EAGAIN )
+            throw sys_exception(geterror(EBUSY), "%s: queue in use", f);
+        throw sys_exception(geterror(errno), "%s: can't lock queue", f);
+    }
+
+    shmq_hdr * h = (shmq_hdr *)m_file.mmap(0, size_t(mapsize));
+
+    // Claimed entries aren't locked yet; and process locks never
+    // conflict with our own.
+    m_hdr = h;
+    if ( _load(&h->magic, ACQUIRE) == SHMQ_MAGIC ) {
+        for (int i = 0; i < SHMQ_MAXPEERS; i++) {
+            if ( alive(i) ) {
+                lockpeers(m_file.fd(), F_UNLCK);
+                throw sys_exception(geterror(EBUSY), "%s: queue in use", f);
+            }
+        }
+    }
+
+    // Attachers check the magic last: make it invalid until the
+    // rest is written.
+    _store(&h->magic, 0, RELEASE);
+    memset((uint8_t *)h + sizeof h->magic, 0, sizeof *h - sizeof h->magic);
+
+    h->version  = SHMQ_VERSION;
+    h->hdrsize  = sizeof *h;
+    h->type     = type;
+    h->elsize   = elsize;
+    h->nelem    = nelem;
+    h->slotsize = slotsize;
+    h->dataoff  = dataoff;
+    h->mapsize  = mapsize;
+
+    m_data     = (uint8_t *)h + dataoff;
+    m_mask     = nelem - 1;
+    m_slotsize = slotsize;
+    m_elsize   = elsize;
+    m_type     = type;
+    m_spin     = ::sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    for (uint32_t i = 0; i < nelem; i++) {
+        shmq_slot * s = (shmq_slot *)slot(i);
+
+        s->seq = i;
+        s->len = 0;
+    }
+
+    _store(&h->magic, SHMQ_MAGIC, RELEASE);
+    lockpeers(m_file.fd(), F_UNLCK);
+
+    attach(role);
+}
+
+
+shm_queue::shm_queue(const string& fn, unsigned int role)
+        : m_file(fn, MMAP_RDWR | MMAP_SHARED),
+          m_hdr(0),
+          m_data(0),
+          m_peer(-1),
+          m_rcache(0),
+          m_wcache(0)
+{
+    const char * f = fn.c_str();
+
+    if ( m_file.filesize() < off_t(sizeof(shmq_hdr)) )
+        throw sys_exception(geterror(EINVAL), "%s: not a shared queue", f);
+
+    shmq_hdr * h = (shmq_hdr *)m_file.mmap(0, sizeof(shmq_hdr));
+    shmq_hdr   c;
+
+    uint64_t magic = _load(&h->magic, ACQUIRE);
+    memcpy(&c, h, sizeof c);
+    m_file.unmap(h);
+
+    if ( magic != SHMQ_MAGIC )
+        throw sys_exception(geterror(EINVAL), "%s: not a shared queue", f);
+
+    if ( c.version != SHMQ_VERSION || c.hdrsize != sizeof c )
+        throw sys_exception(geterror(EINVAL), "%s: queue version %u, want %u",
+                            f, c.version, SHMQ_VERSION);
+
+    if ( (c.type != SHMQ_SPSC && c.type != SHMQ_MPMC) ||
+         c.nelem < 2 || (c.nelem & (c.nelem - 1)) ||
+         c.slotsize != align_up(SHMQ_SLOTHDR + c.elsize, 64U) ||
+         c.dataoff < sizeof c || (c.dataoff & 63) ||
+         c.mapsize != c.dataoff + uint64_t(c.nelem) * c.slotsize ||
+         off_t(c.mapsize) > m_file.filesize() )
+        throw sys_exception(geterror(EINVAL), "%s: corrupt queue header", f);
+
+    h = (shmq_hdr *)m_file.mmap(0, size_t(c.mapsize));
+
+    m_hdr      = h;
+    m_data     = (uint8_t *)h + c.dataoff;
+    m_mask     = c.nelem - 1;
+    m_slotsize = c.slotsize;
+    m_elsize   = c.elsize;
+    m_type     = c.type;
+    m_spin     = ::sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    attach(role);
+}
+
+
+shm_queue::~shm_queue()
+{
+    detach();
+}
+
+
+// Claim and lock an entry of the peer table. The lock goes away
+// with our file descriptor.
+void
+shm_queue::attach(unsigned int role)
+{
+    uint64_t pid = uint64_t(::getpid()) << 32;
+
+    // Calibrate the deadline clock now, not in the first wait
+    clk_ns();
+
+    for (int tries = 0; tries < 2; tries++) {
+        for (int i = 0; i < SHMQ_MAXPEERS; i++) {
+            uint64_t z = 0;
+
+            if ( !_cas(&m_hdr->peer[i], &z, pid) )
+                continue;
+
+            struct flock fl;
+
+            memset(&fl, 0, sizeof fl);
+            fl.l_type   = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start  = lockoff(i);
+            fl.l_len    = 1;
+            if ( ::fcntl(m_file.fd(), _SETLK, &fl) < 0 ) {
+                _store(&m_hdr->peer[i], 0, RELEASE);
+                continue;
+            }
+
+            _store(&m_hdr->peer[i], pid | role, RELEASE);
+            m_peer = i;
+            return;
+        }
+
+        // Make room by clearing the dead
+        peers(0);
+    }
+
+    throw sys_exception(geterror(ENOSPC), "%s: too many processes attached",
+                        m_file.filename().c_str());
+}
+
+
+// Leave the peer table and wake the sleepers, so that they can
+// see if we were their last peer.
+void
+shm_queue::detach()
+{
+    shmq_hdr * h = m_hdr;
+
+    if ( m_peer >= 0 )
+        _store(&h->peer[m_peer], 0, RELEASE);
+
+    _store(&h->psleep, 0, SEQ_CST);
+    _store(&h->csleep, 0, SEQ_CST);
+    futex_wake(&h->psleep);
+    futex_wake(&h->csleep);
+}
+
+
+bool
+shm_queue::alive(int i)
+{
+    uint64_t v   = _load(&m_hdr->peer[i], ACQUIRE);
+    pid_t    pid = pid_t(v >> 32);
+
+    if ( !v )
+        return false;
+
+    if ( i == m_peer )
+        return true;
+
+    // Claimed but not locked yet
+    if ( uint32_t(v) == 0 )
+        return !(::kill(pid, 0) < 0 && errno == ESRCH);
+
+#ifndef F_OFD_SETLK
+    // Process locks never conflict with our own
+    if ( pid == ::getpid() )
+        return true;
+#endif /* F_OFD_SETLK */
+
+    struct flock fl;
+
+    memset(&fl, 0, sizeof fl);
+    fl.l_type   = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = lockoff(i);
+    fl.l_len    = 1;
+    if ( ::fcntl(m_file.fd(), _GETLK, &fl) < 0 )
+        return true;
+
+    return fl.l_type != F_UNLCK;
+}
+
+
+int
+shm_queue::peers(unsigned int role)
+{
+    int n = 0;
+
+    for (int i = 0; i < SHMQ_MAXPEERS; i++) {
+        uint64_t v = _load(&m_hdr->peer[i], ACQUIRE);
+
+        if ( !v )
+            continue;
+
+        if ( alive(i) ) {
+            if ( uint32_t(v) & role )
+                n++;
+        } else {
+            // Fails if the entry changed since we looked
+            _cas(&m_hdr->peer[i], &v, 0);
+        }
+    }
+    return n;
+}
+
+
+size_t
+shm_queue::size() const
+{
+    uint64_t rd = _load(&m_hdr->rd, ACQUIRE),
+             wr = _load(&m_hdr->wr, ACQUIRE);
+
+    return wr > rd ? size_t(wr - rd) : 0;
+}
+
+
+// Publish-side half of the sleep/wake-up handshake
+inline void
+shm_queue::wake(uint32_t * sleep)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( _load(sleep, RELAXED) && __atomic_exchange_n(sleep, 0, __ATOMIC_SEQ_CST) )
+        futex_wake(sleep);
+}
+
+
+int
+shm_queue::put(const void * msg, size_t n)
+{
+    shmq_hdr * h = m_hdr;
+    shmq_slot * s;
+    uint64_t pos;
+
+    if ( n > m_elsize )
+        return -E2BIG;
+
+    pos = _load(&h->wr, RELAXED);
+    if ( m_type == SHMQ_SPSC ) {
+        if ( (pos - m_rcache) > m_mask ) {
+            m_rcache = _load(&h->rd, ACQUIRE);
+            if ( (pos - m_rcache) > m_mask )
+                return -EAGAIN;
+        }
+
+        s = (shmq_slot *)slot(pos);
+        s->len = uint32_t(n);
+        memcpy(s + 1, msg, n);
+        _store(&h->wr, pos + 1, RELEASE);
+    } else {
+        for (;;) {
+            s = (shmq_slot *)slot(pos);
+
+            int64_t d = int64_t(_load(&s->seq, ACQUIRE) - pos);
+            if ( d == 0 ) {
+                if ( __atomic_compare_exchange_n(&h->wr, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                    break;
+            } else if ( d < 0 ) {
+                return -EAGAIN;
+            } else {
+                pos = _load(&h->wr, RELAXED);
+            }
+        }
+
+        s->len = uint32_t(n);
+        memcpy(s + 1, msg, n);
+        _store(&s->seq, pos + 1, RELEASE);
+    }
+
+    wake(&h->csleep);
+    return 0;
+}
+
+
+ssize_t
+shm_queue::get(void * buf, size_t bufsz)
+{
+    shmq_hdr * h = m_hdr;
+    shmq_slot * s;
+    uint64_t pos;
+    size_t n;
+
+    pos = _load(&h->rd, RELAXED);
+    if ( m_type == SHMQ_SPSC ) {
+        if ( pos == m_wcache ) {
+            m_wcache = _load(&h->wr, ACQUIRE);
+            if ( pos == m_wcache )
+                return -EAGAIN;
+        }
+
+        s = (shmq_slot *)slot(pos);
+        n = s->len;
+        memcpy(buf, s + 1, min(n, bufsz));
+        _store(&h->rd, pos + 1, RELEASE);
+    } else {
+        for (;;) {
+            s = (shmq_slot *)slot(pos);
+
+            int64_t d = int64_t(_load(&s->seq, ACQUIRE) - (pos + 1));
+            if ( d == 0 ) {
+                if ( __atomic_compare_exchange_n(&h->rd, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                    break;
+            } else if ( d < 0 ) {
+                return -EAGAIN;
+            } else {
+                pos = _load(&h->rd, RELAXED);
+            }
+        }
+
+        n = s->len;
+        memcpy(buf, s + 1, min(n, bufsz));
+        _store(&s->seq, pos + m_mask + 1, RELEASE);
+    }
+
+    wake(&h->psleep);
+    return ssize_t(n);
+}
+
+
+// There is space (put) or a message (!put); a guess
+inline bool
+shm_queue::ready(bool put) const
+{
+    uint64_t rd = _load(&m_hdr->rd, SEQ_CST),
+             wr = _load(&m_hdr->wr, SEQ_CST);
+
+    return put ? (wr - rd) <= m_mask : wr != rd;
+}
+
+
+/*
+ * Sleep until woken, the deadline or the end of a slice. Returns 0
+ * to try again, -ETIMEDOUT or -EPIPE if no peer of the other side
+ * is alive.
+ *
+ * 'put' says what we wait for: space (true) or a message.
+ */
+int
+shm_queue::wait(uint32_t * sleep, bool put, uint64_t deadline)
+{
+    uint64_t now  = clk_us(),
+             us   = SHMQ_SLICE * 1000;
+
+    if ( deadline ) {
+        if ( now >= deadline )
+            return -ETIMEDOUT;
+        us = min(us, deadline - now);
+    }
+
+    _store(sleep, 1, SEQ_CST);
+    if ( ready(put) )
+        return 0;
+
+    int r = futex_wait(sleep, 1, us);
+
+    // Woken for nothing (a peer detached) or not woken for a whole
+    // slice: is anyone there?
+    if ( !ready(put) && (r != -ETIMEDOUT || (clk_us() - now) >= us) ) {
+        if ( peers(put ? SHMQ_CONSUMER : SHMQ_PRODUCER) == 0 )
+            return -EPIPE;
+    }
+    return 0;
+}
+
+
+int
+shm_queue::put_wait(const void * msg, size_t n, int timeout)
+{
+    uint64_t deadline = timeout < 0 ? 0 : clk_us() + uint64_t(timeout) * 1000 + 1;
+    int spin = m_spin && timeout ? SHMQ_SPIN : 0;
+    int r;
+
+    while ( (r = put(msg, n)) == -EAGAIN ) {
+        if ( spin > 0 ) {
+            spin--;
+            __pause();
+            continue;
+        }
+
+        if ( (r = wait(&m_hdr->psleep, true, deadline)) < 0 )
+            return r;
+    }
+    return r;
+}
+
+
+ssize_t
+shm_queue::get_wait(void * buf, size_t bufsz, int timeout)
+{
+    uint64_t deadline = timeout < 0 ? 0 : clk_us() + uint64_t(timeout) * 1000 + 1;
+    int spin = m_spin && timeout ? SHMQ_SPIN : 0;
+    ssize_t r;
+
+    while ( (r = get(buf, bufsz)) == -EAGAIN ) {
+        if ( spin > 0 ) {
+            spin--;
+            __pause();
+            continue;
+        }
+
+        int e = wait(&m_hdr->csleep, false, deadline);
+        if ( e < 0 )
+            return e;
+    }
+    return r;
+}
+
+}
+
+/* EOF */
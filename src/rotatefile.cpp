@@ -24,6 +24,10 @@
 
 #include "utils/rotatefile.h"
 
+#ifndef _WIN32
+#include "posix/fcopy.h"
+#endif
+
 using namespace std;
 using namespace putils;
 
@@ -61,13 +65,29 @@ delete_old(const string& fn, int start, int end)
 }
 
 
+// Copy the live file to 'f' and truncate it; writers keep their fd.
+// Writes that land between the copy and the truncate are lost (see
+// ROTATE_COPYTRUNCATE).
+static int
+copy_truncate(const string& filename, const string& f)
+{
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    int r = fcopy_file(0, f.c_str(), filename.c_str());
+    if (r < 0) return r;
+
+    if (::truncate(filename.c_str(), 0) < 0) return -errno;
+    return 0;
+#endif
+}
+
+
 /**
  * Unconditionally rotate a file and keep the last 'nsaved' copies.
- * Flags is currently unused. It can be used to communicate things
- * like "compress" etc.
  */
 int
-rotate_filename(const string& filename, int nsaved, unsigned int)
+rotate_filename(const string& filename, int nsaved, unsigned int flags)
 {
     // Delete older files upto a max of 100 extra files
     delete_old(filename, nsaved, nsaved+500);
@@ -96,6 +116,8 @@ rotate_filename(const string& filename, int nsaved, unsigned int)
 
     if (r > 0) {
         string f = filename + ".0";
+
+        if (flags & ROTATE_COPYTRUNCATE) return copy_truncate(filename, f);
         if (::rename(filename.c_str(), f.c_str()) < 0) return -errno;
     }
 
@@ -105,8 +127,6 @@ rotate_filename(const string& filename, int nsaved, unsigned int)
 
 /**
  * Rotate a file if it exceeds size_mb MBytes and keep the last 'nsaved' copies.
- * Flags is currently unused. It can be used to communicate things
- * like "compress" etc.
  */
 int
 rotate_filename_by_size(const string& filename, int nsaved,
@@ -0,0 +1,470 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * shard.c - Jump hash, hash ring, Maglev and rendezvous hashing.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in shard.h.
+ *
+ * o  Node ids are run through the murmur3 finalizer before use, so
+ *    that sequential ids make good ring tokens and Maglev
+ *    permutations.
+ *
+ * o  The batched ring lookup runs the binary searches of 8 keys in
+ *    lock step; every search takes the same number of steps (the
+ *    ring size decides it), so the loads of the 8 keys are
+ *    independent and their cache misses overlap.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+
+#include "utils/shard.h"
+#include "utils/utils.h"
+
+
+// murmur3 finalizer
+static inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+
+/*
+ * Jump consistent hash
+ */
+
+uint32_t
+jump_hash(uint64_t key, uint32_t n)
+{
+    int64_t b = -1,
+            j = 0;
+
+    while (j < (int64_t)n) {
+        b   = j;
+        key = key * 2862933555777941757ULL + 1;
+        j   = (int64_t)((double)(b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (uint32_t)b;
+}
+
+
+void
+jump_hash_v(const uint64_t *keys, uint32_t *out, size_t nkeys, uint32_t n)
+{
+    size_t i;
+
+    for (i = 0; i < nkeys; i++) out[i] = jump_hash(keys[i], n);
+}
+
+
+
+/*
+ * Consistent hash ring
+ */
+
+struct token
+{
+    uint64_t tok;
+    uint32_t node;
+};
+
+static int
+by_token(const void *a, const void *b)
+{
+    const struct token *x = a,
+                       *y = b;
+
+    if (x->tok != y->tok) return x->tok < y->tok ? -1 : 1;
+
+    // Ties are (very) rare; but the order must not depend on qsort
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+
+int
+hashring_init(hashring *r, const uint64_t *ids, const uint32_t *wt,
+              uint32_t n, uint32_t vnodes)
+{
+    struct token *t;
+    uint64_t ntok = 0;
+    uint32_t i, j, k;
+
+    memset(r, 0, sizeof *r);
+
+    for (i = 0; i < n; i++) ntok += (uint64_t)vnodes * (wt ? wt[i] : 1);
+    if (ntok == 0 || ntok > UINT32_MAX) return -EINVAL;
+
+    t       = NEWA(struct token, ntok);
+    r->tok  = NEWA(uint64_t, ntok);
+    r->node = NEWA(uint32_t, ntok);
+    if (!t || !r->tok || !r->node) {
+        DEL(t);
+        hashring_fini(r);
+        return -ENOMEM;
+    }
+
+    for (k = i = 0; i < n; i++) {
+        uint64_t h   = mix(ids[i]);
+        uint32_t nv  = vnodes * (wt ? wt[i] : 1);
+
+        for (j = 0; j < nv; j++, k++) {
+            t[k].tok  = mix(h + (j + 1) * 0x9e3779b97f4a7c15ULL);
+            t[k].node = i;
+        }
+    }
+
+    qsort(t, ntok, sizeof t[0], by_token);
+    for (k = 0; k < ntok; k++) {
+        r->tok[k]  = t[k].tok;
+        r->node[k] = t[k].node;
+    }
+
+    r->ntok   = (uint32_t)ntok;
+    r->nnodes = n;
+    DEL(t);
+    return 0;
+}
+
+
+void
+hashring_fini(hashring *r)
+{
+    DEL(r->tok);
+    DEL(r->node);
+    r->ntok = r->nnodes = 0;
+}
+
+
+uint32_t
+hashring_lookup(const hashring *r, uint64_t key)
+{
+    const uint64_t *base = r->tok;
+    uint32_t n = r->ntok,
+             i;
+
+    // lower bound: first token >= key
+    while (n > 1) {
+        uint32_t half = n / 2;
+
+        base = base[half - 1] < key ? base + half : base;
+        n   -= half;
+    }
+
+    i = (uint32_t)(base - r->tok) + (*base < key);
+    return r->node[i == r->ntok ? 0 : i];
+}
+
+
+#define RING_BATCH      8
+
+void
+hashring_lookup_v(const hashring *r, const uint64_t *keys, uint32_t *out, size_t nkeys)
+{
+    const uint64_t *base[RING_BATCH];
+    size_t i = 0;
+    int j;
+
+    for (; (i + RING_BATCH) <= nkeys; i += RING_BATCH) {
+        const uint64_t *k = keys + i;
+        uint32_t n = r->ntok;
+
+        for (j = 0; j < RING_BATCH; j++) base[j] = r->tok;
+
+        while (n > 1) {
+            uint32_t half = n / 2;
+
+            for (j = 0; j < RING_BATCH; j++) {
+                base[j] = base[j][half - 1] < k[j] ? base[j] + half : base[j];
+                __builtin_prefetch(base[j] + (n - half) / 2);
+            }
+            n -= half;
+        }
+
+        for (j = 0; j < RING_BATCH; j++) {
+            uint32_t x = (uint32_t)(base[j] - r->tok) + (*base[j] < k[j]);
+
+            out[i + j] = r->node[x == r->ntok ? 0 : x];
+        }
+    }
+
+    for (; i < nkeys; i++) out[i] = hashring_lookup(r, keys[i]);
+}
+
+
+
+/*
+ * Maglev
+ */
+
+static int
+is_prime(uint32_t m)
+{
+    uint32_t d;
+
+    if (m < 2)      return 0;
+    if (m < 4)      return 1;
+    if (!(m & 1))   return 0;
+
+    for (d = 3; (uint64_t)d * d <= m; d += 2) {
+        if ((m % d) == 0) return 0;
+    }
+    return 1;
+}
+
+
+int
+maglev_init(maglev *g, const uint64_t *ids, const uint32_t *wt, uint32_t n, uint32_t m)
+{
+    uint32_t *off, *skip, *next;
+    uint64_t *credit;
+    uint32_t i, maxw = 0, nw = 0, filled = 0;
+
+    memset(g, 0, sizeof *g);
+
+    for (i = 0; i < n; i++) {
+        uint32_t w = wt ? wt[i] : 1;
+
+        if (w > maxw) maxw = w;
+        if (w)        nw++;
+    }
+    if (nw == 0 || m < nw || !is_prime(m)) return -EINVAL;
+
+    g->tab = NEWA(uint32_t, m);
+    off    = NEWA(uint32_t, n);
+    skip   = NEWA(uint32_t, n);
+    next   = NEWZA(uint32_t, n);
+    credit = NEWZA(uint64_t, n);
+    if (!g->tab || !off || !skip || !next || !credit) {
+        DEL(g->tab);
+        DEL(off);
+        DEL(skip);
+        DEL(next);
+        DEL(credit);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t h = mix(ids[i]);
+
+        off[i]  = (uint32_t)((h >> 32) % m);
+        skip[i] = m > 1 ? (uint32_t)((h & 0xffffffff) % (m - 1)) + 1 : 1;
+    }
+    memset(g->tab, 0xff, m * sizeof g->tab[0]);
+
+    /*
+     * Each turn, every node earns w/maxw of a slot and claims the
+     * next free slot of its permutation for every whole slot it has
+     * earned; the heaviest nodes claim one slot per turn.
+     */
+    while (filled < m) {
+        for (i = 0; i < n && filled < m; i++) {
+            credit[i] += wt ? wt[i] : 1;
+
+            while (credit[i] >= maxw && filled < m) {
+                uint32_t c;
+
+                do {
+                    c = (uint32_t)((off[i] + (uint64_t)next[i] * skip[i]) % m);
+                    next[i]++;
+                } while (g->tab[c] != UINT32_MAX);
+
+                g->tab[c]  = i;
+                credit[i] -= maxw;
+                filled++;
+            }
+        }
+    }
+
+    g->m      = m;
+    g->nnodes = n;
+
+    DEL(off);
+    DEL(skip);
+    DEL(next);
+    DEL(credit);
+    return 0;
+}
+
+
+void
+maglev_fini(maglev *g)
+{
+    DEL(g->tab);
+    g->m = g->nnodes = 0;
+}
+
+
+void
+maglev_lookup_v(const maglev *g, const uint64_t *keys, uint32_t *out, size_t nkeys)
+{
+    size_t i;
+
+    for (i = 0; i < nkeys; i++) out[i] = maglev_lookup(g, keys[i]);
+}
+
+
+
+/*
+ * Weighted rendezvous hashing
+ *
+ * Node i scores key k with u = U(0,1) from hash(k, i) as
+ * w_i / -ln(u); -ln(u) is exponentially distributed, so the best
+ * score is node i with probability w_i / sum(w). We keep the
+ * reciprocal -ln(u) / w_i and pick the smallest. With equal weights
+ * that is the largest hash.
+ */
+
+static inline uint64_t
+score_hash(const hrw *h, uint64_t key, uint32_t i)
+{
+    return mix(key ^ h->seed[i]);
+}
+
+static inline double
+score(const hrw *h, uint64_t key, uint32_t i)
+{
+    double u = ((double)(score_hash(h, key, i) >> 11) + 0.5) * 0x1.0p-53;
+
+    return -log(u) / h->wt[i];
+}
+
+
+int
+hrw_init(hrw *h, const uint64_t *ids, const double *wt, uint32_t n)
+{
+    uint32_t i, k;
+
+    memset(h, 0, sizeof *h);
+
+    h->seed = NEWA(uint64_t, n ? n : 1);
+    h->wt   = NEWA(double,   n ? n : 1);
+    if (!h->seed || !h->wt) {
+        hrw_fini(h);
+        return -ENOMEM;
+    }
+
+    // Nodes of weight 0 keep their index but never win
+    h->uniform = 1;
+    for (k = i = 0; i < n; i++) {
+        double w = wt ? wt[i] : 1.0;
+
+        h->seed[i] = mix(ids[i]);
+        h->wt[i]   = w > 0.0 ? w : 0.0;
+        if (h->wt[i] > 0.0)   k++;
+        if (h->wt[i] != h->wt[0] || h->wt[i] == 0.0) h->uniform = 0;
+    }
+
+    if (k == 0) {
+        hrw_fini(h);
+        return -EINVAL;
+    }
+
+    h->nnodes = n;
+    return 0;
+}
+
+
+void
+hrw_fini(hrw *h)
+{
+    DEL(h->seed);
+    DEL(h->wt);
+    h->nnodes = 0;
+}
+
+
+// True if node 'i' beats node 'j' for 'key'; ties go to the lower index
+static inline int
+better(const hrw *h, uint64_t key, uint32_t i, uint32_t j)
+{
+    if (h->uniform) {
+        uint64_t x = score_hash(h, key, i),
+                 y = score_hash(h, key, j);
+
+        return x > y || (x == y && i < j);
+    } else {
+        double x = score(h, key, i),
+               y = score(h, key, j);
+
+        return x < y || (x == y && i < j);
+    }
+}
+
+
+uint32_t
+hrw_lookup(const hrw *h, uint64_t key)
+{
+    uint32_t i, best = 0;
+
+    if (h->uniform) {
+        uint64_t m = score_hash(h, key, 0);
+
+        for (i = 1; i < h->nnodes; i++) {
+            uint64_t x = score_hash(h, key, i);
+
+            if (x > m) { m = x; best = i; }
+        }
+    } else {
+        double m = HUGE_VAL;
+
+        for (i = 0; i < h->nnodes; i++) {
+            double s;
+
+            if (h->wt[i] == 0.0) continue;
+
+            s = score(h, key, i);
+            if (s < m) { m = s; best = i; }
+        }
+    }
+    return best;
+}
+
+
+void
+hrw_lookup_v(const hrw *h, const uint64_t *keys, uint32_t *out, size_t nkeys)
+{
+    size_t i;
+
+    for (i = 0; i < nkeys; i++) out[i] = hrw_lookup(h, keys[i]);
+}
+
+
+uint32_t
+hrw_lookup_k(const hrw *h, uint64_t key, uint32_t *out, uint32_t k)
+{
+    uint32_t i, j, n = 0;
+
+    // insertion into the k best so far (k is small)
+    for (i = 0; i < h->nnodes; i++) {
+        if (h->wt[i] == 0.0) continue;
+        if (n == k && (k == 0 || !better(h, key, i, out[n-1]))) continue;
+        if (n < k) n++;
+
+        for (j = n - 1; j > 0 && better(h, key, i, out[j-1]); j--) out[j] = out[j-1];
+        out[j] = i;
+    }
+    return n;
+}
+
+/* EOF */
@@ -0,0 +1,224 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * topk.c - Space-Saving heavy hitters (top-k) tracker.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  See commentary in topk.h.
+ * o  Nodes never move; the heap is an array of node pointers and
+ *    each node knows its heap position, so a bumped count is a
+ *    sift-down from where the node is (minheap.h can't do that).
+ * o  Counts only grow, so a node never needs to sift up - except
+ *    when it is first added at the bottom of the heap.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils/topk.h"
+#include "utils/utils.h"
+
+
+static inline void
+swap(topk *t, uint32_t a, uint32_t b)
+{
+    topk_node *x = t->heap[a];
+
+    t->heap[a] = t->heap[b];
+    t->heap[b] = x;
+    t->heap[a]->pos = a;
+    t->heap[b]->pos = b;
+}
+
+
+static void
+siftdown(topk *t, uint32_t i)
+{
+    for (;;) {
+        uint32_t l = 2 * i + 1,
+                 r = l + 1,
+                 j = i;
+
+        if (l < t->n && t->heap[l]->it.count < t->heap[j]->it.count) j = l;
+        if (r < t->n && t->heap[r]->it.count < t->heap[j]->it.count) j = r;
+        if (j == i) return;
+
+        swap(t, i, j);
+        i = j;
+    }
+}
+
+
+static void
+siftup(topk *t, uint32_t i)
+{
+    while (i > 0) {
+        uint32_t p = (i - 1) / 2;
+
+        if (t->heap[p]->it.count <= t->heap[i]->it.count) return;
+
+        swap(t, i, p);
+        i = p;
+    }
+}
+
+
+int
+topk_init(topk *t, uint32_t m)
+{
+    uint32_t nlog2 = 1;
+
+    if (m == 0) return -EINVAL;
+
+    memset(t, 0, sizeof *t);
+    t->m     = m;
+    t->nodes = NEWZA(topk_node, m);
+    t->heap  = NEWZA(topk_node *, m);
+
+    while ((1u << nlog2) < m && nlog2 < 31) nlog2++;
+    ht_init(&t->idx, nlog2);
+
+    if (!t->nodes || !t->heap || !t->idx.b) {
+        topk_fini(t);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+
+void
+topk_fini(topk *t)
+{
+    if (t->idx.b) ht_fini(&t->idx);
+
+    DEL(t->nodes);
+    DEL(t->heap);
+    memset(t, 0, sizeof *t);
+}
+
+
+topk *
+topk_new(uint32_t m)
+{
+    topk *t = NEW(topk);
+
+    if (!t) return 0;
+    if (topk_init(t, m) < 0) {
+        DEL(t);
+        return 0;
+    }
+    return t;
+}
+
+
+void
+topk_delete(topk *t)
+{
+    topk_fini(t);
+    DEL(t);
+}
+
+
+uint64_t
+topk_add(topk *t, uint64_t key, uint64_t w)
+{
+    topk_node *x;
+    void *v;
+
+    if (!key) key = 1;
+
+    t->total += w;
+
+    if (ht_find(&t->idx, key, &v)) {
+        x = v;
+        x->it.count += w;
+        siftdown(t, x->pos);
+        return x->it.count;
+    }
+
+    if (t->n < t->m) {
+        x = &t->nodes[t->n];
+        x->it.key   = key;
+        x->it.count = w;
+        x->it.err   = 0;
+        x->pos      = t->n;
+
+        t->heap[t->n++] = x;
+        siftup(t, x->pos);
+        ht_probe(&t->idx, key, x);
+        return w;
+    }
+
+    // Replace the item with the smallest count
+    x = t->heap[0];
+    ht_remove(&t->idx, x->it.key, &v);
+
+    x->it.key    = key;
+    x->it.err    = x->it.count;
+    x->it.count += w;
+    ht_probe(&t->idx, key, x);
+    siftdown(t, 0);
+    return x->it.count;
+}
+
+
+int
+topk_find(topk *t, uint64_t key, topk_item *it)
+{
+    void *v;
+
+    if (!key) key = 1;
+    if (!ht_find(&t->idx, key, &v)) return 0;
+
+    *it = ((topk_node *)v)->it;
+    return 1;
+}
+
+
+static int
+by_count(const void *a, const void *b)
+{
+    const topk_item *x = a,
+                    *y = b;
+
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    if (x->err   != y->err)   return x->err   > y->err   ? 1 : -1;
+    return 0;
+}
+
+
+size_t
+topk_list(topk *t, topk_item *out, size_t n)
+{
+    topk_item *v;
+    uint32_t i;
+
+    if (t->n == 0 || n == 0) return 0;
+
+    v = NEWA(topk_item, t->n);
+    if (!v) return 0;
+
+    for (i = 0; i < t->n; i++) v[i] = t->nodes[i].it;
+    qsort(v, t->n, sizeof v[0], by_count);
+
+    if (n > t->n) n = t->n;
+    memcpy(out, v, n * sizeof v[0]);
+    DEL(v);
+    return n;
+}
+
+/* EOF */
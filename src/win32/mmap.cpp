@@ -88,7 +88,7 @@ mmap_file::~mmap_file()
                           end = m_mappings.end();
     while (i != end)
     {
-        const mapping& m = *i;
+        const mapping& m = i->second;
         UnmapViewOfFile(m.ptr);
         ++i;
     }
@@ -98,7 +98,10 @@ mmap_file::~mmap_file()
 void *
 mmap_file::mmap(unsigned long long off, unsigned long size)
 {
-    void * ptr = find(off, size);
+    // The mapping options are only hints here, but key the cache
+    // the way the POSIX backend does
+    unsigned int opts = m_flags & MMAP_OPTS_MASK;
+    void * ptr = find(off, size, opts, -1);
 
     if ( ptr )
         return ptr;
@@ -155,9 +158,7 @@ mmap_file::mmap(unsigned long long off, unsigned long size)
     if ( !ptr )
         throw sys_exception(geterror(), "Can't mmap '%s'", fn());
 
-    mapping m(ptr, size, off);
-
-    m_mappings.push_back(m);
+    add_mapping(ptr, size, off, opts, -1);
 
     CloseHandle(mh);
 
@@ -165,6 +166,16 @@ mmap_file::mmap(unsigned long long off, unsigned long size)
 }
 
 
+// Mapping options are not supported on Win32
+void *
+mmap_file::mmap(off_t off, size_t size, unsigned int opts, int numa_node)
+{
+    USEARG(opts);
+    USEARG(numa_node);
+    return mmap(off, size);
+}
+
+
 void
 mmap_file::unmap(void * ptr)
 {
@@ -174,6 +185,32 @@ mmap_file::unmap(void * ptr)
 }
 
 
+// Access pattern advice has no Win32 equivalent
+void
+mmap_file::advise(void * ptr, size_t n, unsigned int opts)
+{
+    USEARG(ptr);
+    USEARG(n);
+    USEARG(opts);
+}
+
+
+void
+mmap_file::prefetch(off_t off, size_t n)
+{
+    USEARG(off);
+    USEARG(n);
+}
+
+
+void
+mmap_file::drop(off_t off, size_t n)
+{
+    USEARG(off);
+    USEARG(n);
+}
+
+
 // lock and unlock memory
 void
 mmap_file::mlock(void * ptr, unsigned long n)
@@ -33,7 +33,7 @@ z_buf_compress_init (z_buf_context * zc, int lev, int wbits)
     assert (zc->process_output);
 
     if ( lev <= 0 || lev > 9 )
-        lev = 5;
+        lev = Z_BUF_DEFAULT_LEVEL;
 
     if ( wbits <= 4 || wbits > 15 )
         wbits = 15;
@@ -0,0 +1,630 @@
+/* :vi:ts=4:sw=4:
+ *
+ * zbuf_par.c - parallel (pigz style) zlib buffer interface.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Creation date: Sat Jan 16 10:41:22 2016
+ *
+ * Redistribution permitted under the same terms as the original
+ * zlib library.
+ *
+ * Blocks of input are handed to a job_manager; the calling thread
+ * waits for each block in order, writes it out and keeps the
+ * pipeline topped up so that only a bounded number of blocks are in
+ * memory at any time.
+ */
+
+#include "zlib/zbuf.h"
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#include "posix/job.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "fast/encdec.h"
+
+
+/* deflate window; also the size of the dictionary we carry over */
+#define ZPAR_WINDOW     32768
+
+/* Size of a Z_PAR_MEMBERS gzip header and trailer */
+#define ZPAR_HDRSZ      20
+#define ZPAR_TRLSZ      8
+
+/* Worst case expansion of deflate; used to sanity check ISIZE */
+#define ZPAR_MAXRATIO   1032
+
+
+/*
+ * One block of work. The input is a slice of the caller's buffer;
+ * the output is allocated by the worker and released by the
+ * calling thread after it is written out.
+ */
+struct zpar_blk
+{
+    const Byte * in;
+    uInt         inlen;
+
+    const Byte * dict;
+    uInt         dictlen;
+
+    Byte *       out;
+    uInt         outlen;
+
+    uLong        check;
+    int          last;
+    int          err;
+
+    sem_t        done;
+};
+typedef struct zpar_blk zpar_blk;
+
+
+/*
+ * State shared by all workers of one parallel session.
+ */
+struct zpar
+{
+    int level;
+    int format;
+
+    /* z_streams are recycled across blocks via deflateReset() */
+    z_stream_pool * pool;
+};
+typedef struct zpar zpar;
+
+
+/*
+ * Drain 'n' bytes to the output processor.
+ */
+static int
+zpar_emit (z_buf_context * zc, const void * p, size_t n)
+{
+    Byte * b = (Byte *)p;
+
+    while ( n > 0 )
+    {
+        int want = n > INT_MAX ? INT_MAX : (int)n;
+        int used = (*zc->process_output) (zc->opaq, b, want);
+
+        if ( used <= 0 )
+            return Z_MEM_ERROR;
+
+        b += used;
+        n -= used;
+    }
+    return Z_OK;
+}
+
+
+/*
+ * Worker: raw-deflate one block. Non-final blocks of a single
+ * stream end with a sync flush so they land on a byte boundary and
+ * can be concatenated.
+ */
+static int
+zpar_deflate (void * ctx, void * j, int cpu)
+{
+    zpar     * zp = (zpar *)ctx;
+    zpar_blk * b  = (zpar_blk *)j;
+    int flush     = b->last || zp->format == Z_PAR_MEMBERS ? Z_FINISH : Z_SYNC_FLUSH;
+    uLong  sz;
+    z_stream * zs;
+    int err;
+
+    USEARG(cpu);
+
+    if ( zp->format == Z_PAR_ZLIB )
+        b->check = adler32 (adler32 (0, 0, 0), b->in, b->inlen);
+    else
+        b->check = crc32 (crc32 (0, 0, 0), b->in, b->inlen);
+
+    zs = z_stream_pool_deflate (zp->pool, zp->level, -15);
+    if ( !zs )
+    {
+        err = Z_MEM_ERROR;
+        goto done;
+    }
+
+    if ( b->dictlen > 0 )
+    {
+        err = deflateSetDictionary (zs, b->dict, b->dictlen);
+        if ( err != Z_OK )
+            goto end;
+    }
+
+    sz     = deflateBound (zs, b->inlen) + 16;
+    b->out = NEWA(Byte, sz);
+    if ( !b->out )
+    {
+        err = Z_MEM_ERROR;
+        goto end;
+    }
+
+    zs->next_in   = (Bytef *)b->in;
+    zs->avail_in  = b->inlen;
+    zs->next_out  = b->out;
+    zs->avail_out = sz;
+
+    while (1)
+    {
+        err = deflate (zs, flush);
+        if ( err == Z_STREAM_END )
+            break;
+
+        if ( err != Z_OK )
+            goto end;
+
+        if ( flush == Z_SYNC_FLUSH && zs->avail_out > 0 )
+            break;
+
+        /* Out of room; deflateBound() should make this rare. */
+        if ( zs->avail_out == 0 )
+        {
+            Byte * nb = RENEWA(Byte, b->out, 2 * sz);
+            if ( !nb )
+            {
+                err = Z_MEM_ERROR;
+                goto end;
+            }
+
+            b->out        = nb;
+            zs->next_out  = nb + sz;
+            zs->avail_out = sz;
+            sz           *= 2;
+        }
+    }
+
+    b->outlen = zs->total_out;
+    err       = Z_OK;
+
+end:
+    z_stream_pool_put (zp->pool, zs);
+
+done:
+    b->err = err;
+    sem_post (&b->done);
+    return err == Z_OK ? 0 : -1;
+}
+
+
+/*
+ * Worker: inflate one Z_PAR_MEMBERS member. The member boundaries
+ * and ISIZE have already been validated by the caller.
+ */
+static int
+zpar_inflate (void * ctx, void * j, int cpu)
+{
+    zpar     * zp = (zpar *)ctx;
+    zpar_blk * b  = (zpar_blk *)j;
+    z_stream * zs;
+    int err;
+
+    USEARG(cpu);
+
+    /* One byte of slack lets inflate see the end of the stream. */
+    b->out = NEWA(Byte, b->outlen + 1);
+    if ( !b->out )
+    {
+        err = Z_MEM_ERROR;
+        goto done;
+    }
+
+    zs = z_stream_pool_inflate (zp->pool, -15);
+    if ( !zs )
+    {
+        err = Z_MEM_ERROR;
+        goto done;
+    }
+
+    zs->next_in   = (Bytef *)b->in;
+    zs->avail_in  = b->inlen;
+    zs->next_out  = b->out;
+    zs->avail_out = b->outlen + 1;
+
+    err = inflate (zs, Z_FINISH);
+    if ( err == Z_STREAM_END )
+    {
+        if ( zs->total_out != b->outlen ||
+             crc32 (crc32 (0, 0, 0), b->out, b->outlen) != b->check )
+            err = Z_DATA_ERROR;
+        else
+            err = Z_OK;
+    }
+    else if ( err == Z_OK || err == Z_BUF_ERROR )
+        err = Z_DATA_ERROR;
+
+    z_stream_pool_put (zp->pool, zs);
+
+done:
+    b->err = err;
+    sem_post (&b->done);
+    return err == Z_OK ? 0 : -1;
+}
+
+
+/*
+ * Write the gzip header of a Z_PAR_MEMBERS member that holds 'clen'
+ * bytes of compressed data.
+ */
+static Byte *
+zpar_member_hdr (Byte * p, uInt clen)
+{
+    static const Byte fixed[] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3 };
+
+    memcpy (p, fixed, sizeof fixed);
+    p = enc_LE_u16 (p + sizeof fixed, 8);
+    *p++ = 'P';
+    *p++ = 'Z';
+    p = enc_LE_u16 (p, 4);
+    return enc_LE_u32 (p, clen + ZPAR_HDRSZ + ZPAR_TRLSZ);
+}
+
+
+/*
+ * Parse a Z_PAR_MEMBERS header at 'p' with 'rem' bytes available.
+ * Return total member size or 0 if this isn't one of our members.
+ */
+static size_t
+zpar_member_size (const Byte * p, size_t rem)
+{
+    size_t sz;
+
+    if ( rem < ZPAR_HDRSZ + ZPAR_TRLSZ )
+        return 0;
+
+    if ( p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 4 )
+        return 0;
+
+    if ( dec_LE_u16 (p+10) != 8 || p[12] != 'P' || p[13] != 'Z' ||
+         dec_LE_u16 (p+14) != 4 )
+        return 0;
+
+    sz = dec_LE_u32 (p+16);
+    if ( sz < ZPAR_HDRSZ + ZPAR_TRLSZ || sz > rem )
+        return 0;
+
+    return sz;
+}
+
+
+/*
+ * Run 'nblk' blocks through 'func' on 'nthreads' workers and call
+ * 'out' on each finished block in order. No more than 2 x nthreads
+ * blocks are outstanding at any time.
+ */
+typedef int (*zpar_out_t) (z_buf_context *, zpar *, zpar_blk *);
+
+static int
+zpar_run (z_buf_context * zc, zpar * zp, zpar_blk * blks, size_t nblk,
+          int nthreads, jobfunc_t func, zpar_out_t out)
+{
+    job_manager jm;
+    size_t i, nsub = 0, window;
+    int err = Z_OK;
+    int r;
+
+    if ( nthreads <= 0 )
+        nthreads = sys_cpu_getavail ();
+
+    if ( (size_t)nthreads > nblk )
+        nthreads = nblk;
+
+    window = 2 * nthreads;
+    if ( window > JOB_MAX )
+        window = JOB_MAX;
+
+    if ( !(zp->pool = z_stream_pool_new (nthreads)) )
+        return Z_MEM_ERROR;
+
+    r = job_manager_init (&jm, nthreads, func, zp);
+    if ( r <= 0 )
+    {
+        // No threads: stop the ones that did start and run the
+        // blocks here, one at a time
+        job_manager_wait (&jm);
+        job_manager_destroy (&jm);
+
+        for (i = 0; i < nblk && err == Z_OK; i++)
+        {
+            zpar_blk * b = &blks[i];
+
+            sem_init (&b->done, 0, 0);
+            (*func) (zp, b, 0);
+            sem_wait (&b->done);
+            sem_destroy (&b->done);
+
+            err = b->err != Z_OK ? b->err : (*out) (zc, zp, b);
+            DEL (b->out);
+        }
+
+        z_stream_pool_delete (zp->pool);
+        return err;
+    }
+
+    for (i = 0; i < nblk; i++)
+    {
+        zpar_blk * b = &blks[i];
+
+        while ( err == Z_OK && nsub < nblk && nsub < i + window )
+        {
+            sem_init (&blks[nsub].done, 0, 0);
+            job_manager_submit_job (&jm, &blks[nsub]);
+            nsub++;
+        }
+
+        if ( i >= nsub )
+            break;
+
+        sem_wait (&b->done);
+        sem_destroy (&b->done);
+
+        if ( err == Z_OK )
+            err = b->err != Z_OK ? b->err : (*out) (zc, zp, b);
+
+        DEL (b->out);
+    }
+
+    job_manager_wait (&jm);
+    job_manager_destroy (&jm);
+    z_stream_pool_delete (zp->pool);
+
+    return err;
+}
+
+
+static int
+zpar_out_deflate (z_buf_context * zc, zpar * zp, zpar_blk * b)
+{
+    int err;
+
+    if ( zp->format == Z_PAR_MEMBERS )
+    {
+        Byte hdr[ZPAR_HDRSZ];
+        Byte trl[ZPAR_TRLSZ];
+
+        zpar_member_hdr (hdr, b->outlen);
+        enc_LE_u32 (enc_LE_u32 (trl, b->check), b->inlen);
+
+        if ( (err = zpar_emit (zc, hdr, sizeof hdr)) != Z_OK )
+            return err;
+        if ( (err = zpar_emit (zc, b->out, b->outlen)) != Z_OK )
+            return err;
+        if ( (err = zpar_emit (zc, trl, sizeof trl)) != Z_OK )
+            return err;
+
+        zc->z.total_out += sizeof hdr + sizeof trl;
+    }
+    else
+    {
+        if ( (err = zpar_emit (zc, b->out, b->outlen)) != Z_OK )
+            return err;
+    }
+
+    if ( zp->format == Z_PAR_ZLIB )
+        zc->z.adler = adler32_combine (zc->z.adler, b->check, b->inlen);
+    else
+        zc->z.adler = crc32_combine (zc->z.adler, b->check, b->inlen);
+
+    zc->z.total_in  += b->inlen;
+    zc->z.total_out += b->outlen;
+    return Z_OK;
+}
+
+
+static int
+zpar_out_inflate (z_buf_context * zc, zpar * zp, zpar_blk * b)
+{
+    int err;
+
+    USEARG(zp);
+
+    if ( (err = zpar_emit (zc, b->out, b->outlen)) != Z_OK )
+        return err;
+
+    zc->z.adler      = crc32_combine (zc->z.adler, b->check, b->outlen);
+    zc->z.total_in  += b->inlen + ZPAR_HDRSZ + ZPAR_TRLSZ;
+    zc->z.total_out += b->outlen;
+    return Z_OK;
+}
+
+
+/*
+ * Compress 'len' bytes in 'buf' in parallel.
+ */
+int
+z_buf_par_compress (z_buf_context * zc, const z_par_opt * opt,
+                    const void * buf, size_t len)
+{
+    const Byte * in = (const Byte *)buf;
+    z_par_opt o     = { Z_BUF_DEFAULT_LEVEL, 0, Z_PAR_GZIP, 0 };
+    zpar_blk * blks;
+    size_t i, nblk;
+    zpar zp;
+    Byte hdr[16];
+    Byte * p = hdr;
+    int err;
+
+    assert (zc);
+    assert (zc->process_output);
+
+    if ( opt )
+        o = *opt;
+
+    if ( o.level < 0 || o.level > 9 )
+        o.level = Z_BUF_DEFAULT_LEVEL;
+
+    if ( o.blksize == 0 )
+        o.blksize = Z_PAR_BLKSIZE;
+
+    if ( o.blksize < ZPAR_WINDOW )
+        o.blksize = ZPAR_WINDOW;
+
+    if ( o.format < Z_PAR_ZLIB || o.format > Z_PAR_MEMBERS )
+        return Z_STREAM_ERROR;
+
+    nblk = len == 0 ? 1 : (len + o.blksize - 1) / o.blksize;
+    blks = NEWZA(zpar_blk, nblk);
+    if ( !blks )
+        return Z_MEM_ERROR;
+
+    for (i = 0; i < nblk; i++)
+    {
+        zpar_blk * b = &blks[i];
+        size_t off   = i * o.blksize;
+
+        b->in    = in + off;
+        b->inlen = len - off > o.blksize ? o.blksize : len - off;
+        b->last  = i == nblk - 1;
+
+        if ( i > 0 && o.format != Z_PAR_MEMBERS )
+        {
+            b->dictlen = ZPAR_WINDOW;
+            b->dict    = b->in - ZPAR_WINDOW;
+        }
+    }
+
+    zp.level  = o.level;
+    zp.format = o.format;
+
+    zc->z.total_in  = 0;
+    zc->z.total_out = 0;
+
+    /* Single stream formats get one header up front */
+    switch (o.format)
+    {
+        case Z_PAR_ZLIB:
+        {
+            int lvl = o.level <= 1 ? 0 : o.level < 6 ? 1 : o.level == 6 ? 2 : 3;
+            int flg = lvl << 6;
+
+            flg += 31 - ((0x78 << 8) + flg) % 31;
+            *p++ = 0x78;
+            *p++ = flg;
+            zc->z.adler = adler32 (0, 0, 0);
+            break;
+        }
+
+        case Z_PAR_GZIP:
+        {
+            static const Byte fixed[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+            memcpy (p, fixed, sizeof fixed);
+            p += sizeof fixed;
+            zc->z.adler = crc32 (0, 0, 0);
+            break;
+        }
+
+        default:
+            zc->z.adler = crc32 (0, 0, 0);
+            break;
+    }
+
+    if ( (err = zpar_emit (zc, hdr, p - hdr)) != Z_OK )
+        goto done;
+
+    zc->z.total_out = p - hdr;
+
+    err = zpar_run (zc, &zp, blks, nblk, o.nthreads, zpar_deflate, zpar_out_deflate);
+    if ( err != Z_OK )
+        goto done;
+
+    /* .. and one trailer at the end */
+    p = hdr;
+    if ( o.format == Z_PAR_ZLIB )
+        p = enc_BE_u32 (p, zc->z.adler);
+    else if ( o.format == Z_PAR_GZIP )
+        p = enc_LE_u32 (enc_LE_u32 (p, zc->z.adler), (uint32_t)len);
+
+    if ( (err = zpar_emit (zc, hdr, p - hdr)) == Z_OK )
+        zc->z.total_out += p - hdr;
+
+done:
+    DEL (blks);
+    return err;
+}
+
+
+
+/*
+ * Uncompress a Z_PAR_MEMBERS stream in parallel.
+ */
+int
+z_buf_par_uncompress (z_buf_context * zc, int nthreads, const void * buf,
+                      size_t len)
+{
+    const Byte * in = (const Byte *)buf;
+    zpar_blk * blks = 0;
+    size_t off, nblk = 0, nalloc = 0;
+    zpar zp;
+    int err;
+
+    assert (zc);
+    assert (zc->process_output);
+
+    for (off = 0; off < len; )
+    {
+        size_t sz = zpar_member_size (in + off, len - off);
+        zpar_blk * b;
+        uint32_t isz;
+
+        if ( sz == 0 )
+        {
+            DEL (blks);
+            return Z_DATA_ERROR;
+        }
+
+        /* Reject absurd ISIZE before anyone allocates for it. */
+        isz = dec_LE_u32 (in + off + sz - 4);
+        if ( isz > (sz - ZPAR_HDRSZ - ZPAR_TRLSZ) * ZPAR_MAXRATIO + 64 )
+        {
+            DEL (blks);
+            return Z_DATA_ERROR;
+        }
+
+        if ( nblk == nalloc )
+        {
+            zpar_blk * nb;
+
+            nalloc = nalloc ? 2 * nalloc : 64;
+            nb     = RENEWA(zpar_blk, blks, nalloc);
+            if ( !nb )
+            {
+                DEL (blks);
+                return Z_MEM_ERROR;
+            }
+            blks = nb;
+        }
+
+        b = &blks[nblk++];
+        memset (b, 0, sizeof *b);
+        b->in     = in + off + ZPAR_HDRSZ;
+        b->inlen  = sz - ZPAR_HDRSZ - ZPAR_TRLSZ;
+        b->check  = dec_LE_u32 (in + off + sz - 8);
+        b->outlen = isz;
+
+        off += sz;
+    }
+
+    if ( nblk == 0 )
+        return Z_DATA_ERROR;
+
+    zp.level  = 0;
+    zp.format = Z_PAR_MEMBERS;
+
+    zc->z.total_in  = 0;
+    zc->z.total_out = 0;
+    zc->z.adler     = crc32 (0, 0, 0);
+
+    err = zpar_run (zc, &zp, blks, nblk, nthreads, zpar_inflate, zpar_out_inflate);
+
+    DEL (blks);
+    return err;
+}
+
+/* EOF */
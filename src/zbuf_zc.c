@@ -0,0 +1,591 @@
+/* :vi:ts=4:sw=4:
+ *
+ * zbuf_zc.c - zero-copy zlib buffer interface and z_stream pool.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Creation date: Sun Jan 24 18:02:37 2016
+ *
+ * Redistribution permitted under the same terms as the original
+ * zlib library.
+ */
+
+#include "zlib/zbuf.h"
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "utils/utils.h"
+
+
+/* zlib counts in uInt; feed it no more than this at a time. */
+#define ZC_MAXCHUNK     (1U << 30)
+
+#define ZC_DEFLATE      1
+#define ZC_INFLATE      2
+
+
+/*
+ * Pool entry. The z_stream must be the first member; we get back to
+ * the entry from the z_stream pointer handed out.
+ */
+struct z_pool_ent
+{
+    z_stream z;
+
+    struct z_pool_ent * next;
+
+    int kind;
+    int level;
+    int wbits;
+};
+typedef struct z_pool_ent z_pool_ent;
+
+
+struct z_stream_pool
+{
+    pthread_mutex_t lock;
+
+    z_pool_ent * free;
+    int nfree;
+    int max;
+};
+
+
+
+z_stream_pool *
+z_stream_pool_new (int max)
+{
+    z_stream_pool * p = NEWZ(z_stream_pool);
+
+    if ( !p )
+        return 0;
+
+    if ( pthread_mutex_init (&p->lock, 0) != 0 )
+    {
+        DEL (p);
+        return 0;
+    }
+
+    p->max = max > 0 ? max : 1;
+    return p;
+}
+
+
+static void
+pool_ent_free (z_pool_ent * e)
+{
+    if ( e->kind == ZC_DEFLATE )
+        deflateEnd (&e->z);
+    else
+        inflateEnd (&e->z);
+
+    DEL (e);
+}
+
+
+void
+z_stream_pool_delete (z_stream_pool * p)
+{
+    z_pool_ent * e, * n;
+
+    if ( !p )
+        return;
+
+    for (e = p->free; e; e = n)
+    {
+        n = e->next;
+        pool_ent_free (e);
+    }
+
+    pthread_mutex_destroy (&p->lock);
+    DEL (p);
+}
+
+
+/*
+ * Pull an idle entry matching (kind, level, wbits) off the pool.
+ */
+static z_pool_ent *
+pool_get (z_stream_pool * p, int kind, int level, int wbits)
+{
+    z_pool_ent * e, ** pp;
+
+    if ( !p )
+        return 0;
+
+    pthread_mutex_lock (&p->lock);
+    for (pp = &p->free; (e = *pp); pp = &e->next)
+    {
+        if ( e->kind == kind && e->level == level && e->wbits == wbits )
+        {
+            *pp = e->next;
+            p->nfree--;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&p->lock);
+
+    return e;
+}
+
+
+z_stream *
+z_stream_pool_deflate (z_stream_pool * p, int lev, int wbits)
+{
+    z_pool_ent * e = pool_get (p, ZC_DEFLATE, lev, wbits);
+
+    if ( e )
+        return &e->z;
+
+    if ( !(e = NEWZ(z_pool_ent)) )
+        return 0;
+
+    if ( deflateInit2 (&e->z, lev, Z_DEFLATED, wbits, MAX_MEM_LEVEL,
+                       Z_DEFAULT_STRATEGY) != Z_OK )
+    {
+        DEL (e);
+        return 0;
+    }
+
+    e->kind  = ZC_DEFLATE;
+    e->level = lev;
+    e->wbits = wbits;
+    return &e->z;
+}
+
+
+z_stream *
+z_stream_pool_inflate (z_stream_pool * p, int wbits)
+{
+    z_pool_ent * e = pool_get (p, ZC_INFLATE, 0, wbits);
+
+    if ( e )
+        return &e->z;
+
+    if ( !(e = NEWZ(z_pool_ent)) )
+        return 0;
+
+    if ( inflateInit2 (&e->z, wbits) != Z_OK )
+    {
+        DEL (e);
+        return 0;
+    }
+
+    e->kind  = ZC_INFLATE;
+    e->wbits = wbits;
+    return &e->z;
+}
+
+
+void
+z_stream_pool_put (z_stream_pool * p, z_stream * zs)
+{
+    z_pool_ent * e = (z_pool_ent *)zs;
+    int r;
+
+    if ( !zs )
+        return;
+
+    r = e->kind == ZC_DEFLATE ? deflateReset (zs) : inflateReset (zs);
+
+    if ( p && r == Z_OK )
+    {
+        pthread_mutex_lock (&p->lock);
+        if ( p->nfree < p->max )
+        {
+            e->next = p->free;
+            p->free = e;
+            p->nfree++;
+            e = 0;
+        }
+        pthread_mutex_unlock (&p->lock);
+    }
+
+    if ( e )
+        pool_ent_free (e);
+}
+
+
+
+/*
+ * Retire the current window and (unless 'last') get the next one.
+ */
+static int
+zc_next_window (z_zc_context * zc, int last)
+{
+    z_stream * zs = zc->z;
+    uInt used     = zc->win.size - zs->avail_out;
+
+    if ( (*zc->next_window) (zc->opaq, &zc->win, used, last) < 0 )
+        return Z_MEM_ERROR;
+
+    if ( last )
+        return Z_OK;
+
+    if ( !zc->win.buf || zc->win.size == 0 )
+        return Z_MEM_ERROR;
+
+    zs->next_out  = zc->win.buf;
+    zs->avail_out = zc->win.size;
+    return Z_OK;
+}
+
+
+static int
+zc_init (z_zc_context * zc, z_stream * zs, z_stream_pool * pool,
+         z_window_fn fn, void * opaq)
+{
+    assert (fn);
+
+    memset (zc, 0, sizeof *zc);
+    if ( !zs )
+        return Z_MEM_ERROR;
+
+    zc->z           = zs;
+    zc->pool        = pool;
+    zc->next_window = fn;
+    zc->opaq        = opaq;
+
+    zs->next_out  = 0;
+    zs->avail_out = 0;
+
+    return zc_next_window (zc, 0);
+}
+
+
+static void
+zc_fini (z_zc_context * zc)
+{
+    if ( zc->z )
+        z_stream_pool_put (zc->pool, zc->z);
+
+    zc->z = 0;
+}
+
+
+int
+z_zc_compress_init (z_zc_context * zc, z_stream_pool * pool, int lev,
+                    int wbits, z_window_fn fn, void * opaq)
+{
+    int err;
+
+    if ( lev < 0 || lev > 9 )
+        lev = Z_BUF_DEFAULT_LEVEL;
+
+    err = zc_init (zc, z_stream_pool_deflate (pool, lev, wbits), pool, fn, opaq);
+    if ( err != Z_OK )
+        zc_fini (zc);
+
+    return err;
+}
+
+
+int
+z_zc_compress (z_zc_context * zc, const void * buf, size_t len)
+{
+    z_stream * zs = zc->z;
+    const Byte * p = (const Byte *)buf;
+    int err;
+
+    while ( len > 0 )
+    {
+        uInt n = len > ZC_MAXCHUNK ? ZC_MAXCHUNK : (uInt)len;
+
+        zs->next_in  = (Bytef *)p;
+        zs->avail_in = n;
+
+        while ( zs->avail_in > 0 )
+        {
+            if ( zs->avail_out == 0 )
+            {
+                if ( (err = zc_next_window (zc, 0)) != Z_OK )
+                    return err;
+            }
+
+            err = deflate (zs, Z_NO_FLUSH);
+            if ( err != Z_OK )
+                return err;
+        }
+
+        p   += n;
+        len -= n;
+    }
+
+    return Z_OK;
+}
+
+
+int
+z_zc_compress_end (z_zc_context * zc)
+{
+    z_stream * zs = zc->z;
+    int err;
+
+    do
+    {
+        if ( zs->avail_out == 0 )
+        {
+            if ( (err = zc_next_window (zc, 0)) != Z_OK )
+                goto done;
+        }
+
+        err = deflate (zs, Z_FINISH);
+    } while ( err == Z_OK );
+
+    if ( err == Z_STREAM_END )
+        err = zc_next_window (zc, 1);
+
+done:
+    zc_fini (zc);
+    return err;
+}
+
+
+int
+z_zc_uncompress_init (z_zc_context * zc, z_stream_pool * pool, int wbits,
+                      z_window_fn fn, void * opaq)
+{
+    int err;
+
+    if ( wbits <= 0 || wbits > 47 )
+        wbits = 15;
+
+    err = zc_init (zc, z_stream_pool_inflate (pool, wbits), pool, fn, opaq);
+    if ( err != Z_OK )
+        zc_fini (zc);
+
+    return err;
+}
+
+
+int
+z_zc_uncompress (z_zc_context * zc, const void * buf, size_t len)
+{
+    z_stream * zs  = zc->z;
+    const Byte * p = (const Byte *)buf;
+    int err = Z_OK;
+
+    while ( len > 0 )
+    {
+        uInt n = len > ZC_MAXCHUNK ? ZC_MAXCHUNK : (uInt)len;
+
+        zs->next_in  = (Bytef *)p;
+        zs->avail_in = n;
+
+        while ( zs->avail_in > 0 )
+        {
+            if ( zs->avail_out == 0 )
+            {
+                if ( (err = zc_next_window (zc, 0)) != Z_OK )
+                    return err;
+            }
+
+            err = inflate (zs, Z_NO_FLUSH);
+            if ( err == Z_STREAM_END )
+                return err;
+
+            if ( err != Z_OK )
+                return err;
+        }
+
+        p   += n;
+        len -= n;
+    }
+
+    return err;
+}
+
+
+int
+z_zc_uncompress_end (z_zc_context * zc)
+{
+    z_stream * zs = zc->z;
+    int err;
+
+    zs->next_in  = 0;
+    zs->avail_in = 0;
+
+    /*
+     * inflate() may be holding decoded data that didn't fit in the
+     * last window; keep supplying windows until it reports the end
+     * of the stream.
+     */
+    do
+    {
+        if ( zs->avail_out == 0 )
+        {
+            if ( (err = zc_next_window (zc, 0)) != Z_OK )
+                goto done;
+        }
+
+        err = inflate (zs, Z_NO_FLUSH);
+    } while ( err == Z_OK && zs->avail_out == 0 );
+
+    if ( err == Z_STREAM_END )
+        err = zc_next_window (zc, 1);
+    else if ( err == Z_OK || err == Z_BUF_ERROR )
+        err = Z_DATA_ERROR;
+
+done:
+    zc_fini (zc);
+    return err;
+}
+
+
+int
+z_zc_uncompress_into (z_stream_pool * pool, int wbits,
+                      const void * in, size_t inlen,
+                      void * out, size_t outsz, size_t * p_outlen)
+{
+    const Byte * ip = (const Byte *)in;
+    Byte * op       = (Byte *)out;
+    size_t inrem    = inlen,
+           outrem   = outsz;
+    z_stream * zs;
+    int err;
+
+    if ( wbits <= 0 || wbits > 47 )
+        wbits = 15;
+
+    if ( !(zs = z_stream_pool_inflate (pool, wbits)) )
+        return Z_MEM_ERROR;
+
+    zs->avail_in  = 0;
+    zs->avail_out = 0;
+
+    do
+    {
+        if ( zs->avail_in == 0 && inrem > 0 )
+        {
+            uInt n = inrem > ZC_MAXCHUNK ? ZC_MAXCHUNK : (uInt)inrem;
+
+            zs->next_in  = (Bytef *)ip;
+            zs->avail_in = n;
+            ip    += n;
+            inrem -= n;
+        }
+
+        if ( zs->avail_out == 0 && outrem > 0 )
+        {
+            uInt n = outrem > ZC_MAXCHUNK ? ZC_MAXCHUNK : (uInt)outrem;
+
+            zs->next_out  = op;
+            zs->avail_out = n;
+            op     += n;
+            outrem -= n;
+        }
+
+        err = inflate (zs, Z_NO_FLUSH);
+
+        /*
+         * No progress: either we ran out of input (truncated stream)
+         * or out of room in the caller's region.
+         */
+        if ( err == Z_BUF_ERROR )
+        {
+            if ( zs->avail_out == 0 && outrem == 0 )
+                break;
+
+            if ( zs->avail_in == 0 && inrem == 0 )
+            {
+                err = Z_DATA_ERROR;
+                break;
+            }
+            err = Z_OK;
+        }
+    } while ( err == Z_OK );
+
+    if ( p_outlen )
+        *p_outlen = (op - (Byte *)out) - zs->avail_out;
+
+    if ( err == Z_STREAM_END )
+        err = Z_OK;
+
+    z_stream_pool_put (pool, zs);
+    return err;
+}
+
+
+
+int
+z_mmap_sink_init (z_mmap_sink * s, int fd, off_t off, size_t chunk)
+{
+    long pgsz = sysconf (_SC_PAGESIZE);
+
+    memset (s, 0, sizeof *s);
+
+    if ( fd < 0 || off < 0 )
+        return -EINVAL;
+
+    if ( chunk == 0 )
+        chunk = 1024 * 1024;
+
+    if ( chunk > ZC_MAXCHUNK )
+        chunk = ZC_MAXCHUNK;
+
+    s->fd    = fd;
+    s->off   = off;
+    s->chunk = _ALIGN_UP(chunk, (size_t)pgsz);
+    return 0;
+}
+
+
+int
+z_mmap_sink_window (void * opaq, z_window * w, uInt used, int last)
+{
+    z_mmap_sink * s = (z_mmap_sink *)opaq;
+    long pgsz       = sysconf (_SC_PAGESIZE);
+    off_t mapoff;
+    void * m;
+    int err, r;
+
+    s->off += used;
+
+    if ( s->map )
+    {
+        munmap (s->map, s->maplen);
+        s->map = 0;
+    }
+
+    w->buf  = 0;
+    w->size = 0;
+
+    if ( last )
+        return ftruncate (s->fd, s->off) < 0 ? -errno : 0;
+
+    /*
+     * mmap offsets must be page aligned; the window starts wherever
+     * the output ends within the first page.
+     */
+    mapoff    = _ALIGN_DOWN(s->off, (off_t)pgsz);
+    s->maplen = (s->off - mapoff) + s->chunk;
+
+    if ( ftruncate (s->fd, mapoff + s->maplen) < 0 )
+        goto fail;
+
+    m = mmap (0, s->maplen, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, mapoff);
+    if ( m == MAP_FAILED )
+        goto fail;
+
+    s->map  = (Byte *)m;
+    w->buf  = s->map + (s->off - mapoff);
+    w->size = s->chunk;
+    return 0;
+
+fail:
+    /*
+     * No window; don't leave the file extended past the output.
+     * The first error is the one to report.
+     */
+    err       = -errno;
+    s->maplen = 0;
+    r         = ftruncate (s->fd, s->off);
+    USEARG (r);
+    return err;
+}
+
+/* EOF */
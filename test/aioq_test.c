@@ -0,0 +1,8 @@
+/*
+ * aioq.c with its test hooks (AIOQ_TEST), for t_aioq.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#define AIOQ_TEST   1
+#include "../src/posix/aioq.c"
@@ -0,0 +1,499 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bench.c - Micro-benchmark harness for the test programs.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  TSC ticks are converted to ns with a ratio measured against
+ *    CLOCK_MONOTONIC over a short sleep at startup.
+ * o  BENCH_OP() costs two TSC reads and a store. The fastest of
+ *    many back to back reads is taken off each latency sample; the
+ *    fastest per-op time of loops of empty BENCH_OP()s is taken off
+ *    the repetition for each BENCH_OP() in it.
+ * o  Hardware counters are those of perfprof for the calling
+ *    thread; counters the CPU or VM doesn't have are left out. If
+ *    perf_event_open(2) isn't permitted at all, results simply have
+ *    no counters.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "bench.h"
+
+#define BENCH_MAXSAMP   (1024 * 1024)
+
+
+static const char * HwNames[PERFPROF_NCTR] = {
+    "instructions",
+    "cycles",
+    "llc_misses",
+    "branch_misses",
+};
+
+
+static int
+envint(const char * name, int def)
+{
+    const char * s = getenv(name);
+
+    return (s && *s) ? atoi(s) : def;
+}
+
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static double
+calibrate(void)
+{
+    struct timespec d = { 0, 20 * 1000 * 1000 };
+    uint64_t n0, n1, c0, c1;
+
+    n0 = monotonic_ns();
+    c0 = bench_tsc();
+    nanosleep(&d, 0);
+    n1 = monotonic_ns();
+    c1 = bench_tsc();
+
+    return c1 > c0 ? (double)(n1 - n0) / (double)(c1 - c0) : 1.0;
+}
+
+
+#define OVH_LOOPS       16
+#define OVH_OPS         1000
+
+static void
+calibrate_ovh(bench * b)
+{
+    uint64_t best = ~0ULL;
+    int i, j;
+
+    for (i = 0; i < OVH_LOOPS * OVH_OPS; i++) {
+        uint64_t t0 = bench_tsc();
+        uint64_t t1 = bench_tsc();
+
+        if (t1 - t0 < best) best = t1 - t0;
+    }
+    b->tsc_ovh = best;
+
+    // Empty ops, stored as they are when measuring
+    b->cap = OVH_OPS < b->maxsamp ? OVH_OPS : b->maxsamp;
+    best   = ~0ULL;
+    for (i = 0; i < OVH_LOOPS; i++) {
+        uint64_t t0 = bench_tsc(), t1;
+
+        b->nsamp = 0;
+        for (j = 0; j < OVH_OPS; j++) BENCH_OP(b, (void)0);
+
+        t1 = bench_tsc();
+        if (t1 - t0 < best) best = t1 - t0;
+    }
+    b->op_ovh = (double)best / OVH_OPS;
+    b->nsamp  = 0;
+    b->cap    = 0;
+}
+
+
+static void
+hw_enable(bench * b, int on)
+{
+    perfprof_sample s;
+    int i;
+
+    if (!b->hw) return;
+
+    if (on) {
+        perfprof_read(&b->hw0);
+        return;
+    }
+
+    perfprof_read(&s);
+    for (i = 0; i < PERFPROF_NCTR; i++) b->hwsum[i] += s.v[i] - b->hw0.v[i];
+}
+
+
+int
+bench_init(bench * b, const char * suite, unsigned flags)
+{
+    const char * fmt = getenv("BENCH_FORMAT");
+    const char * out = getenv("BENCH_OUT");
+
+    memset(b, 0, sizeof *b);
+
+    b->suite   = suite;
+    b->reps    = envint("BENCH_REPS", 5);
+    b->warmup  = envint("BENCH_WARMUP", 1);
+    b->cpu     = envint("BENCH_CPU", sys_cpu_getavail() - 1);
+    b->maxsamp = envint("BENCH_SAMPLES", BENCH_MAXSAMP);
+
+    if (b->reps < 1)   b->reps = 1;
+    if (b->warmup < 0) b->warmup = 0;
+
+    if (!fmt || !*fmt || 0 == strcmp(fmt, "text")) b->fmt = BENCH_TEXT;
+    else if (0 == strcmp(fmt, "json"))             b->fmt = BENCH_JSON;
+    else if (0 == strcmp(fmt, "csv"))              b->fmt = BENCH_CSV;
+    else                                           return -EINVAL;
+
+    if (b->fmt != BENCH_TEXT) {
+        if (out && *out) {
+            char fn[PATH_MAX];
+            struct stat st;
+
+            if (stat(out, &st) == 0 && S_ISDIR(st.st_mode)) {
+                snprintf(fn, sizeof fn, "%s/%s.%s", out, suite,
+                         b->fmt == BENCH_JSON ? "json" : "csv");
+                out = fn;
+            }
+            if (!(b->out = fopen(out, "w"))) return -errno;
+        } else {
+            b->out = stdout;
+        }
+    }
+
+    b->rep_ns = NEWZA(double, b->reps);
+    b->samp   = NEWA(uint64_t, b->maxsamp > 0 ? b->maxsamp : 1);
+    if (!b->rep_ns || !b->samp) return -ENOMEM;
+
+    if (!(flags & BENCH_NOPIN) && b->cpu >= 0) sys_cpu_set_my_thread_affinity(b->cpu);
+    else b->cpu = -1;
+
+    b->ns_per_tick = calibrate();
+    calibrate_ovh(b);
+    if (envint("BENCH_HW", 1)) b->hw = perfprof_thread_init("bench");
+    return 0;
+}
+
+
+static void
+json_str(FILE * fp, const char * s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+
+static void
+write_json(bench * b)
+{
+    FILE * fp = b->out;
+    char host[256];
+    size_t i;
+    int j;
+
+    if (gethostname(host, sizeof host) < 0) strcpy(host, "unknown");
+    host[sizeof host - 1] = 0;
+
+    fprintf(fp, "{\n  \"suite\": ");
+    json_str(fp, b->suite);
+    fprintf(fp, ",\n  \"host\": ");
+    json_str(fp, host);
+    fprintf(fp, ",\n  \"time\": %lu,\n  \"cpu\": %d,\n  \"tsc_ghz\": %.4f,\n"
+                "  \"reps\": %d,\n  \"warmup\": %d,\n  \"results\": [",
+                (unsigned long)time(0), b->cpu, 1.0 / b->ns_per_tick, b->reps, b->warmup);
+
+    for (i = 0; i < b->nres; i++) {
+        bench_result * r = &b->res[i];
+
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        json_str(fp, r->name);
+        fprintf(fp, ", \"ops\": %llu, \"reps\": %d,\n"
+                    "     \"ns_per_op\": {\"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, \"max\": %.3f},\n"
+                    "     \"mops\": %.3f",
+                    (unsigned long long)r->ops, r->reps,
+                    r->ns_min, r->ns_med, r->ns_mean, r->ns_max, 1000.0 / r->ns_med);
+        if (r->bytes)
+            fprintf(fp, ", \"mb_per_sec\": %.3f",
+                    (double)r->bytes * 1000.0 / (r->ns_med * (double)r->ops));
+        if (r->nsamples)
+            fprintf(fp, ",\n     \"latency_ns\": {\"n\": %llu, \"p50\": %.1f, \"p90\": %.1f, "
+                        "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+                        (unsigned long long)r->nsamples,
+                        r->lat[0], r->lat[1], r->lat[2], r->lat[3], r->lat[4]);
+        if (r->hw) {
+            fprintf(fp, ",\n     \"hw_per_op\": {");
+            for (j = 0; j < PERFPROF_NCTR; j++) {
+                fprintf(fp, "%s\"%s\": ", j ? ", " : "", HwNames[j]);
+                if (r->hw & (1 << j)) fprintf(fp, "%.4f", r->hwc[j]);
+                else                 fprintf(fp, "null");
+            }
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+
+static void
+write_csv(bench * b)
+{
+    FILE * fp = b->out;
+    size_t i;
+    int j;
+
+    fprintf(fp, "suite,name,ops,reps,ns_min,ns_median,ns_mean,ns_max,mops,mb_per_sec,"
+                "lat_n,lat_p50,lat_p90,lat_p99,lat_p999,lat_max");
+    for (j = 0; j < PERFPROF_NCTR; j++) fprintf(fp, ",%s", HwNames[j]);
+    fputc('\n', fp);
+
+    for (i = 0; i < b->nres; i++) {
+        bench_result * r = &b->res[i];
+
+        fprintf(fp, "%s,%s,%llu,%d,%.3f,%.3f,%.3f,%.3f,%.3f,", b->suite, r->name,
+                (unsigned long long)r->ops, r->reps,
+                r->ns_min, r->ns_med, r->ns_mean, r->ns_max, 1000.0 / r->ns_med);
+        if (r->bytes) fprintf(fp, "%.3f", (double)r->bytes * 1000.0 / (r->ns_med * (double)r->ops));
+
+        fprintf(fp, ",%llu,%.1f,%.1f,%.1f,%.1f,%.1f", (unsigned long long)r->nsamples,
+                r->lat[0], r->lat[1], r->lat[2], r->lat[3], r->lat[4]);
+        for (j = 0; j < PERFPROF_NCTR; j++) {
+            fputc(',', fp);
+            if (r->hw & (1 << j)) fprintf(fp, "%.4f", r->hwc[j]);
+        }
+        fputc('\n', fp);
+    }
+}
+
+
+void
+bench_fini(bench * b)
+{
+    if (b->out) {
+        if (b->fmt == BENCH_JSON) write_json(b);
+        else                      write_csv(b);
+        if (b->out != stdout) fclose(b->out);
+        else                  fflush(stdout);
+    }
+
+    DEL(b->rep_ns);
+    DEL(b->samp);
+    if (b->res) DEL(b->res);
+    memset(b, 0, sizeof *b);
+}
+
+
+void
+bench_begin(bench * b, const char * name, uint64_t ops)
+{
+    memset(&b->cur, 0, sizeof b->cur);
+    memset(b->hwsum, 0, sizeof b->hwsum);
+    snprintf(b->cur.name, sizeof b->cur.name, "%s", name);
+
+    b->cur.ops   = ops > 0 ? ops : 1;
+    b->rep       = -b->warmup - 1;
+    b->ticks     = 0;
+    b->nsamp     = 0;
+    b->cap       = 0;
+    b->measuring = 0;
+}
+
+
+int
+bench_next(bench * b)
+{
+    if (b->rep >= 0) {
+        b->rep_ns[b->rep] = bench_ns(b, b->ticks) / (double)b->cur.ops;
+    } else if (b->rep == -1) {
+        /* Warmup done; count from here on */
+        memset(b->hwsum, 0, sizeof b->hwsum);
+        b->nsamp = 0;
+        b->cap   = b->maxsamp;
+    }
+
+    b->ticks = 0;
+    return ++b->rep < b->reps;
+}
+
+
+void
+bench_start(bench * b)
+{
+    b->measuring = 1;
+    b->nop       = 0;
+    hw_enable(b, 1);
+    b->t0 = bench_tsc();
+}
+
+
+void
+bench_stop(bench * b)
+{
+    uint64_t t1  = bench_tsc();
+    uint64_t d   = t1 - b->t0,
+             ovh = (uint64_t)((double)b->nop * b->op_ovh);
+
+    hw_enable(b, 0);
+    b->ticks    += d > ovh ? d - ovh : 0;
+    b->measuring = 0;
+}
+
+
+static int
+cmp_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+cmp_dbl(const void * a, const void * b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * p50, p90, p99, p99.9 and max of 'n' samples, scaled by 'scale'.
+ */
+static void
+percentiles(double * lat, uint64_t * v, size_t n, double scale)
+{
+    static const double Q[] = { 0.5, 0.9, 0.99, 0.999 };
+    size_t i;
+
+    if (n == 0) return;
+
+    qsort(v, n, sizeof v[0], cmp_u64);
+    for (i = 0; i < ARRAY_SIZE(Q); i++) {
+        size_t k = (size_t)(Q[i] * (double)n + 0.999999);
+
+        lat[i] = scale * (double)v[k > 0 ? k - 1 : 0];
+    }
+    lat[4] = scale * (double)v[n - 1];
+}
+
+
+static void
+print_text(const bench_result * r)
+{
+    printf("  %-32s %10.2f ns/op [%.2f .. %.2f] %9.2f M/s",
+            r->name, r->ns_med, r->ns_min, r->ns_max, 1000.0 / r->ns_med);
+    if (r->bytes)
+        printf(" %9.2f MB/s", (double)r->bytes * 1000.0 / (r->ns_med * (double)r->ops));
+    if (r->nsamples)
+        printf("\n  %-32s p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f ns", "",
+                r->lat[0], r->lat[1], r->lat[2], r->lat[3], r->lat[4]);
+    if (r->hw) {
+        unsigned both = (1 << PERFPROF_CYCLES) | (1 << PERFPROF_INSTRUCTIONS);
+
+        printf("\n  %-32s", "");
+        if (r->hw & (1 << PERFPROF_CYCLES))        printf(" %.1f cyc", r->hwc[PERFPROF_CYCLES]);
+        if (r->hw & (1 << PERFPROF_INSTRUCTIONS))  printf(" %.1f ins", r->hwc[PERFPROF_INSTRUCTIONS]);
+        if ((r->hw & both) == both && r->hwc[PERFPROF_CYCLES] > 0)
+            printf(" (%.2f IPC)", r->hwc[PERFPROF_INSTRUCTIONS] / r->hwc[PERFPROF_CYCLES]);
+        if (r->hw & (1 << PERFPROF_LLC_MISSES))    printf(" %.3f llc-miss", r->hwc[PERFPROF_LLC_MISSES]);
+        if (r->hw & (1 << PERFPROF_BRANCH_MISSES)) printf(" %.3f br-miss", r->hwc[PERFPROF_BRANCH_MISSES]);
+        printf(" per op");
+    }
+    printf("\n");
+}
+
+
+static const bench_result *
+push_result(bench * b)
+{
+    b->res = RENEWA(bench_result, b->res, b->nres + 1);
+    if (!b->res) return 0;
+
+    b->res[b->nres] = b->cur;
+    b->cur.bytes    = 0;
+    if (b->out != stdout) print_text(&b->res[b->nres]);
+    return &b->res[b->nres++];
+}
+
+
+const bench_result *
+bench_end(bench * b)
+{
+    bench_result * r = &b->cur;
+    double sum = 0.0;
+    int reps   = b->reps;
+    int i;
+
+    /* Finish a loop that was abandoned early */
+    if (b->measuring) bench_stop(b);
+    if (b->rep < reps) {
+        if (b->rep <= 0) {
+            /* Not one repetition measured */
+            b->cap = 0;
+            return 0;
+        }
+        reps = b->rep;
+    }
+
+    r->reps = reps;
+    for (i = 0; i < reps; i++) sum += b->rep_ns[i];
+
+    qsort(b->rep_ns, reps, sizeof b->rep_ns[0], cmp_dbl);
+    r->ns_min  = b->rep_ns[0];
+    r->ns_max  = b->rep_ns[reps - 1];
+    r->ns_med  = (b->rep_ns[(reps - 1) / 2] + b->rep_ns[reps / 2]) / 2.0;
+    r->ns_mean = sum / (double)reps;
+
+    r->nsamples = b->nsamp;
+    percentiles(r->lat, b->samp, b->nsamp, b->ns_per_tick);
+
+    if (b->hw) {
+        double n = (double)r->ops * (double)r->reps;
+
+        r->hw = b->hw;
+        for (i = 0; i < PERFPROF_NCTR; i++) r->hwc[i] = (double)b->hwsum[i] / n;
+    }
+
+    b->cap = 0;
+    return push_result(b);
+}
+
+
+const bench_result *
+bench_add(bench * b, const char * name, uint64_t ops, double ns, uint64_t * lat, size_t n)
+{
+    bench_result * r = &b->cur;
+    uint64_t bytes   = r->bytes;
+
+    memset(r, 0, sizeof *r);
+    snprintf(r->name, sizeof r->name, "%s", name);
+
+    r->bytes   = bytes;
+    r->ops     = ops > 0 ? ops : 1;
+    r->reps    = 1;
+    r->ns_min  = r->ns_med = r->ns_mean = r->ns_max = ns / (double)r->ops;
+
+    r->nsamples = n;
+    percentiles(r->lat, lat, n, 1.0);
+    return push_result(b);
+}
+
+/* EOF */
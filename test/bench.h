@@ -0,0 +1,213 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bench.h - Micro-benchmark harness for the test programs.
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * A benchmark is a loop of warmup and measured repetitions:
+ *
+ *      bench_begin(b, "find", nwords);
+ *      while (bench_next(b)) {
+ *          ... untimed setup ...
+ *          bench_start(b);
+ *          for (i = 0; i < nwords; i++)
+ *              BENCH_OP(b, ht_find(h, w[i].h, &x));
+ *          bench_stop(b);
+ *      }
+ *      bench_end(b);
+ *
+ * Each repetition must do the same 'ops' operations. The time
+ * between bench_start() and bench_stop() gives ns/op per repetition
+ * (and hardware counters per op, via perfprof.h); BENCH_OP()
+ * additionally records the TSC ticks of each operation for latency
+ * percentiles. The cost of the TSC reads, measured at bench_init(),
+ * is taken out of both the latencies and the repetition times (but
+ * not the hardware counters).
+ * Results of multi-threaded benchmarks that keep their own books are
+ * added with bench_add().
+ *
+ * The harness is configured from the environment so that each test
+ * keeps its own command line:
+ *
+ *  BENCH_FORMAT    text (default), json or csv
+ *  BENCH_OUT       output file; a directory means DIR/SUITE.json
+ *                  (or .csv). Text is always shown on stdout.
+ *  BENCH_REPS      measured repetitions (5)
+ *  BENCH_WARMUP    warmup repetitions (1)
+ *  BENCH_CPU       CPU to pin to; -1 to not pin (last CPU)
+ *  BENCH_HW        0 to not read hardware counters
+ *  BENCH_SAMPLES   max latency samples kept per benchmark (1M)
+ */
+
+#ifndef ___TEST_BENCH_H_5522917_1476224931__
+#define ___TEST_BENCH_H_5522917_1476224931__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "utils/utils.h"
+#include "posix/perfprof.h"
+
+
+#define BENCH_TEXT      0
+#define BENCH_JSON      1
+#define BENCH_CSV       2
+
+/*
+ * bench_init() flags
+ */
+#define BENCH_NOPIN     0x01    /* multi-threaded; pins its own threads */
+
+
+struct bench_result
+{
+    char     name[64];
+    uint64_t ops;           /* per repetition */
+    uint64_t bytes;         /* per repetition; 0 if not applicable */
+    int      reps;
+
+    /* ns per op across repetitions */
+    double   ns_min;
+    double   ns_med;
+    double   ns_mean;
+    double   ns_max;
+
+    /* per-op latency in ns: p50, p90, p99, p99.9, max */
+    uint64_t nsamples;
+    double   lat[5];
+
+    /* hardware counters per op (PERFPROF_xxx); 'hw' is the mask of
+     * valid ones */
+    unsigned hw;
+    double   hwc[PERFPROF_NCTR];
+};
+typedef struct bench_result bench_result;
+
+
+struct bench
+{
+    const char *    suite;
+    int             fmt;
+    int             reps;
+    int             warmup;
+    int             cpu;
+    FILE *          out;
+
+    double          ns_per_tick;
+    unsigned        hw;                 /* perfprof counters available */
+    uint64_t        tsc_ovh;            /* ticks of back to back TSC reads */
+    double          op_ovh;             /* ticks a BENCH_OP() adds */
+
+    /* current benchmark */
+    bench_result    cur;
+    int             rep;                /* < 0 during warmup */
+    int             measuring;
+    uint64_t        t0;
+    uint64_t        ticks;
+    uint64_t        nop;                /* BENCH_OP()s since bench_start() */
+    perfprof_sample hw0;
+    uint64_t        hwsum[PERFPROF_NCTR];
+    double *        rep_ns;
+
+    uint64_t *      samp;
+    size_t          nsamp;
+    size_t          maxsamp;
+    size_t          cap;                /* 0 during warmup */
+
+    bench_result *  res;
+    size_t          nres;
+};
+typedef struct bench bench;
+
+
+/*
+ * Configure from the environment, calibrate the TSC, pin the caller
+ * and open the hardware counters (if permitted). Returns 0 or
+ * -errno.
+ */
+extern int bench_init(bench * b, const char * suite, unsigned flags);
+
+/*
+ * Write JSON/CSV results and free everything.
+ */
+extern void bench_fini(bench * b);
+
+
+/*
+ * Run benchmark 'name' of 'ops' operations per repetition; see
+ * above.
+ */
+extern void bench_begin(bench * b, const char * name, uint64_t ops);
+extern int  bench_next(bench * b);
+extern void bench_start(bench * b);
+extern void bench_stop(bench * b);
+extern const bench_result * bench_end(bench * b);
+
+/*
+ * Bytes processed per repetition; adds MB/s to the result.
+ */
+static inline void
+bench_bytes(bench * b, uint64_t n)
+{
+    b->cur.bytes = n;
+}
+
+
+/*
+ * Record one result measured elsewhere: 'ops' operations in 'ns'
+ * nanoseconds and optionally 'n' per-op latencies in ns. A
+ * bench_bytes() just before applies to it.
+ */
+extern const bench_result * bench_add(bench * b, const char * name, uint64_t ops,
+                                      double ns, uint64_t * lat, size_t n);
+
+
+static inline uint64_t
+bench_tsc(void)
+{
+    return sys_cpu_timestamp();
+}
+
+static inline double
+bench_ns(bench * b, uint64_t ticks)
+{
+    return b->ns_per_tick * (double)ticks;
+}
+
+
+/*
+ * Latency sample of one op in TSC ticks, including one TSC read;
+ * ignored during warmup.
+ */
+static inline void
+bench_sample(bench * b, uint64_t ticks)
+{
+    b->nop++;
+    ticks = ticks > b->tsc_ovh ? ticks - b->tsc_ovh : 0;
+    if (b->nsamp < b->cap) b->samp[b->nsamp++] = ticks;
+}
+
+#define BENCH_OP(b, stmt)   do {                    \
+        uint64_t t0_ = bench_tsc();                 \
+        stmt;                                       \
+        bench_sample(b, bench_tsc() - t0_);         \
+    } while (0)
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___TEST_BENCH_H_5522917_1476224931__ */
+
+/* EOF */
@@ -0,0 +1,78 @@
+#! /usr/bin/env python
+
+# Compare two sets of benchmark results (BENCH_FORMAT=json output)
+#
+# Usage: benchcmp.py BASE NEW [THRESHOLD]
+#
+#  - BASE, NEW are JSON result files or directories of them (as
+#    written by 'make bench').
+#  - Prints median ns/op of each benchmark in both and the change.
+#  - Exits with 1 if any benchmark is slower by more than THRESHOLD
+#    percent (default 5) and the slowdown is larger than the spread
+#    of the base run.
+#
+# Sudhi Herle <sudhi-at-herle.net>
+#
+# License: Public Domain
+
+from __future__ import print_function
+
+import os, sys, json
+
+
+def load(path):
+    """Return a dict of (suite, name) => result"""
+    files = [path]
+    if os.path.isdir(path):
+        files = [os.path.join(path, f) for f in sorted(os.listdir(path)) if f.endswith('.json')]
+
+    r = {}
+    for fn in files:
+        with open(fn) as fd:
+            d = json.load(fd)
+        for x in d['results']:
+            r[(d['suite'], x['name'])] = x
+    return r
+
+
+def main(argv):
+    if len(argv) < 3:
+        print("Usage: %s BASE NEW [THRESHOLD]" % argv[0], file=sys.stderr)
+        return 2
+
+    base = load(argv[1])
+    new  = load(argv[2])
+    thr  = float(argv[3]) if len(argv) > 3 else 5.0
+    bad  = 0
+
+    print("%-40s %12s %12s %8s" % ("benchmark", "base ns/op", "new ns/op", "change"))
+    for k in sorted(new.keys()):
+        n = new[k]['ns_per_op']
+        if k not in base:
+            print("%-40s %12s %12.2f %8s" % ("/".join(k), "-", n['median'], "new"))
+            continue
+
+        b     = base[k]['ns_per_op']
+        pct   = 100.0 * (n['median'] - b['median']) / b['median']
+        noise = 100.0 * (b['max'] - b['min']) / b['median']
+        flag  = ""
+        if pct > thr and pct > noise:
+            flag = "  ** SLOWER **"
+            bad += 1
+
+        print("%-40s %12.2f %12.2f %+7.1f%%%s" % ("/".join(k), b['median'], n['median'], pct, flag))
+
+    for k in sorted(base.keys()):
+        if k not in new:
+            print("%-40s %12.2f %12s %8s" % ("/".join(k), base[k]['ns_per_op']['median'], "-", "gone"))
+
+    if bad > 0:
+        print("\n%d benchmark(s) slower by more than %.1f%%" % (bad, thr))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
+
+# vim: expandtab:sw=4:ts=4:tw=72:
@@ -27,13 +27,16 @@ static const struct option Long_options[] =
     , {"cpu",                             required_argument, 0, 302}
     , {"pause",                           required_argument, 0, 303}
     , {"iosize",                          required_argument, 0, 304}
-    , {"wipes",                           required_argument, 0, 305}
-    , {"verbose",                         no_argument,       0, 306}
+    , {"depth",                           required_argument, 0, 305}
+    , {"sync",                            required_argument, 0, 306}
+    , {"buffered",                        no_argument,       0, 307}
+    , {"wipes",                           required_argument, 0, 308}
+    , {"verbose",                         no_argument,       0, 309}
 
     , {0, 0, 0, 0}
 };
 
-static const char Short_options[] = "hc:p:z:w:v";
+static const char Short_options[] = "hc:p:z:q:s:bw:v";
 
 static unsigned long grok_int(const char * str, const char * option, char * present, int * err, unsigned long limit, int has_limit);
 static uint64_t grok_size(const char * str, const char * option, char * present, int * err);
@@ -62,7 +65,10 @@ opt_parse(opt_option * opt, int argc, char * const *argv)
     opt->help = 0;
     opt->ncpu = 0;
     opt->iopause = 0;
-    opt->iosize = 268435456;
+    opt->iosize = 1048576;
+    opt->depth = 4;
+    opt->syncsize = 0;
+    opt->buffered = 0;
     opt->wipes = 1;
     opt->verbose = 0;
 
@@ -70,6 +76,9 @@ opt_parse(opt_option * opt, int argc, char * const *argv)
     opt->ncpu_present = 0;
     opt->iopause_present = 0;
     opt->iosize_present = 0;
+    opt->depth_present = 0;
+    opt->syncsize_present = 0;
+    opt->buffered_present = 0;
     opt->wipes_present = 0;
     opt->verbose_present = 0;
 
@@ -123,7 +132,30 @@ opt_parse(opt_option * opt, int argc, char * const *argv)
                                     &opt->iosize_present, &errs);
             break;
 
-        case 305:  /* wipes */
+        case 305:  /* depth */
+        case 'q':  /* depth */
+            if (optarg && *optarg)
+            {
+                opt->depth = (int)grok_int(optarg, "depth",
+                                    &opt->depth_present, &errs,
+                                    INT_MAX, 1);
+            }
+            break;
+
+        case 306:  /* sync */
+        case 's':  /* sync */
+            if (optarg && *optarg)
+                opt->syncsize = grok_size(optarg, "sync",
+                                    &opt->syncsize_present, &errs);
+            break;
+
+        case 307:  /* buffered */
+        case 'b':  /* buffered */
+            opt->buffered = 1;
+            opt->buffered_present = 1;
+            break;
+
+        case 308:  /* wipes */
         case 'w':  /* wipes */
             if (optarg && *optarg)
             {
@@ -133,7 +165,7 @@ opt_parse(opt_option * opt, int argc, char * const *argv)
             }
             break;
 
-        case 306:  /* verbose */
+        case 309:  /* verbose */
         case 'v':  /* verbose */
             opt->verbose = 1;
             opt->verbose_present = 1;
@@ -321,7 +353,10 @@ show_help(void)
 "    --help, -h        Print this help and exit [false]\n"
 "    --cpu=c, -c c     Run on 'N' CPUs [0]\n"
 "    --pause=p, -p p   Pause for 'P' milliseconds after every I/O [0]\n"
-"    --iosize=z, -z z  Do I/O in 'Z' sized chunks [256M]\n"
+"    --iosize=z, -z z  Do I/O in 'Z' sized chunks [1M]\n"
+"    --depth=q, -q q   Keep 'Q' I/Os in flight per thread [4]\n"
+"    --sync=s, -s s    fsync after every 'S' bytes per thread (0: only at the end) [0]\n"
+"    --buffered, -b    Write through the page cache instead of O_DIRECT [false]\n"
 "    --wipes=w, -w w   Wipe each block 'W' times [1]\n"
 "    --verbose, -v     Show verbose progress messages [false]\n"
 ;
@@ -6,8 +6,8 @@
  *
  * Make all changes in dd-wipe-opt.in.
  */
-#ifndef ___DD_WIPE_OPT_H_340907651___
-#define ___DD_WIPE_OPT_H_340907651___ 1
+#ifndef ___DD_WIPE_OPT_H_567196920___
+#define ___DD_WIPE_OPT_H_567196920___ 1
 
 /* ANSI/ISO headerfile that defines exact width types */
 #include <stdint.h>
@@ -52,6 +52,9 @@ struct opt_option
     int ncpu;
     int iopause;
     uint64_t iosize;
+    int depth;
+    uint64_t syncsize;
+    int buffered;
     int wipes;
     int verbose;
 
@@ -64,6 +67,9 @@ struct opt_option
     char ncpu_present;
     char iopause_present;
     char iosize_present;
+    char depth_present;
+    char syncsize_present;
+    char buffered_present;
     char wipes_present;
     char verbose_present;
 
@@ -116,6 +122,6 @@ extern const char* opt_usage(void);
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
-#endif /* ___DD_WIPE_OPT_H_340907651___ */
+#endif /* ___DD_WIPE_OPT_H_567196920___ */
 
 /* EOF */
@@ -42,6 +42,6 @@ done
 
 exe=${u}_objs_${obj}/t_mpmcq
 
-echo "$exe $np $nc > $file"
-$exe $np $nc >| $file
+echo "$exe $np $nc $file"
+$exe $np $nc $file
 head -10 $file
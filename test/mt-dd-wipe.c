@@ -6,6 +6,10 @@
  * threads as CPUs on your machine. Assumes that your I/O subsystem
  * can handle the load of multiple writers to the same disk.
  *
+ * The writing is done by blkwriter: O_DIRECT writes (bypassing the
+ * page cache and its writeback stalls) with several I/Os in flight
+ * per thread.
+ *
  * Usage: $0 [options] FILE|DISKNAME
  *
  * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
@@ -21,136 +25,74 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
-#include <assert.h>
 #include <errno.h>
-#include <semaphore.h>
-#include <pthread.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 
 
 #include "error.h"
 #include "utils/cpu.h"
-#include "fast/syncq.h"
 #include "utils/utils.h"
+#include "posix/blkwriter.h"
 
 // Auto-generated headerfile
 #include "dd-wipe-opt.h"
 
-extern uint32_t arc4random(void);
+extern void arc4random_buf(void *, size_t);
 
 extern uint64_t get_disksize(int fd, const char* fnam);
 
-// mmap in 256 MB chunks
-#define CHUNKSIZE       (256 * 1048576)
-
-// Progress Queue size
-#define QUEUESIZE       1024
-
-
-/*
- * Holds info to send back to the main thread.
- * This is progress info - sent periodically.
- */
-struct progress
-{
-    int cpu;        // thread# doing the job
-    pthread_t id;   // thread id
-
-    uint64_t done,  // # of blocks done
-             total; // total # of blocks
-
-};
-typedef struct progress progress;
-
-
-// Synchronized Queue (producer-consumer)
-SYNCQ_TYPEDEF(progq, progress, QUEUESIZE);
-
-
-
-// Per thread context
-struct ctxt
-{
-    int         cpu;        // CPU# 
-    int         fd;         // fd we are working with
-    int         wipes;      // how many times to wipe each block
-    uint32_t    iopause;    // # of milliseconds of waiting before starting next I/O
-    uint32_t    pgsize;     // system page size
-
-    uint64_t    iosize;
-
-    pthread_t id;   // thread id
-    progq*  q;      // queue for sending progress status
-
-    uint8_t* iobuf; // IO Buf (for non-mmapable targets)
-
-    uint64_t   start,  // starting offset
-               count;  // count of bytes
-};
-typedef struct ctxt ctxt;
-
 
 /*
  * Struct to measure progress bar of each CPU.
  */
 struct speedo
 {
-    uint64_t *done;
-    uint64_t *total;
     uint64_t start;
     uint64_t prev;
-
-    int     ncpu;
 };
 typedef struct speedo speedo;
 
 // Init progress bar
 static void
-speedo_init(speedo* sp, int ncpu)
+speedo_init(speedo* sp)
 {
-    sp->done  = NEWZA(uint64_t, ncpu);
-    sp->total = NEWZA(uint64_t, ncpu);
-    sp->ncpu  = ncpu;
-
     sp->start = timenow();
     sp->prev  = 0;
 }
 
 
+#define dd(x)       ((double)(x))
+#define rate(a,b)   ((b) > 0 ? (100.0 * dd(a)) / dd(b) : 0.0)
+
 // Show progress bar
 static void
-speedo_show(speedo* sp, int cpu, uint64_t done, uint64_t tot)
+speedo_show(speedo* sp, blkwriter* bw)
 {
     uint64_t tm = timenow() - sp->start;
-
-    sp->done[cpu]  = done;
-    sp->total[cpu] = tot;
+    int i, nthr = blkwriter_nthreads(bw);
 
     if (tm < 100000) return;
 
     char buf[256];
     char* p = &buf[0];
-    int i;
     ssize_t n,
             av = sizeof buf;
 
-#define dd(x)       ((double)(x))
-#define rate(a,b)   ((b) > 0 ? (100.0 * dd(a)) / dd(b) : 0.0)
-
     uint64_t td = 0;
-    for (i = 0; i < sp->ncpu; ++i) {
-        td += sp->done[i];
-        n = snprintf(p, av, "%02d: %4.1f%% ", i, rate(sp->done[i], sp->total[i]));
+    for (i = 0; i < nthr && av > 32; ++i) {
+        uint64_t done, total;
+
+        blkwriter_progress(bw, i, &done, &total);
+        td += done;
+        n = snprintf(p, av, "%02d: %4.1f%% ", i, rate(done, total));
         p  += n;
         av -= n;
     }
 
-    //printf("total %llu, elapsed %llu us\n", td, tm);
-
     uint64_t z  = (td - sp->prev) / 1048576;    // MB
     double secs = dd(tm) * 1.0e-6;              // elapsed time in seconds
     snprintf(p, av, "%5.2f MB/s\r", dd(z) / secs);
@@ -163,175 +105,22 @@ speedo_show(speedo* sp, int cpu, uint64_t done, uint64_t tot)
 }
 
 
-// write(2) that ignores EINTR
-static void
-fullwrite(int fd, uint8_t* buf, uint64_t sz, uint64_t off)
-{
-    while (sz > 0) {
-        ssize_t n = pwrite(fd, buf, sz, off);
-
-        if (n < 0) {
-            if (errno == EINTR) continue;
-
-            error(1, errno, "Write failed at offset %llu (%llu bytes)", off, sz);
-        }
-
-        sz  -= n;
-        off += n;
-        buf += n;
-    }
-}
-
-
-/*
- * Darwin doesn't let us mmap a block device.
- */
-#if defined(__APPLE__) // || defined(__linux__)
-
-#define IOBUF_INIT(cx)  do {    \
-            cx->iobuf = NEWA(uint8_t, cx->iosize); \
-            if (!cx->iobuf)  \
-                error(1, ENOMEM, "Memory exhausted while allocating %llu bytes", cx->iosize);\
-        } while (0)
-
-#define IOTHREAD_FUNC   copying_thread_func
-
-
-
-// Uses write(2) to write random junk. 
-// Some Posix systems don't allow you to mmap() block devices.
-static void*
-copying_thread_func(void* x)
-{
-    ctxt* cx = x;
-    uint64_t n = cx->count;
-    int i;
-    progress pp;
-
-    pp.cpu   = cx->cpu;
-    pp.id    = cx->id;
-    pp.total = cx->count;
-    pp.done  = 0;
-
-    while (n > 0) {
-        uint64_t m  = n > cx->iosize ? cx->iosize : n;
-
-        //printf("%d: chunk %llu off %llu; rem %llu\n", cx->cpu, m, cx->start, n);
-
-        for (i = 0; i < cx->wipes; ++i) {
-            arc4random_buf(cx->iobuf, m);
-            fullwrite(cx->fd, cx->iobuf, m, cx->start);
-        }
-
-        n         -= m;
-        cx->start += m;
-        pp.done   += m;
-
-        SYNCQ_ENQ(cx->q, pp);
-
-        // Let the device catchup with the I/O
-        if (cx->iopause) usleep(cx->iopause * 1000);
-    }
-    return 0;
-}
-
-
-
-
-#else
-
-#define IOBUF_INIT(cx)  cx->iobuf = 0
-#define IOTHREAD_FUNC   mmap_thread_func
-
-// Use mmap(2) to write random junk at the given offset
-static void*
-mmap_thread_func(void* x)
+// Fill each block with random junk
+static int
+fill(void* ctx, int thread, uint8_t* buf, size_t n, uint64_t off)
 {
-    ctxt* cx = x;
-    uint64_t n = cx->count;
-    int i;
-    progress pp;
-
-    pp.cpu   = cx->cpu;
-    pp.id    = cx->id;
-    pp.total = cx->count;
-    pp.done  = 0;
-
-    while (n > 0) {
-        uint64_t m  = n > cx->iosize ? cx->iosize : n;
+    opt_option* opt = ctx;
 
-        if (m < cx->pgsize) break;
-        else if (!_IS_ALIGNED(m, cx->pgsize))
-            m = cx->pgsize;
-
-        void* mm = mmap(0, m, PROT_WRITE, MAP_SHARED, cx->fd, cx->start);
-        if (MAP_FAILED == mm)
-            error(1, errno, "CPU%d: Can't mmap %llu bytes at offset %llu",
-                    cx->cpu, m, cx->start);
-
-        for (i = 0; i < cx->wipes; ++i) {
-            arc4random_buf(mm, m);
-        }
-
-        munmap(mm, m);
-
-        n         -= m;
-        cx->start += m;
-        pp.done   += m;
-
-        SYNCQ_ENQ(cx->q, pp);
-
-        // Let the device catchup with the I/O
-        if (cx->iopause) usleep(cx->iopause * 1000);
-    }
+    USEARG(thread);
+    USEARG(off);
 
-    if (n > 0) {
-        uint8_t rr[n];
+    arc4random_buf(buf, n);
 
-        for (i = 0; i < cx->wipes; ++i) {
-            arc4random_buf(rr, n);
-            fullwrite(cx->fd, rr, n, cx->start);
-        }
-    }
+    // Let the device catchup with the I/O
+    if (opt->iopause) usleep(opt->iopause * 1000);
     return 0;
 }
 
-#endif /* __APPLE__ */
-
-
-
-
-
-/*
- * Start a new thread to handle 'count' bytes starting at 'st'.
- *
- * Return next offset to start.
- */
-static uint64_t
-start(ctxt* cx, int cpu, uint64_t st, uint64_t count)
-{
-    int r;
-    int nmax  = sys_cpu_getavail();
-
-    // Align the offset at 8k boundary (page size)
-
-    cx->cpu   = cpu;
-    cx->count = count;
-    cx->start = st;
-
-    printf("CPU %d: Off %llu size %llu\n", cpu, st, count);
-
-    r = pthread_create(&cx->id, 0, IOTHREAD_FUNC, cx);
-    if (r != 0) 
-        error(1, r, "Can't create thread# %d", cx->cpu);
-
-    if (cpu < nmax)
-        sys_cpu_set_thread_affinity(cx->id, cpu);
-
-    return st + count;
-}
-
-
 
 int
 main(int argc, char **argv)
@@ -346,64 +135,49 @@ main(int argc, char **argv)
     if (opt.argv_count <= 0)
         error(1, 0, "Usage: %s [options] device-name", program_name);
 
-#ifndef O_DIRECT
-#define O_DIRECT 0
-#endif
-
     char* dev = opt.argv_inputs[0];
-    int fd    = open(dev, O_RDWR|O_NONBLOCK|O_DIRECT);
+    int flags = O_RDWR;
+    int fd;
+
+#ifdef O_DIRECT
+    if (!opt.buffered) flags |= O_DIRECT;
+#endif
 
+    // Some file systems (tmpfs) don't do O_DIRECT
+    fd = open(dev, flags);
+    if (fd < 0 && errno == EINVAL && flags != O_RDWR) {
+        if (opt.verbose) printf("%s: O_DIRECT not supported; using the page cache\n", dev);
+        fd = open(dev, O_RDWR);
+    }
     if (fd < 0)
         error(1, errno, "Can't open %s for writing", dev);
 
-    uint32_t pgsize   = sysconf(_SC_PAGESIZE);
+#ifdef F_NOCACHE
+    if (!opt.buffered) fcntl(fd, F_NOCACHE, 1);
+#endif
+
     uint64_t disksize = get_disksize(fd, dev);
 
     // We start at least _one_ thread
     if (opt.ncpu <= 0)
         opt.ncpu = sys_cpu_getavail();
 
-    if (opt.iosize == 0)
-        opt.iosize = 256 * 1048576;
-    else if ((opt.iosize & ~(pgsize-1)) != opt.iosize)
-        error(1, 0, "IO size %llu is not a multiple of system page size (%lu)", opt.iosize, pgsize);
-
-    ctxt    cxs[opt.ncpu];
-    progq   pq;
-    speedo  sp;
-    int i;
-
-
-    i = SYNCQ_INIT(&pq, QUEUESIZE);
-    if (i != 0) error(1, -i, "Can't initialize SyncQ");
+    if (opt.depth <= 0)
+        opt.depth = 1;
 
-    speedo_init(&sp, opt.ncpu);
-
-    // ensure frac is a multiple of page size.
-    uint64_t frac, rem;
-
-    frac = disksize / opt.ncpu;
-    frac = _ALIGN_DOWN(frac, pgsize);
-    rem  = disksize - (frac * opt.ncpu);
-
-    // Initialize every instance
-    for (i = 0; i < opt.ncpu; ++i) {
-        ctxt* cx = &cxs[i];
-
-        memset(cx, 0, sizeof *cx);
-
-        cx->fd      = fd;
-        cx->wipes   = opt.wipes;
-        cx->iosize  = opt.iosize;
-        cx->iopause = opt.iopause;
-        cx->pgsize  = pgsize;
-        cx->q       = &pq;
+    if (opt.iosize == 0)
+        opt.iosize = 1048576;
+    else if (!_IS_ALIGNED(opt.iosize, BLKW_ALIGN))
+        error(1, 0, "IO size %llu is not a multiple of %d", opt.iosize, BLKW_ALIGN);
 
-        // Darwin doesn't let us mmap block devices. Grr.
-        // So, we create a per-thread random buffer
-        IOBUF_INIT(cx);
-    }
+    blkwriter_opt bo;
 
+    memset(&bo, 0, sizeof bo);
+    bo.nthreads   = opt.ncpu;
+    bo.depth      = opt.depth;
+    bo.blksize    = opt.iosize;
+    bo.fsync      = opt.syncsize > 0 ? BLKW_FSYNC_EVERY : BLKW_FSYNC_END;
+    bo.sync_bytes = opt.syncsize;
 
     if (opt.verbose) {
         char b0[128];
@@ -411,49 +185,51 @@ main(int argc, char **argv)
 
         humanize_size(b0, sizeof b0, disksize);
         humanize_size(b1, sizeof b1, opt.iosize);
-        printf("%s: %s; using %d threads to wipe %d time%s [IO size %s, IO pause %d ms]\n",
-                dev, b0, opt.ncpu, opt.wipes, opt.wipes > 1 ? "s" : "", b1, opt.iopause);
+        printf("%s: %s; using %d threads to wipe %d time%s [IO size %s x %d, IO pause %d ms]\n",
+                dev, b0, opt.ncpu, opt.wipes, opt.wipes > 1 ? "s" : "", b1, opt.depth, opt.iopause);
     }
 
-    // Start the first thread separately
-    // We want to account for the fraction separately
-    uint64_t st = 0;
-    for (i = 0; i < opt.ncpu-1; ++i) {
-        ctxt* cx = &cxs[i];
-
-        st = start(cx, i, st, frac);
+    uint64_t t0 = timenow();
+    int i, r;
+
+    for (i = 0; i < opt.wipes; ++i) {
+        blkwriter* bw;
+        blkwriter_stats st;
+        speedo sp;
+
+        r = blkwriter_start(&bw, fd, 0, disksize, &bo, fill, &opt);
+        if (r < 0) error(1, -r, "Can't start writers for %s", dev);
+
+        if (opt.verbose && i == 0)
+            printf("%s: %s backend\n", dev, blkwriter_backend(bw));
+
+        /*
+         * Show progress reports until the writers are done.
+         */
+        speedo_init(&sp);
+        do {
+            usleep(100000);
+            blkwriter_get_stats(bw, &st);
+            if (opt.verbose) speedo_show(&sp, bw);
+        } while (st.running > 0);
+
+        r = blkwriter_wait(bw);
+        blkwriter_destroy(bw);
+        if (r < 0) error(1, -r, "Write to %s failed", dev);
     }
 
-    // Last thread does frac + rem
-    start(&cxs[i], i, st, frac + rem);
-
-    /*
-     * Now, wait for the threads to complete and show progress
-     * reports.
-     */
-    int done = opt.ncpu;
-    while (done > 0) {
-        progress p = { .cpu = 0, .id = 0, .done = 0 };
-
-       SYNCQ_DEQ(&pq, p);
-
-        if (p.done == p.total) {
-            void* rr;
-
-            done--;
-            pthread_join(p.id, &rr);
-        }
-        if (opt.verbose) {
-            speedo_show(&sp, p.cpu, p.done, p.total);
-        }
-    }
+    uint64_t tm = timenow() - t0;
 
     if (opt.verbose) {
         fputc('\n', stdout);
     }
 
-    return 0;
+    printf("%s: wrote %llu bytes in %.2f s, %.3f GB/s\n", dev,
+            (unsigned long long)(disksize * opt.wipes), dd(tm) * 1.0e-6,
+            dd(disksize * opt.wipes) / (dd(tm) * 1.0e3));
 
+    close(fd);
+    return 0;
 }
 
 
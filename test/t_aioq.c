@@ -0,0 +1,481 @@
+/*
+ * Test and fio-like benchmark for the async I/O queue.
+ *
+ * Usage: t_aioq [FILE_MB [BLOCK_KB [DEPTH [FILE]]]]
+ *
+ * Verifies write/read round trips (plain, registered files and
+ * buffers, poll(2) driven completion) and that destroying a queue
+ * after a failed submit cancels what didn't go in, on each backend;
+ * then runs
+ * sequential and random reads and writes of BLOCK_KB blocks at
+ * DEPTH requests in flight and prints IOPS and latencies. Runs are
+ * repeated with O_DIRECT where the file system supports it.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "posix/aioq.h"
+
+#define _d(x)   ((double)(x))
+
+#define NBUFS   8
+
+// In aioq_test.o: aioq.c built with AIOQ_TEST
+extern void __aioq_fail_submit(aioq* q, int err);
+
+
+/*
+ * Round trip check: write NBUFS blocks with registered files and
+ * buffers, fsync, read them back with plain requests driven off
+ * poll(2) on aioq_fd().
+ */
+struct rt
+{
+    aioq_req req[16];
+    int      done;
+    int      err;
+};
+
+static void
+rt_cb(void* ctx, aioq_req* r)
+{
+    struct rt* t = (struct rt*)ctx;
+
+    if (r->res != (ssize_t)r->len) t->err++;
+    t->done++;
+}
+
+
+static void
+roundtrip(const char* fn, unsigned flags)
+{
+    size_t bs = 65536;
+    uint8_t* bufs[NBUFS];
+    struct iovec iov[NBUFS];
+    struct rt t;
+    aioq* q;
+    int i, fd, r;
+
+    if ((r = aioq_init(&q, 16, flags, 0)) < 0) error(1, -r, "can't make aioq");
+    if ((fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) error(1, errno, "can't open %s", fn);
+
+    for (i = 0; i < NBUFS; i++) {
+        bufs[i] = aioq_buf_alloc(bs);
+        memset(bufs[i], 'a' + i, bs);
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len  = bs;
+    }
+
+    assert(aioq_register_files(q, &fd, 1) == 0);
+    assert(aioq_register_buffers(q, iov, NBUFS) == 0);
+
+    memset(&t, 0, sizeof t);
+    for (i = 0; i < NBUFS; i++) {
+        aioq_req* rq = &t.req[i];
+
+        rq->op        = AIOQ_WRITE;
+        rq->fd        = 0;
+        rq->flags     = AIOQ_FIXED_FILE|AIOQ_FIXED_BUF;
+        rq->buf_index = i;
+        rq->buf       = bufs[i];
+        rq->len       = bs;
+        rq->off       = (uint64_t)i * bs;
+        rq->cb        = rt_cb;
+        rq->ctx       = &t;
+        assert(aioq_prep(q, rq) == 0);
+    }
+    assert(aioq_submit(q) == NBUFS);
+    while (t.done < NBUFS) aioq_reap(q, NBUFS - t.done);
+    if (t.err) error(1, 0, "%s: write errors", aioq_backend(q));
+
+    /* fsync reports 0 bytes, not 'len' */
+    t.req[0].op    = AIOQ_FSYNC;
+    t.req[0].len   = 0;
+    t.req[0].flags = 0;
+    t.req[0].fd    = fd;
+    t.done = 0;
+    assert(aioq_prep(q, &t.req[0]) == 0);
+    aioq_submit(q);
+    aioq_reap(q, 1);
+    assert(t.done == 1 && t.err == 0);
+
+    t.done = 0;
+    for (i = 0; i < NBUFS; i++) {
+        aioq_req* rq = &t.req[i];
+
+        memset(bufs[i], 0, bs);
+        rq->op    = AIOQ_READ;
+        rq->fd    = fd;
+        rq->flags = 0;
+        rq->len   = bs;
+        rq->buf   = bufs[(i + 1) % NBUFS];
+        assert(aioq_prep(q, rq) == 0);
+    }
+    aioq_submit(q);
+
+    while (t.done < NBUFS) {
+        struct pollfd pfd = { aioq_fd(q), POLLIN, 0 };
+
+        if (poll(&pfd, 1, 5000) <= 0) error(1, 0, "%s: no completion event", aioq_backend(q));
+        aioq_reap(q, 0);
+    }
+    if (t.err) error(1, 0, "%s: read errors", aioq_backend(q));
+
+    for (i = 0; i < NBUFS; i++) {
+        uint8_t* b = bufs[(i + 1) % NBUFS];
+        size_t j;
+
+        for (j = 0; j < bs; j++) {
+            if (b[j] != 'a' + i) error(1, 0, "%s: block %d: bad data", aioq_backend(q), i);
+        }
+    }
+
+    /* Queue depth is enforced */
+    for (i = 0; i < 16; i++) {
+        t.req[i]     = t.req[i % NBUFS];
+        t.req[i].buf = bufs[i % NBUFS];
+        assert(aioq_prep(q, &t.req[i]) == 0);
+    }
+    assert(aioq_pending(q) == 16);
+    assert(aioq_prep(q, &t.req[0]) == -EAGAIN);
+    t.done = 0;
+    aioq_submit(q);
+    while (aioq_pending(q) > 0) aioq_reap(q, 1);
+    assert(t.done == 16 && t.err == 0);
+
+    printf("%s: round trip OK\n", aioq_backend(q));
+
+    aioq_destroy(q);
+    for (i = 0; i < NBUFS; i++) free(bufs[i]);
+    close(fd);
+}
+
+
+/*
+ * Destroy with requests prepped after a failed submit: those
+ * submitted complete, the rest are cancelled (and it doesn't hang).
+ */
+struct cn
+{
+    aioq_req req[4];
+    int      ok;
+    int      cancelled;
+};
+
+static void
+cn_cb(void* ctx, aioq_req* r)
+{
+    struct cn* c = (struct cn*)ctx;
+
+    if (r->res == (ssize_t)r->len) c->ok++;
+    if (r->res == -ECANCELED)      c->cancelled++;
+}
+
+static void
+submit_fail(const char* fn, unsigned flags)
+{
+    static char buf[4096];
+    struct cn c;
+    aioq* q;
+    int i, fd, r;
+
+    if ((r = aioq_init(&q, 16, flags, 0)) < 0) error(1, -r, "can't make aioq");
+    if ((fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) error(1, errno, "can't open %s", fn);
+
+    memset(&c, 0, sizeof c);
+    for (i = 0; i < 4; i++) {
+        aioq_req* rq = &c.req[i];
+
+        rq->op  = AIOQ_WRITE;
+        rq->fd  = fd;
+        rq->buf = buf;
+        rq->len = sizeof buf;
+        rq->off = (uint64_t)i * sizeof buf;
+        rq->cb  = cn_cb;
+        rq->ctx = &c;
+        assert(aioq_prep(q, rq) == 0);
+        if (i == 1) assert(aioq_submit(q) == 2);
+    }
+
+    __aioq_fail_submit(q, -EIO);
+    assert(aioq_submit(q) == -EIO);
+    assert(aioq_pending(q) == 4);
+
+    // And again in aioq_destroy()
+    __aioq_fail_submit(q, -EIO);
+    aioq_destroy(q);
+    assert(c.ok == 2 && c.cancelled == 2);
+    close(fd);
+}
+
+
+/*
+ * Benchmark job: keeps 'depth' requests in flight until 'nops'
+ * have completed.
+ */
+struct job
+{
+    aioq*     q;
+    int       fd;
+    int       write;
+    int       rand;
+    size_t    bs;
+    uint64_t  nblks;
+    uint64_t  nops;
+    uint64_t  issued;
+    uint64_t  done;
+    uint64_t  x;        // xorshift state
+    int       err;
+
+    uint64_t* lat;      // per-op latency, us
+    uint64_t* start;    // per-slot start time
+    aioq_req* reqs;
+    uint8_t*  buf;
+};
+typedef struct job job;
+
+
+static void
+issue(job* j, aioq_req* r)
+{
+    uint64_t blk;
+    int slot = (int)(r - j->reqs);
+
+    if (j->rand) {
+        j->x ^= j->x >> 12; j->x ^= j->x << 25; j->x ^= j->x >> 27;
+        blk = (j->x * 2685821657736338717ULL) % j->nblks;
+    } else {
+        blk = j->issued % j->nblks;
+    }
+
+    r->op  = j->write ? AIOQ_WRITE : AIOQ_READ;
+    r->off = blk * j->bs;
+
+    j->issued++;
+    j->start[slot] = timenow();
+    if (aioq_prep(j->q, r) < 0) abort();
+}
+
+
+static void
+job_cb(void* ctx, aioq_req* r)
+{
+    job* j   = (job*)ctx;
+    int slot = (int)(r - j->reqs);
+
+    if (r->res != (ssize_t)r->len) j->err++;
+    j->lat[j->done++] = timenow() - j->start[slot];
+
+    if (j->issued < j->nops) issue(j, r);
+}
+
+
+static int
+cmpu64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static void
+report(const char* name, const char* be, unsigned depth, uint64_t nops,
+       uint64_t us, uint64_t* lat)
+{
+    double avg = 0;
+    uint64_t i;
+
+    for (i = 0; i < nops; i++) avg += _d(lat[i]);
+    avg /= _d(nops);
+    qsort(lat, nops, sizeof lat[0], cmpu64);
+
+    printf("  %-10s %-8s qd %3u: %9.0f IOPS, lat avg %8.1f us, p50 %6llu, p99 %6llu us\n",
+            name, be, depth, _d(nops) * 1.0e6 / _d(us), avg,
+            (unsigned long long)lat[nops / 2],
+            (unsigned long long)lat[(nops * 99) / 100]);
+}
+
+
+static void
+bench(int fd, const char* name, int write, int rnd, size_t bs,
+      uint64_t nblks, unsigned depth, unsigned flags)
+{
+    uint64_t nops = nblks;
+    uint64_t t0, t1;
+    unsigned i;
+    job j;
+    int r;
+
+    memset(&j, 0, sizeof j);
+    if ((r = aioq_init(&j.q, depth, flags, 0)) < 0) error(1, -r, "can't make aioq");
+
+    j.fd    = fd;
+    j.write = write;
+    j.rand  = rnd;
+    j.bs    = bs;
+    j.nblks = nblks;
+    j.nops  = nops;
+    j.x     = 0x9e3779b97f4a7c15;
+    j.lat   = NEWZA(uint64_t, nops);
+    j.start = NEWZA(uint64_t, depth);
+    j.reqs  = NEWZA(aioq_req, depth);
+    j.buf   = aioq_buf_alloc(bs * depth);
+    memset(j.buf, 0x5a, bs * depth);
+
+    t0 = timenow();
+    for (i = 0; i < depth && j.issued < nops; i++) {
+        aioq_req* rq = &j.reqs[i];
+
+        rq->fd  = fd;
+        rq->buf = j.buf + (i * bs);
+        rq->len = bs;
+        rq->cb  = job_cb;
+        rq->ctx = &j;
+        issue(&j, rq);
+    }
+
+    while (j.done < nops) {
+        aioq_submit(j.q);
+        aioq_reap(j.q, 1);
+    }
+    t1 = timenow();
+
+    if (j.err) error(1, 0, "%s: %d I/O errors", name, j.err);
+    report(name, aioq_backend(j.q), depth, nops, t1 - t0, j.lat);
+
+    aioq_destroy(j.q);
+    DEL(j.lat);
+    DEL(j.start);
+    DEL(j.reqs);
+    free(j.buf);
+}
+
+
+/* Synchronous baseline: one pread/pwrite at a time */
+static void
+bench_sync(int fd, const char* name, int write, int rnd, size_t bs, uint64_t nblks)
+{
+    uint8_t* buf  = aioq_buf_alloc(bs);
+    uint64_t* lat = NEWZA(uint64_t, nblks);
+    uint64_t x    = 0x9e3779b97f4a7c15;
+    uint64_t i, t0, t1;
+
+    memset(buf, 0x5a, bs);
+    t0 = timenow();
+    for (i = 0; i < nblks; i++) {
+        uint64_t blk = i, s = timenow();
+        ssize_t n;
+
+        if (rnd) {
+            x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+            blk = (x * 2685821657736338717ULL) % nblks;
+        }
+
+        n = write ? pwrite(fd, buf, bs, blk * bs) : pread(fd, buf, bs, blk * bs);
+        if (n != (ssize_t)bs) error(1, errno, "%s: sync I/O failed", name);
+        lat[i] = timenow() - s;
+    }
+    t1 = timenow();
+
+    report(name, "sync", 1, nblks, t1 - t0, lat);
+    DEL(lat);
+    free(buf);
+}
+
+
+static void
+run_all(const char* fn, int oflags, size_t bs, uint64_t nblks, unsigned depth)
+{
+    static const struct {
+        const char* name;
+        int write, rnd;
+    } modes[] = {
+        { "seqread",   0, 0 },
+        { "randread",  0, 1 },
+        { "seqwrite",  1, 0 },
+        { "randwrite", 1, 1 },
+    };
+    size_t m;
+    int fd = open(fn, O_RDWR | oflags);
+
+    if (fd < 0) error(1, errno, "can't open %s", fn);
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        bench_sync(fd, modes[m].name, modes[m].write, modes[m].rnd, bs, nblks);
+        bench(fd, modes[m].name, modes[m].write, modes[m].rnd, bs, nblks, depth, AIOQ_THREADS);
+        bench(fd, modes[m].name, modes[m].write, modes[m].rnd, bs, nblks, depth, 0);
+    }
+    close(fd);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    char tmpl[] = "/tmp/t_aioq_XXXXXX";
+    size_t mb     = 64;
+    size_t bkb    = 4;
+    unsigned depth = 32;
+    const char* fn;
+    uint64_t nblks;
+    int fd;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    mb = 1024;
+#endif
+
+    if (argc > 1) mb    = strtoul(argv[1], 0, 0);
+    if (argc > 2) bkb   = strtoul(argv[2], 0, 0);
+    if (argc > 3) depth = strtoul(argv[3], 0, 0);
+    if (argc > 4) {
+        fn = argv[4];
+    } else {
+        if ((fd = mkstemp(tmpl)) < 0) error(1, errno, "can't make temp file");
+        close(fd);
+        fn = tmpl;
+    }
+
+    roundtrip(fn, AIOQ_THREADS);
+    roundtrip(fn, 0);
+    submit_fail(fn, AIOQ_THREADS);
+    submit_fail(fn, 0);
+
+    nblks = (mb * 1024) / bkb;
+    if ((fd = open(fn, O_RDWR|O_TRUNC)) < 0 || ftruncate(fd, nblks * bkb * 1024) < 0)
+        error(1, errno, "can't size %s", fn);
+    close(fd);
+
+    printf("\n%zu MB file, %zu KB blocks, buffered:\n", mb, bkb);
+    run_all(fn, 0, bkb * 1024, nblks, depth);
+
+#ifdef O_DIRECT
+    if ((fd = open(fn, O_RDWR|O_DIRECT)) >= 0) {
+        close(fd);
+        printf("\n%zu MB file, %zu KB blocks, O_DIRECT:\n", mb, bkb);
+        run_all(fn, O_DIRECT, bkb * 1024, nblks, depth);
+    } else {
+        printf("\nO_DIRECT not supported on %s; skipped\n", fn);
+    }
+#endif /* O_DIRECT */
+
+    if (argc <= 4) unlink(fn);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,357 @@
+/*
+ * Test and benchmark for the parallel block writer.
+ *
+ * Usage: t_blkwriter [FILE_MB [BLOCK_KB [DEPTH [FILE]]]]
+ *
+ * Writes an offset dependent pattern with each backend and fsync
+ * policy (including a range with an unaligned tail) and verifies
+ * it. Then compares GB/s of O_DIRECT and buffered blkwriter runs
+ * with the mmap + memcpy chunks that mt-dd-wipe used to write.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "posix/blkwriter.h"
+
+#define _d(x)   ((double)(x))
+
+
+/* Every 8 bytes hold their own file offset */
+static int
+pattern(void* ctx, int thread, uint8_t* buf, size_t n, uint64_t off)
+{
+    size_t i;
+
+    USEARG(ctx);
+    USEARG(thread);
+
+    for (i = 0; i < n; i++) {
+        uint64_t o = off + i;
+
+        buf[i] = (uint8_t)((o & ~7ULL) >> (8 * (o & 7)));
+    }
+    return 0;
+}
+
+
+static int
+junk(void* ctx, int thread, uint8_t* buf, size_t n, uint64_t off)
+{
+    USEARG(ctx);
+    USEARG(off);
+
+    memset(buf, 0x5a + thread, n);
+    return 0;
+}
+
+
+static int
+failing(void* ctx, int thread, uint8_t* buf, size_t n, uint64_t off)
+{
+    USEARG(ctx);
+    USEARG(thread);
+    USEARG(buf);
+    USEARG(n);
+
+    return off >= 4 * 1048576 ? -ENOSPC : 0;
+}
+
+
+static void
+verify(const char* fn, uint64_t size)
+{
+    uint8_t* buf = NEWA(uint8_t, 1048576);
+    uint8_t* ref = NEWA(uint8_t, 1048576);
+    uint64_t off = 0;
+    int fd       = open(fn, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) error(1, errno, "can't open %s", fn);
+    fstat(fd, &st);
+    if ((uint64_t)st.st_size != size) error(1, 0, "size %llu, expected %llu",
+                                            (unsigned long long)st.st_size,
+                                            (unsigned long long)size);
+
+    while (off < size) {
+        size_t n = size - off > 1048576 ? 1048576 : size - off;
+
+        if (pread(fd, buf, n, off) != (ssize_t)n) error(1, errno, "short read at %llu", off);
+        pattern(0, 0, ref, n, off);
+        if (memcmp(buf, ref, n) != 0) error(1, 0, "bad data at 1MB block %llu", off);
+        off += n;
+    }
+
+    close(fd);
+    DEL(buf);
+    DEL(ref);
+}
+
+
+static int
+openf(const char* fn, int direct)
+{
+    int fd;
+
+#ifdef O_DIRECT
+    if (direct) {
+        if ((fd = open(fn, O_RDWR|O_CREAT|O_TRUNC|O_DIRECT, 0600)) >= 0) return fd;
+        if (errno != EINVAL) error(1, errno, "can't open %s", fn);
+    }
+#endif
+    USEARG(direct);
+    if ((fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) error(1, errno, "can't open %s", fn);
+    return fd;
+}
+
+
+static void
+check(const char* fn, uint64_t size, int direct, const blkwriter_opt* o)
+{
+    blkwriter* w;
+    blkwriter_stats st;
+    int fd = openf(fn, direct);
+    int fl = fcntl(fd, F_GETFL);
+    int r;
+
+    if (ftruncate(fd, size) < 0) error(1, errno, "can't size %s", fn);
+
+    r = blkwriter_start(&w, fd, 0, size, o, pattern, 0);
+    if (r < 0) error(1, -r, "can't start writer");
+
+    r = blkwriter_wait(w);
+    if (r < 0) error(1, -r, "%s: write failed", blkwriter_backend(w));
+
+    blkwriter_get_stats(w, &st);
+    assert(st.done == size && st.running == 0);
+    if (o->fsync != BLKW_FSYNC_NONE) assert(st.fsyncs > 0);
+    else                             assert(st.fsyncs == 0);
+
+    // The tail doesn't touch the flags of the caller's fd
+    assert(fcntl(fd, F_GETFL) == fl);
+
+    blkwriter_destroy(w);
+    close(fd);
+    verify(fn, size);
+}
+
+
+static void
+correctness(const char* fn)
+{
+    static const struct {
+        int     direct;
+        int     fsync;
+        unsigned flags;
+    } cases[] = {
+        { 1, BLKW_FSYNC_END,   0 },
+        { 1, BLKW_FSYNC_EVERY, 0 },
+        { 1, BLKW_FSYNC_NONE,  BLKW_PWRITEV },
+        { 1, BLKW_FSYNC_EVERY, BLKW_PWRITEV },
+        { 0, BLKW_FSYNC_END,   0 },
+        { 0, BLKW_FSYNC_END,   BLKW_PWRITEV },
+    };
+    blkwriter_opt o;
+    blkwriter* w;
+    size_t i;
+    int fd, r;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        memset(&o, 0, sizeof o);
+        o.nthreads   = 3;
+        o.depth      = 3;
+        o.blksize    = 65536;
+        o.fsync      = cases[i].fsync;
+        o.sync_bytes = 1048576;
+        o.flags      = cases[i].flags;
+
+        check(fn, 8 * 1048576 + 12345, cases[i].direct, &o);    // unaligned tail
+        check(fn, 3 * 4096, cases[i].direct, &o);               // tiny
+        check(fn, 100, cases[i].direct, &o);                    // tail only
+    }
+
+    /* Errors from the fill function stop all writers */
+    fd = openf(fn, 1);
+    memset(&o, 0, sizeof o);
+    o.nthreads = 2;
+    o.blksize  = 65536;
+    r = blkwriter_start(&w, fd, 0, 16 * 1048576, &o, failing, 0);
+    assert(r == 0);
+    r = blkwriter_wait(w);
+    assert(r == -ENOSPC);
+    blkwriter_destroy(w);
+    close(fd);
+
+    printf("correctness OK\n");
+}
+
+
+/*
+ * What mt-dd-wipe used to do: each thread mmap's and fills a chunk
+ * at a time, leaving writeback to the page cache.
+ */
+struct mchunk
+{
+    pthread_t id;
+    int       fd;
+    uint64_t  start;
+    uint64_t  count;
+    size_t    chunk;
+};
+
+static void*
+mmap_writer(void* x)
+{
+    struct mchunk* c = x;
+    uint64_t off = c->start;
+    uint64_t end = c->start + c->count;
+
+    while (off < end) {
+        size_t n = end - off > c->chunk ? c->chunk : end - off;
+        void* p  = mmap(0, n, PROT_WRITE, MAP_SHARED, c->fd, off);
+
+        if (p == MAP_FAILED) error(1, errno, "can't mmap %zu bytes", n);
+        memset(p, 0x5a, n);
+        munmap(p, n);
+        off += n;
+    }
+    return 0;
+}
+
+
+static double
+bench_mmap(const char* fn, uint64_t size, int nthr)
+{
+    struct mchunk c[nthr];
+    uint64_t frac = _ALIGN_DOWN(size / nthr, 4096);
+    uint64_t t0, t1;
+    int fd = openf(fn, 0);
+    int i;
+
+    if (ftruncate(fd, size) < 0) error(1, errno, "can't size %s", fn);
+
+    t0 = timenow();
+    for (i = 0; i < nthr; i++) {
+        c[i].fd    = fd;
+        c[i].start = i * frac;
+        c[i].count = i == nthr - 1 ? size - c[i].start : frac;
+        c[i].chunk = 256 * 1048576;
+        pthread_create(&c[i].id, 0, mmap_writer, &c[i]);
+    }
+    for (i = 0; i < nthr; i++) pthread_join(c[i].id, 0);
+    fsync(fd);
+    t1 = timenow();
+
+    close(fd);
+    return _d(size) / (_d(t1 - t0) * 1.0e3);
+}
+
+
+static double
+bench_bw(const char* fn, uint64_t size, int direct, const blkwriter_opt* o, const char** be)
+{
+    blkwriter* w;
+    uint64_t t0, t1;
+    int fd = openf(fn, direct);
+    int r;
+
+    if (ftruncate(fd, size) < 0) error(1, errno, "can't size %s", fn);
+
+    t0 = timenow();
+    if ((r = blkwriter_start(&w, fd, 0, size, o, junk, 0)) < 0) error(1, -r, "can't start writer");
+    if ((r = blkwriter_wait(w)) < 0) error(1, -r, "write failed");
+    t1 = timenow();
+
+    *be = blkwriter_backend(w);
+    blkwriter_destroy(w);
+    close(fd);
+    return _d(size) / (_d(t1 - t0) * 1.0e3);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    char tmpl[] = "/tmp/t_blkw_XXXXXX";
+    size_t mb      = 256;
+    size_t bkb     = 1024;
+    unsigned depth = 4;
+    int nthr       = sys_cpu_getavail();
+    const char* fn;
+    const char* be;
+    blkwriter_opt o;
+    uint64_t size;
+    int fd, direct;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    mb = 2048;
+#endif
+
+    if (argc > 1) mb    = strtoul(argv[1], 0, 0);
+    if (argc > 2) bkb   = strtoul(argv[2], 0, 0);
+    if (argc > 3) depth = strtoul(argv[3], 0, 0);
+    if (argc > 4) {
+        fn = argv[4];
+    } else {
+        if ((fd = mkstemp(tmpl)) < 0) error(1, errno, "can't make temp file");
+        close(fd);
+        fn = tmpl;
+    }
+
+    correctness(fn);
+
+    size = (uint64_t)mb * 1048576;
+    memset(&o, 0, sizeof o);
+    o.nthreads = nthr;
+    o.depth    = depth;
+    o.blksize  = bkb * 1024;
+
+    direct = 0;
+#ifdef O_DIRECT
+    if ((fd = open(fn, O_RDWR|O_DIRECT)) >= 0) {
+        direct = 1;
+        close(fd);
+    }
+#endif
+
+    printf("%zu MB, %d threads, %zu KB x %u blocks:\n", mb, nthr, bkb, depth);
+    printf("  mmap 256MB chunks:        %6.3f GB/s\n", bench_mmap(fn, size, nthr));
+
+    if (direct) {
+        double g = bench_bw(fn, size, 1, &o, &be);
+
+        printf("  O_DIRECT %-8s:        %6.3f GB/s\n", be, g);
+        o.flags = BLKW_PWRITEV;
+        g = bench_bw(fn, size, 1, &o, &be);
+        printf("  O_DIRECT %-8s:        %6.3f GB/s\n", be, g);
+        o.flags = 0;
+    } else {
+        printf("  O_DIRECT not supported on %s; skipped\n", fn);
+    }
+
+    {
+        double g = bench_bw(fn, size, 0, &o, &be);
+
+        printf("  buffered %-8s:        %6.3f GB/s\n", be, g);
+    }
+
+    if (argc <= 4) unlink(fn);
+    return 0;
+}
+
+/* EOF */
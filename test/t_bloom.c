@@ -17,6 +17,7 @@
 #include "utils/arena.h"
 #include "fast/vect.h"
 #include "utils/hashfunc.h"
+#include "bench.h"
 
 
 extern uint32_t arc4random(void);
@@ -47,10 +48,13 @@ struct result
 typedef struct result result;
 
 
-#define now()       sys_cpu_timestamp()
 #define _d(x)       ((double)(x))
 
-#define NITER       32
+// Time 'stmt' if we're benchmarking
+#define timed(bb, stmt) do {                    \
+        if (bb) BENCH_OP(bb, stmt);             \
+        else    { stmt; }                       \
+    } while (0)
 
 
 // Score a test result
@@ -113,73 +117,76 @@ read_words(strvect* v, arena_t a, const char* filename)
     if (fp != stdin) fclose(fp);
 }
 
-static uint64_t
-find_all(strvect* v, Bloom* b, int show_results)
+static void
+find_all(strvect* v, Bloom* b, int show_results, bench* bb)
 {
     size_t i;
     word* w;
-    uint64_t tot = 0;
     result rr = { 0, 0, 0};
 
     VECT_FOR_EACHi(v, i, w) {
-        uint64_t t0 = now();
-        int r = Bloom_find(b, w->h);
-        tot += now() - t0;
+        int r;
+
+        timed(bb, r = Bloom_find(b, w->h));
         score(r, 1, &rr, w);
     }
 
     if (show_results) print_results("find-all", &rr, b);
-    return tot;
 }
 
-static uint64_t
-insert_words(strvect* v, Bloom* b)
+static void
+insert_words(strvect* v, Bloom* b, bench* bb)
 {
     word* w;
-    uint64_t tot = 0;
 
     VECT_FOR_EACH(v, w) {
-        uint64_t t0 = now();
-        Bloom_probe(b, w->h);
-        tot += now() - t0;
+        timed(bb, Bloom_probe(b, w->h));
     }
-    return tot;
+}
+
+
+static Bloom*
+new_bloom(Bloom* b, size_t n, int counting, int scalable)
+{
+    if (counting) return Counting_bloom_init(b, n, 0.005);
+    return Standard_bloom_init(b, scalable ? n / 4 : n, 0.005, scalable);
 }
 
 
 static void
-perf_test(strvect* v, size_t Niters, int counting, int scalable)
+perf_test(strvect* v, bench* bb, int counting, int scalable)
 {
     Bloom _b;
-    uint64_t tins  = 0,
-             tsrch = 0;
-    size_t i;
     size_t n = VECT_SIZE(v);
     Bloom *b;
+    char name[64];
 
-    if (counting) {
-        for (i = 0; i < Niters; ++i) {
-            b      = Counting_bloom_init(&_b, n, 0.005);
-            tins  += insert_words(v, b);
-            tsrch += find_all(v, b, 0);
-            Bloom_fini(b);
-        }
-    } else {
-        if (scalable)   n /= 4;
-        for (i = 0; i < Niters; ++i) {
-            b      = Standard_bloom_init(&_b, n, 0.005, scalable);
-            tins  += insert_words(v, b);
-            tsrch += find_all(v, b, 0);
-            Bloom_fini(b);
-        }
+    const char* pref = scalable ? "scalable-" : "";
+    const char* kind = counting ? "counting-bloom" : "standard-bloom";
+
+    snprintf(name, sizeof name, "%s%s/add", pref, kind);
+    bench_begin(bb, name, n);
+    while (bench_next(bb)) {
+        b = new_bloom(&_b, n, counting, scalable);
+        bench_start(bb);
+        insert_words(v, b, bb);
+        bench_stop(bb);
+        Bloom_fini(b);
     }
+    bench_end(bb);
 
-    double  ins  = (_d(tins)  / _d(Niters)) / _d(n);
-    double  srch = (_d(tsrch) / _d(Niters)) / _d(n);
+    b = new_bloom(&_b, n, counting, scalable);
+    insert_words(v, b, 0);
 
-    const char* pref = scalable ? "scalable-" : "";
-    printf("    Performance:  %s%s %8.4f cy/add %8.4f cy/search\n", pref,
-            counting ? "counting-bloom" : "standard-bloom", ins, srch);
+    snprintf(name, sizeof name, "%s%s/search", pref, kind);
+    bench_begin(bb, name, n);
+    while (bench_next(bb)) {
+        bench_start(bb);
+        find_all(v, b, 0, bb);
+        bench_stop(bb);
+    }
+    bench_end(bb);
+    Bloom_fini(b);
 }
 
 
@@ -278,7 +285,7 @@ marshal_tests(Bloom* b, strvect * v, const char *desc)
     assert(Bloom_eq(b, ub));
 
     // Verify that all the elements are present.
-    find_all(v, b, 0);
+    find_all(v, b, 0, 0);
     Bloom_fini(ub); ub = 0;
 
     printf("ok\n    Unmarshal mem-mapped: ");
@@ -291,7 +298,7 @@ marshal_tests(Bloom* b, strvect * v, const char *desc)
     assert(Bloom_eq(b, ub));
 
     // Verify that all the elements are present.
-    find_all(v, b, 0);
+    find_all(v, b, 0, 0);
     Bloom_fini(ub);
 
     printf("ok\n");
@@ -301,7 +308,7 @@ marshal_tests(Bloom* b, strvect * v, const char *desc)
 
 
 static void
-counting_tests(strvect* v)
+counting_tests(strvect* v, bench* bb)
 {
     char buf[4096];
     Bloom _b;
@@ -311,9 +318,9 @@ counting_tests(strvect* v)
     printf("Counting-Bloom-Tests:\n");
 
     b = Counting_bloom_init(&_b, n, 0.005);
-    insert_words(v, b);
+    insert_words(v, b, 0);
     VECT_SHUFFLE(v, arc4random);
-    find_all(v, b, 1);
+    find_all(v, b, 1, 0);
 
     printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
     delete_test(v, b);
@@ -324,16 +331,16 @@ counting_tests(strvect* v)
     Bloom_fini(b);
 
     b = Counting_bloom_init(&_b, n, 0.005);
-    insert_words(v, b);
+    insert_words(v, b, 0);
     marshal_tests(b, v, "Counting");
     Bloom_fini(b);
 
-    perf_test(v, NITER, 1, 0);
+    perf_test(v, bb, 1, 0);
 }
 
 
 static void
-quick_tests(strvect* v, int scalable)
+quick_tests(strvect* v, int scalable, bench* bb)
 {
     char desc[64] = "";
     char buf[8192];
@@ -351,9 +358,9 @@ quick_tests(strvect* v, int scalable)
     printf("%s-Bloom-Tests:\n", desc);
 
     b = Standard_bloom_init(&_b, n, 0.005, scalable);
-    insert_words(v, b);
+    insert_words(v, b, 0);
     VECT_SHUFFLE(v, arc4random);
-    find_all(v, b, 1);
+    find_all(v, b, 1, 0);
 
     printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
     Bloom_fini(b);
@@ -363,11 +370,11 @@ quick_tests(strvect* v, int scalable)
     Bloom_fini(b);
 
     b = Standard_bloom_init(&_b, n, 0.005, scalable);
-    insert_words(v, b);
+    insert_words(v, b, 0);
     marshal_tests(b, v, desc);
     Bloom_fini(b);
 
-    perf_test(v, NITER, 0, scalable);
+    perf_test(v, bb, 0, scalable);
 }
 
 
@@ -380,16 +387,22 @@ main(int argc, char* argv[])
     char* filename = argc > 1 ? argv[1] : "/usr/share/dict/words";
     arena_t a;
     strvect v;
+    bench bb;
+    int e;
+
+    if ((e = bench_init(&bb, "t_bloom", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
 
     VECT_INIT(&v, 256*1024);
     arena_new(&a, 1048576);
 
     read_words(&v, a, filename);
 
-    counting_tests(&v);
+    counting_tests(&v, &bb);
 
-    quick_tests(&v, 0);
-    quick_tests(&v, 1);
+    quick_tests(&v, 0, &bb);
+    quick_tests(&v, 1, &bb);
+    bench_fini(&bb);
 
     VECT_FINI(&v);
     arena_delete(a);
@@ -0,0 +1,504 @@
+/*
+ * Test for the variable length message queues.
+ *
+ * Usage: t_byteq [NPRODUCERS]
+ *
+ * Checks reserve/commit and read/release on one thread: fill,
+ * wraparound with padding, batching and the space limits. Then
+ * passes messages of random lengths from one producer (SPSC) and
+ * from NPRODUCERS producers (MPSC) to a consumer thread, with and
+ * without batching, and checks every message arrives intact and in
+ * order. Then benchmarks messages/sec and MB/s across message
+ * sizes, against passing malloc'd buffers through an SPSCQ.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "fast/byteq.h"
+#include "fast/spsc_bounded_queue.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define NMSG        (1024 * 1024)
+#else
+#define NMSG        (256 * 1024)
+#endif
+
+#define QSIZE       (256 * 1024)
+#define MAXPROD     64
+#define MAXLEN      8192
+
+static uint8_t Src[MAXLEN];     // payload of benchmark messages
+
+
+static inline uint64_t
+mix(uint64_t z)
+{
+    z = (z ^ (z >> 33)) * 0xff51afd7ed558ccdULL;
+    z = (z ^ (z >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return z ^ (z >> 33);
+}
+
+
+// Message 'i' of producer 'id': its length and contents
+static inline size_t
+msglen(uint64_t id, uint64_t i, size_t max)
+{
+    return 16 + (mix((id << 40) ^ i) % (max - 15));
+}
+
+static void
+mkmsg(uint8_t *p, size_t n, uint64_t id, uint64_t i)
+{
+    uint64_t x = mix((id << 40) ^ i ^ 0x5555);
+    size_t j;
+
+    memcpy(p, &id, 8);
+    memcpy(p + 8, &i, 8);
+    for (j = 16; j < n; j++) p[j] = (uint8_t)(x + j);
+}
+
+static void
+chkmsg(const uint8_t *p, size_t n, uint64_t id, uint64_t i)
+{
+    uint64_t x = mix((id << 40) ^ i ^ 0x5555);
+    uint64_t a, b;
+    size_t j;
+
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    assert(a == id && b == i);
+    for (j = 16; j < n; j++) assert(p[j] == (uint8_t)(x + j));
+}
+
+
+static void
+test_basic(void)
+{
+    byteq q;
+    uint8_t *p;
+    size_t n;
+    uint64_t i, j, k;
+
+    assert(byteq_init(&q, 32) == -EINVAL);
+    assert(byteq_init(&q, 3000) == 0);
+    assert(q.size == 4096);
+    assert(BYTEQ_MAXMSG(&q) == 2040);
+
+    assert(byteq_reserve(&q, 2041) == 0);
+    assert(byteq_read(&q, &n) == 0);
+
+    // 64 byte records: exactly 64 fit
+    for (i = 0; i < 64; i++) {
+        if (!(p = byteq_reserve(&q, 56))) break;
+        mkmsg(p, 56, 0, i);
+    }
+    assert(i == 64);
+    assert(byteq_reserve(&q, 1) == 0);
+
+    // not visible until committed
+    assert(byteq_read(&q, &n) == 0);
+    byteq_commit(&q);
+    assert(byteq_used(&q) == 4096);
+
+    for (i = 0; i < 64; i++) {
+        assert((p = byteq_read(&q, &n)) && n == 56);
+        chkmsg(p, n, 0, i);
+    }
+    assert(byteq_read(&q, &n) == 0);
+
+    // no space until released
+    assert(byteq_reserve(&q, 8) == 0);
+    byteq_release(&q);
+    assert(byteq_used(&q) == 0);
+
+    // Random lengths, many times around the ring: messages that
+    // don't fit at the end go to the start, behind a pad record
+    for (i = j = 0; i < 100000; ) {
+        for (k = 0; k < 5; k++, i++) {
+            n = msglen(1, i, 1500);
+            if (!(p = byteq_reserve(&q, n))) break;
+            assert(((uintptr_t)p & 7) == 0);
+            mkmsg(p, n, 1, i);
+        }
+        byteq_commit(&q);
+
+        while ((p = byteq_read(&q, &n))) {
+            assert(n == msglen(1, j, 1500));
+            chkmsg(p, n, 1, j++);
+        }
+        byteq_release(&q);
+    }
+    assert(i == j);
+
+    // zero length messages
+    assert(byteq_reserve(&q, 0));
+    byteq_commit(&q);
+    assert(byteq_read(&q, &n) && n == 0);
+    byteq_release(&q);
+
+    byteq_fini(&q);
+}
+
+
+static void
+test_mp_basic(void)
+{
+    size_t n[4] = { 100, 2041, 17, 900 };
+    byteq_resv r1, r2;
+    void *p[4];
+    uint8_t *x;
+    size_t m;
+    byteq q;
+    int i;
+
+    assert(byteq_init(&q, 4096) == 0);
+
+    assert(byteq_mp_reserve_v(&q, n, p, 4, &r1) == -E2BIG);
+    n[1] = 2000;
+
+    // Two reservations; each is seen when it is committed
+    assert(byteq_mp_reserve_v(&q, n, p, 2, &r1) == 0);
+    for (i = 0; i < 2; i++) mkmsg(p[i], n[i], 2, i);
+    assert(byteq_mp_reserve_v(&q, n + 2, p + 2, 2, &r2) == 0);
+    for (i = 2; i < 4; i++) mkmsg(p[i], n[i], 2, i);
+    assert(r2.start == r1.end);
+
+    assert(byteq_read(&q, &m) == 0);
+    byteq_mp_commit(&q, &r1);
+    for (i = 0; i < 2; i++) {
+        assert((x = byteq_read(&q, &m)) && m == n[i]);
+        chkmsg(x, m, 2, i);
+    }
+    assert(byteq_read(&q, &m) == 0);
+    byteq_mp_commit(&q, &r2);
+    for (i = 2; i < 4; i++) {
+        assert((x = byteq_read(&q, &m)) && m == n[i]);
+        chkmsg(x, m, 2, i);
+    }
+    byteq_release(&q);
+
+    // At 3064: 1008 byte records fit at 3064 and (after 24 bytes
+    // of padding) at 4096, 5104 and 6112; the next would end 5064
+    // bytes past the consumer.
+    assert(byteq_used(&q) == 0 && r2.end == 3064);
+    for (i = 0; i < 4; i++) {
+        assert((x = byteq_mp_reserve(&q, 1000, &r1)));
+        mkmsg(x, 1000, 3, i);
+        byteq_mp_commit(&q, &r1);
+    }
+    n[0] = 1000;
+    assert(byteq_mp_reserve_v(&q, n, p, 1, &r2) == -ENOSPC);
+    assert(byteq_used(&q) == 4056);
+
+    for (i = 0; i < 4; i++) {
+        assert((x = byteq_read(&q, &m)) && m == 1000);
+        chkmsg(x, m, 3, i);
+    }
+    byteq_release(&q);
+    assert(byteq_mp_reserve_v(&q, n, p, 1, &r2) == 0);
+
+    byteq_fini(&q);
+}
+
+
+
+/*
+ * Threads
+ */
+
+struct prod
+{
+    pthread_t id;
+    byteq *   q;
+    uint64_t  pid;
+    uint64_t  nmsg;
+    size_t    max;
+    int       batch;
+    int       check;
+};
+
+
+static void *
+spsc_prod(void *v)
+{
+    struct prod *w = v;
+    uint64_t i;
+
+    for (i = 0; i < w->nmsg; i++) {
+        size_t n = w->check ? msglen(w->pid, i, w->max) : w->max;
+        uint8_t *p;
+
+        while (!(p = byteq_reserve(w->q, n))) {
+            byteq_commit(w->q);
+            sched_yield();
+        }
+        if (w->check) {
+            mkmsg(p, n, w->pid, i);
+        } else {
+            memcpy(p, Src, n);
+            memcpy(p, &i, 8);
+        }
+
+        if (((i+1) % w->batch) == 0) byteq_commit(w->q);
+    }
+    byteq_commit(w->q);
+    return 0;
+}
+
+
+static void *
+mpsc_prod(void *v)
+{
+    struct prod *w = v;
+    size_t n[w->batch];
+    void  *p[w->batch];
+    uint64_t i;
+    int j, k;
+
+    for (i = 0; i < w->nmsg; i += k) {
+        byteq_resv r;
+
+        k = w->nmsg - i < (uint64_t)w->batch ? (int)(w->nmsg - i) : w->batch;
+        for (j = 0; j < k; j++) n[j] = w->check ? msglen(w->pid, i+j, w->max) : w->max;
+
+        while (byteq_mp_reserve_v(w->q, n, p, k, &r) < 0) sched_yield();
+
+        for (j = 0; j < k; j++) {
+            if (w->check) {
+                mkmsg(p[j], n[j], w->pid, i+j);
+            } else {
+                memcpy(p[j], Src, n[j]);
+                memcpy(p[j], &w->pid, 8);
+            }
+        }
+        byteq_mp_commit(w->q, &r);
+    }
+    return 0;
+}
+
+
+/*
+ * Consume 'total' messages; if checking, each producer's messages
+ * must come in order and intact. Returns the sum of the first words
+ * of the messages.
+ */
+static uint64_t
+consume(byteq *q, uint64_t total, int nprod, int batch, int check, size_t max)
+{
+    uint64_t next[MAXPROD] = { 0 };
+    uint64_t got = 0, sum = 0;
+    size_t n;
+
+    while (got < total) {
+        uint8_t *p;
+        int k;
+
+        for (k = 0; k < batch && (p = byteq_read(q, &n)); k++) {
+            if (check) {
+                uint64_t id;
+
+                memcpy(&id, p, 8);
+                assert(id < (uint64_t)nprod);
+                assert(n == msglen(id, next[id], max));
+                chkmsg(p, n, id, next[id]++);
+            } else {
+                sum += *(uint64_t *)p;
+            }
+            got++;
+        }
+
+        if (k > 0) byteq_release(q);
+        else       sched_yield();
+    }
+
+    assert(byteq_read(q, &n) == 0);
+    assert(byteq_used(q) == 0);
+    return sum;
+}
+
+
+/*
+ * Pass 'nmsg' messages per producer from 'nprod' producers ('mp'
+ * for the MPSC calls) to this thread. Returns the elapsed µs.
+ */
+static uint64_t
+run(int mp, int nprod, uint64_t nmsg, size_t max, int batch, int check)
+{
+    struct prod w[nprod];
+    uint64_t t0, t1, sum;
+    byteq q;
+    int i;
+
+    assert(byteq_init(&q, QSIZE) == 0);
+
+    t0 = timenow();
+    for (i = 0; i < nprod; i++) {
+        w[i].q     = &q;
+        w[i].pid   = i;
+        w[i].nmsg  = nmsg;
+        w[i].max   = max;
+        w[i].batch = batch;
+        w[i].check = check;
+        pthread_create(&w[i].id, 0, mp ? mpsc_prod : spsc_prod, &w[i]);
+    }
+
+    sum = consume(&q, nmsg * nprod, nprod, batch, check, max);
+    for (i = 0; i < nprod; i++) pthread_join(w[i].id, 0);
+    t1 = timenow();
+
+    // unchecked SPSC messages carry their number
+    if (!check && !mp) assert(sum == (nmsg * (nmsg - 1)) / 2);
+
+    byteq_fini(&q);
+    return t1 - t0;
+}
+
+
+static void
+test_mt(int nprod)
+{
+    run(0, 1, NMSG, 3000, 1, 1);
+    run(0, 1, NMSG, 3000, 16, 1);
+    run(0, 1, NMSG, 60, 64, 1);
+
+    run(1, 1, NMSG, 3000, 1, 1);
+    run(1, nprod, NMSG / nprod, 3000, 1, 1);
+    run(1, nprod, NMSG / nprod, 3000, 8, 1);
+    run(1, nprod, NMSG / nprod, 200, 32, 1);
+}
+
+
+
+/*
+ * Baseline: malloc'd messages through an SPSCQ of pointers
+ */
+
+SPSCQ_DYN_TYPEDEF(ptrq, void *);
+
+struct pctx
+{
+    pthread_t id;
+    ptrq      q;
+    uint64_t  nmsg;
+    size_t    len;
+};
+
+static void *
+ptr_prod(void *v)
+{
+    struct pctx *c = v;
+    uint64_t i;
+
+    for (i = 0; i < c->nmsg; i++) {
+        void *p = malloc(c->len);
+
+        assert(p);
+        memcpy(p, Src, c->len);
+        memcpy(p, &i, 8);
+        while (!SPSCQ_ENQ(&c->q, p)) sched_yield();
+    }
+    return 0;
+}
+
+static uint64_t
+run_ptr(uint64_t nmsg, size_t len)
+{
+    struct pctx c;
+    uint64_t i, t0, t1, sum = 0;
+
+    SPSCQ_DYN_INIT(&c.q, QSIZE / 64);
+    c.nmsg = nmsg;
+    c.len  = len;
+
+    t0 = timenow();
+    pthread_create(&c.id, 0, ptr_prod, &c);
+    for (i = 0; i < nmsg; ) {
+        void *p;
+
+        if (SPSCQ_DEQ(&c.q, p)) {
+            sum += *(uint64_t *)p;
+            free(p);
+            i++;
+        } else {
+            sched_yield();
+        }
+    }
+    pthread_join(c.id, 0);
+    t1 = timenow();
+
+    assert(sum == (nmsg * (nmsg - 1)) / 2);
+    SPSCQ_DYN_FINI(&c.q);
+    return t1 - t0;
+}
+
+
+static void
+perf_test(bench *b, int nprod)
+{
+    static const size_t Size[] = { 16, 64, 256, 1024, 4096 };
+    char name[64];
+    size_t i;
+
+    for (i = 0; i < sizeof Size / sizeof Size[0]; i++) {
+        size_t   n = Size[i];
+        uint64_t m = NMSG;
+        uint64_t us;
+
+        us = run(0, 1, m, n, 32, 0);
+        snprintf(name, sizeof name, "spsc/%zu", n);
+        bench_bytes(b, m * n);
+        bench_add(b, name, m, _d(us) * 1000.0, 0, 0);
+
+        us = run_ptr(m, n);
+        snprintf(name, sizeof name, "spscq-malloc/%zu", n);
+        bench_bytes(b, m * n);
+        bench_add(b, name, m, _d(us) * 1000.0, 0, 0);
+
+        us = run(1, nprod, m / nprod, n, 8, 0);
+        snprintf(name, sizeof name, "mpsc-%dp/%zu", nprod, n);
+        bench_bytes(b, (m / nprod) * nprod * n);
+        bench_add(b, name, (m / nprod) * nprod, _d(us) * 1000.0, 0, 0);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int nprod = sys_cpu_getavail();
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nprod = atoi(argv[1]);
+    if (nprod < 4)       nprod = 4;
+    if (nprod > MAXPROD) nprod = MAXPROD;
+
+    test_basic();
+    test_mp_basic();
+    test_mt(nprod);
+
+    if ((e = bench_init(&b, "t_byteq", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    perf_test(&b, nprod);
+    bench_fini(&b);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,666 @@
+/*
+ * Test for the S3-FIFO cache.
+ *
+ * Usage: t_cache [NTHREADS]
+ *
+ * Checks put/get/del, byte capacity, TTL expiry (on a fake clock)
+ * and that puts don't re-sweep a timer slot full of live entries,
+ * and that a replaced entry keeps its frequency; then replays Zipfian traces - pure and mixed with a scan
+ * of one-hit keys - through the cache and through a global lock
+ * LRU (fast-ht and a list, moved to the head on every hit) of the
+ * same capacity, and compares hit ratios and ops/sec on 1 and
+ * NTHREADS threads.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cache.h"
+#include "utils/cpu.h"
+#include "utils/fast-ht.h"
+#include "utils/hashfunc.h"
+#include "fast/list.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define UNIVERSE    (1 << 20)
+#define NREQ        (8 * 1024 * 1024)
+#else
+#define UNIVERSE    (1 << 18)
+#define NREQ        (2 * 1024 * 1024)
+#endif
+
+#define VLEN        100
+#define NSLOT       50000
+
+
+/*
+ * Trace of key ids: Zipfian over UNIVERSE keys (key i has
+ * probability proportional to 1/(i+1)^s); with 'scan' percent of
+ * the requests replaced by keys that are never seen again.
+ */
+static uint64_t *
+mktrace(uint64_t n, double s, int scan)
+{
+    double   *cdf = NEWA(double, UNIVERSE);
+    uint64_t *t   = NEWA(uint64_t, n);
+    uint64_t  i, once = UNIVERSE;
+    double    sum = 0.0;
+
+    assert(cdf && t);
+    for (i = 0; i < UNIVERSE; i++) cdf[i] = (sum += 1.0 / pow(_d(i+1), s));
+    for (i = 0; i < UNIVERSE; i++) cdf[i] /= sum;
+
+    for (i = 0; i < n; i++) {
+        uint64_t r = fasthash64(&i, sizeof i, 0x243f6a8885a308d3ULL);
+        double   u = _d(r >> 11) * 0x1.0p-53;
+        uint32_t lo = 0, hi = UNIVERSE - 1;
+
+        if ((int)(r % 100) < scan) {
+            t[i] = once++;
+            continue;
+        }
+
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+
+            if (cdf[mid] < u) lo = mid + 1;
+            else              hi = mid;
+        }
+        t[i] = lo;
+    }
+
+    DEL(cdf);
+    return t;
+}
+
+
+
+/*
+ * LRU baseline
+ */
+
+struct lent
+{
+    DL_ENTRY(lent) link;
+    uint64_t key;
+    uint32_t vlen;
+    uint8_t  v[];
+};
+typedef struct lent lent;
+
+DL_HEAD_TYPEDEF(lq, lent);
+
+struct lru
+{
+    pthread_mutex_t lock;
+    ht       idx;
+    lq       q;
+    uint64_t bytes;
+    uint64_t cap;
+    uint64_t charge;    // per entry; as in the cache
+};
+typedef struct lru lru;
+
+
+static inline uint64_t
+lhash(uint64_t k)
+{
+    uint64_t h = fasthash64(&k, sizeof k, 0);
+
+    return h ? h : 1;
+}
+
+static void
+lru_init(lru *l, uint64_t cap, uint64_t charge)
+{
+    memset(l, 0, sizeof *l);
+    pthread_mutex_init(&l->lock, 0);
+    ht_init(&l->idx, 12);
+    DL_INIT(&l->q);
+    l->cap    = cap;
+    l->charge = charge;
+}
+
+static void
+lru_fini(lru *l)
+{
+    lent *e;
+
+    while ((e = DL_REMOVE_HEAD(&l->q, link))) DEL(e);
+    ht_fini(&l->idx);
+    pthread_mutex_destroy(&l->lock);
+}
+
+static ssize_t
+lru_get(lru *l, uint64_t k, void *buf, size_t bufsz)
+{
+    ssize_t r = -ENOENT;
+    void *v;
+
+    pthread_mutex_lock(&l->lock);
+    if (ht_find(&l->idx, lhash(k), &v)) {
+        lent *e = v;
+
+        DL_REMOVE(&l->q, e, link);
+        DL_INSERT_HEAD(&l->q, e, link);
+        memcpy(buf, e->v, e->vlen < bufsz ? e->vlen : bufsz);
+        r = e->vlen;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return r;
+}
+
+static void
+lru_put(lru *l, uint64_t k, const void *val, size_t vlen)
+{
+    uint64_t h = lhash(k);
+    lent *e;
+    void *v;
+
+    pthread_mutex_lock(&l->lock);
+    if (ht_remove(&l->idx, h, &v)) {
+        e = v;
+        DL_REMOVE(&l->q, e, link);
+        l->bytes -= l->charge;
+        DEL(e);
+    }
+
+    while ((l->bytes + l->charge) > l->cap && (e = DL_REMOVE_TAIL(&l->q, link))) {
+        ht_remove(&l->idx, lhash(e->key), 0);
+        l->bytes -= l->charge;
+        DEL(e);
+    }
+
+    e = malloc(sizeof *e + vlen);
+    assert(e);
+    e->key  = k;
+    e->vlen = vlen;
+    memcpy(e->v, val, vlen);
+    ht_probe(&l->idx, h, e);
+    DL_INSERT_HEAD(&l->q, e, link);
+    l->bytes += l->charge;
+    pthread_mutex_unlock(&l->lock);
+}
+
+
+
+/*
+ * Functional tests
+ */
+
+static uint64_t Now = 1000;
+
+static uint64_t
+fakeclock(void)
+{
+    return Now;
+}
+
+
+static void
+mkval(uint8_t *v, size_t n, uint64_t k)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) v[i] = (uint8_t)(k + i);
+}
+
+
+static void
+test_basic(void)
+{
+    cache_opt o = { .capacity = 1024 * 1024, .nshards = 4 };
+    uint8_t v[VLEN], b[VLEN];
+    uint8_t big[64 * 1024];
+    cache_stats st;
+    uint64_t k;
+    cache *c;
+
+    assert(cache_new(&c, &o) == 0);
+
+    for (k = 0; k < 1000; k++) {
+        mkval(v, VLEN, k);
+        assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+    }
+    for (k = 0; k < 1000; k++) {
+        mkval(v, VLEN, k);
+        assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+        assert(0 == memcmp(v, b, VLEN));
+    }
+
+    cache_stats_get(c, &st);
+    assert(st.items == 1000 && st.hits == 1000 && st.misses == 0 && st.evictions == 0);
+    assert(st.bytes <= st.capacity);
+
+    // short buffer: still the full length
+    k = 7;
+    memset(b, 0, sizeof b);
+    assert(cache_get(c, &k, sizeof k, b, 10) == VLEN);
+    mkval(v, VLEN, k);
+    assert(0 == memcmp(v, b, 10) && b[10] == 0);
+
+    // overwrite
+    mkval(v, 50, 99);
+    assert(cache_put(c, &k, sizeof k, v, 50, 0) == 0);
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == 50);
+    assert(0 == memcmp(v, b, 50));
+
+    // a different key length is a different key
+    assert(cache_get(c, &k, 4, b, sizeof b) == -ENOENT);
+
+    assert(cache_del(c, &k, sizeof k) == 0);
+    assert(cache_del(c, &k, sizeof k) == -ENOENT);
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == -ENOENT);
+
+    cache_stats_get(c, &st);
+    assert(st.items == 999);
+
+    // too big for a shard
+    k = 12345;
+    assert(cache_put(c, &k, sizeof k, big, sizeof big, 0) == -E2BIG);
+
+    cache_delete(c);
+
+    o.capacity = 100;
+    assert(cache_new(&c, &o) == -EINVAL);
+}
+
+
+// Byte capacity with sizes across all the classes and malloc
+static void
+test_capacity(void)
+{
+    cache_opt o = { .capacity = 2 * 1024 * 1024, .nshards = 2 };
+    static uint8_t v[16384], b[16384];
+    cache_stats st;
+    uint64_t k, found = 0;
+    cache *c;
+
+    assert(cache_new(&c, &o) == 0);
+
+    for (k = 0; k < 100000; k++) {
+        size_t n = 1 + (fasthash64(&k, sizeof k, 1) % 12000);
+
+        mkval(v, n, k);
+        assert(cache_put(c, &k, sizeof k, v, n, 0) == 0);
+
+        if ((k % 1000) == 0) {
+            cache_stats_get(c, &st);
+            assert(st.bytes <= st.capacity);
+        }
+    }
+
+    // whatever is there is intact
+    for (k = 0; k < 100000; k++) {
+        size_t  n = 1 + (fasthash64(&k, sizeof k, 1) % 12000);
+        ssize_t r = cache_get(c, &k, sizeof k, b, sizeof b);
+
+        if (r < 0) continue;
+        assert((size_t)r == n);
+        mkval(v, n, k);
+        assert(0 == memcmp(v, b, n));
+        found++;
+    }
+
+    cache_stats_get(c, &st);
+    assert(st.items == found);
+    assert(st.evictions == 100000 - found);
+    assert(st.bytes <= st.capacity && st.bytes > st.capacity / 2);
+    printf("capacity: %llu items, %llu of %llu bytes\n",
+           (unsigned long long)st.items, (unsigned long long)st.bytes,
+           (unsigned long long)st.capacity);
+    cache_delete(c);
+}
+
+
+static void
+test_ttl(void)
+{
+    cache_opt o = { .capacity = 1024 * 1024, .nshards = 4, .tick = 10, .clock = fakeclock };
+    uint8_t v[VLEN], b[VLEN];
+    cache_stats st;
+    uint64_t k;
+    cache *c;
+
+    assert(cache_new(&c, &o) == 0);
+
+    // odd keys expire after 100ms
+    for (k = 0; k < 1000; k++) {
+        mkval(v, VLEN, k);
+        assert(cache_put(c, &k, sizeof k, v, VLEN, (k & 1) ? 100 : 0) == 0);
+    }
+
+    Now += 99;
+    for (k = 0; k < 1000; k++) assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+
+    // expired, but not yet freed
+    Now += 1;
+    for (k = 0; k < 1000; k++) {
+        assert(cache_get(c, &k, sizeof k, b, sizeof b) == ((k & 1) ? -ENOENT : VLEN));
+    }
+    cache_stats_get(c, &st);
+    assert(st.items == 1000 && st.expired == 0);
+
+    cache_expire(c);
+    cache_stats_get(c, &st);
+    assert(st.items == 500 && st.expired == 500);
+
+    // Far in the future - more than a turn of the wheel; freed by
+    // the next put to each shard
+    for (k = 0; k < 1000; k += 2) {
+        mkval(v, VLEN, k);
+        assert(cache_put(c, &k, sizeof k, v, VLEN, 50 + k) == 0);
+    }
+    Now += 100000;
+    for (k = 1000; k < 1100; k++) assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+    cache_expire(c);
+    cache_stats_get(c, &st);
+    assert(st.items == 100 && st.expired == 1000);
+
+    // a put without a TTL clears it
+    k = 2000;
+    assert(cache_put(c, &k, sizeof k, v, VLEN, 10) == 0);
+    assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+    Now += 1000;
+    cache_expire(c);
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+
+    cache_delete(c);
+}
+
+
+// Live entries a wheel turn out share the slot of the current
+// tick; puts in that tick must not walk it each time.
+static void
+test_ttl_slot(void)
+{
+    cache_opt o = { .capacity = 64 * 1024 * 1024, .nshards = 1, .tick = 10, .clock = fakeclock };
+    uint8_t v[VLEN];
+    uint64_t k, t0, t1, t2;
+    cache_stats st;
+    cache *c, *c0;
+
+    assert(cache_new(&c, &o) == 0);
+    o.clock = 0;
+    assert(cache_new(&c0, &o) == 0);
+    mkval(v, VLEN, 0);
+
+    t0 = timenow();
+    for (k = 0; k < NSLOT; k++) assert(cache_put(c0, &k, sizeof k, v, VLEN, 0) == 0);
+    t1 = timenow();
+    for (k = 0; k < NSLOT; k++) assert(cache_put(c, &k, sizeof k, v, VLEN, 256 * 10) == 0);
+    t2 = timenow();
+
+    printf("ttl slot: %d puts: %.3f s; without ttl: %.3f s\n", NSLOT,
+           _d(t2 - t1) / 1.0e6, _d(t1 - t0) / 1.0e6);
+    assert((t2 - t1) < 10 * (t1 - t0) + 10000);
+
+    // Swept, but live; then all expire
+    Now += 10;
+    cache_expire(c);
+    cache_stats_get(c, &st);
+    assert(st.items == NSLOT && st.expired == 0);
+
+    Now += 256 * 10;
+    cache_expire(c);
+    cache_stats_get(c, &st);
+    assert(st.items == 0 && st.expired == NSLOT);
+
+    cache_delete(c);
+    cache_delete(c0);
+}
+
+
+// A replaced entry keeps its frequency: a hot key that is
+// rewritten survives a scan of one-hit keys.
+static void
+test_replace(void)
+{
+    cache_opt o = { .capacity = 256 * 1024, .nshards = 1 };
+    uint8_t v[VLEN], b[VLEN];
+    cache_stats st;
+    uint64_t k = 1;
+    cache *c;
+
+    assert(cache_new(&c, &o) == 0);
+
+    mkval(v, VLEN, 1);
+    assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+
+    mkval(v, VLEN, 2);
+    assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+
+    for (k = 100; k < 10100; k++) assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+
+    cache_stats_get(c, &st);
+    assert(st.evictions > 0);
+
+    k = 1;
+    assert(cache_get(c, &k, sizeof k, b, sizeof b) == VLEN);
+    assert(0 == memcmp(v, b, VLEN));
+    cache_delete(c);
+}
+
+
+
+/*
+ * Hit ratio and throughput on traces
+ */
+
+struct worker
+{
+    pthread_t  id;
+    cache *    c;
+    lru *      l;
+    uint64_t * t;
+    uint64_t   n;
+    uint64_t   hits;
+};
+
+
+static void *
+run_cache(void *p)
+{
+    struct worker *w = p;
+    uint8_t v[VLEN];
+    uint64_t i;
+
+    for (i = 0; i < w->n; i++) {
+        uint64_t k = w->t[i];
+
+        if (cache_get(w->c, &k, sizeof k, v, sizeof v) >= 0) {
+            w->hits++;
+        } else {
+            mkval(v, VLEN, k);
+            cache_put(w->c, &k, sizeof k, v, VLEN, 0);
+        }
+    }
+    return 0;
+}
+
+
+static void *
+run_lru(void *p)
+{
+    struct worker *w = p;
+    uint8_t v[VLEN];
+    uint64_t i;
+
+    for (i = 0; i < w->n; i++) {
+        uint64_t k = w->t[i];
+
+        if (lru_get(w->l, k, v, sizeof v) >= 0) {
+            w->hits++;
+        } else {
+            mkval(v, VLEN, k);
+            lru_put(w->l, k, v, VLEN);
+        }
+    }
+    return 0;
+}
+
+
+// Bytes charged for one entry of the trace
+static uint64_t
+charge(void)
+{
+    cache_opt o = { .capacity = 1024 * 1024, .nshards = 1 };
+    uint8_t v[VLEN] = { 0 };
+    cache_stats st;
+    uint64_t k = 0;
+    cache *c;
+
+    assert(cache_new(&c, &o) == 0);
+    assert(cache_put(c, &k, sizeof k, v, VLEN, 0) == 0);
+    cache_stats_get(c, &st);
+    cache_delete(c);
+    return st.bytes;
+}
+
+
+/*
+ * Replay 'n' requests of trace 't' on 'nthr' threads through a
+ * cache and an LRU of 'cap' bytes; returns the hit ratios.
+ */
+static void
+replay(bench *b, const char *name, uint64_t *t, uint64_t n, uint64_t cap,
+       int nthr, double *p_s3, double *p_lru)
+{
+    cache_opt o = { .capacity = cap };
+    struct worker w[nthr];
+    uint64_t t0, t1, hits;
+    char nm[64];
+    cache *c;
+    lru l;
+    int i;
+
+    assert(cache_new(&c, &o) == 0);
+    lru_init(&l, cap, charge());
+
+    for (i = 0; i < nthr; i++) {
+        memset(&w[i], 0, sizeof w[i]);
+        w[i].c = c;
+        w[i].l = &l;
+        w[i].t = t + (n * i) / nthr;
+        w[i].n = (n * (i+1)) / nthr - (n * i) / nthr;
+    }
+
+    t0 = timenow();
+    for (i = 0; i < nthr; i++) pthread_create(&w[i].id, 0, run_cache, &w[i]);
+    for (hits = 0, i = 0; i < nthr; i++) {
+        pthread_join(w[i].id, 0);
+        hits += w[i].hits;
+    }
+    t1 = timenow();
+    *p_s3 = _d(hits) / _d(n);
+    if (b) {
+        snprintf(nm, sizeof nm, "s3fifo/%s-%dthr", name, nthr);
+        bench_add(b, nm, n, _d(t1 - t0) * 1000.0, 0, 0);
+    }
+
+    do {
+        cache_stats st;
+
+        cache_stats_get(c, &st);
+        assert(st.hits == hits && st.hits + st.misses == n);
+        assert(st.bytes <= st.capacity);
+    } while (0);
+
+    for (i = 0; i < nthr; i++) w[i].hits = 0;
+
+    t0 = timenow();
+    for (i = 0; i < nthr; i++) pthread_create(&w[i].id, 0, run_lru, &w[i]);
+    for (hits = 0, i = 0; i < nthr; i++) {
+        pthread_join(w[i].id, 0);
+        hits += w[i].hits;
+    }
+    t1 = timenow();
+    *p_lru = _d(hits) / _d(n);
+    if (b) {
+        snprintf(nm, sizeof nm, "lru/%s-%dthr", name, nthr);
+        bench_add(b, nm, n, _d(t1 - t0) * 1000.0, 0, 0);
+    }
+
+    lru_fini(&l);
+    cache_delete(c);
+}
+
+
+static void
+test_hitratio(const char *name, uint64_t *t, int scan)
+{
+    static const double Pct[] = { 0.1, 1.0, 10.0 };
+    uint64_t ch = charge();
+    size_t i;
+
+    for (i = 0; i < sizeof Pct / sizeof Pct[0]; i++) {
+        uint64_t cap = (uint64_t)(_d(UNIVERSE) * Pct[i] / 100.0) * ch;
+        double s3, lr;
+
+        if (cap < 4096) cap = 4096;
+        replay(0, name, t, NREQ, cap, 1, &s3, &lr);
+        printf("%-8s cache %5.1f%% of keys: hit ratio s3fifo %.4f, lru %.4f\n",
+               name, Pct[i], s3, lr);
+
+        // No worse than LRU on Zipf; better when scanned
+        if (scan) assert(s3 > lr);
+        else      assert(s3 > lr - 0.01);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int nthr = sys_cpu_getavail();
+    uint64_t *zipf, *scan;
+    double s3, lr;
+    uint64_t cap;
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (nthr < 4) nthr = 4;
+
+    test_basic();
+    test_capacity();
+    test_ttl();
+    test_ttl_slot();
+    test_replace();
+
+    zipf = mktrace(NREQ, 0.99, 0);
+    scan = mktrace(NREQ, 0.8, 30);
+
+    test_hitratio("zipf", zipf, 0);
+    test_hitratio("scan", scan, 1);
+
+    if ((e = bench_init(&b, "t_cache", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    cap = (UNIVERSE / 10) * charge();
+    replay(&b, "zipf", zipf, NREQ, cap, 1, &s3, &lr);
+    replay(&b, "zipf", zipf, NREQ, cap, nthr, &s3, &lr);
+    bench_fini(&b);
+
+    DEL(zipf);
+    DEL(scan);
+    return 0;
+}
+
+/* EOF */
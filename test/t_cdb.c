@@ -0,0 +1,346 @@
+/*
+ * Test and benchmark for the CDB writer and reader.
+ *
+ * Usage: t_cdb [NRECS [DIR]]
+ *
+ * Builds CDB and CDB64 files of NRECS records serially and in
+ * parallel, verifies every key (and some missing ones) via
+ * cdb_find() and cdb_find_batch() and prints the write and lookup
+ * rates. Random lookups are timed with a warm and a cold page
+ * cache; to measure a DB larger than RAM, give a large NRECS and a
+ * DIR on a real disk.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cdb_writer.h"
+#include "utils/cdb_reader.h"
+
+#define _d(x)   ((double)(x))
+
+
+/* Key i and its value */
+static size_t
+mkkey(char* buf, size_t bsiz, size_t i)
+{
+    return snprintf(buf, bsiz, "key-%zu", i);
+}
+
+static size_t
+mkval(char* buf, size_t bsiz, size_t i)
+{
+    return snprintf(buf, bsiz, "value-%zx-%zu", i * 2654435761u, i % 97);
+}
+
+
+static uint64_t
+build(const char* fname, size_t n, int nthr, int wide)
+{
+    char k[64], v[64];
+    cdb_writer w;
+    uint64_t t0, t1;
+    size_t i;
+    int r;
+
+    t0 = timenow();
+    r  = wide ? cdb64_write_init(&w, fname) : cdb_write_init(&w, fname);
+    if (r < 0) error(1, -r, "can't create %s", fname);
+
+    for (i = 0; i < n; i++) {
+        size_t kl = mkkey(k, sizeof k, i);
+        size_t vl = mkval(v, sizeof v, i);
+
+        if ((r = cdb_write(&w, k, kl, v, vl)) < 0) error(1, -r, "can't write record %zu", i);
+    }
+
+    if ((r = cdb_write_finish(&w, nthr)) < 0) error(1, -r, "can't finish %s", fname);
+    t1 = timenow();
+
+    return t1 - t0;
+}
+
+
+static uint64_t
+verify(const char* fname, size_t n)
+{
+    char k[64], v[64];
+    uint64_t t0, t1;
+    CDB db;
+    size_t i;
+    int r;
+
+    if ((r = cdb_read_init(&db, fname)) < 0) error(1, -r, "can't open %s", fname);
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) {
+        size_t kl = mkkey(k, sizeof k, i);
+        size_t vl = mkval(v, sizeof v, i);
+        void*  p  = 0;
+        ssize_t m = cdb_find(&db, &p, k, kl);
+
+        if (m < 0)                                 error(1, 0, "%s: can't find key %zu", fname, i);
+        if ((size_t)m != vl || memcmp(p, v, vl)) error(1, 0, "%s: wrong value for key %zu", fname, i);
+    }
+    t1 = timenow();
+
+    for (i = n; i < n + 1000; i++) {
+        size_t kl = mkkey(k, sizeof k, i);
+        void*  p  = 0;
+
+        if (cdb_find(&db, &p, k, kl) != -ENOENT) error(1, 0, "%s: found missing key %zu", fname, i);
+    }
+
+    cdb_close(&db);
+    return t1 - t0;
+}
+
+
+/*
+ * Batch lookups of 'n' random keys (half of them missing) with the
+ * page cache warm or cold; compare with single lookups of the same
+ * keys. Returns lookups/sec for (single, batch).
+ */
+#define NBATCH  64
+
+static void
+bench_random(const char* fname, size_t n, size_t nlookup, int cold, double* rate)
+{
+    char   kbuf[NBATCH][64];
+    const void* keys[NBATCH];
+    size_t klens[NBATCH];
+    void*  vals[NBATCH];
+    ssize_t vlens[NBATCH];
+    uint64_t x = 0x9e3779b97f4a7c15;
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        uint64_t t0, t1;
+        size_t i, j, found = 0;
+        CDB db;
+        int r;
+
+        if (cold) {
+            int fd = open(fname, O_RDONLY);
+
+            assert(fd >= 0);
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+
+        if ((r = cdb_open(&db, fname, CDB_RANDOM | (cold ? CDB_COLD : 0))) < 0)
+            error(1, -r, "can't open %s", fname);
+
+        t0 = timenow();
+        for (i = 0; i < nlookup; i += NBATCH) {
+            for (j = 0; j < NBATCH; j++) {
+                x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+                klens[j] = mkkey(kbuf[j], sizeof kbuf[j], (x * 2685821657736338717ULL) % (2 * n));
+                keys[j]  = kbuf[j];
+            }
+
+            if (mode == 1) {
+                found += cdb_find_batch(&db, NBATCH, keys, klens, vals, vlens);
+                continue;
+            }
+
+            for (j = 0; j < NBATCH; j++) {
+                void* p = 0;
+                if (cdb_find(&db, &p, keys[j], klens[j]) >= 0) found++;
+            }
+        }
+        t1 = timenow();
+
+        cdb_close(&db);
+        assert(found > 0);
+        rate[mode] = _d(nlookup) * 1.0e6 / _d(t1 - t0);
+    }
+}
+
+
+/* Check cdb_find_batch() agrees with cdb_find() */
+static void
+verify_batch(const char* fname, size_t n)
+{
+    char   kbuf[NBATCH][64];
+    const void* keys[NBATCH];
+    size_t klens[NBATCH];
+    void*  vals[NBATCH];
+    ssize_t vlens[NBATCH];
+    size_t i, j, m;
+    CDB db;
+    int r;
+
+    if ((r = cdb_read_init(&db, fname)) < 0) error(1, -r, "can't open %s", fname);
+
+    /* Walk past the end so some keys are missing */
+    for (i = 0; i < n + 100; i += m) {
+        size_t found;
+
+        m = (n + 100 - i) < NBATCH ? (n + 100 - i) : NBATCH;
+        for (j = 0; j < m; j++) {
+            klens[j] = mkkey(kbuf[j], sizeof kbuf[j], i + j);
+            keys[j]  = kbuf[j];
+        }
+
+        found = cdb_find_batch(&db, m, keys, klens, vals, vlens);
+        for (j = 0; j < m; j++) {
+            void* p   = 0;
+            ssize_t r = cdb_find(&db, &p, keys[j], klens[j]);
+
+            if (r != vlens[j] || (r >= 0 && p != vals[j]))
+                error(1, 0, "%s: batch lookup of key %zu differs", fname, i + j);
+            if (r >= 0) found--;
+        }
+        assert(found == 0);
+    }
+
+    cdb_close(&db);
+}
+
+
+static int
+samefile(const char* a, const char* b)
+{
+    char ba[65536], bb[65536];
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    size_t na, nb;
+    int same = 1;
+
+    assert(fa && fb);
+    do {
+        na = fread(ba, 1, sizeof ba, fa);
+        nb = fread(bb, 1, sizeof bb, fb);
+        if (na != nb || memcmp(ba, bb, na)) same = 0;
+    } while (same && na > 0);
+
+    fclose(fa);
+    fclose(fb);
+    return same;
+}
+
+
+/* Empty DBs, duplicate keys and a value larger than the buffer */
+static void
+edge_cases(const char* fname, int wide)
+{
+    size_t bigsz = 3 * 1024 * 1024;
+    char*  big   = NEWA(char, bigsz);
+    cdb_writer w;
+    void* p = 0;
+    CDB db;
+    int r;
+
+    assert(big);
+    memset(big, 'x', bigsz);
+
+    assert((wide ? cdb64_write_init(&w, fname) : cdb_write_init(&w, fname)) == 0);
+    assert(cdb_write_finish(&w, 1) == 0);
+    assert(cdb_read_init(&db, fname) == 0);
+    assert(cdb_find(&db, &p, "a", 1) == -ENOENT);
+    cdb_close(&db);
+
+    assert((wide ? cdb64_write_init(&w, fname) : cdb_write_init(&w, fname)) == 0);
+    assert(cdb_write(&w, "dup", 3, "one", 3) == 0);
+    assert(cdb_write(&w, "big", 3, big, bigsz) == 0);
+    assert(cdb_write(&w, "dup", 3, "two", 3) == 0);
+    assert(cdb_write(&w, "", 0, "empty", 5) == 0);
+    assert(cdb_write_finish(&w, 0) == 0);
+
+    assert(cdb_read_init(&db, fname) == 0);
+    r = cdb_find(&db, &p, "dup", 3);
+    assert(r == 3 && 0 == memcmp(p, "one", 3));
+    r = cdb_find(&db, &p, "big", 3);
+    assert(r == (int)bigsz && 0 == memcmp(p, big, bigsz));
+    r = cdb_find(&db, &p, "", 0);
+    assert(r == 5 && 0 == memcmp(p, "empty", 5));
+    cdb_close(&db);
+
+    /* An aborted build leaves the old DB in place */
+    assert((wide ? cdb64_write_init(&w, fname) : cdb_write_init(&w, fname)) == 0);
+    assert(cdb_write(&w, "new", 3, "x", 1) == 0);
+    cdb_write_abort(&w);
+
+    assert(cdb_read_init(&db, fname) == 0);
+    assert(cdb_find(&db, &p, "new", 3) == -ENOENT);
+    assert(cdb_find(&db, &p, "dup", 3) == 3);
+    cdb_close(&db);
+
+    DEL(big);
+    printf("%s edge cases: OK\n", wide ? "CDB64" : "CDB");
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    const char* dir = "/tmp";
+    char f1[PATH_MAX], f2[PATH_MAX];
+    size_t n;
+    uint64_t tw1, twp, tr;
+    int wide;
+
+#ifdef __MAKE_OPTIMIZE__
+    n = 4000000;
+#else
+    n = 200000;
+#endif
+
+    program_name = argv[0];
+
+    if (argc > 1) n   = strtoul(argv[1], 0, 0);
+    if (argc > 2) dir = argv[2];
+
+    snprintf(f1, sizeof f1, "%s/t_cdb.%d.1", dir, getpid());
+    snprintf(f2, sizeof f2, "%s/t_cdb.%d.p", dir, getpid());
+
+    edge_cases(f1, 0);
+    edge_cases(f1, 1);
+
+    for (wide = 0; wide < 2; wide++) {
+        const char* nm = wide ? "CDB64" : "CDB";
+        double warm[2], cold[2];
+
+        tw1 = build(f1, n, 1, wide);
+        twp = build(f2, n, 0, wide);
+
+        if (!samefile(f1, f2)) error(1, 0, "%s: serial and parallel builds differ", nm);
+
+        tr = verify(f1, n);
+        verify_batch(f1, n);
+
+        bench_random(f1, n, n, 0, warm);
+        bench_random(f1, n, n / 4, 1, cold);
+
+        printf("%s, %zu records: OK\n", nm, n);
+        printf("  write, serial:   %8.3f s, %8.2f M recs/s\n",
+                _d(tw1) / 1.0e6, _d(n) / _d(tw1));
+        printf("  write, parallel: %8.3f s, %8.2f M recs/s\n",
+                _d(twp) / 1.0e6, _d(n) / _d(twp));
+        printf("  lookup:          %8.3f s, %8.2f M lookups/s\n",
+                _d(tr) / 1.0e6, _d(n) / _d(tr));
+        printf("  random, warm:    %8.2f M lookups/s single, %8.2f M lookups/s batch\n",
+                warm[0] / 1.0e6, warm[1] / 1.0e6);
+        printf("  random, cold:    %8.2f k lookups/s single, %8.2f k lookups/s batch\n",
+                cold[0] / 1.0e3, cold[1] / 1.0e3);
+    }
+
+    unlink(f1);
+    unlink(f2);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,490 @@
+/*
+ * Test for content defined chunking.
+ *
+ * Usage: t_cdc [SIZE_MB [NTHREADS]]
+ *
+ * Chunks SIZE_MB of random data (with a run of zeros) and checks
+ * that the chunks tile the data and respect the size limits, that
+ * streaming with random buffer sizes, chunking on 1..NTHREADS
+ * threads and chunking a file all give the same chunks and hashes,
+ * and that a second version of the data with a few hundred edits
+ * dedups against the first. Then benchmarks the chunking in GB/s.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cdc.h"
+#include "utils/cpu.h"
+#include "utils/fast-ht.h"
+#include "utils/hashfunc.h"
+#include "bench.h"
+
+#include "sodium.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define SIZE_MB     256
+#else
+#define SIZE_MB     32
+#endif
+
+#define NEDITS      200
+
+
+static uint64_t Rand = 0x243f6a8885a308d3ULL;
+
+static inline uint64_t
+rnd(void)
+{
+    uint64_t z = (Rand += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+// 'n' random bytes with a run of zeros in the middle
+static uint8_t *
+mkdata(size_t n)
+{
+    uint8_t *p = NEWA(uint8_t, n + 8);
+    size_t i;
+
+    assert(p);
+    for (i = 0; i < n; i += 8) {
+        uint64_t x = rnd();
+
+        memcpy(p + i, &x, 8);
+    }
+    memset(p + n / 3, 0, n / 16);
+    return p;
+}
+
+
+// Chunks tile [0, n), sizes within limits
+static void
+check_tiling(const cdc *c, const cdc_chunk *ch, size_t nch, size_t n)
+{
+    uint64_t off = 0;
+    size_t i;
+
+    for (i = 0; i < nch; i++) {
+        assert(ch[i].off == off);
+        assert(ch[i].len <= c->max);
+        if (i < nch - 1) assert(ch[i].len >= c->min);
+        off += ch[i].len;
+    }
+    assert(off == n);
+}
+
+
+static int
+cmp_chunks(const cdc_chunk *a, const cdc_chunk *b, size_t n, int hashed)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (a[i].off != b[i].off || a[i].len != b[i].len) return 0;
+        if (hashed && memcmp(a[i].hash, b[i].hash, CDC_HASHLEN) != 0) return 0;
+    }
+    return 1;
+}
+
+
+static void
+test_params(void)
+{
+    cdc c;
+
+    assert(cdc_init(&c, 32, 1024, 8192, 0) == -EINVAL);
+    assert(cdc_init(&c, 2048, 1024, 8192, 0) == -EINVAL);
+    assert(cdc_init(&c, 256, 1024, 1024, 0) == -EINVAL);
+    assert(cdc_init(&c, 256, 1024, CDC_MAX_SIZE + 1, 0) == -EINVAL);
+
+    assert(cdc_init(&c, 0, 0, 0, 0) == 0);
+    assert(c.avg == 8192 && c.min == 2048 && c.max == 65536);
+    assert(!c.hs);
+    cdc_fini(&c);
+
+    // avg is rounded down to a power of 2 for the masks
+    assert(cdc_init(&c, 1000, 5000, 20000, CDC_HASH) == 0);
+    assert(c.hs);
+    assert(__builtin_popcountll(c.mask_s) == 14);
+    assert(__builtin_popcountll(c.mask_l) == 10);
+    cdc_fini(&c);
+}
+
+
+static void
+test_sizes(const cdc *c, const uint8_t *p, size_t n)
+{
+    cdc_chunk *ch;
+    size_t nch, i, nmax = 0;
+    double mean, var = 0.0;
+
+    assert(cdc_buf(c, p, n, 1, &ch, &nch) == 0);
+    check_tiling(c, ch, nch, n);
+
+    mean = _d(n) / _d(nch);
+    for (i = 0; i < nch; i++) {
+        var += (_d(ch[i].len) - mean) * (_d(ch[i].len) - mean);
+        if (ch[i].len == c->max) nmax++;
+    }
+
+    printf("  %u/%u/%u: %zu chunks, mean %.0f, stddev %.0f, %zu at max\n",
+            c->min, c->avg, c->max, nch, mean, sqrt(var / _d(nch)), nmax);
+
+    // The zeros are cut at max; elsewhere chunks average ~avg
+    assert(mean > 0.75 * c->avg && mean < 1.5 * c->avg);
+
+    // A lone chunk and cdc_cut() at the end
+    assert(cdc_cut(c, p, c->min - 1) == c->min - 1);
+    assert(cdc_cut(c, p, n) == ch[0].len);
+    DEL(ch);
+}
+
+
+// Hash of every chunk must be BLAKE2b of its bytes
+static void
+check_hashes(const cdc_chunk *ch, size_t nch, const uint8_t *p)
+{
+    size_t i;
+
+    for (i = 0; i < nch; i++) {
+        crypto_generichash_state st;
+        uint8_t h[CDC_HASHLEN];
+
+        crypto_generichash_init(&st, 0, 0, CDC_HASHLEN);
+        crypto_generichash_update(&st, p + ch[i].off, ch[i].len);
+        crypto_generichash_final(&st, h, CDC_HASHLEN);
+        assert(memcmp(h, ch[i].hash, CDC_HASHLEN) == 0);
+    }
+}
+
+
+struct collect
+{
+    cdc_chunk * v;
+    size_t      n;
+    size_t      max;
+};
+
+static int
+collect(void *ctx, const cdc_chunk *ch)
+{
+    struct collect *x = ctx;
+
+    if (x->n == x->max) return -ENOSPC;
+    x->v[x->n++] = *ch;
+    return 0;
+}
+
+
+static void
+test_stream(const cdc *c0, const uint8_t *p, size_t n)
+{
+    struct collect x;
+    cdc_chunk *ch;
+    size_t nch, off;
+    cdc c;
+
+    assert(cdc_init(&c, c0->min, c0->avg, c0->max, CDC_HASH) == 0);
+    assert(cdc_buf(&c, p, n, 1, &ch, &nch) == 0);
+    check_hashes(ch, nch, p);
+
+    x.v   = NEWA(cdc_chunk, nch);
+    x.n   = 0;
+    x.max = nch;
+    assert(x.v);
+
+    // Buffers of 1 byte .. 3 x max
+    for (off = 0; off < n; ) {
+        size_t k = 1 + rnd() % (3 * c.max);
+
+        if ((rnd() & 7) == 0) k = 1 + rnd() % 64;
+        if (k > n - off) k = n - off;
+
+        assert(cdc_update(&c, p + off, k, collect, &x) == 0);
+        off += k;
+    }
+    assert(cdc_final(&c, collect, &x) == 0);
+
+    assert(x.n == nch);
+    assert(cmp_chunks(x.v, ch, nch, 1));
+
+    // Callback errors stop the chunking
+    x.n   = 0;
+    x.max = 3;
+    assert(cdc_update(&c, p, n, collect, &x) == -ENOSPC);
+    assert(x.n == 3);
+    cdc_reset(&c);
+
+    printf("  streaming: %zu chunks same as whole buffer\n", nch);
+
+    DEL(x.v);
+    DEL(ch);
+    cdc_fini(&c);
+}
+
+
+static void
+test_parallel(const cdc *c0, const uint8_t *p, size_t n, int maxthr)
+{
+    cdc_chunk *ch, *pch;
+    size_t nch, npch;
+    int t;
+    cdc c;
+
+    assert(cdc_init(&c, c0->min, c0->avg, c0->max, CDC_HASH) == 0);
+    assert(cdc_buf(&c, p, n, 1, &ch, &nch) == 0);
+
+    for (t = 2; t <= maxthr; t++) {
+        assert(cdc_buf(&c, p, n, t, &pch, &npch) == 0);
+        assert(npch == nch);
+        assert(cmp_chunks(pch, ch, nch, 1));
+        DEL(pch);
+    }
+
+    // Empty buffer
+    assert(cdc_buf(&c, p, 0, 4, &pch, &npch) == 0);
+    assert(npch == 0 && !pch);
+
+    printf("  parallel: 2..%d threads same as 1\n", maxthr);
+    DEL(ch);
+    cdc_fini(&c);
+}
+
+
+static void
+test_file(const cdc *c, const uint8_t *p, size_t n)
+{
+    char fn[] = "/tmp/t_cdc.XXXXXX";
+    cdc_chunk *ch, *fch;
+    size_t nch, nfch;
+    int fd;
+
+    assert((fd = mkstemp(fn)) >= 0);
+    assert(write(fd, p, n) == (ssize_t)n);
+    close(fd);
+
+    assert(cdc_buf(c, p, n, 1, &ch, &nch) == 0);
+    assert(cdc_file(c, fn, 0, &fch, &nfch) == 0);
+    assert(nfch == nch);
+    assert(cmp_chunks(fch, ch, nch, 0));
+    DEL(ch);
+    DEL(fch);
+
+    assert(truncate(fn, 0) == 0);
+    assert(cdc_file(c, fn, 0, &fch, &nfch) == 0);
+    assert(nfch == 0 && !fch);
+
+    unlink(fn);
+    assert(cdc_file(c, fn, 0, &fch, &nfch) == -ENOENT);
+}
+
+
+// Add the chunks of 'p' to 'h'; return the bytes not seen before
+static uint64_t
+dedup(ht *h, const uint8_t *p, const cdc_chunk *ch, size_t nch)
+{
+    uint64_t nu = 0;
+    size_t i;
+
+    for (i = 0; i < nch; i++) {
+        uint64_t k = fasthash64(p + ch[i].off, ch[i].len, 0) | 1;
+
+        if (!ht_probe(h, k, (void *)1)) nu += ch[i].len;
+    }
+    return nu;
+}
+
+
+/*
+ * Version 2: version 1 with a byte inserted in front and NEDITS
+ * random inserts, deletes and overwrites of up to 64 bytes.
+ */
+static void
+test_dedup(const cdc *c, const uint8_t *p, size_t n, uint64_t *p_u1, uint64_t *p_u2)
+{
+    uint8_t *q = NEWA(uint8_t, n + 1 + NEDITS * 64);
+    size_t i, m, from, pos[NEDITS];
+    cdc_chunk *ch;
+    size_t nch;
+    uint64_t u1, u2;
+    ht h;
+
+    assert(q);
+
+    for (i = 0; i < NEDITS; i++) pos[i] = rnd() % n;
+    for (i = 1; i < NEDITS; i++) {
+        size_t j, x = pos[i];
+
+        for (j = i; j > 0 && pos[j-1] > x; j--) pos[j] = pos[j-1];
+        pos[j] = x;
+    }
+
+    q[0] = 0x5a;
+    m    = 1;
+    from = 0;
+    for (i = 0; i < NEDITS; i++) {
+        size_t k = 1 + rnd() % 64;
+
+        if (pos[i] < from) continue;
+
+        memcpy(q + m, p + from, pos[i] - from);
+        m   += pos[i] - from;
+        from = pos[i];
+
+        switch (rnd() % 3) {
+            case 0:         // insert
+                memset(q + m, 0xa5, k);
+                m += k;
+                break;
+            case 1:         // delete
+                from += k < (n - from) ? k : n - from;
+                break;
+            case 2:         // overwrite
+                memset(q + m, 0xa5, k);
+                m    += k;
+                from += k < (n - from) ? k : n - from;
+                break;
+        }
+    }
+    memcpy(q + m, p + from, n - from);
+    m += n - from;
+
+    ht_init(&h, 16);
+
+    assert(cdc_buf(c, p, n, 0, &ch, &nch) == 0);
+    u1 = dedup(&h, p, ch, nch);
+    DEL(ch);
+
+    assert(cdc_buf(c, q, m, 0, &ch, &nch) == 0);
+    check_tiling(c, ch, nch, m);
+    u2 = dedup(&h, q, ch, nch);
+    DEL(ch);
+
+    printf("  dedup: v1 %zu bytes, v2 (%d edits) %zu bytes, %.2f%% of v2 new; "
+           "dedup ratio %.3f\n", n, NEDITS, m, 100.0 * _d(u2) / _d(m),
+           _d(n + m) / _d(u1 + u2));
+
+    // Each edit changes a chunk or two
+    assert(_d(u2) < 3.0 * NEDITS * c->max);
+
+    *p_u1 = u1;
+    *p_u2 = u2;
+
+    ht_fini(&h);
+    DEL(q);
+}
+
+
+static void
+perf_test(bench *b, const cdc *c0, const uint8_t *p, size_t n, int nthr)
+{
+    cdc_chunk *ch;
+    size_t nch;
+    char name[64];
+    cdc c;
+    int t;
+
+    assert(cdc_init(&c, c0->min, c0->avg, c0->max, 0) == 0);
+
+    bench_begin(b, "cut", n / c.avg);
+    bench_bytes(b, n);
+    while (bench_next(b)) {
+        size_t off = 0;
+
+        bench_start(b);
+        while (off < n) off += cdc_cut(&c, p + off, n - off);
+        bench_stop(b);
+    }
+    bench_end(b);
+    cdc_fini(&c);
+
+    for (t = 1; t <= nthr; t *= 2) {
+        int k;
+
+        for (k = 0; k < 2; k++) {
+            assert(cdc_init(&c, c0->min, c0->avg, c0->max, k ? CDC_HASH : 0) == 0);
+
+            snprintf(name, sizeof name, "buf%s/%dthr", k ? "+blake2b" : "", t);
+            bench_begin(b, name, n / c.avg);
+            bench_bytes(b, n);
+            while (bench_next(b)) {
+                bench_start(b);
+                assert(cdc_buf(&c, p, n, t, &ch, &nch) == 0);
+                bench_stop(b);
+                DEL(ch);
+            }
+            bench_end(b);
+            cdc_fini(&c);
+        }
+
+        if (t < nthr && 2 * t > nthr) t = nthr / 2;
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    size_t n = (size_t)SIZE_MB << 20;
+    int nthr = sys_cpu_getavail();
+    uint64_t u1, u2;
+    uint8_t *p;
+    bench b;
+    cdc c;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) n    = strtoul(argv[1], 0, 0) << 20;
+    if (argc > 2) nthr = atoi(argv[2]);
+    if (n < (4 << 20)) n    = 4 << 20;
+    if (nthr < 2)      nthr = 2;
+
+    p = mkdata(n);
+
+    test_params();
+
+    assert(cdc_init(&c, 0, 0, 0, 0) == 0);
+    test_sizes(&c, p, n);
+    test_stream(&c, p, n);
+    test_parallel(&c, p, n, nthr > 8 ? nthr : 8);
+    test_file(&c, p, n);
+    test_dedup(&c, p, n, &u1, &u2);
+    cdc_fini(&c);
+
+    // Small chunks dedup better
+    assert(cdc_init(&c, 512, 2048, 16384, 0) == 0);
+    test_sizes(&c, p, n);
+    test_parallel(&c, p, n, 4);
+    test_dedup(&c, p, n, &u1, &u2);
+
+    if ((e = bench_init(&b, "t_cdc", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    cdc_fini(&c);
+    assert(cdc_init(&c, 0, 0, 0, 0) == 0);
+    perf_test(&b, &c, p, n, nthr);
+    bench_fini(&b);
+
+    cdc_fini(&c);
+    DEL(p);
+    return 0;
+}
+
+/* EOF */
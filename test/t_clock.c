@@ -0,0 +1,282 @@
+/*
+ * Test for the calibrated TSC clock and the coarse clock.
+ *
+ * Usage: t_clock [NTHREADS]
+ *
+ * Checks that clk_ns() never goes backwards (on one thread and
+ * between NTHREADS threads), that it keeps to CLOCK_MONOTONIC over
+ * sleeps and after the ticker syncs it, that the coarse clock ticks
+ * about every ms and trails clk_ns(), and that CLK_NOTSC falls back
+ * to CLOCK_MONOTONIC; neither clock may step back when the ticker
+ * stops or the source changes. Then benchmarks ns per call of each
+ * source.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/clock.h"
+#include "bench.h"
+
+#ifdef __MAKE_OPTIMIZE__
+#define NREADS      10000000
+#else
+#define NREADS      1000000
+#endif
+
+#define MS          1000000ULL
+
+static int64_t
+diff(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b);
+}
+
+
+static void
+test_monotonic(void)
+{
+    uint64_t prev = clk_ns();
+    int i;
+
+    for (i = 0; i < NREADS; i++) {
+        uint64_t now = clk_ns();
+
+        assert(now >= prev);
+        prev = now;
+    }
+}
+
+
+// Threads hand a timestamp around; each must see a later one
+struct mthr
+{
+    uint64_t * last;
+    int        n;
+    int        bad;
+};
+
+static void *
+mono_thread(void * v)
+{
+    struct mthr * m = v;
+    int i;
+
+    for (i = 0; i < m->n; i++) {
+        uint64_t seen = __atomic_load_n(m->last, __ATOMIC_ACQUIRE);
+        uint64_t now  = clk_ns();
+
+        if (now < seen) m->bad++;
+        __atomic_store_n(m->last, now, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void
+test_threads(int nthr)
+{
+    struct mthr * m = NEWZA(struct mthr, nthr);
+    pthread_t * t   = NEWZA(pthread_t, nthr);
+    uint64_t last   = 0;
+    int i, bad = 0;
+
+    for (i = 0; i < nthr; i++) {
+        m[i].last = &last;
+        m[i].n    = NREADS / nthr;
+        pthread_create(&t[i], 0, mono_thread, &m[i]);
+    }
+    for (i = 0; i < nthr; i++) {
+        pthread_join(t[i], 0);
+        bad += m[i].bad;
+    }
+
+    // A read after seeing another thread's must not be earlier
+    assert(bad == 0);
+    DEL(m);
+    DEL(t);
+}
+
+
+// clk_ns() and CLOCK_MONOTONIC advance alike over 'ms'
+static void
+test_agree(int ms, int64_t tol)
+{
+    uint64_t c0 = clk_ns(), m0 = clk_mono_ns();
+    int64_t off0, off1;
+
+    usleep(ms * 1000);
+
+    off0 = diff(c0, m0);
+    off1 = diff(clk_ns(), clk_mono_ns());
+    if (off1 - off0 > tol || off0 - off1 > tol)
+        error(1, 0, "clk_ns drifted %lld ns from CLOCK_MONOTONIC in %d ms",
+              (long long)(off1 - off0), ms);
+
+    // And is on the same timeline
+    assert(off1 < 2 * (int64_t)MS && off1 > -2 * (int64_t)MS);
+}
+
+
+static void
+test_coarse(void)
+{
+    uint64_t c0, c1, n;
+    int i, ticks = 0;
+
+    assert(clk_coarse_start(1000) == 0);
+    assert(clk_coarse_start(5000) == 0);    // counted; keeps 1 ms
+
+    usleep(5000);
+    c0 = clk_coarse_ns();
+    n  = clk_ns();
+    assert(c0 <= n);
+    assert(n - c0 < 50 * MS);
+
+    // It ticks
+    for (i = 0, c1 = c0; i < 100; i++) {
+        uint64_t v;
+
+        usleep(200);
+        v = clk_coarse_ns();
+        assert(v >= c1);
+        if (v > c1) ticks++;
+        c1 = v;
+    }
+    assert(ticks > 0);
+
+    usleep(50000);
+    assert(clk_coarse_ns() - c0 >= 40 * MS);
+
+    // Let the ticker sync the TSC scale a couple of times
+    sleep(2);
+    test_agree(200, 200000);
+
+    clk_coarse_stop();
+    assert(__clk_coarse != 0);
+    c1 = clk_coarse_ns();
+    clk_coarse_stop();
+    assert(__clk_coarse == 0);
+
+    // Not behind the last tick
+    assert(clk_coarse_ns() >= c1);
+
+    // Without the ticker: CLOCK_MONOTONIC_COARSE (or clk_ns())
+    c0 = clk_coarse_ns();
+    n  = clk_ns();
+    assert(diff(n, c0) > -5 * (int64_t)MS && diff(n, c0) < 50 * (int64_t)MS);
+}
+
+
+static void
+test_fallback(int src)
+{
+    uint64_t a, b, c;
+
+    // Switching sources doesn't go back
+    a = clk_ns();
+    assert(clk_init(CLK_NOTSC) == CLK_MONOTONIC);
+    b = clk_ns();
+    assert(b >= a);
+
+    a = clk_mono_ns();
+    b = clk_ns();
+    assert(b >= a && b - a < 10 * MS);
+    test_agree(20, 1000000);
+
+    b = clk_ns();
+    assert(clk_init(0) == src);
+    c = clk_ns();
+    assert(c >= b);
+}
+
+
+/*
+ * Benchmarks
+ */
+static volatile uint64_t Sink;
+
+#define BENCH_SRC(b, nm, expr) do {                 \
+        const int n_ = 100000;                      \
+        bench_begin(b, nm, n_);                     \
+        while (bench_next(b)) {                     \
+            uint64_t s_ = 0;                        \
+            int i_;                                 \
+            bench_start(b);                         \
+            for (i_ = 0; i_ < n_; i_++) s_ += expr; \
+            bench_stop(b);                          \
+            Sink = s_;                              \
+        }                                           \
+        bench_end(b);                               \
+    } while (0)
+
+
+static uint64_t
+mono_coarse(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    int nthr = sys_cpu_getavail();
+    bench b;
+    int src, e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (nthr < 2) nthr = 2;
+
+    src = clk_init(0);
+    printf("clk_ns: %s", src == CLK_TSC ? "tsc" : "CLOCK_MONOTONIC");
+    if (src == CLK_TSC)
+        printf(" (mult %u, shift %u; %.4f ns/tick)", __clk.mult, __clk.shift,
+               (double)__clk.mult / (double)(1ULL << __clk.shift));
+    printf("\n");
+
+    test_monotonic();
+    test_threads(nthr);
+    test_agree(100, 200000);
+    test_coarse();
+    test_fallback(src);
+
+    if ((e = bench_init(&b, "t_clock", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    BENCH_SRC(&b, "timenow", timenow());
+    BENCH_SRC(&b, "CLOCK_MONOTONIC", clk_mono_ns());
+    BENCH_SRC(&b, "CLOCK_MONOTONIC_COARSE", mono_coarse());
+    BENCH_SRC(&b, "rdtsc", sys_cpu_timestamp());
+    BENCH_SRC(&b, "clk_ns", clk_ns());
+
+    clk_init(CLK_NOTSC);
+    BENCH_SRC(&b, "clk_ns/notsc", clk_ns());
+    clk_init(0);
+
+    BENCH_SRC(&b, "clk_coarse_ns/noticker", clk_coarse_ns());
+    assert(clk_coarse_start(1000) == 0);
+    BENCH_SRC(&b, "clk_coarse_ns", clk_coarse_ns());
+    clk_coarse_stop();
+
+    bench_fini(&b);
+    return 0;
+}
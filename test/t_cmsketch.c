@@ -0,0 +1,431 @@
+/*
+ * Test for Count-Min/Count-Sketch and the Space-Saving top-k
+ * tracker.
+ *
+ * Usage: t_cmsketch [NITEMS [ZIPF_S [NTHREADS]]]
+ *
+ * Streams NITEMS Zipfian distributed keys (exponent ZIPF_S) and
+ * checks every estimate against the exact counts: Count-Min never
+ * underestimates, conservative update never exceeds Count-Min and
+ * all sketches stay within their error bound for all but a
+ * fraction of the keys. Merged and concurrently updated (NTHREADS)
+ * sketches must equal the serial ones. Space-Saving must monitor
+ * every key above N/m and bound its counts. Then benchmarks the
+ * updates.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cmsketch.h"
+#include "utils/topk.h"
+#include "utils/fast-ht.h"
+#include "utils/hashfunc.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define NITEMS      10000000
+#else
+#define NITEMS      1000000
+#endif
+
+#define UNIVERSE    1000000
+
+static const char *Names[] = { "count-min", "conservative", "count-sketch" };
+
+static uint64_t   N;
+static uint32_t * Stream;       // key index of each item
+static uint64_t * Hash;         // hash of each key
+static uint64_t * Count;        // exact count of each key
+static double     L2;           // ||f||_2
+
+
+/*
+ * Zipfian stream: key i (0 based) has probability proportional to
+ * 1/(i+1)^s. Inverse CDF by binary search.
+ */
+static void
+mkstream(uint64_t n, double s)
+{
+    double *cdf = NEWA(double, UNIVERSE);
+    double sum  = 0.0;
+    uint64_t i;
+
+    assert(cdf);
+    for (i = 0; i < UNIVERSE; i++) cdf[i] = (sum += 1.0 / pow(_d(i+1), s));
+    for (i = 0; i < UNIVERSE; i++) cdf[i] /= sum;
+
+    Stream = NEWA(uint32_t, n);
+    Hash   = NEWA(uint64_t, UNIVERSE);
+    Count  = NEWZA(uint64_t, UNIVERSE);
+    assert(Stream && Hash && Count);
+
+    for (i = 0; i < UNIVERSE; i++) Hash[i] = fasthash64(&i, sizeof i, 0);
+
+    for (i = 0; i < n; i++) {
+        double r = _d(fasthash64(&i, sizeof i, 0x243f6a8885a308d3ULL) >> 11) * 0x1.0p-53;
+        uint32_t lo = 0, hi = UNIVERSE - 1;
+
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+
+            if (cdf[mid] < r) lo = mid + 1;
+            else              hi = mid;
+        }
+        Stream[i] = lo;
+        Count[lo]++;
+    }
+
+    for (sum = 0.0, i = 0; i < UNIVERSE; i++) sum += _d(Count[i]) * _d(Count[i]);
+    L2 = sqrt(sum);
+    N  = n;
+    DEL(cdf);
+}
+
+
+static void
+fill(cms *c, uint64_t lo, uint64_t hi)
+{
+    uint64_t i;
+
+    for (i = lo; i < hi; i++) cms_add(c, Hash[Stream[i]], 1);
+}
+
+
+static void
+test_params(void)
+{
+    cms c;
+
+    assert(cms_init(&c, CMS_COUNT_MIN, 0.0, 0.01, 0)   == -EINVAL);
+    assert(cms_init(&c, CMS_COUNT_MIN, 0.01, 1.0, 0)   == -EINVAL);
+    assert(cms_init(&c, 7, 0.01, 0.01, 0)              == -EINVAL);
+    assert(cms_init(&c, CMS_COUNT_MIN, 0.01, 1e-9, 0)  == -EINVAL);
+
+    assert(cms_init(&c, CMS_COUNT_MIN, 0.001, 0.01, 0) == 0);
+    assert(c.rows == 5 && c.slots == 3);
+    assert(_d(c.width) >= M_E / 0.001);
+    assert(((uintptr_t)c.c & 63) == 0);
+    cms_fini(&c);
+
+    // Count-Sketch has an odd number of rows
+    assert(cms_init(&c, CMS_COUNT_SKETCH, 0.05, 0.02, 0) == 0);
+    assert(c.rows == 5 && _d(c.width) >= 3.0 / (0.05 * 0.05));
+    cms_fini(&c);
+}
+
+
+/*
+ * Check a sketch of the whole stream against the exact counts.
+ */
+static void
+check(cms *c, cms *cm)
+{
+    double bound = c->type == CMS_COUNT_SKETCH ? c->eps * L2 : c->eps * _d(N);
+    uint64_t nbad = 0, nkeys = 0, maxerr = 0;
+    double toperr = 0.0;
+    uint32_t i;
+
+    assert(cms_total(c) == N);
+
+    for (i = 0; i < UNIVERSE; i++) {
+        uint64_t e = cms_estimate(c, Hash[i]);
+        uint64_t d = e > Count[i] ? e - Count[i] : Count[i] - e;
+
+        if (c->type != CMS_COUNT_SKETCH) assert(e >= Count[i]);
+        if (cm) assert(e <= cms_estimate(cm, Hash[i]));
+
+        if (_d(d) > bound) nbad++;
+        if (d > maxerr)    maxerr = d;
+        if (i < 100)       toperr += _d(d) / _d(Count[i] ? Count[i] : 1);
+        nkeys++;
+    }
+
+    printf("  %-13s %2d rows x %6u, %5zu kB: bound %7.1f, max err %6llu, "
+           "top-100 err %.4f%%, %.4f%% over bound\n",
+            Names[c->type], c->rows, c->width, cms_size(c) / 1024, bound,
+            (unsigned long long)maxerr, toperr, 100.0 * _d(nbad) / _d(nkeys));
+
+    // Blocking correlates the rows; allow 2x the nominal failure
+    // rate.
+    assert(_d(nbad) <= 2.0 * c->delta * _d(nkeys));
+}
+
+
+/*
+ * Sketches of the two halves merged are the sketch of the whole.
+ */
+static void
+test_merge(cms *whole)
+{
+    cms a, b;
+
+    cms_init(&a, whole->type, whole->eps, whole->delta, 0);
+    cms_init(&b, whole->type, whole->eps, whole->delta, 0);
+    fill(&a, 0, N/2);
+    fill(&b, N/2, N);
+
+    assert(cms_merge(&a, &b) == 0);
+    assert(cms_total(&a) == N);
+
+    if (whole->type == CMS_CONSERVATIVE) {
+        uint32_t i;
+
+        // Still an overestimate; no better than Count-Min
+        for (i = 0; i < UNIVERSE; i += 7) assert(cms_estimate(&a, Hash[i]) >= Count[i]);
+    } else {
+        assert(0 == memcmp(a.c, whole->c, cms_size(&a)));
+    }
+
+    cms_fini(&b);
+    cms_init(&b, whole->type, whole->eps / 2, whole->delta, 0);
+    assert(cms_merge(&a, &b) == -EINVAL);
+
+    cms_fini(&a);
+    cms_fini(&b);
+}
+
+
+struct worker
+{
+    pthread_t id;
+    cms *     c;
+    uint64_t  lo, hi;
+};
+
+static void *
+worker(void *p)
+{
+    struct worker *w = p;
+
+    fill(w->c, w->lo, w->hi);
+    return 0;
+}
+
+
+/*
+ * 'nthr' threads share one sketch; the counters must equal the
+ * serial sketch (for the additive variants).
+ */
+static void
+test_atomic(bench *b, cms *serial, cms *cm, int nthr)
+{
+    struct worker w[nthr];
+    char name[64];
+    uint64_t t0, t1;
+    cms c;
+    int i;
+
+    cms_init(&c, serial->type, serial->eps, serial->delta, CMS_ATOMIC);
+
+    t0 = timenow();
+    for (i = 0; i < nthr; i++) {
+        w[i].c  = &c;
+        w[i].lo = (N * i) / nthr;
+        w[i].hi = (N * (i+1)) / nthr;
+        pthread_create(&w[i].id, 0, worker, &w[i]);
+    }
+    for (i = 0; i < nthr; i++) pthread_join(w[i].id, 0);
+    t1 = timenow();
+
+    snprintf(name, sizeof name, "%s/atomic-%dthr", Names[c.type], nthr);
+    bench_add(b, name, N, _d(t1 - t0) * 1000.0, 0, 0);
+
+    assert(cms_total(&c) == N);
+    if (c.type == CMS_CONSERVATIVE) {
+        uint32_t j;
+
+        for (j = 0; j < UNIVERSE; j += 3) {
+            uint64_t e = cms_estimate(&c, Hash[j]);
+
+            assert(e >= Count[j] && e <= cms_estimate(cm, Hash[j]));
+        }
+    } else {
+        assert(0 == memcmp(c.c, serial->c, cms_size(&c)));
+    }
+    cms_fini(&c);
+}
+
+
+static void
+test_topk(uint32_t m)
+{
+    const uint32_t K = m / 10 < 100 ? m / 10 : 100;
+    topk_item *v = NEWA(topk_item, m);
+    topk t;
+    ht idx;
+    uint64_t i, nhot = 0, found = 0;
+    void *x;
+
+    assert(v);
+    assert(topk_init(&t, 0) == -EINVAL);
+    assert(topk_init(&t, m) == 0);
+    assert(topk_min(&t) == 0);
+
+    for (i = 0; i < N; i++) topk_add(&t, Hash[Stream[i]], 1);
+    assert(topk_total(&t) == N);
+    assert(t.n == m);
+
+    // key -> index
+    ht_init(&idx, 20);
+    for (i = 0; i < UNIVERSE; i++) ht_probe(&idx, Hash[i], (void *)(uintptr_t)(i+1));
+
+    // Counts bracket the truth
+    assert(topk_list(&t, v, m) == m);
+    for (i = 0; i < m; i++) {
+        uint64_t k;
+
+        assert(ht_find(&idx, v[i].key, &x));
+        k = (uintptr_t)x - 1;
+        assert(v[i].count - v[i].err <= Count[k] && Count[k] <= v[i].count);
+        if (i > 0) assert(v[i].count <= v[i-1].count);
+    }
+    assert(v[m-1].count == topk_min(&t));
+
+    // Every key above N/m is monitored; and nothing unmonitored is
+    // above the smallest monitored count.
+    for (i = 0; i < UNIVERSE; i++) {
+        topk_item it;
+        int in = topk_find(&t, Hash[i], &it);
+
+        if (Count[i] > N / m) {
+            assert(in);
+            nhot++;
+        }
+        if (!in) assert(Count[i] <= topk_min(&t));
+    }
+
+    // Recall of the true top K (keys are in rank order, and with a
+    // Zipfian stream nearly in count order). Space-Saving needs about
+    // ten times more counters than K to tell the tail of the top K from
+    // the rest.
+    for (i = 0; i < K; i++) {
+        uint64_t k;
+
+        assert(ht_find(&idx, v[i].key, &x));
+        k = (uintptr_t)x - 1;
+        if (k < K) found++;
+    }
+
+    printf("  space-saving  m=%u: %llu keys above N/m all monitored, "
+           "top-%u recall %.2f, min count %llu\n", m,
+            (unsigned long long)nhot, K, _d(found) / _d(K),
+            (unsigned long long)topk_min(&t));
+    assert(found >= (K * 9) / 10);
+
+    ht_fini(&idx);
+    topk_fini(&t);
+    DEL(v);
+}
+
+
+static void
+perf_test(bench *b, cms *sk)
+{
+    char name[64];
+    uint64_t i;
+    topk t;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        cms *c = &sk[k];
+
+        snprintf(name, sizeof name, "%s/add", Names[k]);
+        bench_begin(b, name, N);
+        while (bench_next(b)) {
+            cms_reset(c);
+            bench_start(b);
+            for (i = 0; i < N; i++) cms_add(c, Hash[Stream[i]], 1);
+            bench_stop(b);
+        }
+        bench_end(b);
+
+        snprintf(name, sizeof name, "%s/estimate", Names[k]);
+        bench_begin(b, name, N);
+        while (bench_next(b)) {
+            uint64_t s = 0;
+
+            bench_start(b);
+            for (i = 0; i < N; i++) s += cms_estimate(c, Hash[Stream[i]]);
+            bench_stop(b);
+            assert(s >= N || k == CMS_COUNT_SKETCH);
+        }
+        bench_end(b);
+    }
+
+    bench_begin(b, "space-saving/add", N);
+    while (bench_next(b)) {
+        topk_init(&t, 1000);
+        bench_start(b);
+        for (i = 0; i < N; i++) topk_add(&t, Hash[Stream[i]], 1);
+        bench_stop(b);
+        topk_fini(&t);
+    }
+    bench_end(b);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const double Eps[] = { 1e-4, 1e-4, 5e-3 };
+    uint64_t n = NITEMS;
+    double   s = 1.1;
+    int   nthr = 4;
+    cms sk[3];
+    bench b;
+    int e, k;
+
+    program_name = argv[0];
+
+    if (argc > 1) n    = strtoull(argv[1], 0, 0);
+    if (argc > 2) s    = atof(argv[2]);
+    if (argc > 3) nthr = atoi(argv[3]);
+    if (n < 1000) n    = 1000;
+    if (nthr < 1) nthr = 1;
+
+    if ((e = bench_init(&b, "t_cmsketch", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    mkstream(n, s);
+    printf("%llu items, %u keys, zipf %.2f; top key %llu, ||f||_2 %.1f\n",
+            (unsigned long long)N, UNIVERSE, s,
+            (unsigned long long)Count[0], L2);
+
+    test_params();
+
+    for (k = 0; k < 3; k++) {
+        assert(cms_init(&sk[k], k, Eps[k], 0.001, 0) == 0);
+        fill(&sk[k], 0, N);
+    }
+    for (k = 0; k < 3; k++) {
+        check(&sk[k], k == CMS_CONSERVATIVE ? &sk[CMS_COUNT_MIN] : 0);
+        test_merge(&sk[k]);
+    }
+    for (k = 0; k < 3; k++) test_atomic(&b, &sk[k], &sk[CMS_COUNT_MIN], nthr);
+
+    test_topk(1000);
+    test_topk(100);
+
+    perf_test(&b, sk);
+    bench_fini(&b);
+
+    for (k = 0; k < 3; k++) cms_fini(&sk[k]);
+    DEL(Stream);
+    DEL(Hash);
+    DEL(Count);
+    return 0;
+}
+
+/* EOF */
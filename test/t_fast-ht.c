@@ -17,29 +17,34 @@
 #include "utils/fast-ht.h"
 
 #include "ht-common.c"
+#include "bench.h"
 
-#define now()   sys_cpu_timestamp()
 #define _d(x)   ((double)(x))
 
+// Time 'stmt' if we're benchmarking
+#define timed(b, stmt)  do {                    \
+        if (b) BENCH_OP(b, stmt);               \
+        else   { stmt; }                        \
+    } while (0)
+
 
 extern uint32_t arc4random(void);
 extern void     arc4random_buf(void *, size_t);
 
-static uint64_t
-find_all(strvect* v, ht* h, int exp)
+static void
+find_all(strvect* v, ht* h, int exp, bench* b)
 {
     size_t i;
     word* w;
-    uint64_t tot     = 0;
     uint64_t perturb = 0;
 
     if (!exp) arc4random_buf(&perturb, sizeof perturb);
 
     VECT_FOR_EACHi(v, i, w) {
         void *x = 0;
-        uint64_t t0 = now();
-        int r = ht_find(h, w->h + perturb, &x);
-        tot += now() - t0;
+        int r;
+
+        timed(b, r = ht_find(h, w->h + perturb, &x));
         if (exp) {
             if (!r) {
                 printf("** I-MISS %s\n", w->w);
@@ -60,25 +65,18 @@ find_all(strvect* v, ht* h, int exp)
         }
 #endif
     }
-
-    return tot;
 }
 
-static uint64_t
-insert_words(strvect* v, ht* h)
+static void
+insert_words(strvect* v, ht* h, bench* b)
 {
     word* w;
-    uint64_t tot = 0;
     int r;
 
     VECT_FOR_EACH(v, w) {
-        uint64_t t0 = now();
-        r = ht_probe(h, w->h, w->w);
-        tot += now() - t0;
-
+        timed(b, r = ht_probe(h, w->h, w->w));
         assert(!r);
     }
-    return tot;
 }
 
 
@@ -104,112 +102,94 @@ print_ht(ht* h)
 }
 
 
-#ifdef __MAKE_OPTIMIZE__    // set by GNUmakefile.portablelib.mk
-
-static uint64_t
-del_all(strvect* v, ht* h, int exp)
+static void
+del_all(strvect* v, ht* h, int exp, bench* b)
 {
     word* w;
-    uint64_t tot = 0;
     int r;
 
     VECT_FOR_EACH(v, w) {
         void *x = 0;
-        uint64_t t0 = now();
-        r = ht_remove(h, w->h, &x);
-        tot += now() - t0;
 
+        timed(b, r = ht_remove(h, w->h, &x));
         if (r != exp) {
             printf("** DEL MISS %s\n", w->w);
             continue;
         }
     }
-    return tot;
 }
+
+
 static void
-perf_test(strvect* v, size_t Niters)
+perf_test(strvect* v, bench* b)
 {
-    uint64_t cyi = 0,
-             cyd = 0,
-             cyx = 0,
-             cyy = 0,
-             cys = 0;
-
-    size_t i;
     size_t n = VECT_SIZE(v);
     size_t nlog2 = (size_t) log2(n)+1;
     ht _h;
     ht* h = &_h;
-    uint64_t ti  = 0,
-             td  = 0,
-             tx  = 0,
-             ty  = 0,
-             ts  = 0;
-    uint64_t t0;
 
     printf("--- Perf Test --\n");
 
     VECT_SHUFFLE(v, arc4random);
-    for (i = 0; i < Niters; ++i) {
-        ht_init(h, nlog2);
-        t0    = timenow();
-        cyi  += insert_words(v, h);
-        ti   += timenow() - t0;
-
-
-        t0    = timenow();
-        cys  += find_all(v, h, 1);
-        ts   += timenow() - t0;
 
-        t0    = timenow();
-        cyy  += find_all(v, h, 0);
-        ty   += timenow() - t0;
-
-        t0    = timenow();
-        cyd  += del_all(v, h, 1);
-        td   += timenow() - t0;
+    bench_begin(b, "add-empty", n);
+    while (bench_next(b)) {
+        ht_init(h, nlog2);
+        bench_start(b);
+        insert_words(v, h, b);
+        bench_stop(b);
+        ht_fini(h);
+    }
+    bench_end(b);
 
+    ht_init(h, nlog2);
+    insert_words(v, h, 0);
+    print_ht(h);
 
-        // Finally, delete it again -- this will give us delete for
-        // non existing
-        t0    = timenow();
-        cyx  += del_all(v, h, 0);
-        tx   += timenow() - t0;
+    bench_begin(b, "find-existing", n);
+    while (bench_next(b)) {
+        bench_start(b);
+        find_all(v, h, 1, b);
+        bench_stop(b);
+    }
+    bench_end(b);
 
-        if (i == 0) print_ht(h);
+    bench_begin(b, "find-non-exist", n);
+    while (bench_next(b)) {
+        bench_start(b);
+        find_all(v, h, 0, b);
+        bench_stop(b);
+    }
+    bench_end(b);
+    ht_fini(h);
 
+    bench_begin(b, "del-existing", n);
+    while (bench_next(b)) {
+        ht_init(h, nlog2);
+        insert_words(v, h, 0);
+        bench_start(b);
+        del_all(v, h, 1, b);
+        bench_stop(b);
         ht_fini(h);
     }
-
-    double tot    = _d(n) * _d(Niters);
-
-    double ispd   = tot / _d(ti);
-    double dspd   = tot / _d(td);
-    double xspd   = tot / _d(tx);
-    double yspd   = tot / _d(ty);
-    double sspd   = tot / _d(ts);
-
-    double ci     = _d(cyi)  / tot;
-    double cd     = _d(cyd)  / tot;
-    double cx     = _d(cyx)  / tot;
-    double cy     = _d(cyy)  / tot;
-    double cs     = _d(cys)  / tot;
-
-    
-    printf("Add-empty:      %4.1f cy/add   %8.2f M/sec\n"
-           "Find-existing:  %4.1f cy/find  %8.2f M/sec\n"
-           "Find-non-exist: %4.1f cy/find  %8.2f M/sec\n"
-           "Del-existing:   %4.1f cy/find  %8.2f M/sec\n"
-           "Del-non-exist:  %4.1f cy/find  %8.2f M/sec\n",
-           ci, ispd,
-           cs, sspd,
-           cy, yspd,
-           cd, dspd,
-           cx, xspd
-           );
-
+    bench_end(b);
+
+    // Deleting from the emptied table gives us delete for non
+    // existing keys
+    ht_init(h, nlog2);
+    insert_words(v, h, 0);
+    del_all(v, h, 1, 0);
+
+    bench_begin(b, "del-non-exist", n);
+    while (bench_next(b)) {
+        bench_start(b);
+        del_all(v, h, 0, b);
+        bench_stop(b);
+    }
+    bench_end(b);
+    ht_fini(h);
 }
-#endif // __MAKE_OPTIMIZE__
+
 
 
 int
@@ -239,21 +219,22 @@ main(int argc, char** argv)
 
     ht_init(h, 2);
 
-    insert_words(&v, h);
+    insert_words(&v, h, 0);
 
     //VECT_SHUFFLE(&v, arc4random);
 
-    find_all(&v, h, 1);
+    find_all(&v, h, 1, 0);
     print_ht(h);
     ht_fini(h);
 
+    bench b;
+    int e;
 
-#ifdef __MAKE_OPTIMIZE__
-
-#define NITER   10
-    perf_test(&v, NITER);
+    if ((e = bench_init(&b, "t_fast-ht", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
 
-#endif // __OPTIMIZE__
+    perf_test(&v, &b);
+    bench_fini(&b);
 
     VECT_FINI(&v);
 
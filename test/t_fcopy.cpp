@@ -0,0 +1,336 @@
+/*
+ * Test and benchmark for in-kernel file copies.
+ *
+ * Usage: t_fcopy [FILE_MB [DIR]]
+ *
+ * Copies whole files and unaligned ranges with each copy method
+ * (falling back where the file system doesn't support one), to a
+ * pipe, with progress and abort; refuses to copy a file onto
+ * itself; checks copy-truncate rotation; then prints MB/s of each
+ * method.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/rotatefile.h"
+#include "posix/fcopy.h"
+
+using namespace std;
+
+#define _d(x)   ((double)(x))
+
+
+/*
+ * Flags that leave only method 'm' (and read/write as the last
+ * resort).
+ */
+static unsigned
+only(int m)
+{
+    return m == FCOPY_RW ? FCOPY_RW_ONLY : FCOPY_RW_ONLY & ~(1 << (m - 1));
+}
+
+
+static vector<uint8_t>
+readall(const string& fn)
+{
+    vector<uint8_t> v;
+    struct stat st;
+    int fd = ::open(fn.c_str(), O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) error(1, errno, "can't open %s", fn.c_str());
+
+    v.resize(st.st_size);
+    if (st.st_size > 0 && ::pread(fd, &v[0], v.size(), 0) != (ssize_t)v.size())
+        error(1, errno, "can't read %s", fn.c_str());
+    ::close(fd);
+    return v;
+}
+
+
+static void
+mkfile(const string& fn, size_t size)
+{
+    vector<uint64_t> v((size + 7) / 8);
+    uint64_t x = 0x9e3779b97f4a7c15;
+    int fd = ::open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0640);
+
+    if (fd < 0) error(1, errno, "can't create %s", fn.c_str());
+    for (size_t i = 0; i < v.size(); i++) {
+        x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+        v[i] = x * 2685821657736338717ULL;
+    }
+    if (::write(fd, &v[0], size) != (ssize_t)size) error(1, errno, "can't write %s", fn.c_str());
+    ::close(fd);
+}
+
+
+struct prog
+{
+    int      calls;
+    uint64_t last;
+    int      abort_at;
+};
+
+static int
+progress(void* ctx, uint64_t done, uint64_t total)
+{
+    prog* p = (prog*)ctx;
+
+    USEARG(total);
+    assert(done > p->last);
+    p->last = done;
+    if (++p->calls == p->abort_at) return -ECANCELED;
+    return 0;
+}
+
+
+static void
+check_file(const string& src, const string& dst, int m)
+{
+    fcopy c;
+    prog p;
+
+    memset(&c, 0, sizeof c);
+    memset(&p, 0, sizeof p);
+    c.flags    = only(m);
+    c.chunk    = 1048576;
+    c.progress = progress;
+    c.ctx      = &p;
+
+    int r = fcopy_file(&c, dst.c_str(), src.c_str());
+    if (r < 0) error(1, -r, "%s: copy failed", fcopy_method_name(m));
+    if (readall(src) != readall(dst)) error(1, 0, "%s: copy differs", fcopy_method_name(m));
+    assert(p.calls > 0 && p.last == c.copied);
+
+    struct stat s1, s2;
+    ::stat(src.c_str(), &s1);
+    ::stat(dst.c_str(), &s2);
+    assert((s1.st_mode & 07777) == (s2.st_mode & 07777));
+
+    printf("  %-16s whole file OK (via %s)\n", fcopy_method_name(m), fcopy_method_name(c.method));
+}
+
+
+static void
+check_range(const string& src, const string& dst, int m)
+{
+    uint64_t soff = 12345, doff = 777, len = 3 * 1048576 + 17;
+    vector<uint8_t> s = readall(src);
+    vector<uint8_t> d0(8 * 1048576, 0xee);
+    fcopy c;
+
+    int fd = ::open(dst.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+    int sfd = ::open(src.c_str(), O_RDONLY);
+
+    assert(fd >= 0 && sfd >= 0);
+    if (::write(fd, &d0[0], d0.size()) != (ssize_t)d0.size()) error(1, errno, "write");
+
+    memset(&c, 0, sizeof c);
+    c.flags = only(m);
+    int r = fcopy_range(&c, fd, doff, sfd, soff, len);
+    if (r < 0) error(1, -r, "%s: range copy failed", fcopy_method_name(m));
+    assert(c.copied == len);
+
+    /* File offsets are untouched */
+    assert(lseek(fd, 0, SEEK_CUR) == (off_t)d0.size());
+    assert(lseek(sfd, 0, SEEK_CUR) == 0);
+
+    memcpy(&d0[doff], &s[soff], len);
+    if (readall(dst) != d0) error(1, 0, "%s: range copy differs", fcopy_method_name(m));
+
+    /* Ranges past the end of the source are short, not errors */
+    r = fcopy_range(&c, fd, 0, sfd, s.size() - 100, 4096);
+    assert(r == 0 && c.copied == 100);
+
+    ::close(fd);
+    ::close(sfd);
+}
+
+
+static void
+check_pipe(const string& src)
+{
+    int sfd = ::open(src.c_str(), O_RDONLY);
+    vector<uint8_t> s = readall(src);
+    uint8_t buf[32768];
+    int pfd[2];
+    fcopy c;
+
+    assert(sfd >= 0 && pipe(pfd) == 0);
+    memset(&c, 0, sizeof c);
+
+    /* Small enough to sit in the pipe */
+    int r = fcopy_range(&c, pfd[1], 0, sfd, 100, sizeof buf);
+    assert(r == 0 && c.copied == sizeof buf);
+    assert(::read(pfd[0], buf, sizeof buf) == (ssize_t)sizeof buf);
+    assert(memcmp(buf, &s[100], sizeof buf) == 0);
+
+    printf("  to a pipe OK (via %s)\n", fcopy_method_name(c.method));
+    ::close(pfd[0]);
+    ::close(pfd[1]);
+    ::close(sfd);
+}
+
+
+static void
+check_abort(const string& src, const string& dst)
+{
+    fcopy c;
+    prog p;
+
+    memset(&c, 0, sizeof c);
+    memset(&p, 0, sizeof p);
+    c.chunk    = 1048576;
+    c.flags    = FCOPY_NO_CLONE;    // clones are done in one go
+    c.progress = progress;
+    c.ctx      = &p;
+    p.abort_at = 2;
+
+    int r = fcopy_file(&c, dst.c_str(), src.c_str());
+    assert(r == -ECANCELED);
+    assert(::access(dst.c_str(), F_OK) < 0);
+}
+
+
+// Copying a file onto itself (or a link to it) leaves it alone
+static void
+check_same(const string& src, const string& dir)
+{
+    string ln = dir + "/t_fcopy.lnk";
+    vector<uint8_t> v = readall(src);
+
+    assert(fcopy_file(0, src.c_str(), src.c_str()) == -EINVAL);
+
+    ::unlink(ln.c_str());
+    assert(::link(src.c_str(), ln.c_str()) == 0);
+    assert(fcopy_file(0, ln.c_str(), src.c_str()) == -EINVAL);
+    ::unlink(ln.c_str());
+
+    assert(readall(src) == v);
+    printf("  same file OK\n");
+}
+
+
+static void
+check_rotate(const string& dir)
+{
+    string fn = dir + "/t_fcopy.log";
+    const char msg1[] = "before rotation\n";
+    const char msg2[] = "after\n";
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        char x[PATH_MAX];
+
+        snprintf(x, sizeof x, "%s.%d", fn.c_str(), i);
+        ::unlink(x);
+    }
+
+    int fd = ::open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    assert(fd >= 0);
+    assert(::write(fd, msg1, sizeof msg1 - 1) > 0);
+
+    int r = putils::rotate_filename(fn, 3, ROTATE_COPYTRUNCATE);
+    if (r < 0) error(1, -r, "rotate failed");
+
+    /* The writer carries on in the (now empty) live file */
+    assert(::write(fd, msg2, sizeof msg2 - 1) > 0);
+    ::close(fd);
+
+    vector<uint8_t> v0 = readall(fn + ".0");
+    vector<uint8_t> v  = readall(fn);
+    assert(v0.size() == sizeof msg1 - 1 && 0 == memcmp(&v0[0], msg1, v0.size()));
+    assert(v.size()  == sizeof msg2 - 1 && 0 == memcmp(&v[0], msg2, v.size()));
+
+    /* Second rotation shifts .0 to .1 by renaming */
+    r = putils::rotate_filename(fn, 3, ROTATE_COPYTRUNCATE);
+    assert(r == 0);
+    assert(readall(fn + ".1") == v0);
+    assert(readall(fn + ".0") == v);
+    assert(readall(fn).size() == 0);
+
+    for (i = 0; i < 3; i++) {
+        char x[PATH_MAX];
+
+        snprintf(x, sizeof x, "%s.%d", fn.c_str(), i);
+        ::unlink(x);
+    }
+    ::unlink(fn.c_str());
+    printf("  copy-truncate rotation OK\n");
+}
+
+
+static void
+bench(const string& src, const string& dst, size_t mb, int m)
+{
+    fcopy c;
+
+    memset(&c, 0, sizeof c);
+    c.flags = only(m);
+
+    uint64_t t0 = timenow();
+    int r = fcopy_file(&c, dst.c_str(), src.c_str());
+    uint64_t t1 = timenow();
+
+    if (r < 0) error(1, -r, "%s: copy failed", fcopy_method_name(m));
+    printf("  %-16s %9.2f MB/s (via %s)\n", fcopy_method_name(m),
+            _d(mb * 1048576) / _d(t1 - t0), fcopy_method_name(c.method));
+    ::unlink(dst.c_str());
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    size_t mb  = 64;
+    string dir = "/tmp";
+    int m;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    mb = 1024;
+#endif
+
+    if (argc > 1) mb  = strtoul(argv[1], 0, 0);
+    if (argc > 2) dir = argv[2];
+
+    string src = dir + "/t_fcopy.src";
+    string dst = dir + "/t_fcopy.dst";
+
+    mkfile(src, 8 * 1048576 + 4097);
+    for (m = FCOPY_CFR; m <= FCOPY_RW; m++) {
+        check_file(src, dst, m);
+        check_range(src, dst, m);
+    }
+    check_pipe(src);
+    check_abort(src, dst);
+    check_same(src, dir);
+    check_rotate(dir);
+
+    mkfile(src, mb * 1048576);
+    printf("\n%zu MB copy:\n", mb);
+    for (m = FCOPY_CFR; m <= FCOPY_RW; m++) bench(src, dst, mb, m);
+
+    ::unlink(src.c_str());
+    ::unlink(dst.c_str());
+    return 0;
+}
+
+/* EOF */
@@ -1,6 +1,7 @@
 /*
  * 32-bit Hash function benchmark against realworld input.
- * Prints hashing speed in MB/sec and cycles/byte
+ * Prints ns/hash, MB/sec and per-hash latencies (see bench.h for
+ * the output formats).
  *
  * Usage:
  *    t_hashbench [INPUTFILE]
@@ -21,6 +22,7 @@
 #include "utils/arena.h"
 #include "utils/utils.h"
 #include "fast/vect.h"
+#include "bench.h"
 
 #include <assert.h>
 
@@ -89,38 +91,31 @@ static const hashfunc Hashes[] =
 
 
 static uint32_t
-benchmark(const token_array* tok, const hashfunc* hf)
+benchmark(bench* b, const token_array* tok, const hashfunc* hf)
 {
     int i,
         n = VECT_SIZE(tok);
     uint64_t nbytes = 0;
-    double speed, perbyte;
 
     volatile uint32_t hv = 0;
-    uint64_t t0, tn = 0;
-    uint64_t t1, tm = 0;
 
     for (i = 0; i < n; i++)
-    {
-        token* t = &VECT_ELEM(tok, i);
-        nbytes  += t->len;
-
-        t1  = timenow();
-        t0  = sys_cpu_timestamp();
-        hv += (*hf->func)(t->str, t->len, 0);
-        tn += sys_cpu_timestamp() - t0;
-        tm += timenow() - t1;
-    }
+        nbytes += VECT_ELEM(tok, i).len;
 
-    // cycles per byte
-    perbyte = (double)tn / (double)nbytes;
-
-    // this is speed: hashing bytes per sec
-    //speed   = (60.0 * 1.0e6 * (double)nbytes) / (((double)tm) * 1048576.0);
-    speed = ((double)nbytes) / ((double)tm);
+    bench_begin(b, hf->name, n);
+    bench_bytes(b, nbytes);
+    while (bench_next(b))
+    {
+        bench_start(b);
+        for (i = 0; i < n; i++)
+        {
+            token* t = &VECT_ELEM(tok, i);
 
-    printf("%9s: %8.2f MB/sec %5.4f cyc/byte\n", 
-            hf->name, speed, perbyte);
+            BENCH_OP(b, hv += (*hf->func)(t->str, t->len, 0));
+        }
+        bench_stop(b);
+    }
+    bench_end(b);
 
     return hv;
 }
@@ -171,6 +166,7 @@ main(int argc, char* argv[])
     int i, e;
     arena_t a;
     token_array tok;
+    bench b;
 
     program_name = argv[0];
 
@@ -205,10 +201,14 @@ main(int argc, char* argv[])
             fclose(fp);
     }
 
+    if ((e = bench_init(&b, "t_hashbench", 0)) < 0)
+        error(1, -e, "Unable to initialize benchmarks");
+
     for (hf=&Hashes[0]; hf->name; hf++)
     {
-        benchmark(&tok, hf);
+        benchmark(&b, &tok, hf);
     }
+    bench_fini(&b);
 
     VECT_FINI(&tok);
     arena_delete(a);
@@ -0,0 +1,416 @@
+/*
+ * Test for partitioned, parallel and incremental hash table walks.
+ *
+ * Usage: t_hashsweep [NTHREADS]
+ *
+ * Checks that partition iterators and cursors cover every item
+ * exactly once (cursors also while the table splits under them),
+ * and that the parallel and incremental remove_if remove what they
+ * should and keep the stats right. Then benchmarks full-table
+ * apply and remove_if sweeps: one thread with the table locked
+ * throughout, NTHREADS threads, and a cursor that locks the table
+ * for a few buckets per call (the per-call latency is how long
+ * writers wait).
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/hashtab.h"
+#include "bench.h"
+
+#ifdef __MAKE_OPTIMIZE__
+#define NITEMS      (1 << 20)
+#else
+#define NITEMS      (1 << 16)
+#endif
+
+#define SWEEP_K     1024
+
+
+struct ent
+{
+    uint32_t key;
+    uint32_t exp;
+};
+typedef struct ent ent;
+
+
+static uint32_t
+ent_hash(const void * x)
+{
+    uint32_t h = ((const ent *)x)->key * 0x9e3779b1;
+
+    return h ^ (h >> 15);
+}
+
+static int
+ent_cmp(const void * a, const void * b)
+{
+    uint32_t x = ((const ent *)a)->key,
+             y = ((const ent *)b)->key;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static hash_table_t
+mktab(int logsize)
+{
+    hash_table_policy pol;
+    hash_table_t t;
+
+    memset(&pol, 0, sizeof pol);
+    malloc_memmgr(&pol.mem);
+    pol.hash    = ent_hash;
+    pol.cmp     = ent_cmp;
+    pol.logsize = logsize;
+    pol.lock    = Mutex_locker;
+
+    assert(hash_table_new(&t, &pol) == 0);
+    return t;
+}
+
+
+static void
+fill(hash_table_t t, ent * v, uint32_t lo, uint32_t hi)
+{
+    uint32_t i;
+
+    for (i = lo; i < hi; i++) {
+        v[i].key = i;
+        v[i].exp = i % 10;
+        assert(hash_table_insert(t, &v[i]) == 0);
+    }
+}
+
+
+static size_t
+nodes(hash_table_t t)
+{
+    hash_table_stat st;
+
+    hash_table_stats(t, &st);
+    return st.nodes;
+}
+
+
+// Count visits per key
+static void
+mark(void * cookie, const void * x)
+{
+    uint32_t * seen = cookie;
+
+    __atomic_add_fetch(&seen[((const ent *)x)->key], 1, __ATOMIC_RELAXED);
+}
+
+static void
+check_seen(uint32_t * seen, uint32_t lo, uint32_t hi, uint32_t min, uint32_t max)
+{
+    uint32_t i;
+
+    for (i = lo; i < hi; i++) {
+        if (seen[i] < min || seen[i] > max)
+            error(1, 0, "key %u seen %u times; expected %u..%u", i, seen[i], min, max);
+    }
+}
+
+
+static void
+test_part_iter(hash_table_t t, uint32_t n)
+{
+    uint32_t * seen = NEWZA(uint32_t, n);
+    size_t nparts[] = { 1, 3, 7, 64 };
+    size_t i, p;
+
+    for (i = 0; i < ARRAY_SIZE(nparts); i++) {
+        memset(seen, 0, n * sizeof seen[0]);
+        for (p = 0; p < nparts[i]; p++) {
+            hash_table_iter_t it;
+            ent * e;
+
+            assert(hash_table_part_iter_new(&it, t, p, nparts[i]) == 0);
+            for (hash_table_iter_first(it); (e = hash_table_iter_item(it));
+                 hash_table_iter_next(it))
+                seen[e->key]++;
+            hash_table_iter_delete(it);
+        }
+        check_seen(seen, 0, n, 1, 1);
+    }
+
+    hash_table_iter_t it;
+    assert(hash_table_part_iter_new(&it, t, 3, 3) == -EINVAL);
+    DEL(seen);
+}
+
+
+static void
+test_apply_par(hash_table_t t, uint32_t n, int nthr)
+{
+    uint32_t * seen = NEWZA(uint32_t, n);
+    size_t p, np = 5;
+
+    assert(hash_table_apply_par(t, nthr, mark, seen) == 0);
+    check_seen(seen, 0, n, 1, 1);
+
+    // Each partition of a cursor, all at once
+    memset(seen, 0, n * sizeof seen[0]);
+    for (p = 0; p < np; p++) {
+        hash_table_cursor c;
+
+        assert(hash_table_cursor_init(t, &c, p, np) == 0);
+        assert(hash_table_sweep_apply(t, &c, 0, mark, seen) >= 0);
+        assert(hash_table_cursor_done(&c));
+    }
+    check_seen(seen, 0, n, 1, 1);
+    DEL(seen);
+}
+
+
+// A cursor sweep while the table splits between calls
+static void
+test_sweep_grow(void)
+{
+    hash_table_t t    = mktab(4);
+    uint32_t n        = NITEMS;
+    ent * v           = NEWZA(ent, n);
+    uint32_t * seen   = NEWZA(uint32_t, n);
+    uint32_t next     = n / 4;
+    hash_table_stat st0, st1;
+    hash_table_cursor c;
+    int calls = 0;
+
+    fill(t, v, 0, next);
+    hash_table_stats(t, &st0);
+
+    assert(hash_table_cursor_init(t, &c, 0, 0) == 0);
+    while (!hash_table_cursor_done(&c)) {
+        uint32_t i;
+
+        assert(hash_table_sweep_apply(t, &c, 7, mark, seen) >= 0);
+        calls++;
+
+        for (i = 0; i < 16 && next < n; i++, next++) {
+            v[next].key = next;
+            assert(hash_table_insert(t, &v[next]) == 0);
+        }
+    }
+
+    hash_table_stats(t, &st1);
+    assert(st1.splits > st0.splits);
+
+    check_seen(seen, 0, n / 4, 1, 1);
+    check_seen(seen, n / 4, n, 0, 1);
+
+    hash_table_delete(t);
+    DEL(seen);
+    DEL(v);
+}
+
+
+static int
+key_mod3(void * cookie, const void * x)
+{
+    return ((const ent *)x)->key % 3 == *(uint32_t *)cookie;
+}
+
+
+static void
+test_remove(int nthr)
+{
+    hash_table_t t = mktab(8);
+    uint32_t n     = NITEMS;
+    ent * v        = NEWZA(ent, n);
+    uint32_t third = (n + 2) / 3,
+             m, i, p;
+    int r, tot;
+
+    fill(t, v, 0, n);
+
+    m = 0;
+    r = hash_table_remove_if_par(t, nthr, key_mod3, &m);
+    assert(r == (int)third);
+    assert(nodes(t) == n - third);
+
+    // Incrementally, in 4 partitions
+    m   = 1;
+    tot = 0;
+    for (p = 0; p < 4; p++) {
+        hash_table_cursor c;
+
+        assert(hash_table_cursor_init(t, &c, p, 4) == 0);
+        while (!hash_table_cursor_done(&c)) {
+            assert((r = hash_table_sweep_remove_if(t, &c, 100, key_mod3, &m)) >= 0);
+            tot += r;
+        }
+    }
+    assert(tot == (int)(n / 3 + (n % 3 > 1)));
+    assert(nodes(t) == n / 3);
+
+    for (i = 0; i < n; i++) {
+        ent k = { i, 0 };
+        void * x = 0;
+
+        assert(hash_table_lookup(t, &k, &x) == (i % 3 == 2));
+        if (i % 3 == 2) assert(x == &v[i]);
+    }
+
+    // The rest, serially; 'pred' sees the item
+    m = 2;
+    assert(hash_table_remove_if(t, key_mod3, &m) == (int)(n / 3));
+    assert(nodes(t) == 0);
+
+    hash_table_stat st;
+    hash_table_stats(t, &st);
+    assert(st.fill == 0);
+
+    hash_table_delete(t);
+    DEL(v);
+}
+
+
+/*
+ * Benchmarks: sweeps that find nothing to expire, so every
+ * repetition walks the same full table.
+ */
+static uint32_t Now = 100;
+
+static int
+expired(void * cookie, const void * x)
+{
+    return ((const ent *)x)->exp >= *(uint32_t *)cookie;
+}
+
+static void
+count(void * cookie, const void * x)
+{
+    uint64_t * n = cookie;
+
+    *n += ((const ent *)x)->exp;
+}
+
+
+static void
+bench_apply(bench * b, hash_table_t t, int nthr)
+{
+    uint32_t * seen = NEWZA(uint32_t, NITEMS);
+    char nm[64];
+
+    bench_begin(b, "apply", NITEMS);
+    while (bench_next(b)) {
+        uint64_t n = 0;
+
+        bench_start(b);
+        hash_table_apply(t, count, &n);
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    snprintf(nm, sizeof nm, "apply_par-%dthr", nthr);
+    bench_begin(b, nm, NITEMS);
+    while (bench_next(b)) {
+        bench_start(b);
+        hash_table_apply_par(t, nthr, mark, seen);
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    snprintf(nm, sizeof nm, "sweep_apply-k%d", SWEEP_K);
+    bench_begin(b, nm, NITEMS);
+    while (bench_next(b)) {
+        hash_table_cursor c;
+        uint64_t n = 0;
+
+        bench_start(b);
+        hash_table_cursor_init(t, &c, 0, 0);
+        while (!hash_table_cursor_done(&c))
+            BENCH_OP(b, hash_table_sweep_apply(t, &c, SWEEP_K, count, &n));
+        bench_stop(b);
+    }
+    bench_end(b);
+    DEL(seen);
+}
+
+
+static void
+bench_remove_if(bench * b, hash_table_t t, int nthr)
+{
+    char nm[64];
+
+    // One op is the whole sweep: its latency is the lock hold time
+    bench_begin(b, "remove_if", 1);
+    while (bench_next(b)) {
+        bench_start(b);
+        BENCH_OP(b, hash_table_remove_if(t, expired, &Now));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    snprintf(nm, sizeof nm, "remove_if_par-%dthr", nthr);
+    bench_begin(b, nm, 1);
+    while (bench_next(b)) {
+        bench_start(b);
+        BENCH_OP(b, hash_table_remove_if_par(t, nthr, expired, &Now));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    snprintf(nm, sizeof nm, "sweep_remove_if-k%d", SWEEP_K);
+    bench_begin(b, nm, 1);
+    while (bench_next(b)) {
+        hash_table_cursor c;
+
+        bench_start(b);
+        hash_table_cursor_init(t, &c, 0, 0);
+        while (!hash_table_cursor_done(&c))
+            BENCH_OP(b, hash_table_sweep_remove_if(t, &c, SWEEP_K, expired, &Now));
+        bench_stop(b);
+    }
+    bench_end(b);
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    int nthr = sys_cpu_getavail();
+    hash_table_t t;
+    ent * v;
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (nthr < 2) nthr = 2;
+
+    v = NEWZA(ent, NITEMS);
+    t = mktab(10);
+    fill(t, v, 0, NITEMS);
+
+    test_part_iter(t, NITEMS);
+    test_apply_par(t, NITEMS, nthr);
+    test_sweep_grow();
+    test_remove(nthr);
+
+    if ((e = bench_init(&b, "t_hashsweep", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    printf("# %d items\n", NITEMS);
+    bench_apply(&b, t, nthr);
+    bench_remove_if(&b, t, nthr);
+    bench_fini(&b);
+
+    assert(nodes(t) == NITEMS);
+    hash_table_delete(t);
+    DEL(v);
+    return 0;
+}
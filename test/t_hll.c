@@ -0,0 +1,362 @@
+/*
+ * Test for the HyperLogLog sketch.
+ *
+ * Usage: t_hll [NSKETCHES]
+ *
+ * Checks the estimate against the true cardinality across the
+ * sparse and dense ranges, that sparse and dense sketches of the
+ * same items agree, that merging equals sketching the union and
+ * that marshalled sketches round trip (and fail their checksum
+ * when corrupted). Then benchmarks adds, estimates and merges of
+ * NSKETCHES sketches.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/hll.h"
+#include "utils/hashfunc.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#define SEED    0x6a09e667f3bcc908ULL
+
+static inline uint64_t
+H(uint64_t i)
+{
+    return fasthash64(&i, sizeof i, SEED);
+}
+
+
+// Sketch of items [lo, hi)
+static void
+fill(hll *h, uint64_t lo, uint64_t hi)
+{
+    uint64_t i;
+
+    for (i = lo; i < hi; i++) hll_add(h, H(i));
+}
+
+
+static void
+test_accuracy(int p)
+{
+    static const uint64_t N[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+    double se = 1.04 / sqrt(_d(1 << p));
+    hll *h    = hll_new(p);
+    uint64_t prev = 0;
+    size_t i;
+
+    assert(h);
+    assert(hll_count(h) == 0);
+
+    printf("p=%d (std err %.2f%%):\n", p, 100.0 * se);
+    for (i = 0; i < ARRAY_SIZE(N); i++) {
+        uint64_t n = N[i];
+        uint64_t c;
+        double err;
+
+        fill(h, prev, n);
+        prev = n;
+
+        c   = hll_count(h);
+        err = fabs(_d(c) - _d(n)) / _d(n);
+        printf("   %8llu: %8llu  %6.3f%% %s\n", (unsigned long long)n,
+                (unsigned long long)c, 100.0 * err,
+                hll_is_dense(h) ? "dense" : "sparse");
+
+        // Sparse is (nearly) exact; dense within 5 std errors.
+        if (!hll_is_dense(h)) assert(err <= 0.01);
+        else                  assert(err <= 5.0 * se);
+    }
+
+    // Adding the same items again changes nothing
+    prev = hll_count(h);
+    fill(h, 0, 1000);
+    assert(hll_count(h) == prev);
+
+    hll_delete(h);
+}
+
+
+static void
+test_sparse_dense(void)
+{
+    hll a, b;
+    uint64_t n;
+
+    assert(hll_init(&a, 3) == -EINVAL);
+    assert(hll_init(&a, HLL_MAX_P+1) == -EINVAL);
+
+    for (n = 1; n <= 20000; n *= 3) {
+        hll_init(&a, 12);
+        hll_init(&b, 12);
+        hll_todense(&b);
+
+        fill(&a, 0, n);
+        fill(&b, 0, n);
+        assert(hll_is_dense(&b));
+        assert(hll_eq(&a, &b));
+        assert(hll_count(&a) > 0);
+
+        hll_todense(&a);
+        assert(hll_eq(&a, &b));
+        assert(hll_count(&a) == hll_count(&b));
+
+        hll_reset(&a);
+        assert(!hll_is_dense(&a) && hll_count(&a) == 0);
+
+        hll_fini(&a);
+        hll_fini(&b);
+    }
+}
+
+
+/*
+ * Sketches of overlapping ranges of sizes from sparse to dense;
+ * merging them must give the sketch of their union.
+ */
+static void
+test_merge(void)
+{
+    static const uint64_t N[] = { 5, 300, 2000, 50000 };
+    hll u, m, s;
+    size_t i, j;
+
+    for (i = 0; i < ARRAY_SIZE(N); i++) {
+        for (j = 0; j < ARRAY_SIZE(N); j++) {
+            hll_init(&m, 14);
+            hll_init(&s, 14);
+            hll_init(&u, 14);
+
+            fill(&m, 0, N[i]);
+            fill(&s, N[i]/2, N[i]/2 + N[j]);
+            fill(&u, 0, N[i]);
+            fill(&u, N[i]/2, N[i]/2 + N[j]);
+
+            assert(hll_merge(&m, &s) == 0);
+            assert(hll_eq(&m, &u));
+            assert(hll_count(&m) == hll_count(&u));
+
+            hll_fini(&m);
+            hll_fini(&s);
+            hll_fini(&u);
+        }
+    }
+
+    hll_init(&m, 14);
+    hll_init(&s, 12);
+    assert(hll_merge(&m, &s) == -EINVAL);
+    assert(hll_merge(&m, &m) == 0);
+    hll_fini(&m);
+    hll_fini(&s);
+}
+
+
+static void
+test_marshal(uint64_t n)
+{
+    const char *fname = "/tmp/t_hll.dat";
+    hll h, u;
+    hll *f;
+    uint8_t *buf;
+    size_t sz;
+    ssize_t r;
+
+    hll_init(&h, 14);
+    fill(&h, 0, n);
+
+    sz  = hll_marshal_size(&h);
+    buf = NEWA(uint8_t, sz);
+    assert(buf);
+
+    assert(hll_marshal_buf(&h, buf, sz-1) == -ENOSPC);
+
+    r = hll_marshal_buf(&h, buf, sz);
+    assert(r == (ssize_t)sz);
+
+    assert(hll_unmarshal_buf(&u, buf, sz) == 0);
+    assert(hll_is_dense(&u) == hll_is_dense(&h));
+    assert(hll_eq(&u, &h));
+    assert(hll_count(&u) == hll_count(&h));
+    hll_fini(&u);
+
+    // Corrupt data and short buffers are caught
+    buf[64] ^= 0x01;
+    assert(hll_unmarshal_buf(&u, buf, sz) == -EILSEQ);
+    buf[64] ^= 0x01;
+    buf[sz-1] ^= 0x80;
+    assert(hll_unmarshal_buf(&u, buf, sz) == -EILSEQ);
+    buf[sz-1] ^= 0x80;
+    assert(hll_unmarshal_buf(&u, buf, sz-1) == -EILSEQ);
+    assert(hll_unmarshal_buf(&u, buf, 16) == -EILSEQ);
+
+    // To a file and back; copied and in-situ
+    assert(hll_marshal(&h, fname) == 0);
+
+    assert(hll_unmarshal(&f, fname, 0) == 0);
+    assert(hll_eq(f, &h));
+    assert(!(f->flags & HLL_MMAP));
+    hll_delete(f);
+
+    assert(hll_unmarshal(&f, fname, HLL_MMAP) == 0);
+    assert(hll_eq(f, &h));
+    assert(!!(f->flags & HLL_MMAP) == hll_is_dense(&h));
+
+    // Adds to a mapped sketch don't reach the file
+    fill(f, n, 2*n + 1000);
+    assert(!hll_eq(f, &h));
+    hll_delete(f);
+
+    assert(hll_unmarshal(&f, fname, HLL_MMAP) == 0);
+    assert(hll_eq(f, &h));
+    hll_delete(f);
+
+    assert(hll_unmarshal(&f, "/tmp/t_hll.nonexistent", 0) == -ENOENT);
+
+    unlink(fname);
+    DEL(buf);
+    hll_fini(&h);
+}
+
+
+static void
+perf_test(bench *b, int nsk)
+{
+    const uint64_t N = 1000000;
+    hll *sk = NEWZA(hll, nsk);
+    uint8_t *bufs;
+    size_t sz;
+    uint64_t i;
+    hll h, u;
+    int k;
+
+    assert(sk);
+
+    hll_init(&h, 14);
+    bench_begin(b, "add-dense", N);
+    while (bench_next(b)) {
+        hll_reset(&h);
+        hll_todense(&h);
+
+        bench_start(b);
+        for (i = 0; i < N; i++) hll_add(&h, H(i));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    bench_begin(b, "add-sparse", 2000);
+    while (bench_next(b)) {
+        hll_reset(&h);
+
+        bench_start(b);
+        for (i = 0; i < 2000; i++) hll_add(&h, H(i));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    hll_reset(&h);
+    fill(&h, 0, N);
+    bench_begin(b, "count", 1000);
+    while (bench_next(b)) {
+        bench_start(b);
+        for (i = 0; i < 1000; i++) BENCH_OP(b, hll_count(&h));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    // 'nsk' dense sketches of 10k items each
+    for (k = 0; k < nsk; k++) {
+        hll_init(&sk[k], 14);
+        fill(&sk[k], 1000 * k, 1000 * k + 10000);
+    }
+
+    hll_init(&u, 14);
+    bench_begin(b, "merge", nsk);
+    bench_bytes(b, (uint64_t)nsk * u.nbytes);
+    while (bench_next(b)) {
+        hll_reset(&u);
+        hll_todense(&u);
+
+        bench_start(b);
+        for (k = 0; k < nsk; k++) BENCH_OP(b, hll_merge(&u, &sk[k]));
+        bench_stop(b);
+    }
+    bench_end(b);
+
+    i = hll_count(&u);
+    printf("union of %d sketches: %llu (exact %llu)\n", nsk,
+            (unsigned long long)i, (unsigned long long)(1000 * (nsk-1) + 10000));
+
+    // Verify and merge marshalled sketches
+    sz   = hll_marshal_size(&sk[0]);
+    bufs = NEWA(uint8_t, sz * nsk);
+    assert(bufs);
+    for (k = 0; k < nsk; k++) {
+        assert(hll_marshal_buf(&sk[k], bufs + k * sz, sz) == (ssize_t)sz);
+    }
+
+    bench_begin(b, "unmarshal+merge", nsk);
+    bench_bytes(b, (uint64_t)nsk * sz);
+    while (bench_next(b)) {
+        hll_reset(&u);
+
+        bench_start(b);
+        for (k = 0; k < nsk; k++) {
+            hll x;
+
+            hll_unmarshal_buf(&x, bufs + k * sz, sz);
+            hll_merge(&u, &x);
+            hll_fini(&x);
+        }
+        bench_stop(b);
+    }
+    bench_end(b);
+    assert(hll_count(&u) == i);
+
+    for (k = 0; k < nsk; k++) hll_fini(&sk[k]);
+    hll_fini(&h);
+    hll_fini(&u);
+    DEL(bufs);
+    DEL(sk);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int nsk = 1000;
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nsk = atoi(argv[1]);
+    if (nsk < 1)  nsk = 1;
+
+    test_accuracy(10);
+    test_accuracy(14);
+    test_sparse_dense();
+    test_merge();
+    test_marshal(100);
+    test_marshal(100000);
+
+    if ((e = bench_init(&b, "t_hll", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    perf_test(&b, nsk);
+    bench_fini(&b);
+    return 0;
+}
+
+/* EOF */
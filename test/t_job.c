@@ -0,0 +1,347 @@
+/*
+ * Test for the job manager's priority levels and deadlines.
+ *
+ * Usage: t_job [NTHREADS]
+ *
+ * Checks on one thread the dispatch order - weighted round robin
+ * between levels, earliest deadline first within a level - the per
+ * level stats and that waiting runs all the queued jobs. Then
+ * measures the queue wait of periodic probe jobs while other
+ * threads keep the queue full of bulk jobs: with probes and bulk
+ * jobs at the same level (a single FIFO) and with the probes at
+ * JOB_PRIO_URGENT and the bulk at JOB_PRIO_BULK.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "posix/job.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define NPROBES     2000
+#else
+#define NPROBES     500
+#endif
+
+#define BULK_US     20      // run time of a bulk job
+#define PROBE_US    200     // interval between probes
+
+static uint64_t
+nsnow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Dispatch order on one thread: the first job holds the thread
+ * until everything else is queued.
+ */
+struct order
+{
+    sem_t started;
+    sem_t go;
+
+    int   ids[64];
+    int   n;
+};
+
+#define GATE    ((void*)1)
+
+static int
+order_job(void* ctx, void* j, int thr)
+{
+    struct order* o = ctx;
+
+    USEARG(thr);
+    if (j == GATE) {
+        sem_post(&o->started);
+        sem_wait(&o->go);
+        return 0;
+    }
+
+    o->ids[o->n++] = (int)(uintptr_t)j;
+    return 0;
+}
+
+
+static void
+order_start(job_manager* jm, struct order* o)
+{
+    memset(o, 0, sizeof *o);
+    sem_init(&o->started, 0, 0);
+    sem_init(&o->go, 0, 0);
+
+    assert(job_manager_init(jm, 1, order_job, o) == 1);
+    job_manager_submit_job(jm, GATE);
+    sem_wait(&o->started);
+}
+
+
+static void
+order_end(job_manager* jm, struct order* o)
+{
+    job_manager_destroy(jm);
+    sem_destroy(&o->started);
+    sem_destroy(&o->go);
+}
+
+
+#define ID(p, i)    ((void*)(uintptr_t)(100 * ((p) + 1) + (i)))
+
+static void
+test_wrr()
+{
+    static const unsigned w[JOB_NPRIO] = { 2, 1, 1, 1 };
+    static const int want[] = {
+        101, 102, 301, 401,  103, 104, 302, 402,  105, 106, 303, 403,
+    };
+    struct order o;
+    job_manager jm;
+    job_stats st[JOB_NPRIO];
+    int i;
+
+    order_start(&jm, &o);
+    job_manager_set_weights(&jm, w);
+
+    assert(job_manager_submit(&jm, ID(0, 1), -1, 0) == -EINVAL);
+    assert(job_manager_submit(&jm, ID(0, 1), JOB_NPRIO, 0) == -EINVAL);
+
+    for (i = 1; i <= 3; i++) assert(job_manager_submit(&jm, ID(JOB_PRIO_BULK, i), JOB_PRIO_BULK, 0) == 0);
+    for (i = 1; i <= 3; i++) job_manager_submit_job(&jm, ID(JOB_PRIO_NORMAL, i));
+    for (i = 1; i <= 6; i++) assert(job_manager_submit(&jm, ID(JOB_PRIO_URGENT, i), JOB_PRIO_URGENT, 0) == 0);
+
+    job_manager_stats(&jm, st);
+    assert(st[JOB_PRIO_URGENT].depth == 6 && st[JOB_PRIO_URGENT].max_depth == 6);
+    assert(st[JOB_PRIO_NORMAL].depth == 3);
+    assert(st[JOB_PRIO_BULK].depth   == 3);
+    assert(st[JOB_PRIO_HIGH].submitted == 0);
+
+    sem_post(&o.go);
+    assert(job_manager_wait(&jm) == 0);
+
+    assert(o.n == ARRAY_SIZE(want));
+    for (i = 0; i < o.n; i++) assert(o.ids[i] == want[i]);
+
+    job_manager_stats(&jm, st);
+    assert(st[JOB_PRIO_URGENT].dispatched == 6 && st[JOB_PRIO_URGENT].depth == 0);
+    assert(st[JOB_PRIO_NORMAL].dispatched == 3 + 1);    // and the gate
+    assert(st[JOB_PRIO_BULK].submitted == 3 && st[JOB_PRIO_BULK].dispatched == 3);
+    assert(st[JOB_PRIO_BULK].late == 0);
+
+    order_end(&jm, &o);
+}
+
+
+/*
+ * Earliest deadline first within a level; jobs without one after,
+ * in FIFO order. A deadline too far out to add up is none.
+ */
+static void
+test_edf()
+{
+    static const int want[] = { 303, 305, 302, 301, 304, 306 };
+    struct order o;
+    job_manager jm;
+    job_stats st[JOB_NPRIO];
+    int i;
+
+    order_start(&jm, &o);
+
+    job_manager_submit_job(&jm, ID(JOB_PRIO_NORMAL, 1));
+    job_manager_submit(&jm, ID(JOB_PRIO_NORMAL, 2), JOB_PRIO_NORMAL, 5000000);
+    job_manager_submit(&jm, ID(JOB_PRIO_NORMAL, 3), JOB_PRIO_NORMAL, 1);
+    job_manager_submit_job(&jm, ID(JOB_PRIO_NORMAL, 4));
+    job_manager_submit(&jm, ID(JOB_PRIO_NORMAL, 5), JOB_PRIO_NORMAL, 1000000);
+    job_manager_submit(&jm, ID(JOB_PRIO_NORMAL, 6), JOB_PRIO_NORMAL, UINT64_MAX);
+
+    // Job 3 misses its deadline
+    usleep(2000);
+    sem_post(&o.go);
+    assert(job_manager_wait(&jm) == 0);
+
+    assert(o.n == ARRAY_SIZE(want));
+    for (i = 0; i < o.n; i++) assert(o.ids[i] == want[i]);
+
+    job_manager_stats(&jm, st);
+    assert(st[JOB_PRIO_NORMAL].late == 1);
+    assert(st[JOB_PRIO_NORMAL].max_wait_us >= 2000);
+
+    order_end(&jm, &o);
+}
+
+
+/*
+ * Late jobs and the end of work: waiting runs everything queued.
+ */
+static uint64_t Ran;
+
+static int
+count_job(void* ctx, void* j, int thr)
+{
+    USEARG(ctx);
+    USEARG(j);
+    USEARG(thr);
+    __atomic_add_fetch(&Ran, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+static void
+test_drain(int nthr)
+{
+    job_manager jm;
+    job_stats st[JOB_NPRIO];
+    uint64_t want = 0;
+    int i, p;
+
+    assert(job_manager_init(&jm, nthr, count_job, 0) == nthr);
+    for (i = 0; i < 3 * JOB_MAX; i++) {
+        p = i % JOB_NPRIO;
+        assert(job_manager_submit(&jm, ID(p, 1), p, i % 3 ? 1 : 0) == 0);
+        want++;
+    }
+    assert(job_manager_wait(&jm) == 0);
+    assert(Ran == want);
+
+    job_manager_stats(&jm, st);
+    for (p = 0; p < JOB_NPRIO; p++) {
+        assert(st[p].submitted == st[p].dispatched);
+        assert(st[p].depth == 0);
+        assert(st[p].max_depth <= JOB_MAX);
+        assert(st[p].late <= st[p].dispatched);
+        assert(st[p].max_wait_us * st[p].dispatched >= st[p].wait_us);
+    }
+    job_manager_destroy(&jm);
+}
+
+
+
+/*
+ * Probe latency under bulk load.
+ */
+struct probe
+{
+    uint64_t  t_sub;
+    uint64_t* lat;
+};
+
+static struct probe Bulk;
+static volatile int Stop;
+
+
+static int
+load_job(void* ctx, void* j, int thr)
+{
+    struct probe* p = j;
+
+    USEARG(ctx);
+    USEARG(thr);
+    if (p == &Bulk) {
+        uint64_t end = nsnow() + BULK_US * 1000;
+
+        while (nsnow() < end)
+            ;
+    } else {
+        *p->lat = nsnow() - p->t_sub;
+    }
+    return 0;
+}
+
+
+struct loader
+{
+    job_manager* jm;
+    int          prio;
+};
+
+static void*
+bulk_loader(void* v)
+{
+    struct loader* l = v;
+
+    while (!Stop) job_manager_submit(l->jm, &Bulk, l->prio, 0);
+    return 0;
+}
+
+
+static void
+probe_run(bench* b, const char* name, int nthr, int bulk, int prio)
+{
+    uint64_t* lat      = NEWZA(uint64_t, NPROBES);
+    struct probe* pr   = NEWZA(struct probe, NPROBES);
+    struct loader ld   = { 0, bulk };
+    job_manager jm;
+    pthread_t t;
+    double sum = 0;
+    int i;
+
+    ld.jm = &jm;
+    Stop  = 0;
+    assert(job_manager_init(&jm, nthr, load_job, 0) == nthr);
+    pthread_create(&t, 0, bulk_loader, &ld);
+
+    // Let the bulk jobs fill the queue
+    usleep(JOB_MAX * BULK_US / nthr);
+
+    for (i = 0; i < NPROBES; i++) {
+        pr[i].lat   = &lat[i];
+        pr[i].t_sub = nsnow();
+        job_manager_submit(&jm, &pr[i], prio, 0);
+        usleep(PROBE_US);
+    }
+
+    Stop = 1;
+    pthread_join(t, 0);
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+
+    for (i = 0; i < NPROBES; i++) sum += _d(lat[i]);
+    bench_add(b, name, NPROBES, sum, lat, NPROBES);
+
+    DEL(lat);
+    DEL(pr);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    int nthr = sys_cpu_getavail();
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (nthr < 1) nthr = 1;
+
+    test_wrr();
+    test_edf();
+    test_drain(nthr);
+
+    if ((e = bench_init(&b, "t_job", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    probe_run(&b, "probe-wait-fifo",     nthr, JOB_PRIO_NORMAL, JOB_PRIO_NORMAL);
+    probe_run(&b, "probe-wait-priority", nthr, JOB_PRIO_BULK,   JOB_PRIO_URGENT);
+    bench_fini(&b);
+    return 0;
+}
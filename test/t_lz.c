@@ -0,0 +1,750 @@
+/*
+ * Test for the LZ77 block and frame codec.
+ *
+ * Usage: t_lz [SIZE_MB]
+ *
+ * Round trips blocks of log lines, JSON cache values, binary
+ * records, zeros and random bytes of many sizes at every level;
+ * checks the output bounds and that corrupt or truncated blocks are
+ * rejected without overruns. Checks that a dictionary helps small
+ * values and that frames round trip when fed in random pieces
+ * (linked and not, with and without checksums) and detect damage.
+ * Then benchmarks compression and decompression in GB/s and the
+ * ratio of each data shape against zbuf's deflate streams.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/lz.h"
+#include "zlib/zbuf.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define SIZE_MB     16
+#else
+#define SIZE_MB     2
+#endif
+
+#define BLKSIZE     (64 * 1024)
+#define NVALS       2000
+
+
+static uint64_t Rand = 0x243f6a8885a308d3ULL;
+
+static inline uint64_t
+rnd(void)
+{
+    uint64_t z = (Rand += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/*
+ * Data shapes
+ */
+
+static const char *Words[] = {
+    "GET", "PUT", "POST", "/api/v1/users", "/api/v1/orders", "/static/app.js",
+    "200", "404", "500", "ok", "timeout", "retry", "cache", "miss", "hit",
+};
+
+// Log lines
+static size_t
+mk_log(char *p, size_t n)
+{
+    size_t off = 0;
+    uint64_t t = 1477000000000ULL;
+
+    while (off + 160 < n) {
+        uint64_t r = rnd();
+
+        t  += r % 5000;
+        off += sprintf(p + off,
+                "%llu host-%02u INFO %s %s %s req=%08llx lat=%uus %s\n",
+                (unsigned long long)t, (unsigned)(r >> 8) % 16, Words[(r >> 12) % 3],
+                Words[3 + (r >> 16) % 3], Words[6 + (r >> 20) % 3],
+                (unsigned long long)(r >> 32), (unsigned)(r >> 24) % 100000,
+                Words[9 + (r >> 40) % 6]);
+    }
+    memset(p + off, '\n', n - off);
+    return n;
+}
+
+
+// One JSON cache value
+static size_t
+mk_json(char *p, size_t n)
+{
+    uint64_t r = rnd();
+
+    return snprintf(p, n,
+            "{\"id\":%llu,\"name\":\"user%u\",\"email\":\"user%u@example.com\","
+            "\"plan\":\"%s\",\"active\":%s,\"balance\":%u.%02u,"
+            "\"tags\":[\"%s\",\"%s\"],\"created\":\"2016-10-%02uT%02u:%02u:00Z\"}",
+            (unsigned long long)(r >> 20), (unsigned)(r % 100000), (unsigned)(r % 100000),
+            (r >> 8) & 1 ? "premium" : "basic", (r >> 9) & 1 ? "true" : "false",
+            (unsigned)(r >> 10) % 10000, (unsigned)(r >> 30) % 100,
+            Words[9 + (r >> 40) % 6], Words[9 + (r >> 44) % 6],
+            1 + (unsigned)(r >> 48) % 28, (unsigned)(r >> 52) % 24, (unsigned)(r >> 56) % 60);
+}
+
+
+static size_t
+mk_jsons(char *p, size_t n)
+{
+    size_t off = 0;
+
+    while (off + 400 < n) {
+        off += mk_json(p + off, n - off);
+        p[off++] = '\n';
+    }
+    memset(p + off, ' ', n - off);
+    return n;
+}
+
+
+// Binary records
+struct rec
+{
+    uint64_t id;
+    uint64_t ts;
+    uint32_t flags;
+    uint32_t count;
+    double   val;
+};
+
+static size_t
+mk_recs(char *p, size_t n)
+{
+    struct rec r;
+    size_t off;
+
+    memset(&r, 0, sizeof r);
+    for (off = 0; off + sizeof r <= n; off += sizeof r) {
+        uint64_t x = rnd();
+
+        r.id++;
+        r.ts   += x % 1000;
+        r.flags = (x >> 10) & 0x7;
+        r.count = (x >> 20) % 64;
+        r.val   = _d((x >> 32) % 1000) / 8.0;
+        memcpy(p + off, &r, sizeof r);
+    }
+    memset(p + off, 0, n - off);
+    return n;
+}
+
+
+static size_t
+mk_zeros(char *p, size_t n)
+{
+    memset(p, 0, n);
+    return n;
+}
+
+
+static size_t
+mk_random(char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) p[i] = (char)rnd();
+    return n;
+}
+
+
+struct shape
+{
+    const char *name;
+    size_t    (*mk)(char *p, size_t n);
+};
+
+static const struct shape Shapes[] = {
+    { "log",    mk_log    },
+    { "json",   mk_jsons  },
+    { "struct", mk_recs   },
+    { "zeros",  mk_zeros  },
+    { "random", mk_random },
+};
+
+
+
+/*
+ * Round trip 'n' bytes at 'p' at 'level'; returns the compressed
+ * size.
+ */
+static size_t
+roundtrip(const uint8_t *p, size_t n, int level)
+{
+    size_t bound = LZ_BOUND(n);
+    uint8_t *z   = NEWA(uint8_t, bound);
+    uint8_t *u   = NEWA(uint8_t, n + 1);
+    ssize_t zn, un;
+
+    zn = lz_compress(z, bound, p, n, level);
+    assert(zn > 0 && (size_t)zn <= bound);
+
+    un = lz_decompress(u, n, z, zn);
+    assert(un == (ssize_t)n);
+    assert(memcmp(u, p, n) == 0);
+
+    // Output bounds
+    if (n > 0) assert(lz_decompress(u, n - 1, z, zn) == -ENOSPC);
+    if (zn > 1) assert(lz_compress(z, zn - 1, p, n, level) == -ENOSPC);
+
+    DEL(z);
+    DEL(u);
+    return zn;
+}
+
+
+static void
+test_roundtrip(void)
+{
+    static const size_t sizes[] = {
+        0, 1, 5, 12, 13, 17, 100, 1000, 4096, 65535, 65536, 65537, 300000,
+    };
+    char *buf = NEWA(char, 300000);
+    size_t i, j;
+    int lev;
+
+    for (i = 0; i < ARRAY_SIZE(Shapes); i++) {
+        const struct shape *s = &Shapes[i];
+
+        (*s->mk)(buf, 300000);
+        for (lev = 0; lev <= LZ_MAXLEVEL; lev++) {
+            for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+                size_t zn = roundtrip((uint8_t *)buf, sizes[j], lev);
+
+                if (sizes[j] == 300000 && s->mk == mk_zeros) assert(zn < 2000);
+                if (sizes[j] == 300000 && s->mk == mk_log)   assert(zn < 150000);
+            }
+        }
+    }
+
+    // Levels out of range are clamped
+    roundtrip((uint8_t *)buf, 1000, -1);
+    roundtrip((uint8_t *)buf, 1000, 100);
+
+    // Short periods and overlapping matches
+    for (i = 1; i <= 20; i++) {
+        for (j = 0; j < 5000; j++) buf[j] = (char)('a' + j % i);
+        roundtrip((uint8_t *)buf, 5000, LZ_FAST);
+        roundtrip((uint8_t *)buf, 5000, LZ_HC);
+    }
+
+    DEL(buf);
+    printf("  round trips: OK\n");
+}
+
+
+/*
+ * Damaged blocks decode to an error or to something that fits.
+ */
+static void
+test_corrupt(void)
+{
+    size_t n    = 20000;
+    char *p     = NEWA(char, n);
+    uint8_t *z  = NEWA(uint8_t, LZ_BOUND(n));
+    uint8_t *u  = NEWA(uint8_t, n);
+    ssize_t zn, r;
+    int i, bad = 0;
+
+    mk_log(p, n);
+    zn = lz_compress(z, LZ_BOUND(n), p, n, LZ_HC);
+    assert(zn > 0);
+
+    // Truncated
+    for (i = 0; i < zn; i++) {
+        r = lz_decompress(u, n, z, i);
+        assert(r < 0 || r < (ssize_t)n);
+        bad += r < 0;
+    }
+    assert(bad > zn / 2);
+
+    // Flipped bytes
+    for (i = 0; i < 20000; i++) {
+        size_t k  = rnd() % zn;
+        uint8_t c = z[k];
+
+        z[k] ^= (uint8_t)(1 + rnd() % 255);
+        r = lz_decompress(u, n, z, zn);
+        assert(r < 0 || r <= (ssize_t)n);
+        z[k] = c;
+    }
+
+    // An offset of 0 and one before the start
+    {
+        static const uint8_t z0[] = { 0x10, 'a', 0, 0, 0x50, 'a', 'b', 'c', 'd', 'e' };
+        static const uint8_t z1[] = { 0x10, 'a', 2, 0, 0x50, 'a', 'b', 'c', 'd', 'e' };
+
+        assert(lz_decompress(u, n, z0, sizeof z0) == -EINVAL);
+        assert(lz_decompress(u, n, z1, sizeof z1) == -EINVAL);
+        assert(lz_decompress(u, n, z1, 0) == -EINVAL);
+    }
+
+    DEL(p);
+    DEL(z);
+    DEL(u);
+    printf("  corrupt blocks: OK\n");
+}
+
+
+
+/*
+ * Small values compress better with a dictionary of similar ones.
+ */
+static void
+test_dict(void)
+{
+    char dbuf[16384], v[512];
+    uint8_t z[LZ_BOUND(512)], u[512];
+    size_t dn = 0, plain = 0, withd = 0, tot = 0, nodict = 0;
+    lz_dict *d;
+    int i, lev;
+
+    while (dn + 512 < sizeof dbuf) dn += mk_json(dbuf + dn, sizeof dbuf - dn);
+    assert(lz_dict_new(&d, dbuf, dn) == 0);
+
+    for (i = 0; i < NVALS; i++) {
+        size_t n = mk_json(v, sizeof v);
+
+        for (lev = LZ_FAST; lev <= LZ_HC; lev += LZ_HC - LZ_FAST) {
+            ssize_t zn = lz_compress_dict(z, sizeof z, v, n, d, lev);
+
+            assert(zn > 0);
+            assert(lz_decompress_dict(u, sizeof u, z, zn, d) == (ssize_t)n);
+            assert(memcmp(u, v, n) == 0);
+
+            // Refers to the dictionary
+            nodict += lz_decompress(u, sizeof u, z, zn) < 0;
+
+            if (lev == LZ_FAST) {
+                withd += zn;
+                plain += lz_compress(z, sizeof z, v, n, lev);
+                tot   += n;
+            }
+        }
+    }
+    lz_dict_delete(d);
+
+    printf("  dict: %d values, %zu bytes => %zu plain, %zu with a %zu byte dict\n",
+            NVALS, tot, plain, withd, dn);
+    assert(withd * 3 < plain * 2);
+    assert(nodict > NVALS);
+}
+
+
+
+/*
+ * Frames
+ */
+struct sink
+{
+    uint8_t *buf;
+    size_t   len;
+    size_t   cap;
+};
+
+static int
+sink_write(void *ctx, const void *buf, size_t n)
+{
+    struct sink *s = ctx;
+
+    if (s->len + n > s->cap) {
+        s->cap = 2 * (s->len + n);
+        s->buf = realloc(s->buf, s->cap);
+        assert(s->buf);
+    }
+    memcpy(s->buf + s->len, buf, n);
+    s->len += n;
+    return 0;
+}
+
+
+// Feed 'n' bytes to 'fp' in random pieces
+static int
+feed(int (*fp)(lz_stream *, const void *, size_t), lz_stream *s,
+     const uint8_t *p, size_t n)
+{
+    size_t off = 0;
+    int r;
+
+    while (off < n) {
+        size_t k = rnd() % 3 ? rnd() % 100 : rnd() % 300000;
+
+        if (k > n - off) k = n - off;
+        if ((r = (*fp)(s, p + off, k)) < 0) return r;
+        off += k;
+    }
+    return 0;
+}
+
+
+static void
+frame(struct sink *z, const lz_opt *o, const uint8_t *p, size_t n)
+{
+    lz_stream *s;
+
+    memset(z, 0, sizeof *z);
+    assert(lz_stream_compress_new(&s, o, sink_write, z) == 0);
+    assert(feed(lz_stream_compress, s, p, n) == 0);
+    assert(lz_stream_compress_end(s) == 0);
+    lz_stream_delete(s);
+}
+
+
+// Decode frame 'z'; returns the error
+static int
+unframe(struct sink *u, const uint8_t *z, size_t zn)
+{
+    lz_stream *s;
+    int r;
+
+    memset(u, 0, sizeof *u);
+    assert(lz_stream_decompress_new(&s, sink_write, u) == 0);
+    r = feed(lz_stream_decompress, s, z, zn);
+    if (r == 0) r = lz_stream_decompress_end(s);
+    lz_stream_delete(s);
+    return r;
+}
+
+
+static void
+test_stream(const uint8_t *p, size_t n)
+{
+    static const uint32_t flags[] = {
+        0, LZ_CONTENT_CSUM, LZ_BLOCK_CSUM | LZ_CONTENT_CSUM, LZ_LINKED,
+        LZ_LINKED | LZ_BLOCK_CSUM | LZ_CONTENT_CSUM,
+    };
+    lz_opt o = { 0, 0, 0 };
+    struct sink z, u;
+    size_t i, sz[2];
+    int lev;
+
+    lz_stream *s;
+
+    o.blocksize = 1000;
+    assert(lz_stream_compress_new(&s, &o, sink_write, &z) == -EINVAL);
+    o.blocksize = 8 << 20;
+    assert(lz_stream_compress_new(&s, &o, sink_write, &z) == -EINVAL);
+
+    for (lev = LZ_FAST; lev <= LZ_HC; lev += LZ_HC - LZ_FAST) {
+        for (i = 0; i < ARRAY_SIZE(flags); i++) {
+            o.level     = lev;
+            o.blocksize = BLKSIZE;
+            o.flags     = flags[i];
+
+            frame(&z, &o, p, n);
+            assert(unframe(&u, z.buf, z.len) == 0);
+            assert(u.len == n && memcmp(u.buf, p, n) == 0);
+
+            if (i == 0) sz[0] = z.len;
+            if (flags[i] == LZ_LINKED) sz[1] = z.len;
+            DEL(z.buf);
+            DEL(u.buf);
+        }
+        printf("  frame level %d: %zu bytes => %zu, %zu linked\n", lev, n, sz[0], sz[1]);
+        assert(sz[1] <= sz[0]);
+    }
+
+    // Defaults; empty
+    frame(&z, 0, p, n);
+    assert(unframe(&u, z.buf, z.len) == 0 && u.len == n);
+    DEL(z.buf);
+    DEL(u.buf);
+
+    frame(&z, 0, p, 0);
+    assert(z.len == 8 + 4 + 4);
+    assert(unframe(&u, z.buf, z.len) == 0 && u.len == 0);
+
+    // Damage: header checksum, version, truncation, trailing data
+    z.buf[6]++;
+    assert(unframe(&u, z.buf, z.len) == -EBADMSG);
+    z.buf[6]--;
+    DEL(u.buf);
+
+    assert(unframe(&u, z.buf, z.len - 1) == -EINVAL);
+    DEL(u.buf);
+
+    z.buf = realloc(z.buf, z.len + 1);
+    assert(unframe(&u, z.buf, z.len + 1) == -EINVAL);
+    DEL(u.buf);
+    DEL(z.buf);
+
+    // A damaged block: block checksum; content checksum (a stored
+    // block, so that it decodes)
+    o.level = LZ_FAST; o.blocksize = BLKSIZE; o.flags = LZ_BLOCK_CSUM;
+    frame(&z, &o, p, n);
+    z.buf[8 + 4 + 100] ^= 1;
+    assert(unframe(&u, z.buf, z.len) == -EBADMSG);
+    DEL(z.buf);
+    DEL(u.buf);
+
+    {
+        uint8_t *r = NEWA(uint8_t, 3 * BLKSIZE);
+
+        mk_random((char *)r, 3 * BLKSIZE);
+        o.flags = LZ_CONTENT_CSUM;
+        frame(&z, &o, r, 3 * BLKSIZE);
+        assert(z.buf[8 + 3] & 0x80);
+        z.buf[8 + 4 + 100] ^= 1;
+        assert(unframe(&u, z.buf, z.len) == -EBADMSG);
+        assert(u.len == 3 * BLKSIZE);
+        DEL(z.buf);
+        DEL(u.buf);
+        DEL(r);
+    }
+
+    printf("  frames: OK\n");
+}
+
+
+
+/*
+ * Benchmarks: blocks of BLKSIZE bytes with lz and with zbuf's
+ * (raw) deflate streams.
+ */
+struct codec
+{
+    const char *name;
+    int         lev;
+    int         zlib;
+};
+
+static const struct codec Codecs[] = {
+    { "lz-fast", LZ_FAST, 0 },
+    { "lz-hc",   LZ_HC,   0 },
+    { "zbuf-1",  1,       1 },
+    { "zbuf-6",  6,       1 },
+};
+
+
+// Compress 'n' bytes into blocks; fills 'zlen' with each block's size
+static size_t
+blk_compress(const struct codec *c, z_stream_pool *pool, uint8_t *z,
+             const uint8_t *p, size_t n, size_t *zlen)
+{
+    size_t off, tot = 0, i = 0;
+
+    for (off = 0; off < n; off += BLKSIZE, i++) {
+        size_t k = n - off < BLKSIZE ? n - off : BLKSIZE;
+        uint8_t *d = z + i * LZ_BOUND(BLKSIZE);
+
+        if (c->zlib) {
+            z_stream *zs = z_stream_pool_deflate(pool, c->lev, -15);
+
+            zs->next_in   = (Bytef *)(p + off);
+            zs->avail_in  = k;
+            zs->next_out  = d;
+            zs->avail_out = LZ_BOUND(BLKSIZE);
+            assert(deflate(zs, Z_FINISH) == Z_STREAM_END);
+            zlen[i] = zs->total_out;
+            z_stream_pool_put(pool, zs);
+        } else {
+            ssize_t r = lz_compress(d, LZ_BOUND(BLKSIZE), p + off, k, c->lev);
+
+            assert(r > 0);
+            zlen[i] = r;
+        }
+        tot += zlen[i];
+    }
+    return tot;
+}
+
+
+static void
+blk_decompress(const struct codec *c, z_stream_pool *pool, uint8_t *u,
+               const uint8_t *z, size_t n, const size_t *zlen)
+{
+    size_t off, i = 0;
+
+    for (off = 0; off < n; off += BLKSIZE, i++) {
+        size_t k = n - off < BLKSIZE ? n - off : BLKSIZE;
+        const uint8_t *s = z + i * LZ_BOUND(BLKSIZE);
+
+        if (c->zlib) {
+            z_stream *zs = z_stream_pool_inflate(pool, -15);
+
+            zs->next_in   = (Bytef *)s;
+            zs->avail_in  = zlen[i];
+            zs->next_out  = u + off;
+            zs->avail_out = k;
+            assert(inflate(zs, Z_FINISH) == Z_STREAM_END);
+            z_stream_pool_put(pool, zs);
+        } else {
+            assert(lz_decompress(u + off, k, s, zlen[i]) == (ssize_t)k);
+        }
+    }
+}
+
+
+static void
+perf_test(bench *b, size_t n)
+{
+    size_t nblk     = (n + BLKSIZE - 1) / BLKSIZE;
+    uint8_t *p      = NEWA(uint8_t, n);
+    uint8_t *z      = NEWA(uint8_t, nblk * LZ_BOUND(BLKSIZE));
+    uint8_t *u      = NEWA(uint8_t, n);
+    size_t *zlen    = NEWA(size_t, nblk);
+    z_stream_pool *pool = z_stream_pool_new(4);
+    double ratio[ARRAY_SIZE(Shapes)][ARRAY_SIZE(Codecs)];
+    char name[64];
+    size_t i, j;
+
+    assert(pool);
+    for (i = 0; i < ARRAY_SIZE(Shapes); i++) {
+        (*Shapes[i].mk)((char *)p, n);
+
+        for (j = 0; j < ARRAY_SIZE(Codecs); j++) {
+            const struct codec *c = &Codecs[j];
+            size_t zn = 0;
+
+            snprintf(name, sizeof name, "%s/%s/compress", c->name, Shapes[i].name);
+            bench_begin(b, name, nblk);
+            bench_bytes(b, n);
+            while (bench_next(b)) {
+                bench_start(b);
+                zn = blk_compress(c, pool, z, p, n, zlen);
+                bench_stop(b);
+            }
+            bench_end(b);
+            ratio[i][j] = _d(n) / _d(zn);
+
+            snprintf(name, sizeof name, "%s/%s/decompress", c->name, Shapes[i].name);
+            bench_begin(b, name, nblk);
+            bench_bytes(b, n);
+            while (bench_next(b)) {
+                bench_start(b);
+                blk_decompress(c, pool, u, z, n, zlen);
+                bench_stop(b);
+            }
+            bench_end(b);
+            assert(memcmp(u, p, n) == 0);
+        }
+    }
+
+    printf("\nCompression ratio (%zu KB blocks):\n  %-8s", (size_t)BLKSIZE >> 10, "");
+    for (j = 0; j < ARRAY_SIZE(Codecs); j++) printf(" %9s", Codecs[j].name);
+    printf("\n");
+    for (i = 0; i < ARRAY_SIZE(Shapes); i++) {
+        printf("  %-8s", Shapes[i].name);
+        for (j = 0; j < ARRAY_SIZE(Codecs); j++) printf(" %9.2f", ratio[i][j]);
+        printf("\n");
+    }
+    printf("\n");
+
+    z_stream_pool_delete(pool);
+    DEL(p);
+    DEL(z);
+    DEL(u);
+    DEL(zlen);
+}
+
+
+// Small values, one at a time: plain and with a dictionary
+static void
+perf_values(bench *b)
+{
+    char *v        = NEWA(char, NVALS * 512);
+    size_t *vlen   = NEWA(size_t, NVALS);
+    uint8_t *z     = NEWA(uint8_t, NVALS * LZ_BOUND(512));
+    size_t *zlen   = NEWA(size_t, NVALS);
+    char dbuf[16384], u[512];
+    size_t dn = 0, tot = 0, zn = 0;
+    lz_dict *d = 0;
+    int i, k;
+
+    while (dn + 512 < sizeof dbuf) dn += mk_json(dbuf + dn, sizeof dbuf - dn);
+    assert(lz_dict_new(&d, dbuf, dn) == 0);
+    for (i = 0; i < NVALS; i++) tot += vlen[i] = mk_json(v + i * 512, 512);
+
+    for (k = 0; k < 2; k++) {
+        const lz_dict *dd = k ? d : 0;
+
+        bench_begin(b, k ? "value/dict/compress" : "value/compress", NVALS);
+        bench_bytes(b, tot);
+        while (bench_next(b)) {
+            bench_start(b);
+            for (zn = 0, i = 0; i < NVALS; i++) {
+                uint8_t *o = z + i * LZ_BOUND(512);
+
+                zlen[i] = dd ? lz_compress_dict(o, LZ_BOUND(512), v + i * 512, vlen[i], dd, LZ_FAST)
+                             : lz_compress(o, LZ_BOUND(512), v + i * 512, vlen[i], LZ_FAST);
+                zn += zlen[i];
+            }
+            bench_stop(b);
+        }
+        bench_end(b);
+
+        bench_begin(b, k ? "value/dict/decompress" : "value/decompress", NVALS);
+        bench_bytes(b, tot);
+        while (bench_next(b)) {
+            bench_start(b);
+            for (i = 0; i < NVALS; i++) {
+                const uint8_t *s = z + i * LZ_BOUND(512);
+                ssize_t r = dd ? lz_decompress_dict(u, sizeof u, s, zlen[i], dd)
+                               : lz_decompress(u, sizeof u, s, zlen[i]);
+
+                assert(r == (ssize_t)vlen[i]);
+            }
+            bench_stop(b);
+        }
+        bench_end(b);
+
+        printf("values %s: %zu bytes => %zu (ratio %.2f)\n", k ? "with dict" : "plain",
+                tot, zn, _d(tot) / _d(zn));
+    }
+
+    lz_dict_delete(d);
+    DEL(v);
+    DEL(vlen);
+    DEL(z);
+    DEL(zlen);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    size_t n = (size_t)SIZE_MB << 20;
+    uint8_t *p;
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) n = strtoul(argv[1], 0, 0) << 20;
+    if (n < (1 << 20)) n = 1 << 20;
+
+    test_roundtrip();
+    test_corrupt();
+    test_dict();
+
+    p = NEWA(uint8_t, n);
+    mk_log((char *)p, n);
+    test_stream(p, n);
+    DEL(p);
+
+    if ((e = bench_init(&b, "t_lz", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    perf_test(&b, n);
+    perf_values(&b);
+    bench_fini(&b);
+    return 0;
+}
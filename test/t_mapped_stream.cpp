@@ -0,0 +1,246 @@
+/*
+ * Test and benchmark for the sliding window mapped_stream.
+ *
+ * Usage: t_mapped_stream [FILE_MB [WINDOW_KB [FILE]]]
+ *
+ * Writes a file of variable length text records, parses it line by
+ * line through mapped_stream (records straddle window boundaries)
+ * and checks the result against read(2). Then compares scan rate
+ * and peak RSS with mapping the whole file.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/mmap.h"
+#include "utils/mapped_stream.h"
+
+using namespace std;
+using namespace putils;
+
+#define _d(x)   ((double)(x))
+
+
+struct result
+{
+    uint64_t lines;
+    uint64_t sum;
+
+    result() : lines(0), sum(0) { }
+
+    bool operator==(const result& r) const { return lines == r.lines && sum == r.sum; }
+};
+
+
+/* Accumulate one line */
+static inline void
+line(result& r, const uint8_t* p, size_t n)
+{
+    uint64_t h = n;
+    size_t i;
+
+    for (i = 0; i < n; i++) h = (h * 31) + p[i];
+    r.sum += h;
+    r.lines++;
+}
+
+
+/*
+ * Lines of 1 .. 'maxlen' chars; one in 1000 lines is 'big' bytes
+ * long to exercise records larger than a window.
+ */
+static void
+mkfile(const char* fn, size_t size, size_t big)
+{
+    FILE* fp = fopen(fn, "w");
+    uint64_t x = 0x9e3779b97f4a7c15;
+    size_t done = 0;
+
+    if (!fp) error(1, errno, "can't create %s", fn);
+
+    while (done < size) {
+        size_t n, i;
+
+        x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+        n = ((x % 1000) == 7) ? big : 1 + (x % 200);
+        for (i = 0; i < n; i++) fputc('a' + ((x >> (i % 40)) % 26), fp);
+        fputc('\n', fp);
+        done += n + 1;
+    }
+    fclose(fp);
+}
+
+
+/* Reference: read(2) in small chunks */
+static result
+refparse(const char* fn)
+{
+    vector<uint8_t> buf(65536);
+    string cur;
+    result r;
+    ssize_t n;
+    int fd = ::open(fn, O_RDONLY);
+
+    if (fd < 0) error(1, errno, "can't open %s", fn);
+    while ((n = ::read(fd, &buf[0], buf.size())) > 0) {
+        ssize_t i;
+
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                line(r, (const uint8_t*)cur.data(), cur.size());
+                cur.clear();
+            } else {
+                cur += char(buf[i]);
+            }
+        }
+    }
+    ::close(fd);
+    return r;
+}
+
+
+static result
+streamparse(const char* fn, size_t window, unsigned int flags)
+{
+    mapped_stream ms(fn, window, flags);
+    result r;
+    size_t used;
+
+    do {
+        const uint8_t* p   = ms.data();
+        const uint8_t* end = p + ms.size();
+        const uint8_t* nl;
+
+        /* Only whole lines; the partial one starts the next window */
+        while (p < end && (nl = (const uint8_t*)memchr(p, '\n', end - p))) {
+            line(r, p, nl - p);
+            p = nl + 1;
+        }
+        used = p - ms.data();
+    } while (ms.advance(used));
+
+    return r;
+}
+
+
+static void
+dropcache(const char* fn)
+{
+    int fd = ::open(fn, O_RDONLY);
+
+    if (fd < 0) return;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+
+static result
+wholeparse(const char* fn)
+{
+    mmap_file mm(fn, MMAP_RDONLY | MMAP_SEQUENTIAL);
+    const uint8_t* p   = (const uint8_t*)mm.mmap();
+    const uint8_t* end = p + mm.filesize();
+    const uint8_t* nl;
+    result r;
+
+    while (p < end && (nl = (const uint8_t*)memchr(p, '\n', end - p))) {
+        line(r, p, nl - p);
+        p = nl + 1;
+    }
+    return r;
+}
+
+
+static long
+maxrss_kb()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    char tmpl[] = "/tmp/t_mstream_XXXXXX";
+    size_t mb   = 64;
+    size_t wkb  = 256;
+    const char* fn;
+    result ref, r;
+    uint64_t t0, t1;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    mb = 1024;
+#endif
+
+    if (argc > 1) mb  = strtoul(argv[1], 0, 0);
+    if (argc > 2) wkb = strtoul(argv[2], 0, 0);
+    if (argc > 3) {
+        fn = argv[3];
+    } else {
+        int fd = mkstemp(tmpl);
+
+        if (fd < 0) error(1, errno, "can't make temp file");
+        ::close(fd);
+        fn = tmpl;
+    }
+
+    size_t wsz = wkb * 1024;
+
+    mkfile(fn, mb * 1024 * 1024, 3 * wsz);
+    ref = refparse(fn);
+
+    /* Small windows with every flag combination */
+    for (unsigned int fl = 0; fl < 4; fl++) {
+        r = streamparse(fn, 4096, fl);
+        if (!(r == ref)) error(1, 0, "flags %#x, 4k windows: mismatch", fl);
+
+        r = streamparse(fn, wsz, fl);
+        if (!(r == ref)) error(1, 0, "flags %#x, %zuk windows: mismatch", fl, wkb);
+    }
+    printf("%zu MB, %" PRIu64 " lines: OK\n", mb, ref.lines);
+
+    /*
+     * Benchmarks; the sliding window goes first so that its peak RSS
+     * isn't masked by the whole file mapping.
+     */
+    dropcache(fn);
+    t0 = timenow();
+    r  = streamparse(fn, wsz, MSTREAM_PREFETCH|MSTREAM_DROP);
+    t1 = timenow();
+    assert(r == ref);
+    printf("  sliding %4zuk window: %8.2f MB/s, peak RSS %6ld KB\n", wkb,
+            _d(mb * 1024 * 1024) / _d(t1 - t0), maxrss_kb());
+
+    dropcache(fn);
+    t0 = timenow();
+    r  = wholeparse(fn);
+    t1 = timenow();
+    assert(r == ref);
+    printf("  whole file mapping:   %8.2f MB/s, peak RSS %6ld KB\n",
+            _d(mb * 1024 * 1024) / _d(t1 - t0), maxrss_kb());
+
+    if (argc <= 3) ::unlink(fn);
+    return 0;
+}
+
+/* EOF */
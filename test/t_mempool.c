@@ -29,6 +29,8 @@
 #include "utils/mempool.h"
 #include "error.h"
 #include "fast/vect.h"
+#include "utils/utils.h"
+#include "bench.h"
 
 
 struct obj
@@ -49,75 +51,88 @@ VECT_TYPEDEF(ptr_vect, void*);
 #define N       (65535 * 16)
 
 
-#define now()   sys_cpu_timestamp()
-
 extern uint32_t arc4random(void);
 
 
-static void
-perf_test(int run)
+/*
+ * Allocate N objects into 'pv' and shuffle them.
+ */
+static struct mempool*
+fill(ptr_vect* pv, bench* b)
 {
     struct mempool* pool;
-    ptr_vect        pv;
+    int i;
 
     if (0 != mempool_new(&pool, 0, sizeof(obj2), N, 0))
         error(1, 0, "Can't initialize mempool of size %zu [%d objs]", sizeof(obj2), N);
 
+    VECT_RESET(pv);
 
-    VECT_INIT(&pv, N);
-
-    uint64_t cy_a = 0,
-             cy_f = 0,
-             tm_a = 0,
-             tm_f = 0;
-
-    void * p;
-    int i;
+    if (b) bench_start(b);
     for (i = 0; i < N; ++i) {
-        uint64_t t0 = timenow(),
-                 c0 = sys_cpu_timestamp();
+        void * p;
 
-        p = mempool_alloc(pool);
+        if (b) BENCH_OP(b, p = mempool_alloc(pool));
+        else   p = mempool_alloc(pool);
 
-        cy_a += (sys_cpu_timestamp() - c0);
-        tm_a += (timenow() - t0);
-
-        VECT_APPEND(&pv, p);
+        VECT_APPEND(pv, p);
     }
+    if (b) bench_stop(b);
 
     // Now, randomize the elements
-    VECT_SHUFFLE(&pv, arc4random);
+    VECT_SHUFFLE(pv, arc4random);
+    return pool;
+}
 
 
-    void** x;
-    VECT_FOR_EACH(&pv, x) {
-        uint64_t t0 = timenow(),
-                 c0 = sys_cpu_timestamp();
+static void
+perf_test(bench* b)
+{
+    struct mempool* pool;
+    ptr_vect        pv;
+    void**          x;
 
-        mempool_free(pool, *x);
+    VECT_INIT(&pv, N);
 
-        cy_f  += (sys_cpu_timestamp() - c0);
-        tm_f  += (timenow() - t0);
+    bench_begin(b, "alloc", N);
+    while (bench_next(b)) {
+        pool = fill(&pv, b);
+        mempool_delete(pool);
     }
+    bench_end(b);
 
-#define _ops_per_sec(a) (((double)N) / (double)(a))
-#define _us_per_op(a)   ((double)(a) / (double)N)
+    bench_begin(b, "free", N);
+    while (bench_next(b)) {
+        pool = fill(&pv, 0);
 
-    printf("%2d: %6.2f M allocs/sec (%6.4f cyc/alloc)  %6.2f M free/sec (%6.4f cyc/free)\n",
-            run, _ops_per_sec(tm_a), _us_per_op(cy_a)
-               , _ops_per_sec(tm_f), _us_per_op(cy_f));
+        bench_start(b);
+        VECT_FOR_EACH(&pv, x) {
+            BENCH_OP(b, mempool_free(pool, *x));
+        }
+        bench_stop(b);
 
-    mempool_delete(pool);
+        mempool_delete(pool);
+    }
+    bench_end(b);
 
+    VECT_FINI(&pv);
 }
 
 
 int
-main()
+main(int argc, char** argv)
 {
-    int i;
-    for(i = 0; i < 16; ++i)
-        perf_test(i);
+    bench b;
+    int e;
+
+    USEARG(argc);
+    program_name = argv[0];
+
+    if ((e = bench_init(&b, "t_mempool", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    perf_test(&b);
+    bench_fini(&b);
 
     return 0;
 }
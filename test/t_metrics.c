@@ -0,0 +1,455 @@
+/*
+ * Test and benchmark for the metrics registry.
+ *
+ * Usage: t_metrics [NTHREADS [NOPS]]
+ *
+ * Checks histogram bucketing and quantiles, concurrent counters
+ * and gauges, registry lookups, text and binary exports taken while
+ * recorders run, and the job_manager, mempool and queue hooks.
+ * Then compares the cost of a sharded counter with a shared atomic
+ * and a mutex protected counter.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/metrics.h"
+#include "utils/mempool.h"
+#include "posix/job.h"
+#include "fast/encdec.h"
+
+#define _d(x)   ((double)(x))
+
+
+static void
+test_buckets(void)
+{
+    uint64_t v;
+    unsigned i;
+
+    for (i = 0; i + 1 < METRICS_HIST_BUCKETS; i++) {
+        uint64_t lo = metrics_hist_bucket_lo(i);
+        uint64_t hi = metrics_hist_bucket_lo(i + 1) - 1;
+
+        assert(metrics_hist_index(lo) == i);
+        assert(metrics_hist_index(hi) == i);
+
+        /* width relative to the value is at most 2^-BITS */
+        if (lo >= METRICS_HIST_SUB) assert((hi - lo + 1) * METRICS_HIST_SUB <= lo);
+    }
+    assert(metrics_hist_index(~0ULL) == METRICS_HIST_BUCKETS - 1);
+
+    for (v = 1; v < (1ULL << 62); v = v * 3 + 1) {
+        i = metrics_hist_index(v);
+        assert(metrics_hist_bucket_lo(i) <= v);
+        assert(v < metrics_hist_bucket_lo(i + 1));
+    }
+}
+
+
+static void
+test_quantiles(metrics_registry* r)
+{
+    metrics_hist* h = metrics_hist_get(r, "latency_us", "op=get");
+    metrics_hist_snap* s = NEW(metrics_hist_snap);
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t n = 1000000, v;
+    size_t i;
+
+    assert(h);
+
+    metrics_hist_snapshot(h, s);
+    assert(s->count == 0 && s->min == 0 && metrics_hist_quantile(s, 0.5) == 0);
+
+    for (v = 1; v <= n; v++) metrics_hist_record(h, v);
+
+    metrics_hist_snapshot(h, s);
+    assert(s->count == n);
+    assert(s->sum == n * (n + 1) / 2);
+    assert(s->min == 1 && s->max == n);
+
+    for (i = 0; i < ARRAY_SIZE(qs); i++) {
+        double want = qs[i] * _d(n);
+        double got  = _d(metrics_hist_quantile(s, qs[i]));
+
+        if (got < want || got > want * (1.0 + 1.0 / METRICS_HIST_SUB))
+            error(1, 0, "q %.3f: got %.0f, want %.0f", qs[i], got, want);
+    }
+    DEL(s);
+}
+
+
+struct worker
+{
+    pthread_t        id;
+    metrics_counter* c;
+    metrics_gauge*   g;
+    metrics_hist*    h;
+    uint64_t         nops;
+};
+
+
+static void*
+recorder(void* p)
+{
+    struct worker* w = p;
+    uint64_t i;
+
+    for (i = 0; i < w->nops; i++) {
+        metrics_counter_inc(w->c);
+        metrics_gauge_add(w->g, (i & 1) ? -1 : 1);
+        if ((i & 63) == 0) metrics_hist_record(w->h, i);
+    }
+    return 0;
+}
+
+
+static int
+count_writer(void* ctx, const void* buf, size_t n)
+{
+    USEARG(buf);
+    *(size_t*)ctx += n;
+    return 0;
+}
+
+
+/*
+ * Counters and gauges from several threads with exports running
+ * alongside.
+ */
+static void
+test_concurrent(metrics_registry* r, int nthr, uint64_t nops)
+{
+    struct worker w[nthr];
+    metrics_counter* c = metrics_counter_get(r, "ops", "test=concurrent");
+    metrics_gauge*   g = metrics_gauge_get(r, "level", "test=concurrent");
+    metrics_hist*    h = metrics_hist_get(r, "sample", "test=concurrent");
+    size_t bytes = 0;
+    int i, exports = 0;
+
+    for (i = 0; i < nthr; i++) {
+        w[i].c = c;
+        w[i].g = g;
+        w[i].h = h;
+        w[i].nops = nops;
+        pthread_create(&w[i].id, 0, recorder, &w[i]);
+    }
+
+    /* Export while the recorders run; they don't wait for us */
+    while (metrics_counter_read(c) < (uint64_t)nthr * nops) {
+        int e = metrics_export(r, (exports & 1) ? METRICS_BINARY : METRICS_TEXT,
+                               count_writer, &bytes);
+
+        assert(e == 0);
+        exports++;
+    }
+
+    for (i = 0; i < nthr; i++) pthread_join(w[i].id, 0);
+
+    assert(metrics_counter_read(c) == (uint64_t)nthr * nops);
+    assert(metrics_gauge_read(g) == 0);
+    printf("  %d threads x %llu ops OK; %d exports (%zu bytes) meanwhile\n",
+            nthr, (unsigned long long)nops, exports, bytes);
+}
+
+
+static void
+test_registry(metrics_registry* r)
+{
+    metrics_counter* a = metrics_counter_get(r, "reqs", "host=a");
+    metrics_counter* b = metrics_counter_get(r, "reqs", "host=b");
+    metrics_counter* n = metrics_counter_get(r, "reqs", 0);
+    size_t k = metrics_count(r);
+
+    assert(a && b && n && a != b && a != n);
+    assert(a == metrics_counter_get(r, "reqs", "host=a"));
+    assert(n == metrics_counter_get(r, "reqs", ""));
+    assert(0 == metrics_gauge_get(r, "reqs", "host=a"));   // type mismatch
+    assert(metrics_count(r) == k);
+
+    metrics_counter_add(a, 40);
+    metrics_counter_inc(a);
+    assert(metrics_counter_read(a) == 41);
+    assert(metrics_counter_read(b) == 0);
+
+    metrics_gauge_set(metrics_gauge_get(r, "temp", 0), -12);
+}
+
+
+/* Growable buffer for exports */
+struct obuf
+{
+    uint8_t* p;
+    size_t   n;
+    size_t   sz;
+};
+
+static int
+buf_writer(void* ctx, const void* buf, size_t n)
+{
+    struct obuf* b = ctx;
+
+    if (b->n + n + 1 > b->sz) {
+        b->sz = (b->n + n + 1) * 2;
+        b->p  = RENEWA(uint8_t, b->p, b->sz);
+    }
+    memcpy(b->p + b->n, buf, n);
+    b->n += n;
+    b->p[b->n] = 0;
+    return 0;
+}
+
+
+static void
+test_text(metrics_registry* r)
+{
+    struct obuf b = { 0, 0, 0 };
+
+    assert(metrics_export(r, METRICS_TEXT, buf_writer, &b) == 0);
+
+    if (!strstr((char*)b.p, "\nreqs{host=a} 41\n"))                error(1, 0, "text: no counter");
+    if (!strstr((char*)b.p, "\ntemp -12\n"))                       error(1, 0, "text: no gauge");
+    if (!strstr((char*)b.p, "latency_us_count{op=get} 1000000\n")) error(1, 0, "text: no hist count");
+    if (!strstr((char*)b.p, "latency_us{op=get,quantile=0.99} "))  error(1, 0, "text: no quantile");
+    DEL(b.p);
+}
+
+
+static const uint8_t*
+dec_str(const uint8_t* p, char* s, size_t sz)
+{
+    size_t n = dec_LE_u16(p);
+
+    assert(n < sz);
+    memcpy(s, p + 2, n);
+    s[n] = 0;
+    return p + 2 + n;
+}
+
+
+static void
+test_binary(metrics_registry* r)
+{
+    struct obuf b = { 0, 0, 0 };
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t i, n;
+    int seen = 0;
+
+    assert(metrics_export(r, METRICS_BINARY, buf_writer, &b) == 0);
+
+    p   = b.p;
+    end = b.p + b.n;
+    assert(0 == memcmp(p, "MTRC", 4) && dec_LE_u32(p + 4) == 1);
+    n = dec_LE_u32(p + 16);
+    assert(n == metrics_count(r));
+    p += 20;
+
+    for (i = 0; i < n; i++) {
+        char name[256], labels[256];
+        int type = *p++;
+
+        p = dec_str(p, name, sizeof name);
+        p = dec_str(p, labels, sizeof labels);
+
+        if (type == METRICS_HIST) {
+            uint64_t count = dec_LE_u64(p), tot = 0;
+            unsigned k, nb = dec_LE_u16(p + 32);
+
+            p += 34;
+            for (k = 0; k < nb; k++, p += 10) tot += dec_LE_u64(p + 2);
+            assert(tot == count);
+            if (0 == strcmp(name, "latency_us")) {
+                assert(count == 1000000);
+                seen++;
+            }
+        } else {
+            uint64_t v = dec_LE_u64(p);
+
+            p += 8;
+            if (0 == strcmp(name, "reqs") && 0 == strcmp(labels, "host=a")) {
+                assert(type == METRICS_COUNTER && v == 41);
+                seen++;
+            }
+            if (0 == strcmp(name, "temp")) {
+                assert(type == METRICS_GAUGE && (int64_t)v == -12);
+                seen++;
+            }
+        }
+    }
+    assert(p == end && seen == 3);
+    DEL(b.p);
+}
+
+
+static int
+job(void* ctx, void* j, int thr)
+{
+    USEARG(ctx);
+    USEARG(thr);
+
+    return ((uintptr_t)j % 10) == 0 ? -1 : 0;
+}
+
+
+static void
+test_hooks(metrics_registry* r)
+{
+    metrics_hist_snap* s = NEW(metrics_hist_snap);
+    job_manager jm;
+    struct mempool* mp;
+    void* v[100];
+    uintptr_t i;
+    int nthr;
+
+    nthr = job_manager_init(&jm, 2, job, 0);
+    assert(nthr == 2);
+    assert(job_manager_metrics(&jm, r, "pool=test") == 0);
+
+    for (i = 1; i <= 1000; i++) job_manager_submit_job(&jm, (void*)i);
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+
+    assert(metrics_counter_read(metrics_counter_get(r, "job_completed", "pool=test")) == 1000);
+    assert(metrics_counter_read(metrics_counter_get(r, "job_errors", "pool=test")) == 100);
+    assert(metrics_gauge_read(metrics_gauge_get(r, "job_busy", "pool=test")) == 0);
+
+    /* One extra per thread: the end of work markers */
+    assert(metrics_counter_read(metrics_counter_get(r, "jobq_enq", "pool=test")) == 1000 + 2);
+    assert(metrics_counter_read(metrics_counter_get(r, "jobq_deq", "pool=test")) == 1000 + 2);
+
+    metrics_hist_snapshot(metrics_hist_get(r, "job_run_us", "pool=test"), s);
+    assert(s->count == 1000);
+
+    assert(mempool_new(&mp, 0, 64, 0, 16) == 0);
+    assert(mempool_metrics(mp, r, "pool=objs") == 0);
+    for (i = 0; i < ARRAY_SIZE(v); i++) v[i] = mempool_alloc(mp);
+    for (i = 0; i < 40; i++) mempool_free(mp, v[i]);
+
+    assert(metrics_counter_read(metrics_counter_get(r, "mempool_alloc", "pool=objs")) == 100);
+    assert(metrics_counter_read(metrics_counter_get(r, "mempool_free", "pool=objs")) == 40);
+    assert(metrics_gauge_read(metrics_gauge_get(r, "mempool_inuse", "pool=objs")) == 60);
+    assert(metrics_counter_read(metrics_counter_get(r, "mempool_chunks", "pool=objs")) > 0);
+    mempool_delete(mp);
+
+    DEL(s);
+}
+
+
+/*
+ * Benchmarks
+ */
+struct bench
+{
+    pthread_t        id;
+    int              kind;
+    uint64_t         nops;
+    metrics_counter* c;
+    metrics_hist*    h;
+};
+
+static uint64_t         Shared;
+static pthread_mutex_t  Lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t         Locked;
+
+static void*
+bench_thread(void* p)
+{
+    struct bench* b = p;
+    uint64_t i;
+
+    switch (b->kind) {
+        case 0:
+            for (i = 0; i < b->nops; i++) metrics_counter_inc(b->c);
+            break;
+        case 1:
+            for (i = 0; i < b->nops; i++) __atomic_fetch_add(&Shared, 1, __ATOMIC_RELAXED);
+            break;
+        case 2:
+            for (i = 0; i < b->nops; i++) {
+                pthread_mutex_lock(&Lock);
+                Locked++;
+                pthread_mutex_unlock(&Lock);
+            }
+            break;
+        case 3:
+            for (i = 0; i < b->nops; i++) metrics_hist_record(b->h, i);
+            break;
+    }
+    return 0;
+}
+
+
+static void
+bench(metrics_registry* r, int nthr, uint64_t nops)
+{
+    static const char* names[] = { "sharded counter", "shared atomic", "mutex counter", "histogram" };
+    struct bench b[nthr];
+    int k, i;
+
+    printf("\n%d threads, %llu ops each:\n", nthr, (unsigned long long)nops);
+    for (k = 0; k < 4; k++) {
+        uint64_t t0 = timenow();
+
+        for (i = 0; i < nthr; i++) {
+            b[i].kind = k;
+            b[i].nops = nops;
+            b[i].c    = metrics_counter_get(r, "bench", 0);
+            b[i].h    = metrics_hist_get(r, "bench_hist", 0);
+            pthread_create(&b[i].id, 0, bench_thread, &b[i]);
+        }
+        for (i = 0; i < nthr; i++) pthread_join(b[i].id, 0);
+
+        uint64_t t1 = timenow();
+        printf("  %-16s %6.2f ns/op\n", names[k], _d(t1 - t0) * 1000.0 / _d(nops * nthr));
+    }
+    assert(metrics_counter_read(metrics_counter_get(r, "bench", 0)) == (uint64_t)nthr * nops);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    metrics_registry* r;
+    int nthr      = sys_cpu_getavail();
+    uint64_t nops = 1000000;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    nops = 10000000;
+#endif
+
+    if (nthr < 4) nthr = 4;
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (argc > 2) nops = strtoull(argv[2], 0, 0);
+
+    r = metrics_registry_new();
+    assert(r);
+
+    test_buckets();
+    test_quantiles(r);
+    test_registry(r);
+    test_text(r);
+    test_binary(r);
+    test_concurrent(r, nthr, nops);
+    test_hooks(r);
+    assert(metrics_default() && metrics_default() == metrics_default());
+    printf("metrics OK\n");
+
+    bench(r, nthr, nops);
+
+    metrics_registry_delete(r);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,198 @@
+/*
+ * Test and benchmark for windowed mmap_file access.
+ *
+ * Usage: t_mmap [FILE_MB [WINDOW_KB [FILE]]]
+ *
+ * Maps a file as thousands of small windows and times map + unmap
+ * in random order (the registry cost); a window mapped again with
+ * other options is a mapping of its own. Then times sequential
+ * scans of the windows with the different mapping options.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/mmap.h"
+
+using namespace std;
+using namespace putils;
+
+#define _d(x)   ((double)(x))
+
+
+static void
+mkfile(const char* fn, size_t size)
+{
+    vector<uint8_t> buf(1024 * 1024);
+    size_t i;
+    int fd = ::open(fn, O_CREAT|O_TRUNC|O_WRONLY, 0600);
+
+    if (fd < 0) error(1, errno, "can't create %s", fn);
+
+    for (i = 0; i < buf.size(); i++) buf[i] = uint8_t(i * 31);
+    for (i = 0; i < size; i += buf.size()) {
+        if (::write(fd, &buf[0], buf.size()) != ssize_t(buf.size()))
+            error(1, errno, "can't write %s", fn);
+    }
+    ::close(fd);
+}
+
+
+static void
+dropcache(const char* fn)
+{
+    int fd = ::open(fn, O_RDONLY);
+
+    if (fd < 0) return;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+
+/*
+ * Map every window, then unmap them in random order. Each window
+ * is also looked up again while all of them are mapped.
+ */
+static void
+registry(const char* fn, size_t nwin, size_t wsz)
+{
+    mmap_file mm(fn, MMAP_RDONLY);
+    vector<void*> ptrs(nwin);
+    vector<size_t> order(nwin);
+    uint64_t t0, t1, t2, t3, tl;
+    size_t i;
+
+    t0 = timenow();
+    for (i = 0; i < nwin; i++) ptrs[i] = mm.mmap(off_t(i * wsz), wsz);
+    t1 = timenow();
+
+    for (i = 0; i < nwin; i++) {
+        void* p = mm.mmap(off_t(i * wsz), wsz);
+        if (p != ptrs[i]) error(1, 0, "window %zu: lookup mismatch", i);
+        order[i] = i;
+    }
+    t2 = timenow();
+    tl = t2 - t1;
+
+    assert(mm.nmappings() == nwin);
+
+    // Other options are another mapping; the same ones are found
+    void* q = mm.mmap(0, wsz, MMAP_RANDOM);
+    assert(q != ptrs[0]);
+    assert(mm.mmap(0, wsz, MMAP_RANDOM) == q);
+    assert(mm.mmap(0, wsz, 0, -1) == ptrs[0]);
+    assert(mm.nmappings() == nwin + 1);
+    mm.unmap(q);
+    assert(mm.mmap(0, wsz) == ptrs[0]);
+
+    for (i = nwin - 1; i > 0; i--) swap(order[i], order[rand() % (i + 1)]);
+
+    t2 = timenow();
+    for (i = 0; i < nwin; i++) mm.unmap(ptrs[order[i]]);
+    t3 = timenow();
+
+    assert(mm.nmappings() == 0);
+
+    printf("Registry, %zu windows of %zu KB:\n", nwin, wsz / 1024);
+    printf("  map:    %8.3f us/window\n", _d(t1 - t0) / _d(nwin));
+    printf("  lookup: %8.3f us/window\n", _d(tl) / _d(nwin));
+    printf("  unmap:  %8.3f us/window\n", _d(t3 - t2) / _d(nwin));
+}
+
+
+/*
+ * Scan the file one window at a time with options 'opts'; if
+ * 'pf' prefetch the next window while scanning this one.
+ */
+static uint64_t
+scan(const char* fn, size_t nwin, size_t wsz, unsigned int opts, int pf,
+     const char* name, uint64_t exp)
+{
+    mmap_file mm(fn, MMAP_RDONLY | opts);
+    uint64_t t0, t1, sum = 0;
+    size_t i, j;
+
+    dropcache(fn);
+
+    t0 = timenow();
+    for (i = 0; i < nwin; i++) {
+        const uint64_t* p = (const uint64_t*)mm.mmap(off_t(i * wsz), wsz);
+
+        if (pf && (i + 1) < nwin) mm.prefetch(off_t((i + 1) * wsz), wsz);
+
+        for (j = 0; j < wsz / sizeof *p; j++) sum += p[j];
+        mm.unmap((void*)p);
+    }
+    t1 = timenow();
+
+    if (exp && sum != exp) error(1, 0, "%s: checksum mismatch", name);
+
+    printf("  %-22s %8.3f s, %8.2f MB/s\n", name, _d(t1 - t0) / 1.0e6,
+            _d(nwin * wsz) / _d(t1 - t0));
+    return sum;
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    char tmpl[] = "/tmp/t_mmap_XXXXXX";
+    size_t mb   = 64;
+    size_t wkb  = 64;
+    const char* fn;
+    uint64_t sum;
+
+    program_name = argv[0];
+
+#ifdef __MAKE_OPTIMIZE__
+    mb = 1024;
+#endif
+
+    if (argc > 1) mb  = strtoul(argv[1], 0, 0);
+    if (argc > 2) wkb = strtoul(argv[2], 0, 0);
+    if (argc > 3) {
+        fn = argv[3];
+    } else {
+        int fd = mkstemp(tmpl);
+
+        if (fd < 0) error(1, errno, "can't make temp file");
+        ::close(fd);
+        fn = tmpl;
+    }
+
+    size_t wsz  = wkb * 1024;
+    size_t nwin = (mb * 1024 * 1024) / wsz;
+
+    if (wsz % mmap_file::pagesize()) error(1, 0, "window must be a multiple of the page size");
+
+    mkfile(fn, nwin * wsz);
+
+    registry(fn, nwin, wsz);
+
+    printf("\nWindowed scan, %zu MB in %zu KB windows:\n", mb, wkb);
+    sum = scan(fn, nwin, wsz, 0,               0, "default", 0);
+    scan(fn, nwin, wsz, MMAP_SEQUENTIAL,       0, "sequential", sum);
+    scan(fn, nwin, wsz, MMAP_WILLNEED,         0, "willneed", sum);
+    scan(fn, nwin, wsz, MMAP_POPULATE,         0, "populate", sum);
+    scan(fn, nwin, wsz, MMAP_SEQUENTIAL,       1, "sequential+prefetch", sum);
+    scan(fn, nwin, wsz, MMAP_POPULATE|MMAP_HUGEPAGE, 0, "populate+hugepage", sum);
+
+    if (argc <= 3) ::unlink(fn);
+    return 0;
+}
+
+/* EOF */
@@ -19,12 +19,17 @@
  *   it was pulled off and records the tuple (timestamp, delta) in a
  *   per-thread array
  *
- * - when all consumers have ended, the arrays are collated, sorted
- *   by timestamp and dumped to stdout.
+ * - when all consumers have ended, the arrays are collated and
+ *   reported as latency percentiles along with enq/deq costs (see
+ *   bench.h). If a LATFILE is given, the latencies sorted by
+ *   timestamp are dumped there for latplot.py.
+ *
+ * Usage: t_mpmcq [NPRODUCERS [NCONSUMERS [LATFILE]]]
  */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
 #include <assert.h>
 #include <pthread.h>
 #include <inttypes.h>
@@ -36,6 +41,7 @@
 #include "fast/mpmc_bounded_queue.h"
 #include "fast/vect.h"
 #include "error.h"
+#include "bench.h"
 #include <semaphore.h>
 
 
@@ -72,6 +78,9 @@ uint32_t             pad1[__mpmc_padz(4)];
 atomic_uint_fast32_t Start;     // Used to tell all threads to "go"
 uint32_t             pad2[__mpmc_padz(4)];
 
+bench                Bench;     // Perf test results
+FILE*                Latfp;     // Raw latencies for latplot.py
+
 
 
 // Per-Thread context
@@ -328,6 +337,7 @@ perf_finisher(ctx** pp, int np, ctx** cc, int nc)
         delctx(cx);
     }
     printf("#    P Total %zd elem, %5.2f cy/enq\n", tot, _d(cyc) / _d(tot));
+    bench_add(&Bench, "enq", tot, bench_ns(&Bench, cyc), 0, 0);
 
     latv    all;
     VECT_INIT(&all, tot);
@@ -345,16 +355,25 @@ perf_finisher(ctx** pp, int np, ctx** cc, int nc)
         delctx(cx);
     }
 
-    printf("#    C Total %zd elem, %5.2f cy/enq\n", tot, _d(cyc) / _d(tot));
+    printf("#    C Total %zd elem, %5.2f cy/deq\n", tot, _d(cyc) / _d(tot));
+    bench_add(&Bench, "deq", tot, bench_ns(&Bench, cyc), 0, 0);
 
     assert(tot == VECT_SIZE(&all));
     VECT_SORT(&all, ts_cmp);
 
+    u64v ns;
+    uint64_t sum = 0;
     lat* v;
+
+    VECT_INIT(&ns, tot);
     VECT_FOR_EACH(&all, v) {
-        printf("%" PRIu64 "\n", v->v);
+        if (Latfp) fprintf(Latfp, "%" PRIu64 "\n", v->v);
+        VECT_APPEND(&ns, v->v * 1000);
+        sum += v->v * 1000;
     }
+    bench_add(&Bench, "latency", tot, _d(sum), &VECT_ELEM(&ns, 0), VECT_SIZE(&ns));
 
+    VECT_FINI(&ns);
     VECT_FINI(&all);
 }
 
@@ -685,7 +704,8 @@ main(int argc, char** argv)
     int ncpu = sys_cpu_getavail(),
         half = ncpu >> 1;
     int p = 0,
-        c = 0;
+        c = 0,
+        e;
 
 
     if (half == 0)
@@ -714,6 +734,12 @@ main(int argc, char** argv)
     if (p == 0)
         p = half;
 
+    if (argc > 3 && !(Latfp = fopen(argv[3], "w")))
+        error(1, errno, "Can't create %s", argv[3]);
+
+    if ((e = bench_init(&Bench, "t_mpmcq", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
     basic_test();
     basic_dyn_test();
 
@@ -733,6 +759,9 @@ main(int argc, char** argv)
     mt_test(&vrfy, p, c);
     mt_test(&perf, p, c);
 
+    bench_fini(&Bench);
+    if (Latfp) fclose(Latfp);
+
     return 0;
 }
 
@@ -0,0 +1,234 @@
+/*
+ * Test for hardware counter profiling of code regions.
+ *
+ * Usage: t_perfprof [NTHREADS [NCALLS]]
+ *
+ * Runs regions on several threads and checks the per-thread and
+ * aggregated call counts (and, where the PMU is available, that
+ * instructions were counted); then prints the report and the cost
+ * of an empty region.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#define PERFPROF 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "posix/perfprof.h"
+
+#define _d(x)   ((double)(x))
+
+static volatile uint64_t Sink;
+
+
+static uint64_t
+work(int n)
+{
+    uint64_t x = 0x9e3779b97f4a7c15;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    }
+    return x;
+}
+
+
+struct worker
+{
+    pthread_t id;
+    int       idx;
+    int       ncalls;
+};
+
+
+static void*
+worker(void* p)
+{
+    struct worker* w = p;
+    char name[32];
+    int i;
+
+    snprintf(name, sizeof name, "worker-%d", w->idx);
+    perfprof_thread_init(name);
+
+    for (i = 0; i < w->ncalls; i++) {
+        PERFPROF_BEGIN(a, "work_1000");
+        Sink += work(1000);
+        PERFPROF_END(a);
+
+        if (i & 1) {
+            PERFPROF_BEGIN(b, "work_10");
+            Sink += work(10);
+            PERFPROF_END(b);
+        }
+    }
+    return 0;
+}
+
+
+struct tally
+{
+    int      nthr;
+    uint64_t calls[2];
+    uint64_t ins;
+    unsigned avail;
+};
+
+static int
+count(void* ctx, const perfprof_stats* st)
+{
+    struct tally* t = ctx;
+    int k = 0 == strcmp(st->region, "work_1000") ? 0 : 1;
+
+    if (strncmp(st->region, "work_", 5) != 0) return 0;
+
+    t->calls[k] += st->calls;
+    if (k == 0) {
+        t->nthr++;
+        t->ins   = st->v[PERFPROF_INSTRUCTIONS];
+        t->avail = st->avail;
+    }
+    return 0;
+}
+
+
+static int
+stop_early(void* ctx, const perfprof_stats* st)
+{
+    USEARG(st);
+    return ++*(int*)ctx == 1 ? 7 : 0;
+}
+
+
+static void
+test_threads(int nthr, int ncalls)
+{
+    struct worker w[nthr];
+    struct tally t;
+    int i, n = 0;
+
+    for (i = 0; i < nthr; i++) {
+        w[i].idx    = i;
+        w[i].ncalls = ncalls;
+        pthread_create(&w[i].id, 0, worker, &w[i]);
+    }
+    for (i = 0; i < nthr; i++) pthread_join(w[i].id, 0);
+
+    /* Per thread: each thread has both regions */
+    memset(&t, 0, sizeof t);
+    perfprof_walk(1, count, &t);
+    assert(t.nthr == nthr);
+    assert(t.calls[0] == (uint64_t)nthr * ncalls);
+    assert(t.calls[1] == (uint64_t)nthr * (ncalls / 2));
+
+    /* Aggregated: one line per region */
+    memset(&t, 0, sizeof t);
+    perfprof_walk(0, count, &t);
+    assert(t.nthr == 1);
+    assert(t.calls[0] == (uint64_t)nthr * ncalls);
+    assert(t.calls[1] == (uint64_t)nthr * (ncalls / 2));
+
+    /* 1000 rounds of 6 ops each */
+    if (t.avail & (1 << PERFPROF_INSTRUCTIONS))
+        assert(t.ins >= (uint64_t)nthr * ncalls * 6000);
+
+    assert(perfprof_walk(0, stop_early, &n) == 7 && n == 1);
+
+    printf("\nper region:\n");
+    perfprof_report(stdout, 0);
+    printf("\nper thread:\n");
+    perfprof_report(stdout, 1);
+
+    /* The workers have exited; a reset drops them */
+    perfprof_reset();
+    memset(&t, 0, sizeof t);
+    perfprof_walk(1, count, &t);
+    assert(t.nthr == 0 && t.calls[0] == 0);
+}
+
+
+static void
+test_regions(void)
+{
+    int a = perfprof_region("alpha");
+    int b = perfprof_region("beta");
+    perfprof_sample s0, s1;
+    perfprof_scope s;
+
+    assert(a >= 0 && b >= 0 && a != b);
+    assert(a == perfprof_region("alpha"));
+
+    perfprof_read(&s0);
+    Sink += work(100000);
+    perfprof_read(&s1);
+    assert(s1.tsc > s0.tsc);
+    if (perfprof_avail() & (1 << PERFPROF_INSTRUCTIONS))
+        assert(s1.v[PERFPROF_INSTRUCTIONS] - s0.v[PERFPROF_INSTRUCTIONS] >= 600000);
+
+    /* Out of range regions are ignored */
+    perfprof_begin(&s, -ENOSPC);
+    perfprof_end(&s);
+}
+
+
+static double
+empty_region(uint64_t n)
+{
+    int r = perfprof_region("empty");
+    uint64_t i, t0, t1;
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) {
+        perfprof_scope s;
+
+        perfprof_begin(&s, r);
+        perfprof_end(&s);
+    }
+    t1 = timenow();
+    return _d(t1 - t0) * 1000.0 / _d(n);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    int nthr   = 4;
+    int ncalls = 2000;
+    unsigned avail;
+    uint64_t n = 1000000;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr   = atoi(argv[1]);
+    if (argc > 2) ncalls = atoi(argv[2]);
+
+    avail = perfprof_thread_init("main");
+    printf("counters: %s%s%s%s%s; %s reads; %.3f ns/tick\n",
+            avail ? "" : "none",
+            avail & (1 << PERFPROF_INSTRUCTIONS)  ? "instructions " : "",
+            avail & (1 << PERFPROF_CYCLES)        ? "cycles " : "",
+            avail & (1 << PERFPROF_LLC_MISSES)    ? "llc-misses " : "",
+            avail & (1 << PERFPROF_BRANCH_MISSES) ? "branch-misses" : "",
+            perfprof_rdpmc() ? "rdpmc" : (avail ? "read(2)" : "no"),
+            perfprof_ns_per_tick());
+
+    test_regions();
+    test_threads(nthr, ncalls);
+
+    printf("\nempty region: %.1f ns\n", empty_region(n));
+    perfprof_thread_fini();
+    assert(perfprof_avail() == 0);
+    printf("empty region, no counters: %.1f ns\n", empty_region(n));
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,336 @@
+/*
+ * Test and benchmark for the parallel directory walker.
+ *
+ * Usage: t_pwalk [NFILES [DIR]]
+ *
+ * Generates a tree of roughly NFILES files under DIR (default: a
+ * temp dir), checks the walker against a simple recursive walk and
+ * prints walk rates for 1, 2, 4 .. NCPU threads.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "fast/vect.h"
+#include "posix/pwalk.h"
+
+#define _d(x)   ((double)(x))
+
+/* Files per leaf directory and directories per level */
+#define NFILES_DIR  64
+#define FANOUT      16
+
+
+VECT_TYPEDEF(strv, char*);
+
+
+static void
+strv_free(strv* v)
+{
+    char** s;
+
+    VECT_FOR_EACH(v, s) { DEL(*s); }
+    VECT_FINI(v);
+}
+
+
+/*
+ * Make a tree with 'nfiles' files: FANOUT sub-dirs per level until
+ * the leaves can hold NFILES_DIR files each.
+ */
+static size_t
+mktree(const char* dir, size_t nfiles, size_t* ndirs)
+{
+    char path[PATH_MAX];
+    size_t made = 0;
+    size_t i;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) error(1, errno, "can't mkdir %s", dir);
+    *ndirs += 1;
+
+    if (nfiles <= NFILES_DIR) {
+        for (i = 0; i < nfiles; i++) {
+            int fd;
+
+            snprintf(path, sizeof path, "%s/f%zu", dir, i);
+            if ((fd = open(path, O_CREAT|O_WRONLY, 0600)) < 0) error(1, errno, "can't create %s", path);
+            close(fd);
+        }
+        return nfiles;
+    }
+
+    for (i = 0; i < FANOUT; i++) {
+        size_t n = nfiles / FANOUT + (i < (nfiles % FANOUT) ? 1 : 0);
+
+        snprintf(path, sizeof path, "%s/d%zu", dir, i);
+        made += mktree(path, n, ndirs);
+    }
+    return made;
+}
+
+
+static void
+rmtree(const char* dir)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    DIR* d = opendir(dir);
+
+    if (!d) return;
+    while ((de = readdir(d))) {
+        if (0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, "..")) continue;
+
+        snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+        if (de->d_type == DT_DIR) rmtree(path);
+        else                      unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+
+static int
+cmpstr(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/*
+ * Reference: sorted pre-order walk on one thread.
+ */
+static void
+refwalk(const char* dir, strv* out)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    strv names;
+    char** s;
+    DIR* d = opendir(dir);
+
+    if (!d) error(1, errno, "can't open %s", dir);
+
+    VECT_INIT(&names, 64);
+    while ((de = readdir(d))) {
+        if (0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, "..")) continue;
+        VECT_PUSH_BACK(&names, strdup(de->d_name));
+    }
+    closedir(d);
+
+    qsort(names.array, VECT_SIZE(&names), sizeof(char*), cmpstr);
+    VECT_FOR_EACH(&names, s) {
+        struct stat st;
+
+        snprintf(path, sizeof path, "%s/%s", dir, *s);
+        VECT_PUSH_BACK(out, strdup(path));
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) refwalk(path, out);
+    }
+    strv_free(&names);
+}
+
+
+struct counts
+{
+    atomic_long files;
+    atomic_long dirs;
+    atomic_long bytes;
+};
+typedef struct counts counts;
+
+
+static int
+count_fn(void* ctx, const pwalk_ent* e, int thr)
+{
+    counts* c = (counts*)ctx;
+
+    USEARG(thr);
+    if (e->err) return 0;
+    if (e->type == DT_DIR) atomic_fetch_add(&c->dirs, 1);
+    else                   atomic_fetch_add(&c->files, 1);
+
+    atomic_fetch_add(&c->bytes, strlen(e->name));
+    return 0;
+}
+
+
+static int
+collect_fn(void* ctx, const pwalk_ent* e, int thr)
+{
+    strv* v = (strv*)ctx;
+
+    USEARG(thr);
+    if (e->depth > 0) VECT_PUSH_BACK(v, strdup(e->path));
+    return 0;
+}
+
+
+/* Prune every directory named "d1" */
+static int
+prune_fn(void* ctx, const pwalk_ent* e, int thr)
+{
+    counts* c = (counts*)ctx;
+
+    count_fn(ctx, e, thr);
+    USEARG(c);
+    return (e->type == DT_DIR && 0 == strcmp(e->name, "d1")) ? PWALK_SKIP : 0;
+}
+
+
+static int
+abort_fn(void* ctx, const pwalk_ent* e, int thr)
+{
+    counts* c = (counts*)ctx;
+
+    USEARG(e);
+    USEARG(thr);
+    return atomic_fetch_add(&c->files, 1) >= 100 ? -42 : 0;
+}
+
+
+static void
+check(const char* root, size_t nfiles, size_t ndirs, int nthr)
+{
+    counts c;
+    strv ref, got;
+    char link[PATH_MAX];
+    long pruned = 0;
+    size_t i;
+    int r;
+
+    atomic_init(&c.files, 0);
+    atomic_init(&c.dirs, 0);
+    atomic_init(&c.bytes, 0);
+
+    r = pwalk(root, nthr, PWALK_SIZE, count_fn, &c);
+    if (r != 0) error(1, -r, "pwalk %s failed", root);
+    if ((size_t)c.files != nfiles || (size_t)c.dirs != ndirs)
+        error(1, 0, "%d threads: exp %zu files %zu dirs, saw %ld, %ld",
+                nthr, nfiles, ndirs, (long)c.files, (long)c.dirs);
+
+    /* Ordered delivery must match the sorted reference walk */
+    VECT_INIT(&ref, 1024);
+    VECT_INIT(&got, 1024);
+    refwalk(root, &ref);
+    r = pwalk(root, nthr, PWALK_ORDERED|PWALK_TYPE, collect_fn, &got);
+    assert(r == 0);
+
+    if (VECT_SIZE(&ref) != VECT_SIZE(&got))
+        error(1, 0, "%d threads: ordered: exp %zu entries, saw %zu",
+                nthr, VECT_SIZE(&ref), VECT_SIZE(&got));
+
+    for (i = 0; i < VECT_SIZE(&ref); i++) {
+        if (0 != strcmp(VECT_ELEM(&ref, i), VECT_ELEM(&got, i)))
+            error(1, 0, "%d threads: ordered: entry %zu: exp %s, saw %s",
+                    nthr, i, VECT_ELEM(&ref, i), VECT_ELEM(&got, i));
+    }
+    strv_free(&ref);
+    strv_free(&got);
+
+    /* Pruning and aborting in both modes; both prune the same */
+    for (i = 0; i < 2; i++) {
+        unsigned fl = i ? PWALK_ORDERED : 0;
+
+        atomic_store(&c.files, 0);
+        atomic_store(&c.dirs, 0);
+        r = pwalk(root, nthr, fl, prune_fn, &c);
+        assert(r == 0);
+        if (nfiles > NFILES_DIR) assert((size_t)c.files < nfiles);
+        if (i == 0) pruned = c.files;
+        else        assert(c.files == pruned);
+
+        atomic_store(&c.files, 0);
+        r = pwalk(root, nthr, fl, abort_fn, &c);
+        if (nfiles + ndirs > 101) assert(r == -42);
+    }
+
+    /* A symlink to the root is walked as the root */
+    snprintf(link, sizeof link, "%s.lnk", root);
+    unlink(link);
+    if (symlink(root, link) < 0) error(1, errno, "can't symlink %s", link);
+
+    for (i = 0; i < 2; i++) {
+        atomic_store(&c.files, 0);
+        atomic_store(&c.dirs, 0);
+        r = pwalk(link, nthr, i ? PWALK_ORDERED : 0, count_fn, &c);
+        if (r != 0) error(1, -r, "pwalk %s failed", link);
+        assert((size_t)c.files == nfiles && (size_t)c.dirs == ndirs);
+    }
+    unlink(link);
+
+    printf("%d threads: %zu files, %zu dirs: OK\n", nthr, nfiles, ndirs);
+}
+
+
+static void
+bench(const char* root, size_t nfiles, unsigned flags, const char* name)
+{
+    int ncpu = sys_cpu_getavail();
+    int t;
+
+    printf("\n%s walk of %zu files:\n", name, nfiles);
+    for (t = 1; t <= ncpu; t = (t < ncpu && 2*t > ncpu) ? ncpu : 2*t) {
+        counts c;
+        uint64_t t0, t1;
+
+        atomic_init(&c.files, 0);
+        atomic_init(&c.dirs, 0);
+        atomic_init(&c.bytes, 0);
+
+        t0 = timenow();
+        pwalk(root, t, flags, count_fn, &c);
+        t1 = timenow();
+
+        printf("  %2d threads: %8.3f s, %10.2f k entries/s\n", t,
+                _d(t1 - t0) / 1.0e6, _d(c.files + c.dirs) * 1.0e3 / _d(t1 - t0));
+    }
+}
+
+
+int
+main(int argc, char* argv[])
+{
+    char tmpl[] = "/tmp/t_pwalk_XXXXXX";
+    size_t nfiles = 20000;
+    size_t ndirs  = 0;
+    char* root;
+    int keep = 0;
+
+    program_name = argv[0];
+
+    if (argc > 1) nfiles = strtoul(argv[1], 0, 0);
+    if (argc > 2) {
+        root = argv[2];
+        keep = 1;
+    } else {
+        if (!(root = mkdtemp(tmpl))) error(1, errno, "can't make temp dir");
+        rmdir(root);
+    }
+
+    nfiles = mktree(root, nfiles, &ndirs);
+
+    check(root, nfiles, ndirs, 1);
+    check(root, nfiles, ndirs, 4);
+    check(root, nfiles, ndirs, 0);
+
+    bench(root, nfiles, PWALK_TYPE, "Unordered, type only");
+    bench(root, nfiles, PWALK_STAT, "Unordered, full stat");
+    bench(root, nfiles, PWALK_ORDERED|PWALK_TYPE, "Ordered");
+
+    if (!keep) rmtree(root);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,536 @@
+/*
+ * Test for the interface and host resolution cache.
+ *
+ * Usage: t_resolve_cache [NTHREADS]
+ *
+ * Checks that cached lookups of all interfaces, interface names,
+ * literals and hostnames give what the uncached calls give; that
+ * the oldest hostnames make room once the cache is full; that
+ * asynchronous lookups complete on the cache's threads; that readers
+ * on NTHREADS threads see whole snapshots while the interface table
+ * is rebuilt under them; and (if it may add an address to lo) that
+ * the netlink watcher picks up address changes. Then benchmarks
+ * calls/sec with and without the cache.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/resolve.h"
+#include "bench.h"
+
+#ifdef __MAKE_OPTIMIZE__
+#define NREFRESH    2000
+#define NASYNC      20000
+#else
+#define NREFRESH    200
+#define NASYNC      2000
+#endif
+
+#define TESTADDR    "127.0.0.77"
+
+
+static void
+ifs_fini(if_address_vect * av)
+{
+    if_address * x;
+
+    VECT_FOR_EACH(av, x) {
+        VECT_FINI(&x->if_addr);
+    }
+    VECT_FINI(av);
+}
+
+
+static int
+same_addrs(const if_addr_vect * a, const if_addr_vect * b)
+{
+    size_t i;
+
+    if (VECT_SIZE(a) != VECT_SIZE(b)) return 0;
+    for (i = 0; i < VECT_SIZE(a); i++) {
+        if (memcmp(&VECT_ELEM(a, i).sa, &VECT_ELEM(b, i).sa, sizeof(struct sockaddr_storage)))
+            return 0;
+    }
+    return 1;
+}
+
+
+static int
+has_addr(const if_addr_vect * v, const char * ip)
+{
+    struct in_addr a;
+    const if_addr * x;
+
+    inet_aton(ip, &a);
+    VECT_FOR_EACH(v, x) {
+        const struct sockaddr_in * s = (const struct sockaddr_in *)&x->sa;
+
+        if (s->sin_family == AF_INET && s->sin_addr.s_addr == a.s_addr) return 1;
+    }
+    return 0;
+}
+
+
+static void
+test_ifs(resolve_cache * c)
+{
+    static const unsigned masks[] = {
+        0, F_INET, F_INET6, F_LINK, F_INET|F_INET6|F_LINK,
+    };
+    if_address_vect a, b;
+    size_t i, j;
+
+    for (i = 0; i < ARRAY_SIZE(masks); i++) {
+        VECT_INIT(&a, 8);
+        VECT_INIT(&b, 8);
+        assert(get_all_if_address(&a, masks[i]) == 0);
+        assert(resolve_cache_if_address(c, &b, masks[i]) == 0);
+
+        assert(VECT_SIZE(&a) == VECT_SIZE(&b));
+        for (j = 0; j < VECT_SIZE(&a); j++) {
+            assert(0 == strcmp(VECT_ELEM(&a, j).if_name, VECT_ELEM(&b, j).if_name));
+            assert(same_addrs(&VECT_ELEM(&a, j).if_addr, &VECT_ELEM(&b, j).if_addr));
+        }
+        ifs_fini(&a);
+        ifs_fini(&b);
+    }
+    printf("  interfaces: OK\n");
+}
+
+
+static void
+test_names(resolve_cache * c, unsigned ttl)
+{
+    static const char * names[] = { "lo", "127.0.0.1", "*", "", "localhost" };
+    resolve_cache_stats s0, s1;
+    if_addr_vect a, b;
+    size_t i;
+    int r;
+
+    VECT_INIT(&a, 8);
+    VECT_INIT(&b, 8);
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        if ((r = resolve_host_or_ifname(names[i], &a, 0)) < 0) {
+            printf("  %s: can't resolve (%s); skipped\n", names[i], strerror(-r));
+            continue;
+        }
+
+        assert(resolve_cache_lookup(c, names[i], &b, 0) == 0);
+        assert(same_addrs(&a, &b));
+
+        // Again: from the cache
+        resolve_cache_stats_get(c, &s0);
+        assert(resolve_cache_lookup(c, names[i], &b, 0) == 0);
+        assert(same_addrs(&a, &b));
+        resolve_cache_stats_get(c, &s1);
+        if (i == 0 || (i == 4 && ttl))
+            assert(s1.hits == s0.hits + 1 && s1.misses == s0.misses);
+        else if (i == 4)
+            assert(s1.misses == s0.misses + 1);
+    }
+
+    // Failures aren't cached
+    resolve_cache_stats_get(c, &s0);
+    assert(resolve_cache_lookup(c, "no-such-host.invalid", &b, 0) < 0);
+    assert(resolve_cache_lookup(c, "no-such-host.invalid", &b, 0) < 0);
+    resolve_cache_stats_get(c, &s1);
+    assert(s1.misses == s0.misses + 2);
+
+    VECT_FINI(&a);
+    VECT_FINI(&b);
+    printf("  names: OK\n");
+}
+
+
+
+// The oldest hostnames make room for new ones
+static void
+test_maxhosts(resolve_cache * c)
+{
+    resolve_cache_stats s0, s1;
+    if_addr_vect a;
+    char nm[32];
+    int i, n = RESOLVE_MAXHOSTS + 16;
+
+    VECT_INIT(&a, 8);
+
+    // IPv6 literals aren't short-cut; each is a hostname
+    if (resolve_cache_lookup(c, "::1", &a, 0) < 0) {
+        printf("  maxhosts: can't resolve ::1; skipped\n");
+        VECT_FINI(&a);
+        return;
+    }
+
+    for (i = 2; i <= n; i++) {
+        snprintf(nm, sizeof nm, "::%x", i);
+        assert(resolve_cache_lookup(c, nm, &a, 0) == 0);
+        assert(VECT_SIZE(&a) == 1);
+    }
+
+    resolve_cache_stats_get(c, &s0);
+    assert(s0.hosts == RESOLVE_MAXHOSTS);
+
+    assert(resolve_cache_lookup(c, nm, &a, 0) == 0);
+    resolve_cache_stats_get(c, &s1);
+    assert(s1.hits == s0.hits + 1);
+
+    assert(resolve_cache_lookup(c, "::1", &a, 0) == 0);
+    resolve_cache_stats_get(c, &s1);
+    assert(s1.misses == s0.misses + 1);
+    assert(s1.hosts == RESOLVE_MAXHOSTS);
+
+    VECT_FINI(&a);
+    printf("  maxhosts: OK\n");
+}
+
+
+/*
+ * Asynchronous lookups
+ */
+struct async
+{
+    sem_t        done;
+    if_addr_vect want;
+    uint64_t     ok;
+    uint64_t     bad;
+};
+
+static void
+async_done(void * arg, int err, if_addr_vect * av)
+{
+    struct async * a = arg;
+
+    if (err == 0 && same_addrs(av, &a->want))
+        __atomic_add_fetch(&a->ok, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&a->bad, 1, __ATOMIC_RELAXED);
+    sem_post(&a->done);
+}
+
+
+static void
+test_async(resolve_cache * c)
+{
+    struct async a;
+    resolve_cache * c0;
+    int i;
+
+    memset(&a, 0, sizeof a);
+    sem_init(&a.done, 0, 0);
+    VECT_INIT(&a.want, 8);
+    assert(resolve_host_or_ifname("lo", &a.want, 0) == 0);
+
+    for (i = 0; i < NASYNC; i++)
+        assert(resolve_cache_lookup_async(c, "lo", 0, async_done, &a) == 0);
+    for (i = 0; i < NASYNC; i++)
+        sem_wait(&a.done);
+
+    assert(a.ok == NASYNC && a.bad == 0);
+
+    assert(resolve_cache_new(&c0, 0, 0, 0) == 0);
+    assert(resolve_cache_lookup_async(c0, "lo", 0, async_done, &a) == -ENOTSUP);
+    resolve_cache_delete(c0);
+
+    VECT_FINI(&a.want);
+    sem_destroy(&a.done);
+    printf("  async: %d lookups OK\n", NASYNC);
+}
+
+
+
+/*
+ * Readers against refreshes: every read sees a whole snapshot.
+ */
+struct reader
+{
+    resolve_cache * c;
+    size_t          nifs;
+    uint64_t        reads;
+};
+
+static volatile int Stop;
+
+static void *
+reader(void * v)
+{
+    struct reader * r = v;
+    if_address_vect av;
+    if_addr_vect lo, want;
+
+    VECT_INIT(&lo, 8);
+    VECT_INIT(&want, 8);
+    assert(resolve_host_or_ifname("lo", &want, 0) == 0);
+
+    while (!Stop) {
+        VECT_INIT(&av, 8);
+        assert(resolve_cache_if_address(r->c, &av, F_INET|F_INET6|F_LINK) == 0);
+        assert(VECT_SIZE(&av) == r->nifs);
+        ifs_fini(&av);
+
+        assert(resolve_cache_lookup(r->c, "lo", &lo, 0) == 0);
+        assert(same_addrs(&lo, &want));
+        r->reads++;
+    }
+    VECT_FINI(&lo);
+    VECT_FINI(&want);
+    return 0;
+}
+
+
+static void
+test_refresh(resolve_cache * c, int nthr)
+{
+    struct reader * rd = NEWZA(struct reader, nthr);
+    pthread_t * t      = NEWZA(pthread_t, nthr);
+    resolve_cache_stats s0, s1;
+    if_address_vect av;
+    uint64_t reads = 0;
+    int i;
+
+    VECT_INIT(&av, 8);
+    assert(get_all_if_address(&av, F_INET|F_INET6|F_LINK) == 0);
+
+    resolve_cache_stats_get(c, &s0);
+    Stop = 0;
+    for (i = 0; i < nthr; i++) {
+        rd[i].c    = c;
+        rd[i].nifs = VECT_SIZE(&av);
+        pthread_create(&t[i], 0, reader, &rd[i]);
+    }
+
+    for (i = 0; i < NREFRESH; i++) assert(resolve_cache_refresh(c) == 0);
+
+    Stop = 1;
+    for (i = 0; i < nthr; i++) {
+        pthread_join(t[i], 0);
+        reads += rd[i].reads;
+    }
+
+    resolve_cache_stats_get(c, &s1);
+    assert(s1.refreshes >= s0.refreshes + NREFRESH);
+    assert(s1.gen >= s0.gen + NREFRESH);
+
+    ifs_fini(&av);
+    DEL(rd);
+    DEL(t);
+    printf("  refresh: %d snapshots under %llu reads on %d threads: OK\n",
+            NREFRESH, (unsigned long long)reads, nthr);
+}
+
+
+
+/*
+ * Netlink: wait up to 2s for 'lo' to have (or not have) TESTADDR.
+ */
+static int
+wait_lo(resolve_cache * c, int want)
+{
+    if_addr_vect v;
+    int i, r = 0;
+
+    VECT_INIT(&v, 8);
+    for (i = 0; i < 200; i++) {
+        assert(resolve_cache_lookup(c, "lo", &v, F_INET) == 0);
+        if ((r = has_addr(&v, TESTADDR)) == want) break;
+        usleep(10000);
+    }
+    VECT_FINI(&v);
+    return r == want;
+}
+
+
+static void
+test_watch(resolve_cache * c)
+{
+    resolve_cache_stats s0, s1;
+
+    resolve_cache_stats_get(c, &s0);
+    if (system("ip addr add " TESTADDR "/8 dev lo 2>/dev/null") != 0) {
+        printf("  watch: can't add an address to lo; skipped\n");
+        return;
+    }
+
+    assert(wait_lo(c, 1));
+    assert(system("ip addr del " TESTADDR "/8 dev lo 2>/dev/null") == 0);
+    assert(wait_lo(c, 0));
+
+    resolve_cache_stats_get(c, &s1);
+    assert(s1.refreshes >= s0.refreshes + 2);
+    printf("  watch: address added and removed: OK\n");
+}
+
+
+
+/*
+ * Benchmarks
+ */
+static void
+bench_ifs(bench * b, resolve_cache * c, int cached)
+{
+    if_address_vect av;
+    const int n = 1000;
+
+    bench_begin(b, cached ? "if_address/cached" : "if_address", n);
+    while (bench_next(b)) {
+        int i;
+
+        bench_start(b);
+        for (i = 0; i < n; i++) {
+            VECT_INIT(&av, 8);
+            if (cached) resolve_cache_if_address(c, &av, 0);
+            else        get_all_if_address(&av, 0);
+            ifs_fini(&av);
+        }
+        bench_stop(b);
+    }
+    bench_end(b);
+}
+
+
+static void
+bench_name(bench * b, resolve_cache * c, const char * name, int cached)
+{
+    if_addr_vect av;
+    char nm[64];
+    const int n = 1000;
+
+    VECT_INIT(&av, 8);
+    if (resolve_host_or_ifname(name, &av, 0) < 0) {
+        VECT_FINI(&av);
+        return;
+    }
+
+    snprintf(nm, sizeof nm, "lookup-%s%s", name, cached ? "/cached" : "");
+    bench_begin(b, nm, n);
+    while (bench_next(b)) {
+        int i;
+
+        bench_start(b);
+        for (i = 0; i < n; i++) {
+            if (cached) resolve_cache_lookup(c, name, &av, 0);
+            else        resolve_host_or_ifname(name, &av, 0);
+        }
+        bench_stop(b);
+    }
+    bench_end(b);
+    VECT_FINI(&av);
+}
+
+
+// Aggregate lookups/sec on 'nthr' threads
+struct breader
+{
+    resolve_cache * c;
+    int             n;
+    pthread_barrier_t * bar;
+};
+
+static void *
+bench_reader(void * v)
+{
+    struct breader * r = v;
+    if_addr_vect av;
+    int i;
+
+    VECT_INIT(&av, 8);
+    pthread_barrier_wait(r->bar);
+    for (i = 0; i < r->n; i++) resolve_cache_lookup(r->c, "lo", &av, 0);
+    VECT_FINI(&av);
+    return 0;
+}
+
+
+static void
+bench_threads(bench * b, resolve_cache * c, int nthr)
+{
+    struct breader * r = NEWZA(struct breader, nthr);
+    pthread_t * t      = NEWZA(pthread_t, nthr);
+    const int n        = 20000;
+    pthread_barrier_t bar;
+    char nm[64];
+    int i;
+
+    snprintf(nm, sizeof nm, "lookup-lo/cached-%dthr", nthr);
+    bench_begin(b, nm, (uint64_t)n * nthr);
+    while (bench_next(b)) {
+        pthread_barrier_init(&bar, 0, nthr + 1);
+        for (i = 0; i < nthr; i++) {
+            r[i].c   = c;
+            r[i].n   = n;
+            r[i].bar = &bar;
+            pthread_create(&t[i], 0, bench_reader, &r[i]);
+        }
+
+        bench_start(b);
+        pthread_barrier_wait(&bar);
+        for (i = 0; i < nthr; i++) pthread_join(t[i], 0);
+        bench_stop(b);
+        pthread_barrier_destroy(&bar);
+    }
+    bench_end(b);
+
+    DEL(r);
+    DEL(t);
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    int nthr = sys_cpu_getavail();
+    resolve_cache * c;
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nthr = atoi(argv[1]);
+    if (nthr < 2) nthr = 2;
+
+    // Without hostnames, then with
+    assert(resolve_cache_new(&c, 0, 0, 0) == 0);
+    test_ifs(c);
+    test_names(c, 0);
+    resolve_cache_delete(c);
+
+    if ((e = resolve_cache_new(&c, 2, 60, RESOLVE_WATCH)) < 0)
+        error(1, -e, "Can't make a resolve cache");
+
+    test_ifs(c);
+    test_names(c, 60);
+    test_maxhosts(c);
+    test_async(c);
+    test_refresh(c, nthr);
+    test_watch(c);
+
+    if ((e = bench_init(&b, "t_resolve_cache", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    bench_ifs(&b, c, 0);
+    bench_ifs(&b, c, 1);
+    bench_name(&b, c, "lo", 0);
+    bench_name(&b, c, "lo", 1);
+    bench_name(&b, c, "localhost", 0);
+    bench_name(&b, c, "localhost", 1);
+    bench_threads(&b, c, 1);
+    bench_threads(&b, c, nthr);
+    bench_fini(&b);
+
+    resolve_cache_delete(c);
+    return 0;
+}
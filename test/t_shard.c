@@ -0,0 +1,427 @@
+/*
+ * Test for the key sharding functions.
+ *
+ * Usage: t_shard [NKEYS [NNODES]]
+ *
+ * Maps NKEYS keys to NNODES nodes with each scheme (and with hash %
+ * N for comparison) and checks the load balance, that weights are
+ * honored and how many keys move when a node is added or removed:
+ * the ring, jump hash and rendezvous hashing must only move keys to
+ * the new node (or off the removed one); Maglev may move a few
+ * more. Checks the ring's binary search against a linear one and
+ * the batch lookups against single ones. Then benchmarks lookups.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/shard.h"
+#include "utils/hashfunc.h"
+#include "bench.h"
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define NKEYS       4000000
+#else
+#define NKEYS       1000000
+#endif
+
+#define VNODES      160
+#define MAGLEV_M    65537
+
+#define MODULO      0
+#define JUMP        1
+#define RING        2
+#define MAGLEV      3
+#define HRW         4
+#define NSCHEMES    5
+
+static const char *Names[] = { "modulo", "jump", "ring", "maglev", "rendezvous" };
+
+static size_t     Nkeys;
+static uint64_t * Keys;
+static uint32_t * Out;
+
+
+/*
+ * Node of every key with scheme 's' for nodes 'ids'; returns the
+ * node ids (not indices) in 'v' so that mappings of different node
+ * sets can be compared.
+ */
+static void
+map_keys(int s, const uint64_t *ids, const uint32_t *wt, uint32_t n, uint64_t *v)
+{
+    double *dw = 0;
+    size_t i;
+    uint32_t j;
+
+    switch (s) {
+        case MODULO:
+            for (i = 0; i < Nkeys; i++) Out[i] = Keys[i] % n;
+            break;
+
+        case JUMP:
+            jump_hash_v(Keys, Out, Nkeys, n);
+            break;
+
+        case RING: {
+            hashring r;
+
+            assert(hashring_init(&r, ids, wt, n, VNODES) == 0);
+            hashring_lookup_v(&r, Keys, Out, Nkeys);
+            hashring_fini(&r);
+            break;
+        }
+
+        case MAGLEV: {
+            maglev g;
+
+            assert(maglev_init(&g, ids, wt, n, MAGLEV_M) == 0);
+            maglev_lookup_v(&g, Keys, Out, Nkeys);
+            maglev_fini(&g);
+            break;
+        }
+
+        case HRW: {
+            hrw h;
+
+            if (wt) {
+                dw = NEWA(double, n);
+                assert(dw);
+                for (j = 0; j < n; j++) dw[j] = wt[j];
+            }
+            assert(hrw_init(&h, ids, dw, n) == 0);
+            hrw_lookup_v(&h, Keys, Out, Nkeys);
+            hrw_fini(&h);
+            DEL(dw);
+            break;
+        }
+    }
+
+    for (i = 0; i < Nkeys; i++) {
+        assert(Out[i] < n);
+        v[i] = ids[Out[i]];
+    }
+}
+
+
+// Largest load over the mean load of 'n' nodes numbered 1..n
+static double
+imbalance(const uint64_t *v, uint32_t n)
+{
+    uint64_t *load = NEWZA(uint64_t, n + 1);
+    uint64_t max = 0;
+    size_t i;
+
+    assert(load);
+    for (i = 0; i < Nkeys; i++) load[v[i]]++;
+    for (i = 1; i <= n; i++) if (load[i] > max) max = load[i];
+
+    DEL(load);
+    return _d(max) / (_d(Nkeys) / _d(n));
+}
+
+
+/*
+ * Add node n+1, then remove node 'gone' (jump hash can only remove
+ * the last one). Count the keys that move and the ones that move
+ * without reason: not to the added node, or not off the removed one.
+ */
+static void
+test_moves(int s, uint32_t n)
+{
+    uint64_t *ids = NEWA(uint64_t, n + 1);
+    uint64_t *a   = NEWA(uint64_t, Nkeys);
+    uint64_t *b   = NEWA(uint64_t, Nkeys);
+    uint64_t gone = (s == JUMP || s == MODULO) ? n : n / 3;
+    size_t i, add = 0, addx = 0, rm = 0, rmx = 0;
+    uint32_t j, k;
+    double imb, noise;
+
+    assert(ids && a && b);
+
+    for (j = 0; j <= n; j++) ids[j] = j + 1;
+
+    map_keys(s, ids, 0, n, a);
+    imb = imbalance(a, n);
+
+    map_keys(s, ids, 0, n + 1, b);
+    for (i = 0; i < Nkeys; i++) {
+        if (a[i] == b[i]) continue;
+        add++;
+        if (b[i] != n + 1) addx++;
+    }
+
+    // n nodes without 'gone'
+    for (k = j = 0; j < n; j++) {
+        if (ids[j] != gone) ids[k++] = ids[j];
+    }
+    map_keys(s, ids, 0, n - 1, b);
+    for (i = 0; i < Nkeys; i++) {
+        if (a[i] == b[i]) continue;
+        rm++;
+        if (a[i] != gone) rmx++;
+    }
+
+    printf("  %-10s %3u nodes: max/mean load %.3f; add moves %6.3f%% (%.3f%% needlessly), "
+           "remove moves %6.3f%% (%.3f%% needlessly)\n", Names[s], n, imb,
+           100.0 * _d(add) / _d(Nkeys), 100.0 * _d(addx) / _d(Nkeys),
+           100.0 * _d(rm)  / _d(Nkeys), 100.0 * _d(rmx)  / _d(Nkeys));
+
+    switch (s) {
+        case MODULO:
+            assert(add > Nkeys / 2);
+            break;
+
+        case JUMP:
+        case RING:
+        case HRW:
+            assert(addx == 0 && rmx == 0);
+            assert(_d(add) < 1.5 * _d(Nkeys) / _d(n + 1));
+            assert(_d(rm)  < 1.5 * _d(Nkeys) / _d(n));
+            break;
+
+        case MAGLEV:
+            assert(_d(add)  < 2.0 * _d(Nkeys) / _d(n + 1));
+            assert(_d(rm)   < 2.0 * _d(Nkeys) / _d(n));
+            assert(_d(addx) < 0.03 * _d(Nkeys));
+            assert(_d(rmx)  < 0.03 * _d(Nkeys));
+            break;
+    }
+
+    // 5 sigma of sampling noise; the ring is further off by its
+    // token spacing
+    noise = 5.0 / sqrt(_d(Nkeys) / _d(n));
+    if (s == JUMP || s == HRW || s == MAGLEV) assert(imb < 1.0 + noise);
+    if (s == RING)                            assert(imb < 1.35 + noise);
+
+    DEL(ids);
+    DEL(a);
+    DEL(b);
+}
+
+
+// Node i has weight 1 + i%4; check its share
+static void
+test_weights(int s, uint32_t n)
+{
+    uint64_t *ids  = NEWA(uint64_t, n);
+    uint32_t *wt   = NEWA(uint32_t, n);
+    uint64_t *v    = NEWA(uint64_t, Nkeys);
+    uint64_t *load = NEWZA(uint64_t, n + 1);
+    double tw = 0.0, maxerr = 0.0;
+    size_t i;
+    uint32_t j;
+
+    assert(ids && wt && v && load);
+
+    for (j = 0; j < n; j++) {
+        ids[j] = j + 1;
+        wt[j]  = 1 + j % 4;
+        tw    += wt[j];
+    }
+
+    // A weight of 0 leaves a node out
+    wt[0] = 0;
+    tw   -= 1;
+
+    map_keys(s, ids, wt, n, v);
+    for (i = 0; i < Nkeys; i++) load[v[i]]++;
+
+    assert(load[1] == 0);
+    for (j = 1; j < n; j++) {
+        double want = _d(Nkeys) * wt[j] / tw,
+               err  = fabs(_d(load[j+1]) - want) / want;
+
+        if (err > maxerr) maxerr = err;
+    }
+
+    printf("  %-10s %3u nodes, weights 1..4: worst share off by %.2f%%\n",
+           Names[s], n, 100.0 * maxerr);
+    assert(maxerr < (s == RING ? 0.35 : 0.1));
+
+    DEL(ids);
+    DEL(wt);
+    DEL(v);
+    DEL(load);
+}
+
+
+// The ring's binary search and the batch lookups
+static void
+test_lookups(uint32_t n)
+{
+    uint64_t *ids = NEWA(uint64_t, n);
+    uint32_t *o   = NEWA(uint32_t, Nkeys);
+    uint64_t edge[6];
+    hashring r;
+    maglev g;
+    hrw h;
+    size_t i;
+    uint32_t j, best[8];
+
+    assert(ids && o);
+    for (j = 0; j < n; j++) ids[j] = j + 1;
+
+    assert(hashring_init(&r, ids, 0, 0, VNODES) == -EINVAL);
+    assert(maglev_init(&g, ids, 0, n, 65536) == -EINVAL);
+    assert(maglev_init(&g, ids, 0, n, 7) == -EINVAL);
+    assert(hrw_init(&h, ids, 0, 0) == -EINVAL);
+
+    // Binary search vs. linear: first token >= key, wrapping around
+    assert(hashring_init(&r, ids, 0, n, VNODES) == 0);
+    for (j = 1; j < r.ntok; j++) assert(r.tok[j-1] <= r.tok[j]);
+
+    edge[0] = 0;
+    edge[1] = UINT64_MAX;
+    edge[2] = r.tok[0];
+    edge[3] = r.tok[r.ntok - 1];
+    edge[4] = r.tok[r.ntok - 1] + 1;
+    edge[5] = r.tok[r.ntok / 2] - 1;
+    for (i = 0; i < 10006; i++) {
+        uint64_t k = i < 6 ? edge[i] : Keys[i];
+        uint32_t x;
+
+        for (x = 0; x < r.ntok && r.tok[x] < k; x++) ;
+        assert(hashring_lookup(&r, k) == r.node[x == r.ntok ? 0 : x]);
+    }
+
+    hashring_lookup_v(&r, Keys, o, Nkeys - 3);
+    for (i = 0; i < Nkeys - 3; i++) assert(o[i] == hashring_lookup(&r, Keys[i]));
+    hashring_fini(&r);
+
+    jump_hash_v(Keys, o, Nkeys, n);
+    for (i = 0; i < Nkeys; i++) assert(o[i] == jump_hash(Keys[i], n));
+    for (i = 0; i < 1000; i++) assert(jump_hash(Keys[i], 1) == 0);
+
+    assert(maglev_init(&g, ids, 0, n, MAGLEV_M) == 0);
+    maglev_lookup_v(&g, Keys, o, Nkeys);
+    for (i = 0; i < Nkeys; i++) assert(o[i] == maglev_lookup(&g, Keys[i]));
+    maglev_fini(&g);
+
+    // The best of the k best is the lookup; the k are distinct
+    assert(hrw_init(&h, ids, 0, n) == 0);
+    for (i = 0; i < 10000; i++) {
+        uint32_t x, y;
+
+        assert(hrw_lookup_k(&h, Keys[i], best, 8) == 8);
+        assert(best[0] == hrw_lookup(&h, Keys[i]));
+        for (x = 0; x < 8; x++)
+            for (y = x + 1; y < 8; y++) assert(best[x] != best[y]);
+    }
+    assert(hrw_lookup_k(&h, Keys[0], best, 0) == 0);
+    hrw_fini(&h);
+
+    DEL(ids);
+    DEL(o);
+}
+
+
+static void
+perf_test(bench *b, uint32_t n)
+{
+    uint64_t *ids = NEWA(uint64_t, n);
+    char name[64];
+    hashring r;
+    maglev g;
+    hrw h;
+    size_t i;
+    uint32_t j;
+
+    assert(ids);
+    for (j = 0; j < n; j++) ids[j] = j + 1;
+
+#define LOOKUP(nm, nkeys, expr) do {                                \
+        snprintf(name, sizeof name, "%s/%u", nm, n);                \
+        bench_begin(b, name, nkeys);                                \
+        while (bench_next(b)) {                                     \
+            bench_start(b);                                         \
+            for (i = 0; i < nkeys; i++) Out[i] = expr;              \
+            bench_stop(b);                                          \
+        }                                                           \
+        bench_end(b);                                               \
+    } while (0)
+
+#define BATCH(nm, nkeys, stmt) do {                                 \
+        snprintf(name, sizeof name, "%s-batch/%u", nm, n);          \
+        bench_begin(b, name, nkeys);                                \
+        while (bench_next(b)) {                                     \
+            bench_start(b);                                         \
+            stmt;                                                   \
+            bench_stop(b);                                          \
+        }                                                           \
+        bench_end(b);                                               \
+    } while (0)
+
+    LOOKUP("modulo", Nkeys, (uint32_t)(Keys[i] % n));
+    LOOKUP("jump",   Nkeys, jump_hash(Keys[i], n));
+
+    assert(hashring_init(&r, ids, 0, n, VNODES) == 0);
+    LOOKUP("ring", Nkeys, hashring_lookup(&r, Keys[i]));
+    BATCH("ring",  Nkeys, hashring_lookup_v(&r, Keys, Out, Nkeys));
+    hashring_fini(&r);
+
+    assert(maglev_init(&g, ids, 0, n, MAGLEV_M) == 0);
+    LOOKUP("maglev", Nkeys, maglev_lookup(&g, Keys[i]));
+    BATCH("maglev",  Nkeys, maglev_lookup_v(&g, Keys, Out, Nkeys));
+    maglev_fini(&g);
+
+    assert(hrw_init(&h, ids, 0, n) == 0);
+    LOOKUP("rendezvous", Nkeys / 10, hrw_lookup(&h, Keys[i]));
+    hrw_fini(&h);
+
+    DEL(ids);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    uint32_t n = 100;
+    size_t i;
+    bench b;
+    int e, s;
+
+    program_name = argv[0];
+
+    Nkeys = NKEYS;
+    if (argc > 1) Nkeys = strtoul(argv[1], 0, 0);
+    if (argc > 2) n     = strtoul(argv[2], 0, 0);
+    if (Nkeys < 20000) Nkeys = 20000;
+    if (n < 3)         n     = 3;
+
+    Keys = NEWA(uint64_t, Nkeys);
+    Out  = NEWA(uint32_t, Nkeys);
+    assert(Keys && Out);
+
+    for (i = 0; i < Nkeys; i++) Keys[i] = fasthash64(&i, sizeof i, 0);
+
+    printf("%zu keys\n", Nkeys);
+    test_lookups(n);
+    for (s = 0; s < NSCHEMES; s++) test_moves(s, n);
+    test_weights(RING, n);
+    test_weights(MAGLEV, n);
+    test_weights(HRW, n);
+
+    if ((e = bench_init(&b, "t_shard", 0)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    perf_test(&b, n);
+    perf_test(&b, 10);
+    bench_fini(&b);
+
+    DEL(Keys);
+    DEL(Out);
+    return 0;
+}
+
+/* EOF */
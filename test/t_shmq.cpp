@@ -0,0 +1,565 @@
+/*
+ * Test for the shared memory inter-process queues.
+ *
+ * Usage: t_shmq [NPROCS]
+ *
+ * Checks put/get, full, empty and message sizes of SPSC and MPMC
+ * queues in one process; that attaching checks the header (magic,
+ * version) and that re-creating a queue in use fails; that dead
+ * peers are detected - a producer that exits without detaching or
+ * is killed - and a waiting consumer gets -EPIPE. Then passes messages from producer to consumer processes
+ * (1:1 SPSC, NPROCS:NPROCS MPMC) and checks each one arrives
+ * exactly once and in order per producer. Then benchmarks the
+ * handoff latency (ping-pong) and throughput between two processes
+ * against a Unix socketpair.
+ *
+ * The queues live in memfds opened through /proc/self/fd.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <vector>
+#include <string>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/shmq.h"
+#include "bench.h"
+
+using namespace std;
+using namespace putils;
+
+#define _d(x)   ((double)(x))
+
+#ifdef __MAKE_OPTIMIZE__
+#define NMSG        (1024 * 1024)
+#define NPING       (128 * 1024)
+#else
+#define NMSG        (64 * 1024)
+#define NPING       (16 * 1024)
+#endif
+
+#define MAXPROCS    16
+
+
+// A memfd and its name
+struct shmfile
+{
+    int    fd;
+    string fn;
+
+    shmfile()
+    {
+        char buf[64];
+
+        fd = ::memfd_create("t_shmq", 0);
+        if (fd < 0) error(1, errno, "can't make memfd");
+
+        snprintf(buf, sizeof buf, "/proc/self/fd/%d", fd);
+        fn = buf;
+    }
+
+    ~shmfile() { ::close(fd); }
+};
+
+
+static pid_t
+xfork()
+{
+    pid_t p = fork();
+
+    if (p < 0) error(1, errno, "can't fork");
+    return p;
+}
+
+
+static int
+xwait(pid_t p)
+{
+    int st = 0;
+
+    if (waitpid(p, &st, 0) < 0) error(1, errno, "can't wait for %d", p);
+    return st;
+}
+
+
+static void
+test_basic(unsigned int type)
+{
+    shmfile f;
+    shm_queue q(f.fn, type, 6, 32, SHMQ_PRODUCER | SHMQ_CONSUMER);
+    uint8_t buf[64];
+    uint64_t i, v;
+
+    assert(q.capacity() == 8);
+    assert(q.elsize()   == 32);
+    assert(q.type()     == type);
+    assert(q.size()     == 0);
+    assert(q.peers(SHMQ_PRODUCER) == 1);
+    assert(q.peers(SHMQ_CONSUMER) == 1);
+
+    assert(q.get(buf, sizeof buf) == -EAGAIN);
+    assert(q.get_wait(buf, sizeof buf, 0)  == -ETIMEDOUT);
+    assert(q.get_wait(buf, sizeof buf, 20) == -ETIMEDOUT);
+    assert(q.put(buf, 33) == -E2BIG);
+
+    // Fill, drain, twice around the ring
+    for (int k = 0; k < 3; k++) {
+        for (i = 0; i < 8; i++) {
+            v = i * 1000 + k;
+            assert(q.put(&v, sizeof v) == 0);
+        }
+        assert(q.size() == 8);
+        assert(q.put(&v, sizeof v) == -EAGAIN);
+        assert(q.put_wait(&v, sizeof v, 10) == -ETIMEDOUT);
+
+        for (i = 0; i < 8; i++) {
+            assert(q.get(&v, sizeof v) == sizeof v);
+            assert(v == i * 1000 + k);
+        }
+        assert(q.get(&v, sizeof v) == -EAGAIN);
+    }
+
+    // Sizes: empty, full, truncated
+    memset(buf, 0xa5, 32);
+    assert(q.put(buf, 0)  == 0);
+    assert(q.put(buf, 32) == 0);
+    assert(q.put(buf, 32) == 0);
+    assert(q.get(buf + 32, 32) == 0);
+    memset(buf + 32, 0, 32);
+    assert(q.get(buf + 32, 32) == 32);
+    assert(memcmp(buf, buf + 32, 32) == 0);
+    memset(buf + 32, 0, 32);
+    assert(q.get(buf + 32, 4) == 32);
+    assert(buf[32] == 0xa5 && buf[35] == 0xa5 && buf[36] == 0);
+
+    // A second attachment in this process sees the same queue
+    {
+        shm_queue q2(f.fn, SHMQ_CONSUMER);
+
+        assert(q2.capacity() == 8 && q2.elsize() == 32 && q2.type() == type);
+        assert(q.peers(SHMQ_CONSUMER)  == 2);
+        assert(q2.peers(SHMQ_CONSUMER) == 2);
+
+        v = 77;
+        assert(q.put(&v, sizeof v) == 0);
+        v = 0;
+        assert(q2.get(&v, sizeof v) == sizeof v && v == 77);
+    }
+    assert(q.peers(SHMQ_CONSUMER) == 1);
+}
+
+
+static bool
+attach_fails(const string& fn)
+{
+    try {
+        shm_queue q(fn, SHMQ_CONSUMER);
+    } catch (const sys_exception& ex) {
+        return ex.errcode() == EINVAL;
+    }
+    return false;
+}
+
+
+static void
+test_header()
+{
+    shmfile f;
+    uint32_t ver, bad = SHMQ_VERSION + 1;
+    uint64_t mag, zero = 0;
+
+    // Empty file
+    assert(attach_fails(f.fn));
+
+    shm_queue q(f.fn, SHMQ_SPSC, 16, 100, SHMQ_PRODUCER);
+
+    assert(q.capacity() == 16);
+
+    // Version
+    assert(pread(f.fd, &ver, sizeof ver, 8) == sizeof ver);
+    assert(ver == SHMQ_VERSION);
+    assert(pwrite(f.fd, &bad, sizeof bad, 8) == sizeof bad);
+    assert(attach_fails(f.fn));
+    assert(pwrite(f.fd, &ver, sizeof ver, 8) == sizeof ver);
+
+    // Magic
+    assert(pread(f.fd, &mag, sizeof mag, 0) == sizeof mag);
+    assert(pwrite(f.fd, &zero, sizeof zero, 0) == sizeof zero);
+    assert(attach_fails(f.fn));
+    assert(pwrite(f.fd, &mag, sizeof mag, 0) == sizeof mag);
+
+    shm_queue q2(f.fn, SHMQ_CONSUMER);
+    assert(q2.capacity() == 16 && q2.elsize() == 100);
+}
+
+
+static bool
+create_busy(const string& fn)
+{
+    try {
+        shm_queue q(fn, SHMQ_SPSC, 8, 8, SHMQ_PRODUCER);
+    } catch (const sys_exception& ex) {
+        return ex.errcode() == EBUSY;
+    }
+    return false;
+}
+
+
+// Re-creating a queue in use fails and leaves it alone
+static void
+test_recreate()
+{
+    shmfile f;
+    uint64_t v = 9;
+
+    {
+        shm_queue q(f.fn, SHMQ_SPSC, 16, 8, SHMQ_CONSUMER);
+        shm_queue p(f.fn, SHMQ_PRODUCER);
+
+        assert(p.put(&v, sizeof v) == 0);
+        assert(create_busy(f.fn));
+
+        v = 0;
+        assert(q.get(&v, sizeof v) == sizeof v && v == 9);
+        assert(q.capacity() == 16);
+    }
+
+    // Nobody attached
+    shm_queue q(f.fn, SHMQ_SPSC, 8, 8, SHMQ_CONSUMER);
+    assert(q.capacity() == 8);
+}
+
+
+/*
+ * A producer that exits without detaching, and one that is killed
+ * while attached.
+ */
+static void
+test_crash()
+{
+    shmfile f;
+    shm_queue q(f.fn, SHMQ_SPSC, 16, 8, SHMQ_CONSUMER);
+    uint64_t v = 0;
+    int pfd[2];
+    pid_t p;
+
+    p = xfork();
+    if (p == 0) {
+        shm_queue c(f.fn, SHMQ_PRODUCER);
+
+        v = 42;
+        c.put(&v, sizeof v);
+        _exit(0);
+    }
+    xwait(p);
+
+    assert(q.get_wait(&v, sizeof v, 1000) == sizeof v && v == 42);
+    assert(q.get_wait(&v, sizeof v, -1)   == -EPIPE);
+    assert(q.peers(SHMQ_PRODUCER) == 0);
+
+    if (pipe(pfd) < 0) error(1, errno, "can't make pipe");
+
+    p = xfork();
+    if (p == 0) {
+        shm_queue c(f.fn, SHMQ_PRODUCER);
+        char x = 1;
+
+        if (write(pfd[1], &x, 1) != 1) _exit(1);
+        for (;;) pause();
+    }
+
+    char x;
+    assert(read(pfd[0], &x, 1) == 1);
+    assert(q.peers(SHMQ_PRODUCER) == 1);
+    assert(q.get_wait(&v, sizeof v, 10) == -ETIMEDOUT);
+
+    kill(p, SIGKILL);
+    xwait(p);
+
+    assert(q.peers(SHMQ_PRODUCER) == 0);
+    assert(q.get_wait(&v, sizeof v, -1) == -EPIPE);
+
+    close(pfd[0]);
+    close(pfd[1]);
+}
+
+
+/*
+ * Messages are 'producer << 32 | seq'; a sequence number of ~0 is
+ * the end of the stream.
+ */
+#define ENDSEQ      0xffffffffULL
+
+struct tally
+{
+    uint64_t n;
+    uint64_t sum;
+};
+
+
+static void
+producer(const string& fn, uint64_t id, uint64_t n)
+{
+    shm_queue q(fn, SHMQ_PRODUCER);
+    uint64_t i, v;
+
+    for (i = 0; i < n; i++) {
+        v = (id << 32) | i;
+        if (q.put_wait(&v, sizeof v, -1) != 0) _exit(1);
+    }
+    _exit(0);
+}
+
+
+static void
+consumer(const string& fn, int wfd)
+{
+    shm_queue q(fn, SHMQ_CONSUMER);
+    uint64_t last[MAXPROCS];
+    tally t = { 0, 0 };
+    uint64_t v;
+
+    memset(last, 0xff, sizeof last);
+    for (;;) {
+        if (q.get_wait(&v, sizeof v, -1) != sizeof v) _exit(1);
+        if ((v & ENDSEQ) == ENDSEQ) break;
+
+        uint64_t id = v >> 32, seq = v & ENDSEQ;
+
+        // In order per producer
+        if (id >= MAXPROCS) _exit(2);
+        if (last[id] != ~0ULL && seq <= last[id]) _exit(3);
+
+        last[id] = seq;
+        t.n++;
+        t.sum += v;
+    }
+
+    if (write(wfd, &t, sizeof t) != sizeof t) _exit(4);
+    _exit(0);
+}
+
+
+static void
+test_mp(unsigned int type, int nprod, int ncons, uint64_t n)
+{
+    shmfile f;
+    shm_queue q(f.fn, type, 256, 8, SHMQ_PRODUCER);
+    vector<pid_t> prod, cons;
+    uint64_t want = 0, i;
+    tally all = { 0, 0 };
+    int pfd[2], k;
+
+    if (pipe(pfd) < 0) error(1, errno, "can't make pipe");
+
+    for (k = 0; k < ncons; k++) {
+        pid_t p = xfork();
+        if (p == 0) consumer(f.fn, pfd[1]);
+        cons.push_back(p);
+    }
+    for (k = 0; k < nprod; k++) {
+        pid_t p = xfork();
+        if (p == 0) producer(f.fn, uint64_t(k), n);
+        prod.push_back(p);
+    }
+
+    for (k = 0; k < nprod; k++) {
+        int st = xwait(prod[k]);
+        assert(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+        for (i = 0; i < n; i++) want += (uint64_t(k) << 32) | i;
+    }
+
+    for (k = 0; k < ncons; k++) {
+        uint64_t v = ENDSEQ;
+        assert(q.put_wait(&v, sizeof v, -1) == 0);
+    }
+
+    for (k = 0; k < ncons; k++) {
+        tally t;
+        int st = xwait(cons[k]);
+
+        assert(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+        assert(read(pfd[0], &t, sizeof t) == sizeof t);
+        all.n   += t.n;
+        all.sum += t.sum;
+    }
+
+    assert(all.n   == n * nprod);
+    assert(all.sum == want);
+    assert(q.size() == 0);
+
+    close(pfd[0]);
+    close(pfd[1]);
+}
+
+
+/*
+ * Ping-pong one message through a pair of queues (or a socketpair);
+ * half the round trip is the handoff latency.
+ */
+static void
+bench_pingpong(bench * b, uint64_t n)
+{
+    shmfile f1, f2;
+    shm_queue ping(f1.fn, SHMQ_SPSC, 64, 64, SHMQ_PRODUCER);
+    shm_queue pong(f2.fn, SHMQ_SPSC, 64, 64, SHMQ_CONSUMER);
+    vector<uint64_t> lat(n);
+    uint64_t i, v = 0, t0, t1;
+    int sv[2];
+    pid_t p;
+
+    p = xfork();
+    if (p == 0) {
+        shm_queue in(f1.fn, SHMQ_CONSUMER);
+        shm_queue out(f2.fn, SHMQ_PRODUCER);
+
+        for (i = 0; i < n; i++) {
+            if (in.get_wait(&v, sizeof v, -1) != sizeof v) _exit(1);
+            if (out.put_wait(&v, sizeof v, -1) != 0)       _exit(1);
+        }
+        _exit(0);
+    }
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) {
+        uint64_t s = bench_tsc();
+
+        assert(ping.put_wait(&i, sizeof i, -1) == 0);
+        assert(pong.get_wait(&v, sizeof v, -1) == sizeof v && v == i);
+        lat[i] = uint64_t(bench_ns(b, bench_tsc() - s) / 2);
+    }
+    t1 = timenow();
+    assert(xwait(p) == 0);
+    bench_add(b, "pingpong-shmq", n, _d(t1 - t0) * 500.0, &lat[0], n);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        error(1, errno, "can't make socketpair");
+
+    p = xfork();
+    if (p == 0) {
+        close(sv[0]);
+        for (i = 0; i < n; i++) {
+            if (read(sv[1], &v, sizeof v)  != sizeof v) _exit(1);
+            if (write(sv[1], &v, sizeof v) != sizeof v) _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(sv[1]);
+    t0 = timenow();
+    for (i = 0; i < n; i++) {
+        uint64_t s = bench_tsc();
+
+        assert(write(sv[0], &i, sizeof i) == sizeof i);
+        assert(read(sv[0], &v, sizeof v)  == sizeof v && v == i);
+        lat[i] = uint64_t(bench_ns(b, bench_tsc() - s) / 2);
+    }
+    t1 = timenow();
+    assert(xwait(p) == 0);
+    bench_add(b, "pingpong-socketpair", n, _d(t1 - t0) * 500.0, &lat[0], n);
+    close(sv[0]);
+}
+
+
+/*
+ * Stream 'n' messages of 'sz' bytes to another process.
+ */
+static void
+bench_stream(bench * b, uint64_t n, size_t sz)
+{
+    shmfile f;
+    shm_queue q(f.fn, SHMQ_SPSC, 1024, uint32_t(sz), SHMQ_PRODUCER);
+    vector<uint8_t> buf(sz, 0x5a);
+    uint64_t i, t0, t1;
+    char name[64];
+    int sv[2];
+    pid_t p;
+
+    p = xfork();
+    if (p == 0) {
+        shm_queue c(f.fn, SHMQ_CONSUMER);
+
+        for (i = 0; i < n; i++)
+            if (c.get_wait(&buf[0], sz, -1) != ssize_t(sz)) _exit(1);
+        _exit(0);
+    }
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) assert(q.put_wait(&buf[0], sz, -1) == 0);
+    assert(xwait(p) == 0);
+    t1 = timenow();
+
+    snprintf(name, sizeof name, "stream-shmq-%zu", sz);
+    bench_bytes(b, n * sz);
+    bench_add(b, name, n, _d(t1 - t0) * 1000.0, 0, 0);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+        error(1, errno, "can't make socketpair");
+
+    p = xfork();
+    if (p == 0) {
+        close(sv[0]);
+        for (i = 0; i < n; i++)
+            if (read(sv[1], &buf[0], sz) != ssize_t(sz)) _exit(1);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    t0 = timenow();
+    for (i = 0; i < n; i++) assert(write(sv[0], &buf[0], sz) == ssize_t(sz));
+    assert(xwait(p) == 0);
+    t1 = timenow();
+    close(sv[0]);
+
+    snprintf(name, sizeof name, "stream-socketpair-%zu", sz);
+    bench_bytes(b, n * sz);
+    bench_add(b, name, n, _d(t1 - t0) * 1000.0, 0, 0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int nproc = sys_cpu_getavail();
+    bench b;
+    int e;
+
+    program_name = argv[0];
+
+    if (argc > 1) nproc = atoi(argv[1]);
+    if (nproc < 2)        nproc = 2;
+    if (nproc > MAXPROCS) nproc = MAXPROCS;
+
+    test_basic(SHMQ_SPSC);
+    test_basic(SHMQ_MPMC);
+    test_header();
+    test_recreate();
+    test_crash();
+
+    test_mp(SHMQ_SPSC, 1, 1, NMSG);
+    test_mp(SHMQ_MPMC, nproc, nproc, NMSG / nproc);
+
+    if ((e = bench_init(&b, "t_shmq", BENCH_NOPIN)) < 0)
+        error(1, -e, "Can't initialize benchmarks");
+
+    bench_pingpong(&b, NPING);
+    bench_stream(&b, NMSG, 64);
+    bench_stream(&b, NMSG / 16, 4096);
+    bench_fini(&b);
+    return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * Test for parallel zbuf compression and decompression.
+ *
+ * (c) 2016 Sudhi Herle <sudhi-at-herle.net>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "error.h"
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "zlib/zbuf.h"
+
+
+extern uint32_t arc4random(void);
+extern void     arc4random_buf(void *, size_t);
+
+#define _d(x)   ((double)(x))
+
+
+/*
+ * Growable output sink for the zbuf output processor.
+ */
+struct sink
+{
+    uint8_t* buf;
+    size_t   len;
+    size_t   cap;
+};
+typedef struct sink sink;
+
+
+static int
+sink_out(void* opaq, void* buf, int len)
+{
+    sink* s = (sink*)opaq;
+
+    if ((s->len + len) > s->cap) {
+        s->cap = 2 * (s->len + len);
+        s->buf = RENEWA(uint8_t, s->buf, s->cap);
+        assert(s->buf);
+    }
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    return len;
+}
+
+
+/*
+ * Make compressible input: runs of words with some random noise.
+ */
+static uint8_t*
+mkinput(size_t n)
+{
+    static const char* words[] = { "alpha ", "bravo ", "charlie ", "delta ",
+                                   "echo ", "foxtrot ", "golf ", "hotel\n" };
+    uint8_t* p = NEWA(uint8_t, n);
+    size_t i   = 0;
+
+    assert(p);
+    while (i < n) {
+        uint32_t r = arc4random();
+        const char* w = words[r % ARRAY_SIZE(words)];
+        size_t k = strlen(w);
+
+        if (k > (n - i)) k = n - i;
+        memcpy(p+i, w, k);
+        i += k;
+
+        if ((r >> 24) == 0 && i < n) p[i++] = (uint8_t)(r >> 8);
+    }
+    return p;
+}
+
+
+/*
+ * Inflate a single zlib/gzip stream serially using 'wbits'.
+ */
+static void
+inflate_all(const uint8_t* in, size_t inlen, uint8_t* out, size_t outlen, int wbits)
+{
+    z_stream zs;
+    int r;
+
+    memset(&zs, 0, sizeof zs);
+    r = inflateInit2(&zs, wbits);
+    assert(r == Z_OK);
+
+    zs.next_in   = (Bytef*)in;
+    zs.avail_in  = inlen;
+    zs.next_out  = out;
+    zs.avail_out = outlen;
+
+    r = inflate(&zs, Z_FINISH);
+    if (r != Z_STREAM_END) error(1, 0, "inflate wbits=%d: err %d", wbits, r);
+    if (zs.total_out != outlen) error(1, 0, "inflate: exp %zu, saw %lu", outlen, zs.total_out);
+    inflateEnd(&zs);
+}
+
+
+static void
+roundtrip(const uint8_t* in, size_t n, int format, int nthr, int lev)
+{
+    z_par_opt o = { lev, nthr, format, 64 * 1024 };
+    z_buf_context zc;
+    sink c = { 0, 0, 0 };
+    sink u = { 0, 0, 0 };
+    uint8_t* out = NEWA(uint8_t, n+1);
+    int r;
+
+    z_buf_context_init(&zc, 0, 0, sink_out, &c);
+    r = z_buf_par_compress(&zc, &o, in, n);
+    if (r != Z_OK) error(1, 0, "par-compress fmt %d: err %d", format, r);
+    assert(z_buf_context_total_in(&zc) == n);
+    assert(z_buf_context_total_out(&zc) == c.len);
+
+    switch (format) {
+        case Z_PAR_ZLIB:
+            inflate_all(c.buf, c.len, out, n, 15);
+            break;
+
+        case Z_PAR_GZIP:
+            inflate_all(c.buf, c.len, out, n, 15+16);
+            break;
+
+        case Z_PAR_MEMBERS:
+            z_buf_context_init(&zc, 0, 0, sink_out, &u);
+            r = z_buf_par_uncompress(&zc, nthr, c.buf, c.len);
+            if (r != Z_OK) error(1, 0, "par-uncompress: err %d", r);
+            if (u.len != n) error(1, 0, "par-uncompress: exp %zu, saw %zu", n, u.len);
+            memcpy(out, u.buf, n);
+
+            /* Damage one byte; must be caught */
+            if (c.len > 64) {
+                u.len = 0;
+                c.buf[c.len / 2] ^= 0x5a;
+                r = z_buf_par_uncompress(&zc, nthr, c.buf, c.len);
+                assert(r != Z_OK);
+            }
+            break;
+    }
+
+    if (0 != memcmp(in, out, n)) error(1, 0, "fmt %d: roundtrip mismatch", format);
+
+    // Level 0 stores
+    if (lev == 0) assert(c.len > n);
+
+    printf("fmt %d, level %d, %zu bytes => %zu bytes, %d threads: OK\n", format, lev, n,
+           c.len, nthr);
+
+    DEL(c.buf);
+    DEL(u.buf);
+    DEL(out);
+}
+
+
+/*
+ * Window provider that hands out consecutive 'step' sized slices of
+ * a flat buffer -- the moral equivalent of an iovec ring.
+ */
+struct slices
+{
+    uint8_t* buf;
+    size_t   cap;
+    size_t   off;
+    size_t   step;
+};
+typedef struct slices slices;
+
+
+static int
+slice_window(void* opaq, z_window* w, uInt used, int last)
+{
+    slices* s = (slices*)opaq;
+    size_t n;
+
+    s->off += used;
+    if (last) return 0;
+
+    n = s->cap - s->off;
+    if (n == 0) return -1;
+    if (n > s->step) n = s->step;
+
+    w->buf  = s->buf + s->off;
+    w->size = n;
+    return 0;
+}
+
+
+static void
+zc_roundtrip(z_stream_pool* pool, const uint8_t* in, size_t n, int lev)
+{
+    size_t cap   = compressBound(n) + 64;
+    slices c     = { NEWA(uint8_t, cap), cap, 0, 4096 };
+    slices u     = { NEWA(uint8_t, n+1), n+1, 0, 3000 };
+    uint8_t* out = NEWA(uint8_t, n+1);
+    z_zc_context zc;
+    size_t outlen = 0;
+    int r;
+
+    r = z_zc_compress_init(&zc, pool, lev, 15, slice_window, &c);
+    assert(r == Z_OK);
+    r = z_zc_compress(&zc, in, n);      assert(r == Z_OK);
+    r = z_zc_compress_end(&zc);         assert(r == Z_OK);
+
+    /* Level 0 stores */
+    if (lev == 0) assert(c.off >= n);
+
+    /* Streaming inflate into windows; feed input in odd sized pieces */
+    r = z_zc_uncompress_init(&zc, pool, 15, slice_window, &u);
+    assert(r == Z_OK);
+    for (size_t i = 0; i < c.off; i += 777) {
+        size_t k = (c.off - i) > 777 ? 777 : c.off - i;
+        r = z_zc_uncompress(&zc, c.buf+i, k);
+        assert(r == Z_OK || r == Z_STREAM_END);
+    }
+    r = z_zc_uncompress_end(&zc);
+    if (r != Z_OK) error(1, 0, "zc-uncompress %zu bytes: err %d", n, r);
+    if (u.off != n || 0 != memcmp(in, u.buf, n)) error(1, 0, "zc-uncompress %zu bytes: mismatch", n);
+
+    /* One shot inflate into a flat region */
+    r = z_zc_uncompress_into(pool, 15, c.buf, c.off, out, n, &outlen);
+    if (r != Z_OK) error(1, 0, "zc-uncompress-into %zu bytes: err %d", n, r);
+    if (outlen != n || 0 != memcmp(in, out, n)) error(1, 0, "zc-uncompress-into %zu bytes: mismatch", n);
+
+    /* Too small a region must be reported */
+    if (n > 1) {
+        r = z_zc_uncompress_into(pool, 15, c.buf, c.off, out, n-1, &outlen);
+        assert(r == Z_BUF_ERROR);
+        assert(outlen == n-1);
+    }
+
+    /* Truncated input must be reported */
+    if (c.off > 8) {
+        r = z_zc_uncompress_into(pool, 15, c.buf, c.off-8, out, n, &outlen);
+        assert(r == Z_DATA_ERROR);
+    }
+
+    printf("zero-copy %zu bytes, level %d => %zu bytes: OK\n", n, lev, c.off);
+
+    DEL(c.buf);
+    DEL(u.buf);
+    DEL(out);
+}
+
+
+/*
+ * Compress into a mmap'd file and inflate that straight into a
+ * mmap'd destination.
+ */
+static void
+zc_mmap_test(z_stream_pool* pool, const uint8_t* in, size_t n)
+{
+    char zfn[] = "/tmp/t_zbuf_XXXXXX";
+    char ufn[] = "/tmp/t_zbuf_XXXXXX";
+    int zfd    = mkstemp(zfn);
+    int ufd    = mkstemp(ufn);
+    z_mmap_sink sink;
+    z_zc_context zc;
+    size_t outlen = 0;
+    off_t zlen;
+    void *zm, *um;
+    int r;
+
+    if (zfd < 0 || ufd < 0) error(1, errno, "can't make temp files");
+    unlink(zfn);
+    unlink(ufn);
+
+    r = z_mmap_sink_init(&sink, zfd, 0, 8192);
+    assert(r == 0);
+    r = z_zc_compress_init(&zc, pool, 6, 15+16, z_mmap_sink_window, &sink);
+    assert(r == Z_OK);
+    r = z_zc_compress(&zc, in, n);      assert(r == Z_OK);
+    r = z_zc_compress_end(&zc);         assert(r == Z_OK);
+
+    zlen = lseek(zfd, 0, SEEK_END);
+    assert(zlen == sink.off);
+
+    if (ftruncate(ufd, n) < 0) error(1, errno, "can't truncate %s", ufn);
+
+    zm = mmap(0, zlen, PROT_READ, MAP_SHARED, zfd, 0);
+    um = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, ufd, 0);
+    assert(zm != MAP_FAILED && um != MAP_FAILED);
+
+    r = z_zc_uncompress_into(pool, 15+32, zm, zlen, um, n, &outlen);
+    if (r != Z_OK) error(1, 0, "mmap uncompress: err %d", r);
+    if (outlen != n || 0 != memcmp(in, um, n)) error(1, 0, "mmap uncompress: mismatch");
+
+    printf("mmap sink %zu bytes => %zu bytes: OK\n", n, (size_t)zlen);
+
+    munmap(zm, zlen);
+    munmap(um, n);
+    close(zfd);
+    close(ufd);
+}
+
+
+/*
+ * A mmap sink that can't map its window (the fd is write only)
+ * must fail and leave the file at the output so far.
+ */
+static void
+zc_mmap_fail_test(z_stream_pool* pool)
+{
+    char zfn[] = "/tmp/t_zbuf_XXXXXX";
+    int tfd    = mkstemp(zfn);
+    int zfd    = open(zfn, O_WRONLY);
+    uint8_t hdr[100];
+    z_mmap_sink sink;
+    z_zc_context zc;
+    int r;
+
+    if (tfd < 0 || zfd < 0) error(1, errno, "can't make temp file");
+    unlink(zfn);
+    close(tfd);
+
+    memset(hdr, 'h', sizeof hdr);
+    if (write(zfd, hdr, sizeof hdr) != sizeof hdr) error(1, errno, "can't write %s", zfn);
+
+    r = z_mmap_sink_init(&sink, zfd, sizeof hdr, 8192);
+    assert(r == 0);
+    r = z_zc_compress_init(&zc, pool, 6, 15, z_mmap_sink_window, &sink);
+    assert(r == Z_MEM_ERROR);
+
+    assert(sink.map == 0);
+    assert(lseek(zfd, 0, SEEK_END) == sizeof hdr);
+
+    printf("mmap sink without a window: OK\n");
+    close(zfd);
+}
+
+
+/*
+ * Classic zbuf: deflate into a private buffer, then copy into the
+ * destination. Counts the bytes copied.
+ */
+static size_t Copied = 0;
+
+static int
+copy_out(void* opaq, void* buf, int len)
+{
+    Copied += len;
+    return sink_out(opaq, buf, len);
+}
+
+
+/*
+ * Compare the copying z_buf interface to the zero-copy windows.
+ */
+static void
+zc_perf_test(const uint8_t* in, size_t n)
+{
+    static uint8_t obuf[65536];
+    size_t cap = compressBound(n) + 64;
+    z_stream_pool* pool = z_stream_pool_new(2);
+    sink c     = { NEWA(uint8_t, cap), 0, cap };
+    slices s   = { NEWA(uint8_t, cap), cap, 0, 65536 };
+    z_buf_context zb;
+    z_zc_context zc;
+    uint64_t t0, t1, t2, t3, t4;
+    int i;
+
+    Copied = 0;
+    z_buf_context_init(&zb, obuf, sizeof obuf, copy_out, &c);
+    t0 = timenow();
+    z_buf_compress_init(&zb, 1, 15);
+    z_buf_compress(&zb, (void*)in, n);
+    z_buf_compress_end(&zb);
+    t1 = timenow();
+
+    z_zc_compress_init(&zc, pool, 1, 15, slice_window, &s);
+    z_zc_compress(&zc, in, n);
+    z_zc_compress_end(&zc);
+    t2 = timenow();
+
+    assert(s.off == c.len);
+
+    printf("\nZero-copy compression of %zu MB:\n", n >> 20);
+    printf("  z_buf:    %8.2f MB/s, %zu bytes copied\n", _d(n) / _d(t1 - t0), Copied);
+    printf("  z_zc:     %8.2f MB/s, 0 bytes copied\n", _d(n) / _d(t2 - t1));
+
+    /* Many small streams: pooled streams skip deflateInit() */
+    t2 = timenow();
+    for (i = 0; i < 1000; i++) {
+        z_stream* zs = NEWZ(z_stream);
+        deflateInit2(zs, 1, Z_DEFLATED, 15, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+        deflateEnd(zs);
+        DEL(zs);
+    }
+    t3 = timenow();
+    for (i = 0; i < 1000; i++) {
+        z_stream* zs = z_stream_pool_deflate(pool, 1, 15);
+        z_stream_pool_put(pool, zs);
+    }
+    t4 = timenow();
+    printf("  stream setup: init %.2f us, pool %.2f us\n",
+            _d(t3 - t2) / 1000.0, _d(t4 - t3) / 1000.0);
+
+    z_stream_pool_delete(pool);
+    DEL(c.buf);
+    DEL(s.buf);
+}
+
+
+/*
+ * Measure MB/s scaling with thread count.
+ */
+static void
+perf_test(const uint8_t* in, size_t n)
+{
+    int ncpu = sys_cpu_getavail();
+    int t;
+
+    printf("\nParallel compression of %zu MB:\n", n >> 20);
+    for (t = 1; t <= ncpu; t = (t < ncpu && 2*t > ncpu) ? ncpu : 2*t) {
+        z_par_opt o = { 6, t, Z_PAR_MEMBERS, 0 };
+        z_buf_context zc;
+        sink c = { 0, 0, 0 };
+        sink u = { 0, 0, 0 };
+        uint64_t t0, t1, t2;
+
+        z_buf_context_init(&zc, 0, 0, sink_out, &c);
+        t0 = timenow();
+        z_buf_par_compress(&zc, &o, in, n);
+        t1 = timenow();
+
+        z_buf_context_init(&zc, 0, 0, sink_out, &u);
+        z_buf_par_uncompress(&zc, t, c.buf, c.len);
+        t2 = timenow();
+
+        printf("  %2d threads: deflate %8.2f MB/s, inflate %8.2f MB/s\n", t,
+                _d(n) / _d(t1 - t0), _d(n) / _d(t2 - t1));
+
+        DEL(c.buf);
+        DEL(u.buf);
+    }
+}
+
+
+int
+main(int argc, const char* argv[])
+{
+    size_t sizes[] = { 0, 1, 1000, 32768, 65536, 65537, 1000003 };
+    int formats[]  = { Z_PAR_ZLIB, Z_PAR_GZIP, Z_PAR_MEMBERS };
+    size_t i, j;
+    uint8_t* in;
+
+    USEARG(argc);
+    program_name = argv[0];
+
+    in = mkinput(sizes[ARRAY_SIZE(sizes)-1]);
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+            roundtrip(in, sizes[j], formats[i], 1, 6);
+            roundtrip(in, sizes[j], formats[i], 4, 6);
+        }
+        roundtrip(in, sizes[ARRAY_SIZE(sizes)-1], formats[i], 4, 0);
+    }
+
+    z_stream_pool* pool = z_stream_pool_new(4);
+    for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+        zc_roundtrip(pool, in, sizes[j], 6);
+    }
+    zc_roundtrip(pool, in, sizes[ARRAY_SIZE(sizes)-1], 0);
+    zc_mmap_test(pool, in, sizes[ARRAY_SIZE(sizes)-1]);
+    zc_mmap_fail_test(pool);
+    z_stream_pool_delete(pool);
+    DEL(in);
+
+#ifdef __MAKE_OPTIMIZE__
+    size_t n = 256 * 1048576;
+#else
+    size_t n = 16 * 1048576;
+#endif
+
+    in = mkinput(n);
+    perf_test(in, n);
+    zc_perf_test(in, n);
+    DEL(in);
+
+    return 0;
+}
+
+/* EOF */